@@ -40,8 +40,8 @@
 #define SECTSIZE	512
 #define ELFHDR		((elfhdr *) 0x10000) // scratch space
 
-void readsect(void*, uint32_t);
-void readseg(uint32_t, uint32_t, uint32_t);
+static void readsects(void*, uint32_t, uint32_t);
+static void readseg(uint32_t, uint32_t, uint32_t);
 
 void
 bootmain(void)
@@ -74,31 +74,32 @@ bad:
 
 // Read 'count' bytes at 'offset' from kernel into virtual address 'va'.
 // Might copy more than asked
-void
+static void
 readseg(uint32_t va, uint32_t count, uint32_t offset)
 {
-	uint32_t end_va;
+	uint32_t nsect, n;
 
 	va &= 0xFFFFFF;
-	end_va = va + count;
 	
-	// round down to sector boundary
+	// round down to sector boundary, and count whole sectors
+	nsect = (count + (va & (SECTSIZE - 1)) + SECTSIZE - 1) / SECTSIZE;
 	va &= ~(SECTSIZE - 1);
 
 	// translate from bytes to sectors, and kernel starts at sector 1
 	offset = (offset / SECTSIZE) + 1;
 
-	// If this is too slow, we could read lots of sectors at a time.
+	// Read as many sectors at a time as one disk command allows.
 	// We'd write more to memory than asked, but it doesn't matter --
 	// we load in increasing order.
-	while (va < end_va) {
-		readsect((uint8_t*) va, offset);
-		va += SECTSIZE;
-		offset++;
+	for (; nsect > 0; nsect -= n) {
+		n = nsect < 256 ? nsect : 256;
+		readsects((uint8_t*) va, offset, n);
+		va += n * SECTSIZE;
+		offset += n;
 	}
 }
 
-void
+static void
 waitdisk(void)
 {
 	// wait for disk reaady
@@ -106,23 +107,25 @@ waitdisk(void)
 		/* do nothing */;
 }
 
-void
-readsect(void *dst, uint32_t offset)
+// Read 'n' sectors (1 to 256) starting at sector 'offset' into 'dst'.
+static void
+readsects(void *dst, uint32_t offset, uint32_t n)
 {
 	// wait for disk to be ready
 	waitdisk();
 
-	outb(0x1F2, 1);		// count = 1
+	outb(0x1F2, n);		// count, 0 meaning 256
 	outb(0x1F3, offset);
 	outb(0x1F4, offset >> 8);
 	outb(0x1F5, offset >> 16);
 	outb(0x1F6, (offset >> 24) | 0xE0);
 	outb(0x1F7, 0x20);	// cmd 0x20 - read sectors
 
-	// wait for disk to be ready
-	waitdisk();
-
-	// read a sector
-	insl(0x1F0, dst, SECTSIZE/4);
+	// read each sector once the disk has it ready
+	// (it's busy again after we read each one until the next is)
+	for (; n > 0; n--) {
+		waitdisk();
+		insl(0x1F0, dst, SECTSIZE/4);
+		dst += SECTSIZE;
+	}
 }
-
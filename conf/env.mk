@@ -18,3 +18,53 @@ V = @
 # following line and set it to the full path to QEMU.
 #
 # QEMU=
+
+# Kernel spinlock options (see kern/spinlock.h).  Ticket locks are the
+# default; uncomment one of these to use MCS queue locks or the original
+# test-and-set locks, and/or to drop per-acquire call-stack capture.
+#
+# DEFS += -DSPINLOCK_MCS
+# DEFS += -DSPINLOCK_TAS
+# DEFS += -DSPINLOCK_LEAN
+
+# For a fast production boot, skip the kernel's boot-time self-checks
+# (mem_check(), pmap_check(), etc.; see kern/init.h).
+# 'make ktest' still builds a test kernel that runs them all.
+#
+# DEFS += -DPIOS_FASTBOOT
+
+# Scheduling timer interrupts per second (see dev/lapic.h; default 100).
+#
+# DEFS += -DHZ=1000
+
+# Size of the e100 network card's receive ring (default 64 slots).
+#
+# DEFS += -DE100_RX_SLOTS=128
+
+# How device IRQs are steered to CPUs (see dev/ioapic.h):
+# 1 (default) spreads them over the CPUs with the fewest IRQs so far,
+# 0 lets the I/O APIC send each to the lowest-priority CPU.
+#
+# DEFS += -DIOAPIC_ROUTE=0
+
+# Whether big SYS_MERGE operations get help from idle CPUs
+# (see pmap_merge() in kern/pmap.c): 1 (default) or 0.
+#
+# DEFS += -DPMAP_MERGEPAR=0
+
+# Drop one in every N network packets received, to exercise and measure
+# retransmission (see kern/net.h and user/migrbench.c; default 0, none).
+#
+# DEFS += -DNET_LOSS=50
+
+# Whether received network packets are spread over per-CPU queues,
+# by source node or requested page, and processed outside the card's
+# interrupt (see net_rxsteer() in kern/net.c): 1 (default) or 0 for inline.
+#
+# DEFS += -DNET_RXSTEER=0
+
+# Whether the kernel's cprintf() and warn() output is buffered in per-CPU
+# rings and written out by idle CPUs (see kern/cons.c): 1 (default) or 0
+# to write it all synchronously.  panic() output is always synchronous.
+#
+# DEFS += -DCONS_LOG=0
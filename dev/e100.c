@@ -26,14 +26,31 @@
 bool e100_present;
 uint8_t e100_irq;
 
+static net_dev e100_netdev = {
+	.name	= "e100",
+	.txref	= e100_txref,
+	.intr	= e100_intr,
+	.poll	= e100_poll,
+	.maxpkt	= NET_MAXPKT,
+};
+
 #define E100_TX_SLOTS			64
-#define E100_RX_SLOTS			64
+#ifndef E100_RX_SLOTS
+#define E100_RX_SLOTS			64	// Default receive ring size
+#endif
+#define E100_RX_MAXSLOTS		512	// Largest ring we'll allocate
+#define E100_RX_BUDGET			64	// Max packets per poll
+#define E100_RX_BATCH			16	// Max packets claimed at once
+
+// Receive ring size: may be set before e100_attach() runs at boot.
+int e100_rxslots = E100_RX_SLOTS;
 
 #define E100_NULL			0xffffffff
 #define E100_SIZE_MASK			0x3fff	// mask out status/control bits
 
 #define	E100_CSR_SCB_STATACK		0x01	// scb_statack (1 byte)
 #define	E100_CSR_SCB_COMMAND		0x02	// scb_command (1 byte)
+#define	E100_CSR_SCB_INTMASK		0x03	// scb_intmask (1 byte)
 #define	E100_CSR_SCB_GENERAL		0x04	// scb_general (4 bytes)
 #define	E100_CSR_PORT			0x08	// port (4 bytes)
 #define E100_CSR_EEPROM			0x0e	// EEPROM control reg (1 byte)
@@ -46,6 +63,8 @@ uint8_t e100_irq;
 #define E100_SCB_COMMAND_RU_START	1
 #define E100_SCB_COMMAND_RU_RESUME	2
 
+#define E100_SCB_INTMASK_M		0x01	// mask all interrupts
+
 #define E100_SCB_STATACK_RNR		0x10
 #define E100_SCB_STATACK_CNA		0x20
 #define E100_SCB_STATACK_FR		0x40
@@ -113,10 +132,15 @@ struct e100_rbd {
 	volatile uint16_t rbd_pad1;
 };
 
+// In flexible mode a packet is gathered from up to two TBDs:
+// the header, or whole packet if copied, from buf,
+// and optionally a body sent straight from a page we hold a reference to.
+// Cards with extended TCBs look for both TBDs right after the TCB,
+// others at tbd_array_addr, which points to the same place.
 struct e100_tx_slot {
 	struct e100_cb_tx tcb;	// Transmit command block
-	struct e100_tbd tbd;	// Transmit buffer descriptor
-	struct e100_tbd unused;	// Some cards require a second "Extended TBD"
+	struct e100_tbd tbd[2];	// Transmit buffer descriptors
+	struct pageinfo *pi;	// Page holding zero-copy body, to release
 	char buf[NET_MAXPKT];	// Buffer
 };
 
@@ -134,10 +158,12 @@ static struct {
 	int tx_tail;	// Next slot e100 should transmit and mark complete
 	char tx_idle;
 
-	struct e100_rx_slot rx[E100_RX_SLOTS];
+	struct e100_rx_slot *rx;	// Receive ring, allocated at attach
+	int rx_slots;	// Number of slots in the receive ring
 	int rx_head;	// Next slot e100 should receive into and mark complete
 	int rx_tail;	// Last slot e100 can use before it must suspend
 	char rx_idle;
+	char polling;	// Interrupts masked while we drain the ring
 
 	int eebits;
 	union {
@@ -193,37 +219,67 @@ static void e100_tx_start(void)
 	}
 }
 
+// Transmit a packet, copying both header and body into a transmit buffer.
 int e100_tx(void *hdr, int hlen, void *body, int blen)
+{
+	return e100_txref(hdr, hlen, body, blen, NULL);
+}
+
+// Transmit a packet whose body lies within page pi, if pi isn't NULL.
+// The header is copied, since it's usually on the caller's stack,
+// but the card fetches the body directly from the page:
+// we hold a reference to pi until the transmit completes.
+int e100_txref(void *hdr, int hlen, void *body, int blen, pageinfo *pi)
 {
 	assert(hlen + blen <= NET_MAXPKT);
 	int i;
 
 	//cprintf("e100_tx: hdr %d body %d tot %d\n", hlen, blen, hlen+blen);
 
+	// Tiny packets get padded to Ethernet's 64-byte minimum in buf,
+	// so aren't worth sending by reference.
+	if (hlen + blen < 64)
+		pi = NULL;
+	assert(pi == NULL || (mem_ptr2pi(body) == pi
+			&& mem_ptr2pi(body + blen - 1) == pi));
+
 	spinlock_acquire(&e100.lock);
 
 	if (e100.tx_head - e100.tx_tail == E100_TX_SLOTS) {
 		warn("e100_tx: no transmit buffers");
+		net_statinc(txfull);
 		spinlock_release(&e100.lock);
 		return 0;
 	}
 
 	i = e100.tx_head % E100_TX_SLOTS;
+	struct e100_tx_slot *tx = &e100.tx[i];
+	assert(tx->pi == NULL);
+
+	// Copy the packet header, and the body unless it's by reference,
+	// into the transmit buffer.
+	memcpy(tx->buf, hdr, hlen);
+	tx->tbd[0].tb_addr = mem_phys(tx->buf);
+	if (pi != NULL) {
+		mem_incref(pi);
+		tx->pi = pi;
+		tx->tbd[0].tb_size = hlen;
+		tx->tbd[1].tb_addr = mem_phys(body);
+		tx->tbd[1].tb_size = blen;
+		tx->tcb.tbd_number = 2;
+	} else {
+		memcpy(tx->buf+hlen, body, blen);
 
-	// Copy the packet header and body into the transmit buffer
-	memcpy(e100.tx[i].buf, hdr, hlen);
-	memcpy(e100.tx[i].buf+hlen, body, blen);
-
-	// Compute the total packet length,
-	// accounting for Ethernet's 64-byte minimum.
-	// XXX include the 4-byte trailing CRC.
-	int len = MAX(hlen + blen, 64);
+		// Compute the total packet length,
+		// accounting for Ethernet's 64-byte minimum.
+		// XXX include the 4-byte trailing CRC.
+		tx->tbd[0].tb_size = MAX(hlen + blen, 64);
+		tx->tcb.tbd_number = 1;
+	}
 
 	// Set up the transmit command block
-	e100.tx[i].tbd.tb_addr = mem_phys(e100.tx[i].buf);
-	e100.tx[i].tbd.tb_size = len;
-	e100.tx[i].tcb.cb_status = 0;
-	e100.tx[i].tcb.cb_command = E100_CB_COMMAND_XMIT
+	tx->tcb.cb_status = 0;
+	tx->tcb.cb_command = E100_CB_COMMAND_XMIT
 		| E100_CB_COMMAND_SF | E100_CB_COMMAND_I | E100_CB_COMMAND_S;
 	e100.tx_head++;
 
@@ -237,7 +293,7 @@ static void e100_rx_start(void)
 {
 	assert(spinlock_holding(&e100.lock));
 
-	int i = e100.rx_head % E100_RX_SLOTS;
+	int i = e100.rx_head % e100.rx_slots;
 	if (e100.rx[i].rfd.status & E100_RFA_STATUS_C)
 		return;		// We haven't finished processing this RFD.
 
@@ -257,70 +313,137 @@ static void e100_intr_tx(void)
 {
 	int i;
 
-	// Bump tx_tail past all transmit commands that have completed
+	// Bump tx_tail past all transmit commands that have completed,
+	// releasing the pages that zero-copy packets were sent from.
 	for (; e100.tx_head != e100.tx_tail; e100.tx_tail++) {
 		i = e100.tx_tail % E100_TX_SLOTS;
 		if (!(e100.tx[i].tcb.cb_status & E100_CB_STATUS_C))
 			break;
+		if (e100.tx[i].pi != NULL) {
+			mem_decref(e100.tx[i].pi, mem_free);
+			e100.tx[i].pi = NULL;
+		}
 	}
 }
 
-static void e100_intr_rx(void)
+// Dispatch up to 'budget' newly-filled receive buffers
+// to the kernel's network protocol stack, returning how many we handled.
+static int e100_intr_rx(int budget)
 {
 	assert(spinlock_holding(&e100.lock));
 
-	int *count;
-	int i;
+	int i, n, done = 0;
 
-	// Dispatch newly-filled receive buffers
-	// to the kernel's network protocol stack.
 	// The network stack might transmit during this upcall,
-	// so we have to release and reacquire the e100.lock in the loop.
+	// so we have to release and reacquire the e100.lock in the loop,
+	// but we claim a batch of RFDs at a time to do so less often.
 	// We use the RFD's E100_RFA_STATUS_C bit as a high-level "lock"
 	// on the RFD while the received packet is being processed.
-	while (1) {
-		i = e100.rx_head % E100_RX_SLOTS;
-		if (!(e100.rx[i].rfd.status & E100_RFA_STATUS_C))
-			break;	// No more un-processed packets received
-
-		// "Claim" this RFD by moving e100.rx_head past it,
+	while (done < budget) {
+		// "Claim" RFDs by moving e100.rx_head past them,
 		// while leaving the E100_RFA_STATUS_OK bit set.
 		// Other CPUs might concurrently claim other RFDs
 		// while we have the e100.lock released below.
-		e100.rx_head++;
-
-		// Dispatch the received packet to our network stack.
-		if (e100.rx[i].rfd.status & E100_RFA_STATUS_OK) {
-			spinlock_release(&e100.lock);
-			int len = e100.rx[i].rfd.actual & E100_SIZE_MASK;
-			net_rx(e100.rx[i].buf, len);
-			spinlock_acquire(&e100.lock);
-		} else
-			warn("e100: packet receive error: %x",
-				e100.rx[i].rfd.status);
-		assert(e100.rx[i].rfd.status & E100_RFA_STATUS_C);
-
-		// Un-claim this RFD and get it ready to be filled again.
+		int first = e100.rx_head;
+		for (n = 0; n < E100_RX_BATCH && done + n < budget; n++) {
+			i = (first + n) % e100.rx_slots;
+			if (!(e100.rx[i].rfd.status & E100_RFA_STATUS_C))
+				break;	// No more un-processed packets received
+		}
+		if (n == 0)
+			break;
+		e100.rx_head += n;
+		done += n;
+
+		// Dispatch the received packets to our network stack.
+		spinlock_release(&e100.lock);
+		int k;
+		for (k = 0; k < n; k++) {
+			i = (first + k) % e100.rx_slots;
+			if (e100.rx[i].rfd.status & E100_RFA_STATUS_OK) {
+				int len = e100.rx[i].rfd.actual
+						& E100_SIZE_MASK;
+				net_rx(e100.rx[i].buf, len);
+			} else {
+				warn("e100: packet receive error: %x",
+					e100.rx[i].rfd.status);
+				net_statinc(rxerr);
+			}
+		}
+		spinlock_acquire(&e100.lock);
+
+		// Un-claim these RFDs and get them ready to be filled again.
 		// Different RFDs might be un-claimed out of order
 		// due to concurrency among the CPUs.
 		// Mark all RFDs "suspend" until tail catches up.
-		e100.rx[i].rfd.control = E100_RFA_CONTROL_S;
-		e100.rx[i].rfd.status = 0;
-		e100.rx[i].rfd.actual = 0;
+		for (k = 0; k < n; k++) {
+			i = (first + k) % e100.rx_slots;
+			assert(e100.rx[i].rfd.status & E100_RFA_STATUS_C);
+			e100.rx[i].rfd.control = E100_RFA_CONTROL_S;
+			e100.rx[i].rfd.status = 0;
+			e100.rx[i].rfd.actual = 0;
+		}
 	}
 
 	// Now move the tail forward to the first uncompleted RFD,
 	// clearing unnecessary "suspend" bits as we go.
 	while (e100.rx_tail < e100.rx_head) {
-		i = e100.rx_tail % E100_RX_SLOTS;
+		i = e100.rx_tail % e100.rx_slots;
 		if (e100.rx[i].rfd.status & E100_RFA_STATUS_C)
 			break;	// This RFD still being processed by some CPU
 
 		assert(e100.rx[i].rfd.control == E100_RFA_CONTROL_S);
-		i = (e100.rx_tail - 1) % E100_RX_SLOTS;
+		i = (e100.rx_tail + e100.rx_slots - 1) % e100.rx_slots;
 		e100.rx[i].rfd.control = 0;	// Prev RFD need not suspend
 		e100.rx_tail++;
 	}
+	return done;
+}
+
+// Is there a received packet waiting for us to claim?
+static bool e100_rx_pending(void)
+{
+	int i = e100.rx_head % e100.rx_slots;
+	return (e100.rx[i].rfd.status & E100_RFA_STATUS_C) != 0;
+}
+
+// Drain completed transmits and up to one budget of received packets
+// with the card's interrupts masked.
+// Once the receive ring is empty, switch back to interrupts.
+static void e100_poll_locked(void)
+{
+	assert(spinlock_holding(&e100.lock));
+	assert(e100.polling);
+
+	e100_intr_tx();
+	if (e100.tx_head > e100.tx_tail)
+		e100_tx_start();
+	e100_intr_rx(E100_RX_BUDGET);
+	e100_rx_start();
+
+	if (e100_rx_pending())
+		return;		// Still busy: keep polling from the timer
+
+	// Unmask and check again, in case a packet slipped in
+	// after we looked but before interrupts were back on;
+	// otherwise we might not hear about it until the next burst.
+	outb(e100.iobase + E100_CSR_SCB_INTMASK, 0);
+	e100.polling = 0;
+	if (e100_rx_pending()) {
+		outb(e100.iobase + E100_CSR_SCB_INTMASK, E100_SCB_INTMASK_M);
+		e100.polling = 1;
+	}
+}
+
+// Called on every timer tick to continue draining a busy receive ring.
+void e100_poll(void)
+{
+	if (!e100_present || !e100.polling)
+		return;
+	spinlock_acquire(&e100.lock);
+	if (e100.polling)
+		e100_poll_locked();
+	spinlock_release(&e100.lock);
 }
 
 void e100_intr(void)
@@ -345,10 +468,17 @@ void e100_intr(void)
 	}
 
 	if (r & E100_SCB_STATACK_FR) {
+		// Mask further interrupts and drain the ring by polling,
+		// until it's empty, instead of taking one interrupt per frame.
 		r &= ~E100_SCB_STATACK_FR;
-		e100_intr_rx();	// releases and re-acquires e100.lock!
-	}
-	e100_rx_start();
+		if (!e100.polling) {
+			outb(e100.iobase + E100_CSR_SCB_INTMASK,
+				E100_SCB_INTMASK_M);
+			e100.polling = 1;
+		}
+		e100_poll_locked();	// releases and re-acquires e100.lock!
+	} else
+		e100_rx_start();
 
 	if (r)
 		warn("e100_intr: unhandled STAT/ACK %x\n", r);
@@ -392,6 +522,9 @@ int e100_attach(struct pci_func *pcif)
 {
 	int i, next;
 
+	if (net_netdev != NULL)
+		return 0;	// Already using another network card
+
 	pci_func_enable(pcif);
 
 	e100_irq = pcif->irq_line;
@@ -408,21 +541,33 @@ int e100_attach(struct pci_func *pcif)
 		next = (i + 1) % E100_TX_SLOTS;
 		memset(&e100.tx[i], 0, sizeof(e100.tx[i]));
 		e100.tx[i].tcb.link_addr = mem_phys(&e100.tx[next].tcb);
-		e100.tx[i].tcb.tbd_array_addr = mem_phys(&e100.tx[i].tbd);
+		e100.tx[i].tcb.tbd_array_addr = mem_phys(&e100.tx[i].tbd[0]);
 		e100.tx[i].tcb.tbd_number = 1;
 		e100.tx[i].tcb.tx_threshold = 4;
 	}
 
+	// Allocate the RX DMA ring, which must be physically contiguous
+	e100.rx_slots = MAX(MIN(e100_rxslots, E100_RX_MAXSLOTS), 2);
+	int order = 0;
+	while ((PAGESIZE << order) < e100.rx_slots * sizeof(e100.rx[0]))
+		order++;
+	pageinfo *pi = mem_alloc_order(order);
+	if (pi == NULL) {
+		warn("e100: no memory for %d-slot receive ring", e100.rx_slots);
+		return 0;
+	}
+	e100.rx = mem_pi2ptr(pi);
+
 	// Setup RX DMA ring for RU
-	for (i = 0; i < E100_RX_SLOTS; i++) {
-		next = (i + 1) % E100_RX_SLOTS;
+	for (i = 0; i < e100.rx_slots; i++) {
+		next = (i + 1) % e100.rx_slots;
 		memset(&e100.rx[i], 0, sizeof(e100.rx[i]));
 		e100.rx[i].rfd.control = 0;
 		e100.rx[i].rfd.status = 0;
 		e100.rx[i].rfd.size = NET_MAXPKT;
 		e100.rx[i].rfd.link_addr = mem_phys(&e100.rx[next].rfd);
 	}
-	e100.rx[E100_RX_SLOTS-1].rfd.control = E100_RFA_CONTROL_S;
+	e100.rx[e100.rx_slots-1].rfd.control = E100_RFA_CONTROL_S;
 
 	// Determine the EEPROM's size (number of address bits)
 	outb(e100.iobase + E100_CSR_EEPROM, E100_EECS);	// activate
@@ -443,11 +588,12 @@ int e100_attach(struct pci_func *pcif)
 	for (i = 0; i < 6; i++)
 		cprintf("%c%02x", i ? ':' : ' ', e100.mac[i]);
 	cprintf("\n");
-	memcpy(net_mac, e100.mac, 6);
 
-	// Enable network card interrupts
-	pic_enable(e100_irq);
-	ioapic_enable(e100_irq);
+	// Enable network card interrupts, as MSIs if it can do them
+	if (!pci_msi_enable(pcif)) {
+		pic_enable(e100_irq);
+		ioapic_enable(e100_irq);
+	}
 
 	// Start receiving packets
 	spinlock_acquire(&e100.lock);
@@ -455,6 +601,8 @@ int e100_attach(struct pci_func *pcif)
 	spinlock_release(&e100.lock);
 
 	e100_present = 1;
+	e100_netdev.irq = e100_irq;
+	net_attach(&e100_netdev, e100.mac);
 	return 1;
 }
 
@@ -12,12 +12,18 @@
 #define PIOS_KERN_E100_H
 
 struct pci_func;
+struct pageinfo;
 
 extern bool e100_present;
 extern uint8_t e100_irq;
 
 int  e100_attach(struct pci_func *pcif);
 int  e100_tx(void *hdr, int hlen, void *body, int blen);
+int  e100_txref(void *hdr, int hlen, void *body, int blen,
+		struct pageinfo *pi);
 void e100_intr(void);
+void e100_poll(void);
+
+extern int e100_rxslots;	// Receive ring size to allocate at attach
 
 #endif	// PIOS_KERN_E100_H
@@ -0,0 +1,50 @@
+/*
+ * BIOS physical memory map (INT 0x15, AX=0xE820) definitions.
+ * The boot loader queries the BIOS for the memory map while still
+ * in real mode, and leaves it in low memory for the kernel to find.
+ *
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#ifndef PIOS_DEV_E820_H
+#define PIOS_DEV_E820_H
+#ifndef PIOS_KERNEL
+# error "This is a kernel header; user programs should not #include it"
+#endif
+
+#define E820_SMAP	0x534d4150	// 'SMAP' signature for INT 0x15 E820
+#define E820_MAPADDR	0x500		// Where the boot loader leaves the map
+#define E820_ENTSIZE	20		// Size of each map entry
+#define E820_MAXENT	32		// Max entries the boot loader records
+
+// Offsets within the map the boot loader builds at E820_MAPADDR
+#define E820_MAGIC	(E820_MAPADDR + 0)	// E820_SMAP if map is valid
+#define E820_NENT	(E820_MAPADDR + 4)	// Number of entries
+#define E820_ENTS	(E820_MAPADDR + 8)	// Start of entry array
+
+// Address range types
+#define E820_RAM	1		// Usable RAM
+#define E820_RESERVED	2		// Reserved, don't touch
+#define E820_ACPI	3		// ACPI tables, reclaimable
+#define E820_NVS	4		// ACPI non-volatile storage
+
+#ifndef __ASSEMBLER__
+
+#include <inc/types.h>
+#include <inc/cdefs.h>
+
+typedef struct e820ent {
+	uint64_t	addr;		// Start of address range
+	uint64_t	size;		// Size in bytes
+	uint32_t	type;		// Address range type (E820_*)
+} gcc_packed e820ent;
+
+typedef struct e820map {
+	uint32_t	magic;		// E820_SMAP if valid
+	uint32_t	nent;		// Number of entries in ent[]
+	e820ent		ent[E820_MAXENT];
+} e820map;
+
+#endif /* !__ASSEMBLER__ */
+
+#endif	// !PIOS_DEV_E820_H
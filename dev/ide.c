@@ -0,0 +1,185 @@
+/*
+ * Simple PIO-based ATA (IDE) disk driver,
+ * using the same primary controller ports the boot loader does.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#include <inc/x86.h>
+#include <inc/stdio.h>
+#include <inc/assert.h>
+
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+
+#include <dev/ide.h>
+
+
+// Primary ATA controller registers
+#define IDE_DATA	0x1F0		// Data port (16 or 32 bits wide)
+#define IDE_ERROR	0x1F1		// Error register (read)
+#define IDE_NSECT	0x1F2		// Sector count
+#define IDE_LBA0	0x1F3		// LBA bits 0-7
+#define IDE_LBA1	0x1F4		// LBA bits 8-15
+#define IDE_LBA2	0x1F5		// LBA bits 16-23
+#define IDE_DRIVE	0x1F6		// Drive select and LBA bits 24-27
+#define IDE_STATUS	0x1F7		// Status register (read)
+#define IDE_CMD		0x1F7		// Command register (write)
+
+#define IDE_BSY		0x80		// Status: controller busy
+#define IDE_DRDY	0x40		// Status: drive ready
+#define IDE_DF		0x20		// Status: drive fault
+#define IDE_DRQ		0x08		// Status: data request
+#define IDE_ERR		0x01		// Status: error
+
+#define IDE_CMD_READ	0x20		// Read sectors with retry
+#define IDE_CMD_WRITE	0x30		// Write sectors with retry
+#define IDE_CMD_FLUSH	0xE7		// Flush the drive's write cache
+#define IDE_CMD_IDENT	0xEC		// Identify drive
+
+#define IDE_MAXSECT	256		// Most sectors one command transfers
+
+bool ide_present;
+uint32_t ide_nsect;
+
+static spinlock ide_lock;
+
+
+// Wait for the controller to finish whatever it's doing.
+// Returns the final status, or -1 if the drive reported an error.
+static int
+ide_wait(void)
+{
+	int r;
+	while ((r = inb(IDE_STATUS)) & IDE_BSY)
+		pause();
+	if (r & (IDE_DF | IDE_ERR))
+		return -1;
+	return r;
+}
+
+// Select the file system disk and set up an LBA28 transfer, and start it.
+static void
+ide_start(uint32_t secno, size_t nsecs, int cmd)
+{
+	assert(nsecs > 0 && nsecs <= IDE_MAXSECT);
+	assert(secno < (1 << 28));
+	ide_wait();
+	outb(IDE_NSECT, nsecs & 0xff);	// 0 means 256
+	outb(IDE_LBA0, secno);
+	outb(IDE_LBA1, secno >> 8);
+	outb(IDE_LBA2, secno >> 16);
+	outb(IDE_DRIVE, 0xE0 | (IDE_FSDISK << 4) | ((secno >> 24) & 0x0f));
+	outb(IDE_CMD, cmd);
+}
+
+void
+ide_init(void)
+{
+	if (!cpu_onboot())
+		return;
+	spinlock_init(&ide_lock);
+
+	// Select the disk and see if anything answers.
+	// A missing drive leaves the status register floating (0xff) or 0.
+	ide_wait();
+	outb(IDE_DRIVE, 0xE0 | (IDE_FSDISK << 4));
+	int i;
+	for (i = 0; i < 1000; i++)
+		if ((inb(IDE_STATUS) & (IDE_BSY | IDE_DRDY)) == IDE_DRDY)
+			break;
+	int r = inb(IDE_STATUS);
+	if (i == 1000 || r == 0xff || !(r & IDE_DRDY))
+		return;
+
+	// Find out how big it is.
+	outb(IDE_CMD, IDE_CMD_IDENT);
+	if (inb(IDE_STATUS) == 0 || ide_wait() < 0 || !(inb(IDE_STATUS) & IDE_DRQ))
+		return;
+	uint16_t ident[IDE_SECTSIZE/2];
+	insl(IDE_DATA, ident, IDE_SECTSIZE/4);
+	ide_nsect = ident[60] | (uint32_t)ident[61] << 16;	// LBA28 size
+	if (ide_nsect == 0)
+		return;
+
+	ide_present = 1;
+	cprintf("ide: disk %d, %d sectors (%dMB)\n", IDE_FSDISK,
+		ide_nsect, ide_nsect / (1024*1024/IDE_SECTSIZE));
+}
+
+// Read nsecs sectors starting at secno into dst.
+// Returns 0 on success, or -1 on a disk error.
+int
+ide_read(uint32_t secno, void *dst, size_t nsecs)
+{
+	assert(ide_present);
+	assert(secno + nsecs <= ide_nsect);
+	spinlock_acquire(&ide_lock);
+	int rc = 0;
+	while (nsecs > 0) {
+		size_t n = MIN(nsecs, IDE_MAXSECT);
+		ide_start(secno, n, IDE_CMD_READ);
+		size_t i;
+		for (i = 0; i < n; i++) {
+			if (ide_wait() < 0) {
+				rc = -1;
+				goto done;
+			}
+			insl(IDE_DATA, dst, IDE_SECTSIZE/4);
+			dst += IDE_SECTSIZE;
+		}
+		secno += n;
+		nsecs -= n;
+	}
+	done:
+	spinlock_release(&ide_lock);
+	return rc;
+}
+
+// Write nsecs sectors from src starting at secno.
+// They may sit in the disk's write cache until the next ide_flush().
+// Returns 0 on success, or -1 on a disk error.
+int
+ide_write(uint32_t secno, const void *src, size_t nsecs)
+{
+	assert(ide_present);
+	assert(secno + nsecs <= ide_nsect);
+	spinlock_acquire(&ide_lock);
+	int rc = 0;
+	while (nsecs > 0) {
+		size_t n = MIN(nsecs, IDE_MAXSECT);
+		ide_start(secno, n, IDE_CMD_WRITE);
+		size_t i;
+		for (i = 0; i < n; i++) {
+			if (ide_wait() < 0) {
+				rc = -1;
+				goto done;
+			}
+			outsl(IDE_DATA, src, IDE_SECTSIZE/4);
+			src += IDE_SECTSIZE;
+		}
+		secno += n;
+		nsecs -= n;
+	}
+	if (ide_wait() < 0)	// wait for the last sector
+		rc = -1;
+	done:
+	spinlock_release(&ide_lock);
+	return rc;
+}
+
+// Make sure everything written so far is really on the disk.
+// Returns 0 on success, or -1 on a disk error.
+int
+ide_flush(void)
+{
+	assert(ide_present);
+	spinlock_acquire(&ide_lock);
+	ide_wait();
+	outb(IDE_DRIVE, 0xE0 | (IDE_FSDISK << 4));
+	outb(IDE_CMD, IDE_CMD_FLUSH);
+	int rc = ide_wait() < 0 ? -1 : 0;
+	spinlock_release(&ide_lock);
+	return rc;
+}
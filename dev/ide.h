@@ -0,0 +1,30 @@
+/*
+ * Simple ATA (IDE) disk driver definitions.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#ifndef PIOS_DEV_IDE_H
+#define PIOS_DEV_IDE_H
+#ifndef PIOS_KERNEL
+# error "This is a kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+#define IDE_SECTSIZE	512		// Bytes per disk sector
+
+// The boot loader and kernel live on disk 0, the primary master;
+// the kernel keeps the persistent file system on disk 1, the primary slave.
+#define IDE_FSDISK	1
+
+extern bool ide_present;	// Disk IDE_FSDISK was found at boot
+extern uint32_t ide_nsect;	// Its size in sectors
+
+void ide_init(void);
+int  ide_read(uint32_t secno, void *dst, size_t nsecs);
+int  ide_write(uint32_t secno, const void *src, size_t nsecs);
+int  ide_flush(void);
+
+#endif	// !PIOS_DEV_IDE_H
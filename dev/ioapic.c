@@ -16,6 +16,7 @@
 
 #include <kern/mem.h>
 #include <kern/mp.h>
+#include <kern/cpu.h>
 
 #include <dev/ioapic.h>
 
@@ -40,6 +41,15 @@
 #define INT_LOWEST	0x00000100	// to processor at lowest priority
 
 
+#define MAXIRQ		24		// Redirection entries we track
+
+
+// Local APIC ID each enabled IRQ is routed to, and the number of
+// device IRQs (including MSIs) routed to each CPU, by local APIC ID.
+static uint8_t irqdest[MAXIRQ];
+static bool irqrouted[MAXIRQ];	// irqdest[irq] is valid
+static uint8_t nirqs[256];
+
 // IO APIC MMIO structure: write reg, then read or write data.
 struct ioapic {
 	uint32_t reg;
@@ -90,11 +100,46 @@ ioapic_init(void)
 	}
 }
 
+uint8_t
+ioapic_pickcpu(void)
+{
+	// Take the CPU with the fewest device IRQs,
+	// trying the boot CPU last since it already handles the most.
+	cpu *first = cpu_boot.next ? cpu_boot.next : &cpu_boot;
+	cpu *c = first, *best = first;
+	do {
+		if (nirqs[c->id] < nirqs[best->id])
+			best = c;
+		c = c->next ? c->next : &cpu_boot;
+	} while (c != first);
+	nirqs[best->id]++;
+	return best->id;
+}
+
+// Route irq to the CPU with local APIC ID apicid, and enable it.
+static void
+ioapic_route(int irq, uint8_t apicid)
+{
+	// Mark interrupt edge-triggered, active high, enabled,
+	// and delivered to just the one CPU, by physical APIC ID.
+	irqdest[irq] = apicid;
+	irqrouted[irq] = 1;
+	ioapic_write(REG_TABLE+2*irq, INT_FIXED | (T_IRQ0 + irq));
+	ioapic_write(REG_TABLE+2*irq+1, apicid << 24);
+	cprintf("IRQ %d routed to CPU %d\n", irq, apicid);
+}
+
 void
 ioapic_enable(int irq)
 {
 	if (!ismp)
 		return;
+	assert(irq >= 0 && irq < MAXIRQ);
+
+	if (IOAPIC_ROUTE == IOAPIC_ROUTE_SPREAD) {
+		ioapic_route(irq, ioapic_pickcpu());
+		return;
+	}
 
 	// Mark interrupt edge-triggered, active high,
 	// enabled, and routed to any CPU.
@@ -103,3 +148,15 @@ ioapic_enable(int irq)
 	ioapic_write(REG_TABLE+2*irq+1, 0xff << 24);
 }
 
+void
+ioapic_setaffinity(int irq, uint8_t apicid)
+{
+	if (!ismp)
+		return;
+	assert(irq >= 0 && irq < MAXIRQ);
+
+	if (irqrouted[irq])
+		nirqs[irqdest[irq]]--;
+	nirqs[apicid]++;
+	ioapic_route(irq, apicid);
+}
@@ -13,8 +13,33 @@
 # error "This is a kernel header; user programs should not #include it"
 #endif
 
+#include <inc/types.h>
+
+
+// How ioapic_enable() picks a CPU to take each device interrupt:
+// IOAPIC_ROUTE_ANY lets the hardware deliver each one to whichever CPU
+// is at lowest priority at the time, which usually means the same CPU;
+// IOAPIC_ROUTE_SPREAD gives each IRQ to whichever CPU has the fewest
+// device IRQs so far, so that the devices' interrupt work spreads out.
+// Override with, e.g., DEFS += -DIOAPIC_ROUTE=IOAPIC_ROUTE_ANY
+// in conf/env.mk.
+#define IOAPIC_ROUTE_ANY	0
+#define IOAPIC_ROUTE_SPREAD	1
+#ifndef IOAPIC_ROUTE
+#define IOAPIC_ROUTE		IOAPIC_ROUTE_SPREAD
+#endif
+
 void ioapic_init(void);
 
+// Enable a device interrupt, routed as IOAPIC_ROUTE says.
 void ioapic_enable(int irq);
 
+// Route an enabled interrupt to the CPU with local APIC ID apicid instead.
+void ioapic_setaffinity(int irq, uint8_t apicid);
+
+// Choose the CPU to take a new device interrupt, as ioapic_enable() does,
+// and count it as taking it; returns the CPU's local APIC ID.
+// Also for interrupts that bypass the I/O APIC, like PCI MSIs.
+uint8_t ioapic_pickcpu(void);
+
 #endif /* !PIOS_DEV_IOAPIC_H */
@@ -17,6 +17,7 @@
 #include <inc/trap.h>
 
 #include <kern/cons.h>
+#include <kern/spinlock.h>
 
 #include <dev/kbd.h>
 #include <dev/pic.h>
@@ -33,6 +34,8 @@
 #define SCROLLLOCK	(1<<5)
 #define E0ESC		(1<<6)
 
+#define KBD_LOCKSTAT_N	10	// Lock sites shown by Ctrl-Alt-L
+
 
 static uint8_t shiftcode[256] = 
 {
@@ -167,6 +170,11 @@ kbd_proc_data(void)
 		cprintf("Rebooting!\n");
 		outb(0x92, 0x3); // courtesy of Chris Frost
 	}
+	// Ctrl-Alt-L: print the kernel lock contention report
+	if (!(~shift & (CTL | ALT)) && c == C('L')) {
+		spinlock_report(KBD_LOCKSTAT_N);
+		return 0;
+	}
 
 	return c;
 }
@@ -13,6 +13,7 @@
 #include <inc/trap.h>
 #include <inc/x86.h>
 #include <inc/assert.h>
+#include <inc/kdata.h>
 
 #include <kern/cpu.h>
 
@@ -21,6 +22,16 @@
 
 volatile uint32_t *lapic;  // Initialized in mp.c
 
+// Clock rates measured against the PIT by lapic_calibrate()
+uint64_t lapic_tscfreq;		// TSC ticks per second
+static uint32_t lapic_busfreq;	// Local APIC timer ticks per second
+
+// clock_ns() scales TSC ticks since clock_tsc0 to nanoseconds
+// by multiplying by clock_mult / 2^clock_shift.
+static uint64_t clock_tsc0;
+static uint32_t clock_mult;
+static int clock_shift;
+
 
 static void
 lapicw(int index, int value)
@@ -29,9 +40,75 @@ lapicw(int index, int value)
 	lapic[ID];  // wait for write to finish, by reading
 }
 
+#define IO_PIT		0x40		// 8253/8254 timer ports
+#define IO_PITGATE	0x61		// PIT channel 2 gate and output
+#define PIT_HZ		1193182		// PIT input clock frequency
+#define CALIB_MS	10		// How long to calibrate clocks for
+
+// Time the TSC and local APIC timer against CALIB_MS of the PIT,
+// run as a one-shot on channel 2 (whose gate we can control
+// and whose output we can read, without enabling the speaker).
+static void
+lapic_calibrate(void)
+{
+	uint16_t count = PIT_HZ * CALIB_MS / 1000;
+	outb(IO_PITGATE, (inb(IO_PITGATE) & ~0x02) | 0x01);
+	outb(IO_PIT+3, 0xB0);	// channel 2, low then high byte, mode 0
+	outb(IO_PIT+2, count);
+	outb(IO_PIT+2, count >> 8);
+
+	if (lapic) {		// count the APIC timer down meanwhile
+		lapicw(TDCR, X1);
+		lapicw(TIMER, MASKED);
+		lapicw(TICR, 0xffffffff);
+	}
+	uint32_t lapic0 = lapic ? lapic[TCCR] : 0;
+	uint64_t tsc0 = rdtsc();
+	while (!(inb(IO_PITGATE) & 0x20))	// wait for channel 2 output
+		;
+	uint64_t tsc1 = rdtsc();
+	uint32_t lapic1 = lapic ? lapic[TCCR] : 0;
+
+	lapic_tscfreq = (tsc1 - tsc0) * 1000 / CALIB_MS;
+	lapic_busfreq = (lapic0 - lapic1) * (1000 / CALIB_MS);
+	if (lapic_tscfreq == 0) {
+		warn("lapic_calibrate: TSC not ticking?");
+		lapic_tscfreq = 1000000000;
+	}
+
+	// Pick the most precise multiplier for clock_ns() that fits.
+	clock_shift = 32;
+	while (((uint64_t)1000000000 << clock_shift) / lapic_tscfreq
+			> 0xffffffff)
+		clock_shift--;
+	clock_mult = ((uint64_t)1000000000 << clock_shift) / lapic_tscfreq;
+	clock_tsc0 = tsc1;
+	cprintf("TSC %lld kHz, APIC timer %d kHz\n",
+		lapic_tscfreq / 1000, lapic_busfreq / 1000);
+}
+
+uint64_t
+clock_ns(void)
+{
+	uint64_t d = rdtsc() - clock_tsc0;
+	return ((uint64_t)(uint32_t)d * clock_mult >> clock_shift)
+		+ ((d >> 32) * clock_mult << (32 - clock_shift));
+}
+
+void
+clock_kdata(kdata *kd)
+{
+	kd->tscfreq = lapic_tscfreq;
+	kd->tsc0 = clock_tsc0;
+	kd->mult = clock_mult;
+	kd->shift = clock_shift;
+}
+
 void
 lapic_init()
 {
+	if (cpu_onboot())
+		lapic_calibrate();
 	if (!lapic) 
 		return;
 
@@ -39,13 +116,12 @@ lapic_init()
 	lapicw(SVR, ENABLE | (T_IRQ0 + IRQ_SPURIOUS));
 
 	// The timer repeatedly counts down at bus frequency
-	// from lapic[TICR] and then issues an interrupt.  
+	// from lapic[TICR] and then issues an interrupt,
+	// which we want HZ times a second.
+	// (If calibration failed, guess a bus frequency of 250MHz.)
 	lapicw(TDCR, X1);
 	lapicw(TIMER, PERIODIC | T_LTIMER);
-
-	// If we cared more about precise timekeeping,
-	// we would calibrate TICR with another time source such as the PIT.
-	lapicw(TICR, 10000000);
+	lapicw(TICR, (lapic_busfreq ? lapic_busfreq : 250000000) / HZ);
 
 	// Disable logical interrupt lines.
 	lapicw(LINT0, MASKED);
@@ -72,10 +148,14 @@ lapic_init()
 	lapicw(EOI, 0);
 
 	// Send an Init Level De-Assert to synchronise arbitration ID's.
-	lapicw(ICRHI, 0);
-	lapicw(ICRLO, BCAST | INIT | LEVEL);
-	while(lapic[ICRLO] & DELIVS)
-		;
+	// Only the boot CPU does this, before starting the others,
+	// since they all start at once and could still be awaiting STARTUP.
+	if (cpu_onboot()) {
+		lapicw(ICRHI, 0);
+		lapicw(ICRLO, BCAST | INIT | LEVEL);
+		while(lapic[ICRLO] & DELIVS)
+			;
+	}
 
 	// Enable interrupts on the APIC (but not on the processor).
 	lapicw(TPR, 0);
@@ -96,22 +176,56 @@ void lapic_errintr(void)
 	warn("CPU%d LAPIC error: ESR %x", cpu_cur()->id, lapic[ESR]);
 }
 
-// Spin for a given number of microseconds.
-// On real hardware would want to tune this dynamically.
+// Send a fixed-delivery IPI to the CPU with local APIC ID 'apicid'.
+void
+lapic_ipi(uint8_t apicid, int vector)
+{
+	if (!lapic)
+		return;
+	while (lapic[ICRLO] & DELIVS)	// wait for any previous IPI to go out
+		;
+	lapicw(ICRHI, apicid << 24);
+	lapicw(ICRLO, vector);
+}
+
+// Spin for a given number of microseconds, timed by the TSC.
 void
 microdelay(int us)
 {
+	uint64_t end = rdtsc() + lapic_tscfreq * us / 1000000;
+	while (rdtsc() < end)
+		pause();
 }
 
 
 #define IO_RTC  0x70
 
+// Send one interrupt command to the CPU with local APIC ID 'apicid',
+// after waiting for any previous command to go out.
+static void
+lapic_icr(uint8_t apicid, int cmd)
+{
+	while (lapic[ICRLO] & DELIVS)
+		;
+	lapicw(ICRHI, apicid<<24);
+	lapicw(ICRLO, cmd);
+}
+
 // Start additional processor running bootstrap code at addr.
 // See Appendix B of MultiProcessor Specification.
 void
 lapic_startcpu(uint8_t apicid, uint32_t addr)
 {
-	int i;
+	lapic_startcpus(&apicid, 1, addr);
+}
+
+// Start n additional processors all running bootstrap code at addr,
+// overlapping each step of the startup algorithm across all of them
+// so that the delays it calls for are paid once, not once per CPU.
+void
+lapic_startcpus(const uint8_t *apicids, int n, uint32_t addr)
+{
+	int i, j;
 	uint16_t *wrv;
 
 	// "The BSP must initialize CMOS shutdown code to 0AH
@@ -125,10 +239,11 @@ lapic_startcpu(uint8_t apicid, uint32_t addr)
 
 	// "Universal startup algorithm."
 	// Send INIT (level-triggered) interrupt to reset other CPU.
-	lapicw(ICRHI, apicid<<24);
-	lapicw(ICRLO, INIT | LEVEL | ASSERT);
+	for (i = 0; i < n; i++)
+		lapic_icr(apicids[i], INIT | LEVEL | ASSERT);
 	microdelay(200);
-	lapicw(ICRLO, INIT | LEVEL);
+	for (i = 0; i < n; i++)
+		lapic_icr(apicids[i], INIT | LEVEL);
 	microdelay(100);    // should be 10ms, but too slow in Bochs!
 
 	// Send startup IPI (twice!) to enter bootstrap code.
@@ -136,10 +251,9 @@ lapic_startcpu(uint8_t apicid, uint32_t addr)
 	// when it is in the halted state due to an INIT.  So the second
 	// should be ignored, but it is part of the official Intel algorithm.
 	// Bochs complains about the second one.  Too bad for Bochs.
-	for(i = 0; i < 2; i++){
-		lapicw(ICRHI, apicid<<24);
-		lapicw(ICRLO, STARTUP | (addr>>12));
+	for(j = 0; j < 2; j++){
+		for (i = 0; i < n; i++)
+			lapic_icr(apicids[i], STARTUP | (addr>>12));
 		microdelay(200);
 	}
 }
-
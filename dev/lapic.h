@@ -16,9 +16,12 @@
 
 
 // Frequency at which we want our local APICs to produce interrupts,
-// which are used for context switching.
+// which are used for context switching, so 1/HZ is the time quantum.
 // Must be at least 19Hz in order to keep the system type up-to-date.
-#define HZ		25
+// Can be overridden with, e.g., DEFS += -DHZ=1000 in conf/env.mk.
+#ifndef HZ
+#define HZ		100
+#endif
 
 
 // Local APIC registers, divided by 4 for use as uint32_t[] indices.
@@ -59,17 +62,35 @@
 extern volatile uint32_t *lapic;
 
 
-// Initialize current CPU's local APIC
+// TSC ticks per second, as calibrated at boot against the PIT.
+extern uint64_t lapic_tscfreq;
+
+// Initialize current CPU's local APIC,
+// first calibrating the TSC and APIC timer if on the boot CPU.
 void lapic_init(void);
 
+// Nanoseconds since boot, from the TSC.
+uint64_t clock_ns(void);
+
+// Fill in a kernel data page's clock fields (see inc/kdata.h),
+// so that user code can do what clock_ns() does.
+struct kdata;
+void clock_kdata(struct kdata *kd);
+
 // Acknowledge interrupt
 void lapic_eoi(void);
 
 // Handle local APIC error interrupt
 void lapic_errintr(void);
 
+// Send an inter-processor interrupt with a given vector to one CPU.
+void lapic_ipi(uint8_t apicid, int vector);
+
 // Send a message to start an Application Processor (AP) running at addr.
 void lapic_startcpu(uint8_t apicid, uint32_t addr);
 
+// Send it to n APs at once, all to start running at addr.
+void lapic_startcpus(const uint8_t *apicids, int n, uint32_t addr);
+
 
 #endif /* !PIOS_DEV_LAPIC_H */
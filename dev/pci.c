@@ -12,10 +12,15 @@
 #include <inc/assert.h>
 #include <inc/string.h>
 
+#include <inc/trap.h>
+
 #include <kern/cpu.h>
+#include <kern/mp.h>
 
 #include <dev/pci.h>
+#include <dev/ioapic.h>
 #include <dev/e100.h>
+#include <dev/virtio.h>
 
 
 // Flag to do "lspci" at bootup
@@ -42,6 +47,7 @@ struct pci_driver pci_attach_class[] = {
 
 struct pci_driver pci_attach_vendor[] = {
 	{ 0x8086, 0x1209, &e100_attach },
+	{ 0x1af4, 0x1000, &virtio_attach },	// legacy virtio-net
 	{ 0, 0, 0 },
 };
 
@@ -254,6 +260,55 @@ pci_func_enable(struct pci_func *f)
 	}
 }
 
+// Find capability 'id' in f's capability list.
+// Returns its offset in configuration space, or 0 if it has none.
+static int
+pci_find_cap(struct pci_func *f, int id)
+{
+	if (!(pci_conf_read(f, PCI_COMMAND_STATUS_REG)
+			& PCI_STATUS_CAPLIST_SUPPORT))
+		return 0;
+	int off = pci_conf_read(f, PCI_CAPLISTPTR_REG) & 0xfc;
+	int n;
+	for (n = 0; off != 0 && n < 48; n++) {	// don't loop forever
+		uint32_t cap = pci_conf_read(f, off);
+		if ((cap & 0xff) == id)
+			return off;
+		off = (cap >> 8) & 0xfc;
+	}
+	return 0;
+}
+
+bool
+pci_msi_enable(struct pci_func *f)
+{
+	int cap = pci_find_cap(f, PCI_CAP_MSI);
+	if (cap == 0 || !ismp || f->irq_line >= 16)
+		return 0;
+
+	// The message is a write of the vector to the local APIC's address
+	// range, with the destination APIC ID in bits 12-19.
+	uint8_t apicid = ioapic_pickcpu();
+	uint32_t ctl = pci_conf_read(f, cap);
+	pci_conf_write(f, cap + PCI_MSI_ADDR_LO, 0xfee00000 | (apicid << 12));
+	if (ctl & PCI_MSI_CTL_64BIT) {
+		pci_conf_write(f, cap + PCI_MSI_ADDR_HI, 0);
+		pci_conf_write(f, cap + PCI_MSI_DATA_64, T_IRQ0 + f->irq_line);
+	} else
+		pci_conf_write(f, cap + PCI_MSI_DATA_32, T_IRQ0 + f->irq_line);
+
+	// Enable just one message, and stop asserting the legacy INTx line.
+	pci_conf_write(f, cap, (ctl & ~PCI_MSI_CTL_MME_MASK)
+				| PCI_MSI_CTL_ENABLE);
+	uint32_t cmd = pci_conf_read(f, PCI_COMMAND_STATUS_REG) & 0xffff;
+	pci_conf_write(f, PCI_COMMAND_STATUS_REG,
+			cmd | PCI_COMMAND_INTX_DISABLE);
+
+	cprintf("PCI device %02x:%02x.%d: MSI vector %d to CPU %d\n",
+		f->bus->busno, f->dev, f->func, T_IRQ0 + f->irq_line, apicid);
+	return 1;
+}
+
 int
 pci_init(void)
 {
@@ -473,6 +473,24 @@ typedef uint8_t pci_intr_line_t;
 /* Reserved					(1 << 12) - (1 << 15) */
 
 
+/*
+ * Capability list, and the Message Signaled Interrupt (MSI) capability.
+ * The MSI control word shares the capability's first dword
+ * with its ID and next pointer.
+ */
+#define	PCI_COMMAND_INTX_DISABLE		0x00000400
+#define	PCI_CAPLISTPTR_REG			0x34
+
+#define	PCI_CAP_MSI				0x05
+#define	PCI_MSI_CTL_ENABLE			0x00010000
+#define	PCI_MSI_CTL_MME_MASK			0x00700000
+#define	PCI_MSI_CTL_64BIT			0x00800000
+#define	PCI_MSI_ADDR_LO				0x04
+#define	PCI_MSI_ADDR_HI				0x08	/* 64-bit only */
+#define	PCI_MSI_DATA_32				0x08
+#define	PCI_MSI_DATA_64				0x0c
+
+
 // PCI subsystem interface
 enum { pci_res_bus, pci_res_mem, pci_res_io, pci_res_max };
 
@@ -500,4 +518,9 @@ struct pci_bus {
 int  pci_init(void);
 void pci_func_enable(struct pci_func *f);
 
+// Have f deliver its interrupt as an MSI, if it can, straight to a CPU
+// chosen as ioapic_enable() would, with the same vector as IRQ irq_line.
+// Returns false if the caller must use ioapic_enable() instead.
+bool pci_msi_enable(struct pci_func *f);
+
 #endif	// PIOS_KERN_PCI_H
@@ -15,6 +15,7 @@
 #include <inc/trap.h>
 
 #include <kern/cons.h>
+#include <kern/spinlock.h>
 
 #include <dev/serial.h>
 #include <dev/pic.h>
@@ -23,6 +24,23 @@
 
 bool serial_exists;
 
+// Characters we can write at once when the transmitter is empty:
+// 16 with a 16550A's transmit FIFO, 1 without.
+static int serial_txchunk = 1;
+
+// Output waiting for the transmitter, protected by cons_lock.
+// serial_write() appends to the ring, and serial_txmore() feeds the UART
+// from it whenever the transmitter empties, as the transmit-empty
+// interrupt tells us, so writers don't wait on the slow serial line.
+static struct {
+	char buf[SERIAL_TXBUFSIZE];
+	uint32_t head;		// Characters written since boot
+	uint32_t tail;		// Characters handed to the UART
+} serial_tx;
+
+static bool serial_txintr;	// Feed the UART from interrupts, not inline
+static uint8_t serial_ier;	// Interrupts now enabled in COM_IER
+
 
 // Stupid I/O delay routine necessitated by historical PC design flaws
 static void
@@ -34,6 +52,17 @@ delay(void)
 	inb(0x84);
 }
 
+// Wait (for a bounded time) until the transmitter can take more data.
+static void
+serial_txwait(void)
+{
+	int i;
+	for (i = 0;
+	     !(inb(COM1 + COM_LSR) & COM_LSR_TXRDY) && i < 12800;
+	     i++)
+		delay();
+}
+
 static int
 serial_proc_data(void)
 {
@@ -42,33 +71,100 @@ serial_proc_data(void)
 	return inb(COM1+COM_RX);
 }
 
+// Fill the transmit FIFO from the ring, if the transmitter is empty
+// or force is set (when we've already waited as long as we will),
+// and ask for an interrupt when it empties only if there's more to send.
+static void
+serial_txmore(bool force)
+{
+	if (force || (inb(COM1+COM_LSR) & COM_LSR_TXRDY)) {
+		int n = MIN(serial_tx.head - serial_tx.tail, serial_txchunk);
+		while (n-- > 0)
+			outb(COM1+COM_TX,
+				serial_tx.buf[serial_tx.tail++ % SERIAL_TXBUFSIZE]);
+	}
+
+	uint8_t ier = COM_IER_RDI;
+	if (serial_txintr && serial_tx.head != serial_tx.tail)
+		ier |= COM_IER_TXI;
+	if (ier != serial_ier)
+		outb(COM1+COM_IER, serial_ier = ier);
+}
+
 void
 serial_intr(void)
 {
-	if (serial_exists)
+	if (!serial_exists)
+		return;
+
+	// The IRQ is edge-triggered, so keep handling input and output
+	// until the UART has nothing pending, or a cause would get lost.
+	// We also get called to poll for input, so always check once.
+	int i = 0;
+	do {
 		cons_intr(serial_proc_data);
+
+		spinlock_acquire(&cons_lock);
+		serial_txmore(0);
+		spinlock_release(&cons_lock);
+	} while (++i < 16 && !(inb(COM1+COM_IIR) & COM_IIR_NOPEND));
 }
 
 void
 serial_putc(int c)
+{
+	char ch = c;
+	serial_write(&ch, 1);
+}
+
+// Copy a buffer of characters into the transmit ring,
+// waiting for the transmitter only when the ring is full.
+// Until interrupts are on, wait for it all to go out, as before.
+void
+serial_write(const char *buf, size_t len)
 {
 	if (!serial_exists)
 		return;
 
-	int i;
-	for (i = 0;
-	     !(inb(COM1 + COM_LSR) & COM_LSR_TXRDY) && i < 12800;
-	     i++)
-		delay();
-	
-	outb(COM1 + COM_TX, c);
+	while (len > 0) {
+		if (serial_tx.head - serial_tx.tail == SERIAL_TXBUFSIZE) {
+			serial_txwait();
+			serial_txmore(1);
+		}
+		uint32_t n = MIN(len, SERIAL_TXBUFSIZE
+					- (serial_tx.head - serial_tx.tail));
+		len -= n;
+		while (n-- > 0)
+			serial_tx.buf[serial_tx.head++ % SERIAL_TXBUFSIZE]
+				= *buf++;
+	}
+
+	serial_txmore(0);
+	if (!serial_txintr)
+		while (serial_tx.head != serial_tx.tail) {
+			serial_txwait();
+			serial_txmore(1);
+		}
+}
+
+void
+serial_sync(void)
+{
+	serial_txintr = 0;
+	serial_write("", 0);
 }
 
 void
 serial_init(void)
 {
-	// Turn off the FIFO
-	outb(COM1+COM_FCR, 0);
+	// Turn on and clear the FIFOs, if it's a 16550A that has working ones;
+	// otherwise turn them off
+	outb(COM1+COM_FCR, COM_FCR_ENABLE | COM_FCR_RCVR_RESET
+			| COM_FCR_XMIT_RESET | COM_FCR_TRIGGER_14);
+	if ((inb(COM1+COM_IIR) & COM_IIR_FIFO) == COM_IIR_FIFO)
+		serial_txchunk = 16;
+	else
+		outb(COM1+COM_FCR, 0);
 	
 	// Set speed; requires DLAB latch
 	outb(COM1+COM_LCR, COM_LCR_DLAB);
@@ -80,8 +176,8 @@ serial_init(void)
 
 	// No modem controls
 	outb(COM1+COM_MCR, 0);
-	// Enable rcv interrupts
-	outb(COM1+COM_IER, COM_IER_RDI);
+	// Enable rcv interrupts; serial_txmore() enables xmit ones as needed
+	outb(COM1+COM_IER, serial_ier = COM_IER_RDI);
 
 	// Clear any preexisting overrun indications and interrupts
 	// Serial port doesn't exist if COM_LSR returns 0xFF
@@ -93,10 +189,11 @@ serial_init(void)
 void
 serial_intenable(void)
 {
-	// Enable serial interrupts
+	// Enable serial interrupts, for input and from now on for output
 	if (serial_exists) {
 		pic_enable(IRQ_SERIAL);
 		ioapic_enable(IRQ_SERIAL);
+		serial_txintr = 1;
 	}
 }
 
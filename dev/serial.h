@@ -28,8 +28,15 @@
 #define COM_DLM		1	// Out: Divisor Latch High (DLAB=1)
 #define COM_IER		1	// Out: Interrupt Enable Register
 #define   COM_IER_RDI	0x01	//   Enable receiver data interrupt
+#define   COM_IER_TXI	0x02	//   Enable transmitter empty interrupt
 #define COM_IIR		2	// In:	Interrupt ID Register
+#define	  COM_IIR_NOPEND	0x01	//   No interrupt pending
 #define COM_FCR		2	// Out: FIFO Control Register
+#define	  COM_FCR_ENABLE	0x01	//   Enable FIFOs
+#define	  COM_FCR_RCVR_RESET	0x02	//   Clear receive FIFO
+#define	  COM_FCR_XMIT_RESET	0x04	//   Clear transmit FIFO
+#define	  COM_FCR_TRIGGER_14	0xC0	//   Receive interrupt at 14 bytes
+#define	  COM_IIR_FIFO	0xC0	//   FIFOs enabled (16550A)
 #define COM_LCR		3	// Out: Line Control Register
 #define	  COM_LCR_DLAB	0x80	//   Divisor latch access bit
 #define	  COM_LCR_WLEN8	0x03	//   Wordlength: 8 bits
@@ -42,11 +49,24 @@
 #define   COM_LSR_TXRDY	0x20	//   Transmit buffer avail
 #define   COM_LSR_TSRE	0x40	//   Transmitter off
 
+#define SERIAL_TXBUFSIZE	8192	// Output buffered for the transmitter
+
 
 extern bool serial_exists;
 
 void serial_init(void);
+
+// Output: the caller must hold cons_lock.  Once serial_intenable() has
+// been called, these just buffer the output for the transmit interrupt
+// to feed to the UART, waiting only if the buffer is full.
 void serial_putc(int c);
+void serial_write(const char *buf, size_t len);
+
+// Write out everything buffered, and write synchronously from now on,
+// so that a panic's output gets out with interrupts off.
+// The caller must hold cons_lock.
+void serial_sync(void);
+
 void serial_intenable(void);
 void serial_intr(void); // irq 4
 
@@ -53,8 +53,9 @@ video_init(void)
 
 
 
-void
-video_putc(int c)
+// Put a character into the display buffer without moving the cursor.
+static void
+video_putchar(int c)
 {
 	// if no attribute given, then use black on white
 	if (!(c & ~0xFF))
@@ -74,11 +75,11 @@ video_putc(int c)
 		crt_pos -= (crt_pos % CRT_COLS);
 		break;
 	case '\t':
-		video_putc(' ');
-		video_putc(' ');
-		video_putc(' ');
-		video_putc(' ');
-		video_putc(' ');
+		video_putchar(' ');
+		video_putchar(' ');
+		video_putchar(' ');
+		video_putchar(' ');
+		video_putchar(' ');
 		break;
 	default:
 		crt_buf[crt_pos++] = c;		/* write the character */
@@ -95,12 +96,33 @@ video_putc(int c)
 			crt_buf[i] = 0x0700 | ' ';
 		crt_pos -= CRT_COLS;
 	}
+}
 
-	/* move that little blinky thing */
+/* move that little blinky thing */
+static void
+video_cursor(void)
+{
 	outb(addr_6845, 14);
 	outb(addr_6845 + 1, crt_pos >> 8);
 	outb(addr_6845, 15);
 	outb(addr_6845 + 1, crt_pos);
 }
 
+void
+video_putc(int c)
+{
+	video_putchar(c);
+	video_cursor();
+}
+
+// Write a buffer of characters, moving the cursor just once at the end:
+// the cursor's I/O port writes cost far more than the buffer stores.
+void
+video_write(const char *buf, size_t len)
+{
+	while (len-- > 0)
+		video_putchar((uint8_t)*buf++);
+	video_cursor();
+}
+
 
@@ -33,6 +33,7 @@
 
 void video_init(void);
 void video_putc(int c);
+void video_write(const char *buf, size_t len);
 
 
 #endif /* PIOS_KERN_VIDEO_H_ */
@@ -0,0 +1,519 @@
+/*
+ * Virtio network device driver, for the paravirtual NIC of QEMU and KVM.
+ * Uses the legacy (virtio 0.9) PCI interface through the I/O BAR.
+ *
+ * Unlike the e100 we queue a whole chain of buffers per packet
+ * with one descriptor-ring update, and notify the device only when it asks,
+ * including jumbo frames of several whole pages for net.c's pull protocol.
+ * The device never interrupts us for transmits: we reclaim finished
+ * transmit slots as we send, and on every timer tick.
+ * On a receive interrupt we turn receive interrupts off
+ * and drain the ring by polling until it's empty, as dev/e100.c does.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#include <inc/x86.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+
+#include <kern/mem.h>
+#include <kern/spinlock.h>
+#include <kern/net.h>
+
+#include <dev/pic.h>
+#include <dev/ioapic.h>
+#include <dev/pci.h>
+#include <dev/virtio.h>
+
+
+bool virtio_present;
+uint8_t virtio_irq;
+
+static net_dev virtio_netdev = {
+	.name	= "virtio",
+	.txref	= virtio_txref,
+	.intr	= virtio_intr,
+	.poll	= virtio_poll,
+	.txpages = virtio_txpages,
+	.maxpkt	= NET_JUMBOPKT,
+};
+
+#define VIRTIO_TX_SLOTS			64	// Packets in flight
+#define VIRTIO_TX_NBODY			NET_JUMBOPAGES	// Max zero-copy bodies
+#define VIRTIO_TX_DESCS			(2 + VIRTIO_TX_NBODY)	// Per slot
+#define VIRTIO_RX_SLOTS			64	// Receive buffers, 2 descs each
+#define VIRTIO_RX_BUDGET		64	// Max packets per poll
+#define VIRTIO_RX_BATCH			16	// Max packets claimed at once
+
+// Legacy virtio PCI registers, as offsets from the I/O BAR
+#define VIRTIO_PCI_HOSTFEAT		0x00	// Device's features (4 bytes)
+#define VIRTIO_PCI_GUESTFEAT		0x04	// Features we use (4 bytes)
+#define VIRTIO_PCI_QPFN			0x08	// Queue's page number (4 bytes)
+#define VIRTIO_PCI_QSIZE		0x0c	// Queue size (2 bytes)
+#define VIRTIO_PCI_QSEL			0x0e	// Queue select (2 bytes)
+#define VIRTIO_PCI_QNOTIFY		0x10	// Queue notify (2 bytes)
+#define VIRTIO_PCI_STATUS		0x12	// Device status (1 byte)
+#define VIRTIO_PCI_ISR			0x13	// Interrupt status, read clears
+#define VIRTIO_PCI_NETMAC		0x14	// Net device MAC address (6 bytes)
+
+#define VIRTIO_STATUS_ACK		0x01	// We've seen the device
+#define VIRTIO_STATUS_DRIVER		0x02	// We know how to drive it
+#define VIRTIO_STATUS_DRIVER_OK		0x04	// We're ready to go
+#define VIRTIO_STATUS_FAILED		0x80	// We've given up on it
+
+#define VIRTIO_NET_F_MAC		(1 << 5)	// Device has a MAC address
+
+#define VIRTIO_NET_RXQ			0	// Receive queue number
+#define VIRTIO_NET_TXQ			1	// Transmit queue number
+
+#define VRING_DESC_F_NEXT		1	// Chain continues at 'next'
+#define VRING_DESC_F_WRITE		2	// Device writes this buffer
+#define VRING_AVAIL_F_NO_INTERRUPT	1	// We don't want interrupts
+#define VRING_USED_F_NO_NOTIFY		1	// Device doesn't want kicks
+
+// Virtqueue descriptor, naming one buffer in a chain
+struct vring_desc {
+	volatile uint64_t addr;		// Physical address
+	volatile uint32_t len;
+	volatile uint16_t flags;
+	volatile uint16_t next;		// Next descriptor if VRING_DESC_F_NEXT
+};
+
+// Ring of descriptor chains we've made available to the device
+struct vring_avail {
+	volatile uint16_t flags;
+	volatile uint16_t idx;		// Where we'll put the next one
+	volatile uint16_t ring[0];
+};
+
+struct vring_used_elem {
+	volatile uint32_t id;		// First descriptor of chain
+	volatile uint32_t len;		// Bytes the device wrote into it
+};
+
+// Ring of descriptor chains the device is done with
+struct vring_used {
+	volatile uint16_t flags;
+	volatile uint16_t idx;		// Where it'll put the next one
+	struct vring_used_elem ring[0];
+};
+
+struct virtq {
+	int size;			// Number of descriptors, set by device
+	struct vring_desc *desc;
+	struct vring_avail *avail;
+	struct vring_used *used;
+	uint16_t usedlast;		// Next used entry for us to look at
+};
+
+// Header preceding every packet, for offloads we don't use
+struct virtio_net_hdr {
+	uint8_t flags;
+	uint8_t gso_type;
+	uint16_t hdr_len;
+	uint16_t gso_size;
+	uint16_t csum_start;
+	uint16_t csum_offset;
+};
+
+// Transmit slot i owns VIRTIO_TX_DESCS descriptors starting at that times i:
+// the virtio header, then our header or whole copied packet from buf,
+// then optionally bodies sent straight from pages we hold references to.
+struct virtio_tx_slot {
+	struct virtio_net_hdr hdr;	// Always zero
+	int next;			// Next free slot, or -1
+	struct pageinfo *pi[VIRTIO_TX_NBODY];	// Zero-copy pages to release
+	char buf[NET_MAXPKT];
+};
+
+// Receive slot i owns descriptors 2i and 2i+1, naming hdr and buf.
+// Buffers are big enough for the jumbo frames net.c sends between virtio nodes.
+struct virtio_rx_slot {
+	struct virtio_net_hdr hdr;
+	char buf[NET_JUMBOPKT];
+};
+
+static struct {
+	spinlock lock;
+	uint32_t iobase;
+
+	struct virtq txq;
+	struct virtio_tx_slot tx[VIRTIO_TX_SLOTS];
+	int tx_free;	// First free transmit slot, or -1 if none
+
+	struct virtq rxq;
+	struct virtio_rx_slot rx[VIRTIO_RX_SLOTS];
+	char polling;	// Receive interrupts off while we drain the ring
+
+	uint8_t mac[6];
+} virtio;
+
+
+// Order our ring updates before what we read of the device's next.
+static void virtio_mb(void)
+{
+	asm volatile("lock; addl $0,0(%%esp)" : : : "cc", "memory");
+}
+
+// Set up virtqueue number q, which must have at least minsize descriptors,
+// in physically contiguous memory laid out as the legacy interface requires.
+static bool virtio_qinit(int q, struct virtq *vq, int minsize)
+{
+	outw(virtio.iobase + VIRTIO_PCI_QSEL, q);
+	int n = inw(virtio.iobase + VIRTIO_PCI_QSIZE);
+	if (n < minsize) {
+		warn("virtio: queue %d has only %d entries", q, n);
+		return 0;
+	}
+
+	size_t asize = ROUNDUP(sizeof(struct vring_desc) * n
+				+ sizeof(uint16_t) * (3 + n), PAGESIZE);
+	size_t usize = ROUNDUP(sizeof(uint16_t) * 3
+				+ sizeof(struct vring_used_elem) * n, PAGESIZE);
+	int order = 0;
+	while ((PAGESIZE << order) < asize + usize)
+		order++;
+	pageinfo *pi = mem_alloc_order(order);
+	if (pi == NULL) {
+		warn("virtio: no memory for %d-entry queue", n);
+		return 0;
+	}
+	void *ring = mem_pi2ptr(pi);
+	memset(ring, 0, PAGESIZE << order);
+
+	vq->size = n;
+	vq->desc = ring;
+	vq->avail = ring + sizeof(struct vring_desc) * n;
+	vq->used = ring + asize;
+	vq->usedlast = 0;
+	outl(virtio.iobase + VIRTIO_PCI_QPFN, mem_phys(ring) / PAGESIZE);
+	return 1;
+}
+
+// Make the descriptor chain starting at 'head' available to the device.
+static void virtq_post(struct virtq *vq, int head)
+{
+	vq->avail->ring[vq->avail->idx % vq->size] = head;
+	vq->avail->idx++;	// volatile: stored after the ring entry
+}
+
+// Tell the device about chains we posted to queue q, if it wants to know.
+static void virtq_kick(int q, struct virtq *vq)
+{
+	virtio_mb();
+	if (!(vq->used->flags & VRING_USED_F_NO_NOTIFY))
+		outw(virtio.iobase + VIRTIO_PCI_QNOTIFY, q);
+}
+
+// Free the transmit slots the device has finished with,
+// releasing the pages that zero-copy packets were sent from.
+static void virtio_txreap(void)
+{
+	assert(spinlock_holding(&virtio.lock));
+
+	struct virtq *vq = &virtio.txq;
+	while (vq->usedlast != vq->used->idx) {
+		int s = vq->used->ring[vq->usedlast % vq->size].id
+				/ VIRTIO_TX_DESCS;
+		vq->usedlast++;
+		struct virtio_tx_slot *tx = &virtio.tx[s];
+		int i;
+		for (i = 0; i < VIRTIO_TX_NBODY && tx->pi[i] != NULL; i++) {
+			mem_decref(tx->pi[i], mem_free);
+			tx->pi[i] = NULL;
+		}
+		tx->next = virtio.tx_free;
+		virtio.tx_free = s;
+	}
+}
+
+// Transmit a packet made of a header, which we copy,
+// followed by nb bodies sent straight from pages pis[0..nb-1]:
+// we hold a reference to each until the transmit completes.
+// With nb == 1 and a NULL page we copy the single body too.
+static int virtio_txv(void *hdr, int hlen, void **body, int *blen,
+			pageinfo **pis, int nb)
+{
+	assert(nb >= 1 && nb <= VIRTIO_TX_NBODY);
+	assert(hlen <= NET_MAXPKT);
+
+	spinlock_acquire(&virtio.lock);
+
+	virtio_txreap();
+	int s = virtio.tx_free;
+	if (s < 0) {
+		warn("virtio_tx: no transmit buffers");
+		net_statinc(txfull);
+		spinlock_release(&virtio.lock);
+		return 0;
+	}
+	struct virtio_tx_slot *tx = &virtio.tx[s];
+	virtio.tx_free = tx->next;
+	assert(tx->pi[0] == NULL);
+
+	int d0 = s * VIRTIO_TX_DESCS;
+	struct vring_desc *d = &virtio.txq.desc[d0];
+	d[0].addr = mem_phys(&tx->hdr);
+	d[0].len = sizeof(tx->hdr);
+	d[0].flags = VRING_DESC_F_NEXT;
+	d[0].next = d0 + 1;
+
+	memcpy(tx->buf, hdr, hlen);
+	d[1].addr = mem_phys(tx->buf);
+	if (pis[0] != NULL) {
+		d[1].len = hlen;
+		int i;
+		for (i = 0; i < nb; i++) {
+			assert(mem_ptr2pi(body[i]) == pis[i]
+				&& mem_ptr2pi(body[i] + blen[i] - 1) == pis[i]);
+			mem_incref(pis[i]);
+			tx->pi[i] = pis[i];
+			d[1+i].flags = VRING_DESC_F_NEXT;
+			d[1+i].next = d0 + 2 + i;
+			d[2+i].addr = mem_phys(body[i]);
+			d[2+i].len = blen[i];
+		}
+		d[1+nb].flags = 0;
+	} else {
+		assert(nb == 1 && hlen + blen[0] <= NET_MAXPKT);
+		memcpy(tx->buf+hlen, body[0], blen[0]);
+		d[1].len = MAX(hlen + blen[0], 64);
+		d[1].flags = 0;
+	}
+
+	virtq_post(&virtio.txq, d0);
+	virtq_kick(VIRTIO_NET_TXQ, &virtio.txq);
+
+	spinlock_release(&virtio.lock);
+	return 1;
+}
+
+// Transmit a packet, copying the header, and the body unless pi is non-NULL,
+// in which case the device fetches the body directly from page pi.
+int virtio_txref(void *hdr, int hlen, void *body, int blen, pageinfo *pi)
+{
+	assert(hlen + blen <= NET_MAXPKT);
+
+	// Tiny packets get padded to Ethernet's minimum in buf,
+	// so aren't worth sending by reference.
+	if (hlen + blen < 64)
+		pi = NULL;
+	return virtio_txv(hdr, hlen, &body, &blen, &pi, 1);
+}
+
+// Transmit a jumbo frame of a header followed by npg whole pages,
+// which the device fetches straight from the pages.
+int virtio_txpages(void *hdr, int hlen, void **pgs, int npg)
+{
+	assert(hlen + npg*PAGESIZE <= NET_JUMBOPKT);
+
+	int blen[VIRTIO_TX_NBODY];
+	pageinfo *pis[VIRTIO_TX_NBODY];
+	int i;
+	for (i = 0; i < npg; i++) {
+		blen[i] = PAGESIZE;
+		pis[i] = mem_ptr2pi(pgs[i]);
+	}
+	return virtio_txv(hdr, hlen, pgs, blen, pis, npg);
+}
+
+// Give receive slot s back to the device to fill.
+static void virtio_rxpost(int s)
+{
+	struct vring_desc *d = &virtio.rxq.desc[s*2];
+	d[0].addr = mem_phys(&virtio.rx[s].hdr);
+	d[0].len = sizeof(virtio.rx[s].hdr);
+	d[0].flags = VRING_DESC_F_WRITE | VRING_DESC_F_NEXT;
+	d[0].next = s*2 + 1;
+	d[1].addr = mem_phys(virtio.rx[s].buf);
+	d[1].len = sizeof(virtio.rx[s].buf);
+	d[1].flags = VRING_DESC_F_WRITE;
+	virtq_post(&virtio.rxq, s*2);
+}
+
+// Is there a received packet waiting for us to claim?
+static bool virtio_rx_pending(void)
+{
+	return virtio.rxq.usedlast != virtio.rxq.used->idx;
+}
+
+// Dispatch up to 'budget' newly-filled receive buffers
+// to the kernel's network protocol stack, returning how many we handled.
+static int virtio_rx(int budget)
+{
+	assert(spinlock_holding(&virtio.lock));
+
+	struct virtq *vq = &virtio.rxq;
+	int done = 0;
+
+	// The network stack might transmit during this upcall,
+	// so we release the lock while it runs, as the e100 driver does,
+	// claiming a batch of buffers at a time to do so less often.
+	// Other CPUs may concurrently claim the buffers after ours.
+	while (done < budget && virtio_rx_pending()) {
+		int slot[VIRTIO_RX_BATCH], len[VIRTIO_RX_BATCH];
+		int k, n = 0;
+		while (n < VIRTIO_RX_BATCH && done + n < budget
+				&& virtio_rx_pending()) {
+			struct vring_used_elem *e =
+				&vq->used->ring[vq->usedlast % vq->size];
+			slot[n] = e->id / 2;
+			len[n] = e->len - sizeof(struct virtio_net_hdr);
+			vq->usedlast++;
+			n++;
+		}
+		done += n;
+
+		spinlock_release(&virtio.lock);
+		for (k = 0; k < n; k++) {
+			if (len[k] >= 0 && len[k] <= NET_JUMBOPKT)
+				net_rx(virtio.rx[slot[k]].buf, len[k]);
+			else {
+				warn("virtio: bad receive length %d", len[k]);
+				net_statinc(rxerr);
+			}
+		}
+		spinlock_acquire(&virtio.lock);
+
+		for (k = 0; k < n; k++)
+			virtio_rxpost(slot[k]);
+	}
+	if (done > 0)
+		virtq_kick(VIRTIO_NET_RXQ, vq);
+	return done;
+}
+
+// Reclaim finished transmits and drain up to one budget of received packets
+// with receive interrupts off.
+// Once the receive ring is empty, switch back to interrupts.
+static void virtio_poll_locked(void)
+{
+	assert(spinlock_holding(&virtio.lock));
+	assert(virtio.polling);
+
+	virtio_txreap();
+	virtio_rx(VIRTIO_RX_BUDGET);
+
+	if (virtio_rx_pending())
+		return;		// Still busy: keep polling from the timer
+
+	// Turn interrupts back on and check again, in case a packet
+	// slipped in after we looked but before the device saw the flag.
+	virtio.rxq.avail->flags = 0;
+	virtio.polling = 0;
+	virtio_mb();
+	if (virtio_rx_pending()) {
+		virtio.rxq.avail->flags = VRING_AVAIL_F_NO_INTERRUPT;
+		virtio.polling = 1;
+	}
+}
+
+// Called on every timer tick to reclaim transmit slots
+// and continue draining a busy receive ring.
+void virtio_poll(void)
+{
+	if (!virtio_present || (!virtio.polling
+			&& virtio.txq.usedlast == virtio.txq.used->idx))
+		return;		// Racy peek: nothing to do
+	spinlock_acquire(&virtio.lock);
+	if (virtio.polling)
+		virtio_poll_locked();
+	else
+		virtio_txreap();
+	spinlock_release(&virtio.lock);
+}
+
+void virtio_intr(void)
+{
+	spinlock_acquire(&virtio.lock);
+
+	inb(virtio.iobase + VIRTIO_PCI_ISR);	// acknowledge the interrupt
+
+	// Turn off further receive interrupts and drain the ring by polling,
+	// until it's empty, instead of taking one interrupt per frame.
+	if (!virtio.polling) {
+		virtio.rxq.avail->flags = VRING_AVAIL_F_NO_INTERRUPT;
+		virtio.polling = 1;
+	}
+	virtio_poll_locked();	// releases and re-acquires virtio.lock!
+
+	spinlock_release(&virtio.lock);
+}
+
+int virtio_attach(struct pci_func *pcif)
+{
+	int i;
+
+	if (net_netdev != NULL)
+		return 0;	// Already using another network card
+
+	pci_func_enable(pcif);
+
+	virtio_irq = pcif->irq_line;
+	virtio.iobase = pcif->reg_base[0];
+
+	// Reset the device and tell it we're here
+	outb(virtio.iobase + VIRTIO_PCI_STATUS, 0);
+	outb(virtio.iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACK);
+	outb(virtio.iobase + VIRTIO_PCI_STATUS,
+		VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER);
+
+	// We need only the MAC address, which gives us our node number
+	if (!(inl(virtio.iobase + VIRTIO_PCI_HOSTFEAT) & VIRTIO_NET_F_MAC)) {
+		warn("virtio: device has no MAC address");
+		goto fail;
+	}
+	outl(virtio.iobase + VIRTIO_PCI_GUESTFEAT, VIRTIO_NET_F_MAC);
+
+	if (!virtio_qinit(VIRTIO_NET_RXQ, &virtio.rxq, VIRTIO_RX_SLOTS * 2)
+	    || !virtio_qinit(VIRTIO_NET_TXQ, &virtio.txq,
+				VIRTIO_TX_SLOTS * VIRTIO_TX_DESCS))
+		goto fail;
+
+	// All transmit slots start out free, and we never want to hear
+	// about transmits finishing: we check as we go.
+	virtio.tx_free = -1;
+	for (i = VIRTIO_TX_SLOTS - 1; i >= 0; i--) {
+		memset(&virtio.tx[i], 0, sizeof(virtio.tx[i]));
+		virtio.tx[i].next = virtio.tx_free;
+		virtio.tx_free = i;
+	}
+	virtio.txq.avail->flags = VRING_AVAIL_F_NO_INTERRUPT;
+
+	// Give the device every receive buffer to fill
+	for (i = 0; i < VIRTIO_RX_SLOTS; i++)
+		virtio_rxpost(i);
+
+	// Read the NIC's MAC address
+	for (i = 0; i < 6; i++)
+		virtio.mac[i] = inb(virtio.iobase + VIRTIO_PCI_NETMAC + i);
+	cprintf("virtio: MAC address");
+	for (i = 0; i < 6; i++)
+		cprintf("%c%02x", i ? ':' : ' ', virtio.mac[i]);
+	cprintf("\n");
+
+	// Enable network card interrupts, as MSIs if it can do them
+	if (!pci_msi_enable(pcif)) {
+		pic_enable(virtio_irq);
+		ioapic_enable(virtio_irq);
+	}
+
+	// Start receiving packets
+	outb(virtio.iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACK
+		| VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+	spinlock_acquire(&virtio.lock);
+	virtq_kick(VIRTIO_NET_RXQ, &virtio.rxq);
+	spinlock_release(&virtio.lock);
+
+	virtio_present = 1;
+	virtio_netdev.irq = virtio_irq;
+	net_attach(&virtio_netdev, virtio.mac);
+	return 1;
+
+fail:
+	outb(virtio.iobase + VIRTIO_PCI_STATUS, VIRTIO_STATUS_FAILED);
+	return 0;
+}
@@ -0,0 +1,27 @@
+/*
+ * Virtio network device driver definitions.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#ifndef PIOS_DEV_VIRTIO_H
+#define PIOS_DEV_VIRTIO_H
+#ifndef PIOS_KERNEL
+# error "This is a kernel header; user programs should not #include it"
+#endif
+
+struct pci_func;
+struct pageinfo;
+
+extern bool virtio_present;
+extern uint8_t virtio_irq;
+
+int  virtio_attach(struct pci_func *pcif);
+int  virtio_txref(void *hdr, int hlen, void *body, int blen,
+		struct pageinfo *pi);
+int  virtio_txpages(void *hdr, int hlen, void **pgs, int npg);
+void virtio_intr(void);
+void virtio_poll(void);
+
+#endif	// PIOS_DEV_VIRTIO_H
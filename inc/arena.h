@@ -0,0 +1,42 @@
+/*
+ * Arenas for batch-scoped memory allocation.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#ifndef PIOS_INC_ARENA_H
+#define PIOS_INC_ARENA_H 1
+
+#include <types.h>
+
+
+#define ARENA_MAX	8		// Arenas a process can have at once
+
+// An arena hands out memory from its own part of the address space
+// (see inc/vm.h) by just bumping a pointer, and frees it all at once.
+// Arenas live in scratch space, so unlike the malloc() heap,
+// an arena's memory belongs to the thread that allocates it
+// and is never merged back into the thread's parent.
+typedef struct arena {
+	uintptr_t	lo;		// Start of the arena's address space
+	uintptr_t	top;		// Start of the arena's unused space
+	uintptr_t	lim;		// End of the memory mapped so far
+} arena;
+
+// Get a fresh, empty arena, or NULL with errno set if all are in use.
+arena *	arena_new(void);
+
+// Allocate size bytes, 8-byte aligned and initially zero.
+// Returns NULL with errno set to ENOMEM if the arena is full.
+void *	arena_alloc(arena *a, size_t size);
+
+// Free everything allocated from arena a at once,
+// giving its memory back to the kernel but keeping the arena for reuse.
+void	arena_reset(arena *a);
+
+// Reset arena a and release it for a later arena_new() to hand out.
+void	arena_destroy(arena *a);
+
+
+#endif	// !PIOS_INC_ARENA_H
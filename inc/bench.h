@@ -0,0 +1,32 @@
+/*
+ * Shared trial harness for the benchmark programs, user/bench.c
+ * and user/migrbench.c: each runs a benchmark BENCH_TRIALS times
+ * and reports the minimum and median of the per-operation times.
+ *
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#ifndef PIOS_INC_BENCH_H
+#define PIOS_INC_BENCH_H 1
+
+#include <types.h>
+
+
+#define BENCH_TRIALS	5		// Trials per benchmark and parameter
+
+#define BENCH_MIN(t)	((t)[0])		// Best of sorted times t
+#define BENCH_MEDIAN(t)	((t)[BENCH_TRIALS/2])	// Median of sorted times t
+
+
+// Insert trial time c into t, whose first n times are already sorted,
+// so that its first n+1 are.
+static void gcc_inline
+bench_insert(uint64_t t[BENCH_TRIALS], int n, uint64_t c)
+{
+	int j;
+	for (j = n; j > 0 && t[j-1] > c; j--)
+		t[j] = t[j-1];
+	t[j] = c;
+}
+
+#endif /* !PIOS_INC_BENCH_H */
@@ -25,5 +25,8 @@
 #define EAGAIN		8	/* Resource temporarily unavailable */
 #define ECHILD		9	/* No child processes */
 #define ECONFLICT	10	/* Conflict detected (PIOS-specific) */
+#define EBADF		11	/* Bad file descriptor */
+#define EACCES		12	/* Permission denied */
+#define ENOMEM		13	/* Cannot allocate memory */
 
 #endif	// !PIOS_INC_ERRNO_H
@@ -33,6 +33,7 @@
 #define OPEN_MAX	256	// Max number of open files per process
 #define NAME_MAX	63	// Max length of a filename, not inluding null
 #define PATH_MAX	1024	// Max length of a full pathname, incl. null
+#define PIPE_BUF	4096	// Pipe data a writer may get ahead of readers
 
 // File open flags - these belong in fcntl.h according to POSIX
 #define	O_RDONLY	0x0001		// open for reading only
@@ -45,6 +46,8 @@
 #define	O_TRUNC		0x0040		// truncate to zero length
 #define	O_EXCL		0x0080		// error if already exists
 
+#define O_WROTE		0x0100		// internal: data written to a pipe via fd
+
 // Each process contains its own copy of all file system state,
 // which resides between virtual addresses 0x80000000 and 0xc0000000
 // (see the VM_FILELO and VM_FILEHI symbols in inc/vm.h).
@@ -53,16 +56,37 @@
 // contains the file system and process metadata,
 // whose format is defined by the 'filestate' structure below
 // and the various sub-structures it incorporates and builds upon.
-// The remaining 255 4MB areas each hold the content of one file,
-// indexed by an "inode number" from 1 through 255.
-// Thus, this file system can have at most 255 files in existence at once,
-// each having a maximum size of PTSIZE bytes (4MB).
+// The remaining 255 4MB areas are data "windows" holding file content,
+// numbered 1 through 255 (see FILEDATA below).
+// Inodes are allocated separately from windows, from a much larger table,
+// and a file only takes up storage once it has content:
+// a small file lives in one FILE_SLOTSIZE slot of a window shared
+// with other small files, and a file that outgrows its slot moves
+// into windows of its own, up to FILE_MAXEXT windows in all
+// (see fileinode.win below, and fileino_window() in lib/file.c).
+// Thus this file system can hold thousands of small files at once,
+// or a few hundred big ones.
 
-#define FILE_INODES	OPEN_MAX		// Max number of files or "inodes"
-#define	FILE_MAXSIZE	(1<<22)		// Max size of a single file - 4MB
+#define FILE_INODES	4096		// Max number of files or "inodes"
+#define FILE_WINDOWS	256		// Number of 4MB areas, incl. filestate
+#define FILE_DHASH	1024		// Buckets in directory entry index
+#define FILE_CHGLOG	64		// Recent inode changes remembered
+#define	FILE_WINSIZE	(1<<22)		// Size of one file data window - 4MB
+#define	FILE_SLOTSIZE	(1<<16)		// Size of a small file's slot - 64KB
+#define	FILE_NSLOTS	(FILE_WINSIZE/FILE_SLOTSIZE) // Slots per shared window
+#define	FILE_MAXEXT	16		// Max data windows in a single file
+#define	FILE_MAXSIZE	(FILE_MAXEXT*FILE_WINSIZE) // Max file size - 64MB
 
 #define FILESVA	0x80000000		// Virtual address of file state area
-#define FILEDATA(ino)	((void*)FILESVA + ((ino) << 22)) // File data per inode
+#define FILEDATA(w)	((void*)FILESVA + ((w) << 22)) // Data window number w
+
+// Values for filestate.winuse other than owning inode numbers
+#define FILEWIN_FREE	0		// Window holds no file content
+#define FILEWIN_SHARED	0xffff		// Window is divided into slots
+
+// Number of data windows a file of a given size occupies
+#define FILE_NWIN(size)	\
+	((size) <= FILE_WINSIZE ? 1 : ((size) + FILE_WINSIZE-1) / FILE_WINSIZE)
 
 struct stat;
 
@@ -92,7 +116,7 @@ typedef struct filedesc {		// Per-open file descriptor state
 
 // Per-file "inode" metadata structure.
 // These inode structs live in the large 'filestate' struct below;
-// there are 256 of them (FILE_INODES) in a given process's file system,
+// there are 4096 of them (FILE_INODES) in a given process's file system,
 // the first of which is always unused (see FILEINO_NULL below),
 // and the next few of which have reserved uses (FILE_INO_*).
 //
@@ -107,6 +131,15 @@ typedef struct fileinode {		// Per-file state - like an "inode"
 	int	rino;			// Parent's inode this corresponds to
 	int	rver;			// Version at last reconcile w/ parent
 	size_t	rlen;			// Size when last reconciled w/ parent
+
+	int	dhnext;			// Next inode in same dhash chain
+
+	// Where our content lives, local to each process so not reconciled:
+	// file bytes from i*FILE_WINSIZE on live in window win[i],
+	// unless slot is nonzero, in which case they all live
+	// in slot number slot-1 of the shared window win[0].
+	uint8_t	win[FILE_MAXEXT];
+	uint8_t	slot;
 } fileinode;
 
 
@@ -116,13 +149,26 @@ typedef struct fileinode {		// Per-file state - like an "inode"
 // on top of PIOS's minimalistic GET/PUT/RET process management API.
 typedef struct procinfo {
 	int	state;			// Current state of this child process
+	uint32_t chgsync;		// Our chgseq when last reconciled with it
 } procinfo;
 
 // Values for procinfo.state
 #define PROC_FREE	0		// Unused child, available for fork()
 #define PROC_RESERVED	(-1)		// Child reserved for special purpose
 #define PROC_FORKED	1		// This child forked and running
-#define PROC_CHILDREN	FILE_INODES		// Size of child array
+#define PROC_WAITING	2		// Forked child parked waiting for input
+#define PROC_CHILDREN	256		// Size of child array
+
+
+// Executable image that exec has already laid out (see lib/exec.c),
+// kept ready to map in the address space of a reserved child process.
+#define EXEC_CACHE	8		// Number of executable images to keep
+typedef struct execimage {
+	int	ino;			// Executable's inode, 0 if entry unused
+	int	ver;			// Inode version the image was built from
+	size_t	size;			// Inode size the image was built from
+	uint32_t used;			// Last use, for LRU replacement
+} execimage;
 
 
 // User-space Unix process state.
@@ -133,7 +179,33 @@ typedef struct filestate {
 	int		status;		// Process exit status - set on exit()
 	filedesc	fd[OPEN_MAX];	// File descriptor table
 	fileinode	fi[FILE_INODES]; // "Inodes" describing actual files
+	bool		dhvalid;	// Directory entry index is up to date
+	int		dhash[FILE_DHASH]; // Inodes by (dino, name) hash
+
+	// Log of inodes changed, for reconcile() to visit only those:
+	// change number n changed inode chglog[n % FILE_CHGLOG].
+	uint32_t	chgseq;		// Number of changes ever logged
+	uint32_t	chgsync;	// chgseq when parent last reconciled us
+	int		chglast;	// Inode logged last since a reconcile
+	uint16_t	chglog[FILE_CHGLOG];
+
+	// Data window allocation: the inode owning each window
+	// or FILEWIN_FREE or FILEWIN_SHARED, and in each shared window,
+	// the inode owning each slot or 0 if the slot is free.
+	uint16_t	winuse[FILE_WINDOWS];
+	uint16_t	slotuse[FILE_WINDOWS][FILE_NSLOTS];
 	procinfo	child[PROC_CHILDREN]; 	// Unix state of child processes
+	execimage	image[EXEC_CACHE]; // Prepared executable images
+	uint32_t	imgclock;	// Use counter for image[].used
+	int		zygote;		// Child keeping spawn()'s file state, or 0
+	uint32_t	zygsync;	// Our chgseq when it was last brought up to date
+	int		zyglast;	// Our chglast then
+	int		parfirst;	// First child in lib/parallel.c's pool
+	int		parworkers;	// Its size, 0 if none, -1 in a worker
+	int		heaparena;	// Heap arena malloc() uses (lib/malloc.c)
+	uint64_t	heapthreads;	// Arenas our threads have, bit a-1 for a
+	uint8_t		heapchild[PROC_CHILDREN]; // Each child's arena, or 0
+	int		consreader;	// Child reading our console input, or 0
 } filestate;
 
 #define FILES		((filestate *) FILESVA)
@@ -144,7 +216,8 @@ extern filestate *const files;		// always = FILES
 #define FILEINO_CONSIN	1		// Inode 1 holds console input
 #define FILEINO_CONSOUT	2		// Inode 2 holds console output
 #define FILEINO_ROOTDIR	3		// Inode 3 is the root dir
-#define FILEINO_GENERAL	4		// First general-purpose inode
+#define FILEINO_STATS	4		// Inode 4 holds kernel statistics
+#define FILEINO_GENERAL	5		// First general-purpose inode
 
 
 
@@ -169,16 +242,41 @@ extern filestate *const files;		// always = FILES
 	(fileino_alloced(ino) && S_ISREG(files->fi[ino].mode))
 #define fileino_isdir(ino)	\
 	(fileino_alloced(ino) && S_ISDIR(files->fi[ino].mode))
+#define fileino_ispipe(ino)	\
+	(fileino_isreg(ino) && (files->fi[ino].mode & S_IFPART) \
+	 && (ino) != FILEINO_CONSIN)
+
+// Size of the storage holding window 0 of a file: a slot or a whole window.
+#define fileino_segsize(fs, ino) \
+	((fs)->fi[ino].slot ? FILE_SLOTSIZE : FILE_WINSIZE)
+
+// The console and statistics files stay in windows 1, 2, and 4,
+// where the kernel expects them.
+#define fileino_maxsize(ino) \
+	((ino) < FILEINO_GENERAL ? FILE_WINSIZE : FILE_MAXSIZE)
 
 
 int fileino_alloc(void);
 int fileino_create(filestate *st, int dino, const char *name);
+int fileino_lookup(filestate *fs, int dino, const char *name, int len);
+void fileino_setname(filestate *fs, int ino, int dino, const char *name);
+void fileino_reindex(filestate *fs);
+void fileino_logchg(filestate *fs, int ino);
 ssize_t fileino_read(int ino, off_t ofs, void *buf,
 			size_t eltsize, size_t count);
 ssize_t fileino_write(int ino, off_t ofs, const void *buf,
 			size_t eltsize, size_t count);
 int fileino_stat(int ino, struct stat *statbuf);
 int fileino_truncate(int ino, off_t newsize);
+void fileino_endpipe(int ino);
+size_t fileino_maplim(off_t size);
+size_t fileino_winlim(off_t size, int k);
+void *fileino_window(filestate *fs, int ino, int k);
+int fileino_reserve(filestate *fs, int ino, off_t size, void **oldslot);
+void fileino_dropwindows(filestate *fs, int ino, int nwin);
+int fileino_grow(int ino, off_t newsize);
+int fileino_unslot(int ino);
+void fileino_copy(int ino, off_t ofs, void *buf, size_t len, bool towrite);
 int fileino_flush(int ino);
 
 filedesc *filedesc_alloc(void);
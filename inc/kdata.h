@@ -0,0 +1,82 @@
+/*
+ * The kernel data page: a read-only page the kernel maps at VM_KDATA
+ * for processes with PFF_NONDET, so that they can read the clock,
+ * where they're running, and their own accounting without a system call.
+ * Other processes get a page fault if they touch it.
+ *
+ * Each CPU has its own page, which the kernel maps into whichever process
+ * it's running and brings up to date every time it returns to user mode.
+ * A process can be moved to another CPU or node between any two
+ * instructions, though, so a read of more than one field has to be
+ * retried until the seq word is the same before and after it
+ * (kdata_clock() and kdata_acct() below do this).
+ *
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#ifndef PIOS_INC_KDATA_H
+#define PIOS_INC_KDATA_H 1
+
+#include <types.h>
+#include <x86.h>
+#include <vm.h>
+#include <syscall.h>
+
+
+typedef struct kdata {
+	// Bumped by KDATA_SEQONE each time the kernel returns to user mode
+	// on this CPU, with this CPU's index in the bits below that.
+	uint32_t	seq;
+
+	// Where we're running, and the clock SYS_CLOCK reads.
+	uint8_t		node;		// This node's number
+	uint8_t		cpu;		// This CPU's index: 0 up to ncpu
+	uint16_t	ncpu;		// Number of CPUs on this node
+	uint64_t	tscfreq;	// TSC ticks per second
+	uint64_t	tsc0;		// TSC at nanosecond 0 of the clock
+	uint32_t	mult;		// Nanoseconds per TSC tick,
+	uint32_t	shift;		//	times 2^shift
+
+	// The running process's accounting as GET with SYS_ACCT gives it,
+	// as of its last return to user mode.  acct.tsc leaves out
+	// the time since rdtsc() read runtsc, when it last started running.
+	uint64_t	runtsc;
+	procacct	acct;
+} kdata;
+
+#define KDATA_SEQONE	0x100		// seq's increment; below it, cpu
+
+#define KDATA		((const volatile kdata *) VM_KDATA)
+
+
+// Nanoseconds since this node booted, as sys_clock() would return.
+static uint64_t gcc_inline
+kdata_clock(void)
+{
+	const volatile kdata *kd = KDATA;
+	uint32_t seq;
+	uint64_t d, ns;
+	do {
+		seq = kd->seq;
+		d = rdtsc() - kd->tsc0;
+		ns = ((uint64_t)(uint32_t)d * kd->mult >> kd->shift)
+			+ ((d >> 32) * kd->mult << (32 - kd->shift));
+	} while (kd->seq != seq);
+	return ns;
+}
+
+// Copy out our accounting as of now, and return the CPU we're on.
+static int gcc_inline
+kdata_acct(procacct *acct)
+{
+	const volatile kdata *kd = KDATA;
+	uint32_t seq;
+	do {
+		seq = kd->seq;
+		*acct = kd->acct;
+		acct->tsc += rdtsc() - kd->runtsc;
+	} while (kd->seq != seq);
+	return seq % KDATA_SEQONE;
+}
+
+#endif /* !PIOS_INC_KDATA_H */
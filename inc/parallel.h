@@ -0,0 +1,43 @@
+/*
+ * Parallel loops and reductions over deterministic threads.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#ifndef PIOS_INC_PARALLEL_H
+#define PIOS_INC_PARALLEL_H 1
+
+#include <types.h>
+
+
+// Ways to combine the partial results of a parallel reduction
+typedef enum par_op {
+	PAR_SUM,
+	PAR_MIN,
+	PAR_MAX
+} par_op;
+
+// Each of these functions runs over a subrange [lo,hi) of the loop.
+typedef void (*par_forfn)(int lo, int hi, void *arg);
+typedef int64_t (*par_intfn)(int lo, int hi, void *arg);
+typedef double (*par_doublefn)(int lo, int hi, void *arg);
+
+// Split [lo,hi) into at most one contiguous piece per CPU,
+// none smaller than grain iterations, and run fn over each piece
+// in a pool of threads kept from one call to the next.
+// Pieces run as tfork() threads do, so each one's writes to shared memory
+// are merged back into ours when all are done, and must not conflict.
+// Called from inside a piece, these just run the whole range serially.
+void	parallel_for(int lo, int hi, int grain, par_forfn fn, void *arg);
+
+// Like parallel_for(), but combine the results fn returns for the pieces
+// with op, in the order of the pieces, and return the result.
+// The range must not be empty.
+// A double reduction's rounding may depend on the number of pieces.
+int64_t	parallel_reduce_int(int lo, int hi, int grain, par_op op,
+				par_intfn fn, void *arg);
+double	parallel_reduce_double(int lo, int hi, int grain, par_op op,
+				par_doublefn fn, void *arg);
+
+#endif	// !PIOS_INC_PARALLEL_H
@@ -29,6 +29,7 @@ void	vprintfmt(void (*putch)(int, void*), void *putdat,
 // These are available in both the PIOS kernel and in user space,
 // but are implemented differently in user space and in the kernel.
 void	cputs(const char *str);			// lib/cputs.c or kern/cons.c
+void	cwrite(const char *buf, size_t len);	// lib/cputs.c or kern/cons.c
 int	cprintf(const char *fmt, ...);		// lib/cprintf.c
 int	vcprintf(const char *fmt, va_list);	// lib/cprintf.c
 
@@ -40,6 +41,11 @@ int	vcprintf(const char *fmt, va_list);	// lib/cprintf.c
 
 #define EOF		(-1)	/* return value indicating end-of-file */
 
+#define BUFSIZ		1024	/* default stream buffer size */
+#define _IOFBF		1	/* setvbuf: fully buffered */
+#define _IOLBF		2	/* setvbuf: line buffered */
+#define _IONBF		3	/* setvbuf: unbuffered */
+
 typedef struct filedesc FILE;
 
 extern FILE *const stdin;
@@ -78,6 +84,10 @@ int	feof(FILE *fd);
 int	ferror(FILE *fd);
 void	clearerr(FILE *fd);
 int	fflush(FILE *fd);
+int	setvbuf(FILE *fh, char *buf, int mode, size_t size);
+void	setbuf(FILE *fh, char *buf);
+int	fflushbuf(FILE *fh);	// PIOS: write out buffer(s) without syncing
+void	fclosebuf(FILE *fh);	// PIOS: write out and forget fh's buffer
 
 // lib/readline.c
 char*	readline(const char *prompt);
@@ -26,6 +26,7 @@ void *	memcpy(void *dst, const void *src, size_t len);
 void *	memmove(void *dst, const void *src, size_t len);
 int	memcmp(const void *s1, const void *s2, size_t len);
 void *	memchr(const void *str, int c, size_t len);
+extern int string_sse2;		// memmove/memset may use SSE2 (MOVNTI)
 
 long	strtol(const char *s, char **endptr, int base);
 
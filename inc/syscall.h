@@ -19,18 +19,44 @@
 #define SYS_PUT		0x00000001	// Push data to child and start it
 #define SYS_GET		0x00000002	// Pull results from child
 #define SYS_RET		0x00000003	// Return to parent
+#define SYS_VEC		0x00000004	// Do a vector of GETs and PUTs
+#define SYS_CWRITE	0x00000005	// Write buffer to debugging console
+#define SYS_LOCKSTAT	0x00000006	// Print kernel lock contention report
+#define SYS_NETSTAT	0x00000007	// Get network statistics counters
+#define SYS_NCPU	0x00000008	// Get number of CPUs on this node
+#define SYS_MERGEOP	0x00000009	// Set how merges combine a memory range
+#define SYS_CLOCK	0x0000000a	// Get nanoseconds since boot
+#define SYS_CKPT	0x0000000b	// Checkpoint or restore a child's subtree
+#define SYS_PROF	0x0000000c	// Control the kernel's sampling profiler
+#define SYS_TRACE	0x0000000d	// Control or read the kernel event trace
+#define SYS_ADVISE	0x0000000e	// Hint how we'll use a memory range
+					// (the last: see syscall() in the kernel)
 
 #define SYS_START	0x00000010	// Put: start child running
+#define SYS_GANG	0x00000020	// Put: start child in parent's gang
+#define SYS_ANY		0x00000040	// Get: wait for any child in a set
+#define SYS_POLL	0x00000080	// Get: don't wait if child is running
+#define SYS_RESTORE	0x00000010	// Ckpt: restore child instead of saving
 
-#define SYS_REGS	0x00001000	// Get/put register state
-#define SYS_FPU		0x00002000	// Get/put FPU state (with SYS_REGS)
+#define SYS_REGS	0x00001000	// Get/put general register state
+#define SYS_FPU		0x00002000	// Get/put FPU state
 #define SYS_MEM		0x00004000	// Get/put memory mappings
+#define SYS_ACCT	0x00008000	// Get resource usage (not with SYS_STATE)
+#define SYS_STATUS	0x00100000	// Get: just trapno through esp
+#define SYS_STATE	0x00103000	// Any of the above parts of a procstate
 
 #define SYS_MEMOP	0x00030000	// Get/put memory operation
 #define SYS_ZERO	0x00010000	// Get/put fresh zero-filled memory
 #define SYS_COPY	0x00020000	// Get/put virtual copy
 #define SYS_MERGE	0x00030000	// Get: diffs only from last snapshot
 #define SYS_SNAP	0x00040000	// Put: snapshot child state
+#define SYS_FREE	0x00080000	// Put: discard child (other flags ignored)
+#define SYS_SHARE	0x00800000	// Get/put: with SYS_COPY, share outright
+
+#define SYS_ADVICE	0x00600000	// Put: hint about child memory (below)
+#define SYS_WILLNEED	0x00200000	// Will touch it soon: bring it in now
+#define SYS_SEQUENTIAL	0x00400000	// Will write it in order: fault ahead
+#define SYS_DONTNEED	0x00600000	// Done with it: give its pages back
 
 #define SYS_PERM	0x00000100	// Set memory permissions on get/put
 #define SYS_READ	0x00000200	// Read permission (NB: in PTE_AVAIL)
@@ -43,36 +69,282 @@
 //	EBX:	User pointer to string to output to debug console,
 //		up to CPUTS_MAX characters long (see inc/assert.h)
 
+// Register conventions for CWRITE system call (counted console output):
+//	EAX:	System call command
+//	EBX:	User pointer to characters to output to debug console
+//	ECX:	Number of characters, which may be any length
+
+// Register conventions for LOCKSTAT system call:
+//	EAX:	System call command
+//	EBX:	Number of most-contended lock sites to report
+
 
 // Register conventions on GET/PUT system call entry:
 //	EAX:	System call command/flags (SYS_*)
-//	EDX:	bits 15-8: Node number to migrate to, 0 for current
-//		bits 7-0: Child process number on above node to get/put
-//	EBX:	Get/put CPU state pointer for SYS_REGS and/or SYS_FPU)
+//	EDX:	bits 23-16: Number of children to get/put, 0 meaning 1
+//		bits 15-8: Node number to migrate to, 0 for current
+//		bits 7-0: (First) child process number on above node to get/put
+//	A PUT or GET on a range of children waits for all of them to stop,
+//	then does the same thing to each in turn.  A GET with SYS_STATE flags
+//	returns an array of procstates, one per child;
+//	a GET with SYS_ACCT instead returns an array of procaccts.
+//	EBX:	Get/put CPU state pointer for SYS_STATE flags,
+//		or procacct pointer for SYS_ACCT
 //	ECX:	Get/put memory region size
 //	ESI:	Get/put local memory region start
 //	EDI:	Get/put child memory region start
 //	EBP:	reserved
 
+// Child number argument naming n children starting with 'child'
+#define SYS_RANGE(child, n)	((child) | (n) << 16)
+#define SYS_NCHILDREN(edx)	MAX(((edx) >> 16) & 0xff, 1)
+
+// A SYS_COPY with SYS_SHARE maps the very same physical pages in both
+// address spaces instead of copy-on-write copies, with the source's
+// nominal permissions: writes to them on either side, and in any process
+// that later gets a copy of them, are visible to all the others at once,
+// and merges leave them alone.  Only processes with PFF_NONDET may
+// share memory this way; others get a T_GPFLT.  Pages are only shared
+// within a node: a process that migrates takes copies of them with it.
+
+// Register conventions for VEC system call (vector of GETs and PUTs):
+//	EAX:	System call command (SYS_VEC)
+//	EBX:	User pointer to an array of sysvec structs (see below)
+//	ECX:	Number of entries in the array
+//	Each entry is done in turn, as sys_get() or sys_put() would,
+//	but invalidating the TLB once for the whole vector.
+//	On return EBX points past the array and ECX is zero.
+
+// Register conventions for GET with SYS_ANY (wait for any child):
+//	EAX:	System call command/flags (SYS_GET | SYS_ANY)
+//	EBX:	User pointer to a 256-bit set of local child numbers
+//	On return, EDX holds the number of a stopped child in the set:
+//	whichever stopped first if the caller has PFF_NONDET set,
+//	otherwise (deterministically) the lowest-numbered child in the set.
+
+// GET with SYS_POLL, alone or with SYS_ANY, never waits for a child:
+// on return EAX is 0 if the GET was done, or SYS_RUNNING if a child
+// it would have waited for was still running, in which case it did nothing
+// (and, with SYS_ANY, EDX is -1).  Since which it is depends on timing,
+// only processes with PFF_NONDET may poll; others get a T_GPFLT.
+#define SYS_RUNNING	1
+
+// Register conventions for NETSTAT system call:
+//	EAX:	System call command (SYS_NETSTAT)
+//	EBX:	User pointer to a netstats struct (see below) to fill in
+//	Only processes with PFF_NONDET may ask; others get a T_GPFLT.
+
+// Register conventions for NCPU system call:
+//	EAX:	System call command (SYS_NCPU)
+//	On return, EAX holds the number of CPUs on the node we're running on.
+
+// Register conventions for MERGEOP system call:
+//	EAX:	System call command (SYS_MERGEOP)
+//	EBX:	Start of our memory range, page-aligned
+//	ECX:	Size of the range, page-aligned
+//	EDX:	Merge operator (MERGEOP_* below), or MERGEOP_NONE to remove
+// When we GET with SYS_MERGE, each 32-bit word in the range that both
+// the child and we changed since the child's snapshot is combined
+// with the operator instead of being a merge conflict.
+// Words only one side changed take that side's value as usual.
+// A new range replaces any earlier ones it overlaps,
+// and up to MERGEOP_NRANGES ranges may be set at once.
+#define MERGEOP_NONE	0	// Conflicting writes are an error
+#define MERGEOP_ADD	1	// Add the child's change to ours
+#define MERGEOP_MIN	2	// Signed minimum of ours and the child's
+#define MERGEOP_MAX	3	// Signed maximum of ours and the child's
+#define MERGEOP_OR	4	// Bitwise OR of ours and the child's
+#define MERGEOP_NOPS	5	// Number of merge operators
+#define MERGEOP_NRANGES	8	// Ranges with operators per process
+
+// Register conventions for ADVISE system call (memory usage hint):
+//	EAX:	System call command (SYS_ADVISE)
+//	EBX:	Start of our memory range, page-aligned
+//	ECX:	Size of the range, page-aligned
+//	EDX:	SYS_WILLNEED, SYS_SEQUENTIAL, or SYS_DONTNEED
+// A PUT with one of these in its SYS_ADVICE bits does the same
+// to the child's range at EDI, after any memory and permission changes.
+// SYS_WILLNEED makes every nominally writable page in the range
+// really writable now, copying shared pages and filling in zero pages,
+// so touching them later takes no faults; if memory runs short it
+// just stops.  On a PUT of nothing else, if some of the child's pages
+// live on other nodes, it starts pulling them back and returns at once.
+// SYS_SEQUENTIAL makes a write fault in the range resolve many pages
+// after it too, from the first fault on; a new range replaces the last
+// one, and a size of zero removes it.  SYS_DONTNEED unmaps the pages
+// in the range, leaving fresh zero pages with the same permissions.
+
+// Register conventions for CKPT system call (checkpoint or restore):
+//	EAX:	System call command/flags (SYS_CKPT, optionally SYS_RESTORE)
+//	EDX:	bits 15-8: Node to keep the checkpoint, other than ours
+//		bits 7-0: Child process number
+//	EBX:	Key naming the checkpoint on that node
+//	Without SYS_RESTORE, waits for the child to stop and saves it,
+//	its descendants, and all their memory to the node under the key,
+//	replacing any checkpoint saved there under the same key before.
+//	Every descendant must be stopped too.  With SYS_RESTORE, makes
+//	the child, which must not exist yet, and its descendants
+//	over again from the checkpoint, fetching their memory lazily:
+//	each process's pages come over when its parent next starts it.
+//	On return EAX is 0 if it worked, SYS_RUNNING if a descendant
+//	was still running, or SYS_NOCKPT if the node could not take
+//	the checkpoint or has none under the key, or a restore went wrong.
+//	Keys are the saving process's own: no other process can replace
+//	or restore its checkpoints.  Whether the node has room depends
+//	on other nodes, so only processes with PFF_NONDET may checkpoint
+//	or restore; others get a T_GPFLT.
+#define SYS_NOCKPT	2
+
+// Register conventions for PROF system call (sampling profiler):
+//	EAX:	System call command (SYS_PROF)
+//	EBX:	PROF_START, PROF_STOP, or PROF_REPORT
+//	ECX:	For PROF_REPORT, number of hottest addresses to print
+// While started, every CPU records where it was on each timer tick.
+// PROF_START discards any earlier samples; PROF_REPORT stops sampling
+// and prints a summary on the console (misc/profsym.sh can turn its
+// addresses into function names).  Only the root process may profile;
+// others get a T_GPFLT.
+#define PROF_START	1
+#define PROF_STOP	2
+#define PROF_REPORT	3
+
+// Register conventions for TRACE system call (kernel event trace):
+//	EAX:	System call command (SYS_TRACE)
+//	EBX:	TRACE_ENABLE or TRACE_READ
+//	ECX:	For TRACE_ENABLE, mask of events to record (1 << TRACE_*),
+//		or 0 to stop; for TRACE_READ, user buffer of tracerecs
+//	EDX:	For TRACE_READ, number of tracerecs the buffer holds
+//	ESI:	For TRACE_READ, which CPU's trace: 0 up to SYS_NCPU's count
+// TRACE_ENABLE returns the previous mask in EAX.
+// Each CPU keeps a ring of its most recent events, in order.
+// TRACE_READ moves up to EDX of the oldest out of one CPU's ring,
+// returning how many in EAX; stop tracing first to get a tidy cut.
+// Only processes with PFF_NONDET may trace; others get a T_GPFLT.
+#define TRACE_ENABLE	1
+#define TRACE_READ	2
+
+// Kernel trace events, and what the three arguments of each hold.
+#define TRACE_SYSCALL	0	// System call: EAX command, EDX, EIP
+#define TRACE_TRAP	1	// Other trap or interrupt: trapno, EIP, err
+#define TRACE_SWITCH	2	// Process starts to run: proc, EIP, 0
+#define TRACE_PGFLT	3	// Page fault: address, EIP, err
+#define TRACE_MERGE	4	// Merge done: dest address, size, TSC cycles
+#define TRACE_NETTX	5	// Packet sent: message type, length, dest node
+#define TRACE_NETRX	6	// Packet received: type, length, source node
+#define TRACE_RETX	7	// Retransmit timeout: proc, backoff, 0
+#define TRACE_NEVENTS	8
+
 
 #ifndef __ASSEMBLER__
 
-// Process state save area format for GET/PUT with SYS_REGS flags
+// Process state save area format for GET/PUT with SYS_STATE flags.
+// Only the parts the flags ask for are copied, each in its place:
+// SYS_REGS tf and pff, SYS_FPU fx, and SYS_STATUS (GET only)
+// tf.trapno through tf.esp, all a parent waiting for a child usually needs.
+// A GET with SYS_STATUS and SYS_FPU but not SYS_REGS copies everything
+// from tf.trapno to the end.
+// A PUT with SYS_STATUS, or a GET with both SYS_STATE flags and SYS_ACCT,
+// gets a T_GPFLT.
 typedef struct procstate {
 	trapframe	tf;		// general registers
 	uint32_t	pff;		// process feature flags - see below
 	fxsave		fx;		// x87/MMX/XMM registers
 } procstate;
 
+// A process's resource usage, as returned by GET with SYS_ACCT:
+// its own, plus its children's as of the last time it did a GET or PUT
+// on each of them, which it can only do once they've stopped,
+// and so on down the tree.
+typedef struct procacct {
+	uint64_t	tsc;		// TSC cycles run, in user mode or kernel
+	uint32_t	syscalls;	// System calls, counting restarts
+	uint32_t	cowfaults;	// Write faults on copy-on-write pages
+	uint32_t	zerofaults;	// Write faults on fresh zero pages
+	uint32_t	pulls;		// Pages pulled from other nodes
+	uint32_t	merged;		// Pages merged page by page into a parent
+	uint32_t	conflicts;	// Merge conflicts in those pages
+	uint32_t	migrations;	// Arrivals on another node
+} procacct;
+
+// One entry in a SYS_VEC vector: a GET or PUT with its registers
+typedef struct sysvec {
+	uint32_t	cmd;		// SYS_GET or SYS_PUT with flags: EAX
+	uint32_t	child;		// node and child number: EDX
+	procstate	*save;		// CPU state pointer: EBX
+	uint32_t	size;		// memory region size: ECX
+	void		*src;		// memory region source: ESI
+	void		*dst;		// memory region destination: EDI
+} sysvec;
+
+// This node's network statistics since boot, as returned by SYS_NETSTAT.
+// Counters keep changing while we copy them, so it's just a snapshot.
+#define NETSTAT_NTYPES	16		// Message types counted, by number
+#define NETSTAT_NHIST	12		// Pull latency histogram buckets
+typedef struct netstats {
+	uint32_t	txpkts[NETSTAT_NTYPES];	// Packets sent, by type
+	uint64_t	txbytes[NETSTAT_NTYPES]; // Bytes sent, by type
+	uint32_t	rxpkts[NETSTAT_NTYPES];	// Packets received, by type
+	uint64_t	rxbytes[NETSTAT_NTYPES]; // Bytes received, by type
+	uint32_t	rxbad;		// Packets received and dropped as invalid
+	uint32_t	retx;		// Retransmit timeouts that fired
+	uint32_t	dups;		// Duplicate or stale messages received
+	uint32_t	migrout;	// Processes migrated from here
+	uint32_t	migrin;		// Processes migrated to here
+	uint32_t	pullhist[NETSTAT_NHIST]; // Pulls done in < 2^i ticks
+					// (the last bucket takes the rest)
+	uint32_t	txfull;		// Packets lost to a full transmit ring
+	uint32_t	rxerr;		// Receive errors the card reported
+	uint32_t	lossdrop;	// Packets dropped to simulate loss (NET_LOSS)
+	uint32_t	rxsteered;	// Packets handed to another CPU to process
+} netstats;
+
+// One event in the kernel's trace, as read with SYS_TRACE.
+typedef struct tracerec {
+	uint64_t	tsc;		// TSC when it happened
+	uint16_t	event;		// TRACE_* event type
+	uint8_t		cpu;		// Local APIC ID of the CPU
+	uint8_t		pad;
+	uint32_t	arg[3];		// Event-specific arguments
+} tracerec;
+
 // process feature enable/status flags
 #define PFF_USEFPU	0x0001		// process has used the FPU
 #define PFF_NONDET	0x0100		// enable nondeterministic features
 #define PFF_ICNT	0x0200		// enable instruction count/recovery
+#define PFF_BALANCE	0x0400		// kernel may migrate us to balance load
 
 
+// Nonzero if the processor supports SYSENTER/SYSEXIT,
+// which the functions below then use instead of the slower INT T_SYSCALL.
+// Set by the user-space startup code in lib/crt0.S.
+extern int sys_sysenter;
+
+// The SYSENTER instruction sequence, taking the same registers as INT.
+// SYSENTER saves nothing, so we pass our stack pointer in EBP,
+// with the address to return to on top of that stack
+// (see sysenter_entry in kern/trapasm.S).  SYSEXIT returns ECX and EDX
+// holding our ESP and EIP, so callers must treat those as clobbered.
+// The instruction is two bytes long, like INT, so the kernel
+// can restart it the same way by backing up EIP.
+#define SYS_SYSENTER				\
+	"	pushl	%%ebp;"			\
+	"	pushl	$1f;"			\
+	"	movl	%%esp,%%ebp;"		\
+	"	sysenter;"			\
+	"1:	popl	%%ebp;"	/* return address */	\
+	"	popl	%%ebp;"
+
 static void gcc_inline
 sys_cputs(const char *s)
 {
+	if (sys_sysenter) {
+		asm volatile(SYS_SYSENTER : :
+			  "a" (SYS_CPUTS),
+			  "b" (s)
+			: "ecx", "edx", "cc", "memory");
+		return;
+	}
+
 	// Pass system call number and flags in EAX,
 	// parameters in other registers.
 	// Interrupt kernel with vector T_SYSCALL.
@@ -93,9 +365,41 @@ sys_cputs(const char *s)
 }
 
 static void gcc_inline
-sys_put(uint32_t flags, uint16_t child, procstate *save,
+sys_cwrite(const char *buf, size_t len)
+{
+	if (sys_sysenter) {
+		uint32_t ecx = len;
+		asm volatile(SYS_SYSENTER :
+			  "+c" (ecx)
+			: "a" (SYS_CWRITE),
+			  "b" (buf)
+			: "edx", "cc", "memory");
+		return;
+	}
+	asm volatile("int %0" :
+		: "i" (T_SYSCALL),
+		  "a" (SYS_CWRITE),
+		  "b" (buf),
+		  "c" (len)
+		: "cc", "memory");
+}
+
+static void gcc_inline
+sys_put(uint32_t flags, uint32_t child, procstate *save,
 		void *localsrc, void *childdest, size_t size)
 {
+	if (sys_sysenter) {
+		uint32_t edx = child, ecx = size;
+		asm volatile(SYS_SYSENTER :
+			  "+d" (edx),
+			  "+c" (ecx)
+			: "a" (SYS_PUT | flags),
+			  "b" (save),
+			  "S" (localsrc),
+			  "D" (childdest)
+			: "cc", "memory");
+		return;
+	}
 	asm volatile("int %0" :
 		: "i" (T_SYSCALL),
 		  "a" (SYS_PUT | flags),
@@ -108,9 +412,21 @@ sys_put(uint32_t flags, uint16_t child, procstate *save,
 }
 
 static void gcc_inline
-sys_get(uint32_t flags, uint16_t child, procstate *save,
+sys_get(uint32_t flags, uint32_t child, procstate *save,
 		void *childsrc, void *localdest, size_t size)
 {
+	if (sys_sysenter) {
+		uint32_t edx = child, ecx = size;
+		asm volatile(SYS_SYSENTER :
+			  "+d" (edx),
+			  "+c" (ecx)
+			: "a" (SYS_GET | flags),
+			  "b" (save),
+			  "S" (childsrc),
+			  "D" (localdest)
+			: "cc", "memory");
+		return;
+	}
 	asm volatile("int %0" :
 		: "i" (T_SYSCALL),
 		  "a" (SYS_GET | flags),
@@ -122,9 +438,186 @@ sys_get(uint32_t flags, uint16_t child, procstate *save,
 		: "cc", "memory");
 }
 
+static int gcc_inline
+sys_getany(const uint32_t set[256/32])
+{
+	int child;
+	asm volatile("int %1" :
+		"=d" (child)
+		: "i" (T_SYSCALL),
+		  "a" (SYS_GET | SYS_ANY),
+		  "b" (set)
+		: "cc", "memory");
+	return child;
+}
+
+// Like sys_get(), but returns SYS_RUNNING instead of waiting for the child.
+static int gcc_inline
+sys_poll(uint32_t flags, uint32_t child, procstate *save,
+		void *childsrc, void *localdest, size_t size)
+{
+	int status;
+	asm volatile("int %1" :
+		"=a" (status)
+		: "i" (T_SYSCALL),
+		  "a" (SYS_GET | SYS_POLL | flags),
+		  "b" (save),
+		  "d" (child),
+		  "S" (childsrc),
+		  "D" (localdest),
+		  "c" (size)
+		: "cc", "memory");
+	return status;
+}
+
+// Like sys_getany(), but returns -1 right away if no child in the set
+// has stopped yet.
+static int gcc_inline
+sys_pollany(const uint32_t set[256/32])
+{
+	int child;
+	asm volatile("int %1" :
+		"=d" (child)
+		: "i" (T_SYSCALL),
+		  "a" (SYS_GET | SYS_ANY | SYS_POLL),
+		  "b" (set)
+		: "cc", "memory");
+	return child;
+}
+
+static void gcc_inline
+sys_vec(sysvec *vec, int n)
+{
+	asm volatile("int %2" :
+		"+b" (vec),
+		"+c" (n)
+		: "i" (T_SYSCALL),
+		  "a" (SYS_VEC)
+		: "cc", "memory");
+}
+
+static void gcc_inline
+sys_lockstat(int n)
+{
+	asm volatile("int %0" :
+		: "i" (T_SYSCALL),
+		  "a" (SYS_LOCKSTAT),
+		  "b" (n)
+		: "cc", "memory");
+}
+
+static void gcc_inline
+sys_netstat(netstats *ns)
+{
+	asm volatile("int %0" :
+		: "i" (T_SYSCALL),
+		  "a" (SYS_NETSTAT),
+		  "b" (ns)
+		: "cc", "memory");
+}
+
+static int gcc_inline
+sys_ncpu(void)
+{
+	int n;
+	asm volatile("int %1" :
+		"=a" (n)
+		: "i" (T_SYSCALL),
+		  "a" (SYS_NCPU)
+		: "cc", "memory");
+	return n;
+}
+
+// Nanoseconds since this node booted.
+// Only for processes with PFF_NONDET: others get a T_GPFLT,
+// since time would make them nondeterministic.
+// kdata_clock() (see inc/kdata.h) reads it without a system call.
+static uint64_t gcc_inline
+sys_clock(void)
+{
+	uint64_t ns;
+	asm volatile("int %1" :
+		"=A" (ns)
+		: "i" (T_SYSCALL),
+		  "a" (SYS_CLOCK)
+		: "cc", "memory");
+	return ns;
+}
+
+static void gcc_inline
+sys_prof(int op, int n)
+{
+	asm volatile("int %0" :
+		: "i" (T_SYSCALL),
+		  "a" (SYS_PROF),
+		  "b" (op),
+		  "c" (n)
+		: "cc", "memory");
+}
+
+static int gcc_inline
+sys_trace(int op, uint32_t arg, int n, int cpu)
+{
+	int rc;
+	asm volatile("int %1" :
+		"=a" (rc)
+		: "i" (T_SYSCALL),
+		  "a" (SYS_TRACE),
+		  "b" (op),
+		  "c" (arg),
+		  "d" (n),
+		  "S" (cpu)
+		: "cc", "memory");
+	return rc;
+}
+
+static int gcc_inline
+sys_ckpt(int flags, uint8_t node, uint8_t child, uint32_t key)
+{
+	int ret;
+	asm volatile("int %1" :
+		"=a" (ret)
+		: "i" (T_SYSCALL),
+		  "a" (SYS_CKPT | flags),
+		  "b" (key),
+		  "d" (node << 8 | child)
+		: "cc", "memory");
+	return ret;
+}
+
+static void gcc_inline
+sys_mergeop(void *va, size_t size, int op)
+{
+	asm volatile("int %0" :
+		: "i" (T_SYSCALL),
+		  "a" (SYS_MERGEOP),
+		  "b" (va),
+		  "c" (size),
+		  "d" (op)
+		: "cc", "memory");
+}
+
+static void gcc_inline
+sys_advise(void *va, size_t size, int hint)
+{
+	asm volatile("int %0" :
+		: "i" (T_SYSCALL),
+		  "a" (SYS_ADVISE),
+		  "b" (va),
+		  "c" (size),
+		  "d" (hint)
+		: "cc", "memory");
+}
+
 static void gcc_inline
 sys_ret(void)
 {
+	if (sys_sysenter) {
+		asm volatile(SYS_SYSENTER : :
+			  "a" (SYS_RET)
+			: "ecx", "edx", "cc", "memory");
+		return;
+	}
 	asm volatile("int %0" : :
 		"i" (T_SYSCALL),
 		"a" (SYS_RET));
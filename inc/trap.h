@@ -47,6 +47,8 @@
 // We use these vectors to receive local per-CPU interrupts
 #define T_LTIMER	49	// Local APIC timer interrupt
 #define T_LERROR	50	// Local APIC error interrupt
+#define T_TLBFLUSH	51	// TLB shootdown request from another CPU
+#define T_WAKEUP	52	// Wake an idle CPU: work has arrived
 
 #define T_DEFAULT	500	// Unused trap vectors produce this value
 #define T_ICNT		501	// Child process instruction count expired
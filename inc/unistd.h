@@ -36,13 +36,24 @@
 #define WIFSIGNALED(x)		(((x) & 0xf00) == WSIGNALED)
 #define WTERMSIG(x)		((x) & 0xff)
 
+// Memory protection and flags for mmap().
+// These are traditionally in <sys/mman.h>.
+#define PROT_NONE		0x0	// Pages may not be accessed
+#define PROT_READ		0x1	// Pages may be read
+#define PROT_WRITE		0x2	// Pages may be written
+#define MAP_SHARED		0x01	// Use the file's own content in place
+#define MAP_PRIVATE		0x02	// Use a copy-on-write copy of it
+#define MAP_FAILED		((void *) -1)
+
 
 // Process management functions
 pid_t	fork(void);
 pid_t	wait(int *status);				// trad. in sys/wait.h
 pid_t	waitpid(pid_t pid, int *status, int options);	// trad. in sys/wait.h
+pid_t	consreader(pid_t pid);		// Hand console input to child pid
 int	execl(const char *path, const char *arg0, ...);
 int	execv(const char *path, char *const argv[]);
+pid_t	spawn(const char *path, char *const argv[], const int fds[3]);
 
 // File management functions
 int	open(const char *path, int flags, ...);		// trad. in fcntl.h
@@ -59,11 +70,36 @@ int	ftruncate(int fn, off_t newlength);
 int	isatty(int fn);
 int	remove(const char *path);
 int	fsync(int fn);
+int	pipe(int p[2]);
+void *	mmap(void *addr, size_t len, int prot, int flags, int fn, off_t ofs);
+int	munmap(void *addr, size_t len);	// trad. in sys/mman.h
 
 
 // PIOS-specific thread fork/join functions
 int	tfork(uint16_t child);
 void	tjoin(uint16_t child);
+void	tbarrier(void);
+void	tjoinall(uint16_t child, int n);
+
+// PIOS-specific thread pool: workers forked once and reused round by round.
+// A tpool must live in shared memory (a global or the heap, not the stack),
+// since its workers read their work items from it.
+#define TPOOL_MAX	32		// Maximum number of workers in a pool
+typedef void (*tpool_fn)(int worker, void *arg);
+typedef struct tpool {
+	uint16_t	first;		// Child number of worker 0
+	int		nworkers;	// Workers are children first..first+n-1
+	struct tpool_item {
+		tpool_fn	fn;	// Function the worker is to run
+		void		*arg;	// and its argument
+	} item[TPOOL_MAX];
+	bool		busy[TPOOL_MAX]; // Dispatched since the last barrier
+} tpool;
+
+void	tpool_create(tpool *p, uint16_t first, int nworkers);
+void	tpool_run(tpool *p, int worker, tpool_fn fn, void *arg);
+void	tpool_barrier(tpool *p);
+void	tpool_destroy(tpool *p);
 
 
 #endif	// !PIOS_INC_UNISTD_H
@@ -19,6 +19,8 @@
 //   This way the kernel's address space effectively remains the same
 //   both before and after it initializes the MMU and enables paging.
 //   (It also means we can use at most 1GB of physical memory!)
+//   Its top 4MB is kept out of that for the kernel data page (inc/kdata.h),
+//   which processes may read there but not write.
 //
 // - The next 2.75GB contains the running process's user-level address space.
 //   This is the only address range user-mode processes can access or map.
@@ -44,6 +46,8 @@
 //                     |        (see inc/vm.h)        | RW/RW
 //                     |                              | RW/RW
 //    VM_USERLO -----> +==============================+ 0x40000000
+//                     |       Kernel data page       | RW/R-
+//    VM_KDATA ------> +------------------------------+ 0x3fc00000
 //                     |                              | RW/--
 //                     |~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~|
 //                     :              .               :
@@ -57,6 +61,7 @@
 //
 #define	VM_USERHI	0xf0000000
 #define	VM_USERLO	0x40000000
+#define	VM_KDATA	0x3fc00000
 
 
 //
@@ -98,6 +103,15 @@
 #define VM_SCRATCHHI	0xd0000000
 #define VM_SCRATCHLO	0xc0000000
 
+// The top of the scratch area, which file reconciliation leaves alone,
+// holds private file mappings made via mmap() (see lib/unistd.c).
+#define VM_MMAPHI	0xd0000000
+#define VM_MMAPLO	0xc8000000
+
+// Just below that, arenas for batch-scoped allocation (see lib/arena.c).
+#define VM_ARENAHI	0xc8000000
+#define VM_ARENALO	0xc6000000
+
 // Address space area for file system and Unix process state
 #define VM_FILEHI	0xc0000000
 #define VM_FILELO	0x80000000
@@ -107,5 +121,15 @@
 #define VM_SHAREHI	0x80000000
 #define VM_SHARELO	0x40000000
 
+// The malloc() heap at the top of the shared area (see lib/malloc.c)
+// is divided into arenas, so that tfork() threads running at once
+// never write the same allocator metadata.  The main thread's arena
+// comes first, then VM_HEAPNTHREAD smaller arenas for threads,
+// which tfork() hands out so that no two running at once share one.
+#define VM_HEAPHI	0x80000000
+#define VM_HEAPTHREAD	0x60000000
+#define VM_HEAPLO	0x50000000
+#define VM_HEAPNTHREAD	64
+
 
 #endif /* !PIOS_INC_VM_H */
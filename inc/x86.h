@@ -39,6 +39,16 @@
 #define FL_ID		0x00200000	// ID flag
 
 
+// CPUID feature flags (function 1, EDX)
+#define CPUID_SEP	0x00000800	// SYSENTER/SYSEXIT supported
+#define CPUID_SSE2	0x04000000	// SSE2 (and MOVNTI) supported
+
+// Model-specific registers
+#define MSR_SYSENTER_CS		0x174	// SYSENTER code segment
+#define MSR_SYSENTER_ESP	0x175	// SYSENTER stack pointer
+#define MSR_SYSENTER_EIP	0x176	// SYSENTER entrypoint
+
+
 // Struct containing information returned by the CPUID instruction
 typedef struct cpuinfo {
 	uint32_t	eax;
@@ -225,6 +235,34 @@ rcr4(void)
 	return cr4;
 }
 
+static gcc_inline void
+clts(void)
+{
+	__asm __volatile("clts");
+}
+
+// Save/restore the x87/MMX/XMM state to/from a 16-byte aligned
+// 512-byte area laid out as the fxsave struct in inc/trap.h.
+static gcc_inline void
+fpu_save(void *area)
+{
+	__asm __volatile("fxsave %0" : "=m" (*(char (*)[512])area));
+}
+
+static gcc_inline void
+fpu_restore(const void *area)
+{
+	__asm __volatile("fxrstor %0" : : "m" (*(const char (*)[512])area));
+}
+
+// Reset the FPU and SSE state to the processor's defaults.
+static gcc_inline void
+fpu_init(void)
+{
+	uint32_t mxcsr = 0x1f80;	// all SSE exceptions masked
+	__asm __volatile("fninit; ldmxcsr %0" : : "m" (mxcsr));
+}
+
 static gcc_inline void
 tlbflush(void)
 {
@@ -311,13 +349,51 @@ xadd(volatile uint32_t *addr, int32_t incr)
 	int32_t result;
 
 	// The + in "+m" denotes a read-modify-write operand.
-	asm volatile("lock; xaddl %0, %1" :
+	asm volatile("lock; xaddl %1, %0" :
 	       "+m" (*addr), "=a" (result) :
 	       "1" (incr) :
 	       "cc");
 	return result;
 }
 
+// Atomically set *addr to newval if it currently holds oldval.
+// Returns the old value of *addr, which equals oldval on success.
+static inline uint32_t
+cmpxchg(volatile uint32_t *addr, uint32_t oldval, uint32_t newval)
+{
+	uint32_t result;
+
+	asm volatile("lock; cmpxchgl %2, %1" :
+	       "=a" (result), "+m" (*addr) :
+	       "r" (newval), "0" (oldval) :
+	       "cc");
+	return result;
+}
+
+// Atomically set the 64-bit *addr to newval if it currently holds oldval.
+// Returns true on success.
+static inline bool
+cmpxchg64(volatile uint64_t *addr, uint64_t oldval, uint64_t newval)
+{
+	uint8_t ok;
+
+	asm volatile("lock; cmpxchg8b %1; setzb %0" :
+	       "=q" (ok), "+m" (*addr), "+A" (oldval) :
+	       "b" ((uint32_t)newval), "c" ((uint32_t)(newval >> 32)) :
+	       "cc");
+	return ok;
+}
+
+// Atomically add incr to the 64-bit *addr.
+static inline void
+lockadd64(volatile uint64_t *addr, uint64_t incr)
+{
+	uint64_t old;
+	do {
+		old = *addr;
+	} while (!cmpxchg64(addr, old, old + incr));
+}
+
 static inline void
 pause(void)
 {
@@ -333,6 +409,20 @@ cpuid(uint32_t idx, cpuinfo *info)
 		: "a" (idx));
 }
 
+static gcc_inline uint64_t
+rdmsr(uint32_t msr)
+{
+	uint64_t val;
+	asm volatile("rdmsr" : "=A" (val) : "c" (msr));
+	return val;
+}
+
+static gcc_inline void
+wrmsr(uint32_t msr, uint64_t val)
+{
+	asm volatile("wrmsr" : : "c" (msr), "A" (val));
+}
+
 static gcc_inline uint64_t
 rdtsc(void)
 {
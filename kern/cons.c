@@ -30,7 +30,6 @@
 #include <dev/serial.h>
 
 void cons_intr(int (*proc)(void));
-static void cons_putc(int c);
 
 // To keep track of write out
 static int cons_out_pos;
@@ -95,14 +94,6 @@ cons_getc(void)
 	return 0;
 }
 
-// output a character to the console
-static void
-cons_putc(int c)
-{
-	serial_putc(c);
-	video_putc(c);
-}
-
 // initialize the console devices
 void
 cons_init(void)
@@ -132,6 +123,138 @@ cons_intenable(void)
 	serial_intenable();
 }
 
+/***** Per-CPU kernel output rings *****/
+// The kernel's own output (cprintf, warn) goes into a ring on the CPU
+// that printed it, rather than waiting for cons_lock and the slow console
+// devices, so warnings from interrupt handlers and the network path
+// don't throttle them.  Each CPU alone appends to its ring,
+// with interrupts off; whoever holds cons_lock writes the records out,
+// merging the CPUs' rings by TSC.  Idle CPUs do most of the writing,
+// and every synchronous write (user output, the root's console file)
+// first writes out what's buffered, to keep the console in order.
+// When a ring is full we drop the new output, and say so later.
+
+static bool cons_logoff;	// Set for good by cons_logstop()
+
+void
+cons_loginit(void)
+{
+	cpu *c = cpu_cur();
+	if (!CONS_LOG || c->logbuf != NULL)
+		return;
+	pageinfo *pi = mem_alloc_order(CONS_LOGORDER);
+	if (pi == NULL) {
+		warn("cons_loginit: no memory for CPU %d", c->id);
+		return;		// this CPU's output just stays synchronous
+	}
+	c->logbuf = mem_pi2ptr(pi);
+}
+
+// Append output to the current CPU's ring.
+// Returns false if the caller must write it synchronously instead.
+static bool
+cons_log(const char *buf, size_t len)
+{
+	uint32_t eflags = read_eflags();
+	cli();
+	cpu *c = cpu_cur();
+	bool logged = c->logbuf != NULL && !cons_logoff;
+	if (logged) {
+		uint64_t tsc = rdtsc();
+		while (len > 0) {
+			if (c->loghead - c->logtail >= CONS_LOGRECS) {
+				c->logdrops++;
+				break;
+			}
+			cons_logrec *r = &c->logbuf[c->loghead % CONS_LOGRECS];
+			r->tsc = tsc;
+			r->len = MIN(len, CONS_LOGLINE);
+			memmove(r->buf, buf, r->len);
+			buf += r->len;
+			len -= r->len;
+			asm volatile("" : : : "memory");  // fill record first
+			c->loghead++;
+		}
+	}
+	write_eflags(eflags);
+	return logged;
+}
+
+// Write up to max buffered records to the console devices, oldest first,
+// then report any output dropped since last time.
+// Returns the number of records written.  Caller must hold cons_lock.
+static uint32_t
+cons_logwrite(uint32_t max)
+{
+	uint32_t n;
+	cpu *c;
+	for (n = 0; n < max; n++) {
+		cpu *oldest = NULL;
+		uint64_t oldtsc = 0;
+		for (c = &cpu_boot; c != NULL; c = c->next) {
+			if (c->logbuf == NULL || c->logtail == c->loghead)
+				continue;
+			asm volatile("" : : : "memory");  // read head first
+			uint64_t tsc = c->logbuf[c->logtail % CONS_LOGRECS].tsc;
+			if (oldest == NULL || tsc < oldtsc)
+				oldest = c, oldtsc = tsc;
+		}
+		if (oldest == NULL)
+			break;
+
+		cons_logrec *r = &oldest->logbuf[oldest->logtail
+							% CONS_LOGRECS];
+		serial_write(r->buf, r->len);
+		video_write(r->buf, r->len);
+		asm volatile("" : : : "memory");  // done with record first
+		oldest->logtail++;
+	}
+
+	for (c = &cpu_boot; c != NULL; c = c->next)
+		if (c->logdrops != c->logdropsrep) {
+			char msg[80];
+			int len = snprintf(msg, sizeof(msg),
+				"[CPU %d dropped %u console writes]\n",
+				c->id, c->logdrops - c->logdropsrep);
+			serial_write(msg, len);
+			video_write(msg, len);
+			c->logdropsrep = c->logdrops;
+		}
+	return n;
+}
+
+bool
+cons_logidle(void)
+{
+	// Look before taking the lock, since idle CPUs call us constantly.
+	cpu *c;
+	for (c = &cpu_boot; c != NULL; c = c->next)
+		if (c->logtail != c->loghead || c->logdrops != c->logdropsrep)
+			break;
+	if (c == NULL)
+		return 0;
+
+	spinlock_acquire(&cons_lock);
+	cons_logwrite(CONS_LOGIDLE);
+	spinlock_release(&cons_lock);
+	return 1;
+}
+
+void
+cons_logstop(void)
+{
+	bool already = spinlock_holding(&cons_lock);
+	if (!already)
+		spinlock_acquire(&cons_lock);
+
+	cons_logoff = 1;
+	cons_logwrite(~0);
+	serial_sync();		// and don't leave it in the serial ring
+
+	if (!already)
+		spinlock_release(&cons_lock);
+}
+
 // `High'-level console I/O.  Used by readline and cprintf.
 void
 cputs(const char *str)
@@ -139,16 +262,34 @@ cputs(const char *str)
 	if (read_cs() & 3)
 		return sys_cputs(str);	// use syscall from user mode
 
-	// Hold the console spinlock while printing the entire string,
+	cwrite(str, strlen(str));
+}
+
+// Like cputs(), but with an explicit length.
+void
+cwrite(const char *buf, size_t len)
+{
+	if (read_cs() & 3)
+		return sys_cwrite(buf, len);	// use syscall from user mode
+
+	if (!cons_log(buf, len))
+		cons_write(buf, len);
+}
+
+void
+cons_write(const char *buf, size_t len)
+{
+	// Hold the console spinlock while printing the entire buffer,
 	// so that the output of different cputs calls won't get mixed.
 	// Implement ad hoc recursive locking for debugging convenience.
 	bool already = spinlock_holding(&cons_lock);
 	if (!already)
 		spinlock_acquire(&cons_lock);
 
-	char ch;
-	while (*str)
-		cons_putc(*str++);
+	cons_logwrite(~0);	// older kernel output goes first
+
+	serial_write(buf, len);
+	video_write(buf, len);
 
 	if (!already)
 		spinlock_release(&cons_lock);
@@ -164,18 +305,16 @@ cons_io(void)
 	// Get output file
 	fileinode *fi = &files->fi[FILEINO_CONSOUT];
 	int c;
-	// spinlock_acquire(&cons_lock);
-	while(cons_out_pos < fi->size) {
-		c = ((char*)FILEDATA(FILEINO_CONSOUT))[cons_out_pos];
-		cons_putc(c);
-		num_io++;
-		cons_out_pos++;
+	if(cons_out_pos < fi->size) {
+		num_io += fi->size - cons_out_pos;
+		cons_write((char*)FILEDATA(FILEINO_CONSOUT) + cons_out_pos,
+			fi->size - cons_out_pos);
+		cons_out_pos = fi->size;
 	}
-	// spinlock_release(&cons_lock);
 	// Input file
 	fi = &files->fi[FILEINO_CONSIN];
 	// Read from console
-	while(fi->size <= FILE_MAXSIZE && (c = cons_getc())) {
+	while(fi->size < FILE_WINSIZE && (c = cons_getc())) {
 		// And appened to CONSIN
 		((char*)FILEDATA(FILEINO_CONSIN))[fi->size++] = c;
 		num_io++;
@@ -19,10 +19,31 @@
 #endif
 
 #include <inc/types.h>
+#include <inc/mmu.h>
 
 
 #define DEBUG_TRACEFRAMES	10
 
+// Whether the kernel's own console output goes through per-CPU rings
+// (see cons_log() in kern/cons.c): 1 (default) or 0 to write it all
+// synchronously, e.g., to see the last words before a hang.
+#ifndef CONS_LOG
+#define CONS_LOG		1
+#endif
+
+#define CONS_LOGORDER	3		// Each CPU's ring is 2^this pages
+#define CONS_LOGLINE	118		// Most bytes of output per record
+#define CONS_LOGIDLE	16		// Most records an idle CPU writes at once
+
+// One piece of buffered kernel output, 128 bytes.
+typedef struct cons_logrec {
+	uint64_t	tsc;		// When it was printed, for merging CPUs
+	uint16_t	len;		// Bytes of buf in use
+	char		buf[CONS_LOGLINE];
+} cons_logrec;
+
+#define CONS_LOGRECS	((PAGESIZE << CONS_LOGORDER) / sizeof(cons_logrec))
+
 struct iocons;
 
 
@@ -45,4 +66,19 @@ void cons_intenable(void);
 // Returns true if I/O was done, false if no new I/O was ready.
 bool cons_io(void);
 
+// Write a buffer of 'len' characters to the console devices in bulk,
+// after any kernel output still waiting in the CPUs' rings.
+void cons_write(const char *buf, size_t len);
+
+// Give the calling CPU a ring for its kernel output (see cons_log()).
+void cons_loginit(void);
+
+// Called from idle CPUs to write out some buffered kernel output.
+// Returns true if there was any to write.
+bool cons_logidle(void);
+
+// Write out all buffered kernel output and stop buffering for good,
+// so that the last words of a panic or shutdown reach the console.
+void cons_logstop(void);
+
 #endif /* PIOS_KERN_CONSOLE_H_ */
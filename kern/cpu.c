@@ -17,6 +17,14 @@
 
 #include <dev/lapic.h>
 
+// The kernel's own user-mode test code (e.g., in proc_check())
+// runs on stacks outside the user address space,
+// where syscall_fast() won't read return addresses from,
+// so it keeps making system calls with INT (see inc/syscall.h).
+int sys_sysenter;
+
+// SYSENTER entrypoint in kern/trapasm.S
+extern char sysenter_entry[];
 
 cpu cpu_boot = {
 
@@ -82,6 +90,19 @@ void cpu_init()
     
     ltr(CPU_GDT_TSS);
 
+	// Set up the fast system call entrypoint, if we have one.
+	// SYSEXIT derives the user segments from the kernel code segment,
+	// which our GDT layout is arranged to match.
+	cpuinfo inf;
+	cpuid(1, &inf);
+	string_sse2 = (inf.edx & CPUID_SSE2) != 0;	// see lib/string.c
+	if (inf.edx & CPUID_SEP) {
+		assert(CPU_GDT_UCODE == CPU_GDT_KCODE + 16);
+		assert(CPU_GDT_UDATA == CPU_GDT_KCODE + 24);
+		wrmsr(MSR_SYSENTER_CS, CPU_GDT_KCODE);
+		wrmsr(MSR_SYSENTER_ESP, (uint32_t)c->kstackhi);
+		wrmsr(MSR_SYSENTER_EIP, (uint32_t)sysenter_entry);
+	}
 }
 
 // Allocate an additional cpu struct representing a non-bootstrap processor.
@@ -120,6 +141,13 @@ cpu_alloc(void)
 	return c;
 }
 
+// Initial kernel stack of each AP, indexed by local APIC ID,
+// where each AP looks up its own in boot/bootother.S.
+static void *cpu_bootstacks[256];
+
+// Number of APs that have booted, which the boot CPU waits for.
+static volatile int32_t cpu_nbooted;
+
 void
 cpu_bootothers(void)
 {
@@ -128,7 +156,7 @@ cpu_bootothers(void)
 
 	if (!cpu_onboot()) {
 		// Just inform the boot cpu we've booted.
-		xchg(&cpu_cur()->booted, 1);
+		lockadd(&cpu_nbooted, 1);
 		return;
 	}
 
@@ -137,19 +165,66 @@ cpu_bootothers(void)
 	memmove(code, _binary_obj_boot_bootother_start,
 		(uint32_t)_binary_obj_boot_bootother_size);
 
+	// Fill in each AP's %esp, and the %eip they all start at.
+	uint8_t apicids[256];
+	int n = 0;
 	cpu *c;
 	for(c = &cpu_boot; c; c = c->next){
 		if(c == cpu_cur())  // We''ve started already.
 			continue;
+		cpu_bootstacks[c->id] = c->kstackhi;
+		apicids[n++] = c->id;
+	}
+	if (n == 0)
+		return;
+	*(volatile uint32_t**)(code-4) = &lapic[ID];
+	*(void**)(code-8) = init_ap;
+	*(void***)(code-12) = cpu_bootstacks;
+
+	// Start all the APs at once, then wait for all to get through bootstrap.
+	lapic_startcpus(apicids, n, (uint32_t)code);
+	while (cpu_nbooted < n)
+		pause();
+}
 
-		// Fill in %esp, %eip and start code on cpu.
-		*(void**)(code-4) = c->kstackhi;
-		*(void**)(code-8) = init;
-		lapic_startcpu(c->id, (uint32_t)code);
 
-		// Wait for cpu to get through bootstrap.
-		while(c->booted == 0)
-			;
-	}
+// Idle CPUs halt until some CPU makes work for them and sends T_WAKEUP.
+// The count lets cpu_wakeone() skip scanning when nobody is idle.
+static volatile int32_t cpu_nidle;
+
+void
+cpu_idle(void)
+{
+	cpu *c = cpu_cur();
+	assert(!c->idle);
+	xchg(&c->idle, 1);	// also orders our later check for work
+	lockadd(&cpu_nidle, 1);
 }
 
+void
+cpu_busy(void)
+{
+	cpu *c = cpu_cur();
+	if (xchg(&c->idle, 0))
+		lockadd(&cpu_nidle, -1);
+}
+
+bool
+cpu_wake(cpu *c)
+{
+	if (!c->idle)
+		return 0;
+	lapic_ipi(c->id, T_WAKEUP);
+	return 1;
+}
+
+void
+cpu_wakeone(cpu *except)
+{
+	if (cpu_nidle == 0)
+		return;
+	cpu *me = cpu_cur(), *c;
+	for (c = &cpu_boot; c != NULL; c = c->next)
+		if (c != except && c != me && cpu_wake(c))
+			return;
+}
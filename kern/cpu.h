@@ -24,6 +24,10 @@
 #define CPU_GDT_NDESC	7	// number of GDT entries used, including null
 
 
+#define CPU_NSLAB	4	// max slab caches with per-CPU free lists
+#define CPU_NREADY	4	// ready queue priority levels, 0 = highest
+
+
 #ifndef __ASSEMBLER__
 
 #include <inc/assert.h>
@@ -32,6 +36,8 @@
 #include <inc/mmu.h>
 #include <inc/trap.h>
 
+#include <kern/spinlock.h>
+
 
 // Per-CPU kernel state structure.
 // Exactly one page (4096 bytes) in size.
@@ -52,18 +58,105 @@ typedef struct cpu {
 	gcc_noreturn void (*recover)(trapframe *tf, void *recoverdata);
 	void		*recoverdata;
 
+	// Trapframe of a system call entered with SYSENTER,
+	// which trap_return() can leave with SYSEXIT (see kern/trap.c).
+	trapframe	*sysexit;
+
 	// Next in list of all CPUs - cpu_boot (below) is the list head.
 	struct cpu	*next;
 
 	// Local APIC ID of this CPU, for inter-processor interrupts etc.
 	uint8_t		id;
 
-	// Flag used in cpu.c to serialize bootstrap of all CPUs
-	volatile uint32_t booted;
-
 	// Process currently running on this CPU.
 	struct proc	*proc;
 
+	// Process whose FPU state is loaded in this CPU's FPU, or NULL.
+	// CR0_TS is set whenever that isn't the running process.
+	struct proc	*fpuowner;
+
+	// Processes ready to run on this CPU, one FIFO queue per priority
+	// (see proc_ready() and proc_sched() in kern/proc.c).
+	spinlock	readylock;	// Protects the ready queues
+	struct proc	*readyhead[CPU_NREADY];	// Next process to run
+	struct proc	*readytail[CPU_NREADY];	// Last process on each queue
+	uint32_t	boostticks;	// Timer ticks since last priority boost
+	volatile uint32_t idle;		// Halted waiting for T_WAKEUP
+
+	// Per-CPU cache of free physical pages, chained via free_next,
+	// so that the common mem_alloc/mem_free path needs no shared lock.
+	struct pageinfo	*pgcache;	// Head of cached free page chain
+	int		npgcache;	// Number of pages on the chain
+	uint32_t	pgrefill;	// Times we refilled from global list
+	uint32_t	pgdrain;	// Times we drained to global list
+
+	// Page tables already filled with PTE_ZERO, chained via free_next,
+	// that pmap_ptabidle() keeps ready for pmap_walk() to use.
+	struct pageinfo	*ptabpool;	// Head of pre-cleared page table chain
+	int		nptabpool;	// Number of page tables on the chain
+
+	// User page directory this CPU may hold TLB entries for, or NULL,
+	// and the mailbox other CPUs use to shoot down those entries
+	// (see pmap_inval() in kern/pmap.c).
+	// It stays loaded after its process stops, until another replaces it
+	// (see proc_sched() and proc_run() in kern/proc.c).
+	void		*pdir;
+	uint32_t	cr3loads;	// Times proc_run() loaded a new pdir
+	uint32_t	cr3skips;	// Times it found the pdir already loaded
+	uint32_t	pgfaults;	// Page faults pmap_pagefault() took
+
+	// This CPU's kernel data page (see inc/kdata.h), and the page table
+	// mapping it read-only at VM_KDATA, which proc_run() points the PDE
+	// of each process with PFF_NONDET at; NULL until proc_init().
+	struct kdata	*kdata;
+	uint32_t	*kdatapt;
+
+	// Set when the timer ticks while we're in the kernel,
+	// so that a long system call can charge the tick to its process
+	// between chunks of work (see proc_tickcall() in kern/proc.c).
+	volatile bool	kticked;
+	volatile uint32_t tlbbusy;	// Mailbox claimed by some other CPU
+	struct cpu	*tlbfrom;	// CPU that claimed it
+	volatile uint32_t tlbva;	// Start of range to invalidate
+	volatile uint32_t tlbsize;	// Size of range, cleared when done
+	bool		tlbdefer;	// Deferring our own invalidations
+	uint32_t	tlbdeflo;	// Start of deferred range
+	uint32_t	tlbdefhi;	// End of deferred range
+
+	// Timer-tick profiling samples (see debug_profsample() in kern/debug.c).
+	struct debug_sample *profbuf;	// DEBUG_PROFMAX samples, or NULL
+	volatile uint32_t nprof;	// Samples taken, including any dropped
+
+	// Ring of this CPU's recent trace events (see kern/trace.c).
+	// Records head-tail up to head-1, modulo TRACE_NRECS, are valid.
+	struct tracerec	*tracebuf;	// TRACE_NRECS records, or NULL
+	uint32_t	tracehead;	// Records written since boot
+	uint32_t	tracetail;	// Oldest one not yet read or overwritten
+
+	// Ring of this CPU's kernel console output not yet written out
+	// (see cons_log() in kern/cons.c).  Only this CPU advances head,
+	// and only the CPU holding cons_lock advances tail.
+	struct cons_logrec *logbuf;	// CONS_LOGRECS records, or NULL
+	volatile uint32_t loghead;	// Records written since boot
+	volatile uint32_t logtail;	// Records written out to the console
+	uint32_t	logdrops;	// Writes lost because the ring was full
+	uint32_t	logdropsrep;	// Drops already reported on the console
+
+	// Received packets net_rx() has steered to this CPU to process
+	// (see net_rxsteer() in kern/net.c).  Any CPU advances head,
+	// only this CPU advances tail, both under rxlock.
+	struct net_rxpkt *rxq;		// NET_RXQLEN packets, or NULL
+	spinlock	rxlock;		// Protects the queue
+	uint32_t	rxhead;		// Packets queued since boot
+	volatile uint32_t rxtail;	// Packets processed
+
+	// Per-CPU free object lists for each slab cache (see kern/slab.c).
+	void		*slabfree[CPU_NSLAB];
+	int		nslabfree[CPU_NSLAB];
+
+	// Queue nodes for the MCS spinlocks this CPU holds or waits for.
+	spinlock_qnode	mcsnode[SPINLOCK_MCSNODES];
+
 	// Magic verification tag (CPU_MAGIC) to help detect corruption,
 	// e.g., if the CPU's ring 0 stack overflows down onto the cpu struct.
 	uint32_t	magic;
@@ -109,9 +202,23 @@ void cpu_init(void);
 // and chain it onto the list of all CPUs.
 cpu *cpu_alloc(void);
 
-// Get any additional processors booted up and running.
+// On the boot CPU, get all additional processors booted up and running,
+// returning once all of them are; on another CPU, report that it's up.
 void cpu_bootothers(void);
 
+// Mark the current CPU idle before it halts waiting for work,
+// or busy again once it returns from the halt.
+// A CPU must recheck for work after marking itself idle,
+// so as not to miss a wakeup sent just before.
+void cpu_idle(void);
+void cpu_busy(void);
+
+// Wake CPU c with an IPI if it's idle, returning true if it was.
+bool cpu_wake(cpu *c);
+
+// Wake some idle CPU other than c and the current CPU, if there is one.
+void cpu_wakeone(cpu *c);
+
 #endif	// ! __ASSEMBLER__
 
 #endif // PIOS_KERN_CPU_H
@@ -12,11 +12,15 @@
 #include <inc/stdarg.h>
 #include <inc/assert.h>
 #include <inc/x86.h>
+#include <inc/syscall.h>
 
 #include <kern/cons.h>
 #include <kern/debug.h>
 #include <kern/init.h>
 #include <kern/spinlock.h>
+#include <kern/cpu.h>
+#include <kern/mem.h>
+#include <kern/proc.h>
 
 
 // Variable panicstr contains argument to first call to panic; used as flag
@@ -36,6 +40,7 @@ debug_panic(const char *file, int line, const char *fmt,...)
 		if (panicstr)
 			goto dead;
 		panicstr = fmt;
+		cons_logstop();	// all synchronous from here on
 	}
 
 	// First print the requested message
@@ -85,6 +90,212 @@ debug_trace(uint32_t ebp, uint32_t eips[DEBUG_TRACEFRAMES])
 }
 
 
+
+// Sampling profiler.  While debug_profon is set, each CPU's timer tick
+// drops a sample of where that CPU was into the CPU's own buffer,
+// so taking a sample needs no locks and no shared cache lines.
+// Only the root process controls it, via SYS_PROF,
+// and it only runs on one CPU at a time, so debug_prof() needs no lock.
+// A CPU already inside debug_profsample() when we stop may still write
+// one sample into its buffer as we read it, which costs one sample at worst.
+static volatile bool debug_profon;
+
+// Running totals for one address or process in a profile report.
+typedef struct debug_profhit {
+	uint32_t	key;		// EIP or proc pointer
+	uint32_t	count;		// Samples there
+	bool		user;		// EIP is in user mode
+} debug_profhit;
+
+static debug_profhit debug_proftop[DEBUG_PROFTOP];
+
+// Record where the current CPU was when the timer interrupted it.
+// Called from trap() on every tick, whether or not we're profiling.
+void
+debug_profsample(trapframe *tf)
+{
+	if (!debug_profon)
+		return;
+	cpu *c = cpu_cur();
+	uint32_t i = c->nprof++;
+	if (c->profbuf == NULL || i >= DEBUG_PROFMAX)
+		return;		// buffer full: the sample just counts as dropped
+	debug_sample *s = &c->profbuf[i];
+	s->eip = tf->eip;
+	s->proc = c->idle ? NULL : c->proc;
+	s->cpu = c->id;
+	s->user = (tf->cs & 3) != 0;
+}
+
+// Shell-sort n samples by EIP, so equal addresses end up adjacent.
+static void
+debug_profsort(debug_sample *s, int n)
+{
+	int gap, i, j;
+	for (gap = n / 2; gap > 0; gap = gap == 2 ? 1 : gap * 5 / 11)
+		for (i = gap; i < n; i++) {
+			debug_sample t = s[i];
+			for (j = i; j >= gap && s[j-gap].eip > t.eip; j -= gap)
+				s[j] = s[j-gap];
+			s[j] = t;
+		}
+}
+
+// Add count samples at key to the top list top[0..ntop-1],
+// which is sorted by count, largest first, and holds at most max entries.
+// Returns the new length of the list.
+static int
+debug_proftally(debug_profhit *top, int ntop, int max,
+		uint32_t key, uint32_t count, bool user)
+{
+	if (ntop == max && (max == 0 || top[max-1].count >= count))
+		return ntop;
+	int j = ntop < max ? ntop++ : max-1;
+	for (; j > 0 && top[j-1].count < count; j--)
+		top[j] = top[j-1];
+	top[j].key = key;
+	top[j].count = count;
+	top[j].user = user;
+	return ntop;
+}
+
+// Number of usable samples in CPU c's buffer.
+static uint32_t
+debug_profcount(cpu *c)
+{
+	return c->profbuf == NULL ? 0 : MIN(c->nprof, DEBUG_PROFMAX);
+}
+
+// Print the n hottest addresses across all CPUs,
+// then the processes that were running most often.
+static void
+debug_profreport(int n)
+{
+	cpu *c;
+	uint32_t i, total = 0;
+
+	// Sort each CPU's samples and give per-CPU totals.
+	for (c = &cpu_boot; c != NULL; c = c->next) {
+		uint32_t ns = debug_profcount(c), nuser = 0, nidle = 0;
+		debug_profsort(c->profbuf, ns);
+		for (i = 0; i < ns; i++) {
+			nuser += c->profbuf[i].user;
+			nidle += c->profbuf[i].proc == NULL;
+		}
+		cprintf("CPU %d: %u samples (%u user, %u idle, %u dropped)\n",
+			c->id, ns, nuser, nidle, c->nprof - ns);
+		total += ns;
+		c->nprof = 0;	// now the merge cursor into the sorted buffer
+	}
+
+	// Merge the sorted buffers, tallying each distinct EIP.
+	int ntop = 0, naddr = 0;
+	while (1) {
+		cpu *min = NULL;
+		for (c = &cpu_boot; c != NULL; c = c->next)
+			if (c->nprof < debug_profcount(c) && (min == NULL ||
+					c->profbuf[c->nprof].eip <
+					min->profbuf[min->nprof].eip))
+				min = c;
+		if (min == NULL)
+			break;
+		debug_sample *s = &min->profbuf[min->nprof];
+		uint32_t eip = s->eip, count = 0;
+		bool user = s->user;
+		for (c = &cpu_boot; c != NULL; c = c->next)
+			while (c->nprof < debug_profcount(c) &&
+					c->profbuf[c->nprof].eip == eip)
+				c->nprof++, count++;
+		ntop = debug_proftally(debug_proftop, ntop, n,
+					eip, count, user);
+		naddr++;
+	}
+	cprintf("top %d of %d addresses by samples, of %u:\n",
+		ntop, naddr, total);
+	cprintf("%8s %5s %4s  %s\n", "samples", "%", "mode", "eip");
+	for (i = 0; i < ntop; i++) {
+		debug_profhit *h = &debug_proftop[i];
+		uint32_t pm = (uint64_t)h->count * 1000 / total;
+		cprintf("%8u %3u.%u %4s  %08x\n", h->count, pm / 10, pm % 10,
+			h->user ? "u" : "k", h->key);
+	}
+
+	// Tally samples by process, a linear search being good enough
+	// for the few processes a profiled run keeps busy.
+	// Samples for processes beyond the table's size aren't counted.
+	int nproc = 0;
+	for (c = &cpu_boot; c != NULL; c = c->next)
+		for (i = 0; i < debug_profcount(c); i++) {
+			uint32_t key = (uint32_t)c->profbuf[i].proc;
+			int j;
+			for (j = 0; j < nproc; j++)
+				if (debug_proftop[j].key == key)
+					break;
+			if (j == nproc) {
+				if (nproc == DEBUG_PROFTOP)
+					continue;
+				debug_proftop[nproc].key = key;
+				debug_proftop[nproc++].count = 0;
+			}
+			debug_proftop[j].count++;
+		}
+	cprintf("%8s %5s  %s\n", "samples", "%", "proc");
+	for (i = 0; i < nproc && i < n; i++) {
+		// Selection sort: pick the busiest of those left.
+		int j, max = i;
+		for (j = i + 1; j < nproc; j++)
+			if (debug_proftop[j].count > debug_proftop[max].count)
+				max = j;
+		debug_profhit h = debug_proftop[max];
+		debug_proftop[max] = debug_proftop[i];
+		debug_proftop[i] = h;
+		uint32_t pm = (uint64_t)h.count * 1000 / total;
+		if (h.key == 0)
+			cprintf("%8u %3u.%u  idle\n", h.count, pm / 10, pm % 10);
+		else
+			cprintf("%8u %3u.%u  %08x\n", h.count, pm / 10, pm % 10,
+				h.key);
+	}
+
+	// The samples are used up: a later report needs a new PROF_START.
+	for (c = &cpu_boot; c != NULL; c = c->next)
+		c->nprof = 0;
+}
+
+// Start, stop, or report on the sampling profiler (see SYS_PROF).
+void
+debug_prof(int op, int n)
+{
+	cpu *c;
+
+	switch (op) {
+	case PROF_START:
+		debug_profon = 0;
+		for (c = &cpu_boot; c != NULL; c = c->next) {
+			if (c->profbuf == NULL) {
+				pageinfo *pi = mem_alloc_order(DEBUG_PROFORDER);
+				if (pi == NULL) {
+					warn("debug_prof: no memory for CPU %d",
+						c->id);
+					continue;
+				}
+				c->profbuf = mem_pi2ptr(pi);
+			}
+			c->nprof = 0;
+		}
+		debug_profon = 1;
+		break;
+	case PROF_STOP:
+		debug_profon = 0;
+		break;
+	case PROF_REPORT:
+		debug_profon = 0;
+		n = MAX(0, MIN(n, DEBUG_PROFTOP));
+		debug_profreport(n);
+		break;
+	}
+}
+
 static void gcc_noinline f3(int r, uint32_t *e) { debug_trace(read_ebp(), e); }
 static void gcc_noinline f2(int r, uint32_t *e) { r & 2 ? f3(r,e) : f3(r,e); }
 static void gcc_noinline f1(int r, uint32_t *e) { r & 1 ? f2(r,e) : f2(r,e); }
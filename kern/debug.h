@@ -15,14 +15,30 @@
 
 #include <inc/types.h>
 #include <inc/cdefs.h>
+#include <inc/mmu.h>
 
 
 #define DEBUG_TRACEFRAMES	10
 
+// One profiling sample, taken on a CPU's timer tick (see debug_profsample()).
+typedef struct debug_sample {
+	uint32_t	eip;		// Where the CPU was running
+	struct proc	*proc;		// Process last run there, NULL if halted
+	uint8_t		cpu;		// Local APIC ID of the CPU
+	uint8_t		user;		// Nonzero if interrupted in user mode
+} debug_sample;
+
+#define DEBUG_PROFORDER	4	// Each CPU's sample buffer is 2^this pages
+#define DEBUG_PROFMAX	((PAGESIZE << DEBUG_PROFORDER) / sizeof(debug_sample))
+#define DEBUG_PROFTOP	40	// Most addresses or processes to report
+
+struct trapframe;
 
 void debug_warn(const char*, int, const char*, ...);
 void debug_panic(const char*, int, const char*, ...) gcc_noreturn;
 void debug_trace(uint32_t ebp, uint32_t eips[DEBUG_TRACEFRAMES]);
+void debug_profsample(struct trapframe *tf);
+void debug_prof(int op, int n);
 void debug_check(void);
 
 #endif /* PIOS_KERN_DEBUG_H_ */
@@ -10,6 +10,7 @@
 #include <inc/x86.h>
 #include <inc/stat.h>
 #include <inc/stdio.h>
+#include <inc/stdarg.h>
 #include <inc/unistd.h>
 #include <inc/string.h>
 #include <inc/syscall.h>
@@ -18,11 +19,17 @@
 #include <inc/file.h>
 
 #include <kern/cpu.h>
+#include <kern/mem.h>
+#include <kern/pmap.h>
 #include <kern/trap.h>
 #include <kern/proc.h>
 #include <kern/file.h>
 #include <kern/init.h>
 #include <kern/cons.h>
+#include <kern/net.h>
+
+#include <dev/ide.h>
+#include <dev/lapic.h>
 
 
 // Build a table of files to include in the initial file system.
@@ -50,6 +57,14 @@ filestate *const files = FILES;
 static spinlock file_lock;	// Lock to protect file I/O state
 static size_t file_consout;	// Bytes written to console so far
 
+// The statistics file (see file_stats()) is rewritten at most this often,
+// and lists this many of the lock sites with the most wait time.
+#define FILESTATS_NS		100000000	// 100ms
+#define FILESTATS_LOCKS		10
+
+static uint64_t file_statsns;	// clock_ns() when last rewritten
+static char *file_statspos;	// Where file_statsf() writes next
+
 void
 file_init(void)
 {
@@ -59,6 +74,298 @@ file_init(void)
 	spinlock_init(&file_lock);
 }
 
+// If there's a disk for it (dev/ide.c), the root process's file area
+// persists on that disk, page for page, laid out like this:
+//
+//	sector 0		superblock
+//	sectors 1-64		bitmap of file area pages that are mapped
+//	sectors 65-128		bitmap of mapped pages whose content is stored
+//	sector 256 + 8*p	content of file area page p, if stored
+//
+// A page that's mapped but not stored holds zeros.
+// The console and statistics windows are never stored:
+// they start out afresh every boot.
+// To find the pages that need writing back, file_diskpdir keeps a
+// copy-on-write "page cache" address space mapping the pages we wrote last:
+// any page the root process has written since then is a different page.
+#define FILEDISK_MAGIC		0x50494f32	// "PIO2"
+#define FILEDISK_NPAGE		((VM_FILEHI - VM_FILELO) / PAGESIZE)
+#define FILEDISK_BMSECTS	(FILEDISK_NPAGE / 8 / IDE_SECTSIZE)
+#define FILEDISK_MAPSECT	1
+#define FILEDISK_STORESECT	(FILEDISK_MAPSECT + FILEDISK_BMSECTS)
+#define FILEDISK_DATASECT	256
+#define FILEDISK_PGSECTS	(PAGESIZE / IDE_SECTSIZE)
+#define FILEDISK_NSECT		(FILEDISK_DATASECT \
+				 + FILEDISK_NPAGE * FILEDISK_PGSECTS)
+#define FILEDISK_SYNCMAX	256	// Pages file_io() writes back at once
+
+// The root's address for file area page p, and the page at address va.
+#define FILEDISK_VA(p)		(VM_FILELO + (uint32_t)(p) * PAGESIZE)
+#define FILEDISK_PAGE(va)	(((va) - VM_FILELO) / PAGESIZE)
+
+typedef struct filedisk_super {
+	uint32_t	magic;		// FILEDISK_MAGIC if formatted
+	uint32_t	nsect;		// FILEDISK_NSECT when formatted
+	uint8_t		pad[IDE_SECTSIZE - 8];
+} filedisk_super;
+
+static bool file_disk;		// Root's file area persists on disk
+static pde_t *file_diskpdir;	// Pages as last written to disk
+static uint32_t file_diskmapped[FILEDISK_NPAGE/32];	// Mapped bitmap
+static uint32_t file_diskstored[FILEDISK_NPAGE/32];	// Stored bitmap
+static bool file_diskbmdirty;	// Bitmaps changed since written
+static int file_diskcursor = 1;	// Window to resume writing back at
+
+#define filedisk_test(bm, p)	(((bm)[(p)/32] >> ((p)%32)) & 1)
+#define filedisk_set(bm, p, v)	((bm)[(p)/32] = ((bm)[(p)/32] \
+					& ~(1 << ((p)%32))) | ((v) << ((p)%32)))
+
+// Is data window w one of those we don't keep on disk?
+#define filedisk_skipwin(w)	\
+	((w) == FILEINO_CONSIN || (w) == FILEINO_CONSOUT \
+	 || (w) == FILEINO_STATS)
+
+// Find the disk to keep the root's file area on, and load what it holds.
+// Returns true if it had a file system to load,
+// or false if there's no disk or we just formatted it.
+static bool
+file_diskload(proc *root)
+{
+	if (!ide_present)
+		return 0;
+	if (ide_nsect < FILEDISK_NSECT) {
+		warn("file_diskload: disk too small (%d sectors, need %d)",
+			ide_nsect, FILEDISK_NSECT);
+		return 0;
+	}
+	file_diskpdir = pmap_newpdir();
+	if (file_diskpdir == NULL) {
+		warn("file_diskload: no memory for page cache");
+		return 0;
+	}
+	file_disk = 1;
+
+	static filedisk_super sb;
+	if (ide_read(0, &sb, 1) < 0)
+		panic("file_diskload: can't read superblock");
+	if (sb.magic != FILEDISK_MAGIC || sb.nsect != FILEDISK_NSECT) {
+		// Nothing on it yet: write out an empty file area.
+		cprintf("file_diskload: formatting disk\n");
+		memset(&sb, 0, sizeof(sb));
+		sb.magic = FILEDISK_MAGIC;
+		sb.nsect = FILEDISK_NSECT;
+		file_diskbmdirty = 1;
+		if (ide_write(0, &sb, 1) < 0)
+			panic("file_diskload: can't write superblock");
+		return 0;
+	}
+
+	if (ide_read(FILEDISK_MAPSECT, file_diskmapped, FILEDISK_BMSECTS) < 0
+			|| ide_read(FILEDISK_STORESECT, file_diskstored,
+					FILEDISK_BMSECTS) < 0)
+		panic("file_diskload: can't read bitmaps");
+	int p, nstored = 0;
+	for (p = 0; p < FILEDISK_NPAGE; p++) {
+		uint32_t va = FILEDISK_VA(p);
+		if (!filedisk_test(file_diskmapped, p)
+				|| filedisk_skipwin((va - FILESVA) >> 22))
+			continue;
+		if (!filedisk_test(file_diskstored, p)) {
+			pmap_setperm(root->pdir, va, PAGESIZE, SYS_READ | SYS_WRITE);
+			continue;
+		}
+		pageinfo *pi = mem_alloc();
+		if (pi == NULL)
+			panic("file_diskload: out of memory");
+		if (ide_read(FILEDISK_DATASECT + p * FILEDISK_PGSECTS,
+				mem_pi2ptr(pi), FILEDISK_PGSECTS) < 0)
+			panic("file_diskload: can't read page %d", p);
+		if (pmap_insert(root->pdir, pi, va,
+				PTE_W | PTE_U | SYS_READ | SYS_WRITE) == NULL)
+			panic("file_diskload: out of memory");
+		nstored++;
+	}
+	cprintf("file_diskload: loaded %dK of files\n", nstored * PAGESIZE / 1024);
+
+	// What we just loaded is what the disk has.
+	if (!pmap_copy(root->pdir, VM_FILELO, file_diskpdir, VM_FILELO,
+			VM_FILEHI - VM_FILELO))
+		panic("file_diskload: out of memory");
+	return 1;
+}
+
+// Write back whatever the root process changed in data window w
+// (or in the file metadata, for w == 0) since we wrote it last.
+// Returns the number of pages written.
+static int
+file_disksyncwin(int w)
+{
+	pde_t *pdir = proc_root->pdir;
+	uint32_t va = (uint32_t)FILEDATA(w);
+	if (pdir[PDX(va)] == file_diskpdir[PDX(va)])
+		return 0;	// untouched since we last wrote it
+
+	int i, n = 0;
+	for (i = 0; i < NPTENTRIES; i++) {
+		uint32_t pva = va + i * PAGESIZE;
+		pte_t r = pmap_getpte(pdir, pva);
+		pte_t c = pmap_getpte(file_diskpdir, pva);
+		if (PGADDR(r) == PGADDR(c) && (r & SYS_RW) == (c & SYS_RW))
+			continue;	// same page as on disk
+
+		uint32_t p = FILEDISK_PAGE(pva);
+		bool mapped = (r & SYS_READ) != 0;
+		bool stored = mapped && PGADDR(r) != PTE_ZERO;
+		if (stored) {
+			if (ide_write(FILEDISK_DATASECT + p * FILEDISK_PGSECTS,
+					mem_ptr(PGADDR(r)), FILEDISK_PGSECTS) < 0)
+				warn("file_disksync: can't write page %d", p);
+			n++;
+		}
+		if (filedisk_test(file_diskmapped, p) != mapped
+				|| filedisk_test(file_diskstored, p) != stored) {
+			filedisk_set(file_diskmapped, p, mapped);
+			filedisk_set(file_diskstored, p, stored);
+			file_diskbmdirty = 1;
+		}
+	}
+
+	// The root can't have changed anything in the meantime,
+	// so the cache can take on the whole window as it is now,
+	// sharing it copy-on-write so the root's next write goes to a new page.
+	if (!pmap_copy(pdir, va, file_diskpdir, va, PTSIZE))
+		warn("file_disksync: out of memory for page cache");
+	return n;
+}
+
+// Write back up to about 'max' changed pages of the root's file area,
+// resuming at the window where the last call stopped.
+// The file metadata goes out only after a full pass over the data windows,
+// so that it's never newer on disk than the data it describes.
+// Returns true if everything on disk is now up to date.
+static bool
+file_disksync(int max)
+{
+	if (!file_disk)
+		return 1;
+
+	int n = 0, i, start = file_diskcursor;
+	bool done = 0;
+	for (i = 0; i < FILE_WINDOWS-1 && n < max; i++) {
+		int w = file_diskcursor;
+		file_diskcursor = w + 1 < FILE_WINDOWS ? w + 1 : 1;
+		if (!filedisk_skipwin(w))
+			n += file_disksyncwin(w);
+		if (file_diskcursor == 1) {
+			n += file_disksyncwin(0);	// metadata last
+			done = 1;
+			break;
+		}
+	}
+	if (file_diskbmdirty) {
+		if (ide_write(FILEDISK_MAPSECT, file_diskmapped,
+				FILEDISK_BMSECTS) < 0
+				|| ide_write(FILEDISK_STORESECT, file_diskstored,
+					FILEDISK_BMSECTS) < 0)
+			warn("file_disksync: can't write bitmaps");
+		file_diskbmdirty = 0;
+		n++;
+	}
+	if (n > 0 && ide_flush() < 0)
+		warn("file_disksync: can't flush disk");
+
+	// A pass that started midway left the windows before it unchecked.
+	return done && start == 1;
+}
+
+// Append formatted text to the statistics file, as far as it fits.
+static void
+file_statsf(const char *fmt, ...)
+{
+	char *end = (char*)FILEDATA(FILEINO_STATS) + FILE_WINSIZE;
+	va_list ap;
+
+	va_start(ap, fmt);
+	int n = vsnprintf(file_statspos, end - file_statspos, fmt, ap);
+	va_end(ap);
+	file_statspos += MIN(n, end - file_statspos - 1);
+}
+
+// Rewrite the root process's statistics file, /stats, with a snapshot
+// of the kernel's counters, unless we did so less than FILESTATS_NS ago.
+// Each line is a name and a value, so a program,
+// or a node's operator with cat and grep, can pick out what it needs.
+// Like the console files, the kernel writes it behind the root's back,
+// and reconcile() passes it on to the root's children.
+// Counters may still be changing as we read them, so it's only a snapshot.
+static void
+file_stats(void)
+{
+	fileinode *fi = &files->fi[FILEINO_STATS];
+	uint64_t now = clock_ns();
+	if (fi->size != 0 && now - file_statsns < FILESTATS_NS)
+		return;
+	file_statsns = now;
+
+	file_statspos = FILEDATA(FILEINO_STATS);
+	file_statsf("uptime_ms %llu\n", now / 1000000);
+
+	// Physical memory, and each CPU's share of its traffic.
+	file_statsf("mem_pages %u\nmem_free %u\n", mem_npage, mem_nfree());
+	cpu *c;
+	for (c = &cpu_boot; c; c = c->next) {
+		int q, n[CPU_NREADY];
+		proc *p;
+		spinlock_acquire(&c->readylock);
+		for (q = 0; q < CPU_NREADY; q++)
+			for (n[q] = 0, p = c->readyhead[q]; p; p = p->readynext)
+				n[q]++;
+		spinlock_release(&c->readylock);
+
+		file_statsf("cpu%d_ready %d %d %d %d\n",
+			c->id, n[0], n[1], n[2], n[3]);
+		file_statsf("cpu%d_pgfaults %u\n", c->id, c->pgfaults);
+		file_statsf("cpu%d_pgcache %d\n", c->id, c->npgcache);
+		file_statsf("cpu%d_pgrefill %u\ncpu%d_pgdrain %u\n",
+			c->id, c->pgrefill, c->id, c->pgdrain);
+		file_statsf("cpu%d_cr3loads %u\ncpu%d_cr3skips %u\n",
+			c->id, c->cr3loads, c->id, c->cr3skips);
+		file_statsf("cpu%d_logdrops %u\n", c->id, c->logdrops);
+	}
+
+	// The network, summed over message types.
+	uint32_t txpkts = 0, rxpkts = 0;
+	uint64_t txbytes = 0, rxbytes = 0;
+	int i;
+	for (i = 0; i < NETSTAT_NTYPES; i++) {
+		txpkts += net_stats.txpkts[i];
+		txbytes += net_stats.txbytes[i];
+		rxpkts += net_stats.rxpkts[i];
+		rxbytes += net_stats.rxbytes[i];
+	}
+	file_statsf("net_txpkts %u\nnet_txbytes %llu\n", txpkts, txbytes);
+	file_statsf("net_rxpkts %u\nnet_rxbytes %llu\n", rxpkts, rxbytes);
+	file_statsf("net_rxbad %u\nnet_rxerr %u\nnet_txfull %u\n",
+		net_stats.rxbad, net_stats.rxerr, net_stats.txfull);
+	file_statsf("net_retx %u\nnet_dups %u\nnet_lossdrop %u\n",
+		net_stats.retx, net_stats.dups, net_stats.lossdrop);
+	file_statsf("net_rxsteered %u\n", net_stats.rxsteered);
+	file_statsf("net_migrout %u\nnet_migrin %u\n",
+		net_stats.migrout, net_stats.migrin);
+
+	// The most contended lock sites, as for SYS_LOCKSTAT.
+	spinlock_site *top[SPINLOCK_NSITES];
+	int ntop = MIN(spinlock_top(top), FILESTATS_LOCKS);
+	for (i = 0; i < ntop; i++)
+		file_statsf("lock %s:%d wait %llu hold %llu"
+			" acquire %u contend %u\n",
+			top[i]->file, top[i]->line, top[i]->waittsc,
+			top[i]->holdtsc, top[i]->nacquire, top[i]->ncontend);
+
+	fi->size = file_statspos - (char*)FILEDATA(FILEINO_STATS);
+	fi->ver++;
+}
+
 void
 file_initroot(proc *root)
 {
@@ -71,10 +378,51 @@ file_initroot(proc *root)
 	cpu_cur()->proc = root;
 	lcr3(mem_phys(root->pdir));
 
-	// Enable read/write access on the file metadata area	
-	pmap_setperm(root->pdir, FILESVA, ROUNDUP(sizeof(filestate), PAGESIZE),
-				SYS_READ | SYS_WRITE);
-	memset(files, 0, sizeof(*files));
+	// Load the file system from disk if there's one there.
+	// Otherwise start from scratch, with just the initial files.
+	bool loaded = file_diskload(root);
+	if (!loaded) {
+		// Enable read/write access on the file metadata area
+		assert(sizeof(filestate) <= PTSIZE);	// must fit in window 0
+		pmap_setperm(root->pdir, FILESVA,
+			ROUNDUP(sizeof(filestate), PAGESIZE), SYS_READ | SYS_WRITE);
+		memset(files, 0, sizeof(*files));
+
+		// Setup the inodes for the console I/O files and root directory
+		strcpy(files->fi[FILEINO_CONSIN].de.d_name, "consin");
+		strcpy(files->fi[FILEINO_CONSOUT].de.d_name, "consout");
+		strcpy(files->fi[FILEINO_ROOTDIR].de.d_name, "/");
+		strcpy(files->fi[FILEINO_STATS].de.d_name, "stats");
+		files->fi[FILEINO_CONSIN].dino = FILEINO_ROOTDIR;
+		files->fi[FILEINO_CONSOUT].dino = FILEINO_ROOTDIR;
+		files->fi[FILEINO_ROOTDIR].dino = FILEINO_ROOTDIR;
+		files->fi[FILEINO_STATS].dino = FILEINO_ROOTDIR;
+		files->fi[FILEINO_CONSIN].mode = S_IFREG | S_IFPART;
+		files->fi[FILEINO_CONSOUT].mode = S_IFREG;
+		files->fi[FILEINO_ROOTDIR].mode = S_IFDIR;
+		files->fi[FILEINO_STATS].mode = S_IFREG;
+
+		// The console files live in fixed windows 1 and 2 (see cons_io()),
+		// and the statistics file in window 4 (see file_stats()).
+		files->fi[FILEINO_CONSIN].win[0] = FILEINO_CONSIN;
+		files->fi[FILEINO_CONSOUT].win[0] = FILEINO_CONSOUT;
+		files->fi[FILEINO_STATS].win[0] = FILEINO_STATS;
+		files->winuse[FILEINO_CONSIN] = FILEINO_CONSIN;
+		files->winuse[FILEINO_CONSOUT] = FILEINO_CONSOUT;
+		files->winuse[FILEINO_STATS] = FILEINO_STATS;
+	}
+
+	// The process state in the file metadata starts afresh every boot,
+	// and so do the console files, whichever way we got the rest.
+	files->err = 0;
+	files->exited = 0;
+	files->status = 0;
+	memset(files->fd, 0, sizeof(files->fd));
+	memset(files->child, 0, sizeof(files->child));
+	files->dhvalid = 0;
+	files->fi[FILEINO_CONSIN].size = files->fi[FILEINO_CONSIN].rlen = 0;
+	files->fi[FILEINO_CONSOUT].size = files->fi[FILEINO_CONSOUT].rlen = 0;
+	files->fi[FILEINO_STATS].size = files->fi[FILEINO_STATS].rlen = 0;
 
 	// Set up the standard I/O descriptors for console I/O
 	files->fd[0].ino = FILEINO_CONSIN;
@@ -84,22 +432,15 @@ file_initroot(proc *root)
 	files->fd[2].ino = FILEINO_CONSOUT;
 	files->fd[2].flags = O_WRONLY | O_APPEND;
 
-	// Setup the inodes for the console I/O files and root directory
-	strcpy(files->fi[FILEINO_CONSIN].de.d_name, "consin");
-	strcpy(files->fi[FILEINO_CONSOUT].de.d_name, "consout");
-	strcpy(files->fi[FILEINO_ROOTDIR].de.d_name, "/");
-	files->fi[FILEINO_CONSIN].dino = FILEINO_ROOTDIR;
-	files->fi[FILEINO_CONSOUT].dino = FILEINO_ROOTDIR;
-	files->fi[FILEINO_ROOTDIR].dino = FILEINO_ROOTDIR;
-	files->fi[FILEINO_CONSIN].mode = S_IFREG | S_IFPART;
-	files->fi[FILEINO_CONSOUT].mode = S_IFREG;
-	files->fi[FILEINO_ROOTDIR].mode = S_IFDIR;
-
 	// Set the whole console input area to be read/write,
 	// so we won't have to worry about perms in cons_io().
 	pmap_setperm(root->pdir, (uintptr_t)FILEDATA(FILEINO_CONSIN),
 				PTSIZE, SYS_READ | SYS_WRITE);
 
+	// Likewise for the statistics file, which file_io() first fills.
+	pmap_setperm(root->pdir, (uintptr_t)FILEDATA(FILEINO_STATS),
+				PTSIZE, SYS_READ | SYS_WRITE);
+
 	// Set up the initial files in the root process's file system.
 	// Some script magic in kern/Makefrag creates obj/kern/initfiles.h,
 	// which gets included above (twice) to create the 'initfiles' array.
@@ -108,23 +449,46 @@ file_initroot(proc *root)
 	// initfiles[i][1] is a pointer to the start of the file's content, and
 	// initfiles[i][2] is a pointer to the end of the file's content
 	// (i.e., a pointer to the first byte after the file's last byte).
+	// The initial files come fresh from the kernel image
+	// even when the rest of the file system came from disk,
+	// as long as they are still where we first put them.
 	int ninitfiles = sizeof(initfiles)/sizeof(initfiles[0]);
+	assert(FILEINO_GENERAL + ninitfiles <= FILE_WINDOWS);
 	// Lab 4: your file system initialization code here.
 	int i;
 	for(i=0; i<ninitfiles; i++) {
 		int ino = i + FILEINO_GENERAL;
 		int fsize = initfiles[i][2] - initfiles[i][1];
+		fileinode *fi = &files->fi[ino];
+		uintptr_t va = (uintptr_t)FILEDATA(ino);
+		if (loaded && fi->de.d_name[0] != 0) {
+			if (strcmp(fi->de.d_name, initfiles[i][0]) != 0
+					|| fi->dino != FILEINO_ROOTDIR
+					|| fi->mode != S_IFREG || fi->slot != 0
+					|| fi->win[0] != ino || fi->win[1] != 0
+					|| files->winuse[ino] != ino) {
+				warn("file_initroot: keeping %s from disk",
+					initfiles[i][0]);
+				continue;
+			}
+			pmap_remove(root->pdir, va, PTSIZE);
+			fi->ver++;
+		} else if (loaded && files->winuse[ino] != FILEWIN_FREE) {
+			warn("file_initroot: no room for %s", initfiles[i][0]);
+			continue;
+		}
 		// Need to set name, dino, mode, size, permissions, just like above.
-		// We also need to copy the file data into the FILEDATA for that inode
-		strcpy(files->fi[ino].de.d_name, initfiles[i][0]);
-		files->fi[ino].dino = FILEINO_ROOTDIR;					// In the root directory
-		files->fi[ino].mode = S_IFREG;									// Regular file
-		files->fi[ino].size = fsize;										// The size, as calculated above.
-		// Read - write permission for the system (we need to ROUNDUP because pmap_setperm)
-		// expects sizes in the multiple of PTSIZE
-		pmap_setperm(root->pdir, (uintptr_t)FILEDATA(ino), 
-			ROUNDUP(fsize, PTSIZE), SYS_READ | SYS_WRITE);
-		// Copy the data over
+		strcpy(fi->de.d_name, initfiles[i][0]);
+		fi->dino = FILEINO_ROOTDIR;					// In the root directory
+		fi->mode = S_IFREG;									// Regular file
+		fi->size = fsize;										// The size, as calculated above.
+		fi->win[0] = ino;										// In a window of its own
+		files->winuse[ino] = ino;
+		// Read/write permission on the whole window, in fresh pages,
+		// and copy the data over: the kernel image's own pages
+		// have no pageinfos, so they can't be mapped into user space.
+		pmap_setperm(root->pdir, va, ROUNDUP(fsize, PTSIZE),
+			SYS_READ | SYS_WRITE);
 		memcpy(FILEDATA(ino), initfiles[i][1], fsize);
 	}
 	// warn("file_initroot: file system initialization not done\n");
@@ -157,15 +521,29 @@ file_io(trapframe *tf)
 	bool iodone = 0;
 	iodone |= cons_io();
 
+	// Bring the statistics file up to date, if it's been a while.
+	// That alone isn't I/O the root process was waiting for.
+	file_stats();
+
 	// Has the root process exited?
 	if (files->exited) {
 		cprintf("root process exited with status %d\n", files->status);
+		while (!file_disksync(FILEDISK_NPAGE))
+			;
+		cons_logstop();	// before done(), where the grade scripts stop
 		done();
 	}
 
-	// We successfully did some I/O, let the root process run again.
-	if (iodone)
+	// We successfully did some I/O, let the root process run again,
+	// after writing back some of its file changes if it has a disk.
+	if (iodone) {
+		file_disksync(FILEDISK_SYNCMAX);
 		trap_return(tf);
+	}
+
+	// Nothing else to do: get the file system onto disk before we sleep.
+	while (!file_disksync(FILEDISK_NPAGE))
+		;
 
 	// No I/O ready - put the root process to sleep waiting for I/O.
 	spinlock_acquire(&file_lock);
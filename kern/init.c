@@ -22,6 +22,7 @@
 #include <kern/cpu.h>
 #include <kern/trap.h>
 #include <kern/spinlock.h>
+#include <kern/slab.h>
 #include <kern/mp.h>
 #include <kern/proc.h>
 #include <kern/file.h>
@@ -31,6 +32,7 @@
 #include <dev/lapic.h>
 #include <dev/ioapic.h>
 #include <dev/pci.h>
+#include <dev/ide.h>
 
 
 // User-mode stack for user(), below, to run on.
@@ -42,8 +44,39 @@ static char gcc_aligned(16) user_stack[PAGESIZE];
 #endif
 extern char ROOTEXE_START[];
 
-// Called first from entry.S on the bootstrap processor,
-// and later from boot/bootother.S on all other processors.
+// Timestamps (TSC) at the end of each phase of booting,
+// which init() prints once it's done, to show where boot time goes.
+#define INIT_MAXPHASES	16
+static struct {
+	const char	*name;
+	uint64_t	tsc;
+} init_phases[INIT_MAXPHASES];
+static int init_nphases;
+static uint64_t init_tsc;	// When init() started
+
+static void
+init_phase(const char *name)
+{
+	assert(init_nphases < INIT_MAXPHASES);
+	init_phases[init_nphases].name = name;
+	init_phases[init_nphases++].tsc = rdtsc();
+}
+
+static void
+init_printphases(void)
+{
+	uint64_t last = init_tsc;
+	int i;
+	for (i = 0; i < init_nphases; i++) {
+		cprintf("boot: %-12s %12lld cycles\n", init_phases[i].name,
+			init_phases[i].tsc - last);
+		last = init_phases[i].tsc;
+	}
+	cprintf("boot: %-12s %12lld cycles\n", "total", last - init_tsc);
+}
+
+// Called first from entry.S on the bootstrap processor.
+// Other processors run init_ap(), below, instead.
 // As a rule, "init" functions in PIOS are called once on EACH processor.
 void
 init(void)
@@ -55,31 +88,41 @@ init(void)
 	// ensuring that all static/global variables start out zero.
 	if (cpu_onboot())
 		memset(edata, 0, end - edata);
+	init_tsc = rdtsc();
 
 	// Initialize the console.
 	// Can't call cprintf until after we do this!
 	cons_init();
 
 	// Lab 1: test cprintf and debug_trace
-	cprintf("1234 decimal is %o octal!\n", 1234);
-   	unsigned int i = 0x00646c72;
-    cprintf("H%x Wo%s", 57616, &i);
-	debug_check();
+	if (INIT_CHECKS) {
+		cprintf("1234 decimal is %o octal!\n", 1234);
+		unsigned int i = 0x00646c72;
+		cprintf("H%x Wo%s", 57616, &i);
+		debug_check();
+	}
+	init_phase("console");
 
 	// Initialize and load the bootstrap CPU's GDT, TSS, and IDT.
 	cpu_init();
 	trap_init();
+	init_phase("cpu");
 
 	// Physical memory detection/initialization.
 	// Can't call mem_alloc until after we do this!
 	mem_init();
+	init_phase("memory");
 
 	// Lab 2: check spinlock implementation
-	if (cpu_onboot())
+	if (cpu_onboot() && INIT_CHECKS) {
 		spinlock_check();
+		slab_check();
+		init_phase("lockcheck");
+	}
 
 	// Initialize the paged virtual memory system.
 	pmap_init();
+	init_phase("paging");
 
 	// Find and start other processors in a multiprocessor system
 	mp_init();		// Find info about processors in system
@@ -89,11 +132,15 @@ init(void)
 	cpu_bootothers();	// Get other processors started
     cprintf("CPU %d (%s) has booted\n", cpu_cur()->id,
 		cpu_onboot() ? "BP" : "AP");
+	init_phase("processors");
 
 	// Initialize the I/O system.
+	ide_init();		// Find the disk for the persistent file system
 	file_init();		// Create root directory and console I/O files
+	init_phase("filesystem");
 	pci_init();		  // Initialize the PCI bus and network card
 	net_init();
+	init_phase("network");
 
 	// Lab 4: uncomment this when you can handle IRQ_SERIAL and IRQ_KBD.
 	cons_intenable();	// Let the console start producing interrupts
@@ -101,9 +148,6 @@ init(void)
 	// Initialize the process management code.
 	proc_init();
 
-  if(!cpu_onboot())
-    proc_sched();
-  
   proc_root = proc_alloc(NULL, 0);
   elfhdr *elf = (elfhdr*)ROOTEXE_START;
 
@@ -143,12 +187,34 @@ init(void)
   proc_root->sv.tf.eip = elf->e_entry;
   proc_root->sv.tf.esp = VM_STACKHI;
   proc_root->sv.tf.eflags |= FL_IF;
+  proc_root->sv.pff = PFF_NONDET;   // root does I/O anyway
   // Initialize file system
   file_initroot(proc_root);
+  init_phase("root");
+  init_printphases();
+  cons_loginit();	// Buffer our kernel output from now on
   proc_ready(proc_root);
   proc_sched();
 }
 
+// Called from boot/bootother.S on each other processor,
+// which the boot processor starts all at once once it's done with
+// the system-wide setup (and boot-time checks) in init() above.
+// So each just sets up its own CPU state and goes looking for work.
+void
+init_ap(void)
+{
+	cpu_init();		// Load this CPU's GDT and TSS
+	trap_init();		// Load the IDT the boot CPU set up
+	pmap_init();		// Turn on paging with the bootstrap page directory
+	lapic_init();		// Set up this CPU's local APIC
+	cpu_bootothers();	// Tell the boot CPU we're up
+	cons_loginit();		// Buffer our kernel output from now on
+	cprintf("CPU %d (AP) has booted\n", cpu_cur()->id);
+
+	proc_sched();
+}
+
 // This is the first function that gets run in user mode (ring 3).
 // It acts as PIOS's "root process",
 // of which all other processes are descendants.
@@ -158,6 +224,7 @@ user()
 	cprintf("in user()\n");
 	assert(read_esp() > (uint32_t) &user_stack[0]);
 	assert(read_esp() < (uint32_t) &user_stack[sizeof(user_stack)]);
+	cons_logstop();
 	done();
 }
 
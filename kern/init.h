@@ -17,9 +17,22 @@
 #include <inc/cdefs.h>
 
 
-// Called on each processor to initialize the kernel.
+// The boot-time self-checks (debug_check(), mem_check(), pmap_check(), etc.)
+// run on every boot unless the kernel is built with -DPIOS_FASTBOOT
+// (see conf/env.mk).  'make ktest' builds a test kernel that always runs them.
+#if defined(PIOS_FASTBOOT) && !defined(PIOS_KTEST)
+#define INIT_CHECKS	0
+#else
+#define INIT_CHECKS	1
+#endif
+
+
+// Called on the bootstrap processor to initialize the kernel.
 void init(void);
 
+// Called on each other processor to do its own part of that.
+void init_ap(void) gcc_noreturn;
+
 // First function run in user mode (only on one processor)
 void user(void);
 
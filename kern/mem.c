@@ -18,8 +18,10 @@
 #include <kern/spinlock.h>
 #include <kern/pmap.h>
 #include <kern/net.h>
+#include <kern/init.h>
 
 #include <dev/nvram.h>
+#include <dev/e820.h>
 
 
 size_t mem_max;			// Maximum physical address
@@ -27,61 +29,323 @@ size_t mem_npage;		// Total number of physical memory pages
 
 pageinfo *mem_pageinfo;		// Metadata array indexed by page number
 
-pageinfo *mem_freelist;		// Start of free page list
+pageinfo *mem_freelist[MEM_NORDER];	// Buddy freelists, by block order
+size_t mem_nfreepages;		// Pages on all buddy freelists
 spinlock _freelist_lock;
-spinlock mem_freelock;
+
+pageinfo *mem_zerolist;		// Pages known to be all zero
+int mem_nzero;			// Number of pages on mem_zerolist
+spinlock mem_zerolock;
 
 void mem_check(void);
 
+static void mem_buddy_free(pageinfo *pi, int order);
+static rwlock mem_rrlock;	// Guards mem_rrhash; lookups share it
+
+pageinfo *mem_cachehead;	// Replica cache, most recently used first
+pageinfo *mem_cachetail;	// Least recently used replica
+size_t mem_ncached;		// Number of pages on the replica cache
+spinlock mem_cachelock;		// Nests inside mem_rrlock
+
+// Add the physical address range [lo,hi) to a sorted array of RAM ranges,
+// trimming it to whole pages the kernel can address (below VM_KDATA)
+// and merging it with any ranges it overlaps or touches.
+static int
+mem_addrange(memrange *ram, int nram, uint64_t lo, uint64_t hi)
+{
+	if (hi > VM_KDATA)
+		hi = VM_KDATA;
+	if (lo >= hi)
+		return nram;
+	lo = ROUNDUP(lo, PAGESIZE);
+	hi = ROUNDDOWN(hi, PAGESIZE);
+	if (lo >= hi)
+		return nram;
+
+	int i, j;
+	for (i = 0; i < nram && ram[i].hi < lo; i++)
+		;
+	// ranges i..j-1 overlap or touch [lo,hi)
+	for (j = i; j < nram && ram[j].lo <= hi; j++) {
+		lo = MIN(lo, ram[j].lo);
+		hi = MAX(hi, ram[j].hi);
+	}
+	if (i == j) {		// insert a new range at i
+		if (nram == MEM_MAXRANGE)
+			return nram;	// out of room; ignore it
+		memmove(&ram[i+1], &ram[i], (nram-i) * sizeof(memrange));
+		nram++;
+	} else {		// replace ranges i..j-1 with one
+		memmove(&ram[i+1], &ram[j], (nram-j) * sizeof(memrange));
+		nram -= j - i - 1;
+	}
+	ram[i].lo = lo;
+	ram[i].hi = hi;
+	return nram;
+}
+
+// Collect the usable RAM ranges from the BIOS E820 memory map
+// the boot loader left at E820_MAPADDR (see boot/boot.S).
+// Returns the number of ranges, or 0 if there's no usable map.
+static int
+mem_e820(memrange *ram)
+{
+	e820map *map = mem_ptr(E820_MAPADDR);
+	if (map->magic != E820_SMAP || map->nent > E820_MAXENT)
+		return 0;
+
+	int i, nram = 0;
+	for (i = 0; i < map->nent; i++) {
+		e820ent *e = &map->ent[i];
+		if (e->type == E820_RAM)
+			nram = mem_addrange(ram, nram, e->addr, e->addr + e->size);
+	}
+	return nram;
+}
+
+// Determine how much base (<640K) and extended (>1MB) memory
+// is available in the system (in bytes),
+// by reading the PC's BIOS-managed nonvolatile RAM (NVRAM).
+// The NVRAM tells us how many kilobytes there are,
+// plus the number of 64K chunks above 16MB for bigger machines.
+static int
+mem_nvram(memrange *ram)
+{
+	size_t basemem = ROUNDDOWN(nvram_read16(NVRAM_BASELO)*1024, PAGESIZE);
+	size_t extmem = ROUNDDOWN(nvram_read16(NVRAM_EXTLO)*1024, PAGESIZE);
+	size_t ext16mem = nvram_read16(NVRAM_EXT16LO) * 65536;
+	if (ext16mem > 0)
+		extmem = 16*1024*1024 - MEM_EXT + ext16mem;
+
+	int nram = mem_addrange(ram, 0, 0, MIN(basemem, MEM_IO));
+	nram = mem_addrange(ram, nram, MEM_EXT, MEM_EXT + (uint64_t)extmem);
+	if (nram == 0)
+		panic("mem_nvram: no memory found");
+	return nram;
+}
+
 void
 mem_init(void)
 {
 	if (!cpu_onboot())	// only do once, on the boot CPU
 		return;
 
-	// Determine how much base (<640K) and extended (>1MB) memory
-	// is available in the system (in bytes),
-	// by reading the PC's BIOS-managed nonvolatile RAM (NVRAM).
-	// The NVRAM tells us how many kilobytes there are.
-	// Since the count is 16 bits, this gives us up to 64MB of RAM;
-	// additional RAM beyond that would have to be detected another way.
-	size_t basemem = ROUNDDOWN(nvram_read16(NVRAM_BASELO)*1024, PAGESIZE);
-	size_t extmem = ROUNDDOWN(nvram_read16(NVRAM_EXTLO)*1024, PAGESIZE);
+	// Find the usable RAM ranges, preferably from the BIOS memory map
+	// the boot loader left for us, or failing that from the NVRAM.
+	memrange ram[MEM_MAXRANGE];
+	int nram = mem_e820(ram);
+	if (nram == 0)
+		nram = mem_nvram(ram);
 
-	warn("Assuming we have 1GB of memory!");
-	extmem = 1024*1024*1024 - MEM_EXT;	// assume 1GB total memory
-
-	// The maximum physical address is the top of extended memory.
-	mem_max = MEM_EXT + extmem;
+	// The maximum physical address is the top of the highest RAM range.
+	// Pages between ranges are holes we never hand out.
+	mem_max = ram[nram-1].hi;
 
 	// Compute the total number of physical pages (including I/O holes)
 	mem_npage = mem_max / PAGESIZE;
 
-	cprintf("Physical memory: %dK available, ", (int)(mem_max/1024));
-	cprintf("base = %dK, extended = %dK\n",
-		(int)(basemem/1024), (int)(extmem/1024));
+	size_t avail = 0;
+	int i;
+	for (i = 0; i < nram; i++)
+		avail += ram[i].hi - ram[i].lo;
+	cprintf("Physical memory: %dK available, top = %dK, %d ranges\n",
+		(int)(avail/1024), (int)(mem_max/1024), nram);
 
   spinlock_init(&_freelist_lock);
-  pageinfo *mem_pageinfo = (pageinfo*)ROUNDUP((uint32_t)end, (uint32_t)sizeof(pageinfo));
+  spinlock_init(&mem_zerolock);
+  rwlock_init(&mem_rrlock);
+  spinlock_init(&mem_cachelock);
+  mem_pageinfo = (pageinfo*)ROUNDUP((uint32_t)end, (uint32_t)sizeof(pageinfo));
   memset(mem_pageinfo, 0, sizeof(pageinfo)*mem_npage);
-	pageinfo **freetail = &mem_freelist;
-	int i;
-	// Pages 0 and 1 are reserved.
-	for (i = 2; i < mem_npage; i++) {           
-    // All of base memory otherwise is free after the kernel
-    // and the pageinfo table all memory should be free
-    if(i < basemem/4096 ||          
-      i >= (uint32_t)(ROUNDUP(&mem_pageinfo[mem_npage],4096))/4096) {
-      // A free page has no references to it.
-      mem_pageinfo[i].refcount = 0;
-      // Add the page to the end of the free list.
-      *freetail = &mem_pageinfo[i];
-      freetail = &mem_pageinfo[i].free_next;
-    }
+
+	// The kernel and the pageinfo table occupy [start,pgend).
+	uint32_t pgstart = ROUNDDOWN(mem_phys(start), PAGESIZE) / PAGESIZE;
+	uint32_t pgend = ROUNDUP(mem_phys(&mem_pageinfo[mem_npage]), PAGESIZE)
+				/ PAGESIZE;
+	assert(pgend <= mem_npage);
+
+	spinlock_acquire(&_freelist_lock);
+	for (i = 0; i < nram; i++) {
+		uint32_t pg = ram[i].lo / PAGESIZE;
+		uint32_t pglim = ram[i].hi / PAGESIZE;
+		for (; pg < pglim; pg++) {
+			// Pages 0 and 1 are reserved.
+			if (pg < 2 || (pg >= pgstart && pg < pgend))
+				continue;
+			// A free page has no references to it.
+			mem_pageinfo[pg].refcount = 0;
+			// Give the page to the buddy allocator,
+			// which coalesces it with any free neighbors.
+			mem_buddy_free(&mem_pageinfo[pg], 0);
+		}
 	}
-	*freetail = NULL;	// null-terminate the freelist
+	spinlock_release(&_freelist_lock);
 	// Check to make sure the page allocator seems to work correctly.
-	mem_check();
+	if (INIT_CHECKS)
+		mem_check();
+}
+
+// The buddy allocator keeps free memory in naturally aligned blocks
+// of 2^order pages, one doubly-linked freelist per order.
+// Only the first page of a free block is on a freelist;
+// its 'free' flag and 'order' field identify the block,
+// so that a freed block can find and absorb its buddy in O(1).
+// Pages sitting in per-CPU caches count as allocated here.
+// The caller must hold _freelist_lock.
+
+static void
+mem_buddy_insert(pageinfo *pi, int order)
+{
+	pi->free = 1;
+	pi->order = order;
+	pi->free_prev = NULL;
+	pi->free_next = mem_freelist[order];
+	if (pi->free_next != NULL)
+		pi->free_next->free_prev = pi;
+	mem_freelist[order] = pi;
+}
+
+static void
+mem_buddy_unlink(pageinfo *pi)
+{
+	assert(pi->free);
+	if (pi->free_prev != NULL)
+		pi->free_prev->free_next = pi->free_next;
+	else
+		mem_freelist[pi->order] = pi->free_next;
+	if (pi->free_next != NULL)
+		pi->free_next->free_prev = pi->free_prev;
+	pi->free = 0;
+	pi->free_next = pi->free_prev = NULL;
+}
+
+// Allocate a block of 2^order pages, splitting a larger block if needed.
+static pageinfo *
+mem_buddy_alloc(int order)
+{
+	assert(spinlock_holding(&_freelist_lock));
+	int o = order;
+	while (o < MEM_NORDER && mem_freelist[o] == NULL)
+		o++;
+	if (o == MEM_NORDER)
+		return NULL;	// no block big enough
+
+	pageinfo *pi = mem_freelist[o];
+	mem_buddy_unlink(pi);
+	while (o > order) {	// give back the upper halves
+		o--;
+		mem_buddy_insert(pi + (1 << o), o);
+	}
+	mem_nfreepages -= 1 << order;
+	return pi;
+}
+
+// Free a block of 2^order pages, merging it with its buddies while we can.
+static void
+mem_buddy_free(pageinfo *pi, int order)
+{
+	assert(spinlock_holding(&_freelist_lock));
+	assert(!pi->free);
+	uint32_t idx = pi - mem_pageinfo;
+	assert((idx & ((1 << order) - 1)) == 0);	// naturally aligned
+
+	mem_nfreepages += 1 << order;
+	while (order < MEM_MAXORDER) {
+		uint32_t bidx = idx ^ (1 << order);
+		if (bidx >= mem_npage)
+			break;
+		pageinfo *bpi = &mem_pageinfo[bidx];
+		if (!bpi->free || bpi->order != order)
+			break;	// buddy not free as a whole
+		mem_buddy_unlink(bpi);
+		idx &= ~(1 << order);
+		order++;
+	}
+	mem_buddy_insert(&mem_pageinfo[idx], order);
+}
+
+// Reset the per-page state of a block that is being handed out.
+static void
+mem_blockinit(pageinfo *pi, int order)
+{
+	int i;
+	for (i = 0; i < (1 << order); i++) {
+		pi[i].free_next = NULL;
+		pi[i].super = 0;
+		pi[i].cached = 0;
+		pi[i].shm = 0;
+		pi[i].pulling = 0;
+		pi[i].swapnode = 0;
+		pi[i].home = 0;
+		pi[i].shared = 0;
+	}
+}
+
+// Move up to MEM_BATCH pages from the global freelist
+// into CPU c's private page cache.
+static void
+mem_refill(cpu *c)
+{
+	spinlock_acquire(&_freelist_lock);
+	int n;
+	for (n = 0; n < MEM_BATCH; n++) {
+		pageinfo *pi = mem_buddy_alloc(0);
+		if (pi == NULL)
+			break;
+		pi->free_next = c->pgcache;
+		c->pgcache = pi;
+	}
+	spinlock_release(&_freelist_lock);
+
+	c->npgcache += n;
+	c->pgrefill++;
+}
+
+// Return the coldest pages of CPU c's page cache to the global freelist,
+// keeping only the 'keep' most recently freed pages cached.
+static void
+mem_drain(cpu *c, int keep)
+{
+	if (c->npgcache <= keep)
+		return;
+
+	pageinfo **pp = &c->pgcache;
+	int i;
+	for (i = 0; i < keep; i++)
+		pp = &(*pp)->free_next;
+	pageinfo *pi = *pp;
+	*pp = NULL;
+	c->npgcache = keep;
+
+	spinlock_acquire(&_freelist_lock);
+	while (pi != NULL) {
+		pageinfo *next = pi->free_next;
+		pi->free_next = NULL;
+		mem_buddy_free(pi, 0);
+		pi = next;
+	}
+	spinlock_release(&_freelist_lock);
+	c->pgdrain++;
+}
+
+// Take a page off the pre-zeroed list, or return NULL if it is empty.
+static pageinfo *
+mem_zeropop(void)
+{
+	if (mem_zerolist == NULL)	// racy peek, rechecked below
+		return NULL;
+
+	spinlock_acquire(&mem_zerolock);
+	pageinfo *pi = mem_zerolist;
+	if (pi != NULL) {
+		mem_zerolist = pi->free_next;
+		mem_nzero--;
+	}
+	spinlock_release(&mem_zerolock);
+
+	if (pi != NULL)
+		mem_blockinit(pi, 0);
+	return pi;
 }
 
 //
@@ -89,37 +353,256 @@ mem_init(void)
 // Does NOT set the contents of the physical page to zero -
 // the caller must do that if necessary.
 //
+// Pages come from the current CPU's page cache whenever possible.
+// The kernel always runs with interrupts disabled,
+// so the per-CPU cache needs no lock of its own;
+// only a cache refill touches the shared freelist and its lock.
+//
 // RETURNS 
 //   - a pointer to the page's pageinfo struct if successful
 //   - NULL if no available physical pages.
 //
-// Hint: pi->refs should not be incremented 
-// Hint: be sure to use proper mutual exclusion for multiprocessor operation.
 pageinfo *
 mem_alloc(void)
 {
-  if(!spinlock_holding(&_freelist_lock));
-    spinlock_acquire(&_freelist_lock);
-	pageinfo *p = mem_freelist;
-	if(p != NULL)
-		mem_freelist = p->free_next;	// Remove page from free list
-	p->home = 0;
-	p->shared = 0;
-  spinlock_release(&_freelist_lock);
-  return p;
+	cpu *c = cpu_cur();
+	if (c->pgcache == NULL)
+		mem_refill(c);
+
+	// Before giving up, finish freeing any dead address spaces,
+	// then evict the least recently used unmapped replicas.
+	while (c->pgcache == NULL && pmap_reap())
+		/* pmap_reap() frees into our cache */;
+	if (c->pgcache == NULL)
+		mem_rrevict(MEM_BATCH);
+
+	pageinfo *p = c->pgcache;
+	if (p == NULL)
+		return mem_zeropop();	// last resort: use a pre-zeroed page
+	c->pgcache = p->free_next;
+	c->npgcache--;
+
+	mem_blockinit(p, 0);
+	return p;
 }
 
 //
 // Return a page to the free list, given its pageinfo pointer.
 // (This function should only be called when pp->pp_ref reaches 0.)
+// The page goes to the current CPU's page cache,
+// which spills half its contents to the global freelist when full.
 //
 void
 mem_free(pageinfo *pi)
 {
-  spinlock_acquire(&_freelist_lock);
-  pi->free_next = mem_freelist;
-  mem_freelist = pi;
-  spinlock_release(&_freelist_lock);
+	if (pi->home != 0)
+		mem_rruntrack(pi);
+	cpu *c = cpu_cur();
+	pi->free_next = c->pgcache;
+	c->pgcache = pi;
+	if (++c->npgcache > MEM_CACHEMAX)
+		mem_drain(c, MEM_CACHEMAX - MEM_BATCH);
+}
+
+// Allocate a physically contiguous, naturally aligned block
+// of 2^order pages, returning the pageinfo of its first page.
+// The refcount of each page in the block remains zero.
+// Returns NULL if no block of that size is free.
+pageinfo *
+mem_alloc_order(int order)
+{
+	assert(order >= 0 && order <= MEM_MAXORDER);
+	if (order == 0)
+		return mem_alloc();
+
+	spinlock_acquire(&_freelist_lock);
+	pageinfo *pi = mem_buddy_alloc(order);
+	spinlock_release(&_freelist_lock);
+
+	if (pi != NULL)
+		mem_blockinit(pi, order);
+	return pi;
+}
+
+// Free a block of 2^order pages obtained from mem_alloc_order().
+void
+mem_free_order(pageinfo *pi, int order)
+{
+	assert(order >= 0 && order <= MEM_MAXORDER);
+	if (order == 0)
+		return mem_free(pi);
+
+	spinlock_acquire(&_freelist_lock);
+	mem_buddy_free(pi, order);
+	spinlock_release(&_freelist_lock);
+}
+
+// Allocate a physical page whose contents are all zero.
+// Idle CPUs keep a pool of pre-zeroed pages (see mem_zeroidle),
+// so the common case avoids clearing a page on the caller's critical path.
+pageinfo *
+mem_alloczero(void)
+{
+	pageinfo *pi = mem_zeropop();
+	if (pi != NULL)
+		return pi;
+
+	pi = mem_alloc();
+	if (pi != NULL)
+		memset(mem_pi2ptr(pi), 0, PAGESIZE);
+	return pi;
+}
+
+// Called from the scheduler's idle loop:
+// zero one free page and add it to the pre-zeroed pool,
+// unless the pool is already full or memory is tight.
+// Returns true if it did some work.
+bool
+mem_zeroidle(void)
+{
+	if (mem_nzero >= MEM_ZEROMAX || mem_nfreepages < MEM_ZEROMAX)
+		return 0;
+
+	pageinfo *pi = mem_alloc();
+	if (pi == NULL)
+		return 0;
+	memset(mem_pi2ptr(pi), 0, PAGESIZE);
+
+	spinlock_acquire(&mem_zerolock);
+	pi->free_next = mem_zerolist;
+	mem_zerolist = pi;
+	mem_nzero++;
+	spinlock_release(&mem_zerolock);
+	return 1;
+}
+
+void
+mem_cachedrain(void)
+{
+	mem_drain(cpu_cur(), 0);
+}
+
+// Return the number of free pages,
+// counting the global freelists and the current CPU's cache.
+size_t
+mem_nfree(void)
+{
+	return mem_nfreepages + cpu_cur()->npgcache;
+}
+
+// For the allocator self-tests: temporarily take away all free memory,
+// saving the buddy freelists in 'save[MEM_NORDER]'.
+// The caller must not free more than MEM_CACHEMAX pages before mem_unsteal,
+// so that no page is coalesced with a buddy on the stolen lists.
+void
+mem_steal(pageinfo **save, size_t *nsave)
+{
+	mem_cachedrain();
+	spinlock_acquire(&_freelist_lock);
+	memmove(save, mem_freelist, sizeof(mem_freelist));
+	memset(mem_freelist, 0, sizeof(mem_freelist));
+	*nsave = mem_nfreepages;
+	mem_nfreepages = 0;
+	spinlock_release(&_freelist_lock);
+}
+
+// Give back the free memory taken by mem_steal().
+void
+mem_unsteal(pageinfo **save, size_t nsave)
+{
+	spinlock_acquire(&_freelist_lock);
+	memmove(mem_freelist, save, sizeof(mem_freelist));
+	mem_nfreepages = nsave;
+	spinlock_release(&_freelist_lock);
+}
+
+// Remote references we hold local copies of are tracked in an
+// open-addressed hash table keyed on the full RR,
+// so lookups cost the same however many nodes share a physical address,
+// and nodes needn't have identical amounts of RAM.
+// Linear probing, with deletion by shifting later entries back,
+// keeps every entry within MEM_RRPROBE slots of its hash so no tombstones pile up.
+// Tracking is only an optimization: if the neighborhood is full,
+// we just don't track the page and may later fetch it again.
+// Besides pages, the table also tracks local copies of remote objects
+// that don't own a whole page, such as procs (see mem_rrtrackobj).
+typedef struct mem_rrent {
+	uint32_t	rr;		// Remote reference, 0 if slot empty
+	bool		ispage;		// obj is a pageinfo, not a kernel object
+	void		*obj;		// Our local copy
+} mem_rrent;
+
+static mem_rrent mem_rrhash[MEM_RRHASHSIZE];
+
+static inline uint32_t
+mem_rrhashfn(uint32_t rr)
+{
+	return (rr * 2654435761U) >> (32 - MEM_RRHASHBITS);
+}
+
+// Find the slot holding rr, or -1.  Caller must hold mem_rrlock.
+static int
+mem_rrfind(uint32_t rr)
+{
+	uint32_t h = mem_rrhashfn(rr);
+	int i;
+	for (i = 0; i < MEM_RRPROBE; i++) {
+		mem_rrent *e = &mem_rrhash[(h + i) & (MEM_RRHASHSIZE-1)];
+		if (e->rr == rr)
+			return e - mem_rrhash;
+		if (e->rr == 0)
+			break;
+	}
+	return -1;
+}
+
+// Enter rr -> obj in the hash table, replacing any existing entry for rr.
+// Caller must hold mem_rrlock for writing.
+static void
+mem_rrinsert(uint32_t rr, void *obj, bool ispage)
+{
+	int i = mem_rrfind(rr);
+	if (i < 0) {
+		uint32_t h = mem_rrhashfn(rr);
+		for (i = 0; i < MEM_RRPROBE; i++) {
+			mem_rrent *e = &mem_rrhash[(h + i) & (MEM_RRHASHSIZE-1)];
+			if (e->rr == 0)
+				break;
+		}
+		if (i == MEM_RRPROBE)
+			return;		// neighborhood full: don't track
+		i = (h + i) & (MEM_RRHASHSIZE-1);
+	}
+	mem_rrhash[i].rr = rr;
+	mem_rrhash[i].ispage = ispage;
+	mem_rrhash[i].obj = obj;
+}
+
+// Remove the entry mapping rr to obj, if there is one.
+// Caller must hold mem_rrlock for writing.
+static void
+mem_rrremove(uint32_t rr, void *obj)
+{
+	int i = mem_rrfind(rr);
+	if (i < 0 || mem_rrhash[i].obj != obj)
+		return;
+
+	// Shift back any later entries in the cluster
+	// that would no longer be reachable across the hole.
+	int j = i;
+	while (1) {
+		j = (j + 1) & (MEM_RRHASHSIZE-1);
+		if (mem_rrhash[j].rr == 0)
+			break;
+		uint32_t h = mem_rrhashfn(mem_rrhash[j].rr);
+		if (((j - h) & (MEM_RRHASHSIZE-1)) >=
+				((j - i) & (MEM_RRHASHSIZE-1))) {
+			mem_rrhash[i] = mem_rrhash[j];
+			i = j;
+		}
+	}
+	mem_rrhash[i].rr = 0;
+	mem_rrhash[i].obj = NULL;
 }
 
 // When we receive a copy of a page or kernel object from a remote node,
@@ -131,35 +614,104 @@ void mem_rrtrack(uint32_t rr, pageinfo *pi)
 	assert(pi != mem_ptr2pi(pmap_zero));	// Don't track zero page!
 	assert(pi < mem_ptr2pi(start) || pi > mem_ptr2pi(end-1));
 
-	// Change these to use whatever your memory spinlock is called.
-	spinlock_acquire(&mem_freelock);
-
 	uint8_t node = RRNODE(rr);
 	assert(node > 0 && node <= NET_MAXNODES);
+	assert(rr != 0);
+
+	pi->home = rr;
+
+	rwlock_wracquire(&mem_rrlock);
+	int i = mem_rrfind(rr);
+	if (i >= 0)	// stale entry for a copy that's being freed
+		assert(mem_rrhash[i].ispage &&
+			((pageinfo*)mem_rrhash[i].obj)->refcount == 0);
+	mem_rrinsert(rr, pi, 1);
+	rwlock_wrrelease(&mem_rrlock);
+}
+
+// Stop tracking a page we got from a remote node, e.g., because it's freed.
+void
+mem_rruntrack(pageinfo *pi)
+{
+	uint32_t rr = pi->home;
+	if (rr == 0)
+		return;
+
+	rwlock_wracquire(&mem_rrlock);
+	mem_rrremove(rr, pi);
+	rwlock_wrrelease(&mem_rrlock);
+}
+
+// Take a replica off the replica cache.  Caller holds mem_cachelock.
+static void
+mem_cacheunlink(pageinfo *pi)
+{
+	assert(pi->cached);
+	if (pi->free_prev != NULL)
+		pi->free_prev->free_next = pi->free_next;
+	else
+		mem_cachehead = pi->free_next;
+	if (pi->free_next != NULL)
+		pi->free_next->free_prev = pi->free_prev;
+	else
+		mem_cachetail = pi->free_prev;
+	pi->free_next = pi->free_prev = NULL;
+	pi->cached = 0;
+	mem_ncached--;
+}
 
-	// Look up our pageinfo struct containing our homelist
-	// for the appropriate remote physical address.
-	// This design assumes that our pageinfo array will be big enough,
-	// which implies that all nodes must have the same amount of RAM.
-	// This could easily be fixed by allocating a separate hash table
-	// mapping remote references to local pages.
-	uint32_t addr = RRADDR(rr);
-	pageinfo *hpi = mem_phys2pi(addr);
-	assert(hpi > &mem_pageinfo[1] && hpi < &mem_pageinfo[mem_npage]);
-
-	// Quick scan just to make sure it's not already there - shouldn't be!
-	pageinfo *spi;
-	for (spi = hpi->homelist; spi != NULL; spi = spi->homenext) {
-		assert(RRADDR(spi->home) == addr);
-		assert(spi->home != rr);
+// Called by mem_decref() when the last local reference to a replica
+// of a remote page goes away: keep it tracked, at the head of the cache.
+void
+mem_rrcache(pageinfo *pi)
+{
+	spinlock_acquire(&mem_cachelock);
+	if (pi->refcount == 0 && !pi->cached) {	// not revived meanwhile
+		pi->free_prev = NULL;
+		pi->free_next = mem_cachehead;
+		if (mem_cachehead != NULL)
+			mem_cachehead->free_prev = pi;
+		else
+			mem_cachetail = pi;
+		mem_cachehead = pi;
+		pi->cached = 1;
+		mem_ncached++;
 	}
+	spinlock_release(&mem_cachelock);
+}
 
-	// Insert the new page at the head of the appropriate homelist
-	pi->home = rr;
-	pi->homenext = hpi->homelist;
-	hpi->homelist = pi;
+// Evict up to n replicas from the cold end of the replica cache,
+// untracking and freeing them.  Returns the number evicted.
+size_t
+mem_rrevict(size_t n)
+{
+	if (mem_cachetail == NULL)	// racy peek, rechecked below
+		return 0;
+
+	// Holding mem_rrlock for writing keeps lookups from reviving
+	// the replicas we take while we untrack them.
+	pageinfo *list = NULL;
+	size_t i;
+	rwlock_wracquire(&mem_rrlock);
+	spinlock_acquire(&mem_cachelock);
+	for (i = 0; i < n && mem_cachetail != NULL; i++) {
+		pageinfo *pi = mem_cachetail;
+		mem_cacheunlink(pi);
+		mem_rrremove(pi->home, pi);
+		pi->home = 0;
+		pi->shared = 0;
+		pi->free_next = list;
+		list = pi;
+	}
+	spinlock_release(&mem_cachelock);
+	rwlock_wrrelease(&mem_rrlock);
 
-	spinlock_release(&mem_freelock);
+	while (list != NULL) {
+		pageinfo *pi = list;
+		list = pi->free_next;
+		mem_free(pi);
+	}
+	return i;
 }
 
 // Given a remote reference to a page on some other node,
@@ -169,30 +721,59 @@ void mem_rrtrack(uint32_t rr, pageinfo *pi)
 pageinfo *
 mem_rrlookup(uint32_t rr)
 {
-	// Change these to use whatever your memory spinlock is called.
-	spinlock_acquire(&mem_freelock);
-
 	uint8_t node = RRNODE(rr);
 	assert(node > 0 && node <= NET_MAXNODES);
-	uint32_t addr = RRADDR(rr);
-	pageinfo *pi = mem_phys2pi(addr);
-	assert(pi > &mem_pageinfo[1] && pi < &mem_pageinfo[mem_npage]);
 
-	// Search for a page corresponding to this rr in the homelist
-	for (pi = pi->homelist; pi != NULL; pi = pi->homenext) {
-		assert(RRADDR(pi->home) == addr);
-		if (pi->home == rr) {		// found it!
-			// Take a reference while we still have
-			// the pageinfo array locked, so it can't go away.
+	rwlock_rdacquire(&mem_rrlock);
+	pageinfo *pi = NULL;
+	int i = mem_rrfind(rr);
+	if (i >= 0 && mem_rrhash[i].ispage) {
+		pi = mem_rrhash[i].obj;
+		assert(pi->home == rr);
+		// Take a reference while we still have
+		// the table locked, so it can't go away.
+		// An unused replica comes back off the replica cache;
+		// one whose last reference is being dropped doesn't count.
+		if (pi->refcount > 0)
 			mem_incref(pi);
-			break;
+		else {
+			spinlock_acquire(&mem_cachelock);
+			if (pi->cached) {
+				mem_cacheunlink(pi);
+				mem_incref(pi);
+			} else if (pi->refcount > 0)	// revived meanwhile
+				mem_incref(pi);
+			else
+				pi = NULL;
+			spinlock_release(&mem_cachelock);
 		}
 	}
-
-	spinlock_release(&mem_freelock);
+	rwlock_rdrelease(&mem_rrlock);
 	return pi;
 }
 
+// Track and look up local copies of remote kernel objects
+// that share their pages with other objects, such as slab-allocated procs.
+// Unlike pages, these carry no reference count of their own.
+void
+mem_rrtrackobj(uint32_t rr, void *obj)
+{
+	assert(RRNODE(rr) > 0 && RRNODE(rr) <= NET_MAXNODES);
+	rwlock_wracquire(&mem_rrlock);
+	mem_rrinsert(rr, obj, 0);
+	rwlock_wrrelease(&mem_rrlock);
+}
+
+void *
+mem_rrlookupobj(uint32_t rr)
+{
+	rwlock_rdacquire(&mem_rrlock);
+	int i = mem_rrfind(rr);
+	void *obj = (i >= 0 && !mem_rrhash[i].ispage) ? mem_rrhash[i].obj : NULL;
+	rwlock_rdrelease(&mem_rrlock);
+	return obj;
+}
+
 //
 // Check the physical page allocator (mem_alloc(), mem_free())
 // for correct operation after initialization via mem_init().
@@ -201,18 +782,23 @@ void
 mem_check()
 {
 	pageinfo *pp, *pp0, *pp1, *pp2;
-	pageinfo *fl;
-	int i;
+	pageinfo *fl[MEM_NORDER];
+	size_t nfl;
+	int i, o;
 
   // if there's a page that shouldn't be on
   // the free list, try to make sure it
   // eventually causes trouble.
 	int freepages = 0;
-	for (pp = mem_freelist; pp != 0; pp = pp->free_next) {
-		memset(mem_pi2ptr(pp), 0x97, 128);
-		freepages++;
-	}
+	for (o = 0; o < MEM_NORDER; o++)
+		for (pp = mem_freelist[o]; pp != 0; pp = pp->free_next) {
+			assert(pp->free && pp->order == o);
+			for (i = 0; i < (1 << o); i++)
+				memset(mem_pi2ptr(pp + i), 0x97, 128);
+			freepages += 1 << o;
+		}
 	cprintf("mem_check: %d free pages\n", freepages);
+	assert(freepages == mem_nfree());
 	assert(freepages < mem_npage);	// can't have more free than total!
 	assert(freepages > 16000);	// make sure it's in the right ballpark
 
@@ -229,12 +815,13 @@ mem_check()
   assert(mem_pi2phys(pp1) < mem_npage*PAGESIZE);
   assert(mem_pi2phys(pp2) < mem_npage*PAGESIZE);
 
-	// temporarily steal the rest of the free pages
-	fl = mem_freelist;
-	mem_freelist = 0;
+	// temporarily steal the rest of the free pages,
+	// including any our CPU has cached
+	mem_steal(fl, &nfl);
 
 	// should be no free memory
 	assert(mem_alloc() == 0);
+	assert(mem_alloc_order(1) == 0);
 
   // free and re-allocate?
   mem_free(pp0);
@@ -250,13 +837,78 @@ mem_check()
 	assert(mem_alloc() == 0);
 
 	// give free list back
-	mem_freelist = fl;
+	mem_unsteal(fl, nfl);
 
 	// free the pages we took
 	mem_free(pp0);
 	mem_free(pp1);
 	mem_free(pp2);
 
+	// check that multi-page blocks are aligned and coalesce when freed
+	mem_cachedrain();
+	size_t nfree = mem_nfree();
+	pp0 = mem_alloc_order(2); assert(pp0 != 0);
+	pp1 = mem_alloc_order(MEM_MAXORDER); assert(pp1 != 0);
+	assert(((pp0 - mem_pageinfo) & 3) == 0);
+	assert((mem_pi2phys(pp1) & (PTSIZE-1)) == 0);
+	assert(pp1 + NPTENTRIES <= pp0 || pp0 + 4 <= pp1);
+	assert(mem_nfree() == nfree - 4 - NPTENTRIES);
+	mem_free_order(pp1, MEM_MAXORDER);
+	mem_free_order(pp0, 2);
+	assert(mem_nfree() == nfree);
+	pp = mem_alloc_order(2);
+	assert(pp == pp0);	// should get the same coalesced block back
+	mem_free_order(pp, 2);
+
+	// check remote reference tracking,
+	// with two nodes' RRs for the same physical address
+	uint32_t rr0 = RRCONS(1, 0x123000, SYS_READ);
+	uint32_t rr1 = RRCONS(2, 0x123000, SYS_READ);
+	pp0 = mem_alloc(); mem_incref(pp0);
+	pp1 = mem_alloc(); mem_incref(pp1);
+	mem_rrtrack(rr0, pp0);
+	mem_rrtrack(rr1, pp1);
+	assert(mem_rrlookup(rr0) == pp0 && pp0->refcount == 2);
+	assert(mem_rrlookup(rr1) == pp1 && pp1->refcount == 2);
+	assert(mem_rrlookup(RRCONS(3, 0x123000, SYS_READ)) == NULL);
+	pp0->refcount = 1;
+	mem_decref(pp0, mem_free);	// freeing stops tracking
+	assert(mem_rrlookup(rr0) == NULL);
+	assert(mem_rrlookup(rr1) == pp1);
+	pp1->refcount = 1;
+	mem_decref(pp1, mem_free);
+	assert(mem_rrlookup(rr1) == NULL);
+
+	// check the replica cache: an unused replica others hold RRs to
+	// stays tracked and revivable until evicted
+	assert(mem_ncached == 0);
+	pp0 = mem_alloc(); mem_incref(pp0);
+	mem_rrtrack(rr0, pp0);
+	pp0->shared = 1;
+	mem_decref(pp0, mem_free);
+	assert(pp0->cached && mem_ncached == 1 && mem_cachetail == pp0);
+	assert(mem_rrlookup(rr0) == pp0 && pp0->refcount == 1);
+	assert(!pp0->cached && mem_ncached == 0);
+	mem_decref(pp0, mem_free);
+	assert(mem_rrevict(2) == 1);
+	assert(!pp0->cached && pp0->home == 0 && pp0->shared == 0);
+	assert(mem_rrlookup(rr0) == NULL);
+
+	// check the pre-zeroed page pool
+	assert(mem_nzero == 0);
+	assert(mem_zeroidle());
+	assert(mem_nzero == 1);
+	pp0 = mem_zerolist;
+	pp = mem_alloczero();
+	assert(pp == pp0 && mem_nzero == 0);
+	for (i = 0; i < PAGESIZE; i++)
+		assert(((uint8_t*)mem_pi2ptr(pp))[i] == 0);
+	memset(mem_pi2ptr(pp), 0x97, PAGESIZE);
+	mem_free(pp);
+	pp = mem_alloczero();	// not pre-zeroed, so must be cleared here
+	for (i = 0; i < PAGESIZE; i++)
+		assert(((uint8_t*)mem_pi2ptr(pp))[i] == 0);
+	mem_free(pp);
+
 	cprintf("mem_check() succeeded!\n");
 }
-
@@ -45,11 +45,17 @@
 // but that might make debugging a bit more challenging.
 typedef struct pageinfo {
 	struct pageinfo	*free_next;	// Next page number on free list
+	struct pageinfo	*free_prev;	// Previous page on buddy freelist
+	uint8_t	free;			// Page heads a free buddy block
+	uint8_t	order;			// Order of that block: 2^order pages
+	uint8_t	super;			// Heads a 4MB superpage counted as one
+	uint8_t	cached;			// Unused replica on the replica cache
+	uint8_t	shm;			// Shared outright, never copied (SYS_SHARE)
+	uint8_t	pulling;		// Tracked copy whose contents are in flight
+	uint8_t	swapnode;		// Node we hold it for (see net_rxswap())
 	int32_t	refcount;		// Reference count on allocated pages
 	uint32_t home;			// Remote reference to page's home
 	uint32_t shared;		// Other nodes I've given RRs to
-	struct pageinfo *homelist;	// My pages with homes at this physaddr
-	struct pageinfo *homenext;	// Next pointer on homelist
 } pageinfo;
 
 
@@ -72,9 +78,27 @@ extern pageinfo *mem_pageinfo;	// Metadata array indexed by page number
 extern char start[], end[];
 
 
+// A range [lo,hi) of usable physical RAM found during memory detection.
+typedef struct memrange {
+	uint32_t	lo;
+	uint32_t	hi;
+} memrange;
+
+#define MEM_MAXRANGE	16		// Max discontiguous RAM ranges we use
+
 // Detect available physical memory and initialize the mem_pageinfo array.
 void mem_init(void);
 
+// The buddy allocator manages the global freelist in blocks of 2^order pages,
+// up to 4MB (one page table's worth) in a single block.
+#define MEM_MAXORDER	10		// 2^10 pages = PTSIZE
+#define MEM_NORDER	(MEM_MAXORDER+1)
+
+// Each CPU caches up to MEM_CACHEMAX free pages in its cpu struct,
+// and moves pages to or from the global freelist MEM_BATCH at a time.
+#define MEM_BATCH	16		// Pages moved per refill or drain
+#define MEM_CACHEMAX	(MEM_BATCH*2)	// Max free pages cached per CPU
+
 // Allocate a physical page and return a pointer to its pageinfo struct.
 // Returns NULL if no more physical pages are available.
 pageinfo *mem_alloc(void);
@@ -82,10 +106,54 @@ pageinfo *mem_alloc(void);
 // Return a physical page to the free list.
 void mem_free(pageinfo *pi);
 
+// Allocate or free a physically contiguous, naturally aligned block
+// of 2^order pages.  Order 0 is the same as mem_alloc()/mem_free().
+pageinfo *mem_alloc_order(int order);
+void mem_free_order(pageinfo *pi, int order);
+
+// Idle CPUs keep up to MEM_ZEROMAX pre-zeroed pages ready,
+// so that faults on fresh (PTE_ZERO) pages needn't clear a page.
+#define MEM_ZEROMAX	256
+
+// Allocate a page that is known to contain all zeros.
+pageinfo *mem_alloczero(void);
+
+// Zero one page into the pre-zeroed pool from the idle loop.
+// Returns true if there was work to do.
+bool mem_zeroidle(void);
+
+// Return all pages in the current CPU's page cache to the global freelist.
+void mem_cachedrain(void);
+
+// Return the number of free pages (global freelists plus this CPU's cache).
+size_t mem_nfree(void);
+
+// Temporarily take away and give back all free memory, for self-tests.
+void mem_steal(pageinfo **save, size_t *nsave);
+void mem_unsteal(pageinfo **save, size_t nsave);
+
 extern uint8_t pmap_zero[PAGESIZE];	// for the asserts below
 
+// Hash table mapping remote references to our local copies of those pages.
+#define MEM_RRHASHBITS	13
+#define MEM_RRHASHSIZE	(1 << MEM_RRHASHBITS)
+#define MEM_RRPROBE	32		// Max slots searched per lookup
+
 void mem_rrtrack(uint32_t rr, pageinfo *pi);
+void mem_rruntrack(pageinfo *pi);
 pageinfo *mem_rrlookup(uint32_t rr);
+void mem_rrtrackobj(uint32_t rr, void *obj);
+void *mem_rrlookupobj(uint32_t rr);
+
+// Local copies of remote pages that nothing maps anymore stay tracked
+// on a replica cache, linked through free_next/free_prev in LRU order,
+// so that mem_rrlookup() can revive them when a process migrates here again.
+// This is safe because a node never modifies a page in place
+// once it has given out an RR to it (see pmap_cowpage()),
+// so an RR names the same contents for as long as the RR exists.
+// Under memory pressure mem_alloc() evicts the oldest replicas.
+void mem_rrcache(pageinfo *pi);
+size_t mem_rrevict(size_t n);
 
 
 // Atomically increment the reference count on a page.
@@ -108,9 +176,12 @@ mem_decref(pageinfo* pi, void (*freefun)(pageinfo *pi))
 	assert(pi != mem_ptr2pi(pmap_zero));	// Don't alloc/free zero page!
 	assert(pi < mem_ptr2pi(start) || pi > mem_ptr2pi(end-1));
 
-	if (lockaddz(&pi->refcount, -1))
+	if (lockaddz(&pi->refcount, -1)) {
 		if (pi->shared == 0)	// free only if no remote refs
 			freefun(pi);
+		else if (pi->home != 0 && freefun == mem_free)
+			mem_rrcache(pi);	// keep replica for reuse
+	}
 	assert(pi->refcount >= 0);
 }
 
@@ -13,31 +13,152 @@
 #include <kern/spinlock.h>
 #include <kern/trap.h>
 #include <kern/proc.h>
+#include <kern/syscall.h>
 #include <kern/net.h>
+#include <kern/trace.h>
 
-#include <dev/e100.h>
+#include <dev/lapic.h>
 
 
+net_dev *net_netdev; // Network card driver we're using
 uint8_t net_node; // My node number - from net_mac[5]
 uint8_t net_mac[6]; // My MAC address from the Ethernet card
 
 spinlock net_lock;
+netstats net_stats;
 proc *net_migrlist; // List of currently migrating processes
 proc *net_pulllist; // List of processes currently pulling a page
+proc *net_swaplist; // List of processes paging out to other nodes
 
 #define NET_ETHERTYPE 0x9876  // Claim this ethertype for our packets
 
+static uint32_t net_ticks;  // Timer ticks counted by net_tick(), under net_lock
+
+// Retransmission timer wheel: slot i holds timers expiring at ticks = i mod size
+static net_timer *net_wheel[NET_WHEELSIZE];
+
+// Round-trip time estimates for each node we talk to,
+// kept TCP-style in timer ticks (see net_rttsample()).
+typedef struct net_rtt {
+  bool      valid;    // Have at least one sample
+  int32_t   srtt;     // Smoothed RTT, scaled by 8
+  int32_t   rttvar;   // Smoothed RTT deviation, scaled by 4
+  uint32_t  rto;      // Current retransmit timeout
+} net_rtt;
+static net_rtt net_rtts[NET_MAXNODES+1];
+
+// Pages migrating processes' source nodes have pushed to us (see net_txpush),
+// each held here with a reference until its process has finished pulling.
+typedef struct net_push {
+  uint32_t  rr;       // RR of the page pushed, 0 if slot unused
+  uint32_t  home;     // Home RR of the proc it was pushed for
+  pageinfo  *pi;      // Our copy of the page
+  uint8_t   arrived;  // Parts arrived; 7 once complete and tracked
+} net_push;
+static net_push net_pushes[NET_PUSHSLOTS];  // Under net_lock
+
+// Latest load report from each other node (see net_txload()).
+typedef struct net_nodeload {
+  uint32_t  heard;    // net_ticks when it arrived, 0 if never
+  uint16_t  nwait;    // Processes it had waiting for a CPU
+  uint16_t  nidle;    // CPUs it had idle
+  uint32_t  nfree;    // Pages it had free
+} net_nodeload;
+static net_nodeload net_loads[NET_MAXNODES+1];  // Under net_lock
+static uint8_t net_loadnext;  // Node our next report goes to
+
+// Pages other nodes are paging out to us (see net_rxswap()),
+// each held here until all its parts have arrived.
+typedef struct net_swapin {
+  uint32_t  rr;       // Sender's RR for the page, 0 if slot unused
+  uint8_t   node;     // Node sending it
+  uint8_t   arrived;  // Parts arrived so far
+  uint32_t  heard;    // net_ticks when the last part arrived
+  pageinfo  *pi;      // Our copy of the page
+} net_swapin;
+static net_swapin net_swapins[NET_SWAPSLOTS];  // Under net_lock
+
+// Checkpoints other nodes have had us keep (see net_rxckpt()),
+// each in a tree of stopped holder procs shaped like the saver's.
+typedef struct net_ckptslot {
+  uint8_t   node;     // Node that saved it, 0 if slot unused
+  uint32_t  key;      // Key naming it
+  uint32_t  home;     // Home RR of the proc that saved it
+  uint32_t  seq;      // Sequence number of its request
+  uint32_t  rr;       // Saver's RR for the top record
+  proc      *top;     // Our holder for the top process
+  int       pending;  // Holders still pulling their part
+  bool      failed;   // A bad record, or we ran out of memory
+  bool      done;     // All here: restorers may pull it
+} net_ckptslot;
+static net_ckptslot net_ckpts[NET_CKPTSLOTS];  // Under net_lock
+
+// Largest frame each node has told us its card takes, 0 if not yet known.
+static uint16_t net_maxpkts[NET_MAXNODES+1];
+
+// Raw pages waiting to go out together in a NET_PULLPAGES reply,
+// each held with a reference until it's sent (see net_jumboflush()).
+typedef struct net_jumbo {
+  uint8_t   node;       // Node they're going to
+  uint32_t  pushhome;   // As for net_txpullrp()
+  int       n;          // Number of pages so far
+  uint32_t  rr[NET_JUMBOPAGES];
+  void      *pg[NET_JUMBOPAGES];
+} net_jumbo;
+
+
+int net_txref(void *hdr, int hlen, void *body, int blen, pageinfo *pi);
+static int net_txpages(void *hdr, int hlen, void **pgs, int npg);
+static void net_timerset(net_timer *t, uint8_t node);
+static void net_timerclear(net_timer *t);
+static void net_rttsample(uint8_t node, uint32_t sentat);
+static void net_pullarm(proc *p);
 
 void net_txmigrq(proc *p);
 void net_rxmigrq(net_migrq *migrq);
 void net_txmigrp(uint8_t dstnode, uint32_t prochome);
 void net_rxmigrp(net_migrp *migrp);
+static proc *net_procof(uint32_t home);
+
+void net_rxrpcrq(net_rpcrq *rq);
+void net_rxrpcrp(net_rpcrp *rp);
+
+static void net_txload(void);
+void net_rxload(net_load *ld);
 
 void net_pull(proc *p, uint32_t rr, void *pg, int pglevel);
-void net_txpullrq(proc *p);
+static void net_pullstart(proc *p, uint32_t rr, void *pg, uint32_t *pte,
+			int pglevel);
+static bool net_pullwalk(proc *p);
+void net_txpullrq(proc *p, bool resend);
 void net_rxpullrq(net_pullrq *rq);
-void net_txpullrp(uint8_t rqnode, uint32_t rr, int pglev, int part, void *pg);
+void net_txpullredir(uint8_t rqnode, uint32_t rr, uint8_t node);
+void net_rxpullredir(net_pullredir *rd);
+static procpull *net_pullfind(uint32_t rr, proc ***ppp);
+void net_txpullrp(uint8_t rqnode, uint32_t rr, int pglev, int need, void *pg,
+			uint32_t pushhome, net_jumbo *jb);
+static void net_jumboinit(net_jumbo *jb, uint8_t node, uint32_t pushhome);
+static void net_jumboflush(net_jumbo *jb);
 void net_rxpullrp(net_pullrphdr *rp, int len);
+static void net_rxpullone(uint32_t rr, int enc, int part,
+			const void *data, int datalen);
+static void net_untrackdirty(proc *p);
+static void net_txpush(proc *p);
+void net_rxpush(net_pullrphdr *rp, int len);
+static void net_rxpushone(uint8_t srcnode, uint32_t home, uint32_t rr,
+			int enc, int part, const void *data, int datalen);
+static void net_pushdone(proc *p);
+void net_rxswap(net_pullrphdr *rp, int len);
+void net_rxswaprp(net_swaprp *rp);
+static void net_txswapfree(uint32_t rr);
+void net_rxswapfree(net_swapfree *sf);
+static void net_swapdone(proc *p);
+static void net_swaprelease(proc *p);
+void net_rxckpt(net_ckptmsg *m);
+void net_rxckptrp(net_ckptmsg *m);
+static bool net_ckptstart(proc *c, uint32_t rr);
+static bool net_ckptrecord(proc *q);
+static void net_ckptpulled(proc *p);
 bool net_pullpte(proc *p, uint32_t *pte, int pglevel);
 
 void
@@ -47,8 +168,9 @@ net_init(void)
     return;
 
   spinlock_init(&net_lock);
+  assert(NET_LOAD < NETSTAT_NTYPES);  // net_stats counts every type
 
-  if (!e100_present) {
+  if (net_netdev == NULL) {
     cprintf("No network card found; networking disabled\n");
     return;
   }
@@ -56,6 +178,30 @@ net_init(void)
   // Ethernet card should already have been initialized
   assert(net_mac[0] != 0 && net_mac[5] != 0);
   net_node = net_mac[5];  // Last byte in MAC addr is our node number
+
+#if NET_RXSTEER
+  // Give every CPU a receive queue for net_rxsteer(),
+  // initializing its lock before other CPUs can see the queue.
+  cpu *c;
+  for (c = &cpu_boot; c != NULL; c = c->next) {
+    pageinfo *pi = mem_alloc();
+    if (pi == NULL)
+      break;
+    spinlock_init(&c->rxlock);
+    c->rxq = mem_pi2ptr(pi);
+  }
+#endif
+}
+
+// Called by a network card driver once it has found and set up its card,
+// to have us send and receive through it from now on.
+// Drivers check net_netdev first, so we use the first card found.
+void
+net_attach(net_dev *dev, const uint8_t *mac)
+{
+  assert(net_netdev == NULL);
+  net_netdev = dev;
+  memcpy(net_mac, mac, 6);
 }
 
 // Setup the Ethernet header in a packet to be sent.
@@ -70,7 +216,19 @@ net_ethsetup(net_ethhdr *eth, uint8_t destnode)
   eth->type = htons(NET_ETHERTYPE);
 }
 
-// Just a trivial wrapper for the e100 driver's transmit function.
+// Count a packet of len bytes we've sent in net_stats.
+static void
+net_txcount(void *hdr, int len)
+{
+  net_msgtype type = ((net_hdr*)hdr)->type;
+  trace(TRACE_NETTX, type, len, ((net_hdr*)hdr)->eth.dst[5]);
+  if (type < NETSTAT_NTYPES) {
+    net_statinc(txpkts[type]);
+    lockadd64(&net_stats.txbytes[type], len);
+  }
+}
+
+// Just a trivial wrapper for the network card driver's transmit function.
 // The two buffers provided get concatenated to form the transmitted packet;
 // this is just a convenience (and optimization) for when the caller has a
 // "packet head" and a "packet body" coming from different memory areas.
@@ -78,10 +236,133 @@ net_ethsetup(net_ethhdr *eth, uint8_t destnode)
 int net_tx(void *hdr, int hlen, void *body, int blen)
 {
   //cprintf("net_tx %d+%d\n", hlen, blen);
-  return e100_tx(hdr, hlen, body, blen);
+  return net_txref(hdr, hlen, body, blen, NULL);
+}
+
+// Likewise, but send the body straight out of page pi without copying it,
+// holding a reference to pi until the transmit completes.
+int net_txref(void *hdr, int hlen, void *body, int blen, pageinfo *pi)
+{
+  assert(hlen + blen <= net_netdev->maxpkt);
+  int rc = net_netdev->txref(hdr, hlen, body, blen, pi);
+  if (rc)
+    net_txcount(hdr, hlen + blen);
+  return rc;
+}
+
+// Or send a header followed by npg whole pages, straight out of the pages,
+// on a card that takes frames that big (see net_usejumbo()).
+static int
+net_txpages(void *hdr, int hlen, void **pgs, int npg)
+{
+  assert(hlen + npg*PAGESIZE <= net_netdev->maxpkt);
+  int rc = net_netdev->txpages(hdr, hlen, pgs, npg);
+  if (rc)
+    net_txcount(hdr, hlen + npg*PAGESIZE);
+  return rc;
+}
+
+// Can we send jumbo NET_PULLPAGES replies to this node?
+static bool
+net_usejumbo(uint8_t node)
+{
+  return net_netdev->txpages != NULL && net_netdev->maxpkt >= NET_JUMBOPKT
+      && net_maxpkts[node] >= NET_JUMBOPKT;
+}
+
+static void net_rxdispatch(void *pkt, int len);
+
+// Queue a valid received packet to a CPU to process it later,
+// returning false if the caller should just process it now instead.
+// Packets from one node go to the same CPU, so they stay in order,
+// except that each pull request goes by the first page it asks for,
+// since we serve those without regard to anything else the node sent;
+// so several nodes pulling from us at once keep several CPUs busy.
+// Processing happens outside the card's interrupt handler,
+// which can then hand its receive buffers back to the card sooner:
+// in trap() once the handler returns, or on the CPU it was queued to
+// when our T_WAKEUP interrupt arrives there, or in its idle loop.
+static bool
+net_rxsteer(void *pkt, int len)
+{
+#if NET_RXSTEER
+  if (len > PAGESIZE)
+    return 0;   // jumbo frames don't fit in a queue page
+  net_hdr *h = pkt;
+  net_pullrq *rq = pkt;
+  uint32_t key = h->eth.src[5];
+  if (h->type == NET_PULLRQ && len >= sizeof(net_pullrq) && rq->n > 0)
+    key = rq->rr[0] >> PAGESHIFT;
+  key *= 0x9e3779b1;  // Fibonacci hashing, to spread similar keys
+
+  cpu *c;
+  int n = 0;
+  for (c = &cpu_boot; c != NULL; c = c->next)
+    if (c->rxq != NULL)
+      n++;
+  if (n <= 1)
+    return 0;   // nowhere else to go
+  n = (key >> 16) % n;
+  for (c = &cpu_boot; c->rxq == NULL || n-- > 0; c = c->next)
+    ;
+
+  pageinfo *pi = mem_alloc();
+  if (pi == NULL)
+    return 0;
+  memmove(mem_pi2ptr(pi), pkt, len);
+
+  spinlock_acquire(&c->rxlock);
+  if (c->rxhead - c->rxtail >= NET_RXQLEN) {
+    spinlock_release(&c->rxlock);
+    mem_free(pi);
+    return 0;   // queue full: better late here than dropped
+  }
+  bool wasempty = c->rxhead == c->rxtail;
+  net_rxpkt *rp = &c->rxq[c->rxhead++ % NET_RXQLEN];
+  rp->pi = pi;
+  rp->len = len;
+  spinlock_release(&c->rxlock);
+
+  if (c != cpu_cur()) {
+    net_statinc(rxsteered);
+    if (wasempty)
+      lapic_ipi(c->id, T_WAKEUP);
+  }
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+// Process the packets other CPUs, or our own card interrupts,
+// have queued to this CPU (see net_rxsteer()),
+// at most one queue's worth so our caller gets control back.
+// Returns true if there were any.
+bool
+net_rxdrain(void)
+{
+  cpu *c = cpu_cur();
+  if (c->rxq == NULL || c->rxtail == c->rxhead)
+    return 0;
+
+  int n;
+  for (n = 0; n < NET_RXQLEN; n++) {
+    spinlock_acquire(&c->rxlock);
+    if (c->rxtail == c->rxhead) {
+      spinlock_release(&c->rxlock);
+      break;
+    }
+    net_rxpkt rp = c->rxq[c->rxtail % NET_RXQLEN];
+    c->rxtail++;
+    spinlock_release(&c->rxlock);
+
+    net_rxdispatch(mem_pi2ptr(rp.pi), rp.len);
+    mem_free(rp.pi);
+  }
+  return 1;
 }
 
-// The e100 network interface device driver calls this
+// The network card driver calls this
 // from its interrupt handler whenever it receives a packet.
 void
 net_rx(void *pkt, int len)
@@ -89,24 +370,48 @@ net_rx(void *pkt, int len)
   //cprintf("net_rx len %d\n", len);
   if (len < sizeof(net_hdr)) {
     warn("net_rx: runt packet (%d bytes)", len);
+    net_statinc(rxbad);
     return; // drop
   }
   net_hdr *h = pkt;
   if (memcmp(h->eth.dst, net_mac, 6) != 0) {  // is it for us?
     warn("net_rx: stray packet received for someone else");
+    net_statinc(rxbad);
     return; // drop
   }
   if (memcmp(h->eth.src, net_mac, 5) != 0   // from a node we know?
       || h->eth.src[5] < 1 || h->eth.src[5] > NET_MAXNODES) {
     warn("net_rx: stray packet received from outside cluster");
+    net_statinc(rxbad);
     return; // drop
   }
   if (h->eth.type != htons(NET_ETHERTYPE)) {
     warn("net_rx: unrecognized ethertype %x", ntohs(h->eth.type));
+    net_statinc(rxbad);
     return; // drop
   }
+#if NET_LOSS > 0
+  static volatile uint32_t net_lossctr;
+  if ((uint32_t)xadd(&net_lossctr, 1) % NET_LOSS == NET_LOSS - 1) {
+    net_statinc(lossdrop);
+    return; // drop, simulating loss
+  }
+#endif
+  trace(TRACE_NETRX, h->type, len, h->eth.src[5]);
+  if (h->type < NETSTAT_NTYPES) {
+    net_statinc(rxpkts[h->type]);
+    lockadd64(&net_stats.rxbytes[h->type], len);
+  }
 
-  // Process received packet
+  if (!net_rxsteer(pkt, len))
+    net_rxdispatch(pkt, len);
+}
+
+// Process a valid received packet.
+static void
+net_rxdispatch(void *pkt, int len)
+{
+  net_hdr *h = pkt;
   switch(h->type) {
     case NET_MIGRQ:
       net_rxmigrq(pkt);
@@ -120,63 +425,248 @@ net_rx(void *pkt, int len)
     case NET_PULLRP:    // Page pull reply
       net_rxpullrp(pkt, len);    
       break;
+    case NET_PUSH:
+      net_rxpush(pkt, len);
+      break;
+    case NET_PULLREDIR:
+      net_rxpullredir(pkt);
+      break;
+    case NET_RPCRQ:
+      net_rxrpcrq(pkt);
+      break;
+    case NET_RPCRP:
+      net_rxrpcrp(pkt);
+      break;
+    case NET_LOAD:
+      net_rxload(pkt);
+      break;
+    case NET_SWAP:
+      net_rxswap(pkt, len);
+      break;
+    case NET_SWAPRP:
+      net_rxswaprp(pkt);
+      break;
+    case NET_SWAPFREE:
+      net_rxswapfree(pkt);
+      break;
+    case NET_CKPT:
+    case NET_CKPTRQ:
+      net_rxckpt(pkt);
+      break;
+    case NET_CKPTRP:
+      net_rxckptrp(pkt);
+      break;
     default:
       warn("net_rx: invalid packet type\n");
+      net_statinc(rxbad);
+  }
+}
+
+// Arm timer t to fire one retransmit timeout from now,
+// for a request to the given node,
+// doubling the timeout for each time it has already fired.
+static void
+net_timerset(net_timer *t, uint8_t node)
+{
+  assert(spinlock_holding(&net_lock));
+  assert(node > 0 && node <= NET_MAXNODES);
+  net_timerclear(t);
+
+  net_rtt *r = &net_rtts[node];
+  uint32_t rto = r->valid ? r->rto : NET_RTOINIT;
+  rto = t->backoff < 8 ? rto << t->backoff : NET_RTOMAX;
+  rto = MIN(rto, NET_RTOMAX);
+
+  t->expire = net_ticks + rto;
+  net_timer **slot = &net_wheel[t->expire & (NET_WHEELSIZE-1)];
+  t->next = *slot;
+  if (t->next)
+    t->next->prev = &t->next;
+  t->prev = slot;
+  *slot = t;
+}
+
+// Disarm timer t if it's armed.
+static void
+net_timerclear(net_timer *t)
+{
+  assert(spinlock_holding(&net_lock));
+  if (t->prev == NULL)
+    return;
+  *t->prev = t->next;
+  if (t->next)
+    t->next->prev = t->prev;
+  t->next = NULL;
+  t->prev = NULL;
+}
+
+// Update our RTT estimate for a node with a reply
+// to a request first sent at tick 'sentat', and never retransmitted
+// (by Karn's rule, replies to retransmitted requests are ambiguous).
+// This is the Jacobson/Karels estimator TCP uses, in fixed point.
+static void
+net_rttsample(uint8_t node, uint32_t sentat)
+{
+  assert(spinlock_holding(&net_lock));
+  net_rtt *r = &net_rtts[node];
+  int32_t m = net_ticks - sentat;
+  if (!r->valid) {
+    r->srtt = m << 3;
+    r->rttvar = m << 1;
+    r->valid = 1;
+  } else {
+    m -= r->srtt >> 3;
+    r->srtt += m;
+    if (m < 0)
+      m = -m;
+    m -= r->rttvar >> 2;
+    r->rttvar += m;
   }
+  r->rto = (r->srtt >> 3) + r->rttvar;
+  r->rto = MAX(r->rto, NET_RTOMIN);
+  r->rto = MIN(r->rto, NET_RTOMAX);
 }
 
 // Called by trap() on every timer interrupt,
-// so that we can periodically retransmit lost packets.
+// so that we can retransmit requests whose replies are overdue.
 void
 net_tick()
 {
   if (!cpu_onboot())
     return;   // count only one CPU's ticks
 
-  static int tick;
-  if (++tick & 63)
+  if (net_netdev != NULL)
+    net_netdev->poll();  // keep draining a busy card with interrupts masked
+
+  spinlock_acquire(&net_lock);
+  uint32_t now = ++net_ticks;
+  proc *swapped = NULL;   // Procs whose page-outs we give up on
+
+  // Every timer in this slot expires now, since none is armed for longer
+  // than a full turn of the wheel.
+  net_timer *t;
+  while ((t = net_wheel[now & (NET_WHEELSIZE-1)]) != NULL) {
+    assert(t->expire == now);
+    net_timerclear(t);
+    if (t->backoff < 255)
+      t->backoff++;
+
+    net_statinc(retx);
+    proc *p = t->proc;
+    trace(TRACE_RETX, p, t->backoff, 0);
+    if (t == &p->migrtimer) {
+      // cprintf("net_tick: resending migrq for %p\n", p);
+      p->migrretx = 1;
+      net_txmigrq(p);
+      net_timerset(t, p->migrdest);
+    } else if (t == &p->rpctimer) {
+      // The caller resends by re-executing its system call,
+      // whether it's a remote GET/PUT or a checkpoint request.
+      p->rpcretx = 1;
+      if (p->state == PROC_RPC)
+        proc_ready(p);
+    } else if (t == &p->swaptimer) {
+      // Pages not yet acknowledged just stay here.
+      net_swapdone(p);
+      p->swapnext = swapped;
+      swapped = p;
+    } else {
+      assert(t == &p->pulltimer && p->npull > 0);
+      // cprintf("net_tick: resending pulls for %p\n", p);
+      net_txpullrq(p, 1);
+    }
+  }
+
+  net_txload();
+  spinlock_release(&net_lock);
+
+  while (swapped != NULL) {
+    proc *p = swapped;
+    swapped = p->swapnext;
+    net_swaprelease(p);
+  }
+}
+
+// Report our load to the next other node in turn, from net_tick().
+static void
+net_txload(void)
+{
+  assert(spinlock_holding(&net_lock));
+  if (net_node == 0)
+    return;   // Networking disabled
+  do {
+    net_loadnext = net_loadnext % NET_MAXNODES + 1;
+  } while (net_loadnext == net_node);
+
+  net_load ld;
+  net_ethsetup(&ld.eth, net_loadnext);
+  ld.type = NET_LOAD;
+  ld.nwait = proc_nready();
+  ld.maxpkt = net_netdev->maxpkt;
+  ld.nfree = mem_nfree();
+  ld.nidle = 0;
+  cpu *c;
+  for (c = &cpu_boot; c != NULL; c = c->next)
+    if (c->idle)
+      ld.nidle++;
+  net_tx(&ld, sizeof(ld), 0, 0);
+}
+
+// Receive another node's load report.
+void
+net_rxload(net_load *ld)
+{
+  net_nodeload *l = &net_loads[ld->eth.src[5]];
+  spinlock_acquire(&net_lock);
+  l->heard = MAX(net_ticks, 1);
+  l->nwait = ld->nwait;
+  l->nidle = ld->nidle;
+  l->nfree = ld->nfree;
+  net_maxpkts[ld->eth.src[5]] = ld->maxpkt;
+  spinlock_release(&net_lock);
+}
+
+// Called by proc_tick() when the current process has PFF_BALANCE set
+// and has run a while without blocking, to move it to a less loaded node.
+// It's only worth it if some other process here is waiting for a CPU.
+// Then we prefer the node with the most idle CPUs, if any,
+// or else one with at least 2 fewer processes waiting than here,
+// so that two nodes don't keep trading the same processes back and forth.
+// Returns if the process stays here.
+void
+net_balance(trapframe *tf)
+{
+  int nwait = proc_nready();
+  if (net_node == 0 || nwait == 0)
     return;
 
   spinlock_acquire(&net_lock);
+  net_nodeload *best = NULL;
+  int node, bestnode = 0;
+  for (node = 1; node <= NET_MAXNODES; node++) {
+    net_nodeload *l = &net_loads[node];
+    if (node == net_node || l->heard == 0
+        || net_ticks - l->heard > NET_LOADSTALE
+        || (l->nidle == 0 && l->nwait + 2 > nwait))
+      continue;
+    if (best == NULL || l->nidle > best->nidle
+        || (l->nidle == best->nidle && l->nwait < best->nwait)) {
+      best = l;
+      bestnode = node;
+    }
+  }
+  if (best == NULL)
+    return spinlock_release(&net_lock);
 
-  if(net_migrlist){
-    proc *net_migrpoint;
-    // cprintf("net_tick: resending migrlist ");
-    for(net_migrpoint = net_migrlist; net_migrpoint; 
-      net_migrpoint = net_migrpoint->migrnext) {
-      // Resend packets
-      // cprintf("%p->", net_migrpoint);
-      net_txmigrq(net_migrpoint);
-    }
-    // cprintf("END\n");
-  }
-  if(net_pulllist) {
-    proc *net_pullpoint;
-    // cprintf("net_tick: resending pulllist ");
-    for(net_pullpoint = net_pulllist; net_pullpoint; 
-      net_pullpoint = net_pullpoint->pullnext) {
-      // Resend packets
-      // cprintf("%p->", net_pullpoint);
-      net_txpullrq(net_pullpoint);
-   }
-   // cprintf("END\n");
-  }
-  /*
-  Akshay: This won't work if there aren't the same number of pulls and migrations
-  proc *migrations, *pulls;
-  for(migrations = net_migrlist, pulls = net_pulllist; (migrations || pulls);
-          migrations = migrations->migrnext, pulls = pulls->pullnext) {
-    if(migrations) {
-        // cprintf("sending migrq from %x\n", migrations);
-        net_txmigrq(migrations);
-    }
-    if(pulls) {
-        // cprintf("sending pull request from %x\n", pulls);
-        net_txpullrq(pulls);
-    }
-  }
-  */
+  // Count the process against that node until it next reports,
+  // so we don't send it everything waiting here at once.
+  if (best->nidle > 0)
+    best->nidle--;
+  else
+    best->nwait++;
   spinlock_release(&net_lock);
+
+  net_migrate(tf, bestnode, -1);
 }
 
 // Whenever we send a page containing remote refs to a new node,
@@ -211,36 +701,73 @@ net_migrate(trapframe *tf, uint8_t dstnode, int entry)
   // (In the case of a proc it won't anyway, but just for consistency.)
   net_rrshare(p, dstnode);
 
+  // Remote nodes pull our address space one page table at a time.
+  if (!pmap_splitall(p->pdir))
+    panic("net_migrate: no memory to split superpages");
+  net_untrackdirty(p);
+
   p->state = PROC_MIGR;
   assert(p->migrnext == NULL);  // Is this true?
   p->migrdest = dstnode;
 
   spinlock_acquire(&net_lock);
-  // If the list is empty, add p to the front
-  if(!net_migrlist) {
-    net_migrlist = p;
-  } else {
-    // Otherwise, go to the end of the list
-    proc *net_migrpoint = net_migrlist;
-    while(net_migrpoint->migrnext)
-      net_migrpoint = net_migrpoint->migrnext;
-    // Now net_migrtail->migrnext is NULL, so make it p
-    net_migrpoint->migrnext = p;
-  }
-  // cprintf("net_migrate: added proc. migrlist is now ");
-  // proc *np = net_migrlist;
-  // while(np) {
-  //   cprintf("%p->", np);
-  //   np = np->migrnext;
-  // }
-  // cprintf("END\n");
-  // Send request
+  p->migrnext = net_migrlist;
+  net_migrlist = p;
+
+  // Send request, and resend it until we get a reply.
+  // Right behind it, push what we can of the proc's working set.
   net_txmigrq(p);
+  net_txpush(p);
+  p->migrsentat = net_ticks;
+  p->migrretx = 0;
+  p->migrtimer.proc = p;
+  p->migrtimer.backoff = 0;
+  net_timerset(&p->migrtimer, dstnode);
   spinlock_release(&net_lock);
   // Do something else now
   proc_sched();
 }
 
+// Before process p leaves, stop treating pages we pulled for it
+// as copies of their originals if it has since written them,
+// so that net_pullword() names our modified copy instead,
+// and the node p goes to pulls or gets pushed only what p wrote.
+// Clean copies still go out as their original RRs,
+// which the destination resolves through mem_rrlookup(),
+// or straight to the original page when p is returning home.
+// The processor sets PTE_D in each PTE p writes through.
+// Page tables don't get PTE_D, but pmap_walk() write-enables
+// a pulled page table's PDE just before it modifies the table.
+// (Pulled pages themselves pmap_cowpage() copies before writing,
+// leaving the replica intact for the replica cache in mem.c.)
+static void
+net_untrackdirty(proc *p)
+{
+  uint32_t va;
+  for (va = VM_USERLO; va < VM_USERHI; va += PTSIZE) {
+    pde_t *pde = &p->pdir[PDX(va)];
+    if (!(*pde & PTE_P) || PGADDR(*pde) == PTE_ZERO)
+      continue;
+    pageinfo *pi = mem_phys2pi(PGADDR(*pde));
+    if ((*pde & PTE_W) && pi->home != 0) {
+      mem_rruntrack(pi);
+      pi->home = 0;
+    }
+    pte_t *ptab = mem_ptr(PGADDR(*pde));
+    int i;
+    for (i = 0; i < NPTENTRIES; i++) {
+      if ((ptab[i] & (PTE_P | PTE_D)) != (PTE_P | PTE_D)
+          || PGADDR(ptab[i]) == PTE_ZERO)
+        continue;
+      pi = mem_phys2pi(PGADDR(ptab[i]));
+      if (pi->home != 0) {
+        mem_rruntrack(pi);
+        pi->home = 0;
+      }
+    }
+  }
+}
+
 // Transmit a process migration request message
 // using the state in process 'p'.
 // This function does not cause p's state to change,
@@ -258,7 +785,10 @@ net_txmigrq(proc *p)
   rq.type = NET_MIGRQ;                         // As per net.h
   rq.home = p->home; 
   rq.pdir = RRCONS(net_node, mem_phys(p->pdir), 0);
-  rq.save = p->sv;
+  rq.rpcseq = p->rpcseq;
+  rq.save = p->sv;    // FPU state included: proc_save() saved it
+  memmove(rq.mergeops, p->mergeops, sizeof(rq.mergeops));
+  rq.acct = p->acct;
   // Send (No body)
   net_tx(&rq, sizeof(rq), 0, 0);
 }
@@ -269,32 +799,30 @@ void net_rxmigrq(net_migrq *migrq)
   uint8_t srcnode = migrq->eth.src[5];
   assert(srcnode > 0 && srcnode <= NET_MAXNODES);
 
-  // Do we already have a local proc corresponding to the remote one?
-  proc *p = NULL;
-  if (RRNODE(migrq->home) == net_node) {  // Our proc returning home
-    p = mem_ptr(RRADDR(migrq->home));
-  } else {  // Someone else's proc - have we seen it before?
-    pageinfo *pi = mem_rrlookup(migrq->home);
-    p = pi != NULL ? mem_pi2ptr(pi) : NULL;
-  }
-  if (p == NULL) {      // Unrecognized proc RR
-    p = proc_alloc(NULL, 0);  // Allocate new local proc
-    p->state = PROC_AWAY;   // Pretend it's been away
-    p->home = migrq->home;    // Record where proc originated
-    mem_rrtrack(migrq->home, mem_ptr2pi(p)); // Track for future
-  }
+  // Find or make the local proc corresponding to the remote one.
+  proc *p = net_procof(migrq->home);
+  if (p == NULL)
+    return;   // Out of memory: maybe we'll have some when it's resent
   assert(p->home == migrq->home);
 
   // If the proc isn't in the AWAY state, assume it's a duplicate packet.
   // XXX not very robust - should probably have sequence numbers too.
   if (p->state != PROC_AWAY) {
     cprintf("net_rxmigrq: proc %p is already local\n", p);
+    net_statinc(dups);
     return net_txmigrp(srcnode, p->home);
   }
+  net_statinc(migrin);
 
-  // Copy the CPU state and pdir RR into our proc struct
+  // Copy the CPU and FPU state and pdir RR into our proc struct.
+  // proc_fpuload() loads the FPU state, checked, if and when it's used.
   p->sv = migrq->save;
   p->rrpdir = migrq->pdir;
+  p->rpcseq = migrq->rpcseq;
+  memmove(p->mergeops, migrq->mergeops, sizeof(p->mergeops));
+  p->acct = migrq->acct;
+  p->acct.migrations++;
+  p->runticks = 0;        // Give it a while here before moving it on
   p->pullva = VM_USERLO;  // pull all user space from USERLO to USERHI
 
   // Acknowledge the migration request so the source node stops resending
@@ -302,7 +830,7 @@ void net_rxmigrq(net_migrq *migrq)
 
   // Free the proc's old page directory and allocate a fresh one.
   // (The old pdir will hang around until all shared copies disappear.)
-  mem_decref(mem_ptr2pi(p->pdir), pmap_freepdir);
+  mem_decref(mem_ptr2pi(p->pdir), pmap_freepdirlater);
   p->pdir = pmap_newpdir(); assert(p->pdir);
 
   // Now we need to pull over the page directory next,
@@ -313,6 +841,28 @@ void net_rxmigrq(net_migrq *migrq)
   net_pull(p, p->rrpdir, p->pdir, PGLEV_PDIR);
 }
 
+// Find our local proc corresponding to the proc with home RR 'home':
+// the proc itself if it's one of ours, or else the copy we made of it
+// when it first came here or first asked us to do something for it.
+// If we've never seen it before, make a stand-in in the AWAY state now.
+// Returns NULL if we're out of memory.
+static proc *
+net_procof(uint32_t home)
+{
+  if (RRNODE(home) == net_node)   // Our proc returning home
+    return proc_rrptr(home);
+  proc *p = mem_rrlookupobj(home);  // Someone else's: have we seen it?
+  if (p != NULL)
+    return p;
+  p = proc_alloc(NULL, 0);    // Allocate new local proc
+  if (p == NULL)
+    return NULL;
+  p->state = PROC_AWAY;       // Pretend it's been away
+  p->home = home;             // Record where proc originated
+  mem_rrtrackobj(home, p);    // Track for future
+  return p;
+}
+
 // Transmit a migration reply to a given node, for a given proc's home RR
 void
 net_txmigrp(uint8_t dstnode, uint32_t prochome)
@@ -332,32 +882,24 @@ void net_rxmigrp(net_migrp *migrp)
   proc *p = NULL;
 
   spinlock_acquire(&net_lock);
-  // First node is the one!
-  if(net_migrlist && net_migrlist->home == migrp->home) {
-    p = net_migrlist;
-    // Move the migrlist head
-    net_migrlist = net_migrlist->migrnext;
-  } else {
-    // Scan through the list for it
-    proc *net_migrpoint = net_migrlist;
-    while(net_migrpoint) {
-      // Found it
-      if(net_migrpoint->migrnext->home == migrp->home) {
-        p = net_migrpoint->migrnext;
-        // Point this migrnext to the one after the_one
-        net_migrpoint->migrnext = p->migrnext;
-        // Finish
-        break;
-      }
-      net_migrpoint = net_migrpoint->migrnext;
-    }
+  proc **pp;
+  for (pp = &net_migrlist; (p = *pp) != NULL; pp = &p->migrnext)
+    if (p->home == migrp->home)
+      break;
+  if (p != NULL) {
+    *pp = p->migrnext;
+    net_timerclear(&p->migrtimer);
+    if (!p->migrretx)
+      net_rttsample(msgsrcnode, p->migrsentat);
   }
   spinlock_release(&net_lock);
   // If we didn't find it, nothing to do...
   if(!p) {
     cprintf("Unable to find process %p\n", RRADDR(migrp->home));
+    net_statinc(dups);
     return;
   }
+  net_statinc(migrout);
 
   // Mark the process correctly
   p->migrnext = NULL;
@@ -365,64 +907,431 @@ void net_rxmigrp(net_migrp *migrp)
   p->state = PROC_AWAY;
 }
 
-// Pull a page via a remote ref and put process p to sleep waiting for it.
+// Do GET or PUT v on children at another node for the current process,
+// by having that node do it rather than migrating there (see net.h).
+// The first time through we send the request and go to sleep,
+// to re-execute the system call when the reply arrives, or to resend.
+// Once the reply is in we return true if the operation is done,
+// or false for a GET with SYS_POLL that found a child still running,
+// setting *trapno to the trap the operation caused, or -1 if none.
+bool
+net_rpc(trapframe *tf, const sysvec *v, uint8_t node, int *trapno)
+{
+  proc *p = proc_cur();
+  assert(node > 0 && node <= NET_MAXNODES && node != net_node);
+
+  spinlock_acquire(&net_lock);
+  if (p->rpcnode == node && p->rpcstat != NET_RPCWAIT) {
+    // The reply is in: we're done with this request.
+    bool done = p->rpcstat == NET_RPCDONE;
+    *trapno = p->rpctrap;
+    procstate *sv = p->rpcsv;
+    p->rpcnode = 0;
+    p->rpcsv = NULL;
+    spinlock_release(&net_lock);
+    if (sv != NULL) {
+      procstate save = *sv; // Free the page even if the copyout traps
+      mem_free(mem_ptr2pi(sv));
+      uint32_t ofs = syscall_regofs(v->cmd);
+      usercopy(tf, 1, (void*)&save + ofs, (uint32_t)v->save + ofs,
+               syscall_regsize(v->cmd));
+    }
+    return done;
+  }
+  spinlock_release(&net_lock);
+
+  // Make request from scratch, since we don't keep it around to resend
+  net_rpcrq rq;
+  net_ethsetup(&rq.eth, node);
+  rq.type = NET_RPCRQ;
+  rq.home = p->home;
+  rq.cmd = v->cmd;
+  rq.child = v->child;
+  rq.dst = (uint32_t)v->dst;
+  rq.size = v->size;
+  bool regs = (v->cmd & SYS_TYPE) == SYS_PUT
+              && (v->cmd & (SYS_REGS | SYS_FPU));
+  if (regs) {
+    uint32_t ofs = syscall_regofs(v->cmd);
+    usercopy(tf, 0, (void*)&rq.save + ofs, (uint32_t)v->save + ofs,
+             syscall_regsize(v->cmd));
+  }
+  proc_save(p, tf, 0);  // Re-execute the system call when we wake up
+
+  spinlock_acquire(&net_lock);
+  if (p->rpcnode != node) {   // A new request, not a resend
+    p->rpcseq++;
+    p->rpcnode = node;
+    p->rpcstat = NET_RPCWAIT;
+    p->rpcretx = 0;
+    p->rpctimer.proc = p;
+    p->rpctimer.backoff = 0;
+  }
+  rq.seq = p->rpcseq;
+  if (!p->rpcretx)
+    p->rpcsentat = net_ticks;
+  net_tx(&rq, offsetof(net_rpcrq, save)     // state only as far as we need
+         + (regs ? syscall_regend(v->cmd) : 0), 0, 0);
+  p->state = PROC_RPC;
+  net_timerset(&p->rpctimer, node);
+  spinlock_release(&net_lock);
+  // Do something else now
+  proc_sched();
+}
+
+// Transmit a reply to remote GET/PUT command cmd, leaving off the child's
+// state unless it's carrying some, and past the part cmd asks for.
+static void
+net_txrpcrp(net_rpcrp *rp, uint32_t cmd)
+{
+  int len = offsetof(net_rpcrp, save) + (rp->regs ? syscall_regend(cmd) : 0);
+  net_tx(rp, len, 0, 0);
+}
+
+// Do a GET or PUT a process on another node asked to have done
+// on children of the proxy 'pp' here that stands in for it.
+// Returns the NET_RPC* status to reply with, setting rp->trapno,
+// or NET_RPCWAIT if we have to wait for a child to stop first.
+// Caller must hold pp->lock.
+static int
+net_rpcdo(proc *pp, const net_rpcrq *rq, net_rpcrp *rp)
+{
+  uint32_t cmd = rq->cmd;
+  int type = cmd & SYS_TYPE;
+  int cn = rq->child & 0xff;
+  int n = SYS_NCHILDREN(rq->child);
+  if ((type != SYS_PUT && type != SYS_GET) || (cmd & SYS_MEMOP)
+      || cn + n > PROC_CHILDREN
+      || (type == SYS_PUT && (cmd & SYS_STATUS))   // as sysput() checks
+      || ((cmd & SYS_ACCT) && (cmd & SYS_STATE))
+      || ((cmd & (SYS_PERM | SYS_ADVICE)) && (PGOFF(rq->dst) || PGOFF(rq->size)
+          || rq->dst < VM_USERLO || rq->dst > VM_USERHI
+          || rq->size > VM_USERHI - rq->dst))) {
+    rp->trapno = T_GPFLT;
+    return NET_RPCDONE;
+  }
+
+  // Wait until every child in the range is stopped before touching any,
+  // as sysput() and sysget() do.
+  int i;
+  for (i = 0; i < n; i++) {
+    proc *child = pp->child[cn + i];
+    if (child == NULL && type == SYS_PUT
+        && (child = proc_alloc(pp, cn + i)) == NULL)
+      return NET_RPCWAIT;   // out of memory: let the caller resend
+    if (child == NULL || child->state == PROC_STOP)
+      continue;
+    if (type == SYS_GET && (cmd & SYS_POLL))
+      return NET_RPCRUNNING;
+    pp->waitchild = child;  // proc_ret() calls net_rpcwake()
+    return NET_RPCWAIT;
+  }
+
+  if (type == SYS_GET) {
+    if (cmd & SYS_STATE) {
+      proc *child = pp->child[cn];
+      rp->save = child ? child->sv : proc_null.sv;
+      rp->regs = 1;
+    }
+    return NET_RPCDONE;
+  }
+  bool fetchonly = (cmd & ~SYS_TYPE) == SYS_WILLNEED;
+  for (i = 0; i < n; i++) {
+    proc *child = pp->child[cn + i];
+    if (!proc_pmapready(child, 1) && !fetchonly) {
+      pp->waitchild = child;  // proc_wakeparent() calls net_rpcwake()
+      return NET_RPCWAIT;
+    }
+  }
+  for (i = 0; i < n; i++) {
+    proc *child = pp->child[cn + i];
+    if (fetchonly && child->pullstop)
+      continue;   // as in sysputone()
+    if (cmd & (SYS_REGS | SYS_FPU))
+      syscall_putregs(child, &rq->save, cmd, pp);
+    proc_pmapclaim(child);
+    if (cmd & SYS_PERM)
+      pmap_setperm(child->pdir, rq->dst, rq->size, cmd & SYS_RW);
+    if (cmd & SYS_ADVICE)
+      syscall_advise(child, rq->dst, rq->size, cmd & SYS_ADVICE);
+    if (cmd & SYS_SNAP)
+      pmap_snap(child->pdir, child->rpdir);
+    proc_pmapunclaim(child);
+    if ((cmd & (SYS_START | SYS_GANG)) == (SYS_START | SYS_GANG))
+      proc_gang(child);
+    else if (cmd & SYS_START)
+      proc_ready(child);
+  }
+  return NET_RPCDONE;
+}
+
+// Receive a remote GET/PUT request, do it, and reply.
+void
+net_rxrpcrq(net_rpcrq *rq)
+{
+  uint8_t srcnode = rq->eth.src[5];
+  proc *pp = net_procof(rq->home);
+  if (pp == NULL)
+    return;   // Out of memory: the caller will resend
+
+  net_rpcrp rp;
+  net_ethsetup(&rp.eth, srcnode);
+  rp.type = NET_RPCRP;
+  rp.home = rq->home;
+  rp.seq = rq->seq;
+  rp.regs = 0;
+  rp.trapno = -1;
+
+  spinlock_acquire(&pp->lock);
+  if (pp->state != PROC_AWAY || (int32_t)(rq->seq - pp->rpclast) < 0) {
+    spinlock_release(&pp->lock);  // Stale: the caller has moved on
+    return;
+  }
+  if (rq->seq == pp->rpclast && pp->rpcdone) {
+    // A resend of one we did, whose reply must have been lost.
+    // Don't do it again; GET results are still there to send.
+    rp.trapno = pp->rpclasttrap;
+    rp.stat = NET_RPCDONE;
+    if (rp.trapno < 0 && (rq->cmd & SYS_TYPE) == SYS_GET
+        && (rq->cmd & SYS_STATE)) {
+      proc *child = pp->child[rq->child & 0xff];
+      rp.save = child ? child->sv : proc_null.sv;
+      rp.regs = 1;
+    }
+  } else {
+    pp->rpclast = rq->seq;
+    pp->rpcfrom = srcnode;
+    rp.stat = net_rpcdo(pp, rq, &rp);
+    pp->rpcdone = rp.stat == NET_RPCDONE;
+    pp->rpclasttrap = rp.trapno;
+  }
+  spinlock_release(&pp->lock);
+
+  if (rp.stat != NET_RPCWAIT)
+    net_txrpcrp(&rp, rq->cmd);
+}
+
+// A child proxy pp was waiting for on behalf of a remote caller has stopped:
+// tell the caller to send its request again.
+void
+net_rpcwake(proc *pp)
+{
+  net_rpcrp rp;
+  net_ethsetup(&rp.eth, pp->rpcfrom);
+  rp.type = NET_RPCRP;
+  rp.home = pp->home;
+  rp.seq = pp->rpclast;
+  rp.stat = NET_RPCAGAIN;
+  rp.regs = 0;
+  rp.trapno = -1;
+  net_txrpcrp(&rp, 0);
+}
+
+// Receive the reply to a remote GET/PUT,
+// and wake the caller up to finish its system call or resend.
+void
+net_rxrpcrp(net_rpcrp *rp)
+{
+  uint8_t srcnode = rp->eth.src[5];
+  proc *p = RRNODE(rp->home) == net_node ? proc_rrptr(rp->home)
+                                         : mem_rrlookupobj(rp->home);
+  if (p == NULL)
+    return;
+
+  spinlock_acquire(&net_lock);
+  if (p->rpcnode != srcnode || p->rpcseq != rp->seq
+      || p->rpcstat != NET_RPCWAIT) {
+    net_statinc(dups);
+    return spinlock_release(&net_lock);   // Stale or duplicate
+  }
+
+  if (rp->stat == NET_RPCAGAIN) {
+    p->rpcretx = 0;   // Resending it is a fresh exchange
+    p->rpctimer.backoff = 0;
+  } else {
+    if (rp->regs) {
+      pageinfo *pi = mem_alloc();
+      if (pi == NULL)
+        return spinlock_release(&net_lock);  // Get it again on resend
+      p->rpcsv = mem_pi2ptr(pi);
+      *p->rpcsv = rp->save;
+    }
+    if (!p->rpcretx)
+      net_rttsample(srcnode, p->rpcsentat);
+    p->rpctrap = rp->trapno;
+    p->rpcstat = rp->stat;
+    net_timerclear(&p->rpctimer);
+  }
+  if (p->state == PROC_RPC)
+    proc_ready(p);
+  spinlock_release(&net_lock);
+}
+
+// Pull a page directory or page table via a remote ref
+// and put process p to sleep waiting for it.
 void
 net_pull(proc *p, uint32_t rr, void *pg, int pglevel)
 {
   //cprintf("net_pull: proc %x rr %x -> %x level %d\n",
   //  p, rr, pg, pglevel);
+  spinlock_acquire(&net_lock);
+  net_pullstart(p, rr, pg, NULL, pglevel);
+  net_txpullrq(p, 0);
+  spinlock_release(&net_lock);
+}
+
+// Record a new pull in p's window of pulls in flight,
+// putting p in the PROC_PULL state, but don't transmit the request yet:
+// 'pte' is the PTE that maps pg, if pg is a plain page, or NULL.
+// net_txpullrq() batches up all the pulls started together.
+// We can't look at a pdir or page table's contents until it arrives,
+// so pulling one stops net_pullwalk() until then.
+static void
+net_pullstart(proc *p, uint32_t rr, void *pg, uint32_t *pte, int pglevel)
+{
   uint8_t dstnode = RRNODE(rr);
   assert(dstnode > 0 && dstnode <= NET_MAXNODES);
   assert(dstnode != net_node);
   assert(pglevel >= 0 && pglevel <= 2);
-
-  // Lab 5: insert code here to put the process into the PROC_PULL state,
-  // save in the proc structure all information needed for the pull,
-  // and transmit a pull message using net_txpullrq().
-
-  // assert(spinlock_holding(&p->lock));
-  spinlock_acquire(&net_lock);
-
-  if(!net_pulllist) {
+  assert(spinlock_holding(&net_lock));
+  assert(p->npull < PROC_NPULL);
+
+  int i;
+  for (i = 0; p->pull[i].rr != 0; i++)
+    assert(i < PROC_NPULL-1);
+  procpull *pl = &p->pull[i];
+  pl->rr      = rr;
+  pl->pg      = pg;
+  pl->pte     = pte;
+  pl->pglev   = pglevel;
+  pl->arrived = 0;
+  pl->node    = dstnode;
+  pl->direct  = 0;
+  pl->sent    = 0;
+  pl->retx    = 0;
+
+  if (p->npull++ == 0) {      // not already pulling: join the list
+    p->pullnext = net_pulllist;
     net_pulllist = p;
-  } else {
-    // Otherwise, go to the end of the list
-    proc *net_pullpoint = net_pulllist;
-    while(net_pullpoint->pullnext)
-      net_pullpoint = net_pullpoint->pullnext;
-    // Now net_pulltail->pullnext is NULL, so make it p
-    net_pullpoint->pullnext = p;
-  }
-  p->state    = PROC_PULL;
-  p->pullrr   = rr;
-  p->pglev    = pglevel;
-  p->pullpg   = pg;
-  p->arrived  = 0;
-  net_txpullrq(p);
-  spinlock_release(&net_lock);
+    p->pulltimer.proc = p;
+    p->pulltimer.backoff = 0;
+  }
+  if (pglevel > 0)
+    p->pullwait = 1;
+  p->state = PROC_PULL;
+}
+
+// (Re)arm the retransmit timer for process p's pulls in flight,
+// timing out as slowly as the slowest node we're pulling from.
+static void
+net_pullarm(proc *p)
+{
+  uint8_t node = 0;
+  uint32_t rto = 0;
+  int i;
+  for (i = 0; i < PROC_NPULL; i++) {
+    if (p->pull[i].rr == 0)
+      continue;
+    uint8_t n = p->pull[i].node;
+    uint32_t r = net_rtts[n].valid ? net_rtts[n].rto : NET_RTOINIT;
+    if (node == 0 || r > rto)
+      node = n, rto = r;
+  }
+  assert(node != 0);
+  net_timerset(&p->pulltimer, node);
 }
 
-// Transmit a page pull request on behalf of some process.
+// Transmit page pull requests on behalf of some process:
+// for all its pulls in flight if 'resend' is true,
+// otherwise only for those we haven't yet sent.
+// Pulls from the same node at the same level share a request.
+// A pull that times out after being redirected to a peer
+// goes back to the page's home node, not to be redirected again.
 void
-net_txpullrq(proc *p)
+net_txpullrq(proc *p, bool resend)
 {
   assert(p->state == PROC_PULL);
   assert(spinlock_holding(&net_lock));
-  
-  net_pullrq rq;
-  net_ethsetup(&rq.eth, RRNODE(p->pullrr));
-  rq.type = NET_PULLRQ;
-  rq.rr = p->pullrr;
-  rq.pglev = p->pglev;
-  rq.need = p->arrived ^ 7; // ~arrived lower bits
-
-  // No body, just header
-  // cprintf("txpullrq: sending for %p, addr %p, pglev %d\n", 
-  //   p, RRADDR(p->pullrr), p->pglev);
-  net_tx(&rq, sizeof(rq), 0, 0);
+
+  uint32_t todo = 0;
+  int i, j;
+  for (i = 0; i < PROC_NPULL; i++) {
+    procpull *pl = &p->pull[i];
+    if (pl->rr == 0 || !(resend || !pl->sent))
+      continue;
+    if (resend && pl->node != RRNODE(pl->rr)) {
+      pl->node = RRNODE(pl->rr);
+      pl->direct = 1;
+    }
+    todo |= 1 << i;
+  }
+
+  while (todo) {
+    for (i = 0; !(todo & (1 << i)); i++)
+      ;
+    procpull *first = &p->pull[i];
+
+    net_pullrq rq;
+    net_ethsetup(&rq.eth, first->node);
+    rq.type = NET_PULLRQ;
+    rq.pglev = first->pglev;
+    rq.n = 0;
+    rq.direct = first->direct;
+    rq.maxpkt = net_netdev->maxpkt;
+    for (j = i; j < PROC_NPULL && rq.n < NET_PULLMAX; j++) {
+      procpull *pl = &p->pull[j];
+      if (!(todo & (1 << j)) || pl->node != first->node
+          || pl->pglev != first->pglev || pl->direct != first->direct)
+        continue;
+      rq.rr[rq.n] = pl->rr;
+      rq.need[rq.n] = pl->arrived ^ 7; // ~arrived lower bits
+      rq.n++;
+      if (!pl->sent)
+        pl->sentat = net_ticks;
+      else
+        pl->retx = 1;
+      pl->sent = 1;
+      todo &= ~(1 << j);
+    }
+
+    // No body, just header
+    // cprintf("txpullrq: sending %d for %p, addr %p, pglev %d\n", 
+    //   rq.n, p, RRADDR(rq.rr[0]), rq.pglev);
+    net_tx(&rq, sizeof(rq), 0, 0);
+  }
+
+  // Start the retransmit timer for what we sent, if it isn't running.
+  if (resend || p->pulltimer.prev == NULL)
+    net_pullarm(p);
+}
+
+// Choose a peer to serve rqnode's pull of page pi instead of us,
+// once at least NET_PULLPEERS other nodes have been sent copies:
+// requesters are spread evenly over those nodes by node number.
+// Nodes we redirect become candidates themselves,
+// so copies spread out in a tree rather than all from the home node.
+// Returns 0 if we should serve the pull ourselves.
+static uint8_t
+net_pullpeer(pageinfo *pi, uint8_t rqnode)
+{
+  uint32_t peers = pi->shared & ~(1 << (rqnode-1));
+  int n = 0, node;
+  for (node = 1; node <= NET_MAXNODES; node++)
+    if (peers & (1 << (node-1)))
+      n++;
+  if (n < NET_PULLPEERS)
+    return 0;
+
+  int k = rqnode % n;
+  for (node = 1; node <= NET_MAXNODES; node++)
+    if ((peers & (1 << (node-1))) && k-- == 0)
+      break;
+  assert(node <= NET_MAXNODES && node != rqnode);
+  return node;
 }
 
-// Process a page pull request we've received.
+// Process a page pull request we've received,
+// streaming back the needed parts of every page it names.
 void
 net_rxpullrq(net_pullrq *rq)
 {
@@ -430,155 +1339,494 @@ net_rxpullrq(net_pullrq *rq)
   uint8_t rqnode = rq->eth.src[5];
   assert(rqnode > 0 && rqnode <= NET_MAXNODES && rqnode != net_node);
 
-  // Validate the requested node number and page address.
-  uint32_t rr = rq->rr;
-  if (RRNODE(rr) != net_node) {
-    warn("net_rxpullrq: pull request came to wrong node!?");
-    return;
-  }
-  uint32_t addr = RRADDR(rr);
-  pageinfo *pi = mem_phys2pi(addr);
-  if (pi <= &mem_pageinfo[0] || pi >= &mem_pageinfo[mem_npage]) {
-    warn("net_rxpullrq: pull request for invalid page %x", addr);
-    return;
-  }
-  if (pi->refcount == 0) {
-    warn("net_rxpullrq: pull request for free page %x", addr);
-    return;
-  }
-  if (pi->home != 0) {
-    warn("net_rxpullrq: pull request for unowned page %x", addr);
+  if (rq->n > NET_PULLMAX) {
+    warn("net_rxpullrq: pull request for %d pages", rq->n);
     return;
   }
-  void *pg = mem_pi2ptr(pi);
+  net_maxpkts[rqnode] = rq->maxpkt;   // (racy, but just a hint)
+
+  net_jumbo jb;
+  net_jumboinit(&jb, rqnode, 0);
+  int i;
+  for (i = 0; i < rq->n; i++) {
+    // Validate the requested node number and page address.
+    uint32_t rr = rq->rr[i];
+    if (RRNODE(rr) != net_node) {
+      if (rq->pglev != PGLEV_PAGE) {
+        warn("net_rxpullrq: pull request came to wrong node!?");
+        continue;
+      }
+      // The home node sent the requester to us for our copy.
+      // Copies never change (see mem.h), so we can serve ours,
+      // or send the requester back home if we no longer have it,
+      // or don't have all of it yet: home counts us as having it
+      // as soon as it redirects us, before our own pull is done.
+      pageinfo *pi = mem_rrlookup(rr);
+      if (pi == NULL || pi->pulling) {
+        if (pi != NULL)
+          mem_decref(pi, mem_free);
+        net_txpullredir(rqnode, rr, 0);
+        continue;
+      }
+      net_txpullrp(rqnode, rr, PGLEV_PAGE, rq->need[i], mem_pi2ptr(pi), 0,
+                   &jb);
+      mem_decref(pi, mem_free);
+      continue;
+    }
+    uint32_t addr = RRADDR(rr);
+    pageinfo *pi = mem_phys2pi(addr);
+    if (pi <= &mem_pageinfo[0] || pi >= &mem_pageinfo[mem_npage]) {
+      warn("net_rxpullrq: pull request for invalid page %x", addr);
+      continue;
+    }
+    if (pi->refcount == 0) {
+      warn("net_rxpullrq: pull request for free page %x", addr);
+      continue;
+    }
+    if (pi->home != 0) {
+      warn("net_rxpullrq: pull request for unowned page %x", addr);
+      continue;
+    }
+    void *pg = mem_pi2ptr(pi);
+
+    // Spread pulls of popular plain pages across the nodes that have them.
+    uint8_t peer;
+    if (rq->pglev == PGLEV_PAGE && !rq->direct
+        && (peer = net_pullpeer(pi, rqnode)) != 0) {
+      pi->shared |= 1 << (rqnode-1);  // soon has a copy (see above)
+      net_txpullredir(rqnode, rr, peer);
+      continue;
+    }
 
-  // OK, looks legit as far as we can tell.
-  // Mark the page shared, since we're about to share it.
-  net_rrshare(pg, rqnode);
+    // OK, looks legit as far as we can tell.
+    // Mark the page shared, since we're about to share it.
+    net_rrshare(pg, rqnode);
 
-  // First part needed
-  if(rq->need & 1) {
-    net_txpullrp(rqnode, rr, rq->pglev, 0, (void*)addr);
-  }
-  if(rq->need & 2) {
-    net_txpullrp(rqnode, rr, rq->pglev, 1, (void*)addr);
-  }
-  if(rq->need & 4) {
-    net_txpullrp(rqnode, rr, rq->pglev, 2, (void*)addr);
+    net_txpullrp(rqnode, rr, rq->pglev, rq->need[i], (void*)addr, 0, &jb);
+
+    // Mark this page shared with the requesting node.
+    // (XXX might be necessarily only for pdir/ptab pages.)
+    assert(NET_MAXNODES <= sizeof(pi->shared)*8);
+    pi->shared |= 1 << (rqnode-1);
   }
-  // Mark this page shared with the requesting node.
-  // (XXX might be necessarily only for pdir/ptab pages.)
-  assert(NET_MAXNODES <= sizeof(pi->shared)*8);
-  pi->shared |= 1 << (rqnode-1);
+  net_jumboflush(&jb);
 }
 
 static const int partlen[3] = {
   NET_PULLPART0, NET_PULLPART1, NET_PULLPART2};
 
-void
-net_txpullrp(uint8_t rqnode, uint32_t rr, int pglev, int part, void *pg)
-{
-  // Find appropriate part of this page
-  void *data = pg + NET_PULLPART*part;
-  int len = partlen[part];
-  assert(len <= NET_PULLPART);
-  assert((len & 3) == 0);   // must contain only whole PTEs
-  assert(RRADDR(rr) == (uint32_t)pg);
-
-  // If we're transmitting part of a page directory or page table,
-  // then first convert all PTEs into remote references.
-  // XXX it's not ideal that we just believe the requestor's word
-  // about whether this is a page table or regular page;
-  // would be better if we kept our own type info in struct pageinfo.
-  int nrrs = len/4;
-  uint32_t rrs[nrrs];
-  if (pglev > 0) {
-    const uint32_t *pt = data;
-    int i;
-    for(i = 0; i < nrrs; i++) {
-      pte_t tab = pt[i];
-      // If its a global pte then dont send it
-      if(tab & PTE_G)
-        rrs[i] = 0;
-      // If its a remote reference, just send it
-      else if(tab & PTE_REMOTE)
-        rrs[i] = tab;
-      // If its a zero page, just send RR_REMOTE
-      else if(PGADDR(tab) == PTE_ZERO)
-        rrs[i] = (tab & RR_RW) | RR_REMOTE;
-      // Otherwise its a user-space pte that needs to be transferred
-      else {
-        pageinfo *p = mem_phys2pi(PGADDR(tab));
-        if(p->home == 0)    // This is our comps page
-          rrs[i] = RRCONS(net_node, PGADDR(tab), tab & RR_RW);
-        else
-          rrs[i] = p->home; // Send back remote ref
-      }
+// Return word i of a page we're sending in a pull reply.
+// If we're transmitting a page directory or page table,
+// then we convert all its PTEs into remote references.
+// XXX it's not ideal that we just believe the requestor's word
+// about whether this is a page table or regular page;
+// would be better if we kept our own type info in struct pageinfo.
+static uint32_t
+net_pullword(const uint32_t *pg, int i, int pglev)
+{
+  pte_t tab = pg[i];
+  if (pglev == 0)
+    return tab;
+  // If its a global pte then dont send it
+  if(tab & PTE_G)
+    return 0;
+  // If its a remote reference, just send it
+  if(tab & PTE_REMOTE)
+    return tab;
+  // If its a zero page, just send RR_REMOTE
+  if(PGADDR(tab) == PTE_ZERO)
+    return (tab & RR_RW) | RR_REMOTE;
+  // Otherwise its a user-space pte that needs to be transferred
+  pageinfo *p = mem_phys2pi(PGADDR(tab));
+  if(p->home == 0)    // This is our comps page
+    return RRCONS(net_node, PGADDR(tab), tab & RR_RW);
+  return p->home; // Send back remote ref
+}
+
+// How many words starting at i equal word i, up to max?
+static int
+net_pullrepeat(const uint32_t *pg, int i, int pglev, int max)
+{
+  uint32_t w = net_pullword(pg, i, pglev);
+  int n = 1;
+  while (n < max && i+n < NPTENTRIES && net_pullword(pg, i+n, pglev) == w)
+    n++;
+  return n;
+}
+
+// Try to send a whole page in one NET_PULLZERO or NET_PULLRLE reply.
+// Returns false if it doesn't compress enough to fit in one packet.
+static bool
+net_txpullenc(uint8_t rqnode, uint32_t rr, int pglev, const uint32_t *pg,
+		uint32_t pushhome)
+{
+  uint8_t buf[NET_PULLPART];
+  int len = 0, i = 0;
+
+  while (i < NPTENTRIES) {
+    if (len + sizeof(net_pullrun) > NET_PULLPART)
+      return 0;
+    net_pullrun *run = (net_pullrun*)&buf[len];
+    len += sizeof(net_pullrun);
+
+    // A run of at least 3 equal words is worth a fill.
+    int n = net_pullrepeat(pg, i, pglev, NPTENTRIES);
+    run->fill = n >= 3 ? net_pullword(pg, i, pglev) : 0;
+    run->nfill = n >= 3 ? n : 0;
+    i += run->nfill;
+
+    // Then literal words, up to the next run worth filling.
+    run->nwords = 0;
+    while (i < NPTENTRIES && net_pullrepeat(pg, i, pglev, 3) < 3) {
+      if (len + 4 > NET_PULLPART)
+        return 0;
+      *(uint32_t*)&buf[len] = net_pullword(pg, i++, pglev);
+      len += 4;
+      run->nwords++;
     }
-    data = rrs; // Send RRs instead of original page.
   }
 
-  // Build and send the message
   net_pullrphdr rph;
   net_ethsetup(&rph.eth, rqnode);
-  rph.type = NET_PULLRP;
+  rph.type = pushhome ? NET_PUSH : NET_PULLRP;
   rph.rr = rr;
-  rph.part = part;
-  net_tx(&rph, sizeof(rph), data, len);
+  rph.home = pushhome;
+  rph.part = 0;
+  net_pullrun *run = (net_pullrun*)buf;
+  if (len == sizeof(net_pullrun) && run->fill == 0) {
+    rph.enc = NET_PULLZERO;   // All zero: nothing more to say
+    len = 0;
+  } else
+    rph.enc = NET_PULLRLE;
+  net_tx(&rph, sizeof(rph), buf, len);
+  return 1;
 }
 
+// Send the parts of a page a remote node has asked for:
+// the whole page at once if it compresses, otherwise the raw parts needed.
+// If pushhome is nonzero, we're pushing the page unasked
+// on behalf of the migrating process with that home RR.
+// A raw plain page joins jumbo batch jb instead, if the node takes those,
+// to go out with others when the batch fills or the caller flushes it.
 void
-net_rxpullrp(net_pullrphdr *rp, int len)
+net_txpullrp(uint8_t rqnode, uint32_t rr, int pglev, int need, void *pg,
+		uint32_t pushhome, net_jumbo *jb)
 {
-  static const int partlen[3] = {
-    NET_PULLPART0, NET_PULLPART1, NET_PULLPART2};
-
-  assert(rp->type == NET_PULLRP);
+  assert(RRNODE(rr) != net_node || RRADDR(rr) == (uint32_t)pg);
+  if (net_txpullenc(rqnode, rr, pglev, pg, pushhome))
+    return;
 
-  spinlock_acquire(&net_lock);
-  // Find the process waiting for this pull reply, if any.
-  proc *p, **pp;
-  int part = rp->part;
+  if (pglev == 0 && jb != NULL && net_usejumbo(rqnode)) {
+    assert(jb->node == rqnode && jb->pushhome == pushhome);
+    mem_incref(mem_ptr2pi(pg));
+    jb->rr[jb->n] = rr;
+    jb->pg[jb->n] = pg;
+    if (++jb->n == NET_JUMBOPAGES)
+      net_jumboflush(jb);
+    return;
+  }
+
+  int part;
+  for (part = 0; part < 3; part++) {
+    if (!(need & (1 << part)))
+      continue;
+
+    // Find appropriate part of this page
+    void *data = pg + NET_PULLPART*part;
+    int len = partlen[part];
+    assert(len <= NET_PULLPART);
+    assert((len & 3) == 0);   // must contain only whole PTEs
+
+    // Build the message header
+    net_pullrphdr rph;
+    net_ethsetup(&rph.eth, rqnode);
+    rph.type = pushhome ? NET_PUSH : NET_PULLRP;
+    rph.rr = rr;
+    rph.home = pushhome;
+    rph.part = part;
+    rph.enc = NET_PULLRAW;
+
+    // Plain pages go out straight from the page itself;
+    // tables must first be converted to RRs.
+    if (pglev == 0) {
+      net_txref(&rph, sizeof(rph), data, len, mem_ptr2pi(pg));
+      continue;
+    }
+    int nrrs = len/4;
+    uint32_t rrs[nrrs];
+    int i;
+    for (i = 0; i < nrrs; i++)
+      rrs[i] = net_pullword(pg, NET_PULLPART/4*part + i, pglev);
+    net_tx(&rph, sizeof(rph), rrs, len);
+  }
+}
+
+// Start an empty batch of raw pages for node 'node'.
+static void
+net_jumboinit(net_jumbo *jb, uint8_t node, uint32_t pushhome)
+{
+  jb->node = node;
+  jb->pushhome = pushhome;
+  jb->n = 0;
+}
+
+// Send the pages in batch jb, if any, in one NET_PULLPAGES reply,
+// and drop the references we held on them.
+static void
+net_jumboflush(net_jumbo *jb)
+{
+  if (jb->n == 0)
+    return;
 
-  // cprintf("rxpullrp (part %d): data: %p, len: %d, datalen: %d, rr: %d\n",
-  //  rp->part+1, rp->data, len, len - sizeof(*rp), rp->rr);
+  struct {
+    net_pullrphdr rph;
+    net_pulljumbo jh;
+  } h;
+  net_ethsetup(&h.rph.eth, jb->node);
+  h.rph.type = jb->pushhome ? NET_PUSH : NET_PULLRP;
+  h.rph.rr = jb->rr[0];
+  h.rph.home = jb->pushhome;
+  h.rph.part = jb->n;
+  h.rph.enc = NET_PULLPAGES;
+  int i;
+  for (i = 1; i < NET_JUMBOPAGES; i++)
+    h.jh.rr[i-1] = i < jb->n ? jb->rr[i] : 0;
+  net_txpages(&h, sizeof(h), jb->pg, jb->n);
+
+  for (i = 0; i < jb->n; i++)
+    mem_decref(mem_ptr2pi(jb->pg[i]), mem_free);
+  jb->n = 0;
+}
+
+// A page we were pulling turned out to be all zero:
+// if no one else has picked up the local page we allocated for it,
+// free that page and map pmap_zero through the pull's PTE instead.
+// Returns false if we have to keep the page and just zero it.
+static bool
+net_pullzero(procpull *pl)
+{
+  pageinfo *pi = mem_ptr2pi(pl->pg);
+  assert(PGADDR(*pl->pte) == mem_pi2phys(pi));
+
+  // Stop tracking it first, so that no one else can look it up,
+  // then see if our PTE holds the only reference.
+  mem_rruntrack(pi);
+  if (pi->refcount != 1)
+    return 0;
+  *pl->pte = PTE_ZERO | PGOFF(*pl->pte);
+  pi->home = 0;
+  pi->shared = 0;
+  pi->pulling = 0;
+  mem_decref(pi, mem_free);
+  return 1;
+}
+
+// Decode a NET_PULLRLE payload into page pg.
+// Returns false if the encoding is malformed.
+static bool
+net_pulldecode(uint32_t *pg, const uint8_t *data, int len)
+{
+  int i = 0, off = 0;
+  while (off < len) {
+    if (off + sizeof(net_pullrun) > len)
+      return 0;
+    const net_pullrun *run = (const net_pullrun*)&data[off];
+    off += sizeof(net_pullrun);
+    if (i + run->nfill + run->nwords > NPTENTRIES
+        || off + 4*run->nwords > len)
+      return 0;
+    int j;
+    for (j = 0; j < run->nfill; j++)
+      pg[i++] = run->fill;
+    memcpy(&pg[i], &data[off], 4*run->nwords);
+    i += run->nwords;
+    off += 4*run->nwords;
+  }
+  return i == NPTENTRIES;
+}
+
+// Find the pull in flight for a given RR, or return NULL if none.
+// Also sets *ppp to point to the link to its proc on net_pulllist.
+static procpull *
+net_pullfind(uint32_t rr, proc ***ppp)
+{
+  assert(spinlock_holding(&net_lock));
+  proc *p, **pp;
   for (pp = &net_pulllist; (p = *pp) != NULL; pp = &p->pullnext) {
     assert(p->state == PROC_PULL);
-    if (p->pullrr == rp->rr)
-      break;
+    int i;
+    for (i = 0; i < PROC_NPULL; i++)
+      if (p->pull[i].rr == rr) {
+        *ppp = pp;
+        return &p->pull[i];
+      }
   }
-  if (p == NULL) {  // Probably a duplicate due to retransmission
-    //warn("net_rxpullrp: no process waiting for RR %x", rp->rr);
+  return NULL;
+}
+
+// Tell rqnode to pull rr from 'node' instead, or from its home if node is 0.
+void
+net_txpullredir(uint8_t rqnode, uint32_t rr, uint8_t node)
+{
+  net_pullredir rd;
+  net_ethsetup(&rd.eth, rqnode);
+  rd.type = NET_PULLREDIR;
+  rd.rr = rr;
+  rd.node = node;
+  net_tx(&rd, sizeof(rd), 0, 0);
+}
+
+// The node we asked for a page redirected us elsewhere: ask again there.
+void
+net_rxpullredir(net_pullredir *rd)
+{
+  assert(rd->type == NET_PULLREDIR);
+  uint8_t srcnode = rd->eth.src[5];
+
+  spinlock_acquire(&net_lock);
+  proc **pp;
+  procpull *pl = net_pullfind(rd->rr, &pp);
+  if (pl == NULL || pl->node != srcnode || pl->pglev != PGLEV_PAGE) {
+    net_statinc(dups);
+    return spinlock_release(&net_lock);   // Stale or duplicate
+  }
+
+  if (rd->node == 0 || rd->node == net_node || rd->node > NET_MAXNODES
+      || srcnode != RRNODE(pl->rr)) {   // Only home may send us to a peer
+    pl->node = RRNODE(pl->rr);
+    pl->direct = 1;
+  } else
+    pl->node = rd->node;
+  pl->sent = 0;
+  net_txpullrq(*pp, 0);
+  spinlock_release(&net_lock);
+}
+
+// Count a pull that took 'ticks' timer ticks in the latency histogram.
+static void
+net_pullstat(uint32_t ticks)
+{
+  int i = 0;
+  while (i < NETSTAT_NHIST-1 && ticks >= (1 << i))
+    i++;
+  net_statinc(pullhist[i]);
+}
+
+void
+net_rxpullrp(net_pullrphdr *rp, int len)
+{
+  assert(rp->type == NET_PULLRP);
+  if (rp->enc != NET_PULLPAGES)
+    return net_rxpullone(rp->rr, rp->enc, rp->part, rp->data,
+                         len - sizeof(*rp));
+
+  // A jumbo reply: handle each page as if it came in its own reply.
+  int n = rp->part, i;
+  const net_pulljumbo *jh = (const net_pulljumbo*)rp->data;
+  if (n < 1 || n > NET_JUMBOPAGES
+      || len != sizeof(*rp) + sizeof(*jh) + n*PAGESIZE) {
+    warn("net_rxpullrp: bad jumbo reply of %d pages, size %d", n, len);
+    return;
+  }
+  for (i = 0; i < n; i++)
+    net_rxpullone(i == 0 ? rp->rr : jh->rr[i-1], NET_PULLPAGES, 0,
+                  (const char*)(jh+1) + i*PAGESIZE, PAGESIZE);
+}
+
+// Receive the part 'part', in encoding 'enc', of the page we're pulling as rr:
+// if that completes the page, the pull is done.
+// For NET_PULLPAGES, data is just the one whole raw page.
+static void
+net_rxpullone(uint32_t rr, int enc, int part, const void *data, int datalen)
+{
+  spinlock_acquire(&net_lock);
+  // Find the process waiting for this pull reply, if any.
+  proc **pp;
+  procpull *pl = net_pullfind(rr, &pp);
+
+  // cprintf("rxpullrp (part %d): data: %p, datalen: %d, rr: %d\n",
+  //  part+1, data, datalen, rr);
+  if (pl == NULL) {  // Probably a duplicate due to retransmission
+    //warn("net_rxpullrp: no process waiting for RR %x", rr);
+    net_statinc(dups);
     return spinlock_release(&net_lock);
   }
+  proc *p = *pp;
   if (part < 0 || part > 2) {
     warn("net_rxpullrp: invalid part number %d", part);
     return spinlock_release(&net_lock);
   }
-  if (p->arrived & (1 << rp->part)) {
-    warn("net_rxpullrp: part %d already arrived", part);
-    return spinlock_release(&net_lock);
-  }
-  int datalen = len - sizeof(*rp);
-  if (datalen != partlen[rp->part]) {
-    warn("net_rxpullrp: part %d wrong size %d", part, datalen);
+  switch (enc) {
+  case NET_PULLRAW:
+    if (pl->arrived & (1 << part)) {
+      warn("net_rxpullrp: part %d already arrived", part);
+      net_statinc(dups);
+      return spinlock_release(&net_lock);
+    }
+    if (datalen != partlen[part]) {
+      warn("net_rxpullrp: part %d wrong size %d", part, datalen);
+      return spinlock_release(&net_lock);
+    }
+
+    // Fill in the appropriate part of the page.
+    memcpy(pl->pg + NET_PULLPART*part, data, datalen);
+    pl->arrived |= 1 << part;  // Mark this part arrived.
+    if (pl->arrived != 7)
+      return spinlock_release(&net_lock);  // Wait for remaining parts
+    break;
+
+  case NET_PULLZERO:
+    if (datalen != 0) {
+      warn("net_rxpullrp: zero page reply wrong size %d", datalen);
+      return spinlock_release(&net_lock);
+    }
+    if (pl->pte != NULL && net_pullzero(pl))
+      break;    // Mapped pmap_zero instead
+    memset(pl->pg, 0, PAGESIZE);
+    pl->arrived = 7;
+    break;
+
+  case NET_PULLRLE:
+    if (!net_pulldecode(pl->pg, data, datalen)) {
+      warn("net_rxpullrp: bad encoded page of size %d", datalen);
+      pl->arrived = 0;  // may have scribbled on parts already arrived
+      return spinlock_release(&net_lock);
+    }
+    pl->arrived = 7;
+    break;
+
+  case NET_PULLPAGES:
+    if (pl->pglev != PGLEV_PAGE || datalen != PAGESIZE) {
+      warn("net_rxpullrp: bad raw page of size %d", datalen);
+      return spinlock_release(&net_lock);
+    }
+    memcpy(pl->pg, data, PAGESIZE);
+    pl->arrived = 7;
+    break;
+
+  default:
+    warn("net_rxpullrp: invalid page encoding %d", enc);
     return spinlock_release(&net_lock);
   }
 
-  // Fill in the appropriate part of the page.
-  memcpy(p->pullpg + NET_PULLPART*part, rp->data, datalen);
-  p->arrived |= 1 << rp->part;  // Mark this part arrived.
-  if (p->arrived == 7)          // All three parts arrived?
-    *pp = p->pullnext;          // Remove from list of waiting procs.
+  // Peers may serve the page now (see net_rxpullrq()),
+  // unless net_pullzero() already let it go.
+  if (pl->arrived == 7)
+    mem_ptr2pi(pl->pg)->pulling = 0;
 
-  spinlock_release(&net_lock);
+  // A data page that came in the long way can still turn out all zero,
+  // in which case it can share pmap_zero too.
+  if (enc != NET_PULLZERO && pl->pglev == PGLEV_PAGE && pl->pte != NULL
+      && pmap_iszero(pl->pg))
+    net_pullzero(pl);
 
-  if (p->arrived != 7)
-    return;     // Wait for remaining parts
+  // If it was one we'd paged out, the node we got it from can let it go.
+  if (pl->pglev == PGLEV_PAGE && p->paged)
+    net_txswapfree(pl->rr);
 
   // If this was a page directory, reinitialize the kernel portions.
-  if (p->pglev == PGLEV_PDIR) {
-    uint32_t *pdir = p->pullpg;
+  if (pl->pglev == PGLEV_PDIR) {
+    uint32_t *pdir = pl->pg;
     int i;
     for (i = 0; i < NPDENTRIES; i++) {
       if (i == PDX(VM_USERLO))  // skip user area
@@ -587,44 +1835,1068 @@ net_rxpullrp(net_pullrphdr *rp, int len)
     }
   }
 
-  // Done - what else does this proc need to pull before it can run?
-  // Remove/disable this code if the VM system supports pull-on-demand.
-  while (p->pullva < VM_USERHI) {
+  // This pull is done: free its slot, and the walk can continue.
+  // Progress resets the retransmit backoff, as in TCP;
+  // if other pulls are still outstanding, give them a fresh timeout.
+  if (!pl->retx)
+    net_rttsample(pl->node, pl->sentat);
+  net_pullstat(net_ticks - pl->sentat);
+  if (pl->pglev > 0)
+    p->pullwait = 0;
+  pl->rr = 0;
+  p->pulltimer.backoff = 0;
+  if (--p->npull == 0) {
+    *pp = p->pullnext;    // Remove from list of waiting procs.
+    net_timerclear(&p->pulltimer);
+  } else
+    net_pullarm(p);
+
+  bool done = net_pullwalk(p);
+  if (done && p->ckptrec != 0 && net_ckptrecord(p))
+    done = 0;   // Its checkpoint record is in: now for its pdir
+  bool stop = done && p->pullstop, wake = 0;
+  if (stop) {   // A stopped proc's pages are back (see net_fetch())
+    p->pullstop = 0;
+    p->paged = p->pulltabs;   // A restored proc's are still remote
+    p->pulltabs = 0;
+    p->state = PROC_STOP;
+    if (p->ckpt != NULL)
+      net_ckptpulled(p);
+    else
+      wake = 1;
+  } else if (done)
+    net_pushdone(p);
+  spinlock_release(&net_lock);
+
+  // We've pulled the proc's entire address space: it's ready to go!
+  if (wake)
+    proc_wakeparent(p);
+  else if (done && !stop) {
+    //cprintf("net_rxpullrp: migration complete\n");
+    proc_ready(p);
+  }
+}
+
+// Push entry i of page directory or page table 'tab' at level pglev
+// to the node p is migrating to, if it maps a page we own:
+// one we'd serve a pull for, as opposed to a copy of someone else's.
+// Returns true if we pushed it.
+static bool
+net_txpushpte(proc *p, uint32_t *tab, int i, int pglev, net_jumbo *jb)
+{
+  pte_t pte = tab[i];
+  if (!(pte & PTE_P) || PGADDR(pte) == PTE_ZERO)
+    return 0;
+  uint32_t rr = net_pullword(tab, i, pglev);
+  if (RRNODE(rr) != net_node)
+    return 0;
+
+  void *pg = mem_ptr(PGADDR(pte));
+  net_rrshare(pg, p->migrdest);
+  net_txpullrp(p->migrdest, rr, pglev-1, 7, pg, p->home, jb);
+  return 1;
+}
+
+// Push the pages process p has touched lately to the node it's migrating to,
+// right behind its migrate request, so the destination needn't pull them.
+// The processor sets PTE_A in each PTE that p uses;
+// we clear these bits as we go, so next time we push only
+// what p touched since this migration.
+// When p is returning home we push only the pages it wrote (PTE_D):
+// home still has the originals of everything else.
+// Page tables go first, since the destination needs them first,
+// and we stop at NET_PUSHMAX pages so as not to overrun the transmit ring.
+// Anything we don't push the destination will just pull as usual.
+static void
+net_txpush(proc *p)
+{
+  assert(p->state == PROC_MIGR);
+  assert(spinlock_holding(&net_lock));
+
+  pte_t want = p->migrdest == RRNODE(p->home) ? PTE_D : PTE_A;
+  net_jumbo jb;
+  net_jumboinit(&jb, p->migrdest, p->home);
+  int npush = 0, pass;
+  for (pass = 0; pass < 2; pass++) {
+    uint32_t va;
+    for (va = VM_USERLO; va < VM_USERHI; va += PTSIZE) {
+      pde_t *pde = &p->pdir[PDX(va)];
+      if (!(*pde & PTE_P) || PGADDR(*pde) == PTE_ZERO)
+        continue;
+      pte_t *ptab = mem_ptr(PGADDR(*pde));
+      bool used = 0;
+      int i;
+      for (i = 0; i < NPTENTRIES; i++) {
+        // A remote reference's home node overlaps PTE_A and PTE_D.
+        if (!(ptab[i] & PTE_P) || !(ptab[i] & want))
+          continue;
+        used = 1;
+        if (pass == 0)    // First pass: just see if ptab was used
+          break;
+        if (npush < NET_PUSHMAX)
+          npush += net_txpushpte(p, ptab, i, PGLEV_PTAB, &jb);
+        ptab[i] &= ~PTE_A;
+      }
+      if (pass == 0 && used && npush < NET_PUSHMAX)
+        npush += net_txpushpte(p, p->pdir, PDX(va), PGLEV_PDIR, &jb);
+    }
+  }
+  net_jumboflush(&jb);
+}
+
+// Release a pushed page's slot and the slot's reference to the page,
+// freeing the page if no PTE has picked it up.
+// As in net_pullzero(), we can't be racing with net_pullpte()
+// to look the page up, since we hold net_lock.
+static void
+net_pushdrop(net_push *ps)
+{
+  assert(spinlock_holding(&net_lock));
+  pageinfo *pi = ps->pi;
+  if (pi->refcount == 1) {
+    mem_rruntrack(pi);
+    pi->home = 0;
+    pi->shared = 0;
+  }
+  mem_decref(pi, mem_free);
+  ps->rr = 0;
+}
+
+// Process p has pulled its whole address space,
+// so it has picked up every pushed page it's going to: drop the rest.
+static void
+net_pushdone(proc *p)
+{
+  assert(spinlock_holding(&net_lock));
+  int i;
+  for (i = 0; i < NET_PUSHSLOTS; i++)
+    if (net_pushes[i].rr != 0 && net_pushes[i].home == p->home)
+      net_pushdrop(&net_pushes[i]);
+}
+
+// Receive one part of a page pushed to us by a migrating process's
+// source node (see net_txpush()).  Once the whole page has arrived
+// we track it under its RR, as if we'd pulled it, so net_pullpte()
+// will find it without pulling as it walks the process's address space.
+void
+net_rxpush(net_pullrphdr *rp, int len)
+{
+  assert(rp->type == NET_PUSH);
+  uint8_t srcnode = rp->eth.src[5];
+  if (rp->enc != NET_PULLPAGES)
+    return net_rxpushone(srcnode, rp->home, rp->rr, rp->enc, rp->part,
+                         rp->data, len - sizeof(*rp));
+
+  // Several pages in a jumbo frame, as in net_rxpullrp().
+  int n = rp->part, i;
+  const net_pulljumbo *jh = (const net_pulljumbo*)rp->data;
+  if (n < 1 || n > NET_JUMBOPAGES
+      || len != sizeof(*rp) + sizeof(*jh) + n*PAGESIZE) {
+    warn("net_rxpush: bad jumbo push of %d pages, size %d", n, len);
+    return;
+  }
+  for (i = 0; i < n; i++)
+    net_rxpushone(srcnode, rp->home, i == 0 ? rp->rr : jh->rr[i-1],
+                  NET_PULLPAGES, 0, (const char*)(jh+1) + i*PAGESIZE,
+                  PAGESIZE);
+}
+
+// Receive part 'part' of the page with RR rr that srcnode pushed
+// for the proc with home RR 'home', in encoding 'enc'.
+static void
+net_rxpushone(uint8_t srcnode, uint32_t home, uint32_t rr,
+              int enc, int part, const void *data, int datalen)
+{
+  if (RRNODE(rr) != srcnode || RRADDR(rr) == 0
+      || RRNODE(home) < 1 || RRNODE(home) > NET_MAXNODES) {
+    warn("net_rxpush: bogus push of RR %x for proc %x", rr, home);
+    return;
+  }
+  if (part < 0 || part > 2) {
+    warn("net_rxpush: invalid part number %d", part);
+    return;
+  }
+
+  spinlock_acquire(&net_lock);
+
+  // Only take pages for a proc that's still pulling its address space.
+  proc *p = RRNODE(home) == net_node ? proc_rrptr(home)
+                                     : mem_rrlookupobj(home);
+  if (p == NULL || p->state != PROC_PULL || p->pullva >= VM_USERHI)
+    return spinlock_release(&net_lock);
+
+  // Find the page's slot, or make one if we don't already have the page.
+  net_push *ps, *fs = NULL;
+  for (ps = net_pushes; ps < &net_pushes[NET_PUSHSLOTS]; ps++) {
+    if (ps->rr == rr)
+      break;
+    if (ps->rr == 0 && fs == NULL)
+      fs = ps;
+  }
+  if (ps == &net_pushes[NET_PUSHSLOTS]) {
+    pageinfo *pi = mem_rrlookup(rr);
+    if (pi != NULL) {   // Pulled already, or left from an earlier visit
+      mem_decref(pi, mem_free);
+      return spinlock_release(&net_lock);
+    }
+    if (fs == NULL || (pi = mem_alloc()) == NULL)
+      return spinlock_release(&net_lock);   // It'll just be pulled
+    mem_incref(pi);
+    ps = fs;
+    ps->rr = rr;
+    ps->home = home;
+    ps->pi = pi;
+    ps->arrived = 0;
+  }
+  if (ps->arrived & (1 << part))
+    return spinlock_release(&net_lock);   // Duplicate
+
+  void *pg = mem_pi2ptr(ps->pi);
+  bool ok = 0;
+  switch (enc) {
+  case NET_PULLRAW:
+    ok = datalen == partlen[part];
+    if (ok) {
+      memcpy(pg + NET_PULLPART*part, data, datalen);
+      ps->arrived |= 1 << part;
+    }
+    break;
+  case NET_PULLPAGES:
+    ok = datalen == PAGESIZE;
+    if (ok) {
+      memcpy(pg, data, PAGESIZE);
+      ps->arrived = 7;
+    }
+    break;
+  case NET_PULLZERO:
+    ok = datalen == 0;
+    if (ok) {
+      memset(pg, 0, PAGESIZE);
+      ps->arrived = 7;
+    }
+    break;
+  case NET_PULLRLE:
+    ok = net_pulldecode(pg, data, datalen);
+    if (ok)
+      ps->arrived = 7;
+    break;
+  }
+  if (!ok) {
+    warn("net_rxpush: bad part %d encoding %d size %d",
+      part, enc, datalen);
+    net_pushdrop(ps);
+    return spinlock_release(&net_lock);
+  }
+
+  // Once it's all here, track it, unless the walk got there first.
+  if (ps->arrived == 7) {
+    pageinfo *pi = mem_rrlookup(ps->rr);
+    if (pi != NULL) {
+      mem_decref(pi, mem_free);
+      net_pushdrop(ps);
+    } else {
+      mem_rrtrack(ps->rr, ps->pi);
+      ps->pi->shared = (RRNODE(ps->rr)%2)+1;  // as in net_pullpte()
+    }
+  }
+  spinlock_release(&net_lock);
+}
+
+// Is this node short enough of page frames to page out to other nodes?
+bool
+net_swapneeded(void)
+{
+  return net_node != 0 && mem_nfree() < NET_SWAPLOW;
+}
+
+// Pick the node to page out to: the one that last reported
+// the most free pages, or 0 if none has reported lately.
+static uint8_t
+net_swappeer(void)
+{
+  assert(spinlock_holding(&net_lock));
+  uint8_t node, best = 0;
+  for (node = 1; node <= NET_MAXNODES; node++) {
+    net_nodeload *l = &net_loads[node];
+    if (node == net_node || l->heard == 0
+        || net_ticks - l->heard > NET_LOADSTALE || l->nfree == 0)
+      continue;
+    if (best == 0 || l->nfree > net_loads[best].nfree)
+      best = node;
+  }
+  return best;
+}
+
+// Page cold memory in the 4MB region at va of stopped process p
+// out to another node if we're short of memory,
+// while proc_scanidle() has p claimed.
+// Copies of other nodes' pages just get their RRs back (pmap_swapscan());
+// up to NET_SWAPBATCH private pages we send to the node with the most
+// memory free, which answers each with an RR for its copy.
+// Returns true if such a batch is in flight, which then holds
+// the caller's claim on p until it's done; sets *progress
+// if anything has changed, or is on its way to.
+bool
+net_swapout(proc *p, uint32_t va, bool *progress)
+{
+  if (!net_swapneeded())
+    return 0;
+  uint32_t vas[NET_SWAPBATCH];
+  int n = NET_SWAPBATCH, i;
+  bool remote = 0;
+  if (pmap_swapscan(p->pdir, va, vas, &n, &remote) > 0)
+    *progress = 1;
+  if (remote)
+    p->paged = 1;
+  if (n == 0)
+    return 0;
+
+  // We'll be changing p's PTEs as replies arrive,
+  // so only go ahead if no other idle CPU is scanning p too.
+  spinlock_acquire(&p->lock);
+  if (p->zscans != 1 || p->pmapbusy) {
+    spinlock_release(&p->lock);
+    return 0;
+  }
+  spinlock_acquire(&net_lock);
+  uint8_t node = net_swappeer();
+  if (node == 0) {
+    spinlock_release(&net_lock);
+    spinlock_release(&p->lock);
+    return 0;
+  }
+  p->swapping = 1;
+  spinlock_release(&p->lock);
+
+  net_pullrphdr hdr;
+  net_ethsetup(&hdr.eth, node);
+  hdr.type = NET_SWAP;
+  hdr.home = p->home;
+  hdr.enc = NET_PULLRAW;
+  for (i = 0; i < NET_SWAPBATCH; i++) {
+    if (i >= n) {
+      p->swaprr[i] = 0;
+      continue;
+    }
+    pte_t pte = pmap_getpte(p->pdir, vas[i]);
+    p->swapva[i] = vas[i];
+    p->swaprr[i] = hdr.rr = RRCONS(net_node, PGADDR(pte), pte);
+    for (hdr.part = 0; hdr.part < 3; hdr.part++)
+      net_tx(&hdr, sizeof(hdr), mem_ptr(PGADDR(pte) + NET_PULLPART*hdr.part),
+             partlen[hdr.part]);
+  }
+  p->swapnode = node;
+  p->nswap = n;
+  p->swapnext = net_swaplist;
+  net_swaplist = p;
+  p->swaptimer.proc = p;
+  p->swaptimer.backoff = 0;
+  net_timerset(&p->swaptimer, node);
+  spinlock_release(&net_lock);
+  *progress = 1;
+  return 1;
+}
+
+// Process p's batch of pages paging out is over: take it off the list.
+// Its claim on p goes with net_swaprelease() once we let go of net_lock.
+static void
+net_swapdone(proc *p)
+{
+  assert(spinlock_holding(&net_lock));
+  proc **pp;
+  for (pp = &net_swaplist; *pp != p; pp = &(*pp)->swapnext)
+    assert(*pp != NULL);
+  *pp = p->swapnext;
+  net_timerclear(&p->swaptimer);
+  p->nswap = 0;
+}
+
+static void
+net_swaprelease(proc *p)
+{
+  spinlock_acquire(&p->lock);
+  assert(p->swapping && p->zscans > 0);
+  p->swapping = 0;
+  p->zscans--;
+  spinlock_release(&p->lock);
+}
+
+// Call off process p's batch of pages paging out, if still in flight,
+// because its parent wants to work on p (see proc_pmapready()):
+// pages not yet acknowledged just stay here.
+// Returns true if we did, so that the caller releases the batch's claim.
+// Caller holds p->lock.
+bool
+net_swapcancel(proc *p)
+{
+  spinlock_acquire(&net_lock);
+  bool live = p->nswap > 0;
+  if (live)
+    net_swapdone(p);
+  spinlock_release(&net_lock);
+  return live;
+}
+
+// Receive one part of a page another node is paging out to us
+// (see net_swapout()).  Once the whole page has arrived,
+// we keep it under an RR of our own and send the sender that RR,
+// until the sender pulls it back and sends a NET_SWAPFREE.
+// While we're short of memory ourselves we drop pages,
+// and the sender gives up and keeps them.
+// A sender that gave up after we took a page, or never heard our reply,
+// leaves us holding the page, as a node does for an RR no one uses.
+void
+net_rxswap(net_pullrphdr *rp, int len)
+{
+  assert(rp->type == NET_SWAP);
+  uint8_t node = rp->eth.src[5];
+  int part = rp->part;
+  if (part < 0 || part > 2 || rp->enc != NET_PULLRAW
+      || len - sizeof(*rp) != partlen[part] || RRNODE(rp->rr) != node) {
+    warn("net_rxswap: bad page part %d, size %d", part, len);
+    return;
+  }
+
+  // Find the page's slot, or a free one, freeing any the sender abandoned.
+  spinlock_acquire(&net_lock);
+  net_swapin *sw = NULL, *slot = NULL;
+  int i;
+  for (i = 0; i < NET_SWAPSLOTS && sw == NULL; i++) {
+    net_swapin *s = &net_swapins[i];
+    if (s->rr == rp->rr && s->node == node)
+      sw = s;
+    else if (s->rr != 0 && net_ticks - s->heard > NET_RTOMAX) {
+      mem_decref(s->pi, mem_free);
+      s->rr = 0;
+    }
+    if (s->rr == 0 && slot == NULL)
+      slot = s;
+  }
+  if (sw == NULL) {
+    pageinfo *pi;
+    if (slot == NULL || mem_nfree() < NET_SWAPHIGH
+        || (pi = mem_alloc()) == NULL)
+      return spinlock_release(&net_lock);
+    mem_incref(pi);
+    sw = slot;
+    sw->rr = rp->rr;
+    sw->node = node;
+    sw->arrived = 0;
+    sw->pi = pi;
+  }
+  sw->heard = net_ticks;
+  memcpy(mem_pi2ptr(sw->pi) + NET_PULLPART*part, rp->data, partlen[part]);
+  sw->arrived |= 1 << part;
+  if (sw->arrived != 7)
+    return spinlock_release(&net_lock);  // Wait for remaining parts
+
+  net_rrshare(mem_pi2ptr(sw->pi), node);
+  sw->pi->swapnode = node;    // until it sends a NET_SWAPFREE
+  net_swaprp srp;
+  net_ethsetup(&srp.eth, node);
+  srp.type = NET_SWAPRP;
+  srp.rr = rp->rr;
+  srp.home = rp->home;
+  srp.newrr = RRCONS(net_node, mem_pi2phys(sw->pi), rp->rr);
+  sw->rr = 0;
+  net_tx(&srp, sizeof(srp), 0, 0);
+  spinlock_release(&net_lock);
+}
+
+// Another node has taken one of the pages we're paging out:
+// map its RR in place of our page, and let ours go.
+void
+net_rxswaprp(net_swaprp *rp)
+{
+  uint8_t node = rp->eth.src[5];
+  spinlock_acquire(&net_lock);
+  proc *p;
+  for (p = net_swaplist; p != NULL; p = p->swapnext)
+    if (p->home == rp->home && p->swapnode == node)
+      break;
+  int i;
+  for (i = 0; p != NULL && i < NET_SWAPBATCH; i++)
+    if (p->swaprr[i] == rp->rr)
+      break;
+  if (p == NULL || i == NET_SWAPBATCH || RRNODE(rp->newrr) != node) {
+    net_statinc(dups);    // Batch over, or a duplicate
+    return spinlock_release(&net_lock);
+  }
+
+  pde_t *pdir = p->pdir;
+  uint32_t va = p->swapva[i];
+  if (pmap_swapped(pdir, va, rp->rr, rp->newrr))
+    p->paged = 1;
+  p->swaprr[i] = 0;
+  p->swaptimer.backoff = 0;
+  bool done = --p->nswap == 0;
+  if (done)
+    net_swapdone(p);
+  else
+    net_timerset(&p->swaptimer, node);
+  spinlock_release(&net_lock);
+
+  pmap_inval(pdir, va, PAGESIZE);   // p's pdir may still be loaded somewhere
+  if (done)
+    net_swaprelease(p);
+}
+
+// We've pulled back a page we paged out to another node, as rr
+// (see net_rxpullone()): tell that node to let its copy go.
+// Pages pulled from anywhere else get sent here too,
+// and their nodes ignore it, as they don't hold them for us.
+static void
+net_txswapfree(uint32_t rr)
+{
+  net_swapfree sf;
+  net_ethsetup(&sf.eth, RRNODE(rr));
+  sf.type = NET_SWAPFREE;
+  sf.rr = rr;
+  net_tx(&sf, sizeof(sf), 0, 0);
+}
+
+// The node we took a page from in net_rxswap() has pulled it back.
+void
+net_rxswapfree(net_swapfree *sf)
+{
+  uint8_t node = sf->eth.src[5];
+  pageinfo *pi = mem_phys2pi(RRADDR(sf->rr));
+  if (RRNODE(sf->rr) != net_node
+      || pi <= &mem_pageinfo[0] || pi >= &mem_pageinfo[mem_npage]) {
+    warn("net_rxswapfree: bad RR %x", sf->rr);
+    return;
+  }
+  spinlock_acquire(&net_lock);
+  bool ours = pi->swapnode == node && pi->refcount > 0;
+  if (ours)
+    pi->swapnode = 0;
+  spinlock_release(&net_lock);
+  if (ours)
+    mem_decref(pi, mem_free);
+}
+
+// Running process p faulted on a page, or page table, of its own
+// that lives on another node (see net_swapout()): pte points to it.
+// Pull it back on its own, as net_fetch() does all of them,
+// with no walk to go on with once it's here,
+// and put p in PROC_PULL until then: net_rxpullone() readies p
+// to retry the access.  p's state must already be saved.
+// Returns 1 if p must wait, 0 if the page turned out to be here already,
+// or -1 if we're out of memory to pull it into.
+int
+net_pullfault(proc *p, uint32_t *pte, int pglevel)
+{
+  // net_pullpte() counts on getting a page: make sure there is one.
+  pageinfo *pi = mem_alloc();
+  if (pi == NULL)
+    return -1;
+  mem_free(pi);   // onto our CPU's page cache, for it to take
+
+  spinlock_acquire(&net_lock);
+  assert(p->npull == 0);
+  p->pullva = VM_USERHI;
+  p->pullwait = 0;
+  p->pullstop = 0;
+  p->paged = 1;   // if it didn't know: see net_rxpullone()
+  bool wait = !net_pullpte(p, pte, pglevel);
+  if (wait)
+    net_txpullrq(p, 0);
+  spinlock_release(&net_lock);
+  return wait;
+}
+
+// Start pulling back the pages of stopped process p that live on other nodes,
+// walking its address space as a migrating process does,
+// so that its parent can work on it or start it (see proc_pmapready()).
+// Returns true if the parent must wait for the pulls to finish,
+// or false if all p's pages turned out to be here already.
+bool
+net_fetch(proc *p)
+{
+  spinlock_acquire(&net_lock);
+  assert(p->state == PROC_STOP && p->npull == 0);
+  p->pullva = VM_USERLO;
+  p->pullwait = 0;
+  p->pullstop = 1;
+  if (net_pullwalk(p)) {
+    p->pullstop = 0;
+    p->paged = 0;
+  }
+  bool wait = p->pullstop;
+  spinlock_release(&net_lock);
+  return wait;
+}
+
+// Make checkpoint records for stopped process p and all its descendants,
+// for the current process, which holds its own lock, to send off
+// with net_ckpt() (see net.h): each record gets a copy-on-write copy
+// of its process's page directory, with superpages split as for migrating.
+// Puts the top record, first on the list of them all, in *recs.
+// Returns 0, or SYS_RUNNING if some descendant isn't stopped,
+// or SYS_NOCKPT if we run out of memory.
+int
+net_ckptsave(proc *p, net_ckptrec **recs)
+{
+  static_assert(sizeof(net_ckptrec) <= PAGESIZE);
+  proc *q;
+  for (q = p; q != NULL; q = proc_walknext(p, q))
+    if (q->state != PROC_STOP)
+      return SYS_RUNNING;
+
+  net_ckptrec *top = NULL, **tail = &top;
+  int r = 0;
+  for (q = p; q != NULL && r == 0; q = proc_walknext(p, q)) {
+    pageinfo *pi = mem_alloc();
+    if (pi == NULL) {
+      r = SYS_NOCKPT;
+      break;
+    }
+    mem_incref(pi);
+    net_ckptrec *rec = mem_pi2ptr(pi);
+    memset(rec, 0, sizeof(*rec));
+    *tail = rec;
+    tail = &rec->next;
+    pde_t *pdir = pmap_newpdir();
+    if (pdir == NULL) {
+      r = SYS_NOCKPT;
+      break;
+    }
+    rec->pdir = RRCONS(net_node, mem_phys(pdir), SYS_RW);
+
+    proc_pmapready(q, 0);   // keep idle scans and page-outs away
+    bool ok = pmap_splitall(q->pdir);
+    if (ok) {
+      net_untrackdirty(q);
+      ok = pmap_copy(q->pdir, VM_USERLO, pdir, VM_USERLO, VM_USERHI-VM_USERLO);
+    }
+    proc_pmapunclaim(q);
+    if (!ok)
+      r = SYS_NOCKPT;
+    rec->sv = q->sv;
+    memmove(rec->mergeops, q->mergeops, sizeof(rec->mergeops));
+
+    // Link the record into its parent's, made just before in preorder.
+    q->ckptpg = rec;
+    if (q != p) {
+      proc *pp = q->parent;
+      int cn;
+      for (cn = 0; pp->child[cn] != q; cn++)
+        ;
+      pp->ckptpg->child[cn] = RRCONS(net_node, mem_phys(rec), 0);
+    }
+  }
+  for (q = p; q != NULL; q = proc_walknext(p, q))
+    q->ckptpg = NULL;
+
+  if (r != 0) {
+    net_ckptfree(top);
+    top = NULL;
+  }
+  *recs = top;
+  return r;
+}
+
+// Let go of the records net_ckptsave() made, and their page directories,
+// once the node keeping the checkpoint has pulled all it wants of them.
+// No one else ever sees these, so we free them even though we've
+// named them to that node; the pages they map stay as usual.
+void
+net_ckptfree(net_ckptrec *recs)
+{
+  while (recs != NULL) {
+    net_ckptrec *rec = recs;
+    recs = rec->next;
+    pageinfo *pi;
+    if (rec->pdir != 0) {
+      pi = mem_phys2pi(RRADDR(rec->pdir));
+      pi->shared = 0;
+      mem_decref(pi, pmap_freepdirlater);
+    }
+    pi = mem_ptr2pi(rec);
+    pi->shared = 0;
+    mem_decref(pi, mem_free);
+  }
+}
+
+// Send checkpoint request 'type' (NET_CKPT or NET_CKPTRQ) about 'key',
+// carrying 'rr', to a node for the current process, as net_rpc() does:
+// the first time through we send it and go to sleep, to re-execute
+// the system call when the answer arrives, or to send it again.
+// Once the answer is in we return the RR it carried, 0 meaning none;
+// the caller clears ckptnode when it's done with the answer.
+uint32_t
+net_ckpt(trapframe *tf, uint8_t node, int type, uint32_t key, uint32_t rr)
+{
+  proc *p = proc_cur();
+  assert(node > 0 && node <= NET_MAXNODES && node != net_node);
+
+  spinlock_acquire(&net_lock);
+  if (p->ckptnode == node && !p->ckptwait) {
+    rr = p->ckptrr;
+    spinlock_release(&net_lock);
+    return rr;    // The answer is in
+  }
+  spinlock_release(&net_lock);
+  proc_save(p, tf, 0);  // Re-execute the system call when we wake up
+
+  spinlock_acquire(&net_lock);
+  if (p->ckptnode != node) {  // A new request, not a resend
+    p->rpcseq++;
+    p->ckptnode = node;
+    p->ckptwait = 1;
+    p->ckptkey = key;
+    p->rpctimer.proc = p;
+    p->rpctimer.backoff = 0;
+  }
+  net_ckptmsg m;
+  net_ethsetup(&m.eth, node);
+  m.type = type;
+  m.home = p->home;
+  m.seq = p->rpcseq;
+  m.key = key;
+  m.rr = rr;
+  net_tx(&m, sizeof(m), 0, 0);
+  p->state = PROC_RPC;
+  net_timerset(&p->rpctimer, node);
+  spinlock_release(&net_lock);
+  // Do something else now
+  proc_sched();
+}
+
+// The RR a holder's checkpoint slot ck gives restorers for its top record.
+static uint32_t
+net_ckpttop(net_ckptslot *ck)
+{
+  return RRCONS(net_node, mem_phys(ck->top->ckptpg), 0);
+}
+
+// Free the holder procs of checkpoint slot ck, whose pulls are all over,
+// and the slot.  Pages we've named to restorers stay, as usual.
+static void
+net_ckptdrop(net_ckptslot *ck)
+{
+  assert(spinlock_holding(&net_lock) && ck->pending == 0);
+  proc *q;
+  for (q = ck->top; q != NULL; q = proc_walknext(ck->top, q))
+    if (q->ckptpg != NULL) {
+      mem_decref(mem_ptr2pi(q->ckptpg), mem_free);
+      q->ckptpg = NULL;
+    }
+  bool freed = proc_free(ck->top);
+  assert(freed);
+  ck->node = 0;
+  ck->top = NULL;
+}
+
+// Receive a request to keep a checkpoint (NET_CKPT),
+// or to find one to restore (NET_CKPTRQ).
+// Keys belong to the process that saved them, on its node:
+// other processes' requests never see its checkpoints.
+// We answer a new checkpoint only once we've pulled all of it,
+// and the saver keeps resending its request until then;
+// one that replaces another under the same key frees the old one.
+void
+net_rxckpt(net_ckptmsg *m)
+{
+  uint8_t node = m->eth.src[5];
+  net_ckptmsg rp;
+  net_ethsetup(&rp.eth, node);
+  rp.type = NET_CKPTRP;
+  rp.home = m->home;
+  rp.seq = m->seq;
+  rp.key = m->key;
+  rp.rr = 0;
+
+  spinlock_acquire(&net_lock);
+  net_ckptslot *ck = NULL, *slot = NULL;
+  int i;
+  for (i = 0; i < NET_CKPTSLOTS; i++) {
+    net_ckptslot *c = &net_ckpts[i];
+    if (c->node == node && c->home == m->home && c->key == m->key)
+      ck = c;
+    else if (c->node == 0 && slot == NULL)
+      slot = c;
+  }
+  bool same = ck != NULL && ck->seq == m->seq;
+  if (m->type == NET_CKPTRQ) {
+    if (ck != NULL && ck->done)
+      rp.rr = net_ckpttop(ck);
+  } else if (same && !ck->done) {
+    net_statinc(dups);
+    return spinlock_release(&net_lock);   // Still pulling it
+  } else if (same)
+    rp.rr = net_ckpttop(ck);    // Our answer must have been lost
+  else if (RRNODE(m->rr) == node && RRADDR(m->rr) != 0
+           && (ck == NULL ? slot != NULL : ck->done)
+           && mem_nfree() >= NET_SWAPHIGH) {
+    // Take it, in place of any done one under the same key.
+    if (ck != NULL)
+      net_ckptdrop(ck);
+    else
+      ck = slot;
+    proc *top = proc_alloc(NULL, 0);
+    if (top != NULL) {
+      top->ckpt = ck;
+      if (net_ckptstart(top, m->rr)) {
+        ck->node = node;
+        ck->key = m->key;
+        ck->home = m->home;
+        ck->seq = m->seq;
+        ck->rr = m->rr;
+        ck->top = top;
+        ck->pending = 1;
+        ck->failed = 0;
+        ck->done = 0;
+        return spinlock_release(&net_lock);   // Answer once it's here
+      }
+      proc_free(top);
+    }
+  }
+  spinlock_release(&net_lock);
+  net_tx(&rp, sizeof(rp), 0, 0);
+}
+
+// The answer to a checkpoint request has arrived:
+// wake the requester to finish its system call.
+void
+net_rxckptrp(net_ckptmsg *m)
+{
+  uint8_t srcnode = m->eth.src[5];
+  proc *p = RRNODE(m->home) == net_node ? proc_rrptr(m->home)
+                                        : mem_rrlookupobj(m->home);
+  if (p == NULL)
+    return;
+
+  spinlock_acquire(&net_lock);
+  if (p->ckptnode != srcnode || !p->ckptwait || p->rpcseq != m->seq
+      || p->ckptkey != m->key || (m->rr != 0 && RRNODE(m->rr) != srcnode)) {
+    net_statinc(dups);
+    return spinlock_release(&net_lock);   // Stale or duplicate
+  }
+  p->ckptrr = m->rr;
+  p->ckptwait = 0;
+  net_timerclear(&p->rpctimer);
+  if (p->state == PROC_RPC)
+    proc_ready(p);
+  spinlock_release(&net_lock);
+}
+
+// Start restoring fresh process p from the checkpoint record named by rr,
+// leaving its pages remote until its parent needs them (see net_fetch()).
+// p stops, and wakes its parent, once its page tables are all here.
+// Returns false if we're out of memory.
+bool
+net_ckptrestore(proc *p, uint32_t rr)
+{
+  spinlock_acquire(&net_lock);
+  p->pulltabs = 1;
+  bool ok = net_ckptstart(p, rr);
+  spinlock_release(&net_lock);
+  return ok;
+}
+
+// Start process c, fresh from proc_alloc(), pulling the checkpoint record
+// named by rr, which net_ckptrecord() takes it from once it arrives.
+// Returns false if we're out of memory.
+static bool
+net_ckptstart(proc *c, uint32_t rr)
+{
+  assert(spinlock_holding(&net_lock));
+  pageinfo *pi = mem_alloc();
+  if (pi == NULL)
+    return 0;
+  mem_incref(pi);
+  c->ckptpg = mem_pi2ptr(pi);
+  c->ckptrec = rr;
+  c->pullstop = 1;
+  c->pullva = VM_USERHI;  // nothing to walk until the record is in
+  c->pullwait = 0;
+  net_pullstart(c, rr, c->ckptpg, NULL, PGLEV_PAGE);
+  net_txpullrq(c, 0);
+  return 1;
+}
+
+// Process q's checkpoint record has arrived: take q's state from it,
+// start a child pulling its own record for each one the record names,
+// and start q pulling its page directory, as for a migrating proc.
+// A holder keeps the record, rewritten to name its own copies
+// of the pdir and the children's records for restorers to pull;
+// a restored proc has no more use for it.
+// Returns false if the record is bad or we run out of memory,
+// in which case q stops with what it has.
+static bool
+net_ckptrecord(proc *q)
+{
+  assert(spinlock_holding(&net_lock));
+  net_ckptrec *rec = q->ckptpg;
+  net_ckptslot *ck = q->ckpt;
+  uint8_t node = RRNODE(q->ckptrec);
+  q->ckptrec = 0;
+  int cn;
+  if (RRNODE(rec->pdir) != node || RRADDR(rec->pdir) == 0)
+    goto bad;
+  for (cn = 0; cn < PROC_CHILDREN; cn++)
+    if (rec->child[cn] != 0 && (RRNODE(rec->child[cn]) != node
+                                || RRADDR(rec->child[cn]) == 0))
+      goto bad;
+
+  if (ck != NULL)
+    q->sv = rec->sv;    // Holders never run: just keep it
+  else
+    syscall_putregs(q, &rec->sv, (rec->sv.pff & PFF_USEFPU)
+                    ? SYS_REGS | SYS_FPU : SYS_REGS, q->parent);
+  memmove(q->mergeops, rec->mergeops, sizeof(q->mergeops));
+
+  for (cn = 0; cn < PROC_CHILDREN; cn++) {
+    if (rec->child[cn] == 0)
+      continue;
+    proc *c = proc_alloc(NULL, 0);
+    if (c == NULL)
+      goto bad;
+    c->ckpt = ck;
+    c->pulltabs = q->pulltabs;
+    if (!net_ckptstart(c, rec->child[cn])) {
+      proc_free(c);
+      goto bad;
+    }
+    c->parent = q;    // only now that it isn't stopped
+    q->child[cn] = c;
+    if (ck != NULL) {
+      ck->pending++;
+      rec->child[cn] = RRCONS(net_node, mem_phys(c->ckptpg), 0);
+    }
+  }
+
+  uint32_t rr = rec->pdir;
+  if (ck != NULL)
+    rec->pdir = RRCONS(net_node, mem_phys(q->pdir), SYS_RW);
+  else {
+    mem_decref(mem_ptr2pi(rec), mem_free);
+    q->ckptpg = NULL;
+  }
+  q->pullva = VM_USERLO;
+  net_pullstart(q, rr, q->pdir, NULL, PGLEV_PDIR);
+  net_txpullrq(q, 0);
+  return 1;
+
+bad:
+  warn("net_ckptrecord: can't restore checkpoint record from node %d", node);
+  if (ck != NULL)
+    ck->failed = 1;
+  else {
+    mem_decref(mem_ptr2pi(rec), mem_free);
+    q->ckptpg = NULL;
+    q->ckptbad = 1;   // for do_restore() to find
+  }
+  return 0;
+}
+
+// Take over the page or page table a holder's PDE or PTE maps,
+// so that we serve pulls of it under our own RR instead of as a copy.
+static void
+net_ckptown(pte_t pte)
+{
+  if ((pte & PTE_REMOTE) || PGADDR(pte) == PTE_ZERO || PGADDR(pte) == 0)
+    return;
+  pageinfo *pi = mem_phys2pi(PGADDR(pte));
+  if (pi->home != 0) {
+    mem_rruntrack(pi);
+    pi->home = 0;
+  }
+}
+
+// Holder proc p has pulled all it needs of its part of a checkpoint,
+// or given up.  Once every holder has, take over all the pages they map
+// if they all made it, so restorers can pull them from us, or else
+// drop the lot; then tell the saver.
+static void
+net_ckptpulled(proc *p)
+{
+  net_ckptslot *ck = p->ckpt;
+  assert(spinlock_holding(&net_lock) && ck->pending > 0);
+  if (--ck->pending > 0)
+    return;
+
+  net_ckptmsg rp;
+  net_ethsetup(&rp.eth, ck->node);
+  rp.type = NET_CKPTRP;
+  rp.home = ck->home;
+  rp.seq = ck->seq;
+  rp.key = ck->key;
+  rp.rr = 0;
+  if (ck->failed)
+    net_ckptdrop(ck);
+  else {
+    proc *q;
+    for (q = ck->top; q != NULL; q = proc_walknext(ck->top, q)) {
+      uint32_t va;
+      for (va = VM_USERLO; va < VM_USERHI; va += PTSIZE) {
+        pde_t pde = q->pdir[PDX(va)];
+        net_ckptown(pde);
+        if ((pde & PTE_REMOTE) || PGADDR(pde) == PTE_ZERO
+            || PGADDR(pde) == 0)
+          continue;
+        pte_t *ptab = mem_ptr(PGADDR(pde));
+        int i;
+        for (i = 0; i < NPTENTRIES; i++)
+          net_ckptown(ptab[i]);
+      }
+    }
+    ck->done = 1;
+    rp.rr = net_ckpttop(ck);
+  }
+  net_tx(&rp, sizeof(rp), 0, 0);
+}
+
+// Continue walking p's address space to see what else it needs to pull
+// before it can run, starting more pulls until its window is full.
+// Remove/disable this code if the VM system supports pull-on-demand.
+// Returns true once everything has arrived and p is ready to run.
+static bool
+net_pullwalk(proc *p)
+{
+  assert(spinlock_holding(&net_lock));
+
+  while (p->pullva < VM_USERHI && !p->pullwait && p->npull < PROC_NPULL) {
 
     // Pull or traverse PDE to find page table.
     uint32_t *pde = &p->pdir[PDX(p->pullva)];
     if (*pde & PTE_REMOTE) {  // Need to pull remote ptab?
       // cprintf("rxpullrp: pulling remote page %p (addr %p)\n", pde, p->pullva);
       if (!net_pullpte(p, pde, PGLEV_PTAB))
-        return; // Wait for the pull to complete.
+        break;  // Wait for the page table to arrive.
     }
     assert(!(*pde & PTE_REMOTE));
-    if (PGADDR(*pde) == PTE_ZERO) {   // Skip empty PDEs
+    // Skip empty PDEs, and superpages, which are all here,
+    // and the pages of a restored proc, which stay remote for now
+    if (PGADDR(*pde) == PTE_ZERO || (*pde & PTE_PS) || p->pulltabs) {
       p->pullva = PTADDR(p->pullva + PTSIZE);
       continue;
     }
     assert(PGADDR(*pde) != 0);
     uint32_t *ptab = mem_ptr(PGADDR(*pde));
 
-    // Pull or traverse PTE to find page.
+    // Pull or traverse PTE to find page,
+    // moving on without waiting for it to arrive.
     uint32_t *pte = &ptab[PTX(p->pullva)];
-    if (*pte & PTE_REMOTE) {  // Need to pull remote page?
-      if (!net_pullpte(p, pte, PGLEV_PAGE))
-        return; // Wait for the pull to complete.
-    }
+    if (*pte & PTE_REMOTE)    // Need to pull remote page?
+      net_pullpte(p, pte, PGLEV_PAGE);
     assert(!(*pte & PTE_REMOTE));
     assert(PGADDR(*pte) != 0);
-    p->pullva += PAGESIZE;  // Page is local - move to next.
+    p->pullva += PAGESIZE;  // Page is local or on its way - move to next.
   }
 
-  // We've pulled the proc's entire address space: it's ready to go!
-  //cprintf("net_rxpullrp: migration complete\n");
-  proc_ready(p);
+  if (p->npull > 0) {
+    net_txpullrq(p, 0);   // Send requests for the pulls we just started
+    return 0;
+  }
+  return p->pullva >= VM_USERHI;
 }
 
 // See if we need to pull a page to fill a given PDE or PTE.
-// Returns false if we started a pull and need to wait until it's finished,
+// Returns false if we started a pull that will finish later,
 // or true if we were able to resolve the RR immediately.
+// The caller must hold net_lock and transmit the pull via net_txpullrq().
 
 bool
 net_pullpte(proc *p, uint32_t *pte, int pglevel)
@@ -667,6 +2939,10 @@ net_pullpte(proc *p, uint32_t *pte, int pglevel)
       *pte |= PTE_P | PTE_U;
   mem_rrtrack(rr, pi);
   pi->shared = (RRNODE(rr)%2)+1;
-  net_pull(p, rr, mem_pi2ptr(pi), pglevel);
+  pi->pulling = 1;    // not for peers to serve until it's here
+  if(pglevel == PGLEV_PAGE)
+    p->acct.pulls++;
+  net_pullstart(p, rr, mem_pi2ptr(pi), pglevel == PGLEV_PAGE ? pte : NULL,
+                pglevel);
   return 0;
 }
@@ -14,8 +14,11 @@
 #endif
 
 #include <inc/cdefs.h>
+#include <inc/x86.h>
 #include <inc/trap.h>
 #include <inc/syscall.h>
+#include <inc/file.h>
+#include <kern/pmap.h>
 
 
 // Ethernet header
@@ -31,6 +34,20 @@ typedef struct net_ethhdr {
 
 #define NET_MAXNODES	32		// Max number of nodes in system
 
+// Whether net_rx() hands received packets to per-CPU queues,
+// chosen by source node or requested page, to be processed outside
+// the card's interrupt (1, the default), or processes them all inline (0).
+// Override with, e.g., DEFS += -DNET_RXSTEER=0 in conf/env.mk.
+#ifndef NET_RXSTEER
+#define NET_RXSTEER	1
+#endif
+
+// To test and benchmark retransmission, drop one in every NET_LOSS
+// valid packets we receive, as a lossy network would (0 drops none).
+#ifndef NET_LOSS
+#define NET_LOSS	0
+#endif
+
 
 // Message types
 typedef enum net_msgtype {
@@ -39,6 +56,17 @@ typedef enum net_msgtype {
 	NET_MIGRP,		// Migrate reply
 	NET_PULLRQ,		// Page pull request
 	NET_PULLRP,		// Page pull reply
+	NET_PUSH,		// Unrequested page pushed with a migration
+	NET_PULLREDIR,		// Pull elsewhere: a peer has the page
+	NET_RPCRQ,		// Remote GET/PUT request
+	NET_RPCRP,		// Remote GET/PUT reply
+	NET_LOAD,		// Load report
+	NET_SWAP,		// Page pushed out to a node with memory to spare
+	NET_SWAPRP,		// Swapped-out page accepted
+	NET_SWAPFREE,		// Swapped-out page pulled back: let it go
+	NET_CKPT,		// Checkpoint to take and keep
+	NET_CKPTRQ,		// Checkpoint to restore from
+	NET_CKPTRP,		// Checkpoint kept, or found
 } net_msgtype;
 
 // Minimal packet header for all our network messages
@@ -52,7 +80,10 @@ typedef struct net_migrq {
 	net_msgtype	type;	// = NET_MIGRQ
 	uint32_t	home;	// Remote ref for proc's home node & physaddr
 	uint32_t	pdir;	// Remote ref for proc's page directory
+	uint32_t	rpcseq;	// Last remote GET/PUT sequence number used
 	procstate	save;	// Process's saved user-visible state
+	pmap_mergeop	mergeops[MERGEOP_NRANGES]; // Its merge operators
+	procacct	acct;	// Its resource usage so far
 } net_migrq;
 
 typedef struct net_migrp {
@@ -61,28 +92,200 @@ typedef struct net_migrp {
 	uint32_t	home;	// Remote ref for proc being acknowledged
 } net_migrp;
 
-// Pull a page from a remote node
+// Do a GET or PUT on children at a remote node for a caller elsewhere,
+// when it needs none of the caller's memory, instead of migrating there.
+// The remote node keeps a local proxy for the caller, found like
+// a migrating proc, whose children the operation applies to.
+// Requests are numbered so the remote node can spot duplicates;
+// the caller resends by re-executing its system call.
+// If a child is still running the remote node doesn't reply until it stops,
+// then sends NET_RPCAGAIN to have the caller ask again.
+typedef struct net_rpcrq {
+	net_ethhdr	eth;
+	net_msgtype	type;	// = NET_RPCRQ
+	uint32_t	home;	// Home RR of the calling proc
+	uint32_t	seq;	// Caller's request sequence number
+	uint32_t	cmd;	// GET or PUT command and flags
+	uint32_t	child;	// Child number and range, node bits ignored
+	uint32_t	dst;	// Child memory region start for SYS_PERM
+	uint32_t	size;	// Child memory region size for SYS_PERM
+	procstate	save;	// New child state for PUT with SYS_REGS
+} net_rpcrq;
+
+#define NET_RPCWAIT	0	// No reply yet
+#define NET_RPCDONE	1	// Operation done, or trapped
+#define NET_RPCRUNNING	2	// GET with SYS_POLL found a child running
+#define NET_RPCAGAIN	3	// The child we waited for stopped: ask again
+typedef struct net_rpcrp {
+	net_ethhdr	eth;
+	net_msgtype	type;	// = NET_RPCRP
+	uint32_t	home;	// Home RR of the calling proc
+	uint32_t	seq;	// Sequence number of request
+	uint8_t		stat;	// NET_RPCDONE, RUNNING, or AGAIN
+	uint8_t		regs;	// Payload is 'save' for GET with SYS_REGS
+	int		trapno;	// Trap to reflect to the caller, or -1
+	procstate	save;	// Child state, only sent if 'regs'
+} net_rpcrp;
+
+// Each node reports its load to every other node in turn, one per tick.
+// Once a process with PFF_BALANCE set has run NET_BALANCEMIN ticks
+// without blocking, and others here are waiting for a CPU,
+// we move it to a node with an idle CPU or fewer processes waiting.
+#define NET_LOADSTALE	(NET_MAXNODES*4) // Ticks before a report is too old
+#define NET_BALANCEMIN	32		// Ticks CPU-bound before we move a proc
+typedef struct net_load {
+	net_ethhdr	eth;
+	net_msgtype	type;	// = NET_LOAD
+	uint16_t	nwait;	// Ready processes waiting for a CPU
+	uint16_t	nidle;	// CPUs with nothing to run
+	uint16_t	maxpkt;	// Largest frame our card takes
+	uint32_t	nfree;	// Free pages, for nodes paging out to us
+} net_load;
+
+// Pull one or more pages from a remote node.
+// The home node streams back the needed parts of every page named.
+// Once NET_PULLPEERS other nodes have copies of a plain page, though,
+// the home node instead redirects pulls of it to those peers,
+// so that a job fanning out to many nodes doesn't all pull from home.
+// A peer that no longer has its copy redirects the puller back home,
+// which then serves a request marked 'direct' itself.
+#define NET_PULLMAX	8		// Max RRs named in one pull request
+#define NET_PULLPEERS	2		// Copies elsewhere before we redirect
 typedef struct net_pullrq {
 	net_ethhdr	eth;
 	net_msgtype	type;	// = NET_PULLRQ
-	uint32_t	rr;	// Remote ref to pdir, ptab, or page
 	uint8_t		pglev;	// 0=page, 1=page table, 2=page directory
-	uint8_t		need;	// Bits 2-0: which parts of page are needed
+	uint8_t		n;	// Number of RRs requested, all at level pglev
+	uint8_t		direct;	// Home node must not redirect these
+	uint16_t	maxpkt;	// Largest frame the requester's card takes
+	uint8_t		need[NET_PULLMAX]; // Bits 2-0: parts of each needed
+	uint32_t	rr[NET_PULLMAX]; // Remote refs to pdirs, ptabs, or pages
 } net_pullrq;
 
-// Page pull reply - 3 required per page, to fit in Ethernet packet size.
+// Redirect a page pull to another node.
+typedef struct net_pullredir {
+	net_ethhdr	eth;
+	net_msgtype	type;	// = NET_PULLREDIR
+	uint32_t	rr;	// Remote ref being pulled
+	uint8_t		node;	// Peer to ask instead, or 0 to ask home directly
+} net_pullredir;
+
+// Page pull reply.  A page that's all zero takes one empty NET_PULLZERO reply,
+// and one that's mostly zero a NET_PULLRLE reply if the encoding fits.
+// Otherwise it takes 3 NET_PULLRAW replies, to fit in Ethernet packet size,
+// unless both nodes' cards take jumbo frames (see NET_PULLPAGES below).
 #define NET_PULLPART	1368		// 1368*3 >= 4096
 #define NET_PULLPART0	NET_PULLPART
 #define NET_PULLPART1	NET_PULLPART
 #define NET_PULLPART2	(PAGESIZE-NET_PULLPART0-NET_PULLPART1)
+#define NET_PULLRAW	0		// One part of the raw page
+#define NET_PULLZERO	1		// Whole page is zero: no payload
+#define NET_PULLRLE	2		// Whole page, run-length encoded
+#define NET_PULLPAGES	3		// Several whole raw pages
 typedef struct net_pullrphdr {
 	net_ethhdr	eth;
-	net_msgtype	type;	// = NET_PULLRP
+	net_msgtype	type;	// = NET_PULLRP or NET_PUSH
 	uint32_t	rr;	// Remote reference
+	uint32_t	home;	// NET_PUSH: home RR of proc being migrated
 	int		part;	// Which part of the page this is: 0, 1, or 2
+	int		enc;	// Page encoding: NET_PULLRAW, ZERO, or RLE
 	char		data[0]; // Variable-length payload follows pullrphdr
 } net_pullrphdr;
 
+// Between two nodes whose cards both take frames of NET_JUMBOPKT bytes,
+// which each node tells the others in its pull requests and load reports,
+// raw plain pages go up to NET_JUMBOPAGES to a frame instead,
+// in a NET_PULLPAGES reply whose 'part' is the number of pages.
+// The first page's RR is in 'rr', and a net_pulljumbo with the others' RRs
+// comes next, followed by the pages themselves.
+#define NET_JUMBOPAGES	2		// Max pages per jumbo reply
+typedef struct net_pulljumbo {
+	uint32_t	rr[NET_JUMBOPAGES-1]; // RRs of pages after the first
+} net_pulljumbo;
+#define NET_JUMBOPKT	(sizeof(net_pullrphdr) + sizeof(net_pulljumbo) \
+			 + NET_JUMBOPAGES*PAGESIZE)
+
+// When a process migrates, its source node pushes up to NET_PUSHMAX
+// pages and page tables the process recently touched right behind
+// the migrate request, in NET_PUSH messages formatted like pull replies.
+// The destination holds up to NET_PUSHSLOTS of them until needed.
+#define NET_PUSHMAX	16		// Max pages pushed per migration
+#define NET_PUSHSLOTS	64		// Pushed pages a node holds at once
+
+// When a node runs short of page frames, idle CPUs page cold memory
+// of stopped processes out to the node reporting the most free pages
+// (see net_swapout()), up to NET_SWAPBATCH pages of a process at a time.
+// Each page goes in 3 NET_SWAP messages formatted like raw pull replies,
+// whose 'rr' is the sender's own RR for the page, naming it until
+// the receiver answers with a NET_SWAPRP carrying an RR of its own copy.
+// The sender then maps that RR in place of the page and lets the page go;
+// the process pulls it back like any RR before its parent next works on it
+// (see net_fetch()), or on demand if it faults on it (see net_pullfault()),
+// and then tells the receiver to let its copy go with a NET_SWAPFREE.
+// If that gets lost, the receiver just holds on to the page.
+// A node below NET_SWAPLOW free pages pages out, and takes pages
+// from others only if it has NET_SWAPHIGH free, holding up to
+// NET_SWAPSLOTS partly arrived ones at a time.
+#define NET_SWAPBATCH	8		// Max pages of a process in flight
+#define NET_SWAPSLOTS	32		// Incoming pages a node assembles at once
+#define NET_SWAPLOW	(mem_npage/32)	// Page out below this many free
+#define NET_SWAPHIGH	(mem_npage/8)	// Take pages in above this many
+typedef struct net_swaprp {
+	net_ethhdr	eth;
+	net_msgtype	type;	// = NET_SWAPRP
+	uint32_t	rr;	// Sender's RR for the page, from the NET_SWAP
+	uint32_t	home;	// Home RR of the proc it came from
+	uint32_t	newrr;	// RR of our copy, which we now keep
+} net_swaprp;
+typedef struct net_swapfree {
+	net_ethhdr	eth;
+	net_msgtype	type;	// = NET_SWAPFREE
+	uint32_t	rr;	// Receiver's RR for the page, from the NET_SWAPRP
+} net_swapfree;
+
+// A process checkpoints a stopped subtree of its children (see SYS_CKPT)
+// by making a net_ckptrec record page for each process in it,
+// with a copy-on-write copy of the process's page directory,
+// and sending a NET_CKPT naming the top record to the node to keep it.
+// That node pulls the records, their page directories and everything
+// they map, just as it would pull a migrating process, into a tree of
+// stopped holder procs of its own that never run; then it answers
+// with a NET_CKPTRP and the caller lets its records go.
+// The holder node keeps every page from then on, under RRs of its own.
+// To restore, a process sends a NET_CKPTRQ with the key,
+// answered with the RR of the holder's top record, and pulls the tree
+// back the same way, except that the pages each process maps
+// stay remote until its parent next needs them (see net_fetch()).
+// Each message goes again until answered, like a remote GET/PUT;
+// an 'rr' of 0 in the reply means the holder has no room to take it,
+// or has no checkpoint under the key.
+#define NET_CKPTSLOTS	8		// Checkpoints a node keeps at once
+typedef struct net_ckptmsg {
+	net_ethhdr	eth;
+	net_msgtype	type;	// = NET_CKPT, NET_CKPTRQ or NET_CKPTRP
+	uint32_t	home;	// Home RR of the saving or restoring proc
+	uint32_t	seq;	// Requester's sequence number, as for RPCs
+	uint32_t	key;	// Key naming the checkpoint
+	uint32_t	rr;	// RR of the top record, or 0
+} net_ckptmsg;
+
+typedef struct net_ckptrec {
+	procstate	sv;		// Process's saved user-visible state
+	uint32_t	pdir;		// RR of its page directory
+	pmap_mergeop	mergeops[MERGEOP_NRANGES]; // Its merge operators
+	uint32_t	child[PROC_CHILDREN]; // RRs of children's records, or 0
+	struct net_ckptrec *next;	// Saver's own list of records
+} net_ckptrec;
+
+// A NET_PULLRLE payload is a sequence of runs, each a net_pullrun header
+// followed by 'nwords' literal 32-bit words, covering the whole page.
+// Runs take at most NET_PULLPART bytes in all.
+typedef struct net_pullrun {
+	uint16_t	nfill;	// Number of words equal to 'fill' first
+	uint16_t	nwords;	// Number of literal words that follow
+	uint32_t	fill;	// Repeated word value, usually zero
+} net_pullrun;
+
 
 // 32-bit remote reference layout.
 // Note that bit 0, corresponding to PTE_P, must always be zero,
@@ -92,6 +295,7 @@ typedef struct net_pullrphdr {
 #define RR_RW		0x00000600	// Nominal perms for mapping (=SYS_RW)
 #define RR_HOME		0x000001fe	// 8-bit home node
 #define RR_HOMESHIFT		1	// Home node field starts at bit 1
+#define RR_SLOTSHIFT		9	// Proc RRs keep slab slot in RR_RW bits
 
 // Macros to construct and extract fields from remote refs
 #define RRCONS(node,addr,perm)	(RR_REMOTE | ((addr) & RR_ADDR) \
@@ -106,15 +310,77 @@ typedef struct net_pullrphdr {
 #define PGLEV_PDIR		2	// Page directory
 
 
+// Retransmission timer for an outstanding request, kept on a timer wheel.
+// The wheel has a slot for each of the next NET_WHEELSIZE timer ticks,
+// so timeouts are capped at NET_RTOMAX < NET_WHEELSIZE ticks.
+#define NET_WHEELSIZE	256		// Timer wheel slots, a power of two
+#define NET_RTOINIT	16		// Retransmit timeout before any RTT sample
+#define NET_RTOMIN	2		// Min retransmit timeout in timer ticks
+#define NET_RTOMAX	(NET_WHEELSIZE-1) // Max timeout, after backoff
+typedef struct net_timer {
+	struct net_timer *next;		// Next timer in the same wheel slot
+	struct net_timer **prev;	// Pointer to us in slot, NULL if unarmed
+	uint32_t	expire;		// net_ticks value at which we fire
+	uint8_t		backoff;	// Timeouts since last progress
+	struct proc	*proc;		// Process whose request this is
+} net_timer;
+
+// Network card driver entry points, which the driver for the card we use
+// hands to net_attach() once it has set the card up
+// (see dev/e100.c and dev/virtio.c).
+struct pageinfo;
+typedef struct net_dev {
+	const char	*name;
+	uint8_t		irq;		// IRQ line the card interrupts on
+	// Transmit a packet of header plus body, as for net_txref()
+	int		(*txref)(void *hdr, int hlen, void *body, int blen,
+				struct pageinfo *pi);
+	// Or transmit a header followed by npg whole pages, or NULL if
+	// the card doesn't take frames that big; as for net_txpages()
+	int		(*txpages)(void *hdr, int hlen, void **pgs, int npg);
+	int		maxpkt;		// Largest frame it sends and receives
+	void		(*intr)(void);	// Handle an interrupt from the card
+	void		(*poll)(void);	// Called on every timer tick
+} net_dev;
+
+// A received packet waiting in a CPU's receive queue,
+// copied into a page of its own so the card can reuse its buffer.
+typedef struct net_rxpkt {
+	struct pageinfo	*pi;		// Page holding the packet
+	int		len;		// Length of the packet
+} net_rxpkt;
+#define NET_RXQLEN	256		// Packets each CPU's queue holds
+
+extern net_dev *net_netdev;	// Card we're using, NULL if none
 extern uint8_t net_node;	// My node number - from net_mac[5]
 extern uint8_t net_mac[6];	// My MAC address from the Ethernet card
 
+extern netstats net_stats;	// Statistics counters for SYS_NETSTAT
+
+// Bump one of the net_stats counters, from any CPU.
+#define net_statinc(field)	lockadd((volatile int32_t*)&net_stats.field, 1)
+
 
 struct trapframe;
 
 void net_init(void);
+void net_attach(net_dev *dev, const uint8_t *mac);
 void net_rx(void *ethpkt, int len);
+bool net_rxdrain(void);
 void net_tick(void);
 void gcc_noreturn net_migrate(struct trapframe *tf, uint8_t node, int entry);
+bool net_rpc(struct trapframe *tf, const sysvec *v, uint8_t node, int *trapno);
+void net_rpcwake(struct proc *proxy);
+void net_balance(struct trapframe *tf);
+bool net_swapneeded(void);
+bool net_swapout(struct proc *p, uint32_t va, bool *progress);
+bool net_swapcancel(struct proc *p);
+bool net_fetch(struct proc *p);
+int net_pullfault(struct proc *p, uint32_t *pte, int pglevel);
+int net_ckptsave(struct proc *p, net_ckptrec **recs);
+void net_ckptfree(net_ckptrec *recs);
+uint32_t net_ckpt(struct trapframe *tf, uint8_t node, int type, uint32_t key,
+			uint32_t rr);
+bool net_ckptrestore(struct proc *p, uint32_t rr);
 
 #endif // !PIOS_KERN_NET_H
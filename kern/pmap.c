@@ -21,6 +21,11 @@
 #include <kern/trap.h>
 #include <kern/proc.h>
 #include <kern/pmap.h>
+#include <kern/net.h>
+#include <kern/init.h>
+#include <kern/trace.h>
+
+#include <dev/lapic.h>
 
 
 // Statically allocated page directory mapping the kernel's address space.
@@ -30,6 +35,57 @@ pde_t pmap_bootpdir[1024] gcc_aligned(PAGESIZE);
 // Statically allocated page that we always keep set to all zeros.
 uint8_t pmap_zero[PAGESIZE] gcc_aligned(PAGESIZE);
 
+// A read-only page table full of untouched SYS_READ zero mappings,
+// which pmap_setperm() shares among all the 4MB regions it makes readable
+// before anything else is put there (see pmap_zeroptabinit()).
+// We hold one reference on it forever, so it is never freed,
+// and pmap_walk() unshares it like any other shared page table.
+static pte_t *pmap_zeroptab;
+#define PMAP_ZEROPTE	(PTE_ZERO | SYS_READ | PTE_U | PTE_P)
+
+// Serializes changes to the reference counting mode of superpages.
+static spinlock pmap_superlock;
+
+// Page directories whose contents pmap_reap() has yet to free,
+// chained through their pageinfo's free_next field.
+static pageinfo *pmap_deadlist;
+static spinlock pmap_deadlock;
+
+#define PMAP_REAPBATCH	16	// Page tables freed per pmap_reap() call
+
+// A big pmap_merge() in progress, whose 4MB units of work
+// idle CPUs may help with (see pmap_mergehelp()).
+typedef struct pmap_mergejob {
+	struct pmap_mergejob *next;	// Next job with units left to claim
+	pde_t		*rpdir, *spdir, *dpdir;
+	uint32_t	sva, dva;
+	const pmap_mergeop *ops;
+	procacct	*acct;		// Where to count pages merged, or NULL
+	int		nunits;		// Units of work: page tables to merge
+	int		claimed;	// Units handed out so far
+	volatile int32_t ndone;		// Units finished
+	volatile int	ok;		// Cleared if any unit failed
+} pmap_mergejob;
+
+// Pages pmap_samescan() has seen, by content hash,
+// each slot holding a reference to its page.
+#define PMAP_SAMESLOTS	1024
+typedef struct pmap_sameslot {
+	uint32_t	hash;		// Hash of the page's contents
+	pageinfo	*pi;		// The page, or NULL if slot unused
+} pmap_sameslot;
+static pmap_sameslot pmap_same[PMAP_SAMESLOTS];
+static spinlock pmap_samelock;
+
+// Jobs with unclaimed units, and the lock protecting the list
+// and every job's 'claimed' count.
+static pmap_mergejob *pmap_mergejobs;
+static spinlock pmap_mergelock;
+
+// Set once pmap_share() has shared any page, so that pmap_unshare()
+// needn't look for shared pages while nobody uses SYS_SHARE.
+static bool pmap_shmused;
+
 // --------------------------------------------------------------
 // Set up initial memory mappings and turn on MMU.
 // --------------------------------------------------------------
@@ -58,6 +114,18 @@ pmap_init(void)
 		// we can also mark them global (PTE_G) so the processor
 		// doesn't flush these mappings when we reload the PDBR.
     cprintf("Initializing bootstrap table.\n");
+    spinlock_init(&pmap_superlock);
+    spinlock_init(&pmap_deadlock);
+    spinlock_init(&pmap_mergelock);
+    spinlock_init(&pmap_samelock);
+
+    pageinfo *zpi = mem_alloc();
+    assert(zpi != NULL);
+    mem_incref(zpi);
+    pmap_zeroptab = mem_pi2ptr(zpi);
+    int i;
+    for (i = 0; i < NPTENTRIES; i++)
+      pmap_zeroptab[i] = PMAP_ZEROPTE;
     
     int page_index;
     for(page_index = 0; page_index < 1024; page_index++) {
@@ -67,6 +135,8 @@ pmap_init(void)
         pmap_bootpdir[page_index] = (page_index << PDXSHIFT) | PTE_P | PTE_W | PTE_G | PTE_PS;
       }
     }  
+    // No memory there: proc_run() maps the kernel data page instead.
+    pmap_bootpdir[PDX(VM_KDATA)] = 0;
 	}
 	// On x86, segmentation maps a VA to a LA (linear addr) and
 	// paging maps the LA to a PA.  i.e., VA => LA => PA.  If paging is
@@ -77,9 +147,10 @@ pmap_init(void)
 	// In PIOS this is always the case for the kernel's address space,
 	// so we don't have to play any special tricks as in other kernels.
 
-	// Enable 4MB pages and global pages.
+	// Enable 4MB pages and global pages,
+	// and let user code use SSE (see proc_fpuload() in kern/proc.c).
 	uint32_t cr4 = rcr4();
-	cr4 |= CR4_PSE | CR4_PGE;
+	cr4 |= CR4_PSE | CR4_PGE | CR4_OSFXSR | CR4_OSXMMEXCPT;
 	lcr4(cr4);
 
 	// Install the bootstrap page directory into the PDBR.
@@ -92,7 +163,7 @@ pmap_init(void)
 	lcr0(cr0);
 	// If we survived the lcr0, we're running with paging enabled.
 	// Now check the page table management functions below.
-	if (cpu_onboot())
+	if (cpu_onboot() && INIT_CHECKS)
 		pmap_check();
 }
 //
@@ -130,12 +201,310 @@ pmap_freeptab(pageinfo *ptabpi)
 	pte_t *pte = mem_pi2ptr(ptabpi), *ptelim = pte + NPTENTRIES;
 	for (; pte < ptelim; pte++) {
 		uint32_t pgaddr = PGADDR(*pte);
-		if (pgaddr != PTE_ZERO)
+		if (pgaddr != PTE_ZERO && !(*pte & PTE_REMOTE))
 			mem_decref(mem_phys2pi(pgaddr), mem_free);
 	}
 	mem_free(ptabpi);
 }
 
+// Fill a page table with PTE_ZERO, as a new one must start out.
+static void
+pmap_ptabclear(pte_t *ptab)
+{
+	pte_t *ptelim = ptab + NPTENTRIES;
+	for (; ptab < ptelim; ptab += 4)
+		ptab[0] = ptab[1] = ptab[2] = ptab[3] = PTE_ZERO;
+}
+
+// Allocate a new, empty page table with a reference count of 1,
+// from this CPU's pool of pre-cleared ones if it has any.
+// Returns NULL if we're out of memory.
+static pageinfo *
+pmap_newptab(void)
+{
+	cpu *c = cpu_cur();
+	pageinfo *pi = c->ptabpool;
+	if (pi != NULL) {
+		c->ptabpool = pi->free_next;
+		c->nptabpool--;
+	} else {
+		pi = mem_alloc();
+		if (pi == NULL)
+			return NULL;
+		pmap_ptabclear(mem_pi2ptr(pi));
+	}
+	mem_incref(pi);
+	return pi;
+}
+
+// Called from the scheduler's idle loop:
+// clear one page table into this CPU's pool for pmap_newptab(),
+// unless the pool is full or memory is tight.
+// Returns true if it did some work.
+bool
+pmap_ptabidle(void)
+{
+	cpu *c = cpu_cur();
+	if (c->nptabpool >= PMAP_PTABPOOL || mem_nfree() < MEM_ZEROMAX)
+		return 0;
+
+	pageinfo *pi = mem_alloc();
+	if (pi == NULL)
+		return 0;
+	pmap_ptabclear(mem_pi2ptr(pi));
+	pi->free_next = c->ptabpool;
+	c->ptabpool = pi;
+	c->nptabpool++;
+	return 1;
+}
+
+// A user superpage maps a naturally aligned 4MB block of physical memory,
+// obtained from mem_alloc_order(MEM_MAXORDER), with a single PTE_PS PDE.
+// While the 'super' flag is set on the block's first pageinfo,
+// that page's refcount counts the superpage mappings of the whole block.
+// Once any part of the block must be shared or mapped on its own,
+// pmap_superbreak() gives every page in the block that many references;
+// from then on a PTE_PS mapping holds one reference on each of its pages,
+// exactly as a page table full of PTEs would.
+// Individual PTEs only ever refer to pages of broken-up blocks.
+
+static void
+pmap_superincref(pageinfo *pi)
+{
+	spinlock_acquire(&pmap_superlock);
+	if (pi->super)
+		pi->refcount++;
+	else {
+		int i;
+		for (i = 0; i < NPTENTRIES; i++)
+			mem_incref(&pi[i]);
+	}
+	spinlock_release(&pmap_superlock);
+}
+
+static void
+pmap_superdecref(pageinfo *pi)
+{
+	spinlock_acquire(&pmap_superlock);
+	if (pi->super) {
+		bool last = (--pi->refcount == 0);
+		if (last)
+			pi->super = 0;
+		spinlock_release(&pmap_superlock);
+		if (last)
+			mem_free_order(pi, MEM_MAXORDER);
+		return;
+	}
+	spinlock_release(&pmap_superlock);
+
+	// A broken-up block never becomes a superpage again,
+	// so we can drop the per-page references without the lock.
+	int i;
+	for (i = 0; i < NPTENTRIES; i++)
+		mem_decref(&pi[i], mem_free);
+}
+
+static void
+pmap_superbreak(pageinfo *pi)
+{
+	spinlock_acquire(&pmap_superlock);
+	if (pi->super) {
+		int i;
+		for (i = 1; i < NPTENTRIES; i++)
+			pi[i].refcount = pi->refcount;
+		pi->super = 0;
+	}
+	spinlock_release(&pmap_superlock);
+}
+
+// Replace the superpage mapping in *pde with a page table
+// that maps the same pages with the same permissions.
+// Returns false if we couldn't allocate the page table.
+static bool
+pmap_split(pde_t *pde)
+{
+	assert(*pde & PTE_PS);
+	pageinfo *pi = mem_alloc();
+	if (pi == NULL)
+		return 0;
+	mem_incref(pi);
+	pmap_superbreak(mem_phys2pi(PGADDR(*pde)));
+
+	// The new PTEs take over the superpage's per-page references.
+	pte_t *ptab = mem_pi2ptr(pi);
+	uint32_t pa = PGADDR(*pde);
+	uint32_t perm = *pde & (SYS_RW | PTE_P | PTE_W | PTE_U | PTE_A | PTE_D);
+	int i;
+	for (i = 0; i < NPTENTRIES; i++)
+		ptab[i] = (pa + i*PAGESIZE) | perm;
+	*pde = mem_pi2phys(pi) | PTE_P | PTE_U | PTE_A | PTE_W;
+	return 1;
+}
+
+// Split every superpage in a user address space back into page tables.
+// Returns false if we ran out of memory for the page tables.
+bool
+pmap_splitall(pde_t *pdir)
+{
+	bool ok = 1;
+	uint32_t va;
+	for (va = VM_USERLO; va < VM_USERHI; va += PTSIZE)
+		if ((pdir[PDX(va)] & PTE_PS) && !pmap_split(&pdir[PDX(va)])) {
+			ok = 0;
+			break;
+		}
+	pmap_inval(pdir, VM_USERLO, VM_USERHI-VM_USERLO);
+	return ok;
+}
+
+// Can the page mapped by this PTE move into a superpage?
+// Only private, fully writable pages that no other node knows about.
+static bool
+pmap_promotable(pte_t pte)
+{
+	const uint32_t want = SYS_RW | PTE_P | PTE_U | PTE_W;
+	if ((pte & (want | PTE_REMOTE)) != want || PGADDR(pte) == PTE_ZERO)
+		return 0;
+	pageinfo *pi = mem_phys2pi(PGADDR(pte));
+	return pi->refcount == 1 && pi->home == 0 && pi->shared == 0;
+}
+
+// Try to replace the page table covering 'va' with a single 4MB superpage,
+// copying its pages into one physically contiguous block.
+// This only happens when the page table is ours alone
+// and every one of its entries is promotable (see above).
+// Returns true if the region is now mapped by a superpage.
+bool
+pmap_promote(pde_t *pdir, uint32_t va)
+{
+	assert(va >= VM_USERLO && va < VM_USERHI);
+	pde_t *pde = &pdir[PDX(va)];
+	if (*pde & PTE_PS)
+		return 1;
+	if ((*pde & (PTE_P | PTE_W)) != (PTE_P | PTE_W))
+		return 0;	// no page table, or a shared one
+	pte_t *ptab = mem_ptr(PGADDR(*pde));
+	if (mem_ptr2pi(ptab)->refcount != 1)
+		return 0;
+
+	// Check both ends first: a table that is still filling up,
+	// either upward or (like a stack) downward, fails right away.
+	if (!pmap_promotable(ptab[0]) || !pmap_promotable(ptab[NPTENTRIES-1]))
+		return 0;
+	int i;
+	for (i = 1; i < NPTENTRIES-1; i++)
+		if (!pmap_promotable(ptab[i]))
+			return 0;
+
+	pageinfo *spi = mem_alloc_order(MEM_MAXORDER);
+	if (spi == NULL)
+		return 0;
+	uint8_t *sp = mem_pi2ptr(spi);
+	for (i = 0; i < NPTENTRIES; i++)
+		memmove(sp + i*PAGESIZE, mem_ptr(PGADDR(ptab[i])), PAGESIZE);
+	spi->super = 1;
+	mem_incref(spi);
+
+	*pde = mem_pi2phys(spi) | SYS_RW | PTE_P | PTE_U | PTE_W
+		| PTE_A | PTE_D | PTE_PS;
+	mem_decref(mem_ptr2pi(ptab), pmap_freeptab);	// frees the old pages
+	pmap_inval(pdir, PTADDR(va), PTSIZE);
+	return 1;
+}
+
+// Free a page directory later, a batch at a time, from pmap_reap().
+// Usable as a mem_decref() free function in place of pmap_freepdir().
+// The pdir must not be loaded on any CPU.
+void
+pmap_freepdirlater(pageinfo *pdirpi)
+{
+	spinlock_acquire(&pmap_deadlock);
+	pdirpi->free_next = pmap_deadlist;
+	pmap_deadlist = pdirpi;
+	spinlock_release(&pmap_deadlock);
+}
+
+// Returns true if some CPU has pdir loaded, whether or not it's running
+// the process that owns it (see proc_sched() in kern/proc.c).
+static bool
+pmap_loaded(pde_t *pdir)
+{
+	cpu *c;
+	for (c = &cpu_boot; c != NULL; c = c->next)
+		if (c->pdir == pdir)
+			return 1;
+	return 0;
+}
+
+// Do one batch of the work pmap_freepdirlater() put off:
+// free up to PMAP_REAPBATCH page tables or superpages of one dead pdir,
+// and the pdir itself once it's empty.
+// Called from the idle loop, and by mem_alloc() when memory runs out.
+// Returns true if there was any work to do.
+bool
+pmap_reap(void)
+{
+	if (pmap_deadlist == NULL)	// racy peek, rechecked below
+		return 0;
+
+	// Take the pdir off the list while we work on it,
+	// so that other CPUs can reap other pdirs at the same time.
+	// Skip any pdir a CPU still has loaded from its last process:
+	// proc_run() or proc_sched() will drop it soon enough.
+	spinlock_acquire(&pmap_deadlock);
+	pageinfo **pp, *pi;
+	for (pp = &pmap_deadlist; (pi = *pp) != NULL; pp = &pi->free_next)
+		if (!pmap_loaded(mem_pi2ptr(pi)))
+			break;
+	if (pi != NULL)
+		*pp = pi->free_next;
+	spinlock_release(&pmap_deadlock);
+	if (pi == NULL)
+		return 0;
+
+	pde_t *pdir = mem_pi2ptr(pi);
+	int n = 0;
+	uint32_t va;
+	for (va = VM_USERLO; va < VM_USERHI && n < PMAP_REAPBATCH;
+			va += PTSIZE) {
+		pde_t *pde = &pdir[PDX(va)];
+		if (*pde & PTE_PS)
+			pmap_superdecref(mem_phys2pi(PGADDR(*pde)));
+		else if (PGADDR(*pde) != PTE_ZERO)
+			mem_decref(mem_phys2pi(PGADDR(*pde)), pmap_freeptab);
+		else
+			continue;
+		*pde = PTE_ZERO;
+		n++;
+	}
+	pi->free_next = NULL;
+	if (va < VM_USERHI)
+		pmap_freepdirlater(pi);		// more left for next time
+	else
+		mem_free(pi);
+	return 1;
+}
+
+// Remove all user mappings from a page directory in constant time,
+// for tearing down an exited process's address space.
+// Returns a fresh empty pdir for the caller to use in place of 'pdir',
+// and drops the caller's reference to the old one,
+// whose contents pmap_reap() frees in the background.
+// If a fresh pdir can't be allocated, just empties 'pdir' and returns it.
+// The caller must ensure that 'pdir' isn't in use by a running process;
+// pmap_reap() waits for CPUs that merely still have it loaded.
+pde_t *
+pmap_detach(pde_t *pdir)
+{
+	pde_t *npdir = pmap_newpdir();
+	if (npdir == NULL) {
+		pmap_remove(pdir, VM_USERLO, VM_USERHI-VM_USERLO);
+		return pdir;
+	}
+	mem_decref(mem_ptr2pi(pdir), pmap_freepdirlater);
+	return npdir;
+}
+
 // Given 'pdir', a pointer to a page directory, pmap_walk returns
 // a pointer to the page table entry (PTE) for user virtual address 'va'.
 // This requires walking the two-level page table structure.
@@ -152,6 +521,9 @@ pmap_freeptab(pageinfo *ptabpi)
 // but it is read shared and writing != 0, then copy the page table
 // to obtain an exclusive copy of it and write-enable the PDE.
 //
+// If a 4MB superpage maps the address, it is split into a page table
+// (whether or not writing != 0), and pmap_walk returns NULL if that fails.
+//
 // Hint: you can turn a pageinfo pointer into the physical address of the
 // page it refers to with mem_pi2phys() from kern/mem.h.
 //
@@ -165,6 +537,8 @@ pmap_walk(pde_t *pdir, uint32_t va, bool writing)
 	assert(va >= VM_USERLO && va < VM_USERHI);
   pde_t *table = &pdir[PDX(va)];
   pte_t *t;
+  if((*table & PTE_PS) && !pmap_split(table))
+    return NULL;
   if(*table & PTE_P) {        // Is there a table at the index?
     pte_t *tmp = (pte_t*)PGADDR(*table);
     // We know if our table is not writable but we are writing
@@ -178,21 +552,29 @@ pmap_walk(pde_t *pdir, uint32_t va, bool writing)
         for(ind = 0; ind < 1024; ind++)
           tmp[ind] = tmp[ind] & ~PTE_W;
       } else {
-        // Ref count decrement bc no longer shared
+        // Ref count decrement bc no longer shared.
+        // Copy the whole table at once (with rep movsl: a page is
+        // far below memmove's STRING_NT threshold for SSE2 stores),
+        // then take references on, and write-protect, the real pages:
+        // zero mappings never have PTE_W, and remote ones hold no ref.
         pageinfo *p = mem_alloc();
+        if(!p)
+          return NULL;
         mem_incref(p);
         pte_t *new = mem_pi2ptr(p);
+        memmove(new, tmp, PAGESIZE);
         int k;
         for(k = 0; k < 1024; k++) {
-          new[k] = tmp[k] & ~PTE_W;
-          if(PGADDR(tmp[k]) != PTE_ZERO)
-            mem_incref(mem_phys2pi(PGADDR(tmp[k])));
+          if(PGADDR(new[k]) == PTE_ZERO || (new[k] & PTE_REMOTE))
+            continue;
+          new[k] &= ~PTE_W;
+          mem_incref(mem_phys2pi(PGADDR(new[k])));
         }
         mem_decref(mem_ptr2pi(tmp), pmap_freeptab);
         tmp = new;
       }
+      *table = (pte_t)tmp | PTE_P | PTE_U | PTE_A | PTE_W;
     }
-    *table = (pte_t)tmp | PTE_P | PTE_U | PTE_A | PTE_W;
     return &tmp[PTX(va)];
   }
 
@@ -200,14 +582,10 @@ pmap_walk(pde_t *pdir, uint32_t va, bool writing)
     return NULL;
 
   // We have to create a new table bc it doesnt exist
-  pageinfo *pi = mem_alloc();
+  pageinfo *pi = pmap_newptab();
   if(!pi)
     return NULL;
   t = mem_pi2ptr(pi);
-  mem_incref(pi);
-  int i;
-  for(i = 0; i < 1024; i++)
-    t[i] = PTE_ZERO;
   *table = mem_pi2phys(pi) | PTE_P | PTE_U | PTE_A | PTE_W;
 
   return &t[PTX(va)];
@@ -276,8 +654,6 @@ pmap_remove(pde_t *pdir, uint32_t va, size_t size)
 	assert(va >= VM_USERLO && va < VM_USERHI);
 	assert(size <= VM_USERHI - va);
 
-  pmap_inval(pdir, va, size);
-
   uint32_t start = va;
   uint32_t end = start + size;
 
@@ -296,8 +672,10 @@ pmap_remove(pde_t *pdir, uint32_t va, size_t size)
     if(PTX(start) != 0
         || start + PTSIZE > end) {
       pte_t *entry = pmap_walk(pdir, start, 1);
+      if(entry == NULL)
+        panic("pmap_remove: no memory to split superpage");
       while(start < end) {
-        if(PGADDR(*entry) != PTE_ZERO) // Theres a page here!
+        if(PGADDR(*entry) != PTE_ZERO && !(*entry & PTE_REMOTE))
             mem_decref(mem_phys2pi(PGADDR(*entry)), mem_free);
         *entry = PTE_ZERO;
         start += PAGESIZE;
@@ -309,70 +687,446 @@ pmap_remove(pde_t *pdir, uint32_t va, size_t size)
     }
 
 		// We can remove an entire table!	
-		if(PGADDR(*table) != PTE_ZERO)
+		if(*table & PTE_PS)
+			pmap_superdecref(mem_phys2pi(PGADDR(*table)));
+		else if(PGADDR(*table) != PTE_ZERO)
 			mem_decref(mem_phys2pi(PGADDR(*table)), pmap_freeptab);
 		*table = PTE_ZERO;
 		start += PTSIZE;
   }
+  pmap_inval(pdir, va, size);
+}
+
+// Beyond this many pages it's cheaper to flush the whole TLB than page by page.
+#define PMAP_INVLPG_MAX	32
+
+// Invalidate a range of this CPU's TLB entries for the current address space,
+// page by page if the range is small, or all at once if it's large.
+static void
+pmap_flushlocal(uint32_t va, size_t size)
+{
+	if (size > PMAP_INVLPG_MAX * PAGESIZE) {
+		lcr3(rcr3());		// invalidate everything
+		return;
+	}
+	for (; size > 0; va += PAGESIZE, size -= PAGESIZE)
+		invlpg(mem_ptr(va));	// invalidate one page
+}
+
+// Carry out a TLB shootdown another CPU has posted to our mailbox, if any.
+// Called from the T_TLBFLUSH interrupt,
+// and from loops in which we spin with interrupts disabled,
+// so that two CPUs shooting at each other can't deadlock.
+void
+pmap_tlbflush(void)
+{
+	cpu *c = cpu_cur();
+	if (c->tlbsize == 0)
+		return;
+	pmap_flushlocal(c->tlbva, c->tlbsize);
+	c->tlbsize = 0;		// tell the requester we're done
 }
 
 //
 // Invalidate the TLB entry or entries for a given virtual address range,
-// but only if the page tables being edited are the ones
-// currently in use by the processor.
+// on every processor that may be using the page tables being edited.
+// Must be called after the page table changes have been made.
 //
 void
 pmap_inval(pde_t *pdir, uint32_t va, size_t size)
 {
-	// Flush the entry only if we're modifying the current address space.
-	proc *p = proc_cur();
-	if (p == NULL || p->pdir == pdir) {
-		if (size == PAGESIZE)
-			invlpg(mem_ptr(va));	// invalidate one page
-		else
-			lcr3(mem_phys(pdir));	// invalidate everything
+	// Flush our own TLB if we're modifying the current address space.
+	cpu *c = cpu_cur();
+	proc *p = c->proc;
+	if (p != NULL && p->pdir == pdir && c->tlbdefer) {
+		c->tlbdeflo = MIN(c->tlbdeflo, va);
+		c->tlbdefhi = MAX(c->tlbdefhi, va + size);
+	} else if (p == NULL || p->pdir == pdir || c->pdir == pdir)
+		pmap_flushlocal(va, size);
+
+	if (cpu_boot.next == NULL)
+		return;		// no other CPUs to worry about
+
+	// Make our page table changes globally visible
+	// before we look at which pdirs other CPUs have loaded:
+	// a CPU that loads this pdir after we look will see our changes.
+	// This pairs with the store to cpu.pdir before lcr3 in proc_run.
+	asm volatile("lock; addl $0,0(%%esp)" : : : "memory", "cc");
+
+	// Post a request to each other CPU using this pdir, then wait for all.
+	cpu *oc;
+	for (oc = &cpu_boot; oc != NULL; oc = oc->next) {
+		if (oc == c || oc->pdir != pdir)
+			continue;
+		while (xchg(&oc->tlbbusy, 1) != 0) {	// claim its mailbox
+			pmap_tlbflush();
+			pause();
+		}
+		oc->tlbfrom = c;
+		oc->tlbva = va;
+		oc->tlbsize = size;
+		lapic_ipi(oc->id, T_TLBFLUSH);
+	}
+	for (oc = &cpu_boot; oc != NULL; oc = oc->next) {
+		if (oc->tlbfrom != c)
+			continue;
+		while (oc->tlbsize != 0) {
+			pmap_tlbflush();
+			pause();
+		}
+		oc->tlbfrom = NULL;
+		xchg(&oc->tlbbusy, 0);
 	}
 }
 
+//
+// Start deferring this CPU's invalidations of the current process's
+// address space, so that a system call doing many memory operations
+// can flush its own TLB once at the end with pmap_invalflush().
+// The TLB may hold stale entries for that address space in the meantime,
+// so pmap_invalsync() or pmap_invalflush() must be called
+// before touching user memory.
+// Switching page directories with lcr3 also ends the deferral.
+// Only local flushes get deferred: a process runs on one CPU at a time,
+// and pmap_inval() still shoots down any other CPU that has pdir loaded.
+//
+void
+pmap_invaldefer(void)
+{
+	cpu *c = cpu_cur();
+	c->tlbdefer = 1;
+	c->tlbdeflo = ~0;
+	c->tlbdefhi = 0;
+}
+
+//
+// Do any local TLB invalidations deferred since pmap_invaldefer(),
+// and stop deferring them.
+//
+void
+pmap_invalflush(void)
+{
+	cpu *c = cpu_cur();
+	if (!c->tlbdefer)
+		return;
+	c->tlbdefer = 0;
+	if (c->tlbdeflo < c->tlbdefhi)
+		pmap_flushlocal(c->tlbdeflo, c->tlbdefhi - c->tlbdeflo);
+}
+
+//
+// Do any local TLB invalidations deferred so far, as pmap_invalflush() does,
+// but go on deferring later ones, for usercopy() partway through
+// a system call that deferred them.
+//
+void
+pmap_invalsync(void)
+{
+	cpu *c = cpu_cur();
+	if (!c->tlbdefer || c->tlbdeflo >= c->tlbdefhi)
+		return;
+	pmap_flushlocal(c->tlbdeflo, c->tlbdefhi - c->tlbdeflo);
+	c->tlbdeflo = ~0;
+	c->tlbdefhi = 0;
+}
+
 //
 // Virtually copy a range of pages from spdir to dpdir (could be the same).
 // Uses copy-on-write to avoid the cost of immediate copying:
 // instead just copies the mappings and makes both source and dest read-only.
+// The range need only be page-aligned: wherever source and destination
+// line up on whole 4MB page tables, we share the page tables themselves,
+// and elsewhere we share the individual pages.
+// Page tables the destination already shares with the source are left as is,
+// so re-copying a mostly unchanged range costs little.
 // Returns true if successfull, false if not enough memory for copy.
 //
 int
 pmap_copy(pde_t *spdir, uint32_t sva, pde_t *dpdir, uint32_t dva,
 		size_t size)
 {
-	assert(PTOFF(sva) == 0);	// must be 4MB-aligned
-	assert(PTOFF(dva) == 0);
-	assert(PTOFF(size) == 0);
+	assert(PGOFF(sva) == 0);	// must be page-aligned
+	assert(PGOFF(dva) == 0);
+	assert(PGOFF(size) == 0);
 	assert(sva >= VM_USERLO && sva < VM_USERHI);
 	assert(dva >= VM_USERLO && dva < VM_USERHI);
 	assert(size <= VM_USERHI - sva);
 	assert(size <= VM_USERHI - dva);
 
-	pmap_inval(spdir, sva, size);
-	pmap_inval(dpdir, dva, size);
   uint32_t start = sva;
   uint32_t end = sva + size;
-	pde_t *source = &spdir[PDX(sva)];
-	pde_t *dest = &dpdir[PDX(dva)];
-  for(; start < end; source++, dest++,
-        start += PTSIZE, dva += PTSIZE) {
-    // Shared means one more reference
-  	if(*source != PTE_ZERO)
-  		mem_incref(mem_phys2pi(PGADDR(*source)));
-        // Delete the old page table
-  	if(*dest & PTE_P)
-  		pmap_remove(dpdir, dva, PTSIZE);
-        // share mappings
-  	*dest = *source;
-    // Mark both as not writable bc they are now shared
-    *dest &= ~PTE_W;
-    *source &= ~PTE_W;
+  uint32_t dstart = dva;
+  int ok = 1;
+  while(start < end) {
+    pde_t *source = &spdir[PDX(start)];
+    pde_t *dest = &dpdir[PDX(dva)];
+    if(PTOFF(start) == 0 && PTOFF(dva) == 0 && end - start >= PTSIZE) {
+      if(PGADDR(*dest) == PGADDR(*source) && !((*dest ^ *source) & PTE_PS)) {
+        // Already sharing this page table, as when re-copying into
+        // a child that has not touched the region since last time.
+        *dest &= ~PTE_W;
+        *source &= ~PTE_W;
+        start += PTSIZE;
+        dva += PTSIZE;
+        continue;
+      }
+      // Shared means one more reference
+      if(*source & PTE_PS)
+        pmap_superincref(mem_phys2pi(PGADDR(*source)));
+      else if(*source != PTE_ZERO)
+        mem_incref(mem_phys2pi(PGADDR(*source)));
+          // Delete the old page table
+      if(*dest & PTE_P)
+        pmap_remove(dpdir, dva, PTSIZE);
+          // share mappings
+      *dest = *source;
+      // Mark both as not writable bc they are now shared
+      *dest &= ~PTE_W;
+      *source &= ~PTE_W;
+      start += PTSIZE;
+      dva += PTSIZE;
+      continue;
+    }
+
+    // Share one page.  Walk the destination first,
+    // since that may replace a page table the source also uses.
+    pte_t *dpte = pmap_walk(dpdir, dva, 1);
+    if(dpte == NULL) {
+      ok = 0;
+      break;
+    }
+    pte_t spte = PTE_ZERO;
+    if(*source & PTE_PS) {
+      // Keep the source superpage, but count its pages individually
+      // so that the destination can share just this one.
+      pmap_superbreak(mem_phys2pi(PGADDR(*source)));
+      *source &= ~PTE_W;
+      spte = (PGADDR(*source) + PTX(start)*PAGESIZE)
+        | (*source & (SYS_RW | PTE_P | PTE_U | PTE_A | PTE_D));
+    } else if(*source != PTE_ZERO) {
+      pte_t *ptab = (pte_t*)PGADDR(*source);
+      pte_t *sp = &ptab[PTX(start)];
+      // A page table we don't share gets its entry write-protected;
+      // a shared one is already read-only through its PDE.
+      if(mem_ptr2pi(ptab)->refcount == 1)
+        *sp &= ~PTE_W;
+      spte = *sp & ~PTE_W;
+    }
+    pte_t old = *dpte;
+    if(PGADDR(spte) != PTE_ZERO)
+      mem_incref(mem_phys2pi(PGADDR(spte)));
+    *dpte = spte;
+    if(PGADDR(old) != PTE_ZERO)
+      mem_decref(mem_phys2pi(PGADDR(old)), mem_free);
+    start += PAGESIZE;
+    dva += PAGESIZE;
   }
-	return 1;
+	pmap_inval(spdir, sva, size);	// source entries are now read-only
+	pmap_inval(dpdir, dstart, size);
+	return ok;
+}
+
+// Must we copy this page before writing to it?
+// Yes if it's shared copy-on-write, or if we've given out an RR to it
+// or it's a replica of a remote page (pi->shared nonzero):
+// RRs name immutable contents, so other nodes can cache them (see mem.h).
+// Never if it's shared outright (SYS_SHARE): then writing is the point.
+static bool
+pmap_mustcopy(pageinfo *pi)
+{
+  return !pi->shm && (pi->refcount > 1 || pi->shared != 0);
+}
+
+// Make the page a nominally writable PTE maps actually writable,
+// first copying it if it's shared copy-on-write or it's the zero page.
+// Returns false if we ran out of memory for the copy.
+static bool
+pmap_cowpage(pte_t *entry)
+{
+  pte_t new = PGADDR(*entry);
+  if(PGADDR(*entry) == PTE_ZERO       // we can also copy zero pages!
+    || pmap_mustcopy(mem_phys2pi(PGADDR(*entry)))) {
+    pageinfo *p;
+    if(PGADDR(*entry) == PTE_ZERO) {
+      // a pre-zeroed page saves copying pmap_zero
+      p = mem_alloczero();
+      if(p == NULL)
+        return 0;
+    } else {
+      p = mem_alloc();
+      if(p == NULL)
+        return 0;
+      memmove(mem_pi2ptr(p), (void*)PGADDR(*entry), PAGESIZE);
+      mem_decref(mem_phys2pi(PGADDR(*entry)), mem_free);
+    }
+    mem_incref(p);
+    new = mem_pi2phys(p);
+  }
+  *entry = new | SYS_WRITE // still nominally writable
+  | PTE_P | PTE_U // present and in user space
+  | PTE_W;    // system writable and accessed
+  return 1;
+}
+
+//
+// Share the pages of a range of spdir outright with the same range
+// of dpdir, for SYS_COPY with SYS_SHARE: each becomes a private page
+// first if it isn't one already (see pmap_cowpage()), then is marked
+// never to be copied again, and both map it with its nominal permissions,
+// actually writable if nominally writable.
+// Returns false if we ran out of memory, having shared some of it.
+//
+int
+pmap_share(pde_t *spdir, uint32_t sva, pde_t *dpdir, uint32_t dva,
+		size_t size)
+{
+  assert(PGOFF(sva) == 0 && PGOFF(dva) == 0 && PGOFF(size) == 0);
+  assert(sva >= VM_USERLO && sva < VM_USERHI);
+  assert(dva >= VM_USERLO && dva < VM_USERHI);
+  assert(size <= VM_USERHI - sva);
+  assert(size <= VM_USERHI - dva);
+
+  uint32_t off;
+  int ok = 1;
+  for(off = 0; off < size; off += PAGESIZE) {
+    // Walk the destination first, as pmap_copy() does.
+    pte_t *dpte = pmap_walk(dpdir, dva + off, 1);
+    pte_t *spte = dpte ? pmap_walk(spdir, sva + off, 1) : NULL;
+    if(spte == NULL) {
+      ok = 0;
+      break;
+    }
+    if(*spte & PTE_REMOTE)
+      continue;   // only paged-out children have these: leave it be
+    uint32_t perm = *spte & SYS_RW;
+    if(PGADDR(*spte) == PTE_ZERO
+        || pmap_mustcopy(mem_phys2pi(PGADDR(*spte)))) {
+      if(!pmap_cowpage(spte)) {
+        ok = 0;
+        break;
+      }
+    }
+    pageinfo *pi = mem_phys2pi(PGADDR(*spte));
+    pi->shm = 1;
+    pmap_shmused = 1;
+    pte_t pte = PGADDR(*spte) | perm;
+    if(perm & SYS_READ)
+      pte |= PTE_P | PTE_U | (perm & SYS_WRITE ? PTE_W : 0);
+    *spte = pte;
+    pte_t old = *dpte;
+    mem_incref(pi);
+    *dpte = pte;
+    if(PGADDR(old) != PTE_ZERO && !(old & PTE_REMOTE))
+      mem_decref(mem_phys2pi(PGADDR(old)), mem_free);
+  }
+  pmap_inval(spdir, sva, size);
+  pmap_inval(dpdir, dva, size);
+  return ok;
+}
+
+//
+// Give dpdir private copies of the pages pmap_share() shared
+// that a range of it maps, for a SYS_COPY into a process without
+// PFF_NONDET: pmap_copy() passes such pages on as they are,
+// and a deterministic process must not see anyone else's writes.
+// The copies are read-only until written, like any copied page.
+// Returns false if we ran out of memory, having copied some of them.
+//
+int
+pmap_unshare(pde_t *pdir, uint32_t va, size_t size)
+{
+  assert(PGOFF(va) == 0 && PGOFF(size) == 0);
+  assert(va >= VM_USERLO && va < VM_USERHI);
+  assert(size <= VM_USERHI - va);
+  if(!pmap_shmused)
+    return 1;   // nothing was ever shared: nothing to look for
+
+  uint32_t start = va, end = va + size;
+  int ok = 1;
+  while(va < end) {
+    // Superpages never hold shared pages (see pmap_promote()).
+    pde_t pde = pdir[PDX(va)];
+    if(!(pde & PTE_P) || (pde & PTE_PS)) {
+      va = ROUNDDOWN(va, PTSIZE) + PTSIZE;
+      continue;
+    }
+    pte_t pte = ((pte_t*)PGADDR(pde))[PTX(va)];
+    if(PGADDR(pte) == 0 || PGADDR(pte) == PTE_ZERO
+        || (pte & PTE_REMOTE) || !mem_phys2pi(PGADDR(pte))->shm) {
+      va += PAGESIZE;
+      continue;
+    }
+    pte_t *entry = pmap_walk(pdir, va, 1);  // our own table, to change
+    pageinfo *p = entry ? mem_alloc() : NULL;
+    if(p == NULL) {
+      ok = 0;
+      break;
+    }
+    mem_incref(p);
+    memmove(mem_pi2ptr(p), (void*)PGADDR(*entry), PAGESIZE);
+    mem_decref(mem_phys2pi(PGADDR(*entry)), mem_free);
+    uint32_t perm = *entry & SYS_RW;
+    *entry = mem_pi2phys(p) | perm | (perm & SYS_READ ? PTE_P | PTE_U : 0);
+    va += PAGESIZE;
+  }
+  pmap_inval(pdir, start, size);
+  return ok;
+}
+
+// Is this PTE a nominally writable page that a write would fault on,
+// for pmap_cowpage() to copy or fill in?
+#define pmap_cowpending(pte) \
+	(((pte) & (SYS_WRITE | PTE_W | PTE_REMOTE)) == SYS_WRITE)
+
+// When a write fault lands on the page right after the last one we resolved,
+// the process is probably filling memory sequentially (appending to a file,
+// say), so we also resolve up to this many following pages in the same trap;
+// or, in a range the process has told us so with SYS_SEQUENTIAL,
+// up to PMAP_SEQAROUND pages after every fault there.
+#define PMAP_FAULTAROUND	8
+#define PMAP_SEQAROUND		64
+
+// How long a process may wait for memory to resolve a page fault
+// before we give up and blame the fault on it (see pmap_faultoom()).
+#define PMAP_OOMWAIT		1000000000ULL	// nanoseconds
+
+// Out of memory to resolve curr's page fault: let other processes run,
+// and other CPUs' idle loops reclaim memory meanwhile,
+// paging cold memory out to other nodes if need be (see proc_scanidle()),
+// then retry the access, for up to PMAP_OOMWAIT.
+// Returns, leaving the fault to be blamed on curr, if that runs out,
+// or if the kernel faulted (in usercopy()), which can't wait here.
+static void
+pmap_faultoom(trapframe *tf, proc *curr)
+{
+  if(!(tf->cs & 3))
+    return;
+  uint64_t now = clock_ns();
+  if(curr->pfoomat == 0)
+    curr->pfoomat = now;
+  else if(now - curr->pfoomat > PMAP_OOMWAIT) {
+    curr->pfoomat = 0;
+    warn("pmap_pagefault: out of memory");
+    return;
+  }
+  proc_yield(tf);
+}
+
+// curr faulted in user mode on a page, or page table, at level pglevel
+// that lives on another node (see net_swapout()), which pte maps:
+// pull it back (see net_pullfault()), and retry the access once it's here.
+// Returns, leaving the fault to be blamed on curr, only if we run out
+// of memory for it for too long.
+static void
+pmap_faultpull(trapframe *tf, proc *curr, pte_t *pte, int pglevel)
+{
+  proc_save(curr, tf, -1);
+  int r = net_pullfault(curr, pte, pglevel);
+  if(r > 0)
+    proc_sched();     // net_rxpullone() readies us once it's here
+  if(r < 0)
+    return pmap_faultoom(tf, curr);
+  trap_return(tf);    // it was here after all
 }
 
 //
@@ -387,33 +1141,105 @@ pmap_pagefault(trapframe *tf)
 {
   // Read processor's CR2 register to find the faulting linear address.
   uint32_t fva = rcr2();
-  //cprintf("pmap_pagefault fva %x eip %x\n", fva, tf->eip);
+  trace(TRACE_PGFLT, fva, tf->eip, tf->err);
+  cpu_cur()->pgfaults++;
 
   // one of the tests tries to page fault outside of user space
   if(fva < VM_USERLO || fva >= VM_USERHI)
     return;
   proc *curr = proc_cur();
+  pde_t *pde = &curr->pdir[PDX(fva)];
+  if(*pde & PTE_REMOTE) {
+    if(tf->cs & 3)
+      pmap_faultpull(tf, curr, pde, PGLEV_PTAB);
+    return;
+  }
+  if((*pde & PTE_PS) && (*pde & SYS_WRITE) && !(*pde & PTE_W)) {
+    // A superpage that only we use just needs write-enabling.
+    // Otherwise pmap_walk splits it and we copy the one page below.
+    pageinfo *spi = mem_phys2pi(PGADDR(*pde));
+    if(spi->super && spi->refcount == 1) {
+      *pde |= PTE_W;
+      pmap_inval(curr->pdir, PGADDR(fva), PAGESIZE);
+      curr->acct.cowfaults++;
+      trap_return(tf);
+    }
+  }
   pte_t *entry = pmap_walk(curr->pdir, fva, 1);
+  if(entry == NULL)
+    return pmap_faultoom(tf, curr);
+  if(*entry & PTE_REMOTE) {
+    if(tf->cs & 3)
+      pmap_faultpull(tf, curr, entry, PGLEV_PAGE);
+    return;
+  }
   // The page must be nominally writable
   if(!(*entry & SYS_WRITE)) 
       return;
-  pte_t new = PGADDR(*entry);
-  if(mem_phys2pi(PGADDR(*entry))->refcount > 1 // shared for copy on write
-    || PGADDR(*entry) == PTE_ZERO) {      // we can also copy zero pages!
-    pageinfo *p = mem_alloc();
-    if(PGADDR(*entry) != PTE_ZERO)
-        mem_decref(mem_phys2pi(PGADDR(*entry)), mem_free);
-    mem_incref(p);
-    memmove((void*)mem_pi2phys(p), (void*)PGADDR(*entry), PAGESIZE);
-    new = mem_pi2phys(p);
+  bool zero = PGADDR(*entry) == PTE_ZERO;
+  if(!pmap_cowpage(entry))
+    return pmap_faultoom(tf, curr);
+  curr->pfoomat = 0;
+  if(zero)
+    curr->acct.zerofaults++;
+  else
+    curr->acct.cowfaults++;
+
+  // Fault around: stop at the end of the page table,
+  // at the first page that isn't a pending copy-on-write,
+  // or if memory runs short, since these pages are only a guess.
+  uint32_t last = PGADDR(fva);
+  bool seq = fva >= curr->seqlo && fva < curr->seqhi;
+  if(seq || last == curr->pflast + PAGESIZE) {
+    int i, max = seq ? PMAP_SEQAROUND : PMAP_FAULTAROUND;
+    for(i = 0; i < max && PTX(last + PAGESIZE) != 0; i++) {
+      pte_t *e = entry + 1 + i;
+      if(!pmap_cowpending(*e) || !pmap_cowpage(e))
+        break;
+      last += PAGESIZE;
+    }
   }
-  *entry = new | SYS_WRITE // still nominally writable
-  | PTE_P | PTE_U // present and in user space
-  | PTE_W;    // system writable and accessed
-  pmap_inval(curr->pdir, PGADDR(fva), PAGESIZE);
+  curr->pflast = last;
+
+  pmap_inval(curr->pdir, PGADDR(fva), last + PAGESIZE - PGADDR(fva));
+  pmap_promote(curr->pdir, fva);  // that may have filled its page table
   trap_return(tf);
 }
 
+// Given a word x, return a word with the high bit of each byte set
+// if and only if that byte of x is nonzero.
+static gcc_inline uint32_t
+pmap_bytesnz(uint32_t x)
+{
+  return (((x & 0x7f7f7f7f) + 0x7f7f7f7f) | x) & 0x80808080;
+}
+
+// Combine a word that changed from r to s in the source and to d in the dest
+// with merge operator op (see SYS_MERGEOP in inc/syscall.h).
+static uint32_t
+pmap_mergeword(int op, uint32_t s, uint32_t r, uint32_t d)
+{
+  switch(op) {
+  case MERGEOP_ADD:	return d + (s - r);
+  case MERGEOP_MIN:	return (int32_t)s < (int32_t)d ? s : d;
+  case MERGEOP_MAX:	return (int32_t)s > (int32_t)d ? s : d;
+  case MERGEOP_OR:	return d | s;
+  }
+  panic("pmap_mergeword: bad op %d", op);
+}
+
+// Find the merge operator, if any, that ops sets for the page at va.
+static int
+pmap_mergeopof(const pmap_mergeop *ops, uint32_t va)
+{
+  int i;
+  if(ops != NULL)
+    for(i = 0; i < MERGEOP_NRANGES; i++)
+      if(ops[i].size != 0 && va - ops[i].va < ops[i].size)
+        return ops[i].op;
+  return MERGEOP_NONE;
+}
+
 //
 // Helper function for pmap_merge: merge a single memory page
 // that has been modified in both the source and destination.
@@ -421,44 +1247,486 @@ pmap_pagefault(trapframe *tf)
 // print a warning to the console and remove the page from the destination.
 // If the destination page is read-shared, be sure to copy it before modifying!
 //
-void
-pmap_mergepage(pte_t *rpte, pte_t *spte, pte_t *dpte, uint32_t dva)
+// We compare a 32-bit word at a time, skipping words the source left alone
+// and copying whole words the destination left alone;
+// only words that changed on both sides get resolved byte by byte,
+// or combined with merge operator op if it isn't MERGEOP_NONE.
+// If the merged page comes out all zero, as cleared buffers often do,
+// we free it and map the zero page there instead.
+// Returns false if there was a conflict.
+//
+bool
+pmap_mergepage(pte_t *rpte, pte_t *spte, pte_t *dpte, uint32_t dva, int op)
 {
-  uint8_t *dest = (uint8_t*)PGADDR(*dpte); // We're doing a byte by byte merge hence uint8_t
-  uint8_t *src = (uint8_t*)PGADDR(*spte);
+  uint32_t *dest = (uint32_t*)PGADDR(*dpte);
+  const uint32_t *src = (const uint32_t*)PGADDR(*spte);
 
   // If dest is read-shared we have to copy it
   // same as in page fault handler
-  if(mem_ptr2pi(dest)->refcount > 1 || dest == (uint8_t*)PTE_ZERO) {  
+  if(dest == (uint32_t*)PTE_ZERO || pmap_mustcopy(mem_ptr2pi(dest))) {
     // zero pages have to be copied too so we can "write" to them
-    pageinfo *p = mem_alloc();
-    if(dest != (uint8_t*)PTE_ZERO)
-        mem_decref(mem_ptr2pi(dest), mem_free);
+    pageinfo *p;
+    if(dest == (uint32_t*)PTE_ZERO)
+      p = mem_alloczero();
+    else {
+      p = mem_alloc();
+      memmove(mem_pi2ptr(p), dest, PAGESIZE);
+      mem_decref(mem_ptr2pi(dest), mem_free);
+    }
     mem_incref(p);
-    memmove(mem_pi2ptr(p), dest, PAGESIZE);
     dest = mem_pi2ptr(p);
     *dpte = (pte_t)mem_pi2ptr(p) | SYS_RW | PTE_P | PTE_U | PTE_W;
   }
-  uint8_t *snap = (uint8_t*)PGADDR(*rpte);
-	int i;
-	for(i = 0; i < PAGESIZE; i++) {
-		if(!(src[i] == snap[i] || dest[i] == snap[i])) {
-      cprintf("Warning: merge conflict.\n");  // if neither src or dest match ref we have a conflict
+  const uint32_t *snap = (const uint32_t*)PGADDR(*rpte);
+  uint32_t nz = 0;      // OR of the merged words
+  int i;
+  for(i = 0; i < PAGESIZE/4; i++) {
+    uint32_t s = src[i], r = snap[i], d = dest[i];
+    if(s == r) {        // untouched in source: keep dest
+      nz |= d;
+      continue;
+    }
+    if(d == r) {        // untouched in dest: take source
+      dest[i] = s;
+      nz |= s;
+      continue;
+    }
+    if(op != MERGEOP_NONE) {
+      nz |= dest[i] = pmap_mergeword(op, s, r, d);
+      continue;
+    }
+    // Both changed this word: ok only if no byte changed in both.
+    uint32_t snz = pmap_bytesnz(s ^ r), dnz = pmap_bytesnz(d ^ r);
+    if(snz & dnz) {
+      cprintf("Warning: merge conflict.\n");
+      mem_decref(mem_ptr2pi(dest), mem_free);
       *dpte = PTE_ZERO;
-      return;
+      return 0;
     }
-		if(dest[i] == snap[i])  // only copy when something has changed
-			dest[i] = src[i];
+    uint32_t dmask = (dnz >> 7) * 0xff;   // bytes dest changed
+    nz |= dest[i] = (d & dmask) | (s & ~dmask);
+  }
+  if(nz == 0) {         // dest is private by now, so no one else sees it
+    mem_decref(mem_ptr2pi(dest), mem_free);
+    *dpte = pmap_zeropte(*dpte);
+  }
+  return 1;
+}
+
+// Is page pg all zero?
+bool
+pmap_iszero(const void *pg)
+{
+  const uint32_t *w = pg;
+  int i;
+  for(i = 0; i < PAGESIZE/4; i++)
+    if(w[i] != 0)
+      return 0;
+  return 1;
+}
+
+// Return the page table for the 4MB region at va in pdir
+// if it's one the idle scanners below may edit: one pdir's private table,
+// not shared with a snapshot or another pdir, nor named to other nodes.
+static pte_t *
+pmap_scanptab(pde_t *pdir, uint32_t va)
+{
+	assert(PTOFF(va) == 0);
+	assert(va >= VM_USERLO && va < VM_USERHI);
+	pde_t pde = pdir[PDX(va)];
+	if (!(pde & PTE_P) || (pde & PTE_PS) || !(pde & PTE_W)
+			|| PGADDR(pde) == PTE_ZERO)
+		return NULL;
+	pageinfo *ptpi = mem_phys2pi(PGADDR(pde));
+	if (ptpi->refcount != 1 || ptpi->shared)
+		return NULL;
+	return mem_ptr(PGADDR(pde));
+}
+
+//
+// Free each private page mapped in the 4MB region at va in pdir
+// that has turned out to be all zero, mapping the zero page there instead
+// with the same nominal permissions (see pmap_zeropte()).
+// Called at idle time on stopped processes (see proc_scanidle()),
+// which no one else can be changing the page tables of meanwhile.
+// Leaves alone page tables shared with a snapshot or another pdir,
+// and pages another pdir, or another node, has references to.
+// Returns the number of pages freed.
+//
+int
+pmap_zeroscan(pde_t *pdir, uint32_t va)
+{
+	pte_t *ptab = pmap_scanptab(pdir, va);
+	if (ptab == NULL)
+		return 0;
+	int i, nfreed = 0;
+	for (i = 0; i < NPTENTRIES; i++) {
+		pte_t pte = ptab[i];
+		if (!(pte & PTE_P) || PGADDR(pte) == PTE_ZERO)
+			continue;
+		pageinfo *pi = mem_phys2pi(PGADDR(pte));
+		if (pi->refcount != 1 || pi->shared || pi->shm
+				|| !pmap_iszero(mem_pi2ptr(pi)))
+			continue;
+		ptab[i] = pmap_zeropte(pte);
+		mem_decref(pi, mem_free);
+		nfreed++;
+	}
+	if (nfreed > 0)
+		pmap_inval(pdir, va, PTSIZE);	// it may still be loaded somewhere
+	return nfreed;
+}
+
+// Hash a page's contents for pmap_samescan() (32-bit FNV-1a on words).
+static uint32_t
+pmap_samehash(const uint32_t *w)
+{
+	uint32_t h = 2166136261u;
+	int i;
+	for (i = 0; i < PAGESIZE/4; i++)
+		h = (h ^ w[i]) * 16777619u;
+	return h;
+}
+
+//
+// Share pages with identical contents among the stopped processes,
+// as pmap_zeroscan() does for all-zero pages: for each read-only page
+// mapped in the 4MB region at va in pdir, look up its content hash
+// among the pages seen so far, and if one of them is the same,
+// map that one copy-on-write instead and drop our reference to ours.
+// Otherwise remember ours in its hash slot.
+// The table holds a reference to each page it remembers,
+// so the page can't be made writable in place or change while there;
+// pmap_sameflush() drops them all at the start of each pass.
+// Only pages without SYS_WRITE qualify, such as program text,
+// so the pages are stable; if a later SYS_PERM makes them writable,
+// the first write copies the page as for any other shared page.
+// Returns the number of pages merged.
+//
+int
+pmap_samescan(pde_t *pdir, uint32_t va)
+{
+	pte_t *ptab = pmap_scanptab(pdir, va);
+	if (ptab == NULL)
+		return 0;
+	int i, nmerged = 0;
+	for (i = 0; i < NPTENTRIES; i++) {
+		pte_t pte = ptab[i];
+		if (!(pte & PTE_P) || PGADDR(pte) == PTE_ZERO
+				|| (pte & (SYS_WRITE | PTE_W)))
+			continue;
+		pageinfo *pi = mem_phys2pi(PGADDR(pte));
+		if (pi->shared || pi->super || pi->shm)
+			continue;
+		uint32_t h = pmap_samehash(mem_pi2ptr(pi));
+		pmap_sameslot *sl = &pmap_same[h % PMAP_SAMESLOTS];
+		spinlock_acquire(&pmap_samelock);
+		pageinfo *spi = sl->pi;
+		if (spi == pi) {
+			spinlock_release(&pmap_samelock);
+			continue;
+		}
+		if (spi != NULL && sl->hash == h && memcmp(mem_pi2ptr(spi),
+				mem_pi2ptr(pi), PAGESIZE) == 0) {
+			mem_incref(spi);	// the table's ref keeps spi alive
+			spinlock_release(&pmap_samelock);
+			ptab[i] = mem_pi2phys(spi) | PGOFF(pte);
+			mem_decref(pi, mem_free);
+			nmerged++;
+			continue;
+		}
+		mem_incref(pi);		// remember this one instead
+		sl->hash = h;
+		sl->pi = pi;
+		spinlock_release(&pmap_samelock);
+		if (spi != NULL)
+			mem_decref(spi, mem_free);
+	}
+	if (nmerged > 0)
+		pmap_inval(pdir, va, PTSIZE);	// it may still be loaded somewhere
+	return nmerged;
+}
+
+// Forget the pages pmap_samescan() has remembered, dropping its references,
+// so that pages processes have since let go of can be freed.
+void
+pmap_sameflush(void)
+{
+	int i;
+	for (i = 0; i < PMAP_SAMESLOTS; i++) {
+		spinlock_acquire(&pmap_samelock);
+		pageinfo *pi = pmap_same[i].pi;
+		pmap_same[i].pi = NULL;
+		spinlock_release(&pmap_samelock);
+		if (pi != NULL)
+			mem_decref(pi, mem_free);
+	}
+}
+
+//
+// Pick out cold pages in the 4MB region at va in pdir to page out
+// to another node while this node is short of memory (see net_swapout()),
+// using the accessed bit as a clock: a page used since the last look
+// just has its PTE_A cleared, getting one more pass to be used again.
+// A cold copy of another node's page needs no sending anywhere:
+// we map its RR again in place of it, letting the copy go to the
+// replica cache, from which mem_alloc() reclaims it when it must.
+// Cold private pages, up to *nvas of them, go in vas for the caller
+// to push to another node, and *nvas comes back as how many.
+// Called at idle time on stopped processes as for pmap_zeroscan().
+// Returns the number of PTEs changed, setting *remote if any now is an RR.
+//
+int
+pmap_swapscan(pde_t *pdir, uint32_t va, uint32_t *vas, int *nvas,
+		bool *remote)
+{
+	int max = *nvas, n = 0, nchanged = 0, i;
+	*nvas = 0;
+	pte_t *ptab = pmap_scanptab(pdir, va);
+	if (ptab == NULL)
+		return 0;
+	for (i = 0; i < NPTENTRIES; i++) {
+		pte_t pte = ptab[i];
+		if (!(pte & PTE_P) || PGADDR(pte) == PTE_ZERO)
+			continue;
+		if (pte & PTE_A) {
+			ptab[i] = pte & ~PTE_A;
+			nchanged++;
+			continue;
+		}
+		pageinfo *pi = mem_phys2pi(PGADDR(pte));
+		if (pi->super)
+			continue;
+		if (pi->home != 0) {
+			ptab[i] = RRCONS(RRNODE(pi->home), pi->home, pte);
+			mem_decref(pi, mem_free);
+			*remote = 1;
+			nchanged++;
+		} else if (n < max && pi->refcount == 1 && !pi->shared
+				&& !pi->shm)
+			vas[n++] = va + i*PAGESIZE;
+	}
+	if (nchanged > 0)
+		pmap_inval(pdir, va, PTSIZE);	// it may still be loaded somewhere
+	*nvas = n;
+	return nchanged;
+}
+
+//
+// Another node has taken a copy of the private page at va in pdir,
+// which pmap_swapscan() picked out and we named to it by the RR 'old':
+// map the node's RR 'rr' in its place and free our page,
+// with the same nominal permissions.
+// Leaves the page be, and returns false, if it's no longer the one mapped
+// there or someone else has since taken a reference to it.
+// The caller must pmap_inval() the page afterwards.
+//
+bool
+pmap_swapped(pde_t *pdir, uint32_t va, uint32_t old, uint32_t rr)
+{
+	pde_t pde = pdir[PDX(va)];
+	if (!(pde & PTE_P) || (pde & PTE_PS) || PGADDR(pde) == PTE_ZERO)
+		return 0;
+	pte_t *pte = &((pte_t*)mem_ptr(PGADDR(pde)))[PTX(va)];
+	if (!(*pte & PTE_P) || PGADDR(*pte) != RRADDR(old))
+		return 0;
+	pageinfo *pi = mem_phys2pi(PGADDR(*pte));
+	if (pi->refcount != 1 || pi->shared)
+		return 0;
+	*pte = RRCONS(RRNODE(rr), rr, *pte);
+	mem_decref(pi, mem_free);
+	return 1;
+}
+
+// Return the page table a PDE refers to, or NULL if it maps nothing.
+static pte_t *
+pmap_ptabof(pde_t pde)
+{
+	assert(!(pde & PTE_PS));
+	return (pde & PTE_P) ? mem_ptr(PGADDR(pde)) : NULL;
+}
+
+// Return the PTE mapping va in pdir, or PTE_ZERO if nothing maps it,
+// making one up for a page of a superpage.
+// Doesn't allocate, split, or unshare anything.
+pte_t
+pmap_getpte(pde_t *pdir, uint32_t va)
+{
+	assert(va >= VM_USERLO && va < VM_USERHI);
+	pde_t pde = pdir[PDX(va)];
+	if (pde & PTE_PS)
+		return (PGADDR(pde) + PTX(va) * PAGESIZE)
+			| (pde & (SYS_RW | PTE_P | PTE_U | PTE_W | PTE_A | PTE_D));
+	const pte_t *ptab = pmap_ptabof(pde);
+	return ptab ? ptab[PTX(va)] : PTE_ZERO;
+}
+
+// Do two PTEs map the same page with the same nominal permissions?
+// Ignores the bits the processor and our copy-on-write code play with.
+static gcc_inline bool
+pmap_samepage(pte_t a, pte_t b)
+{
+	return PGADDR(a) == PGADDR(b) && (a & SYS_RW) == (b & SYS_RW);
+}
+
+//
+// Clear the accessed and dirty bits on every PTE in a range,
+// so that a later pmap_merge() can tell which pages were written since.
+// Doesn't allocate or unshare any page tables.
+//
+void
+pmap_clean(pde_t *pdir, uint32_t va, size_t size)
+{
+	assert(PTOFF(va) == 0);
+	assert(PTOFF(size) == 0);
+	uint32_t end = va + size;
+	for (; va < end; va += PTSIZE) {
+		pde_t *pde = &pdir[PDX(va)];
+		if (*pde & PTE_PS) {
+			*pde &= ~PTE_D;
+			continue;
+		}
+		pte_t *ptab = pmap_ptabof(*pde);
+		if (ptab == NULL)
+			continue;
+		int i;
+		for (i = 0; i < NPTENTRIES; i++)
+			if (ptab[i] & PTE_P)	// not RR_HOME's bits in an RR
+				ptab[i] &= ~(PTE_A | PTE_D);
 	}
 }
 
+//
+// Update the reference snapshot rpdir of the address space pdir,
+// for SYS_SNAP.  Like copying all of pdir into rpdir with pmap_copy(),
+// but regions whose PDE still matches rpdir are already shared read-only
+// with the previous snapshot and cannot have changed since,
+// so we only clean and re-share the 4MB regions touched since then,
+// and flush the TLB only for the range those regions span.
+//
+void
+pmap_snap(pde_t *pdir, pde_t *rpdir)
+{
+	uint32_t lo = VM_USERHI, hi = VM_USERLO;
+	uint32_t va;
+	for (va = VM_USERLO; va < VM_USERHI; va += PTSIZE) {
+		pde_t *pde = &pdir[PDX(va)];
+		pde_t *rpde = &rpdir[PDX(va)];
+		if (*pde == *rpde)
+			continue;	// untouched since the last snapshot
+
+		pmap_clean(pdir, va, PTSIZE);
+		if (*pde & PTE_PS)
+			pmap_superincref(mem_phys2pi(PGADDR(*pde)));
+		else if (PGADDR(*pde) != PTE_ZERO)
+			mem_incref(mem_phys2pi(PGADDR(*pde)));
+		pde_t old = *rpde;
+		*pde &= ~PTE_W;		// page table now shared copy-on-write
+		*rpde = *pde;
+		if (old & PTE_PS)
+			pmap_superdecref(mem_phys2pi(PGADDR(old)));
+		else if (PGADDR(old) != PTE_ZERO)
+			mem_decref(mem_phys2pi(PGADDR(old)), pmap_freeptab);
+
+		lo = MIN(lo, va);
+		hi = va + PTSIZE;
+	}
+	if (lo < hi)
+		pmap_inval(pdir, lo, hi - lo);	// rpdir is never loaded
+}
+
+// Merge the 4MB region at sva in spdir into the one at dva in dpdir,
+// as pmap_merge() does for each region in its range.
+// Only touches the regions' own page directory entries and page tables,
+// and reference counts and acct's counters (which are atomic),
+// so different regions can be merged on different CPUs at once.
+// Doesn't invalidate any TLB entries for what it changes.
+static int
+pmap_mergept(pde_t *rpdir, pde_t *spdir, uint32_t sva,
+		pde_t *dpdir, uint32_t dva, const pmap_mergeop *ops,
+		procacct *acct)
+{
+	pde_t *src = &spdir[PDX(sva)];
+	pde_t *snp = &rpdir[PDX(sva)];
+	pde_t *dst = &dpdir[PDX(dva)];
+
+	if (*src == *snp)	// unchanged in source - nothing to do
+		return 1;
+	if (*dst == *snp)	// unchanged in dest - copy from source
+		return pmap_copy(spdir, sva, dpdir, dva, PTSIZE);
+
+	// Different in both: go entry by entry,
+	// but only through the entries the source changed.
+	if (((*src & PTE_PS) && !pmap_split(src))
+			|| ((*snp & PTE_PS) && !pmap_split(snp))
+			|| ((*dst & PTE_PS) && !pmap_split(dst)))
+		return 0;
+	pte_t *sp = pmap_ptabof(*src);
+	const pte_t *rp = pmap_ptabof(*snp);
+	bool sprivate = (*src & PTE_W) != 0;	// may edit source PTEs
+	int i, merged = 0, conflicts = 0;
+	for (i = 0; i < NPTENTRIES; i++) {
+		pte_t s = sp ? sp[i] : PTE_ZERO;
+		pte_t r = rp ? rp[i] : PTE_ZERO;
+		if (!(s & PTE_D) && pmap_samepage(s, r))
+			continue;	// source didn't touch this page
+		if (PGADDR(s) == PGADDR(r) && PGADDR(s) != PTE_ZERO
+				&& mem_phys2pi(PGADDR(s))->shm)
+			continue;	// shared outright: dest saw its writes
+
+		const pte_t *dp = pmap_ptabof(*dst);
+		pte_t d = dp ? dp[i] : PTE_ZERO;
+		if (pmap_samepage(s, d))
+			continue;	// dest already has the same page
+
+		pte_t *de = pmap_walk(dpdir, dva + i*PAGESIZE, 1);
+		if (de == NULL)
+			break;
+		merged++;
+		if (pmap_samepage(d, r)) {
+			// unchanged in dest: share the source page copy-on-write
+			if (PGADDR(s) != PTE_ZERO)
+				mem_incref(mem_phys2pi(PGADDR(s)));
+			if (PGADDR(*de) != PTE_ZERO)
+				mem_decref(mem_phys2pi(PGADDR(*de)), mem_free);
+			*de = s & ~(PTE_W | PTE_D);
+			if (sprivate)
+				sp[i] &= ~PTE_W;
+		} else if (!pmap_mergepage(&r, &s, de, dva + i*PAGESIZE,
+				pmap_mergeopof(ops, dva + i*PAGESIZE)))
+			conflicts++;	// changed in both, merged word by word
+	}
+	if (acct != NULL) {
+		lockadd((volatile int32_t*)&acct->merged, merged);
+		lockadd((volatile int32_t*)&acct->conflicts, conflicts);
+	}
+	return i == NPTENTRIES;
+}
+
+static bool pmap_mergeunit(pmap_mergejob *j);
+
 // 
 // Merge differences between a reference snapshot represented by rpdir
 // and a source address space spdir into a destination address space dpdir.
 //
+// The source is a child that was snapshotted with SYS_SNAP,
+// which shares its page tables read-only with the snapshot
+// and clears their dirty bits (see pmap_clean()).
+// A 4MB region whose PDE still matches the snapshot was never touched.
+// Elsewhere we visit only the child's pages that are dirty
+// or map a different page than the snapshot,
+// and allocate destination page tables only where we must write.
+//
+// Each 4MB region is a separate unit of work (see pmap_mergept()).
+// With PMAP_MERGEPAR, a merge of several regions lets idle CPUs
+// take some of them (see pmap_mergehelp()), and waits for them to finish.
+// If acct isn't NULL, we count in it the pages we merge one by one,
+// and the merge conflicts among them.
+//
 int
 pmap_merge(pde_t *rpdir, pde_t *spdir, uint32_t sva,
-		pde_t *dpdir, uint32_t dva, size_t size)
+		pde_t *dpdir, uint32_t dva, size_t size,
+		const pmap_mergeop *ops, procacct *acct)
 {
 	assert(PTOFF(sva) == 0);	// must be 4MB-aligned
 	assert(PTOFF(dva) == 0);
@@ -468,55 +1736,85 @@ pmap_merge(pde_t *rpdir, pde_t *spdir, uint32_t sva,
 	assert(size <= VM_USERHI - sva);
 	assert(size <= VM_USERHI - dva);
 
-	pde_t *src = &spdir[PDX(sva)];
-	pde_t *dst = &dpdir[PDX(dva)];
-	pde_t *snp = &rpdir[PDX(sva)];
-
-	pmap_inval(spdir, sva, size); // invalidate anything we might change
-	pmap_inval(dpdir, dva, size);
-    pmap_inval(rpdir, sva, size); // same range in reference as source
-
-	uint32_t start = sva;
-    uint32_t end = start + size;
-    for(; start < end; snp++, dst++, src++) {
-		if(*src == *snp) {	
-			start += PTSIZE;
-            dva += PTSIZE;
-			continue;
-		}
-		if (*dst == *snp) {	// unchanged in dest - copy from source
-			pmap_copy(spdir, start, dpdir, dva, PTSIZE);
-			start += PTSIZE;
-            dva += PTSIZE;
-			continue;
+	uint64_t t0 = trace_on(TRACE_MERGE) ? rdtsc() : 0;
+	int ok = 1;
+	int nunits = size / PTSIZE;
+	if (PMAP_MERGEPAR && nunits > 1 && cpu_boot.next != NULL) {
+		// Publish the job so idle CPUs can take units of it too,
+		// and take units ourselves until they're all claimed.
+		pmap_mergejob j = { NULL, rpdir, spdir, dpdir, sva, dva, ops,
+					acct, nunits, 0, 0, 1 };
+		spinlock_acquire(&pmap_mergelock);
+		j.next = pmap_mergejobs;
+		pmap_mergejobs = &j;
+		spinlock_release(&pmap_mergelock);
+		cpu *c;
+		for (c = &cpu_boot; c != NULL; c = c->next)
+			if (c != cpu_cur())
+				cpu_wake(c);	// only wakes idle ones
+		while (pmap_mergeunit(&j))
+			;
+
+		// Wait for the helpers to finish the units they took,
+		// answering any TLB shootdowns they send us meanwhile.
+		while (j.ndone < nunits) {
+			pmap_tlbflush();
+			pause();
 		}
-		
-        // We have to go entry by entry, different in both src and dest
-		pte_t *src_e = pmap_walk(spdir, start, 1);
-		pte_t *dst_e = pmap_walk(dpdir, dva, 1);	
-    pte_t *snp_e = pmap_walk(rpdir, start, 1);
+		ok = j.ok;
+	} else {
+		int u;
+		for (u = 0; ok && u < nunits; u++)
+			ok = pmap_mergept(rpdir, spdir, sva + u*PTSIZE,
+					dpdir, dva + u*PTSIZE, ops, acct);
+	}
+	pmap_inval(spdir, sva, size);	// invalidate anything we changed
+	pmap_inval(dpdir, dva, size);
+	trace(TRACE_MERGE, dva, size, rdtsc() - t0);
+	return ok;
+}
 
-    int i;
-    for(i = 0; i < 1024; i++, src_e++, dst_e++, snp_e++,
-      start += PAGESIZE, dva += PAGESIZE) {
-      // Same deal entry by entry
-      if(!(*src_e == *snp_e) && !(*dst_e == *snp_e)) {
-        // we have to do a byte merge
-        pmap_mergepage(snp_e, src_e, dst_e, dva);
-      } else if (*dst_e == *snp_e && *src_e != *snp_e) {
-        // just do a full copy with copy on write
-    		if(PGADDR(*dst_e) != PTE_ZERO)
-    			mem_decref(mem_phys2pi(PGADDR(*dst_e)), mem_free);
-    		mem_incref(mem_phys2pi(PGADDR(*src_e)));
-    		*dst_e = *src_e;
-    		*src_e &= ~PTE_W; // not writeable anymore bc its copied
-        *dst_e &= ~PTE_W;
-	    }
-    }
+// Do one unclaimed unit of merge job j, or of any published job if j is NULL.
+// Returns false if there was none left.
+static bool
+pmap_mergeunit(pmap_mergejob *j)
+{
+	spinlock_acquire(&pmap_mergelock);
+	if (j == NULL)
+		j = pmap_mergejobs;
+	if (j == NULL || j->claimed == j->nunits) {
+		spinlock_release(&pmap_mergelock);
+		return 0;
+	}
+	int u = j->claimed++;
+	if (j->claimed == j->nunits) {	// take it off the list
+		pmap_mergejob **jp = &pmap_mergejobs;
+		while (*jp != j)
+			jp = &(*jp)->next;
+		*jp = j->next;
 	}
+	spinlock_release(&pmap_mergelock);
+
+	if (!pmap_mergept(j->rpdir, j->spdir, j->sva + u*PTSIZE,
+			j->dpdir, j->dva + u*PTSIZE, j->ops, j->acct))
+		j->ok = 0;
+	lockadd(&j->ndone, 1);	// last touch: j may vanish once all are done
 	return 1;
 }
 
+//
+// Help some other CPU's pmap_merge() along with a unit of its work, if any.
+// Called from the scheduler when this CPU has nothing else to run.
+// Returns true if it did any work.
+//
+bool
+pmap_mergehelp(void)
+{
+	if (pmap_mergejobs == NULL)	// racy peek, rechecked under the lock
+		return 0;
+	return pmap_mergeunit(NULL);
+}
+
 // 
 // Set the nominal permission bits on a range of virtual pages to 'perm'.
 // Adding permission to a nonexistent page maps zero-filled memory.
@@ -534,17 +1832,38 @@ pmap_setperm(pde_t *pdir, uint32_t va, uint32_t size, int perm)
   assert(size <= VM_USERHI - va);
   assert((perm & ~(SYS_RW)) == 0);
 
-  pmap_inval(pdir, va, size);
-  
   uint32_t start = va;
   uint32_t end = start + size;
   while(start < end) {
     pde_t *tab = &pdir[PDX(start)];
+    if((*tab & PTE_PS) && PTOFF(start) == 0 && end - start >= PTSIZE
+        && (perm & SYS_READ)) {
+      // Change a whole superpage's permissions without splitting it.
+      if(perm & SYS_WRITE)
+        *tab |= SYS_RW;
+      else
+        *tab &= ~SYS_WRITE & ~PTE_W;
+      start += PTSIZE;
+      continue;
+    }
     if(*tab == PTE_ZERO     // if theres no entry here
             && !(perm & SYS_READ)) {// and we dont have to change permission on zero pages
         start = PTADDR(start + PTSIZE); // Next page table
         continue;
     }
+    if(perm == SYS_READ && !(*tab & PTE_PS)
+        && PGADDR(*tab) == mem_phys(pmap_zeroptab)) {
+      start = PTADDR(start + PTSIZE); // already read-only zero pages
+      continue;
+    }
+    if(perm == SYS_READ && *tab == PTE_ZERO
+        && PTOFF(start) == 0 && end - start >= PTSIZE) {
+      // Share the read-only zero page table instead of filling our own.
+      mem_incref(mem_ptr2pi(pmap_zeroptab));
+      *tab = mem_phys(pmap_zeroptab) | PTE_P | PTE_U | PTE_A;
+      start += PTSIZE;
+      continue;
+    }
     pte_t *entry = pmap_walk(pdir, start, 1);
     while(start < end) {    
       if((perm & SYS_READ) && (perm & SYS_WRITE)){
@@ -561,15 +1880,103 @@ pmap_setperm(pde_t *pdir, uint32_t va, uint32_t size, int perm)
         break;
     }
   }
+  pmap_inval(pdir, va, size);
   return 1;
 }
 
+//
+// Resolve now the faults that writes to the nominally writable pages
+// in a range would take (see SYS_WILLNEED), as pmap_pagefault() would:
+// copy shared copy-on-write pages and fill in zero pages.
+// A superpage only we use gets write-enabled, but shared ones stay shared,
+// and page tables with nothing to resolve in the range stay shared too.
+// Returns false if it stopped early because memory ran out.
+// The caller must invalidate the range.
+//
+bool
+pmap_prefault(pde_t *pdir, uint32_t va, uint32_t size)
+{
+  assert(PGOFF(va) == 0 && PGOFF(size) == 0);
+  assert(va >= VM_USERLO && va < VM_USERHI);
+  assert(size <= VM_USERHI - va);
+
+  uint32_t end = va + size;
+  for(; va < end; va = PTADDR(va + PTSIZE)) {
+    uint32_t tend = MIN(PTADDR(va + PTSIZE), end);
+    pde_t *pde = &pdir[PDX(va)];
+    if(*pde & PTE_PS) {
+      if((*pde & (SYS_WRITE | PTE_W)) == SYS_WRITE
+          && mem_phys2pi(PGADDR(*pde))->super
+          && mem_phys2pi(PGADDR(*pde))->refcount == 1)
+        *pde |= PTE_W;
+      continue;
+    }
+    pte_t *ptab = pmap_ptabof(*pde);
+    if(ptab == NULL)
+      continue;
+    uint32_t v = va;
+    while(v < tend && !pmap_cowpending(ptab[PTX(v)]))
+      v += PAGESIZE;
+    if(v == tend)
+      continue;
+    pte_t *entry = pmap_walk(pdir, v, 1);   // unshares the page table
+    if(entry == NULL)
+      return 0;
+    for(; v < tend; v += PAGESIZE, entry++)
+      if(pmap_cowpending(*entry) && !pmap_cowpage(entry))
+        return 0;
+  }
+  return 1;
+}
+
+//
+// Give back the pages mapped in a range (see SYS_DONTNEED),
+// leaving zero mappings with the same nominal permissions in their place,
+// so the next touch of each finds a fresh zero page.
+// Remote pages stay as they are.  The caller must invalidate the range.
+//
+void
+pmap_discard(pde_t *pdir, uint32_t va, uint32_t size)
+{
+  assert(PGOFF(va) == 0 && PGOFF(size) == 0);
+  assert(va >= VM_USERLO && va < VM_USERHI);
+  assert(size <= VM_USERHI - va);
+
+  uint32_t end = va + size;
+  for(; va < end; va = PTADDR(va + PTSIZE)) {
+    uint32_t tend = MIN(PTADDR(va + PTSIZE), end);
+    pde_t *pde = &pdir[PDX(va)];
+    uint32_t v = va;
+    if(!(*pde & PTE_PS)) {
+      pte_t *ptab = pmap_ptabof(*pde);
+      if(ptab == NULL)
+        continue;
+      while(v < tend && (PGADDR(ptab[PTX(v)]) == PTE_ZERO
+          || (ptab[PTX(v)] & PTE_REMOTE)))
+        v += PAGESIZE;
+      if(v == tend)
+        continue;
+    }
+    pte_t *entry = pmap_walk(pdir, v, 1);   // splits or unshares
+    if(entry == NULL)
+      return;   // just a hint: keep the rest
+    for(; v < tend; v += PAGESIZE, entry++) {
+      if(PGADDR(*entry) == PTE_ZERO || (*entry & PTE_REMOTE))
+        continue;
+      mem_decref(mem_phys2pi(PGADDR(*entry)), mem_free);
+      *entry = pmap_zeropte(*entry);
+    }
+  }
+}
+
 static uint32_t
 va2pa(pde_t *pdir, uintptr_t va)
 {
 	pdir = &pdir[PDX(va)];
 	if (!(*pdir & PTE_P))
 		return ~0;
+	if (*pdir & PTE_PS)
+		return PGADDR(*pdir) + PTX(va)*PAGESIZE;
 	pte_t *ptab = mem_ptr(PGADDR(*pdir));
 	if (!(ptab[PTX(va)] & PTE_P))
 		return ~0;
@@ -580,10 +1987,9 @@ va2pa(pde_t *pdir, uintptr_t va)
 void
 pmap_check(void)
 {
-    extern pageinfo *mem_freelist;
-
 	pageinfo *pi, *pi0, *pi1, *pi2, *pi3;
-	pageinfo *fl;
+	pageinfo *fl[MEM_NORDER];
+	size_t nfl;
 	pte_t *ptep, *ptep1;
 	int i;
 
@@ -598,9 +2004,9 @@ pmap_check(void)
 	assert(pi1 && pi1 != pi0);
 	assert(pi2 && pi2 != pi1 && pi2 != pi0);
 
-	// temporarily steal the rest of the free pages
-	fl = mem_freelist;
-	mem_freelist = NULL;
+	// temporarily steal the rest of the free pages,
+	// including any our CPU has cached
+	mem_steal(fl, &nfl);
 
 	// should be no free memory
 	assert(mem_alloc() == NULL);
@@ -707,7 +2113,7 @@ pmap_check(void)
 	assert(pmap_bootpdir[PDX(VM_USERLO)] == PTE_ZERO);
 	assert(pi0->refcount == 0);
 	assert(mem_alloc() == pi0);
-	assert(mem_freelist == NULL);
+	assert(mem_nfree() == 0);
 
 	// test pmap_remove with large, non-ptable-aligned regions
 	mem_free(pi1);
@@ -716,14 +2122,14 @@ pmap_check(void)
 	assert(pmap_insert(pmap_bootpdir, pi0, va+PAGESIZE, 0));
 	assert(pmap_insert(pmap_bootpdir, pi0, va+PTSIZE-PAGESIZE, 0));
 	assert(PGADDR(pmap_bootpdir[PDX(VM_USERLO)]) == mem_pi2phys(pi1));
-	assert(mem_freelist == NULL);
+	assert(mem_nfree() == 0);
 	mem_free(pi2);
 	assert(pmap_insert(pmap_bootpdir, pi0, va+PTSIZE, 0));
 	assert(pmap_insert(pmap_bootpdir, pi0, va+PTSIZE+PAGESIZE, 0));
 	assert(pmap_insert(pmap_bootpdir, pi0, va+PTSIZE*2-PAGESIZE, 0));
 	assert(PGADDR(pmap_bootpdir[PDX(VM_USERLO+PTSIZE)])
 		== mem_pi2phys(pi2));
-	assert(mem_freelist == NULL);
+	assert(mem_nfree() == 0);
 	mem_free(pi3);
 	assert(pmap_insert(pmap_bootpdir, pi0, va+PTSIZE*2, 0));
 	assert(pmap_insert(pmap_bootpdir, pi0, va+PTSIZE*2+PAGESIZE, 0));
@@ -731,7 +2137,7 @@ pmap_check(void)
 	assert(pmap_insert(pmap_bootpdir, pi0, va+PTSIZE*3-PAGESIZE, 0));
 	assert(PGADDR(pmap_bootpdir[PDX(VM_USERLO+PTSIZE*2)])
 		== mem_pi2phys(pi3));
-	assert(mem_freelist == NULL);
+	assert(mem_nfree() == 0);
 	assert(pi0->refcount == 10);
 	assert(pi1->refcount == 1);
 	assert(pi2->refcount == 1);
@@ -739,17 +2145,17 @@ pmap_check(void)
 	pmap_remove(pmap_bootpdir, va+PAGESIZE, PTSIZE*3-PAGESIZE*2);
 	assert(pi0->refcount == 2);
 	assert(pi2->refcount == 0); assert(mem_alloc() == pi2);
-	assert(mem_freelist == NULL);
+	assert(mem_nfree() == 0);
 	pmap_remove(pmap_bootpdir, va, PTSIZE*3-PAGESIZE);
 	assert(pi0->refcount == 1);
 	assert(pi1->refcount == 0); assert(mem_alloc() == pi1);
-	assert(mem_freelist == NULL);
+	assert(mem_nfree() == 0);
 	pmap_remove(pmap_bootpdir, va+PTSIZE*3-PAGESIZE, PAGESIZE);
 	assert(pi0->refcount == 0);	// pi3 might or might not also be freed
 	pmap_remove(pmap_bootpdir, va+PAGESIZE, PTSIZE*3);
 	assert(pi3->refcount == 0);
 	mem_alloc(); mem_alloc();	// collect pi0 and pi3
-	assert(mem_freelist == NULL);
+	assert(mem_nfree() == 0);
 
 	// check pointer arithmetic in pmap_walk
 	mem_free(pi0);
@@ -771,7 +2177,7 @@ pmap_check(void)
 	pi0->refcount = 0;
 
 	// give free list back
-	mem_freelist = fl;
+	mem_unsteal(fl, nfl);
 
 	// free the pages we filched
 	mem_free(pi0);
@@ -779,6 +2185,147 @@ pmap_check(void)
 	mem_free(pi2);
 	mem_free(pi3);
 
+	// check page-granular copy-on-write, into a different page table
+	va = VM_USERLO;
+	pi0 = mem_alloc();
+	assert(pmap_insert(pmap_bootpdir, pi0, va+PAGESIZE, SYS_RW | PTE_W));
+	assert(pmap_copy(pmap_bootpdir, va+PAGESIZE,
+			pmap_bootpdir, va+PTSIZE+3*PAGESIZE, PAGESIZE*2));
+	assert(pi0->refcount == 2);
+	ptep = pmap_walk(pmap_bootpdir, va+PAGESIZE, 0);
+	assert(PGADDR(*ptep) == mem_pi2phys(pi0) && !(*ptep & PTE_W));
+	ptep = pmap_walk(pmap_bootpdir, va+PTSIZE+3*PAGESIZE, 0);
+	assert(PGADDR(ptep[0]) == mem_pi2phys(pi0) && !(ptep[0] & PTE_W));
+	assert(ptep[1] == PTE_ZERO);
+	pmap_remove(pmap_bootpdir, va, PTSIZE*2);
+	assert(pi0->refcount == 0);
+
+	// check superpage promotion, sharing, and splitting
+	size_t nfree = mem_nfree();
+	for (i = 0; i < NPTENTRIES; i++) {
+		pi = mem_alloc();
+		assert(pi != NULL);
+		*(int*)mem_pi2ptr(pi) = i;
+		assert(pmap_insert(pmap_bootpdir, pi, va + i*PAGESIZE,
+				SYS_RW | PTE_U | PTE_W));
+	}
+	assert(pmap_promote(pmap_bootpdir, va));
+	assert(pmap_bootpdir[PDX(va)] & PTE_PS);
+	pi = mem_phys2pi(PGADDR(pmap_bootpdir[PDX(va)]));
+	assert(pi->super && pi->refcount == 1);
+	assert(va2pa(pmap_bootpdir, va+5*PAGESIZE) == mem_pi2phys(pi+5));
+	assert(*(int*)mem_pi2ptr(pi+5) == 5);
+	// sharing all 4MB keeps the superpage whole
+	assert(pmap_copy(pmap_bootpdir, va, pmap_bootpdir, va+PTSIZE, PTSIZE));
+	assert(pmap_bootpdir[PDX(va+PTSIZE)] & PTE_PS);
+	assert(pi->super && pi->refcount == 2);
+	// sharing one page makes its pages individually counted
+	assert(pmap_copy(pmap_bootpdir, va+5*PAGESIZE,
+			pmap_bootpdir, va+2*PTSIZE, PAGESIZE));
+	assert(!pi->super && pi[5].refcount == 3 && pi[6].refcount == 2);
+	assert(va2pa(pmap_bootpdir, va+2*PTSIZE) == mem_pi2phys(pi+5));
+	assert(pmap_bootpdir[PDX(va)] & PTE_PS);
+	// walking into a superpage splits it into a page table
+	ptep = pmap_walk(pmap_bootpdir, va+PTSIZE+6*PAGESIZE, 1);
+	assert(ptep != NULL && !(pmap_bootpdir[PDX(va+PTSIZE)] & PTE_PS));
+	assert(PGADDR(*ptep) == mem_pi2phys(pi+6) && !(*ptep & PTE_W));
+	pmap_remove(pmap_bootpdir, va, PTSIZE*3);
+	assert(pi[0].refcount == 0 && pi[5].refcount == 0);
+	assert(mem_nfree() == nfree);
+
+	// check word-at-a-time page merging
+	pi0 = mem_alloc(); pi1 = mem_alloc(); pi2 = mem_alloc();
+	memset(mem_pi2ptr(pi0), 0, PAGESIZE);		// reference
+	memset(mem_pi2ptr(pi1), 0, PAGESIZE);		// source
+	memset(mem_pi2ptr(pi2), 0, PAGESIZE);		// dest
+	uint8_t *sb = mem_pi2ptr(pi1), *db = mem_pi2ptr(pi2);
+	sb[1] = 1; sb[4] = 2; sb[PAGESIZE-1] = 3;
+	db[0] = 4; db[8] = 5;
+	mem_incref(pi2);
+	pte_t rpte = mem_pi2phys(pi0), spte = mem_pi2phys(pi1);
+	pte_t dpte = mem_pi2phys(pi2) | SYS_RW | PTE_P | PTE_U | PTE_W;
+	pmap_mergepage(&rpte, &spte, &dpte, VM_USERLO, MERGEOP_NONE);
+	assert(PGADDR(dpte) == mem_pi2phys(pi2));
+	assert(db[0] == 4 && db[1] == 1 && db[4] == 2 && db[8] == 5);
+	assert(db[PAGESIZE-1] == 3 && db[2] == 0);
+	sb[9] = 6; db[9] = 7;				// conflicting byte
+	pmap_mergepage(&rpte, &spte, &dpte, VM_USERLO, MERGEOP_NONE);
+	assert(dpte == PTE_ZERO && pi2->refcount == 0);
+	// words changed on both sides get combined by a merge operator
+	pi2 = mem_alloc();
+	db = mem_pi2ptr(pi2);
+	memset(sb, 0, PAGESIZE);
+	memset(db, 0, PAGESIZE);
+	mem_incref(pi2);
+	dpte = mem_pi2phys(pi2) | SYS_RW | PTE_P | PTE_U | PTE_W;
+	uint32_t *sw = (uint32_t*)sb, *dw = (uint32_t*)db;
+	sw[0] = 3; dw[0] = 4; sw[1] = 5; dw[2] = 6;
+	pmap_mergepage(&rpte, &spte, &dpte, VM_USERLO, MERGEOP_ADD);
+	assert(PGADDR(dpte) == mem_pi2phys(pi2));
+	assert(dw[0] == 7 && dw[1] == 5 && dw[2] == 6);
+	sw[0] = -1; dw[0] = 2;
+	pmap_mergepage(&rpte, &spte, &dpte, VM_USERLO, MERGEOP_MAX);
+	assert(dw[0] == 2);
+	pmap_mergepage(&rpte, &spte, &dpte, VM_USERLO, MERGEOP_MIN);
+	assert(dw[0] == (uint32_t)-1);
+	// a merge that leaves the page all zero maps the zero page instead
+	memset(db, 0, PAGESIZE);
+	memset(sb, 0, PAGESIZE);
+	pmap_mergepage(&rpte, &spte, &dpte, VM_USERLO, MERGEOP_NONE);
+	assert(PGADDR(dpte) == PTE_ZERO && pi2->refcount == 0);
+	assert((dpte & SYS_RW) == SYS_RW && !(dpte & PTE_W));
+	mem_free(pi0);
+	mem_free(pi1);
+
+	// check incremental snapshots
+	pde_t *pd = pmap_newpdir(), *rpd = pmap_newpdir();
+	pi0 = mem_alloc();
+	assert(pmap_insert(pd, pi0, va, SYS_RW | PTE_U | PTE_W));
+	pmap_snap(pd, rpd);
+	assert(rpd[PDX(va)] == pd[PDX(va)] && !(pd[PDX(va)] & PTE_W));
+	pi = mem_phys2pi(PGADDR(pd[PDX(va)]));
+	assert(pi->refcount == 2);
+	pmap_snap(pd, rpd);			// nothing changed
+	assert(pi->refcount == 2);
+	ptep = pmap_walk(pd, va, 1);		// unshares pd's page table
+	assert(pi->refcount == 1 && pi0->refcount == 2);
+	pmap_snap(pd, rpd);			// old snapshot table goes away
+	assert(rpd[PDX(va)] == pd[PDX(va)] && pi0->refcount == 1);
+	mem_decref(mem_ptr2pi(pd), pmap_freepdir);
+	mem_decref(mem_ptr2pi(rpd), pmap_freepdir);
+	assert(pi0->refcount == 0);
+
+	// check deferred address space teardown
+	pd = pmap_newpdir();
+	pi0 = mem_alloc();
+	assert(pmap_insert(pd, pi0, va, SYS_RW | PTE_U | PTE_W));
+	pd = pmap_detach(pd);
+	assert(pd[PDX(va)] == PTE_ZERO && pi0->refcount == 1);
+	while (pmap_reap())
+		;
+	assert(pi0->refcount == 0);
+	mem_decref(mem_ptr2pi(pd), pmap_freepdir);
+
+	// check that read-only regions share the zero page table
+	// until something writes to them
+	pd = pmap_newpdir();
+	pi = mem_ptr2pi(pmap_zeroptab);
+	int zrefs = pi->refcount;
+	pmap_setperm(pd, va, PTSIZE*2, SYS_READ);
+	assert(PGADDR(pd[PDX(va)]) == mem_phys(pmap_zeroptab));
+	assert(PGADDR(pd[PDX(va+PTSIZE)]) == mem_phys(pmap_zeroptab));
+	assert(!(pd[PDX(va)] & PTE_W) && pi->refcount == zrefs + 2);
+	assert(pmap_getpte(pd, va) == PMAP_ZEROPTE);
+	pmap_setperm(pd, va, PAGESIZE, SYS_READ);	// nothing to change
+	assert(pi->refcount == zrefs + 2);
+	ptep = pmap_walk(pd, va+PAGESIZE, 1);		// unshares it
+	assert(PGADDR(pd[PDX(va)]) != mem_phys(pmap_zeroptab));
+	assert(*ptep == PMAP_ZEROPTE && pi->refcount == zrefs + 1);
+	for (i = 0; i < NPTENTRIES; i++)
+		assert(pmap_zeroptab[i] == PMAP_ZEROPTE);
+	mem_decref(mem_ptr2pi(pd), pmap_freepdir);
+	assert(pi->refcount == zrefs);
+
 	cprintf("pmap_check() succeeded!\n");
 }
 
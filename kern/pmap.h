@@ -17,6 +17,7 @@
 #include <inc/assert.h>
 #include <inc/mmu.h>
 #include <inc/vm.h>
+#include <inc/syscall.h>
 
 #include <kern/mem.h>
 
@@ -43,20 +44,68 @@ extern uint8_t pmap_zero[PAGESIZE];
 // instead the page fault handler creates copies of the zero page on demand.
 #define PTE_ZERO	((uint32_t)pmap_zero)
 
+// A zero mapping with the same nominal permissions as PTE pte.
+#define pmap_zeropte(pte)	(PTE_ZERO | (PGOFF(pte) & ~(PTE_W | PTE_D)))
+
+// A range of pages in which pmap_merge() combines words changed on both sides
+// with an operator set by SYS_MERGEOP, instead of reporting a conflict.
+typedef struct pmap_mergeop {
+	uint32_t	va;		// Start of the range
+	uint32_t	size;		// Size of the range, 0 if entry unused
+	uint32_t	op;		// MERGEOP_* operator
+} pmap_mergeop;
+
+
+// Whether pmap_merge() spreads big merges over idle CPUs (1, the default)
+// or does them all itself (0).  Override with, e.g.,
+// DEFS += -DPMAP_MERGEPAR=0 in conf/env.mk.
+#ifndef PMAP_MERGEPAR
+#define PMAP_MERGEPAR	1
+#endif
+
+// Page tables each idle CPU keeps pre-cleared (see pmap_ptabidle()).
+#define PMAP_PTABPOOL	8
 
 void pmap_init(void);
 pte_t *pmap_newpdir(void);
 void pmap_freepdir(pageinfo *pdirpi);
+void pmap_freepdirlater(pageinfo *pdirpi);
+bool pmap_reap(void);
+pte_t *pmap_detach(pde_t *pdir);
 void pmap_freeptab(pageinfo *ptabpi);
+bool pmap_ptabidle(void);
 pte_t *pmap_walk(pde_t *pdir, uint32_t uva, bool writing);
+pte_t pmap_getpte(pde_t *pdir, uint32_t uva);
 pte_t *pmap_insert(pde_t *pdir, pageinfo *pi, uint32_t uva, int perm);
 void pmap_remove(pde_t *pdir, uint32_t uva, size_t size);
 void pmap_inval(pde_t *pdir, uint32_t uva, size_t size);
+void pmap_tlbflush(void);
+void pmap_invaldefer(void);
+void pmap_invalflush(void);
+void pmap_invalsync(void);
+bool pmap_promote(pde_t *pdir, uint32_t va);
+bool pmap_splitall(pde_t *pdir);
 int pmap_copy(pde_t *spdir, uint32_t sva, pde_t *dpdir, uint32_t dva,
 		size_t size);
+int pmap_share(pde_t *spdir, uint32_t sva, pde_t *dpdir, uint32_t dva,
+		size_t size);
+int pmap_unshare(pde_t *pdir, uint32_t va, size_t size);
 int pmap_merge(pde_t *rpdir, pde_t *spdir, uint32_t sva,
-		pde_t *dpdir, uint32_t dva, size_t size);
+		pde_t *dpdir, uint32_t dva, size_t size,
+		const pmap_mergeop *ops, procacct *acct);
+bool pmap_mergehelp(void);
+bool pmap_iszero(const void *pg);
+int pmap_zeroscan(pde_t *pdir, uint32_t va);
+int pmap_samescan(pde_t *pdir, uint32_t va);
+void pmap_sameflush(void);
+int pmap_swapscan(pde_t *pdir, uint32_t va, uint32_t *vas, int *nvas,
+		bool *remote);
+bool pmap_swapped(pde_t *pdir, uint32_t va, uint32_t old, uint32_t rr);
+void pmap_clean(pde_t *pdir, uint32_t va, size_t size);
+void pmap_snap(pde_t *pdir, pde_t *rpdir);
 int pmap_setperm(pde_t *pdir, uint32_t va, uint32_t size, int perm);
+bool pmap_prefault(pde_t *pdir, uint32_t va, uint32_t size);
+void pmap_discard(pde_t *pdir, uint32_t va, uint32_t size);
 void pmap_pagefault(trapframe *tf);
 void pmap_check(void);
 
@@ -9,31 +9,108 @@
 
 #include <inc/string.h>
 #include <inc/syscall.h>
+#include <inc/kdata.h>
 
 #include <kern/cpu.h>
+#include <kern/cons.h>
 #include <kern/mem.h>
 #include <kern/trap.h>
 #include <kern/proc.h>
 #include <kern/init.h>
 #include <kern/file.h>
 #include <kern/net.h>
+#include <kern/slab.h>
+#include <kern/trace.h>
+#include <kern/mp.h>
+
+#include <dev/lapic.h>
 
 proc proc_null;		// null process - just leave it initialized to 0
 
 proc *proc_root;	// root process, once it's created in init()
 
-// LAB 2: insert your scheduling data structure declarations here.
-
-proc *queue_head;
-spinlock _proc_queue_lock;
+// Each CPU has its own ready queues in its cpu struct,
+// so CPUs normally schedule without touching any shared lock.
+// An idle CPU steals work from the other CPUs' queues.
+//
+// The queues form a multi-level feedback scheduler.
+// A process runs for up to PROC_QUANTUM(pri) timer ticks at a time,
+// and drops a level each time it uses a whole quantum.
+// Processes that have been stopped or waiting, such as a shell
+// that was waiting for input or for a child, come back at the top level.
+// Every PROC_BOOSTTICKS ticks a CPU moves everything back to the top,
+// so CPU-bound processes can't be starved forever.
+#define PROC_QUANTUM(pri)	(1 << (pri))
+#define PROC_BOOSTTICKS		64
+
+static slab_cache proc_cache;	// where proc structs come from
+
+static volatile int32_t proc_nqueued;	// procs on all ready queues
+
+// Keeps proc_free() from freeing procs proc_scanidle() is walking past.
+static spinlock proc_treelock;
+
+// Where proc_scanidle() is in its pass over the stopped processes:
+// the preorder number of the process it's scanning and the next 4MB there.
+// A new pass starts only if some process has stopped since the last began.
+static uint32_t proc_zscanidx;
+static uint32_t proc_zscanva = VM_USERLO;
+static volatile int32_t proc_nstops;	// Times a process has stopped
+static int32_t proc_zscanstops;		// proc_nstops when this pass began
+static bool proc_zscanfutile;		// Pass found nothing to page out
 
 void
 proc_init(void)
 {
 	if (!cpu_onboot())
 		return;
-  spinlock_init(&_proc_queue_lock);
-  queue_head = NULL;
+	slab_init(&proc_cache, "proc", sizeof(proc));
+	spinlock_init(&proc_treelock);
+	assert(PAGESIZE / proc_cache.size <= (RR_RW >> RR_SLOTSHIFT) + 1);
+
+	// Give each CPU its ready queue lock, here on the boot CPU,
+	// since others may queue processes to APs before they're up,
+	// its kernel data page, numbering the CPUs as SYS_TRACE does,
+	// and a page table mapping that page for proc_run() to use.
+	cpu *c;
+	int i = 0;
+	for (c = &cpu_boot; c != NULL; c = c->next, i++) {
+		spinlock_init(&c->readylock);
+		pageinfo *dpi = mem_alloc(), *tpi = mem_alloc();
+		assert(dpi != NULL && tpi != NULL);
+		mem_incref(dpi);
+		mem_incref(tpi);
+		kdata *kd = mem_pi2ptr(dpi);
+		memset(kd, 0, PAGESIZE);
+		kd->seq = i;
+		kd->node = net_node;
+		kd->cpu = i;
+		kd->ncpu = ncpu;
+		clock_kdata(kd);
+		c->kdata = kd;
+		c->kdatapt = mem_pi2ptr(tpi);
+		memset(c->kdatapt, 0, PAGESIZE);
+		c->kdatapt[PTX(VM_KDATA)] = mem_phys(kd) | PTE_P | PTE_U;
+	}
+}
+
+// Procs are allocated several to a page from a slab cache,
+// so the remote reference naming a proc carries its slot within the page
+// in the RR's perm bits, which are otherwise unused for proc RRs.
+uint32_t
+proc_rr(proc *p)
+{
+	uint32_t slot = (mem_phys(p) & (PAGESIZE-1)) / proc_cache.size;
+	return RRCONS(net_node, mem_phys(p), slot << RR_SLOTSHIFT);
+}
+
+// Find the local proc named by a proc RR from this node.
+proc *
+proc_rrptr(uint32_t rr)
+{
+	assert(RRNODE(rr) == net_node);
+	uint32_t slot = (rr & RR_RW) >> RR_SLOTSHIFT;
+	return mem_ptr(RRADDR(rr) + slot * proc_cache.size);
 }
 
 // Allocate and initialize a new proc as child 'cn' of parent 'p'.
@@ -41,19 +118,17 @@ proc_init(void)
 proc *
 proc_alloc(proc *p, uint32_t cn)
 {
-  pageinfo *pi = mem_alloc();
-	if (!pi) {
+	proc *cp = slab_alloc(&proc_cache);
+	if (!cp) {
     warn("proc_alloc: no memory for new process\n");
 		return NULL;
   }
-	mem_incref(pi);
 
-	proc *cp = (proc*)mem_pi2ptr(pi);
 	memset(cp, 0, sizeof(proc));
 	spinlock_init(&cp->lock);
 	cp->parent = p;
 	cp->state = PROC_STOP;
-	cp->home = RRCONS(net_node, mem_phys(cp), 0);
+	cp->home = proc_rr(cp);
 
 	// Integer register state
 	cp->sv.tf.ds = CPU_GDT_UDATA | 3;
@@ -69,23 +144,419 @@ proc_alloc(proc *p, uint32_t cn)
 	return cp;
 }
 
-// Put process p in the ready state and add it to the ready queue.
+// Return the proc after q in a preorder walk of the tree rooted at top,
+// or NULL at the end of the walk.
+proc *
+proc_walknext(proc *top, proc *q)
+{
+  int cn = 0;
+  while(1) {
+    for(; cn < PROC_CHILDREN; cn++)
+      if(q->child[cn] != NULL)
+        return q->child[cn];
+    if(q == top)
+      return NULL;
+    proc *pp = q->parent;   // go on with q's next sibling
+    for(cn = 0; pp->child[cn] != q; cn++)
+      ;
+    cn++;
+    q = pp;
+  }
+}
+
+// Free stopped child p and all its descendants, with their memory,
+// so that p's parent can reuse p's child number for a fresh process.
+// Only does so if all of them are stopped and have never been seen
+// by other nodes, which may still hold references to them;
+// otherwise leaves them all as they are and returns false.
+// The proc structs go back to their slab cache's per-CPU free list,
+// and their page directories get reaped in the background.
+bool
+proc_free(proc *p)
+{
+  proc *q;
+  spinlock_acquire(&proc_treelock);
+  for(q = p; q != NULL; q = proc_walknext(p, q))
+    if(q->state != PROC_STOP || q->rpcnode != 0 || q->zscans != 0
+        || RRNODE(q->home) != net_node || mem_ptr2pi(q)->shared) {
+      spinlock_release(&proc_treelock);
+      return 0;
+    }
+
+  // Free leaves first, working our way back up to p.
+  q = p;
+  while(1) {
+    int cn;
+    for(cn = 0; cn < PROC_CHILDREN && q->child[cn] == NULL; cn++)
+      ;
+    if(cn < PROC_CHILDREN) {
+      q = q->child[cn];
+      continue;
+    }
+    proc *pp = q->parent;
+    if(pp != NULL) {    // not parentless, as net_rxckpt() makes some
+      for(cn = 0; pp->child[cn] != q; cn++)
+        ;
+      pp->child[cn] = NULL;
+    }
+    if(q->pdir != NULL)
+      mem_decref(mem_ptr2pi(q->pdir), pmap_freepdirlater);
+    if(q->rpdir != NULL)
+      mem_decref(mem_ptr2pi(q->rpdir), pmap_freepdirlater);
+    slab_free(&proc_cache, q);
+    if(q == p) {
+      spinlock_release(&proc_treelock);
+      return 1;
+    }
+    q = pp;
+  }
+}
+
+// Claim stopped child p's memory for its parent to work on,
+// waiting for any idle CPUs scanning it to finish,
+// and keeping them out until proc_pmapunclaim().
+// A system call that traps in between leaves the claim in place
+// until the parent's next GET or PUT on p, which only costs p a scan.
 void
-proc_ready(proc *p)
+proc_pmapclaim(proc *p)
 {
-  spinlock_acquire(&_proc_queue_lock);
-  p->state = PROC_READY;
-  p->readynext = NULL;
-  proc *temp = queue_head;
-  if(!temp) {
-    queue_head = p;
-    spinlock_release(&_proc_queue_lock);
+  spinlock_acquire(&p->lock);
+  while(p->zscans != 0) {
+    spinlock_release(&p->lock);
+    pmap_tlbflush();  // a scanner may be shooting down our TLB
+    pause();
+    spinlock_acquire(&p->lock);
+  }
+  p->pmapbusy = 1;
+  spinlock_release(&p->lock);
+}
+
+void
+proc_pmapunclaim(proc *p)
+{
+  spinlock_acquire(&p->lock);
+  p->pmapbusy = 0;
+  spinlock_release(&p->lock);
+}
+
+// Claim stopped child p's memory as proc_pmapclaim() does,
+// first calling off any batch of its pages still being paged out
+// to another node (see net_swapout()), whose pages then just stay here.
+// If 'fetch' is set and some of p's pages live on other nodes,
+// start pulling them back, as p can't run or be copied from without them,
+// and return false: the parent must wait, and net_rxpullone()
+// wakes it once they're all back.  Also returns false while an earlier
+// fetch (see SYS_WILLNEED) is still going.  Caller holds the parent's lock.
+bool
+proc_pmapready(proc *p, bool fetch)
+{
+  spinlock_acquire(&p->lock);
+  p->pmapbusy = 1;
+  if(p->swapping && net_swapcancel(p)) {
+    p->swapping = 0;
+    p->zscans--;    // the batch's claim
+  }
+  while(p->zscans != 0) {
+    spinlock_release(&p->lock);
+    pmap_tlbflush();
+    pause();
+    spinlock_acquire(&p->lock);
+  }
+  spinlock_release(&p->lock);
+  return !p->pullstop && (!fetch || !p->paged || !net_fetch(p));
+}
+
+// Stopped process p's pages have all come back from other nodes
+// (see proc_pmapready()): wake its parent if it's waiting for p,
+// as proc_ret() would.
+void
+proc_wakeparent(proc *p)
+{
+  proc *parent = p->parent;
+  spinlock_acquire(&parent->lock);
+  if(parent->waitchild != p && !parent->waitany) {
+    spinlock_release(&parent->lock);
     return;
   }
-  while(temp->readynext)
-    temp = temp->readynext;
-  temp->readynext = p;
-  spinlock_release(&_proc_queue_lock);
+  parent->waitchild = NULL;
+  parent->waitany = 0;
+  bool away = parent->state == PROC_AWAY;
+  spinlock_release(&parent->lock);
+  if(away)
+    net_rpcwake(parent);  // a stand-in for a remote caller
+  else
+    proc_ready(parent);
+}
+
+// Use idle time to give back the memory of pages that have turned out
+// all zero in stopped processes, a page table at a time
+// (see pmap_zeroscan()), to share read-only pages with identical
+// contents among them (see pmap_samescan()), and when we're short
+// of memory, to page cold pages out to other nodes (see net_swapout()).
+// Only a stopped process's parent may change it,
+// and the parent claims it first (proc_pmapclaim()), so we leave alone
+// processes that are running or claimed, and hold off parents meanwhile.
+// Returns true if there may be more to do.
+bool
+proc_scanidle(void)
+{
+  if(proc_root == NULL || (proc_zscanidx == 0 && proc_zscanva == VM_USERLO
+      && proc_zscanstops == proc_nstops
+      && (proc_zscanfutile || !net_swapneeded())))
+    return 0;   // racy peek: nothing has stopped since the last pass
+
+  spinlock_acquire(&proc_treelock);
+  if(proc_zscanidx == 0 && proc_zscanva == VM_USERLO) {
+    // While memory is short, keep making passes to page out
+    // as long as the last one got anywhere.
+    if(proc_zscanstops == proc_nstops
+        && (proc_zscanfutile || !net_swapneeded())) {
+      spinlock_release(&proc_treelock);
+      return 0;
+    }
+    proc_zscanstops = proc_nstops;  // start a new pass
+    proc_zscanfutile = net_swapneeded();
+    pmap_sameflush();   // let go of pages from the last one
+  }
+  proc *q = proc_root;
+  uint32_t i;
+  for(i = 0; q != NULL && i < proc_zscanidx; i++)
+    q = proc_walknext(proc_root, q);
+  if(q == NULL) {   // end of the pass
+    proc_zscanidx = 0;
+    proc_zscanva = VM_USERLO;
+    spinlock_release(&proc_treelock);
+    return 1;
+  }
+
+  // Claim q if we can, and find the next page table of it worth a look.
+  // The root process is never stopped for a parent, so we skip it.
+  bool claimed = 0;
+  uint32_t va = proc_zscanva;
+  if(q != proc_root) {
+    spinlock_acquire(&q->lock);
+    claimed = q->state == PROC_STOP && !q->pmapbusy && !q->swapping
+        && q->rpcnode == 0 && RRNODE(q->home) == net_node;
+    if(claimed)
+      q->zscans++;
+    spinlock_release(&q->lock);
+  }
+  if(claimed)
+    while(va < VM_USERHI && !(q->pdir[PDX(va)] & PTE_W))
+      va += PTSIZE;   // shared or absent page table: nothing for us
+  if(!claimed || va >= VM_USERHI) {
+    proc_zscanidx++;
+    proc_zscanva = VM_USERLO;
+  } else if((proc_zscanva = va + PTSIZE) == VM_USERHI) {
+    proc_zscanidx++;
+    proc_zscanva = VM_USERLO;
+  }
+  spinlock_release(&proc_treelock);
+
+  if(claimed) {
+    bool kept = 0, progress = 0;
+    if(va < VM_USERHI) {
+      pmap_zeroscan(q->pdir, va);
+      pmap_samescan(q->pdir, va);
+      kept = net_swapout(q, va, &progress);
+      if(progress)
+        proc_zscanfutile = 0;
+    }
+    if(!kept) {   // else the batch paging out holds our claim
+      spinlock_acquire(&q->lock);
+      q->zscans--;
+      spinlock_release(&q->lock);
+    }
+  }
+  return 1;
+}
+
+// Add process p to CPU c's ready queue for its priority,
+// at the back, or at the front if 'front' is set.
+static void
+proc_enqueue(cpu *c, proc *p, bool front)
+{
+  spinlock_acquire(&c->readylock);
+  p->state = PROC_READY;
+  p->readycpu = c;
+  if(front) {
+    p->readynext = c->readyhead[p->pri];
+    if(c->readyhead[p->pri] == NULL)
+      c->readytail[p->pri] = p;
+    c->readyhead[p->pri] = p;
+  } else {
+    p->readynext = NULL;
+    if(c->readytail[p->pri])
+      c->readytail[p->pri]->readynext = p;
+    else
+      c->readyhead[p->pri] = p;
+    c->readytail[p->pri] = p;
+  }
+  lockadd(&proc_nqueued, 1);
+  spinlock_release(&c->readylock);   // (xchg orders this before waking)
+}
+
+// Put process p in the ready state and add it to a ready queue:
+// that of the CPU it last ran on, whose caches are most likely still warm,
+// or ours if it has never run.
+void
+proc_ready(proc *p)
+{
+  if(p->state == PROC_STOP || p->state == PROC_WAIT
+      || p->state == PROC_RPC) {
+    p->pri = 0;   // boost processes that have been blocked
+    p->ticks = 0;
+    p->runticks = 0;
+  }
+  cpu *c = p->runcpu ? p->runcpu : cpu_cur();
+  proc_enqueue(c, p, 0);
+
+  // Wake the chosen CPU if it's halted; if it's busy,
+  // wake some other idle CPU to steal p, unless p is just yielding.
+  if(!cpu_wake(c) && p != proc_cur())
+    cpu_wakeone(c);
+}
+
+// Start stopped child p as a member of its parent's gang:
+// a group of children, such as tfork() threads, that the parent
+// will wait for all together, so the slowest one decides when it's done.
+// Rather than queueing the whole group behind one another,
+// deal the members out round-robin to the CPUs at the front of the top level,
+// starting with the CPU after the parent's, which keeps running it.
+// Gang members aren't demoted, and preempt non-members on the next tick.
+void
+proc_gang(proc *p)
+{
+  proc *parent = p->parent;
+  cpu *c = parent->gangcpu ? parent->gangcpu : cpu_cur();
+  if((c = c->next) == NULL)
+    c = &cpu_boot;
+  parent->gangcpu = c;
+
+  p->gang = 1;
+  p->pri = 0;
+  p->ticks = 0;
+  proc_enqueue(c, p, 1);
+  if(!cpu_wake(c) && c != cpu_cur())
+    cpu_wakeone(c);   // busy: maybe an idle CPU can steal it sooner
+}
+
+// Is anything on CPU c's ready queues at a priority better than 'pri'?
+static bool
+proc_readyabove(cpu *c, int pri)
+{
+  int i;
+  for(i = 0; i < pri; i++)
+    if(c->readyhead[i])
+      return 1;
+  return 0;
+}
+
+// Take the highest-priority process off CPU c's ready queues,
+// returning it locked, or return NULL if the queues are empty.
+static proc *
+proc_dequeue(cpu *c)
+{
+  if(!proc_readyabove(c, CPU_NREADY))   // racy peek, rechecked below
+    return NULL;
+  spinlock_acquire(&c->readylock);
+  proc *p = NULL;
+  int i;
+  for(i = 0; i < CPU_NREADY && !p; i++) {
+    p = c->readyhead[i];
+    if(p) {
+      c->readyhead[i] = p->readynext;
+      if(c->readyhead[i] == NULL)
+        c->readytail[i] = NULL;
+      p->pri = i;   // in case a boost moved it up
+      lockadd(&proc_nqueued, -1);
+      spinlock_acquire(&p->lock);
+    }
+  }
+  spinlock_release(&c->readylock);
+  return p;
+}
+
+// If p is still waiting on a ready queue, take it off
+// and return true with p locked; otherwise return false.
+static bool
+proc_unready(proc *p)
+{
+  cpu *c = p->readycpu;
+  if(c == NULL || p->state != PROC_READY)   // racy peek
+    return 0;
+  spinlock_acquire(&c->readylock);
+  bool found = 0;
+  int i;
+  for(i = 0; i < CPU_NREADY && !found; i++) {
+    proc **pp = &c->readyhead[i], *prev = NULL;
+    while(*pp && *pp != p) {
+      prev = *pp;
+      pp = &prev->readynext;
+    }
+    found = (*pp == p);
+    if(found) {
+      *pp = p->readynext;
+      if(c->readytail[i] == p)
+        c->readytail[i] = prev;
+      p->pri = i;
+      lockadd(&proc_nqueued, -1);
+      spinlock_acquire(&p->lock);
+    }
+  }
+  spinlock_release(&c->readylock);
+  return found;
+}
+
+// Move everything on CPU c's lower-priority queues to the top level.
+static void
+proc_boost(cpu *c)
+{
+  spinlock_acquire(&c->readylock);
+  int i;
+  for(i = 1; i < CPU_NREADY; i++) {
+    if(!c->readyhead[i])
+      continue;
+    if(c->readytail[0])
+      c->readytail[0]->readynext = c->readyhead[i];
+    else
+      c->readyhead[0] = c->readyhead[i];
+    c->readytail[0] = c->readytail[i];
+    c->readyhead[i] = c->readytail[i] = NULL;
+  }
+  spinlock_release(&c->readylock);
+}
+
+// How many processes are ready but waiting for a CPU, on any CPU's queue?
+int
+proc_nready(void)
+{
+  return proc_nqueued;
+}
+
+// Is anything on any CPU's ready queue?
+static bool
+proc_anyready(void)
+{
+  cpu *c;
+  for(c = &cpu_boot; c != NULL; c = c->next)
+    if(proc_readyabove(c, CPU_NREADY))
+      return 1;
+  return 0;
+}
+
+// Look for a ready process on the other CPUs' queues,
+// starting with the next CPU after c and wrapping around.
+static proc *
+proc_steal(cpu *c)
+{
+  cpu *v = c;
+  while((v = v->next ? v->next : &cpu_boot) != c) {
+    proc *p = proc_dequeue(v);
+    if(p)
+      return p;
+  }
+  return NULL;
 }
 
 // Save the current process's state before switching to another process.
@@ -102,6 +573,61 @@ proc_save(proc *p, trapframe *tf, int entry)
   if(entry == 0)
     p->sv.tf.eip -= 2;   // move back an instruction because the syscall 
                          // pushes eip of the NEXT instruction on the tf
+
+  // Charge p for the time it's run since proc_run() started it.
+  uint64_t now = rdtsc();
+  p->acct.tsc += now - p->runtsc;
+  p->runtsc = now;
+
+  // If p used the FPU since it started running, save that state too.
+  // We can't leave it in the FPU for later: p may next run on another CPU
+  // (or node), or have its state read or replaced by its parent.
+  cpu *c = cpu_cur();
+  if(c->fpuowner == p) {
+    fpu_save(&p->sv.fx);
+    c->fpuowner = NULL;
+    lcr0(rcr0() | CR0_TS);
+  }
+}
+
+// Add what stopped child cp has used since it last reported in
+// to the resource usage of its parent p, which must be running it on us.
+void
+proc_acctmerge(proc *p, proc *cp)
+{
+  procacct *a = &p->acct, *c = &cp->acct, *s = &cp->acctsent;
+  a->tsc += c->tsc - s->tsc;
+  a->syscalls += c->syscalls - s->syscalls;
+  a->cowfaults += c->cowfaults - s->cowfaults;
+  a->zerofaults += c->zerofaults - s->zerofaults;
+  a->pulls += c->pulls - s->pulls;
+  a->merged += c->merged - s->merged;
+  a->conflicts += c->conflicts - s->conflicts;
+  a->migrations += c->migrations - s->migrations;
+  *s = *c;
+}
+
+// Load the FPU state of process p, which is running on this CPU,
+// on its first FPU, MMX or SSE instruction since it started running:
+// CR0_TS makes that instruction take a T_DEVICE trap to here.
+// A process that never used the FPU before gets the default state,
+// so processes that never use it pay nothing to switch.
+void
+proc_fpuload(proc *p)
+{
+  cpu *c = cpu_cur();
+  assert(c->fpuowner == NULL || c->fpuowner == p);
+  clts();
+  if(c->fpuowner == p)
+    return;
+  if(p->sv.pff & PFF_USEFPU) {
+    p->sv.fx.mxcsr &= PROC_MXCSRMASK;	// reserved bits would #GP
+    fpu_restore(&p->sv.fx);
+  } else {
+    fpu_init();
+    p->sv.pff |= PFF_USEFPU;
+  }
+  c->fpuowner = p;
 }
 
 // Go to sleep waiting for a given child process to finish running.
@@ -114,32 +640,74 @@ proc_wait(proc *p, proc *cp, trapframe *tf)
   p->waitchild = cp;
   proc_save(p, tf, 0);
   spinlock_release(&p->lock);
+
+  // If the child hasn't started running yet, hand our CPU straight to it
+  // instead of leaving it in a ready queue for someone to find.
+  // proc_ret() hands the CPU back to us the same way.
+  if(proc_unready(cp))
+    proc_run(cp);
+  proc_sched();
+}
+
+// Go to sleep until any of our children stops running.
+// As with proc_wait(), p must be running and locked on entry,
+// and will re-execute its system call when it wakes up.
+void gcc_noreturn
+proc_waitany(proc *p, trapframe *tf)
+{
+  p->state = PROC_WAIT;
+  p->waitany = 1;
+  proc_save(p, tf, 0);
+  spinlock_release(&p->lock);
   proc_sched();
 }
 
 void gcc_noreturn
 proc_sched(void)
 {
-  spinlock_acquire(&_proc_queue_lock);
-  while(!queue_head) {
-    // Release the spinlock while waiting
-    spinlock_release(&_proc_queue_lock);
-    while(!queue_head) {
-      // Enable interrupts briefly for keyboard, serial
+  // Leave the last process's pdir loaded, in case it's the next to run
+  // here too: then proc_run() needn't reload CR3 and lose its TLB entries.
+  // cpu.pdir still names it, so shootdowns still reach us
+  // and pmap_reap() won't free it while we have it loaded.
+  cpu *c = cpu_cur();
+  pmap_invalflush();
+  while(1) {
+    proc *to_run = proc_dequeue(c);
+    if(!to_run)
+      to_run = proc_steal(c);
+    if(to_run)
+      proc_run(to_run);
+
+    // Nothing to run: let go of the old pdir so pmap_reap() can free it.
+    if(c->pdir != NULL) {
+      lcr3(mem_phys(pmap_bootpdir));
+      c->pdir = NULL;
+    }
+
+    // Use idle time to process received packets queued to us,
+    // or to write out buffered kernel console output,
+    // or to help other CPUs' big merges along,
+    // or to free dead address spaces,
+    // or to give back stopped processes' all-zero pages,
+    // or else to pre-zero pages for future page faults
+    // and pre-clear page tables for pmap_walk(),
+    // enabling interrupts briefly between chunks of work.
+    if (net_rxdrain() || cons_logidle() || pmap_mergehelp() || pmap_reap()
+        || proc_scanidle() || mem_zeroidle() || pmap_ptabidle()) {
       sti();
       pause();
       cli();
+      continue;
     }
-    spinlock_acquire(&_proc_queue_lock);
-    // Now make sure queue_head didn't get snatched while we were
-    // acquiring the spinlock
-  }
 
-  proc *to_run = queue_head;
-  queue_head = queue_head->readynext;
-  spinlock_acquire(&to_run->lock);
-  spinlock_release(&_proc_queue_lock);
-  proc_run(to_run);
+    // Nothing at all to do: halt until an interrupt.
+    // proc_ready() sends us T_WAKEUP if it makes work for us,
+    // and the timer wakes us periodically in any case.
+    cpu_idle();
+    if(!proc_anyready())
+      asm volatile("sti; hlt; cli" : : : "memory");  // sti delays IRQs a cycle
+    cpu_busy();
+  }
 }
 
 // Switch to and run a specified process, which must already be locked.
@@ -151,11 +719,91 @@ proc_run(proc *p)
   cpu *curr = cpu_cur();
   curr->proc = p;
   p->runcpu = curr;
+  trace(TRACE_SWITCH, p, p->sv.tf.eip, 0);
+  p->runtsc = rdtsc();
   spinlock_release(&p->lock);
-	lcr3(mem_phys(p->pdir));
+  if(curr->pdir == p->pdir) {
+    pmap_invalflush();  // but for any we deferred invalidating
+    curr->cr3skips++;   // p's user TLB entries are still good
+  } else {
+    curr->tlbdefer = 0; // lcr3 flushes anything deferred
+    // Leave any old pdir before we stop naming it in cpu.pdir,
+    // so that pmap_reap() can't free it while it's still loaded.
+    if(curr->pdir != NULL)
+      lcr3(mem_phys(pmap_bootpdir));
+    curr->pdir = p->pdir;	// before lcr3: see pmap_inval()
+    lcr3(mem_phys(p->pdir));
+    curr->cr3loads++;
+  }
+  // Only processes allowed to be nondeterministic see this CPU's
+  // kernel data page.  The PDE may have named another CPU's page table
+  // last time p ran, so drop anything we still cache of it.
+  pde_t kpde = (p->sv.pff & PFF_NONDET) ?
+      mem_phys(curr->kdatapt) | PTE_P | PTE_U : 0;
+  if(p->pdir[PDX(VM_KDATA)] != kpde) {
+    p->pdir[PDX(VM_KDATA)] = kpde;
+    invlpg((void*)VM_KDATA);
+  }
+  curr->kticked = 0;  // not p's tick to be charged for
   trap_return(&p->sv.tf);
 }
 
+// Charge a timer tick to the current process, which was in user mode.
+// Preempts it if it has used up its quantum, demoting it a level,
+// or if a higher-priority process is waiting for this CPU.
+void
+proc_tick(trapframe *tf)
+{
+  proc *p = proc_cur();
+  cpu *c = cpu_cur();
+  p->cputicks++;
+  p->runticks++;
+  if(++c->boostticks >= PROC_BOOSTTICKS) {
+    c->boostticks = 0;
+    proc_boost(c);
+    p->pri = 0;
+    p->ticks = 0;
+    proc_yield(tf);   // give the boosted processes a turn
+  }
+  if(!p->gang && c->readyhead[0] && c->readyhead[0]->gang)
+    proc_yield(tf);   // make room for a gang member (racy peek is fine)
+  if(++p->ticks >= PROC_QUANTUM(p->pri)) {
+    if((p->sv.pff & PFF_BALANCE) && p->runticks >= NET_BALANCEMIN)
+      net_balance(tf);  // may move it to another node instead
+    if(p->pri < CPU_NREADY-1 && !p->gang)
+      p->pri++;
+    p->ticks = 0;
+    proc_yield(tf);
+  }
+  if(proc_readyabove(c, p->pri))
+    proc_yield(tf);
+}
+
+// Charge a timer tick that came while the current process was in the kernel,
+// partway through a long system call that has saved its progress
+// so it can pick up from there when restarted (see sysmemop()).
+// Preempts it, restarting the system call later, as proc_tick() would;
+// but boosts and balancing wait until it's back in user mode.
+void
+proc_tickcall(trapframe *tf)
+{
+  proc *p = proc_cur();
+  cpu *c = cpu_cur();
+  p->cputicks++;
+  p->runticks++;
+  bool expired = ++p->ticks >= PROC_QUANTUM(p->pri);
+  if(!expired && !proc_readyabove(c, p->pri))
+    return;
+  if(expired) {
+    if(p->pri < CPU_NREADY-1 && !p->gang)
+      p->pri++;
+    p->ticks = 0;
+  }
+  proc_save(p, tf, 0);	// restart the system call
+  proc_ready(p);
+  proc_sched();
+}
+
 // Yield the current CPU to another ready process.
 // Called while handling a timer interrupt.
 void gcc_noreturn
@@ -186,12 +834,23 @@ proc_ret(trapframe *tf, int entry)
   }
   spinlock_acquire(&me->lock);
   me->state = PROC_STOP;
+  me->gang = 0;
+  lockadd(&proc_nstops, 1);   // something for proc_scanidle() to look at
   proc_save(me, tf, entry);
   spinlock_release(&me->lock);
 
   spinlock_acquire(&parent->lock);
-  if(parent->waitchild == me) {
+  if(parent->waitchild == me || parent->waitany) {
     parent->waitchild = NULL;
+    parent->waitany = 0;
+    if(parent->state == PROC_AWAY) {
+      // Parent is a stand-in waiting for us on behalf of a remote caller
+      spinlock_release(&parent->lock);
+      net_rpcwake(parent);
+      proc_sched();
+    }
+    parent->pri = 0;    // boost it as proc_ready() would
+    parent->ticks = 0;
     proc_run(parent);
   }
   spinlock_release(&parent->lock);
@@ -204,6 +863,7 @@ static void child(int n);
 static void grandchild(int n);
 
 static struct procstate child_state;
+static struct procstate child_states[4];
 static char gcc_aligned(16) child_stack[4][PAGESIZE];
 
 static volatile uint32_t pingpong = 0;
@@ -242,15 +902,14 @@ proc_check(void)
 	// (Re)start all four children, and wait for them.
 	// This will require preemptive scheduling to complete
 	// if we have less than 4 CPUs.
+	// Do it with one PUT and one GET over the range of all four.
 	cprintf("proc_check: spawning 4 children\n");
-	for (i = 0; i < 4; i++) {
-		cprintf("spawning child %d\n", i);
-		sys_put(SYS_START, i, NULL, NULL, NULL, 0);
-	}
+	sys_put(SYS_START, SYS_RANGE(0, 4), NULL, NULL, NULL, 0);
 
-	// Wait for all 4 children to complete.
+	// Wait for all 4 children to complete, collecting all their states.
+	sys_get(SYS_REGS, SYS_RANGE(0, 4), child_states, NULL, NULL, 0);
 	for (i = 0; i < 4; i++)
-		sys_get(0, i, NULL, NULL, NULL, 0);
+		assert(child_states[i].tf.trapno == T_SYSCALL);
 	cprintf("proc_check() 4-child test succeeded\n");
 
 	// Now do a trap handling test using all 4 children -
@@ -18,6 +18,7 @@
 
 #include <kern/spinlock.h>
 #include <kern/pmap.h>
+#include <kern/net.h>
 #include <inc/file.h>
 
 typedef enum proc_state {
@@ -27,11 +28,33 @@ typedef enum proc_state {
 	PROC_WAIT,		// Waiting to synchronize with child
 	PROC_MIGR,		// Migrating to another node
 	PROC_AWAY,		// Migrated to another node
-	PROC_PULL,		// Migrated to another node
+	PROC_PULL,		// Pulling address space from another node
+	PROC_RPC,		// Waiting for a remote GET/PUT to finish
 } proc_state;
 
+// Maximum number of page pulls one process keeps in flight at once.
+#define PROC_NPULL	8
+
+// MXCSR bits a process's saved FPU state may have set: the rest are
+// reserved, including DAZ, which not every processor supports.
+#define PROC_MXCSRMASK	0xffbf
+
+// One page, page table, or page directory being pulled from a remote node.
+typedef struct procpull {
+	uint32_t	rr;		// RR we are pulling, 0 if slot unused
+	void		*pg;		// Local page we are pulling into
+	uint32_t	*pte;		// PTE mapping pg if a page, else NULL
+	uint8_t		pglev;		// Level: 0=page, 1=page table, 2=pdir
+	uint8_t		arrived;	// Bits 0-2: which parts have arrived
+	uint8_t		node;		// Node asked: home, or peer with a copy
+	bool		direct;		// Asked home not to redirect us
+	bool		sent;		// Request transmitted at least once
+	bool		retx;		// Request transmitted more than once
+	uint32_t	sentat;		// net_ticks when first transmitted
+} procpull;
+
 // Thread control block structure.
-// Consumes 1 physical memory page, though we don't use all of it.
+// Allocated from a slab cache, several procs to a physical page.
 typedef struct proc {
 
 	// Master spinlock protecting proc's state.
@@ -44,8 +67,21 @@ typedef struct proc {
 	// Scheduling state for this process.
 	proc_state	state;		// current state
 	struct proc	*readynext;	// chain on ready queue
+	struct cpu	*readycpu;	// cpu whose ready queue we were put on
+	uint8_t		pri;		// Priority level: 0 = highest
+	uint32_t	ticks;		// Timer ticks used of current quantum
+	uint64_t	cputicks;	// Total timer ticks we've run for
+	uint32_t	runticks;	// Ticks run since last blocked or arrived
+	bool		gang;		// Started with SYS_GANG, not yet stopped
+	struct cpu	*gangcpu;	// cpu our last gang child went to
 	struct cpu	*runcpu;	// cpu we're running on if running
 	struct proc	*waitchild;	// child proc if waiting for child
+	bool		waitany;	// waiting for any child to stop
+
+	// Resource usage (see SYS_ACCT in inc/syscall.h).
+	procacct	acct;		// Ours plus what our children reported
+	procacct	acctsent;	// Part of acct our parent has added in
+	uint64_t	runtsc;		// rdtsc() when proc_run() last ran us
 
 	// Save area for user-visible state when process is not running.
 	procstate	sv;
@@ -53,20 +89,80 @@ typedef struct proc {
 	// Virtual memory state for this process.
 	pde_t		*pdir;		// Working page directory
 	pde_t		*rpdir;		// Reference page directory
+	uint32_t	pflast;		// Last page resolved by pmap_pagefault
+	uint64_t	pfoomat;	// When it first ran out of memory, or 0
+	uint32_t	seqlo, seqhi;	// Range set with SYS_SEQUENTIAL
+	pmap_mergeop	mergeops[MERGEOP_NRANGES]; // Set with SYS_MERGEOP
+
+	// Progress of a GET or PUT preempted partway through (see sysmemop()),
+	// so that when the system call restarts it can pick up where it was.
+	uint8_t		opchild;	// Children of the range already done
+	uint32_t	opdone;		// Bytes done of this child's memory op
+
+	// Who's working on our memory while we're stopped, under lock:
+	// idle CPUs scanning for zero or duplicate pages (see proc_scanidle()),
+	// or our parent.
+	uint8_t		zscans;		// Idle CPUs scanning our pages now
+	bool		pmapbusy;	// Parent has claimed our memory
+
+	// Paging out to other nodes while stopped (see net_swapout()).
+	// A batch in flight holds one of the zscans above until it's done.
+	bool		swapping;	// Batch in flight, under lock
+	bool		paged;		// Some of our pages live elsewhere now
+	bool		pullstop;	// Pulling them back for our parent
+	uint8_t		swapnode;	// Node the batch went to
+	uint8_t		nswap;		// Pages of it not yet acknowledged
+	struct proc	*swapnext;	// Next on list of procs paging out
+	net_timer	swaptimer;	// Gives up on the batch
+	uint32_t	swapva[NET_SWAPBATCH];	// Where each page is mapped
+	uint32_t	swaprr[NET_SWAPBATCH];	// Our RR for it, 0 once done
+
+	// Checkpointing a subtree of children, or restoring one (see net_ckpt()).
+	uint8_t		ckptnode;	// Node our request went to, 0 if none
+	bool		ckptwait;	// No answer to it yet
+	uint32_t	ckptkey;	// Key it asks about
+	uint32_t	ckptrr;		// RR the answer carried, 0 for none
+	net_ckptrec	*ckptsave;	// Records of the checkpoint we're saving
+
+	// Being checkpointed or restored ourselves.
+	uint32_t	ckptrec;	// RR of our record while pulling it
+	bool		ckptbad;	// Couldn't restore from it
+	net_ckptrec	*ckptpg;	// Our record
+	bool		pulltabs;	// Leave our pages remote when pulling
+	struct net_ckptslot *ckpt;	// Checkpoint we hold part of, if any
 
 	// Network and process migration state.
 	uint32_t	home;		// RR to proc's home node and addr
 	uint32_t	rrpdir;		// RR to migration source's page dir
 	uint8_t		migrdest;	// Destination we're migrating to
 	struct proc	*migrnext;	// Next on list of migrating procs
+	net_timer	migrtimer;	// Retransmit timer for migrate request
+	uint32_t	migrsentat;	// net_ticks when request first sent
+	bool		migrretx;	// Request has been retransmitted
 
 	// Remote reference pulling state.
 	struct proc	*pullnext;	// Next on list of page-pulling procs
 	uint32_t	pullva;		// Where we are pulling in our addr spc
-	uint32_t	pullrr;		// Current RR we are pulling
-	void		*pullpg;	// Local page we are pulling into
-	uint8_t		pglev;		// Level: 0=page, 1=page table, 2=pdir
-	uint8_t		arrived;	// Bits 0-2: which parts have arrived
+	bool		pullwait;	// Waiting for a pdir or ptab to arrive
+	int		npull;		// Number of pulls in flight
+	procpull	pull[PROC_NPULL]; // Pulls in flight
+	net_timer	pulltimer;	// Retransmit timer for pulls in flight
+
+	// Remote GET/PUT state, as the caller (see net_rpc()).
+	uint32_t	rpcseq;		// Number of our latest request
+	uint8_t		rpcnode;	// Node it went to, 0 if none pending
+	uint8_t		rpcstat;	// NET_RPCWAIT until the reply arrives
+	int		rpctrap;	// Trap the reply says to take, or -1
+	procstate	*rpcsv;		// Page holding GET SYS_REGS result
+	net_timer	rpctimer;	// Retransmit timer for our request
+	uint32_t	rpcsentat;	// net_ticks when request first sent
+	bool		rpcretx;	// Request has been retransmitted
+
+	// Remote GET/PUT state, as a remote caller's proxy (see net_rxrpcrq()).
+	uint32_t	rpclast;	// Number of latest request seen
+	uint8_t		rpcfrom;	// Node it came from
+	bool		rpcdone;	// We've done it and replied
+	int		rpclasttrap;	// Trap we replied with, or -1
 } proc;
 
 #define proc_cur()	(cpu_cur()->proc)
@@ -81,14 +177,30 @@ extern proc *proc_root;
 
 void proc_init(void);	// Initialize process management code
 proc *proc_alloc(proc *p, uint32_t cn);	// Allocate new child
+bool proc_free(proc *p);	// Free stopped child and descendants
+proc *proc_walknext(proc *top, proc *q);	// Preorder walk of a subtree
 void proc_ready(proc *p);	// Make process p ready
+void proc_gang(proc *p);	// Start p alongside its gang siblings
 void proc_save(proc *p, trapframe *tf, int entry);	// save process state
+void proc_fpuload(proc *p);	// give running process the FPU
+void proc_acctmerge(proc *p, proc *cp);	// add child's usage into ours
 void proc_wait(proc *p, proc *cp, trapframe *tf) gcc_noreturn;
+void proc_waitany(proc *p, trapframe *tf) gcc_noreturn;
 void proc_sched(void) gcc_noreturn;	// Find and run some ready process
 void proc_run(proc *p) gcc_noreturn;	// Run a specific process
 void proc_yield(trapframe *tf) gcc_noreturn;	// Yield to another process
+void proc_tick(trapframe *tf);	// Account for a timer tick
+void proc_tickcall(trapframe *tf); // Same, during a long system call
+void proc_pmapclaim(proc *p);	// Keep the zero scanner out of p's memory
+void proc_pmapunclaim(proc *p);	// Let it back in
+bool proc_pmapready(proc *p, bool fetch); // Claim it, pages all here
+void proc_wakeparent(proc *p);	// p's pages are back: wake its parent
+bool proc_scanidle(void);	// Look for zero and same pages while idle
+int proc_nready(void);		// Number of processes waiting for a CPU
 void proc_ret(trapframe *tf, int entry) gcc_noreturn;	// Return to parent
 void proc_check(void);			// Check process code
+uint32_t proc_rr(proc *p);		// Remote reference naming proc p
+proc *proc_rrptr(uint32_t rr);		// Local proc named by our own RR
 
 
 #endif // !PIOS_KERN_PROC_H
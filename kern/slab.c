@@ -0,0 +1,165 @@
+/*
+ * Slab allocator for small, fixed-size kernel objects.
+ *
+ * Objects are carved from pages obtained with mem_alloc,
+ * and free objects are chained through their first word.
+ * Pages are never returned to the page allocator:
+ * a cache's footprint is its high-water mark, which is small
+ * compared to the one-page-per-object scheme it replaces.
+ *
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#include <inc/string.h>
+#include <inc/assert.h>
+
+#include <kern/cpu.h>
+#include <kern/mem.h>
+#include <kern/slab.h>
+
+
+static int slab_ncache;		// Number of caches with per-CPU lists
+static spinlock slab_ncachelock;
+
+
+void
+slab_init(slab_cache *sc, const char *name, size_t size)
+{
+	size = ROUNDUP(MAX(size, sizeof(void*)), SLAB_ALIGN);
+	assert(size <= PAGESIZE);	// one object per page, if it must be
+
+	memset(sc, 0, sizeof(*sc));
+	sc->name = name;
+	sc->size = size;
+	spinlock_init(&sc->lock);
+
+	if (slab_ncache == 0)
+		spinlock_init(&slab_ncachelock);
+	spinlock_acquire(&slab_ncachelock);
+	sc->idx = slab_ncache++;
+	spinlock_release(&slab_ncachelock);
+	if (sc->idx >= CPU_NSLAB)
+		panic("slab_init: too many caches for %s", name);
+}
+
+// Carve a fresh page into objects and add them to the cache-wide freelist.
+// Caller must hold sc->lock.
+static bool
+slab_grow(slab_cache *sc)
+{
+	pageinfo *pi = mem_alloc();
+	if (pi == NULL)
+		return 0;
+	mem_incref(pi);
+
+	uint8_t *pg = mem_pi2ptr(pi);
+	int i, n = PAGESIZE / sc->size;
+	for (i = n-1; i >= 0; i--) {
+		void **obj = (void**)(pg + i * sc->size);
+		*obj = sc->free;
+		sc->free = obj;
+	}
+	sc->nfree += n;
+	sc->npage++;
+	return 1;
+}
+
+// Move up to SLAB_BATCH objects from the cache-wide freelist
+// to the current CPU's list, growing the cache if needed.
+static void
+slab_refill(slab_cache *sc, cpu *c)
+{
+	spinlock_acquire(&sc->lock);
+	if (sc->free == NULL)
+		slab_grow(sc);
+	int n;
+	for (n = 0; n < SLAB_BATCH && sc->free != NULL; n++) {
+		void **obj = sc->free;
+		sc->free = *obj;
+		*obj = c->slabfree[sc->idx];
+		c->slabfree[sc->idx] = obj;
+	}
+	sc->nfree -= n;
+	spinlock_release(&sc->lock);
+	c->nslabfree[sc->idx] += n;
+}
+
+// Move SLAB_BATCH objects from the current CPU's list
+// back to the cache-wide freelist.
+static void
+slab_drain(slab_cache *sc, cpu *c)
+{
+	spinlock_acquire(&sc->lock);
+	int n;
+	for (n = 0; n < SLAB_BATCH; n++) {
+		void **obj = c->slabfree[sc->idx];
+		c->slabfree[sc->idx] = *obj;
+		*obj = sc->free;
+		sc->free = obj;
+	}
+	sc->nfree += n;
+	spinlock_release(&sc->lock);
+	c->nslabfree[sc->idx] -= n;
+}
+
+void *
+slab_alloc(slab_cache *sc)
+{
+	cpu *c = cpu_cur();
+	if (c->slabfree[sc->idx] == NULL)
+		slab_refill(sc, c);
+
+	void **obj = c->slabfree[sc->idx];
+	if (obj == NULL) {
+		warn("slab_alloc: out of memory for %s", sc->name);
+		return NULL;
+	}
+	c->slabfree[sc->idx] = *obj;
+	c->nslabfree[sc->idx]--;
+	return obj;
+}
+
+void
+slab_free(slab_cache *sc, void *obj)
+{
+	assert(mem_ptr2pi(obj)->refcount > 0);	// must be a slab page
+
+	cpu *c = cpu_cur();
+	*(void**)obj = c->slabfree[sc->idx];
+	c->slabfree[sc->idx] = obj;
+	if (++c->nslabfree[sc->idx] > SLAB_CPUMAX)
+		slab_drain(sc, c);
+}
+
+void
+slab_check(void)
+{
+	static slab_cache sc;
+	slab_init(&sc, "slab_check", 100);
+	assert(sc.size == 128);
+
+	// Allocate a few pages' worth of objects, and make sure they're
+	// suitably aligned, distinct, and packed several per page.
+	void *objs[PAGESIZE/128 * 3];
+	int i, j, n = sizeof(objs) / sizeof(objs[0]);
+	for (i = 0; i < n; i++) {
+		objs[i] = slab_alloc(&sc);
+		assert(objs[i] != NULL);
+		assert(((uint32_t)objs[i] & (SLAB_ALIGN-1)) == 0);
+		memset(objs[i], 0xa5, sc.size);
+		for (j = 0; j < i; j++)
+			assert(objs[j] != objs[i]);
+	}
+	assert(sc.npage == 3);
+
+	// Freed objects get reused before the cache grows again.
+	for (i = 0; i < n; i++)
+		slab_free(&sc, objs[i]);
+	for (i = 0; i < n; i++)
+		objs[i] = slab_alloc(&sc);
+	assert(sc.npage == 3);
+	for (i = 0; i < n; i++)
+		slab_free(&sc, objs[i]);
+
+	cprintf("slab_check() succeeded!\n");
+}
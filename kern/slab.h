@@ -0,0 +1,49 @@
+/*
+ * Slab allocator for small, fixed-size kernel objects.
+ *
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#ifndef PIOS_KERN_SLAB_H
+#define PIOS_KERN_SLAB_H
+#ifndef PIOS_KERNEL
+# error "This is a kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+#include <kern/spinlock.h>
+
+
+// An object cache hands out objects of one size, carved from whole pages.
+// Each CPU keeps a short private list of free objects in its cpu struct,
+// so the common alloc/free path takes no lock, just like mem_alloc;
+// a cache-wide list behind a spinlock absorbs the overflow.
+typedef struct slab_cache {
+	const char	*name;		// For debugging output
+	size_t		size;		// Object size, rounded to SLAB_ALIGN
+	int		idx;		// Index of per-CPU free lists in cpu struct
+	spinlock	lock;		// Protects the fields below
+	void		*free;		// Cache-wide free object list
+	int		nfree;		// Number of objects on that list
+	int		npage;		// Pages taken from mem_alloc
+} slab_cache;
+
+#define SLAB_ALIGN	64		// Keep objects on separate cache lines
+#define SLAB_BATCH	8		// Objects moved per refill or drain
+#define SLAB_CPUMAX	(SLAB_BATCH*2)	// Max objects on a per-CPU list
+
+// Set up an object cache for objects of a given size,
+// which must be at most PAGESIZE after rounding.
+// Objects over PAGESIZE/2 get a page each, as large procs do.
+void slab_init(slab_cache *sc, const char *name, size_t size);
+
+// Allocate an uninitialized object; returns NULL if out of memory.
+void *slab_alloc(slab_cache *sc);
+
+// Return an object to its cache.
+void slab_free(slab_cache *sc, void *obj);
+
+void slab_check(void);
+
+#endif // !PIOS_KERN_SLAB_H
@@ -10,21 +10,81 @@
 
 #include <inc/assert.h>
 #include <inc/x86.h>
+#include <inc/string.h>
 
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
 #include <kern/cons.h>
+#include <kern/pmap.h>
 
 
+// Registry of spinlock_init() call sites, for lock profiling.
+// The last entry collects any sites that don't fit.
+static spinlock_site spinlock_sites[SPINLOCK_NSITES];
+static int spinlock_nsites;
+static volatile uint32_t spinlock_sitelock;	// can't be a spinlock itself
+
+// Find or create the profile record for a spinlock_init() call site.
+static spinlock_site *
+spinlock_site_get(const char *file, int line)
+{
+    while (xchg(&spinlock_sitelock, 1) != 0)
+        pause();
+    spinlock_site *s;
+    int i;
+    for (i = 0; i < spinlock_nsites; i++) {
+        s = &spinlock_sites[i];
+        if (s->file == file && s->line == line)
+            goto found;
+    }
+    if (spinlock_nsites < SPINLOCK_NSITES-1) {
+        s = &spinlock_sites[spinlock_nsites++];
+        s->file = file;
+        s->line = line;
+    } else {
+        s = &spinlock_sites[SPINLOCK_NSITES-1];
+        s->file = "(other)";
+    }
+found:
+    lockadd(&s->nlocks, 1);
+    xchg(&spinlock_sitelock, 0);
+    return s;
+}
+
 void
 spinlock_init_(struct spinlock *lk, const char *file, int line)
 {
+    memset(lk, 0, sizeof(*lk));
     lk->file = file;
     lk->line = line;
-    lk->locked = 0;
-    lk->cpu = NULL;
+    lk->site = spinlock_site_get(file, line);
 }
 
+// Spin once while waiting for a lock.
+static inline void
+spinlock_spin(uint32_t *spins)
+{
+    pmap_tlbflush();    // lock holder may be waiting on our TLB
+    pause();
+    (*spins)++;
+}
+
+#ifdef SPINLOCK_MCS
+// Allocate one of this CPU's MCS queue nodes.
+static spinlock_qnode *
+spinlock_qalloc(void)
+{
+    cpu *c = cpu_cur();
+    int i;
+    for (i = 0; i < SPINLOCK_MCSNODES; i++)
+        if (!c->mcsnode[i].inuse) {
+            c->mcsnode[i].inuse = 1;
+            return &c->mcsnode[i];
+        }
+    panic("spinlock: more than %d MCS locks held", SPINLOCK_MCSNODES);
+}
+#endif
+
 // Acquire the lock.
 // Loops (spins) until the lock is acquired.
 // Holding a lock for a long time may cause
@@ -32,12 +92,53 @@ spinlock_init_(struct spinlock *lk, const char *file, int line)
 void
 spinlock_acquire(struct spinlock *lk)
 {
+    uint32_t spins = 0;
+    uint64_t start = rdtsc();
+
     if(spinlock_holding(lk))
         panic("Already holding lock.");
+#if defined(SPINLOCK_TAS)
     while(xchg(&(lk->locked), 1) != 0)
-        pause();
+        spinlock_spin(&spins);
+#elif defined(SPINLOCK_MCS)
+    // Join the tail of the queue, then spin on our own node
+    // until our predecessor hands the lock to us.
+    spinlock_qnode *qn = spinlock_qalloc();
+    qn->next = NULL;
+    qn->wait = 1;
+    spinlock_qnode *pred = (spinlock_qnode*)
+        xchg((volatile uint32_t*)&lk->tail, (uint32_t)qn);
+    if (pred != NULL) {
+        pred->next = qn;
+        while (qn->wait)
+            spinlock_spin(&spins);
+    }
+    lk->qnode = qn;
+    lk->locked = 1;
+#else
+    // Take a ticket and wait for it to be served, in FIFO order.
+    uint32_t ticket = xadd(&lk->next, 1);
+    while (lk->owner != ticket)
+        spinlock_spin(&spins);
+    lk->locked = 1;
+#endif
     lk->cpu = cpu_cur();
+    lk->nacquire++;
+    lk->nspin += spins;
+    lk->tsc = rdtsc();
+
+    spinlock_site *s = lk->site;
+    if (s != NULL) {
+        lockadd(&s->nacquire, 1);
+        if (spins > 0) {
+            lockadd(&s->ncontend, 1);
+            lockadd(&s->nspin, spins);
+            lockadd64(&s->waittsc, lk->tsc - start);
+        }
+    }
+#ifndef SPINLOCK_LEAN
     debug_trace(read_ebp(), lk->eips);
+#endif
 }
 
 // Release the lock.
@@ -46,9 +147,41 @@ spinlock_release(struct spinlock *lk)
 {
     if(!spinlock_holding(lk))
         panic("Not holding lock");
+    uint64_t held = rdtsc() - lk->tsc;
+    if (held > lk->maxhold)
+        lk->maxhold = held;
+    spinlock_site *s = lk->site;
+    if (s != NULL) {
+        lockadd64(&s->holdtsc, held);
+        uint64_t max;
+        while ((max = s->maxhold) < held
+                && !cmpxchg64(&s->maxhold, max, held))
+            pause();
+    }
     lk->cpu = NULL;
     lk->eips[0] = 0;
+#if defined(SPINLOCK_TAS)
+    xchg(&(lk->locked), 0);
+#elif defined(SPINLOCK_MCS)
+    spinlock_qnode *qn = lk->qnode;
+    lk->qnode = NULL;
+    lk->locked = 0;
+    if (qn->next == NULL) {
+        // No known successor: try to swing the tail back to empty.
+        if (cmpxchg((volatile uint32_t*)&lk->tail, (uint32_t)qn, 0)
+                == (uint32_t)qn)
+            goto done;
+        // Someone is enqueueing; wait for them to link in.
+        while (qn->next == NULL)
+            pause();
+    }
+    qn->next->wait = 0;
+done:
+    qn->inuse = 0;
+#else
     xchg(&(lk->locked), 0);
+    xadd(&lk->owner, 1);
+#endif
 }
 
 // Check whether this cpu is holding the lock.
@@ -59,6 +192,110 @@ spinlock_holding(spinlock *lock)
         && lock->locked;
 }
 
+void
+rwlock_init_(rwlock *lk, const char *file, int line)
+{
+    memset(lk, 0, sizeof(*lk));
+    lk->file = file;
+    lk->line = line;
+}
+
+// Acquire the lock for reading, shared with other readers.
+// Waits while a writer holds the lock or is waiting for it.
+void
+rwlock_rdacquire(rwlock *lk)
+{
+    uint32_t spins = 0;
+    if (rwlock_wrholding(lk))
+        panic("rwlock_rdacquire: already holding lock for writing");
+    while (1) {
+        uint32_t st = lk->state;
+        if (lk->wwait == 0 && !(st & RWLOCK_WRITER)
+                && cmpxchg(&lk->state, st, st+1) == st)
+            return;
+        spinlock_spin(&spins);
+    }
+}
+
+void
+rwlock_rdrelease(rwlock *lk)
+{
+    assert(lk->state != 0 && !(lk->state & RWLOCK_WRITER));
+    lockadd((volatile int32_t*)&lk->state, -1);
+}
+
+// Acquire the lock for writing, excluding all readers and other writers.
+void
+rwlock_wracquire(rwlock *lk)
+{
+    uint32_t spins = 0;
+    if (rwlock_wrholding(lk))
+        panic("rwlock_wracquire: already holding lock");
+    lockadd(&lk->wwait, 1);     // hold off new readers
+    while (cmpxchg(&lk->state, 0, RWLOCK_WRITER) != 0)
+        spinlock_spin(&spins);
+    lockadd(&lk->wwait, -1);
+    lk->cpu = cpu_cur();
+}
+
+void
+rwlock_wrrelease(rwlock *lk)
+{
+    if (!rwlock_wrholding(lk))
+        panic("rwlock_wrrelease: not holding lock");
+    lk->cpu = NULL;
+    xchg(&lk->state, 0);
+}
+
+// Check whether this cpu is holding the lock for writing.
+int
+rwlock_wrholding(rwlock *lk)
+{
+    return lk->cpu == cpu_cur() && lk->state == RWLOCK_WRITER;
+}
+
+// Fill top[] with the lock call sites in use, by total wait time,
+// largest first, and return how many there are.
+// Counters may still be changing as we read them,
+// so this is only a snapshot, but that's enough to find the hot spots.
+int
+spinlock_top(spinlock_site *top[SPINLOCK_NSITES])
+{
+    int i, j, ntop = 0;
+
+    // Insertion-sort the sites in use by total wait time.
+    for (i = 0; i < SPINLOCK_NSITES; i++) {
+        spinlock_site *s = &spinlock_sites[i];
+        if (s->nlocks == 0)
+            continue;
+        for (j = ntop++; j > 0 && top[j-1]->waittsc < s->waittsc; j--)
+            top[j] = top[j-1];
+        top[j] = s;
+    }
+    return ntop;
+}
+
+// Print the profiles of the n lock call sites with the most wait time.
+void
+spinlock_report(int n)
+{
+    spinlock_site *top[SPINLOCK_NSITES];
+    int i, ntop = spinlock_top(top);
+    if (n > ntop)
+        n = ntop;
+
+    cprintf("CPU %d: top %d of %d lock sites by wait time (TSC cycles):\n",
+        cpu_cur()->id, n, ntop);
+    cprintf("%12s %12s %10s %8s %8s %5s  site\n",
+        "wait", "hold", "maxhold", "acquire", "contend", "locks");
+    for (i = 0; i < n; i++) {
+        spinlock_site *s = top[i];
+        cprintf("%12llu %12llu %10llu %8u %8u %5d  %s:%d\n",
+            s->waittsc, s->holdtsc, s->maxhold,
+            s->nacquire, s->ncontend, s->nlocks, s->file, s->line);
+    }
+}
+
 // Function that simply recurses to a specified depth.
 // The useless return value and volatile parameter are
 // so GCC doesn't collapse it via tail-call elimination.
@@ -73,7 +310,10 @@ void spinlock_check()
 {
 	const int NUMLOCKS=10;
 	const int NUMRUNS=5;
-	int i,j,run;
+	int i,run;
+#ifndef SPINLOCK_LEAN
+	int j;
+#endif
 	const char* file = "spinlock_check";
 	spinlock locks[NUMLOCKS];
 
@@ -83,6 +323,9 @@ void spinlock_check()
 	for(i=0;i<NUMLOCKS;i++) assert(locks[i].cpu==NULL);
 	// Make sure that all locks have the correct debug info.
 	for(i=0;i<NUMLOCKS;i++) assert(locks[i].file==file);
+	// All locks from one call site share a single profile record.
+	for(i=0;i<NUMLOCKS;i++) assert(locks[i].site==locks[0].site);
+	assert(locks[0].site->nlocks == NUMLOCKS);
 
 	for (run=0;run<NUMRUNS;run++) 
 	{
@@ -96,6 +339,7 @@ void spinlock_check()
 		// Make sure that all locks have holding correctly implemented.
 		for(i=0;i<NUMLOCKS;i++)
 			assert(spinlock_holding(&locks[i]) != 0);
+#ifndef SPINLOCK_LEAN
 		// Make sure that top i frames are somewhere in godeep.
 		for(i=0;i<NUMLOCKS;i++) 
 		{
@@ -107,6 +351,12 @@ void spinlock_check()
 					(uint32_t)spinlock_godeep+100);
 			}
 		}
+#endif
+		// Each acquisition was counted, uncontended.
+		for(i=0;i<NUMLOCKS;i++)
+			assert(locks[i].nacquire == run+1);
+		for(i=0;i<NUMLOCKS;i++)
+			assert(locks[i].nspin == 0);
 
 		// Release all locks
 		for(i=0;i<NUMLOCKS;i++) spinlock_release(&locks[i]);
@@ -115,7 +365,32 @@ void spinlock_check()
 		for(i=0;i<NUMLOCKS;i++) assert(locks[i].eips[0]==0);
 		// Make sure that all locks have holding correctly implemented.
 		for(i=0;i<NUMLOCKS;i++) assert(spinlock_holding(&locks[i]) == 0);
+#ifdef SPINLOCK_MCS
+		// All our queue nodes should have been returned.
+		for(i=0;i<SPINLOCK_MCSNODES;i++)
+			assert(!cpu_cur()->mcsnode[i].inuse);
+#elif !defined(SPINLOCK_TAS)
+		// Every ticket handed out has been served.
+		for(i=0;i<NUMLOCKS;i++)
+			assert(locks[i].next == run+1 && locks[i].owner == run+1);
+#endif
 	}
+	// Readers share a reader-writer lock; a writer has it to itself.
+	rwlock rw;
+	rwlock_init(&rw);
+	rwlock_rdacquire(&rw);
+	rwlock_rdacquire(&rw);
+	assert(rw.state == 2 && !rwlock_wrholding(&rw));
+	rwlock_rdrelease(&rw);
+	rwlock_rdrelease(&rw);
+	assert(rw.state == 0);
+	rwlock_wracquire(&rw);
+	assert(rwlock_wrholding(&rw) && rw.wwait == 0);
+	rwlock_wrrelease(&rw);
+	assert(rw.state == 0 && !rwlock_wrholding(&rw));
+
+	assert(locks[0].site->nacquire == NUMLOCKS*NUMRUNS);
+	assert(locks[0].site->ncontend == 0);
 	cprintf("spinlock_check() succeeded!\n");
 }
 
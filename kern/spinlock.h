@@ -19,9 +19,64 @@
 #include <kern/debug.h>
 
 
+// Lock algorithm selection, normally set via DEFS in conf/env.mk:
+//	SPINLOCK_TAS	simple test-and-set lock (unfair; bounces the line)
+//	SPINLOCK_MCS	MCS queue lock: each waiter spins on its own node
+//	(default)	FIFO ticket lock
+// Defining SPINLOCK_LEAN additionally omits the call-stack capture
+// on every acquire, for release builds.
+#if defined(SPINLOCK_TAS) && defined(SPINLOCK_MCS)
+# error "At most one of SPINLOCK_TAS and SPINLOCK_MCS may be defined"
+#endif
+
+// Maximum number of MCS locks one CPU may hold or wait for at once.
+#define SPINLOCK_MCSNODES	16
+
+// MCS queue node: one per lock a CPU is holding or waiting for.
+// These live in the cpu struct so the spinlock API needs no extra argument.
+typedef struct spinlock_qnode {
+	struct spinlock_qnode *volatile next;	// Next waiter in queue
+	volatile uint32_t wait;		// Cleared by our predecessor
+	bool		inuse;		// Node is allocated to some lock
+} spinlock_qnode;
+
+// Maximum number of distinct spinlock_init() call sites we profile;
+// any beyond this are lumped together in one last "other" site.
+#define SPINLOCK_NSITES		64
+
+// Contention profile aggregated over all locks initialized at one call site.
+// Updated atomically, since locks sharing a site (e.g., per-process locks)
+// may be held on different CPUs at once.
+typedef struct spinlock_site {
+	const char	*file;		// Source file of spinlock_init() call
+	int		line;		// Line number of spinlock_init() call
+	volatile int32_t nlocks;	// Number of locks initialized here
+	volatile int32_t nacquire;	// Total acquisitions
+	volatile int32_t ncontend;	// Acquisitions that had to wait
+	volatile int32_t nspin;		// Total spin iterations
+	volatile uint64_t waittsc;	// Total TSC cycles spent waiting
+	volatile uint64_t holdtsc;	// Total TSC cycles spent holding
+	volatile uint64_t maxhold;	// Longest single hold in TSC cycles
+} spinlock_site;
+
 // Mutual exclusion lock.
 typedef struct spinlock {
-	uint32_t locked;	// Is the lock held?
+	volatile uint32_t locked;	// Is the lock held?
+#if !defined(SPINLOCK_TAS) && !defined(SPINLOCK_MCS)
+	volatile uint32_t next;		// Next ticket to hand out
+	volatile uint32_t owner;	// Ticket now being served
+#endif
+#ifdef SPINLOCK_MCS
+	spinlock_qnode *volatile tail;	// Last waiter in queue, or NULL
+	spinlock_qnode	*qnode;		// Queue node of the current holder
+#endif
+
+	// Contention statistics, updated only while holding the lock.
+	uint32_t	nacquire;	// Times acquired
+	uint32_t	nspin;		// Spin iterations spent waiting
+	uint64_t	maxhold;	// Longest hold time in TSC cycles
+	uint64_t	tsc;		// Timestamp of the current acquire
+	spinlock_site	*site;		// Profile for our init call site
 
 	// For debugging:
 	const char *file;	// Source file where spinlock_init() was called
@@ -33,10 +88,39 @@ typedef struct spinlock {
 #define spinlock_init(lk)	spinlock_init_(lk, __FILE__, __LINE__)
 
 
+// Writer-preferring reader-writer spin lock, for read-mostly data.
+// Any number of CPUs may hold it for reading at once;
+// once a writer is waiting, new readers wait until it's done.
+// Not recursive: a CPU must not re-acquire a lock it already holds.
+typedef struct rwlock {
+	volatile uint32_t state;	// Reader count, or RWLOCK_WRITER
+	volatile int32_t wwait;		// Number of writers waiting
+
+	// For debugging:
+	const char *file;	// Source file where rwlock_init() was called
+	int line;		// Line number of rwlock_init()
+	struct cpu *cpu;	// The cpu holding the lock for writing
+} rwlock;
+
+#define RWLOCK_WRITER	0x80000000	// state value while write-locked
+
+#define rwlock_init(lk)		rwlock_init_(lk, __FILE__, __LINE__)
+
+
 void spinlock_init_(spinlock *lk, const char *file, int line);
 void spinlock_acquire(spinlock *lk);
 void spinlock_release(spinlock *lk);
 int spinlock_holding(spinlock *lk);
+int spinlock_top(spinlock_site *top[SPINLOCK_NSITES]);
+void spinlock_report(int n);
+
+void rwlock_init_(rwlock *lk, const char *file, int line);
+void rwlock_rdacquire(rwlock *lk);
+void rwlock_rdrelease(rwlock *lk);
+void rwlock_wracquire(rwlock *lk);
+void rwlock_wrrelease(rwlock *lk);
+int rwlock_wrholding(rwlock *lk);
+
 void spinlock_check();
 
 #endif /* !PIOS_KERN_SPINLOCK_H */
@@ -19,10 +19,19 @@
 #include <kern/proc.h>
 #include <kern/syscall.h>
 #include <kern/net.h>
+#include <kern/mp.h>
+#include <kern/cons.h>
+#include <kern/trace.h>
+
+#include <dev/lapic.h>
 
 // This bit mask defines the eflags bits user code is allowed to set.
 #define FL_USER		(FL_CF|FL_PF|FL_AF|FL_ZF|FL_SF|FL_DF|FL_OF)
 
+// Long GET and PUT memory operations go this many bytes at a time,
+// letting interrupts and preemption in between (see sysmemop()).
+#define SYS_MEMCHUNK	PTSIZE
+
 extern uint8_t net_node;
 
 // During a system call, generate a specific processor trap -
@@ -33,6 +42,9 @@ systrap(trapframe *utf, int trapno, int err)
 {
     utf->trapno = trapno;
     utf->err = err;
+    proc *curr = proc_cur();
+    curr->opchild = 0;  // abandon any GET or PUT in progress
+    curr->opdone = 0;
     proc_ret(utf, 0);
 }
 
@@ -81,8 +93,10 @@ static void checkva(trapframe *utf, uint32_t uva, size_t size)
 void usercopy(trapframe *utf, bool copyout,
 			void *kva, uint32_t uva, size_t size) {
 	checkva(utf, uva, size);
+  pmap_invalsync();     // don't go through stale TLB entries
   cpu *c = cpu_cur();
   c->recover = sysrecover;
+  c->recoverdata = utf;
 
   if(copyout)
     memmove((void*)uva, kva, size);
@@ -101,19 +115,372 @@ do_cputs(trapframe *tf, uint32_t cmd)
   usercopy(tf, 0, tmp, tf->regs.ebx, CPUTS_MAX);
   // Make sure it's null terminated (though it may be less than CPUTS_MAX long)
   //tmp[CPUTS_MAX] = 0;
-	cprintf("%s", tmp);
+	// Synchronously, not through our CPU's ring as cprintf would:
+	// a process printing a lot waits for the console, rather than losing it.
+	size_t len = 0;
+	while (len < CPUTS_MAX && tmp[len] != 0)
+		len++;
+	cons_write(tmp, len);
 	trap_return(tf);	// syscall completed
 }
 
+// Recover from a trap while writing user memory to the console.
+static void gcc_noreturn
+cwriterecover(trapframe *ktf, void *recoverdata)
+{
+  if(spinlock_holding(&cons_lock))
+    spinlock_release(&cons_lock);
+  sysrecover(ktf, recoverdata);
+}
+
 static void
-do_put(trapframe *tf, uint32_t cmd)
+do_cwrite(trapframe *tf, uint32_t cmd)
+{
+  // Write the user's buffer straight to the console devices,
+  // with no copy and no fixed size: a bad pointer just traps.
+  uint32_t uva = tf->regs.ebx;
+  size_t len = tf->regs.ecx;
+  checkva(tf, uva, len);
+  cpu *c = cpu_cur();
+  c->recover = cwriterecover;
+  c->recoverdata = tf;
+  cons_write((const char*)uva, len);
+  c->recover = NULL;
+	trap_return(tf);	// syscall completed
+}
+
+static void
+do_lockstat(trapframe *tf, uint32_t cmd)
+{
+  // Print the kernel's lock profile; this has no effect on the caller.
+  spinlock_report(tf->regs.ebx);
+	trap_return(tf);	// syscall completed
+}
+
+static void
+do_netstat(trapframe *tf, uint32_t cmd)
+{
+  // The counters move with other nodes' traffic: nondeterministic.
+  if(!(proc_cur()->sv.pff & PFF_NONDET))
+    systrap(tf, T_GPFLT, 0);
+  // Copy out a snapshot of this node's network statistics.
+  usercopy(tf, 1, &net_stats, tf->regs.ebx, sizeof(netstats));
+  trap_return(tf);  // syscall completed
+}
+
+static void
+do_ncpu(trapframe *tf, uint32_t cmd)
+{
+  tf->regs.eax = ncpu;
+	trap_return(tf);	// syscall completed
+}
+
+static void
+do_clock(trapframe *tf, uint32_t cmd)
+{
+  // Time is only for those allowed to be nondeterministic.
+  if(!(proc_cur()->sv.pff & PFF_NONDET))
+    systrap(tf, T_GPFLT, 0);
+  uint64_t ns = clock_ns();
+  tf->regs.eax = ns;
+  tf->regs.edx = ns >> 32;
+	trap_return(tf);	// syscall completed
+}
+
+static void
+do_prof(trapframe *tf, uint32_t cmd)
+{
+  // Only the root process gets to see what everyone else is doing.
+  if(proc_cur() != proc_root)
+    systrap(tf, T_GPFLT, 0);
+  debug_prof(tf->regs.ebx, tf->regs.ecx);
+	trap_return(tf);	// syscall completed
+}
+
+static void
+do_trace(trapframe *tf, uint32_t cmd)
+{
+  // The trace is full of timings, so it's only for the nondeterministic.
+  if(!(proc_cur()->sv.pff & PFF_NONDET))
+    systrap(tf, T_GPFLT, 0);
+  if(tf->regs.ebx == TRACE_ENABLE)
+    tf->regs.eax = trace_enable(tf->regs.ecx);
+  else if(tf->regs.ebx == TRACE_READ)
+    tf->regs.eax = trace_read(tf, tf->regs.esi, tf->regs.ecx, tf->regs.edx);
+  else
+    systrap(tf, T_GPFLT, 0);
+	trap_return(tf);	// syscall completed
+}
+
+static void
+do_mergeop(trapframe *tf, uint32_t cmd)
+{
+  uint32_t va = tf->regs.ebx;
+  uint32_t size = tf->regs.ecx;
+  uint32_t op = tf->regs.edx;
+  if(va < VM_USERLO || va > VM_USERHI || size > VM_USERHI - va
+      || PGOFF(va) || PGOFF(size) || op >= MERGEOP_NOPS)
+    systrap(tf, T_GPFLT, 0);
+
+  // Drop the ranges this one overlaps, then add it in a free slot.
+  proc *p = proc_cur();
+  pmap_mergeop *m, *free = NULL;
+  for(m = p->mergeops; m < &p->mergeops[MERGEOP_NRANGES]; m++) {
+    if(m->size != 0 && m->va < va + size && va < m->va + m->size)
+      m->size = 0;
+    if(m->size == 0 && free == NULL)
+      free = m;
+  }
+  if(op != MERGEOP_NONE && size != 0) {
+    if(free == NULL)
+      systrap(tf, T_GPFLT, 0);
+    free->va = va;
+    free->size = size;
+    free->op = op;
+  }
+	trap_return(tf);	// syscall completed
+}
+
+// Apply memory advice hint (see SYS_ADVISE) to an already checked range
+// of p's memory: p is running it, or is a stopped child its parent claimed.
+void
+syscall_advise(proc *p, uint32_t va, uint32_t size, uint32_t hint)
 {
+  if(hint == SYS_WILLNEED) {
+    pmap_prefault(p->pdir, va, size);   // just a hint if memory runs out
+    pmap_inval(p->pdir, va, size);
+  } else if(hint == SYS_SEQUENTIAL) {
+    p->seqlo = va;
+    p->seqhi = va + size;
+  } else {
+    pmap_discard(p->pdir, va, size);
+    pmap_inval(p->pdir, va, size);
+  }
+}
+
+static void
+do_advise(trapframe *tf, uint32_t cmd)
+{
+  uint32_t va = tf->regs.ebx;
+  uint32_t size = tf->regs.ecx;
+  uint32_t hint = tf->regs.edx;
+  if(va < VM_USERLO || va > VM_USERHI || size > VM_USERHI - va
+      || PGOFF(va) || PGOFF(size)
+      || (hint & ~SYS_ADVICE) || !(hint & SYS_ADVICE))
+    systrap(tf, T_GPFLT, 0);
+
+  syscall_advise(proc_cur(), va, size, hint);
+	trap_return(tf);	// syscall completed
+}
+
+// Give a child the state sv from a PUT with SYS_REGS and/or SYS_FPU:
+// its general registers only with SYS_REGS, its FPU state only with SYS_FPU,
+// forcing it to run in user mode with interrupts enabled.
+void
+syscall_putregs(proc *child, const procstate *sv, uint32_t cmd, proc *parent)
+{
+  uint32_t oldpff = child->sv.pff;
+  if(&child->sv != sv) {
+    if(cmd & SYS_REGS) {
+      child->sv.tf = sv->tf;
+      child->sv.pff = (sv->pff & ~PFF_USEFPU) | (child->sv.pff & PFF_USEFPU);
+    }
+    if(cmd & SYS_FPU)
+      child->sv.fx = sv->fx;
+  }
+  if(cmd & SYS_FPU)
+    child->sv.pff |= PFF_USEFPU;    // load sv.fx on its first FPU use
+  child->sv.tf.ds = CPU_GDT_UDATA | 3;
+  child->sv.tf.es = CPU_GDT_UDATA | 3;
+  child->sv.tf.cs = CPU_GDT_UCODE | 3;
+  child->sv.tf.ss = CPU_GDT_UDATA | 3;
+  child->sv.tf.eflags &= FL_USER;
+  child->sv.tf.eflags |= FL_IF;
+  // children can only be nondeterministic if we are
+  child->sv.pff &= parent->sv.pff | ~PFF_NONDET;
+  // and only nondeterministic ones may keep pages shared outright
+  if((oldpff & ~child->sv.pff & PFF_NONDET) && child != &proc_null)
+    pmap_unshare(child->pdir, VM_USERLO, VM_USERHI - VM_USERLO);
+}
+
+// Which memory operation GET or PUT cmd on child does: its SYS_MEMOP part,
+// with SYS_SHARE added for a SYS_COPY that shares pages outright,
+// which only nondeterministic processes may do, on both ends,
+// and not with proc_null.
+static int
+sysmemopof(trapframe *tf, uint32_t cmd, proc *child)
+{
+  int op = cmd & SYS_MEMOP;
+  if(!(cmd & SYS_SHARE))
+    return op;
+  if(op != SYS_COPY || !(proc_cur()->sv.pff & PFF_NONDET)
+      || child == &proc_null || !(child->sv.pff & PFF_NONDET))
+    systrap(tf, T_GPFLT, 0);
+  return op | SYS_SHARE;
+}
+
+// Do memory operation op (SYS_COPY, SYS_MERGE or SYS_ZERO, see sysmemopof())
+// of a GET or PUT on size bytes, from src in spdir to dst in dpdir,
+// or zeroing dst in dpdir.
+// Goes a SYS_MEMCHUNK at a time, recording its progress in opdone
+// and letting interrupts and preemption in between chunks,
+// so that a huge copy or merge doesn't hold the CPU for its whole length.
+// If preempted, the system call restarts later and we resume at opdone.
+static void
+sysmemop(trapframe *tf, int op, proc *child, pde_t *spdir, uint32_t src,
+    pde_t *dpdir, uint32_t dst, uint32_t size)
+{
+  proc *curr = proc_cur();
+  cpu *c = cpu_cur();
+  uint32_t done = curr->opdone;
+  assert(done <= size);
+  while(done < size) {
+    // merges can spread a chunk over the CPUs (see pmap_merge())
+    uint32_t chunk = op == SYS_MERGE && PMAP_MERGEPAR ?
+        SYS_MEMCHUNK * ncpu : SYS_MEMCHUNK;
+    uint32_t n = MIN(chunk, size - done);
+    if(op == SYS_COPY) {
+      pmap_copy(spdir, src + done, dpdir, dst + done, n);
+      if(!((dpdir == curr->pdir ? curr : child)->sv.pff & PFF_NONDET))
+        pmap_unshare(dpdir, dst + done, n); // not for deterministic eyes
+    }
+    else if(op == (SYS_COPY | SYS_SHARE))
+      pmap_share(spdir, src + done, dpdir, dst + done, n);
+    else if(op == SYS_MERGE)
+      pmap_merge(child->rpdir, spdir, src + done, dpdir, dst + done, n,
+          curr->mergeops, &child->acct);
+    else
+      pmap_remove(dpdir, dst + done, n);
+    done += n;
+    if(done == size)
+      break;
+    curr->opdone = done;
+    sti();      // let pending interrupts in
+    pause();
+    cli();
+    if(c->kticked) {
+      c->kticked = 0;
+      proc_tickcall(tf);  // might not return
+    }
+  }
+  curr->opdone = 0;
+}
+
+// Do the operations of PUT v on one stopped child.
+// Children after the first in a range get the first one's register state.
+static void
+sysputone(trapframe *tf, const sysvec *v, proc *child, proc *first)
+{
+  uint32_t cmd = v->cmd;
+  proc *curr = proc_cur();
+  if(cmd & SYS_FREE) {
+    // Discard the child, or at least all its memory if we can't yet.
+    if(child != NULL)
+      proc_acctmerge(curr, child);
+    if(child != NULL && !proc_free(child)) {
+      proc_pmapclaim(child);
+      child->pdir = pmap_detach(child->pdir);
+      proc_pmapunclaim(child);
+    }
+    return;
+  }
+  if((cmd & ~SYS_TYPE) == SYS_WILLNEED && child->pullstop) {
+    proc_pmapunclaim(child);  // as proc_pmapready() left it claimed
+    return;   // just bringing its pages back from other nodes
+  }
+  proc_pmapclaim(child);    // keep idle zero-page scans out meanwhile
+	if((cmd & (SYS_REGS | SYS_FPU)) && child != first)
+		syscall_putregs(child, &first->sv, cmd, curr);  // already sanitized
+	else if(cmd & (SYS_REGS | SYS_FPU)) {
+    uint32_t usefpu = child->sv.pff & PFF_USEFPU;
+    uint32_t ofs = syscall_regofs(cmd);
+		usercopy(tf, 0, (void*)&child->sv + ofs, (uint32_t)v->save + ofs,
+			syscall_regsize(cmd));
+    if(!(cmd & SYS_FPU))
+      child->sv.pff = (child->sv.pff & ~PFF_USEFPU) | usefpu;
+    syscall_putregs(child, &child->sv, cmd, curr);
+  }
+  uint32_t dest = (uint32_t)v->dst;
+  uint32_t size = v->size;
+  uint32_t src = (uint32_t)v->src;
+
+  if(cmd & SYS_MEMOP) {
+    int op = sysmemopof(tf, cmd, child);
+    // Check if the destination range is okay
+    if(dest < VM_USERLO || dest > VM_USERHI || dest + size > VM_USERHI
+        || PGOFF(dest) || PGOFF(size))
+        systrap(tf, T_GPFLT, 0);
+    if((op & SYS_MEMOP) == SYS_COPY) {
+      // we have to check the source too
+      if(src < VM_USERLO || src > VM_USERHI || src + size > VM_USERHI
+          || PGOFF(src))
+          systrap(tf, T_GPFLT, 0);
+      sysmemop(tf, op, child, curr->pdir, src, child->pdir, dest, size);
+    } else if(dest == VM_USERLO && size == VM_USERHI - VM_USERLO)
+      // zeroing a whole (stopped) child: free its memory in the background
+      child->pdir = pmap_detach(child->pdir);
+    else
+      sysmemop(tf, op, child, NULL, 0, child->pdir, dest, size);
+  }
+
+	if(cmd & SYS_PERM)
+		pmap_setperm(child->pdir, dest, size, cmd & SYS_RW);
+
+  if(cmd & SYS_ADVICE) {
+    if(dest < VM_USERLO || dest > VM_USERHI || size > VM_USERHI - dest
+        || PGOFF(dest) || PGOFF(size))
+      systrap(tf, T_GPFLT, 0);
+    syscall_advise(child, dest, size, cmd & SYS_ADVICE);
+  }
+
+	if(cmd & SYS_SNAP)
+    // bring rpdir up to date with whatever changed since the last snap
+    pmap_snap(child->pdir, child->rpdir);
+
+  proc_acctmerge(curr, child);
+  proc_pmapunclaim(child);
+	if((cmd & (SYS_START | SYS_GANG)) == (SYS_START | SYS_GANG))
+		proc_gang(child);
+	else if(cmd & SYS_START)
+		proc_ready(child);
+
+}
+
+// Can we do GET or PUT v on n children at another node
+// by asking that node to do it for us (see net_rpc()),
+// rather than migrating there?  Only if it involves none of our memory:
+// no memory operations (nor SYS_FREE) and, for a GET, no permission changes,
+// and we don't do GETs of more than one child's registers,
+// or of any child's resource usage, that way.
+// A bare GET or PUT with no flags is how programs ask to migrate.
+static bool
+sysremote(const sysvec *v, int n)
+{
+  uint32_t cmd = v->cmd;
+  if(!(cmd & ~SYS_TYPE) || (cmd & (SYS_MEMOP | SYS_FREE)))
+    return 0;
+  if((cmd & SYS_TYPE) == SYS_GET)
+    return !(cmd & (SYS_PERM | SYS_ACCT)) && (!(cmd & SYS_STATE) || n == 1);
+  return 1;
+}
+
+// Do one PUT operation, described by v as in inc/syscall.h,
+// on one child or on each of a range of children.
+// Returns when done, or doesn't return if we have to wait or migrate,
+// in which case the whole system call gets restarted later.
+static void
+sysput(trapframe *tf, const sysvec *v)
+{
+  uint32_t cmd = v->cmd;
 	proc *curr = proc_cur();
+  if(cmd & SYS_STATUS)
+    systrap(tf, T_GPFLT, 0);  // GET only: nothing to put
   spinlock_acquire(&curr->lock);
 
-  uint32_t child_index = tf->regs.edx;
+  uint32_t child_index = v->child;
   uint8_t node_number  = child_index >> 8 & 0xff;  // First 8 bits are the node number
   uint8_t child_number = child_index & 0xff;// The last 8 bits for child number
+  int n = SYS_NCHILDREN(child_index);
 
   // cprintf("node %d put: dest node: %d, child: %d, home node: %d\n", 
   //   net_node, node_number, child_number, RRNODE(curr->home));
@@ -126,68 +493,176 @@ do_put(trapframe *tf, uint32_t cmd)
   if (net_node != node_number) {
     // cprintf("sys_put: %p migrating to %d\n", curr, RRNODE(curr->home));
     spinlock_release(&curr->lock);
-    net_migrate(tf, node_number, 0);
+    if (!sysremote(v, n))
+      net_migrate(tf, node_number, 0);
+    int trapno;
+    net_rpc(tf, v, node_number, &trapno);
+    if (trapno >= 0)
+      systrap(tf, trapno, 0);
+    return;
   }
 
-  proc *child = curr->child[child_number];
+  if(child_number + n > PROC_CHILDREN) {
+    spinlock_release(&curr->lock);
+    systrap(tf, T_GPFLT, 0);
+  }
 
-  if(!child) 
-    child = proc_alloc(curr, child_number);
-  if(child->state != PROC_STOP)
-    proc_wait(curr, child, tf);
+  // Wait until every child in the range is stopped before touching any,
+  // since waiting restarts the whole system call.
+  // If we were preempted partway through before, skip the children done.
+  int i;
+  for(i = curr->opchild; i < n; i++) {
+    proc *child = curr->child[child_number + i];
+    if(!child && (cmd & SYS_FREE))
+      continue;   // nothing to free
+    if(!child)
+      child = proc_alloc(curr, child_number + i);
+    if(child->state != PROC_STOP)
+      proc_wait(curr, child, tf);
+    if(!proc_pmapready(child, !(cmd & SYS_FREE))
+        && (cmd & ~SYS_TYPE) != SYS_WILLNEED)
+      proc_wait(curr, child, tf);   // for its pages to come back
+  }
   
   spinlock_release(&curr->lock);
 
-  // cprintf("do_put: current proc: %p, cpu_cur proc: %p\n", curr, cpu_cur()->proc);
-	if(cmd & SYS_REGS) {
-		usercopy(tf, 0, &child->sv, tf->regs.ebx, sizeof(procstate));
-    child->sv.tf.ds = CPU_GDT_UDATA | 3;
-		child->sv.tf.es = CPU_GDT_UDATA | 3;
-		child->sv.tf.cs = CPU_GDT_UCODE | 3;
-		child->sv.tf.ss = CPU_GDT_UDATA | 3;
-		child->sv.tf.eflags &= FL_USER;
-		child->sv.tf.eflags |= FL_IF;
+  for(i = curr->opchild; i < n; i++) {
+    sysputone(tf, v, curr->child[child_number + i], curr->child[child_number]);
+    curr->opchild = i + 1;
   }
-  uint32_t dest = tf->regs.edi; //syscall.h
-  uint32_t size = tf->regs.ecx;
-  uint32_t src = tf->regs.esi;
+  curr->opchild = 0;
+}
+
+static void
+do_put(trapframe *tf, uint32_t cmd)
+{
+  sysvec v = { cmd, tf->regs.edx, (procstate*)tf->regs.ebx,
+    tf->regs.ecx, (void*)tf->regs.esi, (void*)tf->regs.edi };
+  sysput(tf, &v);
+	trap_return(tf);	// syscall completed
+}
+
+// Wait for whichever child in the set at EBX stops first,
+// and return its number in EDX - see inc/syscall.h.
+// Which one that is depends on timing, so only processes with
+// PFF_NONDET get it; others wait for the lowest-numbered child in the set.
+static void
+do_getany(trapframe *tf, uint32_t cmd)
+{
+  proc *curr = proc_cur();
+  bool nondet = curr->sv.pff & PFF_NONDET;
+  if((cmd & SYS_POLL) && !nondet)
+    systrap(tf, T_GPFLT, 0);  // polling would show us the scheduling
+
+  uint32_t set[PROC_CHILDREN/32];
+  usercopy(tf, 0, set, tf->regs.ebx, sizeof(set));
+
+  spinlock_acquire(&curr->lock);
+  int i, first = -1;
+  for(i = 0; i < PROC_CHILDREN; i++) {
+    if(!(set[i/32] & (1 << (i%32))))
+      continue;
+    proc *child = curr->child[i];
+    if(first < 0)
+      first = i;
+    if(child == NULL || child->state == PROC_STOP) {
+      if(!nondet && i != first)
+        break;
+      // Only we can restart a stopped child. A child that stops after
+      // we looked at it needs our lock in proc_ret() to wake us,
+      // so proc_waitany() below won't miss it either.
+      spinlock_release(&curr->lock);
+      if(cmd & SYS_POLL)
+        tf->regs.eax = 0;
+      tf->regs.edx = i;
+      trap_return(tf);
+    }
+    if(!nondet)
+      break;
+  }
+  if(first < 0)
+    systrap(tf, T_GPFLT, 0);  // empty set: nothing would wake us
+  if(cmd & SYS_POLL) {
+    spinlock_release(&curr->lock);
+    tf->regs.eax = SYS_RUNNING;
+    tf->regs.edx = -1;
+    trap_return(tf);
+  }
+  if(nondet)
+    proc_waitany(curr, tf);
+  proc_wait(curr, curr->child[first], tf);
+}
+
+// Do the operations of GET v on the idx'th stopped child of a range.
+// Each child's registers go to the next procstate in the save array,
+// while memory from the children all lands in the same place:
+// merging combines their changes, copying leaves the last child's.
+static void
+sysgetone(trapframe *tf, const sysvec *v, proc *child, int idx)
+{
+  uint32_t cmd = v->cmd;
+  proc *curr = proc_cur();
+  uint32_t dest = (uint32_t)v->dst;
+  uint32_t size = v->size;
+  uint32_t src = (uint32_t)v->src;
+  if(child != &proc_null)
+    proc_pmapclaim(child);  // keep idle zero-page scans out meanwhile
 
   if(cmd & SYS_MEMOP) {
-    int op = cmd & SYS_MEMOP;
+    int op = sysmemopof(tf, cmd, child);
     // Check if the destination range is okay
-    if(dest < VM_USERLO || dest > VM_USERHI || dest + size > VM_USERHI)
+    if(dest < VM_USERLO || dest > VM_USERHI || dest + size > VM_USERHI
+        || PGOFF(dest) || PGOFF(size))
         systrap(tf, T_GPFLT, 0);
-    if(op == SYS_COPY) {
+    if((op & SYS_MEMOP) == SYS_COPY) {
       // we have to check the source too
-      if(src < VM_USERLO || src > VM_USERHI || src + size > VM_USERHI)
+      if(src < VM_USERLO || src > VM_USERHI || src + size > VM_USERHI
+          || PGOFF(src))
           systrap(tf, T_GPFLT, 0);
-      pmap_copy(curr->pdir, src, child->pdir, dest, size);
+      sysmemop(tf, op, child, child->pdir, src, curr->pdir, dest, size);
+    } else if(op == SYS_MERGE) {
+        if(PTOFF(src) || PTOFF(dest) || PTOFF(size)) // merges are 4MB-aligned
+          systrap(tf, T_GPFLT, 0);
+        sysmemop(tf, op, child, child->pdir, src, curr->pdir, dest, size);
     } else
-      pmap_remove(child->pdir, dest, size);
+        sysmemop(tf, op, child, NULL, 0, curr->pdir, dest, size);
   }
 
-	if(cmd & SYS_PERM)
-		pmap_setperm(child->pdir, dest, size, cmd & SYS_RW);
-
-	if(cmd & SYS_SNAP)
-    // copy pdir to rpdir
-    pmap_copy(child->pdir, VM_USERLO, child->rpdir, VM_USERLO, VM_USERHI-VM_USERLO);
-
-	if(cmd & SYS_START)
-		proc_ready(child);
+	if((cmd & SYS_PERM) && idx == 0)
+		pmap_setperm(curr->pdir, dest, size, cmd & SYS_RW);
 
-	trap_return(tf);	// syscall completed
+  if(cmd & SYS_STATE) {
+    uint32_t ofs = syscall_regofs(cmd);
+		usercopy(tf, 1, (void*)&child->sv + ofs,
+			(uint32_t)(v->save + idx) + ofs, syscall_regsize(cmd));
+  }
+  if(child != &proc_null)
+    proc_acctmerge(curr, child);  // including what this merge just found
+  if((cmd & (SYS_STATE | SYS_ACCT)) == SYS_ACCT)
+    usercopy(tf, 1, &child->acct, (uint32_t)((procacct*)v->save + idx),
+        sizeof(procacct));
+  if(child != &proc_null)
+    proc_pmapunclaim(child);
 }
 
-static void
-do_get(trapframe *tf, uint32_t cmd)
+// Do one GET operation, other than SYS_ANY, as sysput() does a PUT.
+// With SYS_POLL, returns false instead of waiting for a running child.
+static bool
+sysget(trapframe *tf, const sysvec *v)
 { 
+  uint32_t cmd = v->cmd;
   proc *curr = proc_cur();
+  // Whether a child is still running depends on timing.
+  if((cmd & SYS_POLL) && !(curr->sv.pff & PFF_NONDET))
+    systrap(tf, T_GPFLT, 0);
+  if((cmd & SYS_ACCT) && (cmd & SYS_STATE))
+    systrap(tf, T_GPFLT, 0);  // both would go to the save pointer
   spinlock_acquire(&curr->lock);
   // Find child index (includes node number and child number)
-  int child_index = tf->regs.edx;
-  uint8_t node_number  = child_index >> 8;  // First 8 bits are the node number
+  int child_index = v->child;
+  uint8_t node_number  = child_index >> 8 & 0xff;  // First 8 bits are the node number
   uint8_t child_number = child_index & 0xff;// The last 8 bits for child number
+  int n = SYS_NCHILDREN(child_index);
 
   // cprintf("node %d get: dest node: %d, child: %d, home node: %d\n", 
   //   net_node, node_number, child_number, RRNODE(curr->home));
@@ -200,44 +675,95 @@ do_get(trapframe *tf, uint32_t cmd)
   if (net_node != node_number) {
     // cprintf("sys_get: %p migrating to %d\n", curr, node_number);
     spinlock_release(&curr->lock);
-    net_migrate(tf, node_number, 0);
+    if (!sysremote(v, n))
+      net_migrate(tf, node_number, 0);
+    int trapno;
+    bool done = net_rpc(tf, v, node_number, &trapno);
+    if (trapno >= 0)
+      systrap(tf, trapno, 0);
+    return done;
   }
 
-  proc *child = curr->child[child_number];
-  if(!child)
-    child = &proc_null;
-    // cprintf("No child process %d\n", child_index);
-  if(child->state != PROC_STOP)
-	proc_wait(curr, child, tf);
+  if(child_number + n > PROC_CHILDREN) {
+    spinlock_release(&curr->lock);
+    systrap(tf, T_GPFLT, 0);
+  }
+
+  // Wait for every child in the range to stop,
+  // skipping any done before we were preempted, as in sysput().
+  int i;
+  for(i = curr->opchild; i < n; i++) {
+    proc *child = curr->child[child_number + i];
+    if(!child)
+      child = &proc_null;
+      // cprintf("No child process %d\n", child_index);
+    if(child->state != PROC_STOP && (cmd & SYS_POLL)) {
+      spinlock_release(&curr->lock);
+      return 0;
+    }
+    if(child->state != PROC_STOP)
+	  proc_wait(curr, child, tf);
+    if(child != &proc_null && !proc_pmapready(child, (cmd & SYS_MEMOP) != 0))
+      proc_wait(curr, child, tf);   // for its pages to come back
+  }
 
   spinlock_release(&curr->lock);
-  // cprintf("do_get: current proc: %p, cpu_cur proc: %p\n", curr, cpu_cur()->proc);
-  uint32_t dest = tf->regs.edi; //syscall.h
-  uint32_t size = tf->regs.ecx;
-  uint32_t src = tf->regs.esi;
 
-  if(cmd & SYS_MEMOP) {
-    int op = cmd & SYS_MEMOP;
-    // Check if the destination range is okay
-    if(dest < VM_USERLO || dest > VM_USERHI || dest + size > VM_USERHI)
-        systrap(tf, T_GPFLT, 0);
-    if(op == SYS_COPY) {
-      // we have to check the source too
-      if(src < VM_USERLO || src > VM_USERHI || src + size > VM_USERHI)
-          systrap(tf, T_GPFLT, 0);
-      pmap_copy(child->pdir, src, curr->pdir, dest, size);
-    } else if(op == SYS_MERGE) {
-        pmap_merge(child->rpdir, child->pdir, src, curr->pdir, dest, size);
-    } else
-        pmap_remove(curr->pdir, dest, size);
+  for(i = curr->opchild; i < n; i++) {
+    proc *child = curr->child[child_number + i];
+    sysgetone(tf, v, child ? child : &proc_null, i);
+    curr->opchild = i + 1;
   }
+  curr->opchild = 0;
+  return 1;
+}
 
-	if(cmd & SYS_PERM)
-		pmap_setperm(curr->pdir, dest, size, cmd & SYS_RW);
+static void
+do_get(trapframe *tf, uint32_t cmd)
+{
+  if(cmd & SYS_ANY)
+    return do_getany(tf, cmd);
+  sysvec v = { cmd, tf->regs.edx, (procstate*)tf->regs.ebx,
+    tf->regs.ecx, (void*)tf->regs.esi, (void*)tf->regs.edi };
+  bool done = sysget(tf, &v);
+  if(cmd & SYS_POLL)
+    tf->regs.eax = done ? 0 : SYS_RUNNING;
+	trap_return(tf);	// syscall completed
+}
 
-    if(cmd & SYS_REGS)
-		usercopy(tf, 1, &child->sv, tf->regs.ebx, sizeof(procstate));
+// Do a vector of GET and PUT operations in one system call.
+// We copy in and do SYS_VECCHUNK entries at a time,
+// advancing EBX and counting down ECX after each one,
+// so if we have to wait for a child partway through
+// the restarted system call picks up where we left off.
+// TLB invalidations for our own address space are deferred
+// until we return or touch user memory (see pmap_invaldefer()),
+// which we do only once per chunk unless operations carry registers.
+#define SYS_VECCHUNK	16
 
+static void
+do_vec(trapframe *tf, uint32_t cmd)
+{
+  pmap_invaldefer();
+  while(tf->regs.ecx > 0) {
+    sysvec v[SYS_VECCHUNK];
+    int i, n = MIN(tf->regs.ecx, SYS_VECCHUNK);
+    usercopy(tf, 0, v, tf->regs.ebx, n * sizeof(sysvec));
+    for(i = 0; i < n; i++) {
+      switch(v[i].cmd & SYS_TYPE) {
+        case SYS_PUT: sysput(tf, &v[i]); break;
+        case SYS_GET:
+          if(v[i].cmd & (SYS_ANY | SYS_POLL))
+            systrap(tf, T_GPFLT, 0);  // its result would have nowhere to go
+          sysget(tf, &v[i]);
+          break;
+        default: systrap(tf, T_GPFLT, 0);
+      }
+      tf->regs.ebx += sizeof(sysvec);
+      tf->regs.ecx--;
+    }
+  }
+  pmap_invalflush();
 	trap_return(tf);	// syscall completed
 }
 
@@ -255,6 +781,119 @@ do_ret(trapframe *tf, uint32_t cmd) {
   proc_ret(tf, 1);
 }
 
+// Restore child cn from the checkpoint under key on node (see do_ckpt()).
+// Once the node has told us where the checkpoint is, we make the child
+// and wait for it to pull its record and page tables (see net_ckpt()),
+// and the restarted system call then finds it there and returns.
+static void
+do_restore(trapframe *tf, uint8_t node, uint8_t cn, uint32_t key)
+{
+  proc *curr = proc_cur();
+  spinlock_acquire(&curr->lock);
+  proc *child = curr->child[cn];
+  if(child != NULL && curr->ckptnode == node && !curr->ckptwait) {
+    if(child->state != PROC_STOP)
+      proc_wait(curr, child, tf);
+    // If any record was bad, or we ran out of memory for it,
+    // let the partial subtree go, once all of it has stopped pulling.
+    proc *q;
+    for(q = child; q != NULL && !q->ckptbad; q = proc_walknext(child, q))
+      ;
+    if(q != NULL && !proc_free(child)) {
+      spinlock_release(&curr->lock);
+      proc_save(curr, tf, 0);   // try again after the others have run
+      proc_ready(curr);
+      proc_sched();
+    }
+    curr->ckptnode = 0;
+    spinlock_release(&curr->lock);
+    tf->regs.eax = q != NULL ? SYS_NOCKPT : 0;
+    trap_return(tf);
+  }
+  spinlock_release(&curr->lock);
+  if(child != NULL) {
+    tf->regs.eax = SYS_NOCKPT;    // not restoring over an existing child
+    trap_return(tf);
+  }
+
+  uint32_t rr = net_ckpt(tf, node, NET_CKPTRQ, key, 0);
+  spinlock_acquire(&curr->lock);
+  if(rr != 0 && (child = proc_alloc(NULL, 0)) != NULL) {
+    child->parent = curr;
+    if(net_ckptrestore(child, rr)) {
+      curr->child[cn] = child;
+      proc_wait(curr, child, tf);
+    }
+    child->parent = NULL;
+    proc_free(child);
+  }
+  curr->ckptnode = 0;
+  spinlock_release(&curr->lock);
+  tf->regs.eax = SYS_NOCKPT;
+  trap_return(tf);
+}
+
+// Checkpoint stopped child cn and its descendants to another node,
+// or restore them from there with SYS_RESTORE - see inc/syscall.h.
+// We make the records to send once, the first time through,
+// then keep them until the node has taken the checkpoint or refused it.
+static void
+do_ckpt(trapframe *tf, uint32_t cmd)
+{
+  proc *curr = proc_cur();
+  uint8_t node = tf->regs.edx >> 8 & 0xff;
+  uint8_t cn = tf->regs.edx & 0xff;
+  uint32_t key = tf->regs.ebx;
+  if(net_node == 0 || node == 0 || node == net_node || node > NET_MAXNODES
+      || !(curr->sv.pff & PFF_NONDET))
+    systrap(tf, T_GPFLT, 0);
+  if(cmd & SYS_RESTORE)
+    return do_restore(tf, node, cn, key);
+
+  spinlock_acquire(&curr->lock);
+  proc *child = curr->child[cn];
+  if(child == NULL) {
+    spinlock_release(&curr->lock);
+    tf->regs.eax = SYS_NOCKPT;
+    trap_return(tf);
+  }
+  if(child->state != PROC_STOP)
+    proc_wait(curr, child, tf);
+  if(curr->ckptsave == NULL) {
+    int r = net_ckptsave(child, &curr->ckptsave);
+    if(r != 0) {
+      spinlock_release(&curr->lock);
+      tf->regs.eax = r;
+      trap_return(tf);
+    }
+  }
+  spinlock_release(&curr->lock);
+
+  net_ckptrec *recs = curr->ckptsave;
+  uint32_t rr = net_ckpt(tf, node, NET_CKPT, key,
+      RRCONS(net_node, mem_phys(recs), 0));
+  curr->ckptnode = 0;
+  curr->ckptsave = NULL;
+  net_ckptfree(recs);
+  tf->regs.eax = rr != 0 ? 0 : SYS_NOCKPT;
+	trap_return(tf);	// syscall completed
+}
+
+// Entrypoint for system calls made with SYSENTER: see kern/trapasm.S.
+// The user stub left the address to return to on top of its stack;
+// once we have it the trapframe is just as an INT would have left it.
+// Unless the system call restarts or switches to another process,
+// trap_return() will then leave through SYSEXIT.
+void gcc_noreturn
+syscall_fast(trapframe *tf)
+{
+  asm volatile("cld" ::: "cc");   // as in trap()
+  usercopy(tf, 0, &tf->eip, tf->esp, sizeof(tf->eip));
+  cpu_cur()->sysexit = tf;
+  syscall(tf);
+  trap(tf);   // not a system call: handle as a regular trap
+}
+
 // Common function to handle all system calls -
 // decode the system call type and call an appropriate handler function.
 // Be sure to handle undefined system calls appropriately.
@@ -263,11 +902,28 @@ syscall(trapframe *tf)
 {
 	// EAX register holds system call command/flags
 	uint32_t cmd = tf->regs.eax;
+	// Leave anything else uncounted: coming in through SYSENTER,
+	// it gets here twice, once more via trap() (see syscall_fast()).
+	if ((cmd & SYS_TYPE) > SYS_ADVISE)	// the highest system call type
+		return;		// not a system call: handle as a regular trap
+	trace(TRACE_SYSCALL, cmd, tf->regs.edx, tf->eip);
+	proc_cur()->acct.syscalls++;
 	switch (cmd & SYS_TYPE) {
   	case SYS_CPUTS:	return do_cputs(tf, cmd);
   	case SYS_PUT: return do_put(tf, cmd);
   	case SYS_GET: return do_get(tf, cmd);
   	case SYS_RET: return do_ret(tf, cmd);
+  	case SYS_VEC: return do_vec(tf, cmd);
+  	case SYS_CWRITE: return do_cwrite(tf, cmd);
+  	case SYS_LOCKSTAT: return do_lockstat(tf, cmd);
+  	case SYS_NETSTAT: return do_netstat(tf, cmd);
+  	case SYS_NCPU: return do_ncpu(tf, cmd);
+  	case SYS_MERGEOP: return do_mergeop(tf, cmd);
+  	case SYS_ADVISE: return do_advise(tf, cmd);
+  	case SYS_CLOCK: return do_clock(tf, cmd);
+  	case SYS_CKPT: return do_ckpt(tf, cmd);
+  	case SYS_PROF: return do_prof(tf, cmd);
+  	case SYS_TRACE: return do_trace(tf, cmd);
   	default:	return;		// handle as a regular trap
 	}
 }
@@ -18,5 +18,28 @@
 #include <inc/trap.h>
 
 void syscall(trapframe *tf);
+void syscall_fast(trapframe *tf) gcc_noreturn;
+
+struct proc;
+void usercopy(trapframe *utf, bool copyout,
+		void *kva, uint32_t uva, size_t size);
+void syscall_putregs(struct proc *child, const procstate *sv, uint32_t cmd,
+		struct proc *parent);
+void syscall_advise(struct proc *p, uint32_t va, uint32_t size,
+		uint32_t hint);
+
+// The part of a procstate a GET or PUT command with SYS_STATE flags copies,
+// from byte syscall_regofs(cmd) up to syscall_regend(cmd):
+// the general registers and/or the FPU state, and/or the status view,
+// which with the FPU state alone means everything from tf.trapno on.
+#define syscall_regofs(cmd) \
+	((cmd) & SYS_REGS ? 0 \
+	 : (cmd) & SYS_STATUS ? offsetof(procstate, tf.trapno) \
+	 : offsetof(procstate, fx))
+#define syscall_regend(cmd) \
+	((cmd) & SYS_FPU ? sizeof(procstate) \
+	 : (cmd) & SYS_REGS ? offsetof(procstate, fx) \
+	 : offsetof(procstate, tf.ss))
+#define syscall_regsize(cmd) (syscall_regend(cmd) - syscall_regofs(cmd))
 
 #endif /* !PIOS_KERN_SYSCALL_H */
@@ -0,0 +1,87 @@
+/*
+ * Per-CPU binary event trace.
+ *
+ * Each CPU writes fixed-size records into its own ring,
+ * so recording an event takes no locks and shares no cache lines;
+ * when the ring is full the newest records overwrite the oldest.
+ * Rings are allocated the first time tracing is turned on,
+ * and never freed.  Only their own CPU writes them,
+ * with interrupts off so that a trace point in an interrupt handler
+ * can't tear a record another one on the same CPU is writing.
+ *
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#include <inc/assert.h>
+#include <inc/x86.h>
+
+#include <kern/cpu.h>
+#include <kern/mem.h>
+#include <kern/trace.h>
+#include <kern/syscall.h>
+
+
+volatile uint32_t trace_mask;
+
+
+void
+trace_rec(int ev, uint32_t a0, uint32_t a1, uint32_t a2)
+{
+	uint32_t eflags = read_eflags();
+	cli();
+	cpu *c = cpu_cur();
+	if (c->tracebuf != NULL) {
+		tracerec *r = &c->tracebuf[c->tracehead % TRACE_NRECS];
+		r->tsc = rdtsc();
+		r->event = ev;
+		r->cpu = c->id;
+		r->arg[0] = a0;
+		r->arg[1] = a1;
+		r->arg[2] = a2;
+		if (++c->tracehead - c->tracetail > TRACE_NRECS)
+			c->tracetail = c->tracehead - TRACE_NRECS;
+	}
+	write_eflags(eflags);
+}
+
+uint32_t
+trace_enable(uint32_t mask)
+{
+	cpu *c;
+	if (mask != 0)
+		for (c = &cpu_boot; c != NULL; c = c->next)
+			if (c->tracebuf == NULL) {
+				pageinfo *pi = mem_alloc_order(TRACE_ORDER);
+				if (pi == NULL) {
+					warn("trace_enable: no memory for CPU %d",
+						c->id);
+					continue;
+				}
+				c->tracebuf = mem_pi2ptr(pi);
+			}
+	return xchg(&trace_mask, mask);
+}
+
+int
+trace_read(trapframe *tf, int cpuidx, uint32_t va, int n)
+{
+	cpu *c = &cpu_boot;
+	while (cpuidx-- > 0 && c != NULL)
+		c = c->next;
+	if (c == NULL || c->tracebuf == NULL || n <= 0)
+		return 0;
+
+	// Copy out the oldest records, in at most two pieces
+	// if they wrap around the end of the ring.
+	int done = 0;
+	while (done < n && c->tracetail != c->tracehead) {
+		uint32_t i = c->tracetail % TRACE_NRECS;
+		uint32_t k = MIN(MIN(c->tracehead - c->tracetail,
+					TRACE_NRECS - i), n - done);
+		usercopy(tf, 1, &c->tracebuf[i], va + done * sizeof(tracerec),
+			k * sizeof(tracerec));
+		c->tracetail += k;
+		done += k;
+	}
+	return done;
+}
@@ -0,0 +1,46 @@
+/*
+ * Per-CPU binary event trace, for seeing what the kernel does
+ * without the timing upsets of printing it (see inc/syscall.h for events).
+ *
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#ifndef PIOS_KERN_TRACE_H
+#define PIOS_KERN_TRACE_H
+#ifndef PIOS_KERNEL
+# error "This is a kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/mmu.h>
+#include <inc/syscall.h>
+
+
+#define TRACE_ORDER	4		// Each CPU's ring is 2^this pages
+#define TRACE_NRECS	((PAGESIZE << TRACE_ORDER) / sizeof(tracerec))
+
+// Events being recorded, one bit (1 << TRACE_*) per type.
+extern volatile uint32_t trace_mask;
+
+#define trace_on(ev)	(trace_mask & (1 << (ev)))
+
+// Trace point: record an event if its type is on.
+// When tracing is off this is just one test of trace_mask.
+#define trace(ev, a0, a1, a2) do { \
+		if (trace_on(ev)) \
+			trace_rec((ev), (uint32_t)(a0), (uint32_t)(a1), \
+				(uint32_t)(a2)); \
+	} while (0)
+
+void trace_rec(int ev, uint32_t a0, uint32_t a1, uint32_t a2);
+
+// Record only the events in mask from now on, returning the old mask.
+uint32_t trace_enable(uint32_t mask);
+
+struct trapframe;
+
+// Move up to n of the oldest records from the trace of the cpuidx'th CPU
+// to user buffer va of the process whose trapframe is tf.
+int trace_read(struct trapframe *tf, int cpuidx, uint32_t va, int n);
+
+#endif /* PIOS_KERN_TRACE_H */
@@ -11,6 +11,7 @@
 #include <inc/mmu.h>
 #include <inc/x86.h>
 #include <inc/assert.h>
+#include <inc/kdata.h>
 
 #include <kern/cpu.h>
 #include <kern/trap.h>
@@ -20,11 +21,11 @@
 #include <kern/syscall.h>
 #include <kern/pmap.h>
 #include <kern/net.h>
+#include <kern/trace.h>
 
 #include <dev/lapic.h>
 #include <dev/kbd.h>
 #include <dev/serial.h>
-#include <dev/e100.h>
 
 
 // Interrupt descriptor table.  Must be built at run time because
@@ -46,11 +47,11 @@ trap_init_idt(void)
   // All the trap handlers.
   extern char tdivide, tdebug, tnmi, tbrkpt, toflow, tbound, tillop, 
               tdivide, tdblflt, ttss, tsegnp, tstack, tgpflt, tpgflt, 
-              tfperr, talign, tmchk, tsimd, tsecev,
+              tdevice, tfperr, talign, tmchk, tsimd, tsecev,
               tirq0, tirqspur, tirqkbd, tirqser, tirq2, tirq3, 
               tirq5, tirq6, tirq8, tirq9, tirq10, tirq11, tirq12, 
               tirq13, tirq14, tirq15,
-              tsystem, tltimer;
+              tsystem, tltimer, ttlbflush, twakeup;
       
   SETGATE(idt[T_DIVIDE], 0, CPU_GDT_KCODE, &tdivide, 0);
   SETGATE(idt[T_DEBUG], 0, CPU_GDT_KCODE, &tdebug, 0);
@@ -59,7 +60,7 @@ trap_init_idt(void)
   SETGATE(idt[T_OFLOW], 0, CPU_GDT_KCODE, &toflow, 3);
   SETGATE(idt[T_BOUND], 0, CPU_GDT_KCODE, &tbound, 0);
   SETGATE(idt[T_ILLOP], 0, CPU_GDT_KCODE, &tillop, 0);
-  SETGATE(idt[T_DEVICE], 0, CPU_GDT_KCODE, &tdivide, 0);
+  SETGATE(idt[T_DEVICE], 0, CPU_GDT_KCODE, &tdevice, 0);
   SETGATE(idt[T_DBLFLT], 0, CPU_GDT_KCODE, &tdblflt, 0);
   SETGATE(idt[T_TSS], 0, CPU_GDT_KCODE, &ttss, 0);
   SETGATE(idt[T_SEGNP], 0, CPU_GDT_KCODE, &tsegnp, 0);
@@ -93,6 +94,8 @@ trap_init_idt(void)
 
   SETGATE(idt[T_SYSCALL], 0, CPU_GDT_KCODE, &tsystem, 3);
   SETGATE(idt[T_LTIMER], 0, CPU_GDT_KCODE, &tltimer, 0);
+  SETGATE(idt[T_TLBFLUSH], 0, CPU_GDT_KCODE, &ttlbflush, 0);
+  SETGATE(idt[T_WAKEUP], 0, CPU_GDT_KCODE, &twakeup, 0);
 }
 
 void
@@ -107,7 +110,7 @@ trap_init(void)
 	asm volatile("lidt %0" : : "m" (idt_pd));
 
 	// Check for the correct IDT and trap handler operation.
-	if (cpu_onboot())
+	if (cpu_onboot() && INIT_CHECKS)
 		trap_check_kernel();
 }
 
@@ -177,9 +180,6 @@ trap_print(trapframe *tf)
 void gcc_noreturn
 trap(trapframe *tf)
 {
-
-  extern uint8_t e100_irq;
-  int e100_irq_gate = T_IRQ0 + (int)e100_irq;
 	// The user-level environment may have set the DF flag,
 	// and some versions of GCC rely on DF being clear.
 	asm volatile("cld" ::: "cc");
@@ -188,9 +188,12 @@ trap(trapframe *tf)
   // or this function will call trap_return itself.
   if(tf->trapno == T_PGFLT)
     pmap_pagefault(tf);
+  else if(tf->trapno != T_SYSCALL)    // syscall() traces those
+    trace(TRACE_TRAP, tf->trapno, tf->eip, tf->err);
 
 	// If this trap was anticipated, just use the designated handler.
 	cpu *c = cpu_cur();
+	c->sysexit = NULL;	// whatever it was, we're not returning to it now
   proc *curr = proc_cur();
 
     // This is not this processe's home
@@ -204,12 +207,30 @@ trap(trapframe *tf)
     case T_SYSCALL:
       syscall(tf);
       break;
+    case T_DEVICE:    // first FPU/SSE instruction since we last ran
+      if(tf->cs & 3) {
+        proc_fpuload(curr);
+        trap_return(tf);
+      }
+      break;
     case T_LTIMER:
+      debug_profsample(tf);
       net_tick();
       lapic_eoi();
+      net_rxdrain();    // anything the card's poll queued, or we missed
       //cprintf("Timer Interrupt.\n");
       if(tf->cs & 3)
-        proc_yield(tf);
+        proc_tick(tf);
+      else
+        c->kticked = 1;
+      trap_return(tf);
+    case T_TLBFLUSH:
+      pmap_tlbflush();
+      lapic_eoi();
+      trap_return(tf);
+    case T_WAKEUP:    // gets us out of hlt, or brings packets to process
+      lapic_eoi();
+      net_rxdrain();
       trap_return(tf);
     case T_IRQ0+IRQ_KBD:
       // cprintf("Keyboard interrupt\n");
@@ -227,9 +248,10 @@ trap(trapframe *tf)
       trap_return(tf);
   }
   
-  if(tf->trapno == e100_irq_gate) { 
-      e100_intr();
+  if(net_netdev && tf->trapno == T_IRQ0 + net_netdev->irq) {
+      net_netdev->intr();
       lapic_eoi();
+      net_rxdrain();    // the packets it queued to us, card lock released
       trap_return(tf);
   }
 
@@ -255,6 +277,31 @@ trap(trapframe *tf)
 }
 
 
+// Return from a trap to the CPU state in a given trapframe.
+// The direct return from a system call that came in through SYSENTER
+// can go back out through the cheaper SYSEXIT, which takes the user's
+// EIP and ESP in EDX and ECX (the user stub doesn't expect those back);
+// anything else, including restarted system calls, needs the full iret.
+void gcc_noreturn
+trap_return(trapframe *tf)
+{
+	cpu *c = cpu_cur();
+	if ((tf->cs & 3) && c->kdata != NULL && c->proc != NULL) {
+		// Let the process see its accounting as of now (inc/kdata.h).
+		kdata *kd = c->kdata;
+		kd->seq += KDATA_SEQONE;
+		kd->runtsc = c->proc->runtsc;
+		kd->acct = c->proc->acct;
+	}
+	if (tf == c->sysexit) {
+		c->sysexit = NULL;
+		tf->regs.edx = tf->eip;
+		tf->regs.ecx = tf->esp;
+		trap_sysexit(tf);
+	}
+	trap_iret(tf);
+}
+
 // Helper function for trap_check_recover(), below:
 // handles "anticipated" traps by simply resuming at a new EIP.
 static void gcc_noreturn
@@ -0,0 +1,77 @@
+/*
+ * Arenas for batch-scoped allocation: each arena owns a fixed share
+ * of the VM_ARENALO..VM_ARENAHI part of scratch space,
+ * maps zero-filled pages into it as allocations need them,
+ * and hands all of them back with one SYS_ZERO when reset.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/syscall.h>
+#include <inc/mmu.h>
+#include <inc/vm.h>
+#include <inc/errno.h>
+#include <inc/arena.h>
+
+
+#define ARENA_SIZE	((VM_ARENAHI - VM_ARENALO) / ARENA_MAX)
+#define ARENA_ALIGN	8		// Alignment of arena allocations
+#define ARENA_GROW	(64*1024)	// Least memory an arena maps at a time
+
+static arena arenas[ARENA_MAX];		// lo == 0 if not in use
+
+
+arena *
+arena_new(void)
+{
+	int i;
+	for (i = 0; i < ARENA_MAX; i++) {
+		arena *a = &arenas[i];
+		if (a->lo == 0) {
+			a->lo = a->top = a->lim = VM_ARENALO + i * ARENA_SIZE;
+			return a;
+		}
+	}
+	errno = ENOMEM;
+	return NULL;
+}
+
+void *
+arena_alloc(arena *a, size_t size)
+{
+	assert(a >= arenas && a < &arenas[ARENA_MAX] && a->lo != 0);
+	size = ROUNDUP(size, ARENA_ALIGN);
+	if (size > a->lo + ARENA_SIZE - a->top) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	void *p = (void*)a->top;
+	a->top += size;
+	if (a->top > a->lim) {
+		uintptr_t lim = ROUNDUP(a->top, ARENA_GROW);
+		lim = MIN(lim, a->lo + ARENA_SIZE);
+		sys_get(SYS_PERM | SYS_READ | SYS_WRITE, 0, NULL, NULL,
+			(void*)a->lim, lim - a->lim);
+		a->lim = lim;
+	}
+	return p;
+}
+
+void
+arena_reset(arena *a)
+{
+	assert(a >= arenas && a < &arenas[ARENA_MAX] && a->lo != 0);
+	if (a->lim > a->lo)
+		sys_get(SYS_ZERO, 0, NULL, NULL, (void*)a->lo, a->lim - a->lo);
+	a->top = a->lim = a->lo;
+}
+
+void
+arena_destroy(arena *a)
+{
+	arena_reset(a);
+	a->lo = 0;
+}
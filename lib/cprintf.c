@@ -25,7 +25,7 @@
 #include <inc/assert.h>
 
 
-// Collect up to CPUTS_MAX-1 characters into a buffer
+// Collect up to CPUTS_MAX characters into a buffer
 // and perform ONE system call to print all of them,
 // in order to make the lines output to the console atomic
 // and prevent interrupts from causing context switches
@@ -41,9 +41,8 @@ static void
 putch(int ch, struct printbuf *b)
 {
 	b->buf[b->idx++] = ch;
-	if (b->idx == CPUTS_MAX-1) {
-		b->buf[b->idx] = 0;
-		cputs(b->buf);
+	if (b->idx == CPUTS_MAX) {
+		cwrite(b->buf, b->idx);
 		b->idx = 0;
 	}
 	b->cnt++;
@@ -58,8 +57,7 @@ vcprintf(const char *fmt, va_list ap)
 	b.cnt = 0;
 	vprintfmt((void*)putch, &b, fmt, ap);
 
-	b.buf[b.idx] = 0;
-	cputs(b.buf);
+	cwrite(b.buf, b.idx);
 
 	return b.cnt;
 }
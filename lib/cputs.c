@@ -16,3 +16,8 @@ void cputs(const char *str)
 	sys_cputs(str);
 }
 
+void cwrite(const char *buf, size_t len)
+{
+	sys_cwrite(buf, len);
+}
+
@@ -34,17 +34,19 @@ dir_walk(const char *path, mode_t createmode)
 	assert(fileino_isdir(dino));
 	assert(fileino_isdir(files->fi[dino].dino));
 
-	// Look for a regular directory entry with a matching name.
-	int ino, len;
-	for (ino = 1; ino < FILE_INODES; ino++) {
-		if (!fileino_alloced(ino) || files->fi[ino].dino != dino)
-			continue;	// not an entry in directory 'dino'
-
-		// Does this inode's name match our next path component?
-		len = strlen(files->fi[ino].de.d_name);
-		if (memcmp(path, files->fi[ino].de.d_name, len) != 0)
-			continue;	// no match
-		found:
+	// Look up a regular directory entry matching our next path component
+	// in the directory entry index, instead of scanning every inode.
+	const char *slash = strchr(path, '/');
+	int len = slash != NULL ? slash - path : strlen(path);
+	int ino = fileino_lookup(files, dino, path, len);
+
+	// Looking for one of the special entries '.' or '..'?
+	if (ino == 0 && len == 1 && path[0] == '.')
+		ino = dino;	// just leads to this same directory
+	if (ino == 0 && len == 2 && path[0] == '.' && path[1] == '.')
+		ino = files->fi[dino].dino;	// leads to parent directory
+
+	if (ino != 0) {
 		if (path[len] == 0) {
 			// Exact match at end of path - but does it exist?
 			if (fileino_exists(ino))
@@ -58,10 +60,9 @@ dir_walk(const char *path, mode_t createmode)
 			files->fi[ino].ver++;	// an exclusive change
 			files->fi[ino].mode = createmode;
 			files->fi[ino].size = 0;
+			fileino_logchg(files, ino);
 			return ino;
 		}
-		if (path[len] != '/')
-			continue;	// no match
 
 		// Make sure this dirent refers to a directory
 		if (!fileino_isdir(ino)) {
@@ -80,19 +81,6 @@ dir_walk(const char *path, mode_t createmode)
 		goto searchdir;
 	}
 
-	// Looking for one of the special entries '.' or '..'?
-	if (path[0] == '.' && (path[1] == 0 || path[1] == '/')) {
-		len = 1;
-		ino = dino;	// just leads to this same directory
-		goto found;
-	}
-	if (path[0] == '.' && path[1] == '.'
-			&& (path[2] == 0 || path[2] == '/')) {
-		len = 2;
-		ino = files->fi[dino].dino;	// leads to root directory
-		goto found;
-	}
-
 	// Path component not found - see if we should create it
 	if (!createmode || strchr(path, '/') != NULL) {
 		// cprintf("dirwalk: failing at 99\n");
@@ -109,8 +97,7 @@ dir_walk(const char *path, mode_t createmode)
 	if (ino < 0)
 		return -1;
 	assert(fileino_isvalid(ino) && !fileino_alloced(ino));
-	strcpy(files->fi[ino].de.d_name, path);
-	files->fi[ino].dino = dino;
+	fileino_setname(files, ino, dino, path);
 	files->fi[ino].ver = 0;
 	files->fi[ino].mode = createmode;
 	files->fi[ino].size = 0;
@@ -17,17 +17,41 @@
 #include <inc/unistd.h>
 #include <inc/elf.h>
 #include <inc/vm.h>
+#include <inc/stdio.h>
+#include <inc/errno.h>
 
 
 // Maximum size of executable image we can load -
-// must fit in our scratch area for loading purposes.
-#define EXEMAX  MIN(VM_SHAREHI-VM_SHARELO,VM_SCRATCHHI-VM_SCRATCHLO)
+// must fit in our scratch area for loading purposes,
+// below any arenas and private mmap()s, which we keep in case exec fails.
+#define EXEMAX  MIN(VM_SHAREHI-VM_SHARELO,VM_ARENALO-VM_SCRATCHLO)
 
 extern void start(void);
 extern void exec_start(intptr_t esp) gcc_noreturn;
 
-int exec_readelf(const char *path);
-intptr_t exec_copyargs(char *const argv[]);
+// Maximum number of segments whose pages exec_readelf() shares directly
+// with the executable file; any others it just copies.
+#define EXEC_MAXCOW  8
+
+// Executable images cached in files->image[i] live in child process
+// EXEC_IMAGEPID(i), counting down from the top to stay out of fork's way.
+#define EXEC_IMAGEPID(i)  (PROC_CHILDREN-1-(i))
+
+// The file state spawn() gives new children is kept ready between spawns
+// in the address space of child process EXEC_ZYGOTEPID, just below those.
+#define EXEC_ZYGOTEPID  EXEC_IMAGEPID(EXEC_CACHE)
+
+int exec_readelf(const char *path, pid_t pid);
+static execimage *exec_findimage(int ino);
+static void exec_copyimage(pid_t from, pid_t to);
+static void exec_dropimage(execimage *img);
+static filestate *exec_childfiles(void);
+static bool exec_childinode(filestate *cfiles, int ino);
+static bool exec_pageshared(proghdr *ph, proghdr *eph, proghdr *self,
+        intptr_t page);
+intptr_t exec_copyargs(char *const argv[], pid_t pid);
+void fork_childfiles(filestate *fs, bool inodes);
+void fork_childinode(filestate *fs, int ino);
 
 int
 execl(const char *path, const char *arg0, ...)
@@ -38,17 +62,20 @@ execl(const char *path, const char *arg0, ...)
 int
 execv(const char *path, char *const argv[])
 {
+  // The new program starts with fresh stdio buffers, so empty ours.
+  fflushbuf(NULL);
+
   // We'll build the new program in child 0,
   // which never represents a forked child since 0 is an invalid pid.
   // First clear out the new program's entire address space.
   sys_put(SYS_ZERO, 0, NULL, NULL, (void*)VM_USERLO, VM_USERHI-VM_USERLO);
 
   // Load the ELF executable into child 0.
-  if (exec_readelf(path) < 0)
+  if (exec_readelf(path, 0) < 0)
     return -1;
 
   // Setup child 0's stack with the argument array.
-  intptr_t esp = exec_copyargs(argv);
+  intptr_t esp = exec_copyargs(argv, 0);
 
   // Copy our Unix file system and process state into the child.
   sys_put(SYS_COPY, 0, NULL, (void*)VM_FILELO, (void*)VM_FILELO,
@@ -59,18 +86,96 @@ execv(const char *path, char *const argv[])
   exec_start(esp);
 }
 
-int
-exec_readelf(const char *path)
+// Start a new child process running the program at path,
+// like fork() followed by execv() in the child, but without ever
+// copying our own address space: we build the child's program image
+// directly from the ELF file, and give it only our file system state.
+// If fds is non-NULL, the child's standard input, output, and error
+// are copies of our descriptors fds[0], fds[1], and fds[2],
+// or closed where that entry is negative.
+pid_t
+spawn(const char *path, char *const argv[], const int fds[3])
 {
-  // We'll load the ELF image into a scratch area in our address space.
-  sys_get(SYS_ZERO, 0, NULL, NULL, (void*)VM_SCRATCHLO, EXEMAX);
+  int i;
+
+  // Write out buffered output first, as fork() does.
+  fflushbuf(NULL);
+
+  pid_t pid;
+  for (pid = 1; pid < 256; pid++)
+    if (files->child[pid].state == PROC_FREE)
+      break;
+  if (pid == 256) {
+    warn("spawn: no child process available");
+    errno = EAGAIN;
+    return -1;
+  }
+
+  // Load the program and its arguments into the fresh child.
+  sys_put(SYS_ZERO, pid, NULL, NULL, (void*)VM_USERLO, VM_USERHI-VM_USERLO);
+  if (exec_readelf(path, pid) < 0) {
+    sys_put(SYS_ZERO, pid, NULL, NULL, (void*)VM_USERLO,
+      VM_USERHI-VM_USERLO);
+    return -1;
+  }
+  intptr_t esp = exec_copyargs(argv, pid);
+
+  // Give the child our file data, and a copy of our file state
+  // set up the way a forked child would set up its own.
+  sys_put(SYS_COPY, pid, NULL, (void*)VM_FILELO, (void*)VM_FILELO,
+    VM_FILEHI-VM_FILELO);
+  filestate *cfiles = exec_childfiles();
+  if (fds != NULL)
+    for (i = 0; i < 3; i++) {
+      if (fds[i] < 0)
+        cfiles->fd[i].ino = FILEINO_NULL;
+      else
+        cfiles->fd[i] = files->fd[fds[i]];
+    }
+  sys_put(SYS_COPY, pid, NULL, (void*)VM_SCRATCHLO, (void*)FILESVA, PTSIZE);
+  sys_put(SYS_ZERO, 0, NULL, NULL, (void*)VM_SCRATCHLO, PTSIZE);
+  sys_get(SYS_ZERO, 0, NULL, NULL, (void*)VM_SCRATCHLO, PTSIZE);
+
+  // Start the child at the common entrypoint, on its new stack.
+  struct procstate ps;
+  memset(&ps, 0, sizeof(ps));
+  ps.tf.eip = (intptr_t) start;
+  ps.tf.esp = esp;
+  ps.pff = PFF_NONDET;
+  sys_put(SYS_REGS | SYS_START, pid, &ps, NULL, NULL, 0);
 
+  memset(&files->child[pid], 0, sizeof(files->child[pid]));
+  files->child[pid].state = PROC_FORKED;
+  files->child[pid].chgsync = files->chgseq;
+  files->chglast = 0;	// so the next change to it gets logged for the child
+
+  return pid;
+}
+
+int
+exec_readelf(const char *path, pid_t pid)
+{
   // Open the ELF image to load.
   filedesc *fd = filedesc_open(NULL, path, O_RDONLY, 0);
   if (fd == NULL)
     return -1;
-  void *imgdata = FILEDATA(fd->ino);
-  size_t imgsize = files->fi[fd->ino].size;
+  int ino = fd->ino;
+  size_t imgsize = files->fi[ino].size;
+
+  // If we've laid out this very version of the file before,
+  // just map the image we kept from then into the target child.
+  execimage *img = exec_findimage(ino);
+  if (img != NULL && img->ino == ino && img->ver == files->fi[ino].ver
+      && img->size == imgsize) {
+    exec_copyimage(EXEC_IMAGEPID(img - files->image), pid);
+    img->used = ++files->imgclock;
+    filedesc_close(fd);
+    return 0;
+  }
+
+  // We'll load the ELF image into a scratch area in our address space.
+  sys_get(SYS_ZERO, 0, NULL, NULL, (void*)VM_SCRATCHLO, EXEMAX);
+  void *imgdata = fileino_window(files, ino, 0);
 
   // Make sure it looks like an ELF image.
   elfhdr *eh = imgdata;
@@ -78,14 +183,23 @@ exec_readelf(const char *path)
     warn("exec_readelf: ELF header not found");
     goto err;
   }
+  if (imgsize > FILE_WINSIZE) {   // we read the image in place, below
+    warn("exec_readelf: ELF image spans more than one file window");
+    goto err;
+  }
 
-  // Load each program segment into the scratch area
+  // Load each program segment into the scratch area,
+  // except for the pages we can share copy-on-write with the file itself,
+  // which we queue up to map straight into the target child afterwards.
   proghdr *ph = imgdata + eh->e_phoff;
   proghdr *eph = ph + eh->e_phnum;
   if (imgsize < (void*)eph - imgdata) {
     warn("exec_readelf: ELF program header truncated");
     goto err;
   }
+  sysvec vec[1+EXEC_MAXCOW];
+  int ncow = 0;
+  proghdr *ph0 = ph;
   for (; ph < eph; ph++) {
     if (ph->p_type != ELF_PROG_LOAD)
       continue;
@@ -99,6 +213,13 @@ exec_readelf(const char *path)
         "(%d bytes > %d max)", vahi-valo, EXEMAX);
       goto err;
     }
+    intptr_t filelo = ph->p_offset;
+    intptr_t filehi = filelo + ph->p_filesz;
+    if (filelo < 0 || filelo > imgsize
+        || filehi < filelo || filehi > imgsize) {
+      warn("exec_readelf: loaded section out of bounds");
+      goto err;
+    }
 
     // Map all pages the segment touches in our scratch region.
     // They've already been zeroed by the SYS_ZERO above.
@@ -108,18 +229,40 @@ exec_readelf(const char *path)
     sys_get(SYS_PERM | SYS_READ | SYS_WRITE, 0, NULL, NULL,
       (void*)pagelo + scratchofs, pagehi - pagelo);
 
-    // Initialize the file-loaded part of the ELF image.
-    // (We could use copy-on-write if SYS_COPY
-    // supports copying at arbitrary page boundaries.)
-    intptr_t filelo = ph->p_offset;
-    intptr_t filehi = filelo + ph->p_filesz;
-    if (filelo < 0 || filelo > imgsize
-        || filehi < filelo || filehi > imgsize) {
-      warn("exec_readelf: loaded section out of bounds");
-      goto err;
+    // Share the pages the file's bytes fill copy-on-write with the file.
+    // A partial page at either end can be shared too, extra file bytes
+    // and all, if no other segment uses that page -
+    // and at the top, if there's no .bss in it that we'd have to clear.
+    intptr_t vafile = valo + ph->p_filesz;
+    intptr_t cowlo = ROUNDUP(valo, PAGESIZE);
+    intptr_t cowhi = ROUNDDOWN(vafile, PAGESIZE);
+    if (PGOFF(valo) == PGOFF(filelo)) {
+      if (cowlo > valo && !exec_pageshared(ph0, eph, ph, pagelo))
+        cowlo = pagelo;
+      if (cowhi < vafile && vahi == vafile
+          && !exec_pageshared(ph0, eph, ph, cowhi))
+        cowhi = ROUNDUP(vafile, PAGESIZE);
+    }
+    if (PGOFF(valo) != PGOFF(filelo) || cowlo >= cowhi
+        || ncow == EXEC_MAXCOW)
+      cowlo = cowhi = valo;     // no pages to share: copy it all
+    else {
+      sysvec *v = &vec[1 + ncow++];
+      v->cmd = SYS_PUT | SYS_COPY | SYS_PERM | SYS_READ |
+        (ph->p_flags & ELF_PROG_FLAG_WRITE ? SYS_WRITE : 0);
+      v->child = pid;
+      v->save = NULL;
+      v->src = imgdata + ROUNDDOWN(filelo, PAGESIZE) + (cowlo - pagelo);
+      v->dst = (void*)cowlo;
+      v->size = cowhi - cowlo;
     }
-    memcpy((void*)valo + scratchofs, imgdata + filelo,
-      filehi - filelo);
+
+    // Copy the rest of the file-loaded part: any partial pages at either end.
+    if (cowlo > valo)
+      memcpy((void*)valo + scratchofs, imgdata + filelo, cowlo - valo);
+    if (cowhi < vafile)
+      memcpy((void*)cowhi + scratchofs, imgdata + filelo + (cowhi - valo),
+        vafile - cowhi);
 
     // Finally, remove write permissions on read-only segments.
     if (!(ph->p_flags & ELF_PROG_FLAG_WRITE))
@@ -127,9 +270,15 @@ exec_readelf(const char *path)
         (void*)pagelo + scratchofs, pagehi - pagelo);
   }
 
-  // Copy the ELF image into its correct position in child 0.
-  sys_put(SYS_COPY, 0, NULL, (void*)VM_SCRATCHLO,
-    (void*)VM_USERLO, EXEMAX);
+  // Copy the ELF image into its correct position in the target child,
+  // then map the file's shared pages over it, all in one system call.
+  vec[0].cmd = SYS_PUT | SYS_COPY;
+  vec[0].child = pid;
+  vec[0].save = NULL;
+  vec[0].src = (void*)VM_SCRATCHLO;
+  vec[0].dst = (void*)VM_USERLO;
+  vec[0].size = EXEMAX;
+  sys_vec(vec, 1 + ncow);
 
   // The new program should have the same entrypoint as we do!
   if (eh->e_entry != (intptr_t)start) {
@@ -137,16 +286,149 @@ exec_readelf(const char *path)
     goto err;
   }
 
+  // Keep a copy of the finished image for next time.
+  if (img != NULL) {
+    pid_t ipid = EXEC_IMAGEPID(img - files->image);
+    exec_copyimage(pid, ipid);
+    files->child[ipid].state = PROC_RESERVED;
+    img->ino = ino;
+    img->ver = files->fi[ino].ver;
+    img->size = imgsize;
+    img->used = ++files->imgclock;
+  }
+
   filedesc_close(fd); // Done with the ELF file
   return 0;
 
 err:
+  if (img != NULL && img->ino == ino)   // our old image is stale anyway
+    exec_dropimage(img);
   filedesc_close(fd);
   return -1;
 }
 
+// Find the cached image entry for inode ino, if it has one,
+// or else the entry to reuse for it: a free one or the least recently used.
+// Returns NULL if no entry is available because forked children
+// are using the process slots that would hold the images.
+static execimage *
+exec_findimage(int ino)
+{
+  execimage *img, *best = NULL;
+  int i;
+  for (i = 0; i < EXEC_CACHE; i++) {
+    img = &files->image[i];
+    if (img->ino == ino)
+      return img;
+    if (img->ino == 0
+        && files->child[EXEC_IMAGEPID(i)].state != PROC_FREE)
+      continue;       // slot taken by a forked child
+    if (best == NULL || (best->ino != 0 &&
+        (img->ino == 0 || img->used < best->used)))
+      best = img;
+  }
+  return best;
+}
+
+// Prepare at VM_SCRATCHLO the file state spawn() gives a new child,
+// a copy of ours set up with fork_childfiles(), and return it.
+// Setting up every inode that way touches the whole inode table,
+// so we keep the result in child EXEC_ZYGOTEPID, and next time
+// copy it back and set up again just the inodes our change log shows
+// changed since, and the special files the kernel changes behind our back.
+// We start over when the log has wrapped, or a file's name changed,
+// which would leave the kept directory entry index out of date.
+static filestate *
+exec_childfiles(void)
+{
+  filestate *cfiles = (filestate*)VM_SCRATCHLO;
+  pid_t zpid = EXEC_ZYGOTEPID;
+  bool kept = files->zygote != 0
+    && files->chgseq - files->zygsync <= FILE_CHGLOG;
+  if (kept) {
+    sys_get(SYS_COPY, zpid, NULL, (void*)FILESVA, (void*)VM_SCRATCHLO,
+      PTSIZE);
+
+    // All but the inodes and their index we take from ours as it is now.
+    memcpy(cfiles, files, offsetof(filestate, fi));
+    memcpy(&cfiles->chgseq, &files->chgseq,
+      sizeof(filestate) - offsetof(filestate, chgseq));
+    fork_childfiles(cfiles, 0);
+
+    int ino;
+    for (ino = 1; ino < FILEINO_GENERAL; ino++)
+      kept &= exec_childinode(cfiles, ino);
+    kept &= exec_childinode(cfiles, files->zyglast);  // changed unlogged?
+    kept &= exec_childinode(cfiles, files->chglast);
+    uint32_t n;
+    for (n = files->zygsync; n != files->chgseq; n++)
+      kept &= exec_childinode(cfiles, files->chglog[n % FILE_CHGLOG]);
+  }
+  if (!kept) {
+    // Adjust a whole copy in our scratch area, bouncing it there
+    // copy-on-write through child 0, so only pages we touch get copied.
+    sys_put(SYS_COPY, 0, NULL, (void*)FILESVA, (void*)VM_SCRATCHLO, PTSIZE);
+    sys_get(SYS_COPY, 0, NULL, (void*)VM_SCRATCHLO, (void*)VM_SCRATCHLO,
+      PTSIZE);
+    fork_childfiles(cfiles, 1);
+  }
+
+  // Keep it for next time, if no forked child has the zygote's slot.
+  if (files->zygote != 0 || files->child[zpid].state == PROC_FREE) {
+    sys_put(SYS_COPY, zpid, NULL, (void*)VM_SCRATCHLO, (void*)FILESVA,
+      PTSIZE);
+    files->child[zpid].state = PROC_RESERVED;
+    files->zygote = zpid;
+    files->zygsync = files->chgseq;
+    files->zyglast = files->chglast;
+  }
+  return cfiles;
+}
+
+// Bring inode ino of a new child's file state kept by exec_childfiles()
+// up to date with ours, keeping its own directory entry index links.
+// Returns false if the inode's name or directory changed.
+static bool
+exec_childinode(filestate *cfiles, int ino)
+{
+  if (ino == FILEINO_NULL)
+    return 1;
+  fileinode *cfi = &cfiles->fi[ino], *fi = &files->fi[ino];
+  bool same = cfi->dino == fi->dino
+    && strcmp(cfi->de.d_name, fi->de.d_name) == 0;
+  int dhnext = cfi->dhnext;
+  *cfi = *fi;
+  cfi->dhnext = dhnext;
+  fork_childinode(cfiles, ino);
+  return same;
+}
+
+// Copy a laid-out executable image from child process from to child to,
+// bouncing it copy-on-write through our scratch area.
+static void
+exec_copyimage(pid_t from, pid_t to)
+{
+  sysvec vec[2] = {
+    { SYS_GET | SYS_COPY, from, NULL, EXEMAX,
+      (void*)VM_USERLO, (void*)VM_SCRATCHLO },
+    { SYS_PUT | SYS_COPY, to, NULL, EXEMAX,
+      (void*)VM_SCRATCHLO, (void*)VM_USERLO },
+  };
+  sys_vec(vec, 2);
+}
+
+// Forget a cached image and release the child process holding it.
+static void
+exec_dropimage(execimage *img)
+{
+  pid_t ipid = EXEC_IMAGEPID(img - files->image);
+  sys_put(SYS_ZERO, ipid, NULL, NULL, (void*)VM_USERLO, VM_USERHI-VM_USERLO);
+  files->child[ipid].state = PROC_FREE;
+  memset(img, 0, sizeof(*img));
+}
+
 intptr_t
-exec_copyargs(char *const argv[])
+exec_copyargs(char *const argv[], pid_t pid)
 {
   // Give the process a nice big 4MB, zero-filled stack.
   sys_get(SYS_ZERO | SYS_PERM | SYS_READ | SYS_WRITE, 0, NULL,
@@ -207,8 +489,8 @@ exec_copyargs(char *const argv[])
   mv_esp -= sizeof(int);                    // Room for argc
   *(int *)mv_esp = argc;                    // Copy argc
 
-  // Copy the stack into its correct position in child 0.
-  sys_put(SYS_COPY, 0, NULL, (void*)VM_SCRATCHLO,
+  // Copy the stack into its correct position in the target child.
+  sys_put(SYS_COPY, pid, NULL, (void*)VM_SCRATCHLO,
     (void*)VM_STACKHI-PTSIZE, PTSIZE);
 
   // We eventually return the esp that starts at STACKHI, so
@@ -216,3 +498,15 @@ exec_copyargs(char *const argv[])
   return offset + mv_esp;
 }
 
+// Does any loadable segment in [ph,eph) other than self
+// touch the page at virtual address page?
+static bool
+exec_pageshared(proghdr *ph, proghdr *eph, proghdr *self, intptr_t page)
+{
+  for (; ph < eph; ph++)
+    if (ph != self && ph->p_type == ELF_PROG_LOAD
+        && page >= ROUNDDOWN(ph->p_va, PAGESIZE)
+        && page < ROUNDUP(ph->p_va + ph->p_memsz, PAGESIZE))
+      return 1;
+  return 0;
+}
@@ -55,17 +55,14 @@ fileino_create(filestate *fs, int dino, const char *name)
 	assert(strlen(name) <= NAME_MAX);
 
 	// First see if an inode already exists for this directory and name.
-	int i;
-	for (i = FILEINO_GENERAL; i < FILE_INODES; i++)
-		if (fs->fi[i].dino == dino
-				&& strcmp(fs->fi[i].de.d_name, name) == 0)
-			return i;
+	int i = fileino_lookup(fs, dino, name, strlen(name));
+	if (i >= FILEINO_GENERAL)
+		return i;
 
 	// No inode allocated to this name - find a free one to allocate.
 	for (i = FILEINO_GENERAL; i < FILE_INODES; i++)
 		if (fs->fi[i].de.d_name[0] == 0) {
-			fs->fi[i].dino = dino;
-			strcpy(fs->fi[i].de.d_name, name);
+			fileino_setname(fs, i, dino, name);
 			return i;
 		}
 
@@ -74,6 +71,117 @@ fileino_create(filestate *fs, int dino, const char *name)
 	return -1;
 }
 
+// The directory entry index in fs->dhash chains together, through dhnext,
+// all allocated inodes whose (dino, name) pairs hash to the same bucket,
+// so that path lookup needn't scan every inode for each component.
+// The kernel sets up the root process's file state without the index,
+// so fs->dhvalid starts out false and the first lookup builds it.
+// Since the parent maintains a child's index during reconciliation,
+// chains in 'fs' might be garbage: we rebuild them if they look it.
+
+// Hash the len-byte name 'name' in directory dino to a dhash bucket.
+static int
+fileino_dhash(int dino, const char *name, int len)
+{
+	uint32_t h = dino;
+	while (len-- > 0)
+		h = h * 31 + (uint8_t)*name++;
+	return h % FILE_DHASH;
+}
+
+// Rebuild the directory entry index of file state 'fs' from scratch.
+void
+fileino_reindex(filestate *fs)
+{
+	memset(fs->dhash, 0, sizeof(fs->dhash));
+	int ino;
+	for (ino = FILE_INODES-1; ino > 0; ino--) {	// chains in ino order
+		fileinode *fi = &fs->fi[ino];
+		fi->dhnext = 0;
+		if (fi->de.d_name[0] == 0)
+			continue;	// not allocated
+		int *head = &fs->dhash[fileino_dhash(fi->dino, fi->de.d_name,
+						strlen(fi->de.d_name))];
+		fi->dhnext = *head;
+		*head = ino;
+	}
+	fs->dhvalid = 1;
+}
+
+// Find the inode of the entry in directory dino of file state 'fs'
+// whose name is the len bytes at 'name', which needn't be null-terminated.
+// Returns the inode number found, or 0 if there is no such entry.
+int
+fileino_lookup(filestate *fs, int dino, const char *name, int len)
+{
+	if (len <= 0 || len > NAME_MAX)
+		return 0;
+	if (!fs->dhvalid)
+		fileino_reindex(fs);
+
+	again:;
+	int ino = fs->dhash[fileino_dhash(dino, name, len)], n = 0;
+	for (; ino != 0; ino = fs->fi[ino].dhnext) {
+		if (!fileino_isvalid(ino) || ++n > FILE_INODES) {
+			warn("fileino_lookup: corrupt index, rebuilding");
+			fileino_reindex(fs);
+			goto again;
+		}
+		fileinode *fi = &fs->fi[ino];
+		if (fi->dino == dino && memcmp(fi->de.d_name, name, len) == 0
+				&& fi->de.d_name[len] == 0)
+			return ino;
+	}
+	return 0;
+}
+
+// Give inode 'ino' of file state 'fs' the name 'name' in directory dino,
+// moving it to the right chain of the directory entry index.
+void
+fileino_setname(filestate *fs, int ino, int dino, const char *name)
+{
+	assert(fileino_isvalid(ino));
+	assert(name != NULL && name[0] != 0 && strlen(name) <= NAME_MAX);
+	fileinode *fi = &fs->fi[ino];
+
+	// Unlink the inode from the chain its old name put it on, if any.
+	if (fs->dhvalid && fi->de.d_name[0] != 0) {
+		int *pp = &fs->dhash[fileino_dhash(fi->dino, fi->de.d_name,
+						strlen(fi->de.d_name))];
+		int n = 0;
+		while (*pp != ino && fileino_isvalid(*pp) && ++n <= FILE_INODES)
+			pp = &fs->fi[*pp].dhnext;
+		if (*pp == ino)
+			*pp = fi->dhnext;
+		else
+			fs->dhvalid = 0;	// Not where it should be: rebuild
+	}
+
+	fi->dino = dino;
+	strcpy(fi->de.d_name, name);
+	fileino_logchg(fs, ino);
+
+	if (fs->dhvalid) {
+		int *head = &fs->dhash[fileino_dhash(dino, name, strlen(name))];
+		fi->dhnext = *head;
+		*head = ino;
+	}
+}
+
+// Log that inode 'ino' of file state 'fs' has changed,
+// so that the next reconcile() with our parent or children will visit it.
+// Consecutive changes to the same inode between reconciles log it once:
+// reconcile() looks at an inode's current state, not at the log entry.
+void
+fileino_logchg(filestate *fs, int ino)
+{
+	assert(fileino_isvalid(ino));
+	if (fs->chglast == ino)
+		return;		// Already logged and not yet reconciled
+	fs->chglog[fs->chgseq++ % FILE_CHGLOG] = ino;
+	fs->chglast = ino;
+}
+
 // Read up to 'count' data elements each of size 'eltsize',
 // starting at absolute byte offset 'ofs' within the file in inode 'ino'.
 // Returns the number of elements (NOT the number of bytes!) actually read,
@@ -89,7 +197,7 @@ fileino_read(int ino, off_t ofs, void *buf, size_t eltsize, size_t count)
 	assert(eltsize > 0);
 
 	fileinode *fi = &files->fi[ino];
-	assert(fi->size <= FILE_MAXSIZE);
+	assert(fi->size <= fileino_maxsize(ino));
 
 	// If nothing to read return 0
 	if(count == 0) {
@@ -98,7 +206,8 @@ fileino_read(int ino, off_t ofs, void *buf, size_t eltsize, size_t count)
 	// Reading past end of file
 	while(ofs >= fi->size) {
 		if(fi->mode & S_IFPART) {
-			// Part file: wait for input
+			// Part file: wait for input, showing any output first
+			fflushbuf(NULL);
 			sys_ret();
 		} else {
 			// Not a part file, empty read.
@@ -106,26 +215,271 @@ fileino_read(int ino, off_t ofs, void *buf, size_t eltsize, size_t count)
 		}
 	}
 
-	// Get start pointer
-	void *place = FILEDATA(ino) + ofs;
 	int bytes_left = fi->size - ofs;
 	int bytes_to_read = eltsize*count;
 
 	// Find the limiting factor: file size or things to read
 	int limit = bytes_to_read < bytes_left ? bytes_to_read : bytes_left;
 	// Copy data over
-	memcpy(buf, place, limit);
+	fileino_copy(ino, ofs, buf, limit, 0);
 	// cprintf("fileino_read: limit: %d, read: %d", limit, limit/eltsize);
 	return limit/eltsize;
 }
 
+// Regular files are mapped read/write ahead of their size,
+// so that a growing file needn't change permissions on every new page:
+// the first fileino_maplim(size) bytes of a file's storage are mapped,
+// where the mapped extent doubles each time the file outgrows it,
+// and everything past that extent is unmapped.
+size_t
+fileino_maplim(off_t size)
+{
+	if (size == 0)
+		return 0;
+	size_t lim = PAGESIZE;
+	while (lim < size)
+		lim <<= 1;
+	return MIN(lim, FILE_WINSIZE);
+}
+
+// Return how much of data window k of a file of a given size is mapped:
+// all of every window but the last, and fileino_maplim() of the last.
+size_t
+fileino_winlim(off_t size, int k)
+{
+	int nwin = FILE_NWIN(size);
+	if (k >= nwin)
+		return 0;
+	if (k < nwin-1)
+		return FILE_WINSIZE;
+	return fileino_maplim(size - (off_t)k * FILE_WINSIZE);
+}
+
+// Return the address at which window k of the file in inode 'ino'
+// of file state 'fs' lives, i.e., its file bytes from k*FILE_WINSIZE on,
+// or NULL if it has no storage there.
+// Checks the storage really belongs to the file,
+// since the parent also looks up windows in its children's file state.
+void *
+fileino_window(filestate *fs, int ino, int k)
+{
+	assert(fileino_isvalid(ino));
+	fileinode *fi = &fs->fi[ino];
+	if (k < 0 || k >= FILE_MAXEXT || (fi->slot && k > 0))
+		return NULL;
+	int w = fi->win[k];
+	if (w == 0)
+		return NULL;
+	if (fi->slot == 0)
+		return fs->winuse[w] == ino ? FILEDATA(w) : NULL;
+	int s = fi->slot - 1;
+	if (s >= FILE_NSLOTS || fs->winuse[w] != FILEWIN_SHARED
+			|| fs->slotuse[w][s] != ino)
+		return NULL;
+	return FILEDATA(w) + s * FILE_SLOTSIZE;
+}
+
+// Give inode 'ino' of file state 'fs' a free slot in a shared window,
+// sharing out a free window if all the shared ones are full.
+static int
+fileino_allocslot(filestate *fs, int ino)
+{
+	int w, s = 0, fw = 0;
+	for (w = 1; w < FILE_WINDOWS; w++) {
+		if (fs->winuse[w] == FILEWIN_FREE && fw == 0)
+			fw = w;
+		if (fs->winuse[w] != FILEWIN_SHARED)
+			continue;
+		for (s = 0; s < FILE_NSLOTS && fs->slotuse[w][s] != 0; s++)
+			;
+		if (s < FILE_NSLOTS)
+			break;
+	}
+	if (w == FILE_WINDOWS) {
+		if (fw == 0) {
+			warn("fileino_allocslot: no free windows\n");
+			errno = ENOSPC;
+			return -1;
+		}
+		w = fw, s = 0;
+		fs->winuse[w] = FILEWIN_SHARED;
+	}
+	fs->slotuse[w][s] = ino;
+	fs->fi[ino].win[0] = w;
+	fs->fi[ino].slot = s + 1;
+	return 0;
+}
+
+// Free slot s of shared window w, and the window once all its slots are.
+static void
+fileino_freeslot(filestate *fs, int w, int s)
+{
+	fs->slotuse[w][s] = 0;
+	for (s = 0; s < FILE_NSLOTS; s++)
+		if (fs->slotuse[w][s] != 0)
+			return;
+	fs->winuse[w] = FILEWIN_FREE;
+}
+
+// Make sure the file in inode 'ino' of file state 'fs' has storage
+// for its first 'size' bytes, allocating free windows as needed.
+// A file with no storage yet that fits in a slot just gets a slot.
+// A file that outgrows its slot moves into windows of its own:
+// then we return 1 and set *oldslot to the address of its old slot,
+// which is already free, and which the caller must move the data out of
+// and then empty, before allocating anything else.
+// Otherwise returns 0, or -1 with errno set if there isn't enough room.
+int
+fileino_reserve(filestate *fs, int ino, off_t size, void **oldslot)
+{
+	fileinode *fi = &fs->fi[ino];
+	void *seg0 = fileino_window(fs, ino, 0);
+	int k, nwin = FILE_NWIN(size);
+	assert(nwin <= FILE_MAXEXT);
+	*oldslot = NULL;
+	if (seg0 == NULL)
+		fi->slot = 0;		// whatever it names isn't really ours
+	if (size == 0 || (fi->slot && size <= FILE_SLOTSIZE))
+		return 0;
+	if (seg0 == NULL && size <= FILE_SLOTSIZE)
+		return fileino_allocslot(fs, ino);
+
+	// Find all the windows we need before taking any,
+	// so that we fail without disturbing the file.
+	bool moving = fi->slot != 0;
+	uint8_t win[FILE_MAXEXT];
+	int w = 1;
+	for (k = 0; k < nwin; k++) {
+		win[k] = 0;
+		if (!moving && fileino_window(fs, ino, k) != NULL)
+			continue;
+		while (w < FILE_WINDOWS && fs->winuse[w] != FILEWIN_FREE)
+			w++;
+		if (w == FILE_WINDOWS) {
+			warn("fileino_reserve: no free windows\n");
+			errno = ENOSPC;
+			return -1;
+		}
+		win[k] = w++;
+	}
+	if (moving) {
+		*oldslot = seg0;
+		fileino_freeslot(fs, fi->win[0], fi->slot - 1);
+		fi->slot = 0;
+	}
+	for (k = 0; k < nwin; k++)
+		if (win[k] != 0) {
+			fs->winuse[win[k]] = ino;
+			fi->win[k] = win[k];
+		}
+	return moving;
+}
+
+// Give back the storage of inode 'ino' of file state 'fs'
+// from window nwin on, or all of it if nwin is 0,
+// except that the console files keep their fixed windows.
+// The caller must already have emptied it.
+void
+fileino_dropwindows(filestate *fs, int ino, int nwin)
+{
+	fileinode *fi = &fs->fi[ino];
+	int k;
+	if (ino < FILEINO_GENERAL)
+		nwin = MAX(nwin, 1);
+	for (k = nwin; k < FILE_MAXEXT; k++) {
+		if (fileino_window(fs, ino, k) != NULL) {
+			if (fi->slot)
+				fileino_freeslot(fs, fi->win[k], fi->slot - 1);
+			else
+				fs->winuse[fi->win[k]] = FILEWIN_FREE;
+		}
+		fi->win[k] = 0;
+	}
+	if (nwin == 0)
+		fi->slot = 0;
+}
+
+// Grow the mapped extent of our file 'ino' to cover newsize bytes,
+// reserving storage as needed, but without changing its size.
+// Returns 0 on success, or -1 with errno set.
+int
+fileino_grow(int ino, off_t newsize)
+{
+	fileinode *fi = &files->fi[ino];
+	void *oldslot;
+	int moved = fileino_reserve(files, ino, newsize, &oldslot);
+	if (moved < 0)
+		return -1;
+	size_t oldsize = moved ? 0 : fi->size;	// new windows are unmapped
+	int k, nwin = FILE_NWIN(newsize);
+	for (k = FILE_NWIN(oldsize) - 1; k < nwin; k++) {
+		size_t oldlim = fileino_winlim(oldsize, k);
+		size_t newlim = fileino_winlim(newsize, k);
+		if (newlim > oldlim)
+			sys_get(SYS_PERM | SYS_READ | SYS_WRITE, 0, NULL, NULL,
+				fileino_window(files, ino, k) + oldlim,
+				newlim - oldlim);
+	}
+	if (moved) {
+		// Bring the content along out of the slot, and empty that.
+		memcpy(fileino_window(files, ino, 0), oldslot, fi->size);
+		sys_get(SYS_ZERO, 0, NULL, NULL, oldslot, FILE_SLOTSIZE);
+	}
+	return 0;
+}
+
+// Move our file 'ino' out of its slot, if it's in one,
+// into a window of its own, so that its content stays put as it grows
+// (e.g., while mmap() has handed out pointers to it).
+// Returns 0 on success, or -1 with errno set.
+int
+fileino_unslot(int ino)
+{
+	fileinode *fi = &files->fi[ino];
+	void *oldslot;
+	if (fi->slot == 0)
+		return 0;
+	int moved = fileino_reserve(files, ino, FILE_SLOTSIZE+1, &oldslot);
+	if (moved <= 0)
+		return moved;
+	void *win = fileino_window(files, ino, 0);
+	size_t lim = fileino_maplim(fi->size);
+	if (lim > 0)
+		sys_get(SYS_PERM | SYS_READ | SYS_WRITE, 0, NULL, NULL, win, lim);
+	memcpy(win, oldslot, fi->size);
+	sys_get(SYS_ZERO, 0, NULL, NULL, oldslot, FILE_SLOTSIZE);
+	return 0;
+}
+
+// Copy len bytes between buf and our file 'ino' from offset ofs,
+// into the file if towrite is true, window by window.
+// The file must already be mapped that far.
+void
+fileino_copy(int ino, off_t ofs, void *buf, size_t len, bool towrite)
+{
+	while (len > 0) {
+		void *win = fileino_window(files, ino, ofs / FILE_WINSIZE);
+		assert(win != NULL);
+		size_t wofs = ofs % FILE_WINSIZE;
+		size_t n = MIN(len, FILE_WINSIZE - wofs);
+		if (towrite)
+			memcpy(win + wofs, buf, n);
+		else
+			memcpy(buf, win + wofs, n);
+		ofs += n;
+		buf += n;
+		len -= n;
+	}
+}
+
 // Write 'count' data elements each of size 'eltsize'
 // starting at absolute byte offset 'ofs' within the file in inode 'ino'.
 // Returns the number of elements actually written,
 // which should always be equal to the 'count' input parameter
 // unless an error occurs, in which case this function
 // returns -1 and sets errno appropriately.
-// Since PIOS files can be up to only FILE_MAXSIZE bytes in size (4MB),
+// Since PIOS files can be up to only FILE_MAXSIZE bytes in size (64MB),
+// or FILE_WINSIZE (4MB) for the console files,
 // one particular reason an error might occur is if an application
 // tries to grow a file beyond this maximum file size,
 // in which case this function generates the EFBIG error.
@@ -136,36 +490,31 @@ fileino_write(int ino, off_t ofs, const void *buf, size_t eltsize, size_t count)
 	assert(ofs >= 0);
 	assert(eltsize > 0);
 	fileinode *fi = &files->fi[ino];
-	assert(fi->size <= FILE_MAXSIZE);
+	assert(fi->size <= fileino_maxsize(ino));
 
 	// Rafi's asserts
 	int bytes_to_write = eltsize * count;
 	int end = ofs + bytes_to_write;
 	// cprintf("fileino_write: writing %d bytes from %x to %x\n", bytes_to_write, FILEDATA(ino)+ofs, buf);
 	// Check that the file isn't getting too big, or b_t_w wasn't negative / wrapped around
-	if(end < ofs || end > FILE_MAXSIZE) {
+	if(end < ofs || end > fileino_maxsize(ino)) {
 		errno = EFBIG;
 		warn("fileino_write: file ino %d too big, not writing\n", ino);
 		return -1;
 	}
 	// File is growing
 	if(end > fi->size) {
-		// see if it crosses a page boundary
-		int oldsize = ROUNDUP(fi->size, PAGESIZE);
-		int newsize = ROUNDUP(end, PAGESIZE);
-		if(newsize > oldsize) {
-			// cprintf("fileino_write: growing from %d to %d\n", oldsize, newsize);
-			// Set the new page permissions appropriately
-			sys_get(SYS_PERM | SYS_READ | SYS_WRITE, 0, NULL, NULL,
-				FILEDATA(ino) + oldsize, newsize-oldsize);
-		}
+		// Map whatever it outgrows of its mapped extent
+		if(fileino_grow(ino, end) < 0)
+			return -1;
 		fi->size = end;
 	}
 
 	// cprintf("fileino_write: copying %d bytes from %x to %x\n", 
 	// 	bytes_to_write, FILEDATA(ino) + ofs, buf);
 	// Copy data over, this time from the buffer into the file.
-	memcpy(FILEDATA(ino) + ofs, buf, bytes_to_write);
+	fileino_copy(ino, ofs, (void*)buf, bytes_to_write, 1);
+	fileino_logchg(files, ino);
 	return count;
 }
 
@@ -187,7 +536,9 @@ fileino_stat(int ino, struct stat *st)
 }
 
 // Grow or shrink a file to exactly a specified size.
-// If growing a file, then fills the new space with zeros.
+// If growing a file, then the new space reads as zeros;
+// it's just a hole, though, taking no memory until something writes it,
+// since a file's storage past its end always holds zeros.
 // Returns 0 if successful, or returns -1 and sets errno on error.
 int
 fileino_truncate(int ino, off_t newsize)
@@ -196,29 +547,67 @@ fileino_truncate(int ino, off_t newsize)
 	assert(newsize >= 0 && newsize <= FILE_MAXSIZE);
 
 	size_t oldsize = files->fi[ino].size;
-	size_t oldpagelim = ROUNDUP(files->fi[ino].size, PAGESIZE);
-	size_t newpagelim = ROUNDUP(newsize, PAGESIZE);
 	if (newsize > oldsize) {
-		// Grow the file and fill the new space with zeros.
-		sys_get(SYS_PERM | SYS_READ | SYS_WRITE, 0, NULL, NULL,
-			FILEDATA(ino) + oldpagelim,
-			newpagelim - oldpagelim);
-		memset(FILEDATA(ino) + oldsize, 0, newsize - oldsize);
-	} else if (newsize > 0) {
-		// Shrink the file, but not all the way to empty.
-		// Would prefer to use SYS_ZERO to free the file content,
-		// but SYS_ZERO isn't guaranteed to work at page granularity.
-		sys_get(SYS_PERM, 0, NULL, NULL,
-			FILEDATA(ino) + newpagelim, FILE_MAXSIZE - newpagelim);
+		// Grow the file's mapped extent, which is zero pages already.
+		if (fileino_grow(ino, newsize) < 0)
+			return -1;
 	} else {
-		// Shrink the file to empty.  Use SYS_ZERO to free completely.
-		sys_get(SYS_ZERO, 0, NULL, NULL, FILEDATA(ino), FILE_MAXSIZE);
+		// Empty and give back the windows past the new last one,
+		// or all of the file's storage if it becomes empty.
+		int k, nwin = FILE_NWIN(newsize), nkeep = newsize ? nwin : 0;
+		size_t segsize = fileino_segsize(files, ino);
+		for (k = nkeep; k < FILE_NWIN(oldsize); k++) {
+			void *win = fileino_window(files, ino, k);
+			if (win != NULL)
+				sys_get(SYS_ZERO, 0, NULL, NULL, win,
+					k == 0 ? segsize : FILE_WINSIZE);
+		}
+		fileino_dropwindows(files, ino, nkeep);
+
+		// Shrink the last window we keep, but not all the way to empty,
+		// clearing the rest of the page holding the new end of file,
+		// freeing the pages past it,
+		// then map fresh zero pages out to the new extent.
+		k = nwin - 1;
+		void *win = fileino_window(files, ino, k);
+		if (win != NULL) {
+			size_t wsize = newsize - (off_t)k * FILE_WINSIZE;
+			size_t wlim = k == 0 ? segsize : FILE_WINSIZE;
+			size_t newpagelim = ROUNDUP(wsize, PAGESIZE);
+			size_t newmaplim = fileino_winlim(newsize, k);
+			size_t oldwsize = MIN(oldsize - (off_t)k * FILE_WINSIZE,
+						newpagelim);
+			size_t i = wsize;
+			while (i < oldwsize && ((char*)win)[i] == 0)
+				i++;	// (don't write to a hole just to clear it)
+			if (i < oldwsize)
+				memset(win + i, 0, oldwsize - i);
+			sys_get(SYS_ZERO, 0, NULL, NULL,
+				win + newpagelim, wlim - newpagelim);
+			if (newmaplim > newpagelim)
+				sys_get(SYS_PERM | SYS_READ | SYS_WRITE, 0, NULL, NULL,
+					win + newpagelim, newmaplim - newpagelim);
+		}
 	}
 	files->fi[ino].size = newsize;
 	files->fi[ino].ver++;	// truncation is always an exclusive change
+	fileino_logchg(files, ino);
 	return 0;
 }
 
+// Mark the end of the data written to pipe 'ino',
+// so that readers see end-of-file once they have read everything before it.
+// This is an exclusive change, so reconciliation carries it to everyone.
+void
+fileino_endpipe(int ino)
+{
+	assert(fileino_ispipe(ino));
+
+	files->fi[ino].mode &= ~S_IFPART;
+	files->fi[ino].ver++;
+	fileino_logchg(files, ino);
+}
+
 // Flush any outstanding writes on this file to our parent process.
 // (XXX should flushes propagate across multiple levels?)
 int
@@ -226,8 +615,10 @@ fileino_flush(int ino)
 {
 	assert(fileino_isvalid(ino));
 
-	if (files->fi[ino].size > files->fi[ino].rlen)
+	if (files->fi[ino].size > files->fi[ino].rlen) {
+		fflushbuf(NULL);
 		sys_ret();	// synchronize and reconcile with parent
+	}
 	return 0;
 }
 
@@ -325,6 +716,7 @@ filedesc_read(filedesc *fd, void *buf, size_t eltsize, size_t count)
 {
 	assert(filedesc_isreadable(fd));
 	fileinode *fi = &files->fi[fd->ino];
+	fflushbuf(fd);		// see our own buffered writes
 
 	ssize_t actual = fileino_read(fd->ino, fd->ofs, buf, eltsize, count);
 	if (actual < 0) {
@@ -349,6 +741,7 @@ filedesc_write(filedesc *fd, const void *buf, size_t eltsize, size_t count)
 {
 	assert(filedesc_iswritable(fd));
 	fileinode *fi = &files->fi[fd->ino];
+	fflushbuf(fd);		// keep any buffered stdio output in order
 
 	// If we're appending to the file, seek to the end first.
 	if (fd->flags & O_APPEND)
@@ -371,6 +764,14 @@ filedesc_write(filedesc *fd, const void *buf, size_t eltsize, size_t count)
 	fd->ofs += eltsize * count;
 	assert(fi->size >= fd->ofs);
 
+	// Don't get too far ahead of whoever reads a pipe:
+	// hand a pipe's new data up to our parent every PIPE_BUF bytes or so.
+	if (fileino_ispipe(fd->ino)) {
+		fd->flags |= O_WROTE;
+		if (fi->size - fi->rlen >= PIPE_BUF)
+			fileino_flush(fd->ino);
+	}
+
 	return count;
 }
 
@@ -384,6 +785,7 @@ off_t filedesc_seek(filedesc *fd, off_t offset, int whence)
 	assert(filedesc_isopen(fd));
 	assert(whence == SEEK_SET || whence == SEEK_CUR || whence == SEEK_END);
 	fileinode *fi = &files->fi[fd->ino];
+	fflushbuf(fd);		// buffered output goes at the old position
 
 	switch(whence) {
 		case SEEK_SET:
@@ -408,7 +810,18 @@ filedesc_close(filedesc *fd)
 {
 	assert(filedesc_isopen(fd));
 	assert(fileino_isvalid(fd->ino));
+	fclosebuf(fd);
 
+	// Closing the last descriptor we wrote a pipe through ends the pipe.
+	int ino = fd->ino;
 	fd->ino = FILEINO_NULL;		// mark the fd free
+	if ((fd->flags & O_WROTE) && fileino_ispipe(ino)) {
+		int i;
+		for (i = 0; i < OPEN_MAX; i++)
+			if (files->fd[i].ino == ino
+					&& filedesc_iswritable(&files->fd[i]))
+				return;
+		fileino_endpipe(ino);
+	}
 }
 
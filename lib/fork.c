@@ -17,25 +17,154 @@
 #include <inc/errno.h>
 #include <inc/mmu.h>
 #include <inc/vm.h>
+#include <inc/stdio.h>
 
 
 #define ALLVA   ((void*) VM_USERLO)
 #define ALLSIZE   (VM_USERHI - VM_USERLO)
 
+void fork_childfiles(filestate *fs, bool inodes);
+void fork_childinode(filestate *fs, int ino);
 bool reconcile(pid_t pid, filestate *cfiles);
 bool reconcile_inode(pid_t pid, filestate *cfiles, int pino, int cino);
 bool reconcile_merge(pid_t pid, filestate *cfiles, int pino, int cino);
+static bool reconcile_consin(pid_t pid, filestate *cfiles);
 
-pid_t fork(void)
+// Child GET/PUT operations queued up while synchronizing with a child,
+// so that waitpid() issues them in as few SYS_VEC system calls as it can.
+#define SYNCOPS_MAX 512
+static sysvec syncops[SYNCOPS_MAX];
+static int nsyncops;
+
+static void syncflush(void);
+
+static void
+syncop(uint32_t cmd, pid_t pid, void *src, void *dst, size_t size)
+{
+  if (nsyncops == SYNCOPS_MAX)
+    syncflush();  // issue what we have so far, still in order
+  sysvec *v = &syncops[nsyncops++];
+  v->cmd = cmd;
+  v->child = pid;
+  v->save = NULL;
+  v->size = size;
+  v->src = src;
+  v->dst = dst;
+}
+
+static void
+syncflush(void)
+{
+  if (nsyncops > 0)
+    sys_vec(syncops, nsyncops);
+  nsyncops = 0;
+}
+
+// Pages of a child's filestate, as waitpid() works on it at VM_SCRATCHLO,
+// that reconcile() changed or may have changed: those holding any inode
+// it visited in the child, or all of them if it visited every inode.
+// The parts of the filestate outside the inode table are only a few pages,
+// and always go back to the child (see reconcile_push()).
+#define RECONCILE_NPAGES ((sizeof(filestate) + PAGESIZE-1) / PAGESIZE)
+static bool recdirty[RECONCILE_NPAGES];
+
+static void
+reconcile_touch(filestate *cfiles, int cino)
+{
+  uint32_t ofs = (uint32_t)&cfiles->fi[cino] - (uint32_t)cfiles;
+  recdirty[ofs / PAGESIZE] = 1;
+  recdirty[(ofs + sizeof(fileinode) - 1) / PAGESIZE] = 1;
+}
+
+// Get a copy of child pid's filestate at VM_SCRATCHLO for reconcile(),
+// and its status (trap number and eip) too if ps isn't NULL.
+// Copying the whole 4MB area just shares the child's page table with us.
+static filestate *
+reconcile_fetch(pid_t pid, struct procstate *ps)
+{
+  sys_get(SYS_COPY | (ps != NULL ? SYS_STATUS : 0), pid, ps,
+    (void*)FILESVA, (void*)VM_SCRATCHLO, PTSIZE);
+  memset(recdirty, 0, sizeof(recdirty));
+  return (filestate*)VM_SCRATCHLO;
+}
+
+// Queue up putting back into child pid the pages of its filestate that
+// reconcile() may have changed in our copy, and starting it if 'start'.
+// Only reconcile_consin() leaves out the parts outside the inode table,
+// having changed nothing there that the child needs back.
+// Page by page, these leave the child its own page table,
+// and then we drop our copy, so the child owns all those pages outright
+// and can change them again without copying them first.
+static void
+reconcile_push(pid_t pid, bool start, bool inodesonly)
+{
+  uint32_t filo = offsetof(filestate, fi);
+  uint32_t fihi = filo + sizeof(((filestate*)0)->fi);
+  int pg, run = -1;
+  for (pg = 0; pg <= RECONCILE_NPAGES; pg++) {
+    bool push = pg < RECONCILE_NPAGES && (recdirty[pg] || (!inodesonly
+        && (pg * PAGESIZE < filo || (pg + 1) * PAGESIZE > fihi)));
+    if (push && run < 0)
+      run = pg;
+    else if (!push && run >= 0) {
+      syncop(SYS_PUT | SYS_COPY, pid, (void*)VM_SCRATCHLO + run * PAGESIZE,
+        (void*)FILESVA + run * PAGESIZE, (pg - run) * PAGESIZE);
+      run = -1;
+    }
+  }
+  if (start)
+    syncop(SYS_PUT | SYS_START, pid, NULL, NULL, 0);
+  syncop(SYS_GET | SYS_ZERO, 0, NULL, (void*)VM_SCRATCHLO, PTSIZE);
+}
+
+// Set up a newly forked child's copy of its parent's file state fs,
+// as the child's own: it has no children yet,
+// and its parent already has all of those files as they are now.
+// Also used by spawn() to prepare the file state it gives a new child,
+// which leaves out the inodes when it has kept them ready from before,
+// and sets up just the ones that changed since with fork_childinode().
+void
+fork_childfiles(filestate *fs, bool inodes)
 {
   int i;
 
+  // Clear our child state array, since we have no children yet.
+  memset(&fs->child, 0, sizeof(fs->child));
+  fs->child[0].state = PROC_RESERVED;
+  memset(&fs->image, 0, sizeof(fs->image)); // they were in our parent's slots
+  fs->zygote = 0;
+  fs->parworkers = 0;  // and so were the parallel_for() workers
+  fs->consreader = 0;
+  fs->chgsync = fs->chgseq; // our parent has everything so far
+  fs->chglast = 0;
+  if (inodes)
+    for (i = 1; i < FILE_INODES; i++)
+      fork_childinode(fs, i);
+}
+
+// Make inode ino of a new child's file state fs correspond
+// to the same inode of its parent, as it is now.
+void
+fork_childinode(filestate *fs, int ino)
+{
+  if (fs->fi[ino].de.d_name[0] != 0) {  // i.e., fileino_alloced(ino)
+    fs->fi[ino].rino = ino;  // 1-to-1 mapping
+    fs->fi[ino].rver = fs->fi[ino].ver;
+    fs->fi[ino].rlen = fs->fi[ino].size;
+  }
+}
+
+pid_t fork(void)
+{
   // Find a free child process slot.
   // We just use child process slot numbers as Unix PIDs,
   // even though child slots are process-local in PIOS
   // whereas PIDs are global in Unix.
   // This means that commands like 'ps' and 'kill'
   // have to be shell-builtin commands under PIOS.
+  // Write out buffered output first, so the child won't repeat it.
+  fflushbuf(NULL);
+
   pid_t pid;
   for (pid = 1; pid < 256; pid++)
     if (files->child[pid].state == PROC_FREE)
@@ -70,21 +199,13 @@ pid_t fork(void)
     :
     : "ebx", "ecx", "edx");
   if (!isparent) {
-    // Clear our child state array, since we have no children yet.
-    memset(&files->child, 0, sizeof(files->child));
-    files->child[0].state = PROC_RESERVED;
-    for (i = 1; i < FILE_INODES; i++) {
-      if (fileino_alloced(i)) {
-        files->fi[i].rino = i;  // 1-to-1 mapping
-        files->fi[i].rver = files->fi[i].ver;
-        files->fi[i].rlen = files->fi[i].size;
-      }
-    }
+    fork_childfiles(files, 1);
     return 0; // indicate that we're the child.
   }
 
   // Copy our entire user address space into the child and start it.
   ps.tf.regs.eax = 0; // isparent == 0 in the child
+  ps.pff = PFF_NONDET; // Unix processes may wait(); kernel drops it if we can't
   sys_put(SYS_REGS | SYS_COPY | SYS_START, pid, &ps,
     ALLVA, ALLVA, ALLSIZE);
 
@@ -92,43 +213,100 @@ pid_t fork(void)
   // so that we can reconcile them later when we synchronize with it.
   memset(&files->child[pid], 0, sizeof(files->child[pid]));
   files->child[pid].state = PROC_FORKED;
+  files->child[pid].chgsync = files->chgseq;
+  files->chglast = 0;	// so the next change to it gets logged for the child
 
   return pid;
 }
 
+// Make child pid the reader of our console input, or none if pid is 0,
+// returning the previous one.  A shell registers its foreground job,
+// so that waitpid() can hand it new input with reconcile_consin().
+pid_t
+consreader(pid_t pid)
+{
+  assert(pid >= 0 && pid < 256);
+  pid_t old = files->consreader;
+  files->consreader = pid;
+  return old;
+}
+
 pid_t
 wait(int *status)
 {
   return waitpid(-1, status, 0);
 }
 
+// Give each child parked waiting for input (see waitpid() below)
+// whatever new input we have for it, and restart it if there was any.
+static void
+waitpid_wake(void)
+{
+  pid_t p;
+  for (p = 1; p < 256; p++) {
+    if (files->child[p].state != PROC_WAITING)
+      continue;
+    filestate *cfiles = reconcile_fetch(p, NULL);
+    if (reconcile_consin(p, cfiles)) {
+      files->child[p].state = PROC_FORKED;
+      continue;
+    }
+    bool didio = reconcile(p, cfiles);
+    reconcile_push(p, didio, 0);
+    syncflush();
+    if (didio)
+      files->child[p].state = PROC_FORKED;
+  }
+}
+
 pid_t
 waitpid(pid_t pid, int *status, int options)
 {
   assert(pid >= -1 && pid < 256);
+  bool any = (pid <= 0);
+  pid_t want = pid;
 
-  // Find a process to wait for.
-  // Of course for interactive or load-balancing purposes
-  // we would like to have a way to wait for
-  // whichever child process happens to finish first -
-  // that requires a (nondeterministic) kernel API extension.
-  if (pid <= 0)
-    for (pid = 1; pid < 256; pid++)
-      if (files->child[pid].state == PROC_FORKED)
-        break;
-  if (pid == 256 || files->child[pid].state != PROC_FORKED) {
-    errno = ECHILD;
-    return -1;
-  }
-
-  // Repeatedly synchronize with the chosen child until it exits.
+  // Repeatedly synchronize with the chosen child(ren) until one exits.
   while (1) {
+    // Find the process(es) to wait for.
+    // For wait(), that's whichever child process happens to finish first,
+    // which the kernel reports with SYS_ANY if we're allowed nondeterminism
+    // (otherwise it picks the lowest-numbered child, deterministically).
+    // Children parked waiting for input only count once some arrives,
+    // unless we're waiting for just that one child.
+    if (any)
+      waitpid_wake();
+    uint32_t set[256/32];
+    memset(set, 0, sizeof(set));
+    int nfound = 0, nready = 0;
+    pid_t p;
+    for (p = any ? 1 : want; p < (any ? 256 : want+1); p++) {
+      int state = files->child[p].state;
+      if (state != PROC_FORKED && state != PROC_WAITING)
+        continue;
+      nfound++;
+      if (state == PROC_FORKED || !any) {
+        set[p/32] |= 1 << (p%32);
+        nready++;
+      }
+    }
+    if (nfound == 0) {
+      errno = ECHILD;
+      return -1;
+    }
+    if (nready == 0) {
+      // All our children are waiting for input: wait for our parent's.
+      fflushbuf(NULL);
+      sys_ret();
+      continue;
+    }
+    pid = any ? sys_getany(set) : want;
+    files->child[pid].state = PROC_FORKED;
+
     // Wait for the child to finish whatever it's doing,
     // and extract its CPU and process/file state.
     struct procstate ps;
-    sys_get(SYS_COPY | SYS_REGS, pid, &ps,
-      (void*)FILESVA, (void*)VM_SCRATCHLO, PTSIZE);
-    filestate *cfiles = (filestate*)VM_SCRATCHLO;
+    filestate *cfiles = reconcile_fetch(pid, &ps);
 
     // Did the child take a trap?
     if (ps.tf.trapno != T_SYSCALL) {
@@ -140,13 +318,20 @@ waitpid(pid_t pid, int *status, int options)
         *status = WSIGNALED | ps.tf.trapno;
 
       done:
-      // Clear out the child's address space.
-      sys_put(SYS_ZERO, pid, NULL, ALLVA, ALLVA, ALLSIZE);
+      // Discard the child and its address space for good:
+      // a later fork or spawn with this pid gets a fresh process.
+      syncop(SYS_PUT | SYS_FREE, pid, NULL, NULL, 0);
+      syncflush();
       files->child[pid].state = PROC_FREE;
+      if (files->consreader == pid)
+        files->consreader = 0;
       return pid;
     }
 
-    // Reconcile our file system state with the child's.
+    // Reconcile our file system state with the child's,
+    // unless all it needs is the console input it's waiting for.
+    if (reconcile_consin(pid, cfiles))
+      continue;
     bool didio = reconcile(pid, cfiles);
 
     // Has the child exited gracefully?
@@ -158,112 +343,315 @@ waitpid(pid_t pid, int *status, int options)
 
     // If the child is waiting for new input
     // and the reconciliation above didn't provide anything new,
-    // then wait for something new from OUR parent in turn.
-    if (!didio)
+    // then if some other child might yet provide it (e.g., via a pipe),
+    // park this one and wait for the others;
+    // otherwise wait for something new from OUR parent in turn.
+    if (!didio && any && nready > 1) {
+      reconcile_push(pid, 0, 0);
+      syncflush();
+      files->child[pid].state = PROC_WAITING;
+      continue;
+    }
+    if (!didio) {
+      syncflush();
+      fflushbuf(NULL);
       sys_ret();
+      if (reconcile_consin(pid, cfiles))
+        continue;
+    }
 
     // Reconcile again, to forward any new I/O to the child.
     (void)reconcile(pid, cfiles);
 
-    // Push the child's updated file state back into the child.
-    sys_put(SYS_COPY | SYS_START, pid, NULL,
-      (void*)VM_SCRATCHLO, (void*)FILESVA, PTSIZE);
+    // Push the child's updated file state back into the child,
+    // after any file data reconcile() queued up, and restart it.
+    reconcile_push(pid, 1, 0);
+    syncflush();
   }
 }
 
+// Are all the changes fs logged from change number 'sync' on
+// to console input, which reconcile_consin() handles?
+static bool
+reconcile_onlyconsin(filestate *fs, uint32_t sync)
+{
+  if (fs->chgseq - sync > FILE_CHGLOG)
+    return 0;
+  for (; sync != fs->chgseq; sync++)
+    if (fs->chglog[sync % FILE_CHGLOG] != FILEINO_CONSIN)
+      return 0;
+  return 1;
+}
+
+// Hand child pid, our registered console reader (see consreader()),
+// the console input we've gained since we last reconciled with it,
+// if that's all either side has changed but for the statistics file,
+// and restart it.  Then a keystroke costs each level of a shell subtree
+// an update of one inode and the new input's pages,
+// rather than a reconcile() and a push of the child's file state.
+// The child's statistics file catches up at the next full reconcile().
+// Returns false, changing nothing, if a full reconcile() is needed.
+static bool
+reconcile_consin(pid_t pid, filestate *cfiles)
+{
+  if (pid != files->consreader || cfiles->exited)
+    return 0;
+  if (!reconcile_onlyconsin(files, files->child[pid].chgsync)
+      || !reconcile_onlyconsin(cfiles, cfiles->chgsync))
+    return 0;
+
+  int ino;
+  for (ino = FILEINO_CONSIN; ino < FILEINO_GENERAL; ino++) {
+    fileinode *pfi = &files->fi[ino], *cfi = &cfiles->fi[ino];
+    if (cfi->ver != cfi->rver || cfi->size != cfi->rlen)
+      return 0; // the child changed it
+    if (ino != FILEINO_CONSIN && ino != FILEINO_STATS
+        && (pfi->ver != cfi->rver || pfi->size != cfi->rlen))
+      return 0; // we changed it
+  }
+  fileinode *pfi = &files->fi[FILEINO_CONSIN];
+  fileinode *cfi = &cfiles->fi[FILEINO_CONSIN];
+  if (pfi->ver != cfi->rver || pfi->size <= cfi->rlen)
+    return 0; // no new input, or more than an append
+
+  // Console input stays in its own window, the same on both sides.
+  size_t lo = ROUNDDOWN(cfi->rlen, PAGESIZE);
+  syncop(SYS_PUT | SYS_COPY, pid, FILEDATA(FILEINO_CONSIN) + lo,
+    FILEDATA(FILEINO_CONSIN) + lo, ROUNDUP(pfi->size, PAGESIZE) - lo);
+  cfi->size = cfi->rlen = pfi->size;
+  reconcile_touch(cfiles, FILEINO_CONSIN);
+  reconcile_push(pid, 1, 1);
+  syncflush();
+  files->child[pid].chgsync = files->chgseq;
+  files->chglast = 0;
+  return 1;
+}
+
+// Find the parent inode corresponding to child inode 'cino',
+// creating one if need be, after doing the same for its directory.
+// Returns 0 if the inode shouldn't or can't be reconciled.
+static int
+reconcile_c2p(filestate *cfiles, int cino, int depth)
+{
+  if (cino > 0 && cino < FILEINO_GENERAL)
+    return cino;
+  if (!fileino_isvalid(cino) || depth >= FILE_INODES)
+    return 0;
+  fileinode *cfi = &cfiles->fi[cino];
+  if (cfi->de.d_name[0] == 0)
+    return 0; // not allocated in the child
+  if (cfi->mode == 0 && cfi->rino == 0)
+    return 0; // existed only ephemerally in child
+
+  // The parent directory should have a mapping, or get one.
+  int pdino = reconcile_c2p(cfiles, cfi->dino, depth+1);
+  if (pdino == 0) {
+    warn("reconcile: cino %d has invalid parent", cino);
+    return 0; // don't reconcile it
+  }
+  if (cfi->rino == 0) {
+    // No corresponding parent inode known: find/create one.
+    int pino = fileino_create(files, pdino, cfi->de.d_name);
+    // cprintf("reconcile: creating parent inode %d for %d\n", pino, cino);
+    if (pino <= 0)
+      return 0; // no free inodes!
+    cfi->rino = pino;
+    reconcile_touch(cfiles, cino);
+  }
+
+  // Check the validity of the child's existing mapping.
+  // If something's fishy, just don't reconcile it,
+  // since we don't want the child to kill the parent this way.
+  int pino = cfi->rino;
+  fileinode *pfi = &files->fi[pino];
+  if (!fileino_isvalid(pino)
+      || pfi->dino != pdino
+      || strcmp(pfi->de.d_name, cfi->de.d_name) != 0
+      || cfi->rver > pfi->ver
+      || cfi->rver > cfi->ver) {
+    warn("reconcile: mapping %d/%d: "
+      "dir %d/%d name %s/%s ver %d/%d(%d)",
+      pino, cino, fileino_isvalid(pino) ? pfi->dino : 0, cfi->dino,
+      fileino_isvalid(pino) ? pfi->de.d_name : "?", cfi->de.d_name,
+      fileino_isvalid(pino) ? pfi->ver : 0, cfi->ver, cfi->rver);
+    return 0;
+  }
+  return pino;
+}
+
+// Find the child inode corresponding to parent inode 'pino',
+// creating one if need be, after doing the same for its directory.
+// Returns 0 if the inode shouldn't or can't be reconciled.
+static int
+reconcile_p2c(filestate *cfiles, int pino, int depth)
+{
+  if (pino > 0 && pino < FILEINO_GENERAL)
+    return pino;
+  if (!fileino_isvalid(pino) || depth >= FILE_INODES)
+    return 0;
+  fileinode *pfi = &files->fi[pino];
+  if (pfi->de.d_name[0] == 0)
+    return 0; // not in use
+  int cdino = reconcile_p2c(cfiles, pfi->dino, depth+1);
+  if (cdino == 0)
+    return 0;
+
+  int len = strlen(pfi->de.d_name);
+  int cino = fileino_lookup(cfiles, cdino, pfi->de.d_name, len);
+  if (cino == 0) {
+    if (pfi->mode == 0)
+      return 0; // already deleted, and the child never saw it
+    cino = fileino_create(cfiles, cdino, pfi->de.d_name);
+    if (cino <= 0)
+      return 0; // no free inodes!
+  }
+  fileinode *cfi = &cfiles->fi[cino];
+  reconcile_touch(cfiles, cino);  // perhaps just created
+  if (cfi->rino == 0)
+    cfi->rino = pino;
+
+  // Apply the same checks to the mapping as for the child's own changes.
+  return reconcile_c2p(cfiles, cino, depth) == pino ? cino : 0;
+}
+
 // Reconcile our file system state, whose metadata is in 'files',
 // with the file system state of child 'pid', whose metadata is in 'cfiles'.
 // Returns nonzero if any changes were propagated, false otherwise.
+// File data copies are queued with syncop() for the caller to syncflush().
+//
+// We visit only the special files (console, statistics, root directory),
+// which the kernel changes behind our back in the root process,
+// and the inodes either side logged as changed since we last reconciled.
+// If either log has wrapped since then, we visit every inode.
 bool
 reconcile(pid_t pid, filestate *cfiles)
 {
   bool didio = 0;
-  int i;
-
-  // Compute a parent-to-child and child-to-parent inode mapping table.
-  int p2c[FILE_INODES], c2p[FILE_INODES];
-  memset(p2c, 0, sizeof(p2c)); memset(c2p, 0, sizeof(c2p));
-  p2c[FILEINO_CONSIN] = c2p[FILEINO_CONSIN] = FILEINO_CONSIN;
-  p2c[FILEINO_CONSOUT] = c2p[FILEINO_CONSOUT] = FILEINO_CONSOUT;
-  p2c[FILEINO_ROOTDIR] = c2p[FILEINO_ROOTDIR] = FILEINO_ROOTDIR;
-
-  // First make sure all the child's allocated inodes
-  // have a mapping in the parent, creating mappings as needed.
-  // Also keep track of the parent inodes we find mappings for.
-  int cino;
-  for (cino = 1; cino < FILE_INODES; cino++) {
-    fileinode *cfi = &cfiles->fi[cino];
-    if (cfi->de.d_name[0] == 0)
-      continue; // not allocated in the child
-    if (cfi->mode == 0 && cfi->rino == 0)
-      continue; // existed only ephemerally in child
-    if (cfi->rino == 0) {
-      // No corresponding parent inode known: find/create one.
-      // The parent directory should already have a mapping.
-      if (cfi->dino <= 0 || cfi->dino >= FILE_INODES
-        || c2p[cfi->dino] == 0) {
-        warn("reconcile: cino %d has invalid parent",
-          cino);
-        continue; // don't reconcile it
-      }
-      cfi->rino = fileino_create(files, c2p[cfi->dino],
-              cfi->de.d_name);
-      // cprintf("reconcile: creating parent inode %d for %d\n", cfi->rino, cino);
-      if (cfi->rino <= 0)
-        continue; // no free inodes!
-    }
+  int i, ino;
+
+  // Snapshot both sides' logged changes before we start adding to the logs.
+  uint32_t nc = cfiles->chgseq - cfiles->chgsync;
+  uint32_t np = files->chgseq - files->child[pid].chgsync;
+  bool all = nc > FILE_CHGLOG || np > FILE_CHGLOG;
+  uint16_t cchg[FILE_CHGLOG], pchg[FILE_CHGLOG];
+  // Visiting every inode may change any of them in the child, and so may
+  // a lookup in the child's directory index if it has to rebuild it.
+  if (all || !cfiles->dhvalid)
+    memset(recdirty, 1, sizeof(recdirty));
+  if (!all) {
+    for (i = 0; i < nc; i++)
+      cchg[i] = cfiles->chglog[(cfiles->chgsync + i) % FILE_CHGLOG];
+    for (i = 0; i < np; i++)
+      pchg[i] = files->chglog[(files->child[pid].chgsync + i)
+            % FILE_CHGLOG];
+  }
 
-    // Check the validity of the child's existing mapping.
-    // If something's fishy, just don't reconcile it,
-    // since we don't want the child to kill the parent this way.
-    int pino = cfi->rino;
-    fileinode *pfi = &files->fi[pino];
-    if (pino <= 0 || pino >= FILE_INODES
-        || p2c[pfi->dino] != cfi->dino
-        || strcmp(pfi->de.d_name, cfi->de.d_name) != 0
-        || cfi->rver > pfi->ver
-        || cfi->rver > cfi->ver) {
-      warn("reconcile: mapping %d/%d: "
-        "dir %d/%d name %s/%s ver %d/%d(%d)",
-        pino, cino, pfi->dino, cfi->dino,
-        pfi->de.d_name, cfi->de.d_name,
-        pfi->ver, cfi->ver, cfi->rver);
+  for (ino = FILEINO_CONSIN; ino < FILEINO_GENERAL; ino++)
+    didio |= reconcile_inode(pid, cfiles, ino, ino);
+
+  // First the child's changes, creating parent inodes as needed,
+  // then our own, creating inodes in the child as needed.
+  int n = all ? FILE_INODES : nc;
+  for (i = 0; i < n; i++) {
+    int cino = all ? i : cchg[i];
+    if (cino < FILEINO_GENERAL)
+      continue; // done above, or invalid
+    int pino = reconcile_c2p(cfiles, cino, 0);
+    if (pino != 0)
+      didio |= reconcile_inode(pid, cfiles, pino, cino);
+  }
+  n = all ? FILE_INODES : np;
+  for (i = 0; i < n; i++) {
+    int pino = all ? i : pchg[i];
+    if (pino < FILEINO_GENERAL)
       continue;
-    }
-
-    // Record the mapping.
-    p2c[pino] = cino;
-    c2p[cino] = pino;
+    int cino = reconcile_p2c(cfiles, pino, 0);
+    if (cino != 0)
+      didio |= reconcile_inode(pid, cfiles, pino, cino);
   }
 
-  // Now make sure all the parent's allocated inodes
-  // have a mapping in the child, creating mappings as needed.
-  int pino;
-  for (pino = 1; pino < FILE_INODES; pino++) {
-    fileinode *pfi = &files->fi[pino];
-    if (pfi->de.d_name[0] == 0 || pfi->mode == 0)
-      continue; // not in use or already deleted
-    if (p2c[pino] != 0)
-      continue; // already mapped
-    cino = fileino_create(cfiles, p2c[pfi->dino], pfi->de.d_name);
-    if (cino <= 0)
-      continue; // no free inodes!
-    cfiles->fi[cino].rino = pino;
-    p2c[pino] = cino;
-    c2p[cino] = pino;
-  }
+  // Both sides are now up to date with each other's changes so far,
+  // including those we just made to bring them up to date.
+  cfiles->chgsync = cfiles->chgseq;
+  cfiles->chglast = 0;
+  files->child[pid].chgsync = files->chgseq;
+  files->chglast = 0;
 
-  // Finally, reconcile each corresponding pair of inodes.
-  for (pino = 1; pino < FILE_INODES; pino++) {
-    if (!p2c[pino])
-      continue; // no corresponding inode in child
-    cino = p2c[pino];
-    assert(c2p[cino] == pino);
+  return didio;
+}
 
-    didio |= reconcile_inode(pid, cfiles, pino, cino);
-  }
+// Empty a page-aligned range of the parent's or a child's file windows:
+// the parent's at once, or the child's with the rest of the child's updates.
+static void
+reconcile_zero(pid_t pid, bool parent, void *va, size_t size)
+{
+  if (parent)
+    sys_get(SYS_ZERO, 0, NULL, NULL, va, size);
+  else
+    syncop(SYS_PUT | SYS_ZERO, pid, NULL, va, size);
+}
 
-  return didio;
+// Queue copies of the file data of one inode of a pair, which changed
+// since reference version rver and length rlen, to the other, which didn't:
+// from the parent to the child, or to the parent if toparent is set.
+// After an append-only change that's just the pages from rlen on;
+// otherwise it's every page either version has mapped (see fileino_maplim),
+// so that copying also unmaps what a truncation freed.
+// Either way the range extends to the end of the source's mapped extent,
+// so that the destination can later grow into it without faulting.
+// We copy window by window, since the two sides' windows needn't line up,
+// and empty and give back any storage the destination no longer needs.
+// A source in a slot has no more than the slot to copy from,
+// so we empty whatever the destination has mapped past that instead;
+// and if the destination has to move out of a slot (see fileino_reserve),
+// its new windows start out empty, so we copy everything over into them.
+static void
+reconcile_copy(pid_t pid, filestate *cfiles, int pino, int cino,
+    bool toparent, int rver, size_t rlen)
+{
+  filestate *ffs = toparent ? cfiles : files;
+  filestate *tfs = toparent ? files : cfiles;
+  int fino = toparent ? cino : pino, tino = toparent ? pino : cino;
+  fileinode *from = &ffs->fi[fino], *to = &tfs->fi[tino];
+  size_t ofs = from->ver == rver ? ROUNDDOWN(rlen, PAGESIZE) : 0;
+  size_t size = MAX(from->size, to->size);
+  int k, nfrom = FILE_NWIN(from->size), n = FILE_NWIN(size);
+  int nkeep = from->size ? nfrom : 0;
+  void *oldslot;
+  int moved = fileino_reserve(tfs, tino, from->size, &oldslot);
+  if (moved < 0)
+    warn("reconcile: not enough windows for inode %d/%d", pino, cino);
+  if (moved > 0) {
+    reconcile_zero(pid, toparent, oldslot, FILE_SLOTSIZE);
+    ofs = 0;
+  }
+  size_t fseg = fileino_segsize(ffs, fino), tseg = fileino_segsize(tfs, tino);
+
+  for (k = 0; k < n; k++) {
+    size_t wbase = (size_t)k * FILE_WINSIZE;
+    size_t lim = fileino_winlim(size, k);
+    size_t start = ofs > wbase ? MIN(ofs - wbase, lim) : 0;
+    void *fw = fileino_window(ffs, fino, k);
+    void *tw = fileino_window(tfs, tino, k);
+    if (tw == NULL)
+      continue;
+    if (k >= nkeep) {
+      // Past the source's last window: empty the destination's.
+      reconcile_zero(pid, toparent, tw, k == 0 ? tseg : FILE_WINSIZE);
+      continue;
+    }
+    size_t flim = k == 0 ? MIN(lim, fseg) : lim;
+    if (fw != NULL && start < flim) {
+      if (toparent)
+        syncop(SYS_GET | SYS_COPY, pid, fw + start, tw + start, flim - start);
+      else
+        syncop(SYS_PUT | SYS_COPY, pid, fw + start, tw + start, flim - start);
+    }
+    start = MAX(start, fw != NULL ? flim : 0);
+    if (lim > start)
+      reconcile_zero(pid, toparent, tw + start, lim - start);
+  }
+  fileino_dropwindows(tfs, tino, nkeep);
 }
 
 bool
@@ -273,6 +661,7 @@ reconcile_inode(pid_t pid, filestate *cfiles, int pino, int cino)
   assert(cino > 0 && cino < FILE_INODES);
   fileinode *pfi = &files->fi[pino];
   fileinode *cfi = &cfiles->fi[cino];
+  reconcile_touch(cfiles, cino);
 
   // Find the reference version number and length for reconciliation
   int rver = cfi->rver;
@@ -306,41 +695,36 @@ reconcile_inode(pid_t pid, filestate *cfiles, int pino, int cino)
     // Conflict! Mark files as such
     pfi->mode |= S_IFCONF;
     cfi->mode |= S_IFCONF;
+    fileino_logchg(files, pino);
+    fileino_logchg(cfiles, cino);
     return true;
   }
   if(!child_changed && parent_changed) {
-    // Update the child version
-    cfi->rver = pfi->ver;
-    cfi->rlen = pfi->size;
-
-    // Only works with this commented...
-    // cfi->rino = pfi->rino = pfi->rino;
+    // Copy only the pages the parent changed or appended to
+    reconcile_copy(pid, cfiles, pino, cino, 0, rver, rlen);
     // Update child metadata
-    cfi->dino = pfi->dino;
     cfi->ver  = pfi->ver;
-    strcpy(cfi->de.d_name, pfi->de.d_name);
     cfi->mode = pfi->mode;
     cfi->size = pfi->size;
-    // Copy from parent into child
-    sys_put(SYS_COPY, pid, NULL, FILEDATA(pino), FILEDATA(cino), PTSIZE);
+    fileino_logchg(cfiles, cino);
+    // Update the child's reference version
+    cfi->rver = cfi->ver;
+    cfi->rlen = cfi->size;
 
     return true;
   }
   if (child_changed && !parent_changed) {
-    // Update the child version
-    cfi->rver = pfi->ver;
-    cfi->rlen = pfi->size;
-    // Only works with this commented...
-    // cfi->rino = pfi->rino = cfi->rino;
+    // Copy from child to parent, just the pages changed
+    reconcile_copy(pid, cfiles, pino, cino, 1, rver, rlen);
     // Update parent meta data
-    pfi->dino = cfi->dino;
     pfi->ver  = cfi->ver;
-    strcpy(pfi->de.d_name, cfi->de.d_name);
     // cprintf("reconcile_inode: ino %d/%d pmode set to %x\n", pino, cino, cfi->mode);
     pfi->mode = cfi->mode;
     pfi->size = cfi->size;
-    // Copy physical file from child to parent (we have to copy entire page)
-    sys_get(SYS_COPY, pid, NULL, FILEDATA(cino), FILEDATA(pino), PTSIZE);
+    fileino_logchg(files, pino);
+    // Update the child's reference version
+    cfi->rver = cfi->ver;
+    cfi->rlen = cfi->size;
 
     return true;
   }
@@ -348,6 +732,30 @@ reconcile_inode(pid_t pid, filestate *cfiles, int pino, int cino)
   return false;
 }
 
+// Copy the page-aligned bytes [start, end) of child file 'cino'
+// between the child's windows and a linear image of the file at 'img',
+// into the child if 'put' is set, or into the image otherwise.
+static void
+reconcile_image(pid_t pid, filestate *cfiles, int cino, void *img,
+    size_t start, size_t end, bool put)
+{
+  while (start < end) {
+    void *cw = fileino_window(cfiles, cino, start / FILE_WINSIZE);
+    size_t wofs = start % FILE_WINSIZE;
+    size_t n = MIN(end - start, FILE_WINSIZE - wofs);
+    if (cw == NULL) {
+      // Missing from a corrupt child: take zeros, put back nothing.
+      if (!put)
+        sys_get(SYS_ZERO | SYS_PERM | SYS_READ | SYS_WRITE, 0, NULL, NULL,
+          img + start, n);
+    } else if (put)
+      sys_put(SYS_COPY, pid, NULL, img + start, cw + wofs, n);
+    else
+      sys_get(SYS_COPY, pid, NULL, cw + wofs, img + start, n);
+    start += n;
+  }
+}
+
 bool
 reconcile_merge(pid_t pid, filestate *cfiles, int pino, int cino)
 {
@@ -369,34 +777,74 @@ reconcile_merge(pid_t pid, filestate *cfiles, int pino, int cino)
   int cdif = cfi->size - rlen;
   int pdif = pfi->size - rlen;
 
-  // Since we can only sys_get/put PTSIZE-length items, we can't just
-  // system call the differences -- we have to copy the child file into memory.
-  // We'll use the scratch space, but since cfiles is stored at
-  // VM_SCRATCHLO (and it's a page big), we'll start at VM_SCRATCHLO+PTSIZE
-  int child_loc = VM_SCRATCHLO+PTSIZE;
-  int parent_loc = (int)FILEDATA(pino);
-  sys_get(SYS_COPY, pid, NULL, FILEDATA(cino), (void*)child_loc, PTSIZE);
-
-  // cprintf("merge: cdif: %d, pdif: %d, csize: %d, psize: %d\n",
-  //  cdif, pdif, cfi->size, pfi->size);
-  void *cend = (void*)(child_loc + cfi->size);  // end of child in parent's memory
-  void *pend = (void*)(parent_loc + pfi->size); // end of parent
-
-  if(cfi->size + pdif <= FILE_MAXSIZE) {
-    memcpy(pend, cend-cdif, cdif);              // From last checkpointed end
-    memcpy(cend, pend-pdif, pdif);
-  } else {
+  // Make room for the merged file in the parent first.
+  size_t csize = cfi->size, msize = cfi->size + pdif;
+  if(msize > fileino_maxsize(pino) || fileino_grow(pino, msize) < 0) {
     warn("reconcile_merge: merged files are too big...cancelling merge\n");
     return false;
   }
+
+  // We can only sys_get/put whole pages, so we map into our scratch space
+  // just the child's pages holding what it appended since rlen,
+  // plus fresh zero pages for the parent's tail to go onto the end of those,
+  // and after merging put back only the pages we appended to.
+  // The scratch copy is a linear image of the child's file,
+  // whatever windows the child keeps it in.
+  // If the merged file outgrows the child's slot,
+  // we take the whole file and put it all back into its new windows.
+  // Since cfiles is stored at VM_SCRATCHLO (and it's a page big),
+  // we start at VM_SCRATCHLO+PTSIZE.
+  void *child_loc = (void*)VM_SCRATCHLO+PTSIZE;
+  assert(child_loc + FILE_MAXSIZE <= (void*)VM_ARENALO);
+  bool moving = cfi->slot != 0 && msize > FILE_SLOTSIZE
+      && fileino_window(cfiles, cino, 0) != NULL;
+  size_t cstart = moving ? 0 : ROUNDDOWN(rlen, PAGESIZE);
+  size_t cpage = ROUNDUP(csize, PAGESIZE), mpage = ROUNDUP(msize, PAGESIZE);
+  reconcile_image(pid, cfiles, cino, child_loc, cstart, cpage, 0);
+  void *oldslot;
+  int moved = fileino_reserve(cfiles, cino, msize, &oldslot);
+  if(moved < 0) {
+    warn("reconcile_merge: no room in child...cancelling merge\n");
+    return false;
+  }
+  assert(moved == moving);
+  if(moved)
+    sys_put(SYS_ZERO, pid, NULL, NULL, oldslot, FILE_SLOTSIZE);
+  if(mpage > cpage)
+    sys_get(SYS_ZERO | SYS_PERM | SYS_READ | SYS_WRITE, 0, NULL, NULL,
+      child_loc + cpage, mpage - cpage);
+
+  // cprintf("merge: cdif: %d, pdif: %d, csize: %d, psize: %d\n",
+  //  cdif, pdif, cfi->size, pfi->size);
+  void *cend = child_loc + csize;  // end of child in parent's memory
+  fileino_copy(pino, pfi->size, cend-cdif, cdif, 1); // From last checkpointed end
+  fileino_copy(pino, rlen, cend, pdif, 0);
   cfi->size += pdif;
   pfi->size += cdif;
   // Make sure files are the same size
   assert(cfi->size == pfi->size);
-  // Copy child file back
-  sys_put(SYS_COPY, pid, NULL, (void*)child_loc, FILEDATA(cino), PTSIZE);
+
+  // Copy back the child's pages we appended to,
+  // and extend its mapping in each window to cover the merged size too.
+  size_t mstart = moved ? 0 : ROUNDDOWN(csize, PAGESIZE);
+  if(pdif > 0 || moved)
+    reconcile_image(pid, cfiles, cino, child_loc, mstart, mpage, 1);
+  int k;
+  size_t cmapped = moved ? 0 : csize;
+  for(k = FILE_NWIN(cmapped) - 1; k < FILE_NWIN(msize); k++) {
+    size_t wbase = (size_t)k * FILE_WINSIZE;
+    size_t cur = fileino_winlim(cmapped, k);
+    if(pdif > 0 && mpage > wbase)
+      cur = MAX(cur, MIN(mpage - wbase, FILE_WINSIZE));
+    size_t lim = fileino_winlim(msize, k);
+    if(lim > cur)
+      sys_put(SYS_PERM | SYS_READ | SYS_WRITE, pid, NULL, NULL,
+        fileino_window(cfiles, cino, k) + cur, lim - cur);
+  }
   // Update references
   cfi->rlen = pfi->rlen = cfi->size;
+  fileino_logchg(files, pino);
+  fileino_logchg(cfiles, cino);
 
   return true;
 }
@@ -0,0 +1,204 @@
+/*
+ * Dynamic memory allocation: malloc(), free() and friends.
+ *
+ * The heap lives in the shared part of the address space (see inc/vm.h),
+ * so that memory a tfork() thread allocates is merged back
+ * into its parent's address space along with everything else.
+ * To keep threads that run at the same time from both writing
+ * the allocator's free lists, each thread allocates from its own arena,
+ * whose metadata sits at the arena's base; see tfork() in lib/thread.c.
+ * A block freed by a thread goes on that thread's own free lists,
+ * whichever arena it was allocated from.
+ *
+ * Each arena hands out blocks in power-of-two size classes,
+ * keeping a free list per class, and gets fresh memory
+ * by mapping zero-filled chunks with SYS_PERM as it grows.
+ * Blocks too big for any class get whole pages of their own.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#include <inc/stdlib.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/syscall.h>
+#include <inc/mmu.h>
+#include <inc/vm.h>
+#include <inc/file.h>
+#include <inc/errno.h>
+
+#define HEAP_MINSHIFT	4		// Smallest class: 16-byte blocks
+#define HEAP_MAXSHIFT	20		// Largest class: 1MB blocks
+#define HEAP_NCLASS	(HEAP_MAXSHIFT - HEAP_MINSHIFT + 1)
+#define HEAP_CHUNK	(1 << 20)	// Memory an arena maps at a time
+
+#define HEAP_NARENA	(1 + VM_HEAPNTHREAD)
+#define HEAP_ARENALO(a)	((a) == 0 ? VM_HEAPLO : \
+			 VM_HEAPTHREAD + ((a)-1) * HEAP_ARENASIZE(a))
+#define HEAP_ARENASIZE(a) ((a) == 0 ? VM_HEAPTHREAD - VM_HEAPLO : \
+			 (VM_HEAPHI - VM_HEAPTHREAD) / VM_HEAPNTHREAD)
+
+// Header preceding each block, in use or free.
+// The free list link overlays the data of a block in use,
+// which starts 8-byte aligned so it can hold a double.
+typedef struct heapblock {
+	size_t		size;		// Block size, including this header
+	uint32_t	pad;
+	struct heapblock *next;		// Next on free list, if free
+} heapblock;
+
+#define HEAP_HDR	offsetof(heapblock, next)
+
+// Allocator state, at the start of each arena.
+typedef struct heaparena {
+	uint32_t	top;		// Start of the arena's unused space
+	uint32_t	lim;		// End of the memory mapped so far
+	heapblock	*free[HEAP_NCLASS]; // Free blocks of each size class
+	heapblock	*big;		// Free blocks too big for a class
+} heaparena;
+
+// Which arenas have been set up, so it's safe to look at them.
+// Each thread only ever sets its own arena's flag, in its own word.
+static int heapready[HEAP_NARENA];
+
+extern char end[];		// End of program data, from the linker
+
+
+// Find the calling thread's arena, setting it up the first time.
+static heaparena *
+heap_arena(void)
+{
+	int a = files->heaparena;
+	assert(a >= 0 && a < HEAP_NARENA);
+	heaparena *ar = (heaparena*) HEAP_ARENALO(a);
+	if (!heapready[a]) {
+		assert((uint32_t)end <= VM_HEAPLO);
+		sys_get(SYS_PERM | SYS_READ | SYS_WRITE, 0, NULL, NULL,
+			ar, HEAP_CHUNK);
+		ar->top = ROUNDUP((uint32_t)(ar+1), 1 << HEAP_MINSHIFT);
+		ar->lim = (uint32_t)ar + HEAP_CHUNK;
+		heapready[a] = 1;
+	}
+	return ar;
+}
+
+// Carve a fresh block of size bytes off the top of arena a,
+// mapping more of the arena if need be.
+static heapblock *
+heap_grow(heaparena *ar, size_t size)
+{
+	uint32_t arenahi = (uint32_t)ar + HEAP_ARENASIZE(files->heaparena);
+	uint32_t top = ar->top;
+	if (size > arenahi - top)
+		return NULL;
+	if (top + size > ar->lim) {
+		uint32_t lim = ROUNDUP(top + size, HEAP_CHUNK);
+		lim = MIN(lim, arenahi);
+		sys_get(SYS_PERM | SYS_READ | SYS_WRITE, 0, NULL, NULL,
+			(void*)ar->lim, lim - ar->lim);
+		ar->lim = lim;
+	}
+	ar->top = top + size;
+	heapblock *b = (heapblock*)top;
+	b->size = size;
+	return b;
+}
+
+// Return the size class of blocks of at least size bytes,
+// or HEAP_NCLASS if size is too big for any class.
+static int
+heap_class(size_t size)
+{
+	int c = 0;
+	while (c < HEAP_NCLASS && ((size_t)1 << (HEAP_MINSHIFT + c)) < size)
+		c++;
+	return c;
+}
+
+void *
+malloc(size_t size)
+{
+	if (size > VM_HEAPTHREAD - VM_HEAPLO)
+		goto nomem;
+	heaparena *ar = heap_arena();
+	size_t need = size + HEAP_HDR;
+	int c = heap_class(need);
+	heapblock *b;
+	if (c < HEAP_NCLASS) {
+		if ((b = ar->free[c]) != NULL)
+			ar->free[c] = b->next;
+		else if ((b = heap_grow(ar, 1 << (HEAP_MINSHIFT + c))) == NULL)
+			goto nomem;
+	} else {
+		// Take the first freed big block that's big enough,
+		// or else some fresh pages.
+		need = ROUNDUP(need, PAGESIZE);
+		heapblock **bp;
+		for (bp = &ar->big; (b = *bp) != NULL; bp = &b->next)
+			if (b->size >= need)
+				break;
+		if (b != NULL)
+			*bp = b->next;
+		else if ((b = heap_grow(ar, need)) == NULL)
+			goto nomem;
+	}
+	return &b->next;
+
+nomem:
+	errno = ENOMEM;
+	return NULL;
+}
+
+void
+free(void *ptr)
+{
+	if (ptr == NULL)
+		return;
+	heaparena *ar = heap_arena();
+	heapblock *b = (heapblock*)((char*)ptr - HEAP_HDR);
+	assert((uint32_t)b >= VM_HEAPLO && (uint32_t)b < VM_HEAPHI);
+	int c = heap_class(b->size);
+	if (c < HEAP_NCLASS) {
+		assert(b->size == 1 << (HEAP_MINSHIFT + c));
+		b->next = ar->free[c];
+		ar->free[c] = b;
+	} else {
+		b->next = ar->big;
+		ar->big = b;
+	}
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+	if (size != 0 && nmemb > (size_t)-1 / size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	void *p = malloc(nmemb * size);
+	if (p != NULL)
+		memset(p, 0, nmemb * size);
+	return p;
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	if (ptr == NULL)
+		return malloc(size);
+	if (size == 0) {
+		free(ptr);
+		return NULL;
+	}
+	heapblock *b = (heapblock*)((char*)ptr - HEAP_HDR);
+	size_t have = b->size - HEAP_HDR;
+	if (size <= have)
+		return ptr;		// it already fits
+	void *p = malloc(size);
+	if (p != NULL) {
+		memmove(p, ptr, have);
+		free(ptr);
+	}
+	return p;
+}
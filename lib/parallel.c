@@ -0,0 +1,175 @@
+/*
+ * Parallel loops and reductions for PIOS, built on the tpool
+ * thread pool in lib/thread.c: one worker per CPU, created on first use
+ * and kept until the process exits or execs another program.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/unistd.h>
+#include <inc/assert.h>
+#include <inc/syscall.h>
+#include <inc/file.h>
+#include <inc/parallel.h>
+
+
+// What one worker is to do in a parallel loop
+typedef struct partask {
+	int		lo, hi;		// Subrange to run the loop over
+	par_forfn	forfn;		// Loop body, or
+	par_intfn	intfn;		// integer reduction body, or
+	par_doublefn	doublefn;	// floating-point reduction body
+	void		*arg;		// Argument to whichever one it is
+} partask;
+
+// Each worker gets its own task and result slot,
+// so the workers' writes to them never conflict when we merge.
+static tpool parpool;
+static partask partasks[TPOOL_MAX];
+static union {
+	int64_t		i;
+	double		d;
+} parslot[TPOOL_MAX];
+
+
+// Run a worker's task, as a tpool work item, and leave its result.
+static void
+par_work(int worker, void *arg)
+{
+	partask *t = arg;
+	files->parworkers = -1;		// any nested loops run serially
+	if (t->forfn)
+		t->forfn(t->lo, t->hi, t->arg);
+	else if (t->intfn)
+		parslot[worker].i = t->intfn(t->lo, t->hi, t->arg);
+	else
+		parslot[worker].d = t->doublefn(t->lo, t->hi, t->arg);
+}
+
+// Find our pool, creating it if we don't have one,
+// or return NULL if we are one of its workers.
+// Our file state records which children the pool's workers are,
+// so that a program we exec reuses them instead of leaking them,
+// while a child we fork, with no children yet, starts afresh.
+static tpool *
+par_pool(void)
+{
+	if (files->parworkers < 0)
+		return NULL;
+	if (files->parworkers > 0 && parpool.nworkers == files->parworkers
+			&& parpool.first == files->parfirst)
+		return &parpool;
+
+	if (files->parworkers == 0) {
+		// Reserve a run of free child slots, one per CPU
+		int n = MIN(MAX(sys_ncpu(), 1), TPOOL_MAX);
+		int first, i;
+		for (first = 1; first + n <= PROC_CHILDREN; first++) {
+			for (i = 0; i < n; i++)
+				if (files->child[first + i].state != PROC_FREE)
+					break;
+			if (i == n)
+				break;
+			first += i;	// no run can include that slot
+		}
+		if (first + n > PROC_CHILDREN)
+			return NULL;	// no room: just run serially
+		for (i = 0; i < n; i++)
+			files->child[first + i].state = PROC_RESERVED;
+		files->parfirst = first;
+		files->parworkers = n;
+	}
+	tpool_create(&parpool, files->parfirst, files->parworkers);
+	return &parpool;
+}
+
+// Split [lo,hi) among the pool's workers and wait for them all,
+// returning the number of pieces run,
+// or 0 if the caller should just run the whole range itself.
+static int
+par_run(int lo, int hi, int grain, partask *proto)
+{
+	assert(lo <= hi);
+	tpool *p = par_pool();
+	if (p == NULL)
+		return 0;
+	int len = hi - lo;
+	int n = MIN(p->nworkers, (len + MAX(grain, 1) - 1) / MAX(grain, 1));
+	if (n <= 1)
+		return 0;	// not worth the workers' while
+
+	int i;
+	for (i = 0; i < n; i++) {
+		partasks[i] = *proto;
+		partasks[i].lo = lo + (int)((int64_t)len * i / n);
+		partasks[i].hi = lo + (int)((int64_t)len * (i+1) / n);
+		tpool_run(p, i, par_work, &partasks[i]);
+	}
+	tpool_barrier(p);
+	return n;
+}
+
+void
+parallel_for(int lo, int hi, int grain, par_forfn fn, void *arg)
+{
+	partask t = { .forfn = fn, .arg = arg };
+	if (!par_run(lo, hi, grain, &t))
+		fn(lo, hi, arg);
+}
+
+static int64_t
+par_combineint(par_op op, int64_t a, int64_t b)
+{
+	switch (op) {
+	case PAR_SUM:	return a + b;
+	case PAR_MIN:	return MIN(a, b);
+	case PAR_MAX:	return MAX(a, b);
+	}
+	panic("parallel_reduce_int: bad op %d", op);
+}
+
+static double
+par_combinedouble(par_op op, double a, double b)
+{
+	switch (op) {
+	case PAR_SUM:	return a + b;
+	case PAR_MIN:	return MIN(a, b);
+	case PAR_MAX:	return MAX(a, b);
+	}
+	panic("parallel_reduce_double: bad op %d", op);
+}
+
+int64_t
+parallel_reduce_int(int lo, int hi, int grain, par_op op,
+			par_intfn fn, void *arg)
+{
+	assert(lo < hi);
+	partask t = { .intfn = fn, .arg = arg };
+	int n = par_run(lo, hi, grain, &t);
+	if (n == 0)
+		return fn(lo, hi, arg);
+	int64_t r = parslot[0].i;
+	int i;
+	for (i = 1; i < n; i++)
+		r = par_combineint(op, r, parslot[i].i);
+	return r;
+}
+
+double
+parallel_reduce_double(int lo, int hi, int grain, par_op op,
+			par_doublefn fn, void *arg)
+{
+	assert(lo < hi);
+	partask t = { .doublefn = fn, .arg = arg };
+	int n = par_run(lo, hi, grain, &t);
+	if (n == 0)
+		return fn(lo, hi, arg);
+	double r = parslot[0].d;
+	int i;
+	for (i = 1; i < n; i++)
+		r = par_combinedouble(op, r, parslot[i].d);
+	return r;
+}
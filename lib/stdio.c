@@ -9,6 +9,10 @@
  * just point to the same filedesc structs that low-level fds refer to,
  * which simplifies PIOS's user-space C library code a lot.
  *
+ * We do still collect output written through FILE pointers in a buffer,
+ * so that character-at-a-time output needn't take the whole file write path
+ * for every byte (see setvbuf() below).
+ *
  * Copyright (C) 1997 Massachusetts Institute of Technology
  * See section "MIT License" in the file LICENSES for licensing terms.
  *
@@ -31,6 +35,130 @@ FILE *const stdin = &FILES->fd[0];
 FILE *const stdout = &FILES->fd[1];
 FILE *const stderr = &FILES->fd[2];
 
+// Output buffers for FILE streams, indexed by file descriptor number.
+// These live in our program's own memory rather than in the filedesc,
+// since they're private to this process and this program:
+// we write them out before forking, exec'ing, exiting, or syncing
+// with our parent via sys_ret (see fflushbuf()).
+// The default is line buffering for console output, except stderr,
+// full buffering for regular files, and no buffering for anything else,
+// using one of a few default buffers of BUFSIZ bytes while they last.
+#define NDEFBUFS	8
+static struct stdbuf {
+	char	*buf;		// Buffer space, NULL if unbuffered
+	size_t	size;		// Size of buffer space
+	size_t	len;		// Number of bytes waiting in buf
+	int	mode;		// _IOFBF, _IOLBF, _IONBF, or 0 if not chosen yet
+	int	def;		// Default buffer we're using, plus 1, or 0
+} stdbufs[OPEN_MAX];
+static char defbufs[NDEFBUFS][BUFSIZ];
+static bool defbufused[NDEFBUFS];
+
+// Give stream buffer b one of the default buffers, if any are free.
+static bool
+stdbuf_claim(struct stdbuf *b)
+{
+	int i;
+	for (i = 0; i < NDEFBUFS && defbufused[i]; i++)
+		;
+	if (i == NDEFBUFS)
+		return 0;
+	defbufused[i] = 1;
+	b->def = i + 1;
+	b->buf = defbufs[i];
+	b->size = BUFSIZ;
+	return 1;
+}
+
+// Return the buffer state for stream fh, choosing its default mode if needed.
+static struct stdbuf *
+stdbuf(FILE *fh)
+{
+	assert(filedesc_isvalid(fh));
+	struct stdbuf *b = &stdbufs[fh - files->fd];
+	if (b->mode != 0 || !filedesc_isopen(fh))
+		return b;
+
+	fileinode *fi = &files->fi[fh->ino];
+	int mode = _IONBF;
+	if (fh->ino == FILEINO_CONSOUT)
+		mode = fh == stderr ? _IONBF : _IOLBF;
+	else if (S_ISREG(fi->mode)
+			&& (!(fi->mode & S_IFPART) || fileino_ispipe(fh->ino)))
+		mode = _IOFBF;
+	if (mode != _IONBF && !stdbuf_claim(b))
+		return b;	// none free: unbuffered for now, try again later
+	b->mode = mode;
+	return b;
+}
+
+// Choose how output to stream fh is buffered:
+// fully (_IOFBF), in lines (_IOLBF), or not at all (_IONBF),
+// using the 'size' bytes at 'buf' if given, or else a default buffer.
+// Must be called before any output to the stream, as in Unix.
+// Returns 0 on success, or nonzero with errno set.
+int
+setvbuf(FILE *fh, char *buf, int mode, size_t size)
+{
+	assert(filedesc_isopen(fh));
+	if (mode != _IOFBF && mode != _IOLBF && mode != _IONBF) {
+		errno = EINVAL;
+		return -1;
+	}
+	fclosebuf(fh);
+	struct stdbuf *b = &stdbufs[fh - files->fd];
+	if (mode != _IONBF && (buf == NULL || size == 0)) {
+		if (!stdbuf_claim(b)) {
+			errno = ENOSPC;
+			return -1;
+		}
+	} else if (mode != _IONBF) {
+		b->buf = buf;
+		b->size = size;
+	}
+	b->mode = mode;
+	return 0;
+}
+
+void
+setbuf(FILE *fh, char *buf)
+{
+	setvbuf(fh, buf, buf != NULL ? _IOFBF : _IONBF, BUFSIZ);
+}
+
+// Write out the output waiting in stream fh's buffer,
+// or in every stream's buffer if fh is NULL,
+// without syncing with our parent (which fflush() does).
+// Returns 0 on success, or -1 with errno set.
+int
+fflushbuf(FILE *fh)
+{
+	if (fh == NULL) {
+		int rc = 0;
+		for (fh = &files->fd[0]; fh < &files->fd[OPEN_MAX]; fh++)
+			if (fflushbuf(fh) < 0)
+				rc = -1;
+		return rc;
+	}
+	struct stdbuf *b = &stdbufs[fh - files->fd];
+	size_t len = b->len;
+	if (len == 0 || !filedesc_isopen(fh))
+		return 0;
+	b->len = 0;		// before filedesc_write() calls us again
+	return filedesc_write(fh, b->buf, 1, len) < 0 ? -1 : 0;
+}
+
+// Write out and forget stream fh's buffer, as when it's closed.
+void
+fclosebuf(FILE *fh)
+{
+	struct stdbuf *b = &stdbufs[fh - files->fd];
+	fflushbuf(fh);
+	if (b->def)
+		defbufused[b->def - 1] = 0;
+	memset(b, 0, sizeof(*b));
+}
+
 FILE *
 fopen(const char *path, const char *mode)
 {
@@ -70,7 +198,7 @@ freopen(const char *path, const char *mode, FILE *fd)
 int
 fclose(FILE *fd)
 {
-	filedesc_close(fd);
+	filedesc_close(fd);	// writes out our buffer via fclosebuf()
 	return 0;
 }
 
@@ -88,7 +216,7 @@ int
 fputc(int c, FILE *fd)
 {
 	unsigned char ch = c;
-	if (filedesc_write(fd, &ch, 1, 1) < 1)
+	if (fwrite(&ch, 1, 1, fd) < 1)
 		return EOF;
 	return ch;
 }
@@ -103,10 +231,24 @@ fread(void *buf, size_t eltsize, size_t count, FILE *fd)
 size_t
 fwrite(const void *buf, size_t eltsize, size_t count, FILE *fd)
 {
-	ssize_t actual = filedesc_write(fd, buf, eltsize, count);
+	assert(filedesc_iswritable(fd));
+	struct stdbuf *b = stdbuf(fd);
+	size_t len = eltsize * count;
 
-		
-	return actual >= 0 ? actual : 0;	// no error indication
+	// Write straight through if unbuffered or too big to bother buffering.
+	if (b->buf == NULL || len > b->size) {
+		ssize_t actual = filedesc_write(fd, buf, eltsize, count);
+		return actual >= 0 ? actual : 0;	// no error indication
+	}
+
+	if (b->len + len > b->size && fflushbuf(fd) < 0)
+		return 0;
+	memcpy(b->buf + b->len, buf, len);
+	b->len += len;
+	if (b->mode == _IOLBF && memchr(buf, '\n', len) != NULL
+			&& fflushbuf(fd) < 0)
+		return 0;
+	return count;
 }
 
 int
@@ -121,7 +263,7 @@ long
 ftell(FILE *fd)
 {
 	assert(filedesc_isopen(fd));
-	return fd->ofs;
+	return fd->ofs + stdbufs[fd - files->fd].len;
 }
 
 int
@@ -158,6 +300,8 @@ fflush(FILE *f)
 	}
 
 	assert(filedesc_isopen(f));
+	if (fflushbuf(f) < 0)
+		return EOF;
 	return fileino_flush(f->ino);
 }
 
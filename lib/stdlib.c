@@ -9,17 +9,27 @@
 
 #include <inc/cdefs.h>
 #include <inc/file.h>
+#include <inc/stat.h>
 #include <inc/stdlib.h>
 #include <inc/syscall.h>
 #include <inc/assert.h>
 #include <inc/string.h>
+#include <inc/stdio.h>
 
 void gcc_noreturn
 exit(int status)
 {
 	// To exit a PIOS user process, by convention,
-	// we just set our exit status in our filestate area
+	// we just write out any buffered output,
+	// end any pipes we still hold open for writing,
+	// set our exit status in our filestate area,
 	// and return to our parent process.
+	fflushbuf(NULL);
+	int i;
+	for (i = 0; i < OPEN_MAX; i++)
+		if (filedesc_iswritable(&files->fd[i])
+				&& fileino_ispipe(files->fd[i].ino))
+			fileino_endpipe(files->fd[i].ino);
 	files->status = status;
 	files->exited = 1;
 	sys_ret();
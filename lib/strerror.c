@@ -15,6 +15,9 @@ strerror(int err)
 		"Resource temporarily unavailable",
 		"No child processes",
 		"Conflict detected",
+		"Bad file descriptor",
+		"Permission denied",
+		"Cannot allocate memory",
 	};
 	static char errbuf[64];
 
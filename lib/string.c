@@ -96,24 +96,69 @@ strchr(const char *s, char c)
 	return (char *) s;
 }
 
+// Set at startup, by lib/crt0.S in user space or cpu_init() in the kernel,
+// if the processor has SSE2 and so the MOVNTI non-temporal store.
+int string_sse2;
+
 #if ASM
+
+// Size classes: copies or fills shorter than STRING_SMALL bytes
+// are done a byte at a time in C, to avoid REP's startup cost;
+// longer ones align the destination and go a word at a time,
+// and ones of at least STRING_NT bytes bypass the cache with MOVNTI.
+// The latter only pays when the data won't be touched again soon,
+// so it's set well above a page: a page copied for copy-on-write
+// is written by its new owner right away.
+#define STRING_SMALL	16
+#define STRING_NT	(64*1024)
+
+// Store nw words from s (or of the value c, if s is NULL) at word-aligned d
+// with non-temporal stores, and then fence them.
+static void
+string_storent(uint32_t *d, const uint32_t *s, uint32_t c, size_t nw)
+{
+	for (; nw >= 4; nw -= 4, d += 4) {
+		uint32_t a = c, b = c, e = c, f = c;
+		if (s) {
+			a = s[0], b = s[1], e = s[2], f = s[3];
+			s += 4;
+		}
+		asm volatile("movnti %4,%0; movnti %5,%1; "
+				"movnti %6,%2; movnti %7,%3"
+			: "=m" (d[0]), "=m" (d[1]), "=m" (d[2]), "=m" (d[3])
+			: "r" (a), "r" (b), "r" (e), "r" (f));
+	}
+	for (; nw > 0; nw--, d++)
+		asm volatile("movnti %1,%0" : "=m" (*d) : "r" (s ? *s++ : c));
+	asm volatile("sfence" ::: "memory");
+}
+
 void *
 memset(void *v, int c, size_t n)
 {
-	char *p;
+	char *p = v;
 
-	if (n == 0)
+	c &= 0xFF;
+	if (n < STRING_SMALL) {
+		while (n-- > 0)
+			*p++ = c;
 		return v;
-	if ((int)v%4 == 0 && n%4 == 0) {
-		c &= 0xFF;
-		c = (c<<24)|(c<<16)|(c<<8)|c;
-		asm volatile("cld; rep stosl\n"
-			:: "D" (v), "a" (c), "c" (n/4)
-			: "cc", "memory");
+	}
+
+	// Fill up to a word boundary, then by words, then the tail.
+	size_t head = -(uint32_t)p & 3;
+	size_t nw = (n - head) / 4, tail = (n - head) % 4;
+	c = (c<<24)|(c<<16)|(c<<8)|c;
+	asm volatile("cld; rep stosb\n"
+		: "+D" (p), "+c" (head) : "a" (c) : "cc", "memory");
+	if (string_sse2 && n >= STRING_NT) {
+		string_storent((uint32_t*)p, NULL, c, nw);
+		p += nw * 4;
 	} else
-		asm volatile("cld; rep stosb\n"
-			:: "D" (v), "a" (c), "c" (n)
-			: "cc", "memory");
+		asm volatile("cld; rep stosl\n"
+			: "+D" (p), "+c" (nw) : "a" (c) : "cc", "memory");
+	asm volatile("cld; rep stosb\n"
+		: "+D" (p), "+c" (tail) : "a" (c) : "cc", "memory");
 	return v;
 }
 
@@ -125,24 +170,50 @@ memmove(void *dst, const void *src, size_t n)
 	
 	s = src;
 	d = dst;
+	if (n < STRING_SMALL) {
+		if (s < d && s + n > d) {
+			s += n;
+			d += n;
+			while (n-- > 0)
+				*--d = *--s;
+		} else
+			while (n-- > 0)
+				*d++ = *s++;
+		return dst;
+	}
+
+	// Copy up to a destination word boundary, then by words
+	// (the source may still be misaligned, which x86 tolerates),
+	// then the tail.  Backward copies go from the end the same way.
 	if (s < d && s + n > d) {
 		s += n;
 		d += n;
-		if ((int)s%4 == 0 && (int)d%4 == 0 && n%4 == 0)
-			asm volatile("std; rep movsl\n"
-				:: "D" (d-4), "S" (s-4), "c" (n/4) : "cc", "memory");
-		else
-			asm volatile("std; rep movsb\n"
-				:: "D" (d-1), "S" (s-1), "c" (n) : "cc", "memory");
+		size_t tail = (uint32_t)d & 3;
+		size_t nw = (n - tail) / 4, head = (n - tail) % 4;
+		d--, s--;	// last byte
+		asm volatile("std; rep movsb\n"
+			"	subl $3,%%edi; subl $3,%%esi\n"
+			"	movl %3,%%ecx; rep movsl\n"
+			"	addl $3,%%edi; addl $3,%%esi\n"
+			"	movl %4,%%ecx; rep movsb\n"
+			: "+D" (d), "+S" (s), "+c" (tail)
+			: "g" (nw), "g" (head) : "cc", "memory");
 		// Some versions of GCC rely on DF being clear
 		asm volatile("cld" ::: "cc");
 	} else {
-		if ((int)s%4 == 0 && (int)d%4 == 0 && n%4 == 0)
+		size_t head = -(uint32_t)d & 3;
+		size_t nw = (n - head) / 4, tail = (n - head) % 4;
+		asm volatile("cld; rep movsb\n"
+			: "+D" (d), "+S" (s), "+c" (head) : : "cc", "memory");
+		if (string_sse2 && n >= STRING_NT) {
+			string_storent((uint32_t*)d, (const uint32_t*)s, 0, nw);
+			d += nw * 4;
+			s += nw * 4;
+		} else
 			asm volatile("cld; rep movsl\n"
-				:: "D" (d), "S" (s), "c" (n/4) : "cc", "memory");
-		else
-			asm volatile("cld; rep movsb\n"
-				:: "D" (d), "S" (s), "c" (n) : "cc", "memory");
+				: "+D" (d), "+S" (s), "+c" (nw) : : "cc", "memory");
+		asm volatile("cld; rep movsb\n"
+			: "+D" (d), "+S" (s), "+c" (tail) : : "cc", "memory");
 	}
 	return dst;
 }
@@ -33,11 +33,44 @@
 static int thread_id;
 
 
+// Child number child's thread is done with its heap arena.
+static void
+thread_arenaput(uint16_t child)
+{
+	int a = files->heapchild[child & 0xff];
+	if (a != 0)
+		files->heapthreads &= ~(1ULL << (a-1));
+	files->heapchild[child & 0xff] = 0;
+}
+
+// Give tfork() child number child the lowest heap arena (see inc/vm.h)
+// none of our other threads has, letting go of any it had before.
+// A thread keeps its arena until it's joined for good,
+// as a pool worker is only in tpool_destroy().
+// Our threads' own threads pick from what we had when we forked them.
+static int
+thread_arenaget(uint16_t child)
+{
+	thread_arenaput(child);
+	int a;
+	for (a = 1; a <= VM_HEAPNTHREAD; a++)
+		if (!(files->heapthreads & (1ULL << (a-1))))
+			break;
+	if (a > VM_HEAPNTHREAD)
+		panic("tfork: more than %d threads at once", VM_HEAPNTHREAD);
+	files->heapthreads |= 1ULL << (a-1);
+	files->heapchild[child & 0xff] = a;
+	return a;
+}
+
+
 // Fork a child process/thread, returning 0 in the child and 1 in the parent.
 int
 tfork(uint16_t child)
 {
-	// Set up the register state for the child
+	// Set up the register state for the child,
+	// and pick its heap arena while we're still the only one running
+	int arena = thread_arenaget(child);
 	struct procstate ps;
 	memset(&ps, 0, sizeof(ps));
 
@@ -61,25 +94,31 @@ tfork(uint16_t child)
 		:
 		: "ebx", "ecx", "edx");
 	if (!isparent) {
+		// Allocate from our own heap arena, apart from our siblings
+		files->heaparena = arena;
 		return 0;	// in the child
 	}
 
 	// Fork the child, copying our entire user address space into it.
+	// Threads are joined all together, so start it in our gang
+	// to have the kernel spread the group across the CPUs.
 	ps.tf.regs.eax = 0;	// isparent == 0 in the child
-	sys_put(SYS_REGS | SYS_COPY | SYS_SNAP | SYS_START, child,
+	sys_put(SYS_REGS | SYS_COPY | SYS_SNAP | SYS_START | SYS_GANG, child,
  		&ps, ALLVA, ALLVA, ALLSIZE);
 
 	return 1;
 }
 
-void
-tjoin(uint16_t child)
+// Wait for tfork() child number child and merge its changes,
+// leaving it its heap arena, as for a pool worker parked for its next round.
+static void
+thread_join(uint16_t child)
 {
-	// Wait for the child and retrieve its CPU state.
+	// Wait for the child and retrieve its trap status.
 	// If merging, leave the highest 4MB containing the stack unmerged,
 	// so that the stack acts as a "thread-private" memory area.
 	struct procstate ps;
-	sys_get(SYS_MERGE | SYS_REGS, child, &ps, SHAREVA, SHAREVA, SHARESIZE);
+	sys_get(SYS_MERGE | SYS_STATUS, child, &ps, SHAREVA, SHAREVA, SHARESIZE);
 
 	// Make sure the child exited with the expected trap number
 	if (ps.tf.trapno != T_SYSCALL) {
@@ -90,3 +129,135 @@ tjoin(uint16_t child)
 	}
 }
 
+void
+tjoin(uint16_t child)
+{
+	thread_join(child);
+	thread_arenaput(child);
+}
+
+
+// Stop at a barrier: return to our parent, which restarts us in tjoinall()
+// once all our sibling threads get here too, with everything they
+// (and we) changed in shared memory since the last barrier merged in.
+// The flag in EAX marks the sys_ret; the kernel only looks at SYS_TYPE.
+void
+tbarrier(void)
+{
+	asm volatile("int %0" : :
+		"i" (T_SYSCALL),
+		"a" (SYS_RET | EXIT_BARRIER)
+		: "cc", "memory");
+}
+
+// Wait for the n threads child..child+n-1, all started with tfork(),
+// seeing them through their barriers until they all exit.
+// Each round takes one GET, merging all their changes into our memory,
+// and one PUT giving them all a fresh copy of the result and restarting them.
+void
+tjoinall(uint16_t child, int n)
+{
+	assert(n > 0 && n < 256);
+	procstate ps[n];
+	while (1) {
+		sys_get(SYS_MERGE | SYS_REGS, SYS_RANGE(child, n), ps,
+			SHAREVA, SHAREVA, SHARESIZE);
+
+		int i, nbarrier = 0;
+		for (i = 0; i < n; i++) {
+			if (ps[i].tf.trapno != T_SYSCALL) {
+				cprintf("  eip  0x%08x\n", ps[i].tf.eip);
+				cprintf("  esp  0x%08x\n", ps[i].tf.esp);
+				panic("tjoinall: thread %x: unexpected trap %d\n",
+					child + i, ps[i].tf.trapno);
+			}
+			if (ps[i].tf.regs.eax & EXIT_BARRIER)
+				nbarrier++;
+		}
+		if (nbarrier == 0) {
+			for (i = 0; i < n; i++)
+				thread_arenaput(child + i);
+			return;		// all done
+		}
+		if (nbarrier < n)
+			panic("tjoinall: %d of %d threads exited "
+				"while the rest wait at a barrier", n - nbarrier, n);
+
+		sys_put(SYS_COPY | SYS_SNAP | SYS_START | SYS_GANG,
+			SYS_RANGE(child, n), NULL, SHAREVA, SHAREVA, SHARESIZE);
+	}
+}
+
+
+// A pool worker's main loop: park in sys_ret() until tpool_run()
+// restarts us with a fresh copy of the parent's shared memory,
+// then run the work item it left for us there.
+static void gcc_noreturn
+tpool_worker(tpool *p, int worker)
+{
+	while (1) {
+		sys_ret();
+		p->item[worker].fn(worker, p->item[worker].arg);
+	}
+}
+
+// Fork off nworkers pool workers as children first..first+nworkers-1.
+// They keep their stacks, and their place in tpool_worker(), across rounds,
+// so each round only has to bring their shared memory up to date.
+void
+tpool_create(tpool *p, uint16_t first, int nworkers)
+{
+	assert((void*)p >= SHAREVA && (void*)(p+1) <= SHAREVA + SHARESIZE);
+	assert(nworkers > 0 && nworkers <= TPOOL_MAX);
+	memset(p, 0, sizeof(*p));
+	p->first = first;
+	p->nworkers = nworkers;
+
+	int i;
+	for (i = 0; i < nworkers; i++)
+		if (!tfork(first + i))
+			tpool_worker(p, i);
+}
+
+// Hand a work item to a parked worker and start it.
+// Re-copying the shared region only re-shares the page tables
+// we or other workers changed since this worker's last round,
+// and the snapshot likewise only catches up on those,
+// so a round costs in proportion to what it touches.
+void
+tpool_run(tpool *p, int worker, tpool_fn fn, void *arg)
+{
+	assert(worker >= 0 && worker < p->nworkers);
+	assert(!p->busy[worker]);
+	p->item[worker].fn = fn;
+	p->item[worker].arg = arg;
+	p->busy[worker] = 1;
+	sys_put(SYS_COPY | SYS_SNAP | SYS_START | SYS_GANG, p->first + worker,
+		NULL, SHAREVA, SHAREVA, SHARESIZE);
+}
+
+// Wait for every worker dispatched since the last barrier
+// and merge the changes each made to shared memory into ours.
+void
+tpool_barrier(tpool *p)
+{
+	int i;
+	for (i = 0; i < p->nworkers; i++)
+		if (p->busy[i]) {
+			thread_join(p->first + i);
+			p->busy[i] = 0;
+		}
+}
+
+// Wait for outstanding work, then free the workers' memory.
+void
+tpool_destroy(tpool *p)
+{
+	tpool_barrier(p);
+	int i;
+	for (i = 0; i < p->nworkers; i++) {
+		sys_put(SYS_ZERO, p->first + i, NULL, NULL, ALLVA, ALLSIZE);
+		thread_arenaput(p->first + i);
+	}
+	p->nworkers = 0;
+}
@@ -10,12 +10,16 @@
 
 #include <inc/file.h>
 #include <inc/unistd.h>
+#include <inc/stat.h>
 #include <inc/stdio.h>
 #include <inc/string.h>
 #include <inc/dirent.h>
 #include <inc/assert.h>
 #include <inc/stdarg.h>
 #include <inc/errno.h>
+#include <inc/syscall.h>
+#include <inc/mmu.h>
+#include <inc/vm.h>
 
 int
 creat(const char *path, mode_t mode)
@@ -88,6 +92,7 @@ dup2(int oldfn, int newfn)
 	filedesc *newfd = &files->fd[newfn];
 	assert(filedesc_isopen(oldfd));
 	assert(filedesc_isvalid(newfd));
+	fflushbuf(oldfd);	// the copy starts with an empty buffer
 
 	if (filedesc_isopen(newfd))
 		close(newfn);
@@ -146,4 +151,208 @@ fsync(int fn)
 	return fileino_flush(files->fd[fn].ino);
 }
 
+// Create a pipe, returning its read end in p[0] and its write end in p[1].
+// A pipe is an append-only partial file in /pipe,
+// whose readers wait for more data at its end like console input does,
+// until the last process that writes it closes it or exits.
+// Sibling processes connect through their common parent,
+// which passes along the data as it reconciles with each (see waitpid()).
+// Returns 0 on success, or returns -1 and sets errno on error.
+int
+pipe(int p[2])
+{
+	if (dir_walk("/pipe", S_IFDIR) < 0)
+		return -1;
+
+	// Find an unused name; the pipe is ours until the name is reconciled.
+	int i, ino;
+	char path[32];
+	for (i = 0; ; i++) {
+		snprintf(path, sizeof(path), "/pipe/%d", i);
+		if (dir_walk(path, 0) < 0)
+			break;
+	}
+	if ((ino = dir_walk(path, S_IFREG | S_IFPART)) < 0)
+		return -1;
+	assert(fileino_ispipe(ino));
+
+	if ((p[0] = open(path, O_RDONLY)) < 0)
+		return -1;
+	if ((p[1] = open(path, O_WRONLY | O_APPEND)) < 0) {
+		close(p[0]);
+		return -1;
+	}
+	return 0;
+}
+
+
+// The mappings mmap() has handed out, so that munmap() can undo them.
+// Like the rest of a process's user-space state,
+// a forked child inherits a copy, and exec() starts afresh.
+#define MMAP_MAX	32
+static struct mapping {
+	void	*va;		// Start of mapping, NULL if entry unused
+	size_t	len;		// Length of mapping in bytes
+	int	ino;		// Inode of the file mapped
+	off_t	ofs;		// Offset in the file the mapping starts at
+	int	prot;		// PROT_* protection
+	int	flags;		// MAP_SHARED or MAP_PRIVATE
+} mappings[MMAP_MAX];
+
+// Find room for a private mapping of size bytes between VM_MMAPLO and HI.
+static void *
+mmap_findva(size_t size)
+{
+	uintptr_t va = VM_MMAPLO;
+	int i;
+	for (i = 0; i < MMAP_MAX; i++) {	// restart whenever we overlap one
+		struct mapping *m = &mappings[i];
+		if (m->va == NULL || !(m->flags & MAP_PRIVATE))
+			continue;
+		uintptr_t mva = (uintptr_t)m->va;
+		if (va < mva + ROUNDUP(m->len, PAGESIZE) && mva < va + size) {
+			va = mva + ROUNDUP(m->len, PAGESIZE);
+			i = -1;
+		}
+	}
+	if (va + size > VM_MMAPHI || va + size < va)
+		return NULL;
+	return (void*)va;
+}
+
+// Map len bytes of the content of open file fn from page-aligned offset ofs.
+// A MAP_SHARED mapping is just a pointer into our own copy of the file
+// (see inc/file.h), so it costs nothing, but must lie within one window;
+// we move a small file out of its slot first so that the pointer stays good.
+// Writing through it (PROT_WRITE) may also extend the file:
+// munmap() grows the file to cover whatever was written past its end,
+// and marks the file changed so that reconciliation carries the writes.
+// A MAP_PRIVATE mapping is a copy-on-write copy of the file's pages
+// between VM_MMAPLO and VM_MMAPHI, made with SYS_COPY via scratch child 0,
+// and can span windows.
+// As Unix allows without MAP_FIXED, we ignore the 'addr' hint.
+void *
+mmap(void *addr, size_t len, int prot, int flags, int fn, off_t ofs)
+{
+	if (fn < 0 || fn >= OPEN_MAX || !filedesc_isreadable(&files->fd[fn])) {
+		errno = EBADF;
+		return MAP_FAILED;
+	}
+	int ino = files->fd[fn].ino;
+	fileinode *fi = &files->fi[ino];
+	size_t end = ofs + len;
+	if (!fileino_isreg(ino) || len == 0 || ofs < 0 || PGOFF(ofs)
+			|| end < ofs || end > fileino_maxsize(ino)
+			|| (flags != MAP_SHARED && flags != MAP_PRIVATE)) {
+		errno = EINVAL;
+		return MAP_FAILED;
+	}
+	if (flags == MAP_SHARED && (prot & PROT_WRITE)
+			&& !filedesc_iswritable(&files->fd[fn])) {
+		errno = EACCES;
+		return MAP_FAILED;
+	}
+	int i;
+	for (i = 0; i < MMAP_MAX && mappings[i].va != NULL; i++)
+		;
+	if (i == MMAP_MAX) {
+		errno = ENOMEM;
+		return MAP_FAILED;
+	}
+
+	void *va;
+	if (flags == MAP_SHARED) {
+		int k = ofs / FILE_WINSIZE;
+		if ((end - 1) / FILE_WINSIZE != k) {
+			errno = EINVAL;		// would span windows
+			return MAP_FAILED;
+		}
+		if (fileino_unslot(ino) < 0 || ((prot & PROT_WRITE)
+				&& end > fi->size && fileino_grow(ino, end) < 0))
+			return MAP_FAILED;
+		va = fileino_window(files, ino, k);
+		if (va == NULL) {
+			errno = EINVAL;		// nothing there to map
+			return MAP_FAILED;
+		}
+		va += ofs % FILE_WINSIZE;
+	} else {
+		size_t size = ROUNDUP(len, PAGESIZE);
+		va = mmap_findva(size);
+		if (va == NULL) {
+			errno = ENOMEM;
+			return MAP_FAILED;
+		}
+
+		// Copy the file's pages over window by window, through child 0,
+		// and give the whole mapping the permissions asked for,
+		// which maps fresh zero pages past the file's mapped extent.
+		off_t pos = ofs;
+		while (pos < end) {
+			int k = pos / FILE_WINSIZE;
+			size_t wbase = (size_t)k * FILE_WINSIZE;
+			void *win = fileino_window(files, ino, k);
+			size_t lim = wbase + MIN(fileino_winlim(fi->size, k),
+						fileino_segsize(files, ino));
+			if (win == NULL || pos >= lim)
+				break;
+			size_t n = MIN(ROUNDUP(end, PAGESIZE), lim) - pos;
+			void *dst = va + (pos - ofs);
+			sys_put(SYS_COPY, 0, NULL, win + (pos - wbase), dst, n);
+			sys_get(SYS_COPY, 0, NULL, dst, dst, n);
+			pos += n;
+		}
+		sys_get(SYS_PERM | (prot & PROT_READ ? SYS_READ : 0)
+			| (prot & PROT_WRITE ? SYS_RW : 0), 0, NULL, NULL, va, size);
+		sys_put(SYS_ZERO, 0, NULL, NULL, va, size);
+	}
+
+	struct mapping *m = &mappings[i];
+	m->va = va;
+	m->len = len;
+	m->ino = ino;
+	m->ofs = ofs;
+	m->prot = prot;
+	m->flags = flags;
+	return va;
+}
 
+// Undo a mapping made by mmap(), which must be given whole.
+// Returns 0 on success, or -1 with errno set.
+int
+munmap(void *addr, size_t len)
+{
+	int i;
+	for (i = 0; i < MMAP_MAX; i++)
+		if (mappings[i].va == addr && addr != NULL
+				&& ROUNDUP(mappings[i].len, PAGESIZE)
+					== ROUNDUP(len, PAGESIZE))
+			break;
+	if (i == MMAP_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	struct mapping *m = &mappings[i];
+	m->va = NULL;
+	if (m->flags == MAP_PRIVATE) {
+		sys_get(SYS_ZERO, 0, NULL, NULL, addr, ROUNDUP(len, PAGESIZE));
+		return 0;
+	}
+	if (!(m->prot & PROT_WRITE) || !fileino_isreg(m->ino))
+		return 0;
+
+	// Grow the file to cover the last nonzero byte written past its end,
+	// as long as the file still lives where we mapped it.
+	fileinode *fi = &files->fi[m->ino];
+	size_t end = m->ofs + m->len;
+	void *win = fileino_window(files, m->ino, m->ofs / FILE_WINSIZE);
+	if (win + m->ofs % FILE_WINSIZE == addr) {
+		while (end > fi->size && ((char*)addr)[end - 1 - m->ofs] == 0)
+			end--;
+		if (end > fi->size)
+			fi->size = end;
+	}
+	fi->ver++;	// writes in place are an exclusive change
+	fileino_logchg(files, m->ino);
+	return 0;
+}
@@ -0,0 +1,78 @@
+#!/bin/sh
+#
+# Turn the addresses in a SYS_PROF report (see debug_prof() in kern/debug.c)
+# into function names and source lines, and total the samples by function.
+# The kernel doesn't load its stabs, so we look them up here instead:
+# function names from the symbol table, lines from the stabs via addr2line.
+#
+# Usage: misc/profsym.sh [user-program ...] < console-log
+#
+# Kernel addresses are looked up in obj/kern/kernel; user addresses
+# in the user programs named, e.g., obj/user/testfs, first match wins.
+# Set GCCPREFIX as the GNUmakefile does if the host's nm won't do.
+
+kernel=${KERNEL:-obj/kern/kernel}
+nm=${GCCPREFIX}nm
+addr2line=${GCCPREFIX}addr2line
+
+if test ! -f $kernel; then
+	echo "profsym: can't find $kernel; run make first" 1>&2
+	exit 1
+fi
+
+syms=/tmp/profsym.$$
+trap "rm -f $syms" 0 1 2 15
+
+# One symbol table: "k" or "u" mode, address, name.
+$nm -n $kernel | awk '$2 ~ /^[tTwW]$/ { print "k", $1, $3 }' > $syms
+for prog in "$@"; do
+	$nm -n $prog | awk '$2 ~ /^[tTwW]$/ { print "u", $1, $3 }' >> $syms
+done
+
+# Report lines look like "<samples> <percent> <k|u> <eip>".
+awk -v syms=$syms -v kernel=$kernel -v a2l="$addr2line" '
+function hex(s,   i, n) {
+	n = 0
+	for (i = 1; i <= length(s); i++)
+		n = n * 16 + index("0123456789abcdef", substr(tolower(s), i, 1)) - 1
+	return n
+}
+BEGIN {
+	while ((getline line < syms) > 0) {
+		split(line, f, " ")
+		n[f[1]]++
+		addr[f[1], n[f[1]]] = hex(f[2])
+		name[f[1], n[f[1]]] = f[3]
+	}
+}
+NF == 4 && $1 ~ /^[0-9]+$/ && $3 ~ /^[ku]$/ && $4 ~ /^[0-9a-f]+$/ {
+	mode = $3; eip = hex($4)
+
+	# Binary search for the last symbol at or below eip.
+	lo = 1; hi = n[mode]; fn = "?"
+	while (lo <= hi) {
+		mid = int((lo + hi) / 2)
+		if (addr[mode, mid] <= eip) { fn = name[mode, mid]; lo = mid + 1 }
+		else hi = mid - 1
+	}
+
+	src = ""
+	if (mode == "k") {
+		cmd = a2l " -e " kernel " " $4
+		cmd | getline src
+		close(cmd)
+		if (src ~ /^\?\?/)
+			src = ""
+	}
+	printf "%s  %s %s\n", $0, fn, src
+	total[fn] += $1
+	next
+}
+{ print }
+END {
+	print ""
+	print "samples by function, from the addresses listed above:"
+	for (fn in total)
+		printf "%8d  %s\n", total[fn], fn | "sort -rn"
+}
+'
@@ -0,0 +1,367 @@
+/*
+ * Microbenchmarks for PIOS primitives: system calls, process and thread
+ * creation, page faults, virtual copies and merges, exec, directory
+ * lookups, and file I/O, all timed with the TSC.
+ *
+ * Each result is one line of the form
+ *
+ *	bench <name> <param> <iters> <min> <median>
+ *
+ * giving the minimum and median, over BENCH_TRIALS trials of <iters>
+ * operations each, of TSC cycles per operation; what <param> means
+ * depends on the benchmark (pages, bytes, depth, or 0 if none).
+ * Other output lines start with '#', so runs on two kernel builds
+ * can be compared with little more than grep and join.
+ *
+ * Usage: bench [name]	- run all benchmarks, or those named name
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#include <inc/stdio.h>
+#include <inc/stdlib.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/unistd.h>
+#include <inc/dirent.h>
+#include <inc/syscall.h>
+#include <inc/file.h>
+#include <inc/stat.h>
+#include <inc/x86.h>
+#include <inc/mmu.h>
+#include <inc/vm.h>
+#include <inc/bench.h>
+
+
+#define BCHILD		200		// Child number the benchmarks use
+
+// Scratch memory for the page fault and copy benchmarks:
+// a source region the child gets a copy of, and a destination region.
+// exec() zeroes scratch space, so each benchmark cleans up after itself.
+#define SRCVA		((uint8_t*) VM_SCRATCHLO)
+#define DSTVA		((uint8_t*) VM_SCRATCHLO + PTSIZE)
+#define MAXSIZE		PTSIZE
+
+// Pages threads write in the shared area for the fork and merge benchmarks.
+#define MAXPAGES	64
+static uint8_t sharebuf[MAXPAGES][PAGESIZE] gcc_aligned(PAGESIZE);
+
+// One benchmark: run iters operations with parameter param,
+// returning the TSC cycles the timed part took.
+typedef uint64_t (*benchfn)(int param, int iters);
+
+static const char *only;	// Run only the benchmark of this name
+
+
+// Map size bytes of fresh pages at va, writable but not yet touched.
+static void
+bench_zero(uint8_t *va, size_t size)
+{
+	sys_get(SYS_ZERO | SYS_PERM | SYS_RW, 0, NULL, NULL, va, size);
+}
+
+// Unmap the scratch regions, and the child's copy, after a benchmark.
+static void
+bench_clean(void)
+{
+	sys_get(SYS_ZERO, 0, NULL, NULL, SRCVA, 2 * MAXSIZE);
+	sys_put(SYS_FREE, BCHILD, NULL, NULL, NULL, 0);
+}
+
+// Give the child a copy of a source region of size bytes,
+// every page of it touched so it's really there.
+static void
+bench_source(size_t size)
+{
+	bench_zero(SRCVA, size);
+	size_t i;
+	for (i = 0; i < size; i += PAGESIZE)
+		SRCVA[i] = 1;
+	sys_put(SYS_COPY, BCHILD, NULL, SRCVA, SRCVA, size);
+}
+
+// Run benchmark fn BENCH_TRIALS times and print the result line.
+static void
+bench(const char *name, benchfn fn, int param, int iters)
+{
+	if (only != NULL && strcmp(only, name) != 0)
+		return;
+
+	// Sort the per-operation times of each trial.
+	uint64_t t[BENCH_TRIALS];
+	int i;
+	for (i = 0; i < BENCH_TRIALS; i++)
+		bench_insert(t, i, fn(param, iters) / iters);
+	printf("bench %s %d %d %llu %llu\n", name, param, iters,
+		BENCH_MIN(t), BENCH_MEDIAN(t));
+	fflush(stdout);
+}
+
+
+// System call that does nothing but return.
+static uint64_t
+b_syscall(int param, int iters)
+{
+	uint64_t t0 = rdtsc();
+	while (iters-- > 0)
+		sys_ncpu();
+	return rdtsc() - t0;
+}
+
+// PUT to start a child that returns at once, then GET to wait for it.
+static uint64_t
+b_putget(int param, int iters)
+{
+	if (!tfork(BCHILD))
+		while (1)
+			sys_ret();
+	sys_get(0, BCHILD, NULL, NULL, NULL, 0);
+
+	uint64_t t0 = rdtsc();
+	while (iters-- > 0) {
+		sys_put(SYS_START, BCHILD, NULL, NULL, NULL, 0);
+		sys_get(0, BCHILD, NULL, NULL, NULL, 0);
+	}
+	uint64_t t = rdtsc() - t0;
+	bench_clean();
+	return t;
+}
+
+// Unix fork() of a process that exits at once, and waitpid() for it.
+static uint64_t
+b_fork(int param, int iters)
+{
+	uint64_t t0 = rdtsc();
+	while (iters-- > 0) {
+		pid_t pid = fork();
+		if (pid == 0)
+			exit(0);
+		assert(pid > 0);
+		waitpid(pid, NULL, 0);
+	}
+	return rdtsc() - t0;
+}
+
+// tfork() a thread that writes param pages of shared memory,
+// and tjoin() it, merging its writes back.
+static uint64_t
+b_tfork(int param, int iters)
+{
+	uint64_t t0 = rdtsc();
+	while (iters-- > 0) {
+		if (!tfork(BCHILD)) {
+			int i;
+			for (i = 0; i < param; i++)
+				sharebuf[i][0]++;
+			sys_ret();
+		}
+		tjoin(BCHILD);
+	}
+	return rdtsc() - t0;
+}
+
+// tjoin() alone, merging a thread's writes to param pages
+// that we wrote too: when conflicts is set, to the same words,
+// combined with MERGEOP_ADD; otherwise to other words of the same pages.
+static uint64_t
+b_merge(int param, int iters, bool conflicts)
+{
+	int i, word = conflicts ? 0 : 1;
+	if (conflicts)
+		sys_mergeop(sharebuf, sizeof(sharebuf), MERGEOP_ADD);
+
+	uint64_t t = 0;
+	while (iters-- > 0) {
+		if (!tfork(BCHILD)) {
+			for (i = 0; i < param; i++)
+				sharebuf[i][0]++;
+			sys_ret();
+		}
+		for (i = 0; i < param; i++)
+			((uint32_t*)sharebuf[i])[word]++;
+		uint64_t t0 = rdtsc();
+		tjoin(BCHILD);
+		t += rdtsc() - t0;
+	}
+	if (conflicts)
+		sys_mergeop(sharebuf, sizeof(sharebuf), MERGEOP_NONE);
+	return t;
+}
+
+static uint64_t
+b_merge_disjoint(int param, int iters)
+{
+	return b_merge(param, iters, 0);
+}
+
+static uint64_t
+b_merge_conflict(int param, int iters)
+{
+	return b_merge(param, iters, 1);
+}
+
+// Copy-on-write faults: write to each of iters pages
+// we share with the child after a SYS_COPY from it.
+static uint64_t
+b_cowfault(int param, int iters)
+{
+	size_t size = iters * PAGESIZE, i;
+	bench_source(size);
+	sys_get(SYS_COPY, BCHILD, NULL, SRCVA, DSTVA, size);
+
+	uint64_t t0 = rdtsc();
+	for (i = 0; i < size; i += PAGESIZE)
+		DSTVA[i] = 2;
+	uint64_t t = rdtsc() - t0;
+	bench_clean();
+	return t;
+}
+
+// Zero-fill faults: write to each of iters fresh pages.
+static uint64_t
+b_zerofault(int param, int iters)
+{
+	size_t size = iters * PAGESIZE, i;
+	bench_zero(DSTVA, size);
+
+	uint64_t t0 = rdtsc();
+	for (i = 0; i < size; i += PAGESIZE)
+		DSTVA[i] = 2;
+	uint64_t t = rdtsc() - t0;
+	bench_clean();
+	return t;
+}
+
+// SYS_COPY of param bytes from the child into our address space.
+static uint64_t
+b_copy(int param, int iters)
+{
+	bench_source(param);
+
+	uint64_t t0 = rdtsc();
+	while (iters-- > 0)
+		sys_get(SYS_COPY, BCHILD, NULL, SRCVA, DSTVA, param);
+	uint64_t t = rdtsc() - t0;
+	bench_clean();
+	return t;
+}
+
+// spawn() a small program and waitpid() for it,
+// with its output going to a file rather than the console.
+static uint64_t
+b_exec(int param, int iters)
+{
+	int fd = open("benchout", O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	assert(fd >= 0);
+	int fds[3] = { -1, fd, fd };
+	char *argv[] = { "echo", "bench", NULL };
+
+	uint64_t t0 = rdtsc();
+	while (iters-- > 0) {
+		pid_t pid = spawn("echo", argv, fds);
+		assert(pid > 0);
+		waitpid(pid, NULL, 0);
+	}
+	uint64_t t = rdtsc() - t0;
+	close(fd);
+	return t;
+}
+
+// dir_walk() a path param directories deep, creating them the first time.
+static uint64_t
+b_dirwalk(int param, int iters)
+{
+	char path[100] = "benchdir";
+	int i;
+	for (i = 1; i < param; i++) {
+		if (dir_walk(path, 0) < 0)
+			assert(dir_walk(path, S_IFDIR) >= 0);
+		strcpy(path + strlen(path), "/d");
+	}
+	if (dir_walk(path, 0) < 0)
+		assert(dir_walk(path, S_IFDIR) >= 0);
+
+	uint64_t t0 = rdtsc();
+	while (iters-- > 0)
+		dir_walk(path, 0);
+	return rdtsc() - t0;
+}
+
+// File I/O in chunks of param bytes: write() iters of them to a new file,
+// or read() them back from one.
+static char filebuf[65536];
+
+static uint64_t
+b_fileio(int param, int iters, bool reading)
+{
+	int fd = open("benchfile", O_RDWR | O_CREAT | O_TRUNC, 0666);
+	assert(fd >= 0);
+	int i;
+	if (reading) {
+		for (i = 0; i < iters; i++)
+			assert(write(fd, filebuf, param) == param);
+		lseek(fd, 0, SEEK_SET);
+	}
+
+	uint64_t t0 = rdtsc();
+	for (i = 0; i < iters; i++)
+		assert((reading ? read(fd, filebuf, param)
+				: write(fd, filebuf, param)) == param);
+	uint64_t t = rdtsc() - t0;
+	close(fd);
+	return t;
+}
+
+static uint64_t
+b_write(int param, int iters)
+{
+	return b_fileio(param, iters, 0);
+}
+
+static uint64_t
+b_read(int param, int iters)
+{
+	return b_fileio(param, iters, 1);
+}
+
+
+int
+main(int argc, char **argv)
+{
+	if (argc > 1)
+		only = argv[1];
+
+	printf("# bench <name> <param> <iters> <min> <median>: "
+		"TSC cycles per operation, best and median of %d trials\n",
+		BENCH_TRIALS);
+	printf("# %d CPUs\n", sys_ncpu());
+
+	bench("syscall", b_syscall, 0, 10000);
+	bench("putget", b_putget, 0, 1000);
+	bench("fork", b_fork, 0, 20);
+	int pages[] = { 0, 1, 16, MAXPAGES }, i;
+	for (i = 0; i < 4; i++)
+		bench("tfork", b_tfork, pages[i], 50);
+	for (i = 1; i < 4; i++) {
+		bench("merge_disjoint", b_merge_disjoint, pages[i], 50);
+		bench("merge_conflict", b_merge_conflict, pages[i], 50);
+	}
+	bench("cowfault", b_cowfault, 0, 256);
+	bench("zerofault", b_zerofault, 0, 256);
+	int sizes[] = { PAGESIZE, 16*PAGESIZE, 256*PAGESIZE, MAXSIZE };
+	for (i = 0; i < 4; i++)
+		bench("copy", b_copy, sizes[i], 100);
+	bench("exec", b_exec, 0, 10);
+	int depths[] = { 1, 4, 16 };
+	for (i = 0; i < 3; i++)
+		bench("dirwalk", b_dirwalk, depths[i], 1000);
+	int chunks[] = { 512, 4096, 65536 };
+	for (i = 0; i < 3; i++) {
+		bench("write", b_write, chunks[i], (1 << 20) / chunks[i]);
+		bench("read", b_read, chunks[i], (1 << 20) / chunks[i]);
+	}
+
+	printf("# done\n");
+	return 0;
+}
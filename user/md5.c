@@ -30,6 +30,7 @@
 #define S44 21
 
 static void MD5Transform(uint32_t[4], unsigned char[64]);
+static void MD5Transform4(uint32_t[4][MD5_LANES], uint32_t[16][MD5_LANES]);
 static void Encode(unsigned char *, uint32_t *, unsigned int);
 static void Decode(uint32_t *, unsigned char *, unsigned int);
 
@@ -77,6 +78,16 @@ static unsigned char PADDING[64] = {
  (a) += (b); \
   }
 
+/*
+ * LANES4 does one of the above transformations in each of four lanes.
+ */
+#define LANES4(op, a, b, c, d, x, s, ac) { \
+ op((a)[0], (b)[0], (c)[0], (d)[0], (x)[0], s, ac); \
+ op((a)[1], (b)[1], (c)[1], (d)[1], (x)[1], s, ac); \
+ op((a)[2], (b)[2], (c)[2], (d)[2], (x)[2], s, ac); \
+ op((a)[3], (b)[3], (c)[3], (d)[3], (x)[3], s, ac); \
+ }
+
 /*
  * MD5 initialization. Begins an MD5 operation, writing a new context.
  */
@@ -168,6 +179,56 @@ MD5Final(digest, context)
 	memset(context, 0, sizeof(*context));
 }
 
+/*
+ * MD5 batch operation: computes the digests of n messages,
+ * all len bytes long. Messages short enough to fit in one padded block
+ * are hashed MD5_LANES at a time with MD5Transform4;
+ * any others, and the last few that don't fill all the lanes,
+ * go through MD5Init, MD5Update and MD5Final one at a time.
+ */
+void 
+MD5Batch(digest, input, len, n)
+	unsigned char   digest[][16];	/* message digests */
+	unsigned char  *input[];	/* messages */
+	unsigned int    len;	/* length of each message */
+	unsigned int    n;	/* number of messages */
+{
+	unsigned int    i = 0, k, lane;
+
+	if (len < 56)
+		for (; i + MD5_LANES <= n; i += MD5_LANES) {
+			uint32_t           state[4][MD5_LANES], x[16][MD5_LANES],
+			                w[16], bits[2] = {len << 3, 0};
+			unsigned char   block[64];
+
+			for (lane = 0; lane < MD5_LANES; lane++) {
+				memcpy(block, input[i + lane], len);
+				memcpy(block + len, PADDING, 56 - len);
+				Encode(block + 56, bits, 8);
+				Decode(w, block, 64);
+				for (k = 0; k < 16; k++)
+					x[k][lane] = w[k];
+				state[0][lane] = 0x67452301;
+				state[1][lane] = 0xefcdab89;
+				state[2][lane] = 0x98badcfe;
+				state[3][lane] = 0x10325476;
+			}
+			MD5Transform4(state, x);
+			for (lane = 0; lane < MD5_LANES; lane++) {
+				for (k = 0; k < 4; k++)
+					w[k] = state[k][lane];
+				Encode(digest[i + lane], w, 16);
+			}
+		}
+
+	for (; i < n; i++) {
+		MD5_CTX         ctx;
+		MD5Init(&ctx);
+		MD5Update(&ctx, input[i], len);
+		MD5Final(digest[i], &ctx);
+	}
+}
+
 /*
  * MD5 basic transformation. Transforms state based on block.
  */
@@ -264,6 +325,108 @@ MD5Transform(state, block)
 	memset(x, 0, sizeof(x));
 }
 
+/*
+ * MD5 basic transformation of MD5_LANES independent blocks at once,
+ * one per lane. Each step is done for all the lanes before the next,
+ * so a superscalar processor can overlap the four dependency chains.
+ * State and block words are indexed [word][lane].
+ */
+static void 
+MD5Transform4(state, x)
+	uint32_t           state[4][MD5_LANES];
+	uint32_t           x[16][MD5_LANES];
+{
+	uint32_t           a[MD5_LANES], b[MD5_LANES], c[MD5_LANES],
+	                d[MD5_LANES];
+	unsigned int    lane;
+
+	for (lane = 0; lane < MD5_LANES; lane++) {
+		a[lane] = state[0][lane];
+		b[lane] = state[1][lane];
+		c[lane] = state[2][lane];
+		d[lane] = state[3][lane];
+	}
+
+	/* Round 1 */
+	LANES4(FF, a, b, c, d, x[0], S11, 0xd76aa478);	/* 1 */
+	LANES4(FF, d, a, b, c, x[1], S12, 0xe8c7b756);	/* 2 */
+	LANES4(FF, c, d, a, b, x[2], S13, 0x242070db);	/* 3 */
+	LANES4(FF, b, c, d, a, x[3], S14, 0xc1bdceee);	/* 4 */
+	LANES4(FF, a, b, c, d, x[4], S11, 0xf57c0faf);	/* 5 */
+	LANES4(FF, d, a, b, c, x[5], S12, 0x4787c62a);	/* 6 */
+	LANES4(FF, c, d, a, b, x[6], S13, 0xa8304613);	/* 7 */
+	LANES4(FF, b, c, d, a, x[7], S14, 0xfd469501);	/* 8 */
+	LANES4(FF, a, b, c, d, x[8], S11, 0x698098d8);	/* 9 */
+	LANES4(FF, d, a, b, c, x[9], S12, 0x8b44f7af);	/* 10 */
+	LANES4(FF, c, d, a, b, x[10], S13, 0xffff5bb1);	/* 11 */
+	LANES4(FF, b, c, d, a, x[11], S14, 0x895cd7be);	/* 12 */
+	LANES4(FF, a, b, c, d, x[12], S11, 0x6b901122);	/* 13 */
+	LANES4(FF, d, a, b, c, x[13], S12, 0xfd987193);	/* 14 */
+	LANES4(FF, c, d, a, b, x[14], S13, 0xa679438e);	/* 15 */
+	LANES4(FF, b, c, d, a, x[15], S14, 0x49b40821);	/* 16 */
+
+	/* Round 2 */
+	LANES4(GG, a, b, c, d, x[1], S21, 0xf61e2562);	/* 17 */
+	LANES4(GG, d, a, b, c, x[6], S22, 0xc040b340);	/* 18 */
+	LANES4(GG, c, d, a, b, x[11], S23, 0x265e5a51);	/* 19 */
+	LANES4(GG, b, c, d, a, x[0], S24, 0xe9b6c7aa);	/* 20 */
+	LANES4(GG, a, b, c, d, x[5], S21, 0xd62f105d);	/* 21 */
+	LANES4(GG, d, a, b, c, x[10], S22, 0x2441453);	/* 22 */
+	LANES4(GG, c, d, a, b, x[15], S23, 0xd8a1e681);	/* 23 */
+	LANES4(GG, b, c, d, a, x[4], S24, 0xe7d3fbc8);	/* 24 */
+	LANES4(GG, a, b, c, d, x[9], S21, 0x21e1cde6);	/* 25 */
+	LANES4(GG, d, a, b, c, x[14], S22, 0xc33707d6);	/* 26 */
+	LANES4(GG, c, d, a, b, x[3], S23, 0xf4d50d87);	/* 27 */
+	LANES4(GG, b, c, d, a, x[8], S24, 0x455a14ed);	/* 28 */
+	LANES4(GG, a, b, c, d, x[13], S21, 0xa9e3e905);	/* 29 */
+	LANES4(GG, d, a, b, c, x[2], S22, 0xfcefa3f8);	/* 30 */
+	LANES4(GG, c, d, a, b, x[7], S23, 0x676f02d9);	/* 31 */
+	LANES4(GG, b, c, d, a, x[12], S24, 0x8d2a4c8a);	/* 32 */
+
+	/* Round 3 */
+	LANES4(HH, a, b, c, d, x[5], S31, 0xfffa3942);	/* 33 */
+	LANES4(HH, d, a, b, c, x[8], S32, 0x8771f681);	/* 34 */
+	LANES4(HH, c, d, a, b, x[11], S33, 0x6d9d6122);	/* 35 */
+	LANES4(HH, b, c, d, a, x[14], S34, 0xfde5380c);	/* 36 */
+	LANES4(HH, a, b, c, d, x[1], S31, 0xa4beea44);	/* 37 */
+	LANES4(HH, d, a, b, c, x[4], S32, 0x4bdecfa9);	/* 38 */
+	LANES4(HH, c, d, a, b, x[7], S33, 0xf6bb4b60);	/* 39 */
+	LANES4(HH, b, c, d, a, x[10], S34, 0xbebfbc70);	/* 40 */
+	LANES4(HH, a, b, c, d, x[13], S31, 0x289b7ec6);	/* 41 */
+	LANES4(HH, d, a, b, c, x[0], S32, 0xeaa127fa);	/* 42 */
+	LANES4(HH, c, d, a, b, x[3], S33, 0xd4ef3085);	/* 43 */
+	LANES4(HH, b, c, d, a, x[6], S34, 0x4881d05);	/* 44 */
+	LANES4(HH, a, b, c, d, x[9], S31, 0xd9d4d039);	/* 45 */
+	LANES4(HH, d, a, b, c, x[12], S32, 0xe6db99e5);	/* 46 */
+	LANES4(HH, c, d, a, b, x[15], S33, 0x1fa27cf8);	/* 47 */
+	LANES4(HH, b, c, d, a, x[2], S34, 0xc4ac5665);	/* 48 */
+
+	/* Round 4 */
+	LANES4(II, a, b, c, d, x[0], S41, 0xf4292244);	/* 49 */
+	LANES4(II, d, a, b, c, x[7], S42, 0x432aff97);	/* 50 */
+	LANES4(II, c, d, a, b, x[14], S43, 0xab9423a7);	/* 51 */
+	LANES4(II, b, c, d, a, x[5], S44, 0xfc93a039);	/* 52 */
+	LANES4(II, a, b, c, d, x[12], S41, 0x655b59c3);	/* 53 */
+	LANES4(II, d, a, b, c, x[3], S42, 0x8f0ccc92);	/* 54 */
+	LANES4(II, c, d, a, b, x[10], S43, 0xffeff47d);	/* 55 */
+	LANES4(II, b, c, d, a, x[1], S44, 0x85845dd1);	/* 56 */
+	LANES4(II, a, b, c, d, x[8], S41, 0x6fa87e4f);	/* 57 */
+	LANES4(II, d, a, b, c, x[15], S42, 0xfe2ce6e0);	/* 58 */
+	LANES4(II, c, d, a, b, x[6], S43, 0xa3014314);	/* 59 */
+	LANES4(II, b, c, d, a, x[13], S44, 0x4e0811a1);	/* 60 */
+	LANES4(II, a, b, c, d, x[4], S41, 0xf7537e82);	/* 61 */
+	LANES4(II, d, a, b, c, x[11], S42, 0xbd3af235);	/* 62 */
+	LANES4(II, c, d, a, b, x[2], S43, 0x2ad7d2bb);	/* 63 */
+	LANES4(II, b, c, d, a, x[9], S44, 0xeb86d391);	/* 64 */
+
+	for (lane = 0; lane < MD5_LANES; lane++) {
+		state[0][lane] += a[lane];
+		state[1][lane] += b[lane];
+		state[2][lane] += c[lane];
+		state[3][lane] += d[lane];
+	}
+}
+
 /*
  * Encodes input (uint32_t) into output (unsigned char). Assumes len is a
  * multiple of 4.
@@ -17,3 +17,8 @@ void MD5Init(MD5_CTX *);
 void MD5Update(MD5_CTX *, unsigned char *, unsigned int);
 void MD5Final(unsigned char[16], MD5_CTX *);
 
+/* Messages of equal length hashed MD5_LANES at a time by MD5Batch. */
+#define MD5_LANES 4
+void MD5Batch(unsigned char[][16], unsigned char *[], unsigned int,
+	unsigned int);
+
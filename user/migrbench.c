@@ -0,0 +1,222 @@
+/*
+ * Cluster benchmark for cross-node process migration and page pulls.
+ * See testmigr.c for the corresponding correctness tests.
+ *
+ * Usage: migrbench [nodes]	- benchmark nodes 1..nodes (default 2)
+ *
+ * Each timing result is one line of the form
+ *
+ *	<name> <src> <dst> <param> <iters> <min> <median>
+ *
+ * giving the minimum and median, over BENCH_TRIALS trials of <iters>
+ * operations each, of TSC cycles per operation, as seen on node <src>:
+ *
+ *	rtt	migrate from src to dst and back again
+ *	oneway	half of rtt, since different nodes' TSCs aren't comparable
+ *	pull	a round trip to dst right after writing <param> pages
+ *		on src, less the same round trip with nothing new to pull,
+ *		per page: <param> 1 gives the latency of one pull,
+ *		larger ones the throughput as the address space grows
+ *	fanout	tfork() a thread onto each of nodes 2..<dst>, each touching
+ *		<param> pages, and tjoin() them all, from node 1
+ *
+ * After the timings for each node pair comes a line
+ *
+ *	retx <src> <dst> <txpkts> <retx> <lossdrop>
+ *
+ * with the packets both nodes sent, retransmit timeouts that fired,
+ * and packets dropped on purpose while timing that pair.
+ * Build the kernel with NET_LOSS (see conf/env.mk) to induce loss.
+ * Lines starting with '#' are comments.
+ *
+ * Copyright (C) 2010 Yale University.
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#include <inc/stdio.h>
+#include <inc/stdlib.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/unistd.h>
+#include <inc/syscall.h>
+#include <inc/x86.h>
+#include <inc/mmu.h>
+#include <inc/vm.h>
+#include <inc/bench.h>
+
+
+#define MAXNODES	8		// Most nodes we'll benchmark
+#define MAXPAGES	1024		// Largest address space we pull, 4MB
+#define FANPAGES	16		// Pages each fan-out thread touches
+
+static uint8_t pullbuf[MAXPAGES][PAGESIZE] gcc_aligned(PAGESIZE);
+
+// One benchmark: run iters operations between nodes src and dst
+// with parameter param, returning the TSC cycles the timed part took
+// on whichever node it timed them.
+typedef uint64_t (*benchfn)(int src, int dst, int param, int iters);
+
+
+// Move ourselves to node.
+static void
+migrate(int node)
+{
+	sys_get(0, node << 8, NULL, NULL, NULL, 0);
+}
+
+// Print a result line for sorted per-operation times t.
+// We print only at home, so every line reaches the same console.
+static void
+report(const char *name, int src, int dst, int param, int iters,
+	uint64_t t[BENCH_TRIALS])
+{
+	migrate(1);
+	printf("%s %d %d %d %d %llu %llu\n", name, src, dst, param, iters,
+		BENCH_MIN(t), BENCH_MEDIAN(t));
+	fflush(stdout);
+}
+
+// Run benchmark fn BENCH_TRIALS times, leaving the sorted
+// per-operation times in t, and print the result line.
+static void
+bench(const char *name, benchfn fn, int src, int dst, int param, int iters,
+	uint64_t t[BENCH_TRIALS])
+{
+	int i;
+	for (i = 0; i < BENCH_TRIALS; i++)
+		bench_insert(t, i, fn(src, dst, param, iters) / iters);
+	report(name, src, dst, param, iters, t);
+}
+
+
+// Round trips from src to dst and back, timed on src.
+static uint64_t
+b_rtt(int src, int dst, int param, int iters)
+{
+	migrate(src);
+	uint64_t t0 = rdtsc();
+	while (iters-- > 0) {
+		migrate(dst);
+		migrate(src);
+	}
+	return rdtsc() - t0;
+}
+
+// Write param pages on src, then time a round trip to dst,
+// which has to pull each one over as it arrives,
+// less a second round trip right after, which has nothing new to pull.
+// Migration pulls the whole address space before the process runs,
+// so it's the trip there that pays for the pulls, not touching the pages.
+static uint64_t
+b_pull(int src, int dst, int param, int iters)
+{
+	int i;
+	migrate(src);
+	for (i = 0; i < param; i++)
+		pullbuf[i][0]++;
+
+	uint64_t t0 = rdtsc();
+	migrate(dst);
+	migrate(src);
+	uint64_t t1 = rdtsc();
+	migrate(dst);
+	migrate(src);
+	uint64_t t2 = rdtsc();
+	return t1 - t0 > t2 - t1 ? (t1 - t0) - (t2 - t1) : 0;
+}
+
+// Fan threads out to nodes 2..dst and join them, timed on node 1.
+// Each pulls param pages and writes one word of each of them.
+static uint64_t
+b_fanout(int src, int dst, int param, int iters)
+{
+	int n, i;
+	migrate(1);
+	uint64_t t0 = rdtsc();
+	while (iters-- > 0) {
+		for (n = 2; n <= dst; n++)
+			if (!tfork((n << 8) | n)) {
+				for (i = 0; i < param; i++)
+					((uint32_t*)pullbuf[i])[n]++;
+				sys_ret();
+			}
+		for (n = 2; n <= dst; n++)
+			tjoin((n << 8) | n);
+	}
+	migrate(1);
+	return rdtsc() - t0;
+}
+
+
+// Sum the network statistics of nodes src and dst, from each in turn.
+static void
+netsnap(int src, int dst, uint32_t *txpkts, uint32_t *retx, uint32_t *loss)
+{
+	int nodes[2] = { src, dst }, i, j;
+	*txpkts = *retx = *loss = 0;
+	for (i = 0; i < 2; i++) {
+		netstats ns;
+		migrate(nodes[i]);
+		sys_netstat(&ns);
+		for (j = 0; j < NETSTAT_NTYPES; j++)
+			*txpkts += ns.txpkts[j];
+		*retx += ns.retx;
+		*loss += ns.lossdrop;
+	}
+}
+
+// All the timings for one node pair.
+static void
+pair(int src, int dst)
+{
+	uint32_t tx0, retx0, loss0, tx1, retx1, loss1;
+	uint64_t t[BENCH_TRIALS];
+	int i;
+
+	netsnap(src, dst, &tx0, &retx0, &loss0);
+
+	bench("rtt", b_rtt, src, dst, 0, 20, t);
+	for (i = 0; i < BENCH_TRIALS; i++)
+		t[i] /= 2;
+	report("oneway", src, dst, 0, 20, t);
+
+	int pages[] = { 1, 16, 256, MAXPAGES };
+	for (i = 0; i < 4; i++)
+		bench("pull", b_pull, src, dst, pages[i], pages[i], t);
+
+	netsnap(src, dst, &tx1, &retx1, &loss1);
+	migrate(1);
+	printf("retx %d %d %u %u %u\n", src, dst,
+		tx1 - tx0, retx1 - retx0, loss1 - loss0);
+	fflush(stdout);
+}
+
+int
+main(int argc, char **argv)
+{
+	int nodes = argc > 1 ? strtol(argv[1], NULL, 10) : 2;
+	if (nodes < 2 || nodes > MAXNODES) {
+		fprintf(stderr, "usage: migrbench [nodes], with 2-%d nodes\n",
+			MAXNODES);
+		exit(1);
+	}
+
+	migrate(1);
+	printf("# <name> <src> <dst> <param> <iters> <min> <median>: "
+		"TSC cycles per operation, best and median of %d trials\n",
+		BENCH_TRIALS);
+	printf("# retx <src> <dst> <txpkts> <retx> <lossdrop>\n");
+
+	int src, dst;
+	for (src = 1; src <= nodes; src++)
+		for (dst = 1; dst <= nodes; dst++)
+			if (src != dst)
+				pair(src, dst);
+
+	uint64_t t[BENCH_TRIALS];
+	for (dst = 2; dst <= nodes; dst++)
+		bench("fanout", b_fanout, 1, dst, FANPAGES, 5, t);
+
+	printf("# done\n");
+	return 0;
+}
@@ -30,6 +30,7 @@ int mkdir(const char *path, bool verb) {
       }
       // Indicate that this has changed
       files->fi[ino].ver++;
+      fileino_logchg(files, ino);
       if(verb)
         printf("%s\n", path);
     } else {
@@ -56,24 +56,32 @@ incstr(uint8_t *str, int lo, int hi)
 	return 1;			// carry out to hi position
 }
 
-// Search all strings of length 'len' for one that hashes to 'hash'.
+// Search all strings of length 'len' for one that hashes to 'hash',
+// gathering candidates into batches of MD5_LANES to hash at once.
 int
 search(uint8_t *str, int len, int lo, int hi, const unsigned char *hash)
 {
 	assert(lo < hi);
 	assert(hi <= len);
 
+	int done = 0;
 	do {
-		unsigned char h[16];
-		MD5_CTX ctx;
-		MD5Init(&ctx);
-		MD5Update(&ctx, str, len);
-		MD5Final(h, &ctx);
-		if (memcmp(h, hash, 16) == 0) {
-			strcpy(out, (char*)str);
-			return found = 1;
+		uint8_t cand[MD5_LANES][MAXLEN+1];
+		unsigned char *in[MD5_LANES];
+		unsigned char h[MD5_LANES][16];
+		int i, n;
+		for (n = 0; n < MD5_LANES && !done; n++) {
+			memcpy(cand[n], str, len+1);
+			in[n] = cand[n];
+			done = incstr(str, lo, hi);
 		}
-	} while (!incstr(str, lo, hi));
+		MD5Batch(h, in, len, n);
+		for (i = 0; i < n; i++)
+			if (memcmp(h[i], hash, 16) == 0) {
+				strcpy(out, (char*)cand[i]);
+				return found = 1;
+			}
+	} while (!done);
 	return 0;	// no match at this string length
 }
 
@@ -20,6 +20,7 @@
 #include <inc/stat.h>
 #include <inc/file.h>
 #include <inc/dirent.h>
+#include <inc/syscall.h>
 
 #define BUFSIZ 1024		/* Find the buffer overrun bug! */
 
@@ -104,6 +105,36 @@ again:
 			}
 			break;
 			
+		case '|':	// Pipe
+			// Run the left-hand command in one child
+			// and the rest of the pipeline in another,
+			// and pass the data between them as they run.
+			if (pipe(p) < 0) {
+				cprintf("pipe: %s\n", strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+			if ((r = fork()) < 0)
+				panic("fork: %e", r);
+			if (r == 0) {
+				dup2(p[1], 1);
+				close(p[0]);
+				close(p[1]);
+				goto runit;
+			}
+			if ((pipe_child = fork()) < 0)
+				panic("fork: %e", pipe_child);
+			if (pipe_child == 0) {
+				dup2(p[0], 0);
+				close(p[0]);
+				close(p[1]);
+				goto again;
+			}
+			close(p[1]);
+			while (wait(NULL) >= 0)
+				;
+			ftruncate(p[0], 0);	// give back the pipe's storage
+			exit(EXIT_SUCCESS);
+
 		case 0:		// String is complete
 			// Run the current command!
 			goto runit;
@@ -224,6 +255,32 @@ gettoken(char *s, char **p1)
 }
 
 
+// Print this node's network statistics counters (see SYS_NETSTAT).
+void
+netstat(void)
+{
+	netstats ns;
+	sys_netstat(&ns);
+
+	int i;
+	printf("%4s %10s %12s %10s %12s\n",
+		"type", "txpkts", "txbytes", "rxpkts", "rxbytes");
+	for (i = 0; i < NETSTAT_NTYPES; i++)
+		if (ns.txpkts[i] || ns.rxpkts[i])
+			printf("%4d %10u %12llu %10u %12llu\n", i,
+				ns.txpkts[i], ns.txbytes[i],
+				ns.rxpkts[i], ns.rxbytes[i]);
+	printf("rxbad %u retx %u dups %u migrout %u migrin %u"
+		" txfull %u rxerr %u lossdrop %u rxsteered %u\n",
+		ns.rxbad, ns.retx, ns.dups, ns.migrout, ns.migrin,
+		ns.txfull, ns.rxerr, ns.lossdrop, ns.rxsteered);
+	printf("pull latency (ticks):");
+	for (i = 0; i < NETSTAT_NHIST; i++)
+		printf(" %s%d:%u", i < NETSTAT_NHIST-1 ? "<" : ">=",
+			1 << (i < NETSTAT_NHIST-1 ? i : i-1), ns.pullhist[i]);
+	printf("\n");
+}
+
 void
 usage(void)
 {
@@ -231,6 +288,94 @@ usage(void)
 	exit(EXIT_FAILURE);
 }
 
+// Run a simple command line - just words and < or > redirections,
+// with no pipes - straight from the program file with spawn(),
+// rather than forking a copy of the whole shell to exec it.
+// Returns the child's pid, -1 if the program couldn't be started,
+// or 0 if the line needs the general runcmd() path instead.
+pid_t
+spawncmd(char *s)
+{
+	char line[strlen(s)+1], *argv[MAXARGS], *t, argv0buf[BUFSIZ];
+	int argc = 0, c, fds[3] = { 0, 1, 2 }, i, flags;
+	pid_t pid = 0;
+
+	for (t = s; *t; t++)
+		if (strchr(SYMBOLS, *t) && *t != '<' && *t != '>')
+			return 0;
+
+	strcpy(line, s);
+	gettoken(line, 0);
+	while ((c = gettoken(0, &t)) != 0) {
+		switch (c) {
+		case 'w':
+			if (argc == MAXARGS-1)
+				goto out;	// let runcmd() complain
+			argv[argc++] = t;
+			continue;
+		case '<':	// Input redirection, as in runcmd()
+			if (gettoken(0, &t) != 'w' || fds[0] != 0)
+				goto out;
+			if ((fds[0] = open(t, O_RDONLY)) < 0) {
+				cprintf("open %s for read: %s\n", t,
+					strerror(errno));
+				fds[0] = 0;
+				pid = -1;
+				goto out;
+			}
+			continue;
+		case '>':	// Output redirection, as in runcmd()
+			c = gettoken(0, &t);
+			flags = O_WRONLY | O_CREAT | O_TRUNC;
+			if (c == '>') {
+				flags = O_WRONLY | O_CREAT | O_APPEND;
+				c = gettoken(0, &t);
+			}
+			if (c != 'w' || fds[1] != 1)
+				goto out;
+			if ((fds[1] = open(t, flags)) < 0) {
+				cprintf("open %s for write: %s\n", t,
+					strerror(errno));
+				fds[1] = 1;
+				pid = -1;
+				goto out;
+			}
+			continue;
+		}
+		goto out;
+	}
+	if (argc == 0)
+		goto out;
+	argv[argc] = 0;
+
+	// Same implicit 'PATH=/' as in runcmd().
+	if (argv[0][0] != '/') {
+		argv0buf[0] = '/';
+		strcpy(argv0buf + 1, argv[0]);
+		argv[0] = argv0buf;
+	}
+	if (debug)
+		cprintf("spawn: %s\n", argv[0]);
+	if ((pid = spawn(argv[0], argv, fds)) < 0)
+		cprintf("exec %s: %s\n", argv[0], strerror(errno));
+
+out:
+	// The child has its own copies of the descriptors we opened for it.
+	for (i = 0; i < 2; i++)
+		if (fds[i] != i)
+			close(fds[i]);
+	return pid;
+}
+
+// Wait for a foreground command, which gets our console input meanwhile.
+void
+fgwait(pid_t pid)
+{
+	consreader(pid);
+	waitpid(pid, NULL, 0);
+	consreader(0);
+}
+
 int
 main(int argc, char **argv)
 {
@@ -359,9 +504,36 @@ main(int argc, char **argv)
 			}
 			continue;
 		}
+		if (!strcmp(token, "lockstat")) {	// kernel lock profile
+			char *arg;
+			gettoken(0, &arg);
+			sys_lockstat(arg ? strtol(arg, NULL, 10) : 10);
+			continue;
+		}
+		if (!strcmp(token, "prof")) {	// kernel sampling profiler
+			char *arg;
+			gettoken(0, &arg);
+			if (arg && !strcmp(arg, "start"))
+				sys_prof(PROF_START, 0);
+			else if (arg && !strcmp(arg, "stop"))
+				sys_prof(PROF_STOP, 0);
+			else
+				sys_prof(PROF_REPORT,
+					arg ? strtol(arg, NULL, 10) : 20);
+			continue;
+		}
+		if (!strcmp(token, "netstat")) {	// network statistics
+			netstat();
+			continue;
+		}
 		if (!strcmp(token, "clear")) {
 			clear = 1;
 		}
+		if ((r = spawncmd(buf)) != 0) {
+			if (r > 0)
+				fgwait(r);
+			continue;
+		}
 		if (debug)
 			cprintf("BEFORE FORK\n");
 		if ((r = fork()) < 0)
@@ -372,7 +544,7 @@ main(int argc, char **argv)
 			runcmd(buf);
 			exit(EXIT_SUCCESS);
 		} else
-			waitpid(r, NULL, 0);
+			fgwait(r);
 	}
 }
 
@@ -18,6 +18,10 @@
 #include <inc/file.h>
 #include <inc/stat.h>
 #include <inc/elf.h>
+#include <inc/mmu.h>
+#include <inc/vm.h>
+#include <inc/parallel.h>
+#include <inc/arena.h>
 
 
 int initfilecheck_count;
@@ -36,7 +40,8 @@ initfilecheck()
 			files->fi[ino].size);
 
 		// Make sure general properties are as we expect
-		assert(files->fi[ino].ver == 0);
+		// (the kernel may have rewritten the statistics file already)
+		assert(files->fi[ino].ver == 0 || ino == FILEINO_STATS);
 		if (ino >= FILEINO_GENERAL) {
 			// initfiles are all in the root directory
 			assert(files->fi[ino].dino == FILEINO_ROOTDIR);
@@ -281,6 +286,11 @@ readdircheck()
 			assert(st.st_mode == S_IFDIR);
 			continue;
 		}
+		if (strcmp(de->d_name, "stats") == 0) {
+			assert(st.st_ino == FILEINO_STATS);
+			assert(st.st_mode == S_IFREG);
+			continue;
+		}
 
 		// everything else should be a regular file
 		assert(st.st_ino >= FILEINO_GENERAL);
@@ -304,6 +314,42 @@ readdircheck()
 	cprintf("readdircheck passed\n");
 }
 
+void
+dirindexcheck()
+{
+	// Build a deep path, one component at a time
+	static const char *const dirs[] = {
+		"/os", "/os/is", "/os/is/awesome", "/os/is/awesome/yay" };
+	int i, ino, dino = FILEINO_ROOTDIR;
+	for (i = 0; i < 4; i++) {
+		ino = dir_walk(dirs[i], S_IFDIR); assert(ino > 0);
+		assert(files->fi[ino].dino == dino);
+		assert(dir_walk(dirs[i], 0) == ino);
+		dino = ino;
+	}
+	assert(dir_walk("os//is/./awesome/../awesome/yay/", 0) == dino);
+	assert(dir_walk("/os/is/awful", 0) < 0 && errno == ENOENT);
+	assert(dir_walk("/os/isn", 0) < 0 && errno == ENOENT);
+	assert(dir_walk("/sh/x", 0) < 0 && errno == ENOTDIR);
+
+	// The index should find every allocated inode under its own name,
+	// both as maintained so far and when rebuilt from scratch.
+	int pass;
+	for (pass = 0; pass < 2; pass++) {
+		for (ino = 1; ino < FILE_INODES; ino++) {
+			fileinode *fi = &files->fi[ino];
+			if (fi->de.d_name[0] == 0)
+				continue;
+			assert(fileino_lookup(files, fi->dino, fi->de.d_name,
+					strlen(fi->de.d_name)) == ino);
+		}
+		fileino_reindex(files);
+	}
+	assert(fileino_lookup(files, FILEINO_ROOTDIR, "osx", 2) == dir_walk("/os", 0));
+
+	cprintf("dirindexcheck passed\n");
+}
+
 void
 consoutcheck()
 {
@@ -342,7 +388,7 @@ consincheck()
 }
 
 pid_t
-spawn(const char *arg0, ...)
+forkexec(const char *arg0, ...)
 {
 	pid_t pid = fork();
 	if (pid == 0) {		// We're the child.
@@ -364,10 +410,127 @@ waitcheckstatus(pid_t pid, int statexpect)
 }
 #define waitcheck(pid) waitcheckstatus(pid, 0)
 
+// Check that /stats reads like a list of named counters.
+static void
+statsread(void)
+{
+	static char buf[4096];
+	int fd = open("/stats", O_RDONLY); assert(fd >= 0);
+	ssize_t n = read(fd, buf, sizeof(buf)-1); assert(n > 0);
+	close(fd);
+	buf[n] = 0;
+
+	char *line;
+	int nmem = 0;
+	assert(strncmp(buf, "uptime_ms ", 10) == 0);
+	for (line = buf; line != NULL && *line; line = strchr(line, '\n')) {
+		if (*line == '\n')
+			line++;
+		if (strncmp(line, "mem_pages ", 10) == 0
+				|| strncmp(line, "mem_free ", 9) == 0)
+			nmem++;
+	}
+	assert(nmem == 2);
+}
+
+void
+statscheck()
+{
+	// The kernel filled in the statistics file when we did I/O above.
+	struct stat st;
+	assert(stat("/stats", &st) == 0);
+	assert(st.st_ino == FILEINO_STATS);
+	assert(st.st_size > 0);
+	statsread();
+
+	// A child sees the same file through reconcile.
+	pid_t pid = fork();
+	if (pid == 0) {
+		statsread();
+		exit(0);
+	}
+	waitcheck(pid);
+
+	cprintf("statscheck passed\n");
+}
+
+// A child registered as our console reader gets new input
+// through waitpid()'s shortcut (see reconcile_consin() in lib/fork.c).
+void
+consreadercheck()
+{
+	// Skip anything typed ahead, so the child reads just our input.
+	fileinode *fi = &files->fi[FILEINO_CONSIN];
+	files->fd[0].ofs = fi->size;
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		char buf[4];
+		assert(read(0, buf, 3) == 3);	// waits for our input
+		buf[3] = 0;
+		assert(strcmp(buf, "abc") == 0);
+		exit(0);
+	}
+
+	// Pretend "abc" came in from the console after the fork.
+	memcpy(FILEDATA(FILEINO_CONSIN) + fi->size, "abc", 3);
+	fi->size += 3;
+	assert(consreader(pid) == 0);
+	waitcheck(pid);
+	assert(consreader(0) == 0);	// forgotten when the child went away
+
+	// Keep the shell from reading it again later.
+	files->fd[0].ofs = fi->size;
+
+	cprintf("consreadercheck passed\n");
+}
+
 void
 execcheck()
 {
-	waitcheck(spawn("echo", "-c", "called", "by", "execcheck", NULL));
+	waitcheck(forkexec("echo", "-c", "called", "by", "execcheck", NULL));
+
+	// spawn() starts the program directly, with redirected descriptors.
+	int fd = open("spawnout", O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	assert(fd >= 0);
+	char *const echoargs[] = { "echo", "spawned", NULL };
+	int fds[3] = { 0, fd, 2 };
+	waitcheck(spawn("echo", echoargs, fds));
+	close(fd);
+	char buf[16];
+	fd = open("spawnout", O_RDONLY); assert(fd >= 0);
+	assert(read(fd, buf, sizeof(buf)) == 8);
+	assert(memcmp(buf, "spawned\n", 8) == 0);
+	close(fd);
+	assert(spawn("nosuchprogram", echoargs, NULL) < 0);
+
+	// The image laid out for echo is kept, and works a second time.
+	int ino = dir_walk("echo", 0), i;
+	for (i = 0; i < EXEC_CACHE && files->image[i].ino != ino; i++)
+		;
+	assert(i < EXEC_CACHE && files->image[i].ver == files->fi[ino].ver);
+	waitcheck(spawn("echo", echoargs, NULL));
+
+	// spawn() keeps its children's file state ready between spawns,
+	// and brings it up to date with files changed in between.
+	assert(files->zygote != 0);
+	char *const catargs[] = { "cat", "zygfile", NULL };
+	const char *vers[2] = { "first\n", "second\n" };
+	for (i = 0; i < 2; i++) {
+		fd = open("zygfile", O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		assert(fd >= 0);
+		assert(write(fd, vers[i], strlen(vers[i])) == strlen(vers[i]));
+		close(fd);
+		fd = open("spawnout", O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		assert(fd >= 0);
+		fds[1] = fd;
+		waitcheck(spawn("cat", catargs, fds));
+		close(fd);
+		fd = open("spawnout", O_RDONLY); assert(fd >= 0);
+		assert(read(fd, buf, sizeof(buf)) == strlen(vers[i]));
+		assert(memcmp(buf, vers[i], strlen(vers[i])) == 0);
+		close(fd);
+	}
 
 	cprintf("execcheck done\n");
 }
@@ -391,29 +554,55 @@ reconcilecheck()
 	// First fork off a child process that just writes one file,
 	// and make sure it appears when we subsequently 'cat' it.
 	waitcheck(forkwrite("reconcilefile0"));
-	waitcheck(spawn("cat", "reconcilefile0", NULL));
+	waitcheck(forkexec("cat", "reconcilefile0", NULL));
 
 	// Now try two concurrent, non-conflicting writes.
 	pid_t p1 = forkwrite("reconcilefile1");
 	pid_t p2 = forkwrite("reconcilefile2");
 	waitcheck(p1);
 	waitcheck(p2);
-	waitcheck(spawn("cat", "reconcilefile1", NULL));
-	waitcheck(spawn("cat", "reconcilefile2", NULL));
+	waitcheck(forkexec("cat", "reconcilefile1", NULL));
+	waitcheck(forkexec("cat", "reconcilefile2", NULL));
 
 	// Now try two concurrent, conflicting writes.
 	p1 = forkwrite("reconcilefileC");
 	p2 = forkwrite("reconcilefileC");
 	waitcheck(p1);
 	waitcheck(p2);
-	waitcheckstatus(spawn("cat", "reconcilefileC", NULL), 1); // fails!
-	waitcheck(spawn("ls", "-l", NULL));
+	waitcheckstatus(forkexec("cat", "reconcilefileC", NULL), 1); // fails!
+	waitcheck(forkexec("ls", "-l", NULL));
+
+	// A file we change again right after forking, with nothing else
+	// logged in between, still reaches the child: it waits on a pipe
+	// we write only once the file's second version is in.
+	int p[2];
+	assert(pipe(p) == 0);
+	int fd = open("reconcilefileR", O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	assert(fd >= 0 && write(fd, "one", 3) == 3);
+	close(fd);
+	pid_t rpid = fork();
+	if (rpid == 0) {
+		char buf[3];
+		close(p[1]);
+		assert(read(p[0], buf, 2) == 2);
+		fd = open("reconcilefileR", O_RDONLY);
+		assert(fd >= 0 && read(fd, buf, 3) == 3);
+		assert(memcmp(buf, "two", 3) == 0);
+		exit(0);
+	}
+	fd = open("reconcilefileR", O_WRONLY);
+	assert(fd >= 0 && write(fd, "two", 3) == 3);
+	close(fd);
+	assert(write(p[1], "go", 2) == 2);
+	close(p[0]);
+	close(p[1]);
+	waitcheck(rpid);
 
 	cprintf("reconcilecheck: basic file reconciliation successful\n");
 
 	// Reconcile append-only console output
 	printf("reconcilecheck: running echo\n");
-	pid_t pid = spawn("echo", "called", "by", "reconcilecheck", NULL);
+	pid_t pid = forkexec("echo", "called", "by", "reconcilecheck", NULL);
 	printf("reconcilecheck: echo running\n");
 	waitcheck(pid);
 	printf("reconcilecheck: echo finished\n");
@@ -422,6 +611,590 @@ reconcilecheck()
 	cprintf("reconcilecheck done\n");
 }
 
+void
+bigfilecheck()
+{
+	static char buf[4096];
+	const int nblk = (FILE_WINSIZE + FILE_WINSIZE/4) / sizeof(buf);
+	int i, rc;
+	ssize_t act;
+
+	// Write a file one and a quarter data windows long, a block at a time
+	int fd = open("bigfile", O_RDWR | O_CREAT | O_TRUNC, 0666);
+	assert(fd > 0);
+	for (i = 0; i < nblk; i++) {
+		memset(buf, i, sizeof(buf));
+		act = write(fd, buf, sizeof(buf)); assert(act == sizeof(buf));
+	}
+	struct stat st;
+	rc = fstat(fd, &st); assert(rc >= 0);
+	assert(st.st_size == nblk * sizeof(buf));
+	int ino = files->fd[fd].ino;
+	assert(fileino_window(files, ino, 1) != NULL);
+
+	// Read back a block straddling the window boundary
+	off_t ofs = FILE_WINSIZE - sizeof(buf)/2;
+	rc = lseek(fd, ofs, SEEK_SET); assert(rc == ofs);
+	act = read(fd, buf, sizeof(buf)); assert(act == sizeof(buf));
+	for (i = 0; i < sizeof(buf); i++)
+		assert(buf[i] == (char)((ofs + i) / sizeof(buf)));
+
+	// A child's write past the boundary should reconcile back to us
+	pid_t pid = fork();
+	if (pid == 0) {
+		memset(buf, 0xab, sizeof(buf));
+		lseek(fd, 0, SEEK_END);
+		act = write(fd, buf, sizeof(buf)); assert(act == sizeof(buf));
+		exit(0);
+	}
+	assert(pid > 0);
+	waitcheck(pid);
+	rc = fstat(fd, &st); assert(rc >= 0);
+	assert(st.st_size == (nblk+1) * sizeof(buf));
+	rc = lseek(fd, -sizeof(buf), SEEK_END); assert(rc == nblk * sizeof(buf));
+	act = read(fd, buf, sizeof(buf)); assert(act == sizeof(buf));
+	for (i = 0; i < sizeof(buf); i++)
+		assert(buf[i] == (char)0xab);
+
+	// Shrinking back into one window should give the other one back
+	int w = files->fi[ino].win[1];
+	rc = ftruncate(fd, 1000); assert(rc == 0);
+	assert(fileino_window(files, ino, 1) == NULL);
+	assert(files->winuse[w] == FILEWIN_FREE);
+	close(fd);
+
+	cprintf("bigfilecheck passed\n");
+}
+
+void
+manyfilecheck()
+{
+	static char buf[FILE_SLOTSIZE/2];
+	char name[32];
+	const int nfiles = 600;		// more than there are data windows
+	int i, rc, fd;
+	ssize_t act;
+
+	// Create lots of small files, which should share windows
+	int dino = dir_walk("/many", S_IFDIR); assert(dino > 0);
+	for (i = 0; i < nfiles; i++) {
+		snprintf(name, sizeof(name), "/many/f%d", i);
+		fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666); assert(fd > 0);
+		act = write(fd, name, strlen(name)+1); assert(act == strlen(name)+1);
+		assert(files->fi[files->fd[fd].ino].slot != 0);
+		close(fd);
+	}
+
+	// A child adds one more and changes the first; both reconcile back.
+	pid_t pid = fork();
+	if (pid == 0) {
+		fd = open("/many/new", O_WRONLY | O_CREAT, 0666); assert(fd > 0);
+		act = write(fd, "new", 4); assert(act == 4);
+		close(fd);
+		fd = open("/many/f0", O_WRONLY | O_TRUNC); assert(fd > 0);
+		act = write(fd, "changed", 8); assert(act == 8);
+		close(fd);
+		exit(0);
+	}
+	assert(pid > 0);
+	waitcheck(pid);
+	for (i = 1; i < nfiles; i++) {
+		snprintf(name, sizeof(name), "/many/f%d", i);
+		fd = open(name, O_RDONLY); assert(fd > 0);
+		act = read(fd, buf, sizeof(buf)); assert(act == strlen(name)+1);
+		assert(strcmp(buf, name) == 0);
+		close(fd);
+	}
+	fd = open("/many/new", O_RDONLY); assert(fd > 0);
+	act = read(fd, buf, sizeof(buf)); assert(act == 4);
+	assert(strcmp(buf, "new") == 0);
+	close(fd);
+
+	// Outgrowing its slot should move a file into a window of its own,
+	// taking its content along.
+	fd = open("/many/f0", O_RDWR | O_APPEND); assert(fd > 0);
+	int ino = files->fd[fd].ino;
+	assert(files->fi[ino].size == 8 && files->fi[ino].slot != 0);
+	memset(buf, 'x', sizeof(buf));
+	for (i = 0; i < 3; i++) {
+		act = write(fd, buf, sizeof(buf)); assert(act == sizeof(buf));
+	}
+	assert(files->fi[ino].slot == 0);
+	assert(files->winuse[files->fi[ino].win[0]] == ino);
+	rc = lseek(fd, 0, SEEK_SET); assert(rc == 0);
+	act = read(fd, buf, 8); assert(act == 8);
+	assert(strcmp(buf, "changed") == 0);
+
+	// Truncating it to nothing should give back all its storage
+	rc = ftruncate(fd, 0); assert(rc == 0);
+	assert(fileino_window(files, ino, 0) == NULL);
+	close(fd);
+
+	cprintf("manyfilecheck passed\n");
+}
+
+void
+mmapcheck()
+{
+	static char buf[16];
+	struct stat st;
+	int rc;
+	ssize_t act;
+
+	int fd = open("mapfile", O_RDWR | O_CREAT | O_TRUNC, 0666);
+	assert(fd > 0);
+	act = write(fd, "hello", 5); assert(act == 5);
+	int ino = files->fd[fd].ino;
+
+	// A shared mapping is the file's own content, moved out of its slot,
+	// and writing past the end through it should grow the file.
+	char *p = mmap(NULL, 2*PAGESIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+			fd, 0);
+	assert(p != MAP_FAILED);
+	assert(files->fi[ino].slot == 0);
+	assert(p == fileino_window(files, ino, 0));
+	assert(memcmp(p, "hello", 5) == 0);
+	p[0] = 'j';
+	strcpy(p + PAGESIZE, "tail");
+	rc = munmap(p, 2*PAGESIZE); assert(rc == 0);
+	rc = fstat(fd, &st); assert(rc >= 0);
+	assert(st.st_size == PAGESIZE + 4);	// up to the last nonzero byte
+	rc = lseek(fd, 0, SEEK_SET); assert(rc == 0);
+	act = read(fd, buf, 5); assert(act == 5);
+	assert(memcmp(buf, "jello", 5) == 0);
+
+	// A child's writes through a mapping should reconcile back to us
+	pid_t pid = fork();
+	if (pid == 0) {
+		p = mmap(NULL, PAGESIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		assert(p != MAP_FAILED);
+		memcpy(p, "child", 5);
+		rc = munmap(p, PAGESIZE); assert(rc == 0);
+		exit(0);
+	}
+	assert(pid > 0);
+	waitcheck(pid);
+	rc = lseek(fd, 0, SEEK_SET); assert(rc == 0);
+	act = read(fd, buf, 5); assert(act == 5);
+	assert(memcmp(buf, "child", 5) == 0);
+
+	// A private mapping is a copy-on-write copy, elsewhere
+	p = mmap(NULL, PAGESIZE + 5, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	assert(p != MAP_FAILED);
+	assert(p >= (char*)VM_MMAPLO && p < (char*)VM_MMAPHI);
+	assert(memcmp(p, "child", 5) == 0);
+	assert(strcmp(p + PAGESIZE, "tail") == 0);
+	p[0] = 'X';
+	rc = munmap(p, PAGESIZE + 5); assert(rc == 0);
+	rc = lseek(fd, 0, SEEK_SET); assert(rc == 0);
+	act = read(fd, buf, 5); assert(act == 5);
+	assert(memcmp(buf, "child", 5) == 0);
+
+	// Bad requests
+	p = mmap(NULL, PAGESIZE, PROT_READ, MAP_SHARED, fd, 123);
+	assert(p == MAP_FAILED && errno == EINVAL);
+	p = mmap(NULL, 2*PAGESIZE, PROT_READ, MAP_SHARED, fd, FILE_WINSIZE-PAGESIZE);
+	assert(p == MAP_FAILED && errno == EINVAL);
+	rc = munmap((void*)VM_MMAPLO, PAGESIZE);
+	assert(rc < 0 && errno == EINVAL);
+	close(fd);
+
+	cprintf("mmapcheck passed\n");
+}
+
+void
+stdiobufcheck()
+{
+	static char mybuf[64];
+	struct stat st;
+	int i, rc;
+
+	// Fully buffered output shouldn't reach the file until flushed
+	FILE *f = fopen("buffile", "w"); assert(f != NULL);
+	int fn = f - files->fd;
+	rc = setvbuf(f, mybuf, _IOFBF, sizeof(mybuf)); assert(rc == 0);
+	for (i = 0; i < 10; i++)
+		assert(fputc('a' + i, f) == 'a' + i);
+	rc = fstat(fn, &st); assert(rc >= 0 && st.st_size == 0);
+	assert(ftell(f) == 10);
+	rc = fflushbuf(f); assert(rc == 0);
+	rc = fstat(fn, &st); assert(rc >= 0 && st.st_size == 10);
+
+	// Filling the buffer writes it out, keeping the bytes in order
+	for (i = 0; i < 100; i++)
+		fputc('0' + i % 10, f);
+	rc = fstat(fn, &st); assert(rc >= 0);
+	assert(st.st_size > 10 && st.st_size < 110);
+
+	// Line buffering writes out each complete line
+	rc = setvbuf(f, NULL, _IOLBF, 0); assert(rc == 0);
+	rc = fstat(fn, &st); assert(rc >= 0 && st.st_size == 110);
+	fprintf(f, "partial");
+	rc = fstat(fn, &st); assert(rc >= 0 && st.st_size == 110);
+	fprintf(f, " line\n");
+	rc = fstat(fn, &st); assert(rc >= 0 && st.st_size == 110 + 13);
+
+	// Unbuffered output goes straight through
+	rc = setvbuf(f, NULL, _IONBF, 0); assert(rc == 0);
+	fputc('!', f);
+	rc = fstat(fn, &st); assert(rc >= 0 && st.st_size == 110 + 14);
+
+	// Closing writes out what's left; read the whole thing back
+	rc = setvbuf(f, mybuf, _IOFBF, sizeof(mybuf)); assert(rc == 0);
+	fputc('?', f);
+	fclose(f);
+	f = fopen("buffile", "r"); assert(f != NULL);
+	static char buf[200];
+	size_t act = fread(buf, 1, sizeof(buf), f);
+	assert(act == 110 + 15);
+	assert(memcmp(buf, "abcdefghij0123456789", 20) == 0);
+	assert(memcmp(buf + 110, "partial line\n!?", 15) == 0);
+	fclose(f);
+
+	cprintf("stdiobufcheck passed\n");
+}
+
+// Check that the zeros in a file's holes read as zeros
+void
+sparsezerocheck(int fd, off_t ofs, size_t len)
+{
+	static char buf[PAGESIZE];
+	while (len > 0) {
+		size_t n = MIN(len, sizeof(buf));
+		int rc = lseek(fd, ofs, SEEK_SET); assert(rc == ofs);
+		ssize_t act = read(fd, buf, n); assert(act == n);
+		int i;
+		for (i = 0; i < n; i++)
+			assert(buf[i] == 0);
+		ofs += n;
+		len -= n;
+	}
+}
+
+void
+sparsecheck()
+{
+	static char buf[100];
+	ssize_t act;
+	struct stat st;
+	int rc, i;
+
+	int fd = open("sparsefile", O_RDWR | O_CREAT | O_TRUNC, 0666);
+	assert(fd >= 0);
+	memset(buf, 'x', sizeof(buf));
+	act = write(fd, buf, sizeof(buf)); assert(act == sizeof(buf));
+
+	// Shrinking and growing back gives zeros, not what was there before
+	rc = ftruncate(fd, 10); assert(rc == 0);
+	rc = ftruncate(fd, 100); assert(rc == 0);
+	rc = lseek(fd, 0, SEEK_SET); assert(rc == 0);
+	act = read(fd, buf, sizeof(buf)); assert(act == sizeof(buf));
+	for (i = 0; i < sizeof(buf); i++)
+		assert(buf[i] == (i < 10 ? 'x' : 0));
+
+	// Writing far past the end leaves a hole,
+	// which still reads as zeros after a child writes elsewhere
+	off_t far = FILE_WINSIZE + 3*PAGESIZE + 5;
+	rc = lseek(fd, far, SEEK_SET); assert(rc == far);
+	act = write(fd, "end", 3); assert(act == 3);
+	pid_t pid = fork();
+	if (pid == 0) {
+		lseek(fd, 2*PAGESIZE, SEEK_SET);
+		act = write(fd, "mid", 3); assert(act == 3);
+		exit(0);
+	}
+	waitcheck(pid);
+	rc = fstat(fd, &st); assert(rc >= 0 && st.st_size == far + 3);
+	sparsezerocheck(fd, 100, 2*PAGESIZE - 100);
+	rc = lseek(fd, 2*PAGESIZE, SEEK_SET); assert(rc == 2*PAGESIZE);
+	act = read(fd, buf, 3); assert(act == 3 && memcmp(buf, "mid", 3) == 0);
+	sparsezerocheck(fd, 2*PAGESIZE + 3, far - (2*PAGESIZE + 3));
+	act = read(fd, buf, 3); assert(act == 3 && memcmp(buf, "end", 3) == 0);
+
+	// Preallocating a big file with ftruncate() just makes one big hole
+	rc = ftruncate(fd, 2*FILE_WINSIZE); assert(rc == 0);
+	sparsezerocheck(fd, far + 3, PAGESIZE);
+	sparsezerocheck(fd, 2*FILE_WINSIZE - PAGESIZE, PAGESIZE);
+	close(fd);
+
+	cprintf("sparsecheck passed\n");
+}
+
+void
+pipecheck()
+{
+	int p[2], i, rc;
+	rc = pipe(p); assert(rc == 0);
+	assert(fileino_ispipe(files->fd[p[0]].ino));
+
+	// The reader starts first, and must wait for the writer's data,
+	// which is several times PIPE_BUF so it has to arrive in pieces.
+	pid_t rpid = fork();
+	if (rpid == 0) {
+		close(p[1]);
+		static char buf[PIPE_BUF];
+		int n, tot = 0;
+		while ((n = read(p[0], buf, sizeof(buf))) > 0)
+			for (i = 0; i < n; i++, tot++)
+				assert(buf[i] == 'a' + tot % 26);
+		assert(n == 0 && tot == PIPE_BUF * 4 + 10);
+		exit(0);
+	}
+	pid_t wpid = fork();
+	if (wpid == 0) {
+		close(p[0]);
+		char c;
+		for (i = 0; i < PIPE_BUF * 4 + 10; i++) {
+			c = 'a' + i % 26;
+			write(p[1], &c, 1);
+		}
+		exit(0);
+	}
+	close(p[0]);
+	close(p[1]);
+
+	// Wait for both, in whichever order they finish.
+	int status;
+	for (i = 0; i < 2; i++) {
+		pid_t pid = wait(&status);
+		assert(pid == rpid || pid == wpid);
+		assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	}
+	assert(wait(&status) < 0 && errno == ECHILD);
+
+	cprintf("pipecheck passed\n");
+}
+
+// Worker for poolcheck(): make sure we see every slice as of the last barrier,
+// then bump our own slice for this round.
+#define POOLWORKERS	4
+#define POOLSLICE	(PAGESIZE/sizeof(int))
+static tpool pool;
+static int poolvec[POOLWORKERS][POOLSLICE];
+static int poolround;
+
+static void
+poolwork(int worker, void *arg)
+{
+	int *slice = arg;
+	int i, j;
+	assert(slice == poolvec[worker]);
+	for (i = 0; i < POOLWORKERS; i++)
+		for (j = 0; j < POOLSLICE; j++)
+			assert(poolvec[i][j] == poolround);
+	for (j = 0; j < POOLSLICE; j++)
+		slice[j]++;
+}
+
+void
+poolcheck()
+{
+	int i, j;
+	tpool_create(&pool, 128, POOLWORKERS);
+	for (poolround = 0; poolround < 10; poolround++) {
+		for (i = 0; i < POOLWORKERS; i++)
+			tpool_run(&pool, i, poolwork, poolvec[i]);
+		tpool_barrier(&pool);
+		for (i = 0; i < POOLWORKERS; i++)
+			for (j = 0; j < POOLSLICE; j++)
+				assert(poolvec[i][j] == poolround + 1);
+	}
+
+	// Idle workers stay parked while others run
+	tpool_run(&pool, 2, poolwork, poolvec[2]);
+	tpool_barrier(&pool);
+	assert(poolvec[2][0] == poolround + 1 && poolvec[1][0] == poolround);
+	tpool_destroy(&pool);
+
+	cprintf("poolcheck passed\n");
+}
+
+// Threads that step together through barriers,
+// each seeing all the others' last writes after every barrier.
+#define BARTHREADS	4
+static int barvec[BARTHREADS];
+
+void
+barriercheck()
+{
+	int i, j, r;
+	for (i = 0; i < BARTHREADS; i++)
+		if (!tfork(140 + i)) {
+			for (r = 0; r < 5; r++) {
+				barvec[i] = r * 10 + i;
+				tbarrier();
+				for (j = 0; j < BARTHREADS; j++)
+					assert(barvec[j] == r * 10 + j);
+			}
+			sys_ret();
+		}
+	tjoinall(140, BARTHREADS);
+	for (i = 0; i < BARTHREADS; i++)
+		assert(barvec[i] == 40 + i);
+
+	cprintf("barriercheck passed\n");
+}
+
+// Loop bodies for parcheck()
+#define PARLEN	10000
+static int parvec[PARLEN];
+
+static void
+parfill(int lo, int hi, void *arg)
+{
+	int i;
+	for (i = lo; i < hi; i++)
+		parvec[i] = i * 3 % 1001;
+}
+
+static int64_t
+parsum(int lo, int hi, void *arg)
+{
+	int64_t sum = 0;
+	int i;
+	for (i = lo; i < hi; i++)
+		sum += parvec[i];
+	return sum;
+}
+
+static int64_t
+parmax(int lo, int hi, void *arg)
+{
+	int i, max = parvec[lo];
+	for (i = lo; i < hi; i++)
+		max = MAX(max, parvec[i]);
+	return max;
+}
+
+static void
+parnested(int lo, int hi, void *arg)
+{
+	// Loops inside a loop body run serially in that body's thread
+	assert(parallel_reduce_int(lo, hi, 1, PAR_SUM, parsum, NULL)
+		== parsum(lo, hi, NULL));
+}
+
+void
+parcheck()
+{
+	int i;
+	int64_t sum = 0;
+	parallel_for(0, PARLEN, 100, parfill, NULL);
+	for (i = 0; i < PARLEN; i++) {
+		assert(parvec[i] == i * 3 % 1001);
+		sum += parvec[i];
+	}
+	assert(parallel_reduce_int(0, PARLEN, 100, PAR_SUM, parsum, NULL)
+		== sum);
+	assert(parallel_reduce_int(0, PARLEN, 100, PAR_MAX, parmax, NULL)
+		== 1000);
+	assert(parallel_reduce_int(5, 6, 100, PAR_SUM, parsum, NULL)
+		== 15);
+	parallel_for(0, PARLEN, 1, parnested, NULL);
+
+	cprintf("parcheck passed\n");
+}
+
+#define MALTHREADS	4
+#define MALBLOCKS	100
+static char *malblock[MALTHREADS][MALBLOCKS];
+
+void
+malloccheck()
+{
+	// Basic allocation, reuse, and the calloc()/realloc() variants
+	char *p = malloc(100);
+	assert(p != NULL);
+	memset(p, 'a', 100);
+	free(p);
+	char *q = malloc(100);
+	assert(q == p);			// reused off the free list
+	free(q);
+	int *z = calloc(1000, sizeof(int));
+	int i, j;
+	for (i = 0; i < 1000; i++)
+		assert(z[i] == 0);
+	for (i = 0; i < 1000; i++)
+		z[i] = i;
+	z = realloc(z, 1000000 * sizeof(int));	// too big for a size class
+	for (i = 0; i < 1000; i++)
+		assert(z[i] == i);
+	free(z);
+	assert(malloc(0x40000000) == NULL && errno == ENOMEM);
+
+	// Threads allocating at once must not clobber each other's blocks
+	for (i = 0; i < MALTHREADS; i++)
+		if (!tfork(150 + i)) {
+			for (j = 0; j < MALBLOCKS; j++) {
+				malblock[i][j] = malloc(j * 37 + 1);
+				memset(malblock[i][j], i * MALBLOCKS + j,
+					j * 37 + 1);
+				if (j % 3 == 0) {	// free an earlier one
+					free(malblock[i][j/2]);
+					malblock[i][j/2] = NULL;
+				}
+			}
+			sys_ret();
+		}
+	for (i = 0; i < MALTHREADS; i++)
+		tjoin(150 + i);
+	for (i = 0; i < MALTHREADS; i++)
+		for (j = 0; j < MALBLOCKS; j++) {
+			char *b = malblock[i][j];
+			if (b == NULL)
+				continue;
+			int k;
+			for (k = 0; k < j * 37 + 1; k++)
+				assert(b[k] == (char)(i * MALBLOCKS + j));
+			free(b);
+		}
+
+	cprintf("malloccheck passed\n");
+}
+
+void
+arenacheck()
+{
+	arena *a = arena_new();
+	assert(a != NULL);
+	char *first = arena_alloc(a, 1);
+	int i, j;
+	for (i = 0; i < 1000; i++) {
+		int *p = arena_alloc(a, (i % 17 + 1) * sizeof(int));
+		assert(p != NULL && ((uintptr_t)p & 7) == 0);
+		for (j = 0; j < i % 17 + 1; j++) {
+			assert(p[j] == 0);	// fresh memory starts zeroed
+			p[j] = i;
+		}
+	}
+	char *big = arena_alloc(a, 1000000);
+	assert(big != NULL);
+	memset(big, 0xff, 1000000);
+
+	// Resetting frees everything, leaving us the same space zeroed again
+	arena_reset(a);
+	char *again = arena_alloc(a, 1000000);
+	assert(again == first);
+	for (i = 0; i < 1000000; i++)
+		assert(again[i] == 0);
+	assert(arena_alloc(a, (VM_ARENAHI - VM_ARENALO) / ARENA_MAX) == NULL
+		&& errno == ENOMEM);
+
+	// There are only so many arenas, but destroyed ones get reused
+	arena *as[ARENA_MAX];
+	as[0] = a;
+	for (i = 1; i < ARENA_MAX; i++)
+		assert((as[i] = arena_new()) != NULL);
+	assert(arena_new() == NULL && errno == ENOMEM);
+	for (i = 0; i < ARENA_MAX; i++)
+		arena_destroy(as[i]);
+	a = arena_new();
+	assert(a != NULL && arena_alloc(a, 1) == first);
+	arena_destroy(a);
+
+	cprintf("arenacheck passed\n");
+}
+
 int
 main()
 {
@@ -431,13 +1204,27 @@ main()
 	readwritecheck();
 	seekcheck();
 	readdircheck();
+	dirindexcheck();
 
 	consoutcheck();
 	consincheck();
+	statscheck();
+	consreadercheck();
 
 	execcheck();
 
 	reconcilecheck();
+	bigfilecheck();
+	manyfilecheck();
+	mmapcheck();
+	stdiobufcheck();
+	sparsecheck();
+	pipecheck();
+	poolcheck();
+	barriercheck();
+	parcheck();
+	malloccheck();
+	arenacheck();
 
 	cprintf("testfs: all tests completed; starting shell...\n");
 	execl("sh", "sh", NULL);
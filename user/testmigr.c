@@ -9,7 +9,11 @@
  */
 
 #include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/assert.h>
 #include <inc/syscall.h>
+#include <inc/mmu.h>
+#include <inc/vm.h>
 
 void migrate(int node, int time)
 {
@@ -18,6 +22,100 @@ void migrate(int node, int time)
 	cprintf("testmigr (%d): now on node %d.\n", time, node);
 }
 
+// Fetch the registers of an unused child on another node,
+// which that node can do for us without our migrating there.
+void remoteget(int node)
+{
+	procstate ps;
+	memset(&ps, 0xff, sizeof(ps));
+	sys_get(SYS_REGS, (node << 8) | 17, &ps, NULL, NULL, 0);
+	assert(ps.tf.eip == 0 && ps.pff == 0);
+
+	// Just the status view comes back with SYS_STATUS.
+	memset(&ps, 0xff, sizeof(ps));
+	sys_get(SYS_STATUS, (node << 8) | 17, &ps, NULL, NULL, 0);
+	assert(ps.tf.eip == 0 && ps.pff == 0xffffffff);
+	cprintf("testmigr: remote get from node %d ok\n", node);
+}
+
+// CPU-bound children that let the kernel move them to balance load,
+// which should get the same answers wherever they end up running.
+#define NSPIN		4
+#define SPINITERS	(1 << 24)
+static uint32_t spinout[NSPIN];
+static char gcc_aligned(16) spinstack[NSPIN][PAGESIZE];
+
+uint32_t spinhash(uint32_t x)
+{
+	int i;
+	for (i = 0; i < SPINITERS; i++)
+		x = x * 1103515245 + 12345;
+	return x;
+}
+
+void spin(int n)
+{
+	spinout[n] = spinhash(n);
+	sys_ret();
+}
+
+void balance(void)
+{
+	int i;
+	for (i = 0; i < NSPIN; i++) {
+		procstate ps;
+		memset(&ps, 0, sizeof(ps));
+		uint32_t *esp = (uint32_t*) &spinstack[i][PAGESIZE];
+		*--esp = i;	// argument to spin()
+		*--esp = 0;	// fake return address
+		ps.tf.eip = (uint32_t) spin;
+		ps.tf.esp = (uint32_t) esp;
+		ps.pff = PFF_BALANCE;
+		sys_put(SYS_REGS | SYS_COPY | SYS_SNAP | SYS_START, i, &ps,
+			(void*) VM_USERLO, (void*) VM_USERLO,
+			VM_USERHI - VM_USERLO);
+	}
+	for (i = 0; i < NSPIN; i++) {
+		procstate ps;
+		sys_get(SYS_MERGE | SYS_REGS, i, &ps, (void*) VM_USERLO,
+			(void*) VM_USERLO, VM_USERHI - VM_USERLO);
+		assert(ps.tf.trapno == T_SYSCALL);
+		assert(spinout[i] == spinhash(i));
+	}
+	cprintf("testmigr: balanced children ok\n");
+}
+
+// Checkpoint a child to another node, throw it away,
+// and bring it back from the checkpoint to carry on where it was.
+static uint32_t gcc_aligned(PAGESIZE) ckptpage[PAGESIZE/4];
+
+void ckptloop(void)
+{
+	while (1) {
+		ckptpage[0]++;
+		sys_ret();
+	}
+}
+
+void ckpt(int node)
+{
+	procstate ps;
+	memset(&ps, 0, sizeof(ps));
+	ps.tf.eip = (uint32_t) ckptloop;
+	ps.tf.esp = (uint32_t) &spinstack[0][PAGESIZE];
+	sys_put(SYS_REGS | SYS_COPY | SYS_START, 20, &ps,
+		(void*) VM_USERLO, (void*) VM_USERLO, VM_USERHI - VM_USERLO);
+	assert(sys_ckpt(0, node, 20, 0x1234) == 0);
+	sys_put(SYS_FREE, 20, NULL, NULL, NULL, 0);
+	assert(sys_ckpt(SYS_RESTORE, node, 20, 0x4321) == SYS_NOCKPT);
+	assert(sys_ckpt(SYS_RESTORE, node, 20, 0x1234) == 0);
+	sys_put(SYS_START, 20, NULL, NULL, NULL, 0);
+	sys_get(SYS_COPY, 20, NULL, ckptpage, ckptpage, PAGESIZE);
+	assert(ckptpage[0] == 2);
+	sys_put(SYS_FREE, 20, NULL, NULL, NULL, 0);
+	cprintf("testmigr: checkpoint to node %d and restore ok\n", node);
+}
+
 int
 main()
 {
@@ -27,6 +125,16 @@ main()
 	migrate(1, 2);
 	migrate(2, 2);
 
+	// Remote GET without migrating
+	migrate(1, 3);
+	remoteget(2);
+
+	// Load-balancing migration of CPU-bound children
+	balance();
+
+	// Checkpoint and restore through another node
+	ckpt(2);
+
 	printf("testmigr done\n");
 	return 0;
 }
@@ -14,6 +14,7 @@
 #include <inc/x86.h>
 #include <inc/mmu.h>
 #include <inc/vm.h>
+#include <inc/kdata.h>
 
 
 #define STACKSIZE	PAGESIZE
@@ -26,13 +27,15 @@ extern uint8_t start[], etext[], edata[], end[];
 uint8_t stack[2][STACKSIZE];
 
 
-// Fork a child process, returning 0 in the child and 1 in the parent.
+// Fork a child process with flags pff (PFF_NONDET or 0),
+// returning 0 in the child and 1 in the parent.
 int
-fork(int cmd, uint8_t child)
+forkpff(int cmd, uint8_t child, uint32_t pff)
 {
 	// Set up the register state for the child
 	struct procstate ps;
 	memset(&ps, 0, sizeof(ps));
+	ps.pff = pff;
 
 	// Use some assembly magic to propagate registers to child
 	// and generate an appropriate starting eip
@@ -63,6 +66,13 @@ fork(int cmd, uint8_t child)
 	return 1;
 }
 
+// Fork a deterministic child process, as forkpff() does.
+int
+fork(int cmd, uint8_t child)
+{
+	return forkpff(cmd, child, 0);
+}
+
 void
 join(int cmd, uint8_t child, int trapexpect)
 {
@@ -70,7 +80,7 @@ join(int cmd, uint8_t child, int trapexpect)
 	// If merging, leave the highest 4MB containing the stack unmerged,
 	// so that the stack acts as a "thread-private" memory area.
 	struct procstate ps;
-	sys_get(cmd | SYS_REGS, child, &ps, ALLVA, ALLVA, ALLSIZE-PTSIZE);
+	sys_get(cmd | SYS_STATUS, child, &ps, ALLVA, ALLVA, ALLSIZE-PTSIZE);
 
 	// Make sure the child exited with the expected trap number
 	if (ps.tf.trapno != trapexpect) {
@@ -132,6 +142,11 @@ static void cputsfaultchild(int arg) {
 		{ sys_cputs((char*)(va)); sys_ret(); } \
 	join(0, 0, T_PGFLT);
 
+#define cwritefaulttest(va) \
+	if (!fork(SYS_START, 0)) \
+		{ sys_cwrite((char*)(va), 8); sys_ret(); } \
+	join(0, 0, T_PGFLT);
+
 #define putfaulttest(va) \
 	if (!fork(SYS_START, 0)) { \
 		sys_put(SYS_REGS, 0, (procstate*)(va), NULL, NULL, 0); \
@@ -191,6 +206,24 @@ forkcheck()
 	join(0, 5, T_ILLOP);
 	join(0, 6, T_GPFLT);
 
+	// Poll a busy child until it's done: it may be done already,
+	// if it got a CPU of its own, but then the first poll says so.
+	if (!fork(SYS_START, 0)) {
+		volatile int i;
+		for (i = 0; i < 10000000; i++)
+			;
+		gentrap(T_SYSCALL);
+	}
+	struct procstate ps;
+	while (sys_poll(SYS_REGS, 0, &ps, NULL, NULL, 0) == SYS_RUNNING)
+		;
+	assert(ps.tf.trapno == T_SYSCALL);
+	assert(sys_poll(0, 0, NULL, NULL, NULL, 0) == 0);	// still done
+
+	// Polling depends on timing, so a deterministic child can't.
+	if (!fork(SYS_START, 0)) { sys_poll(0, 1, NULL, NULL, NULL, 0); sys_ret(); }
+	join(0, 0, T_GPFLT);
+
 	// Check that kernel address space is inaccessible to user code
 	readfaulttest(0);
 	readfaulttest(VM_USERLO-4);
@@ -210,6 +243,10 @@ protcheck()
 	cputsfaulttest(VM_USERLO-1);
 	cputsfaulttest(VM_USERHI);
 	cputsfaulttest(~0);
+	cwritefaulttest(0);
+	cwritefaulttest(VM_USERLO-1);
+	cwritefaulttest(VM_USERHI-4);
+	cwritefaulttest(~0);
 	putfaulttest(0);
 	putfaulttest(VM_USERLO-1);
 	putfaulttest(VM_USERHI);
@@ -232,6 +269,8 @@ warn("here");
 warn("here");
 	cputsfaulttest(VM_USERHI-PTSIZE*2);
 warn("here");
+	cwritefaulttest(VM_USERLO+PTSIZE);
+	cwritefaulttest(VM_USERHI-PTSIZE);
 	putfaulttest(VM_USERLO+PTSIZE);
 warn("here");
 	putfaulttest(VM_USERHI-PTSIZE);
@@ -327,6 +366,24 @@ memopcheck(void)
 	sys_get(SYS_PERM|SYS_READ, 0, NULL, NULL, dva2+ofs, PAGESIZE);
 	assert(*(volatile int*)(dva2+ofs) == 0xdeadbeef);	// survived?
 
+	// Test page-granular SYS_COPY, straddling a page table boundary
+	sva = (void*)VM_USERLO+PTSIZE-PAGESIZE;
+	dva = (void*)VM_USERLO+PTSIZE*3+PAGESIZE*5;
+	sys_get(SYS_PERM|SYS_READ|SYS_WRITE, 0, NULL, NULL, sva, PAGESIZE*2);
+	*(volatile int*)sva = 0x12345678;
+	*(volatile int*)(sva+PAGESIZE) = 0x87654321;
+	sys_put(SYS_COPY, 0, NULL, sva, dva, PAGESIZE*2);
+	sys_get(SYS_COPY, 0, NULL, dva, dva+PAGESIZE, PAGESIZE*2);
+	assert(*(volatile int*)(dva+PAGESIZE) == 0x12345678);
+	assert(*(volatile int*)(dva+PAGESIZE*2) == 0x87654321);
+	readfaulttest(dva);			// neighbors untouched
+	readfaulttest(dva+PAGESIZE*3);
+	*(volatile int*)(dva+PAGESIZE) = 0xdeadbeef;	// copy on write
+	assert(*(volatile int*)sva == 0x12345678);
+	sys_get(SYS_ZERO, 0, NULL, NULL, dva+PAGESIZE, PAGESIZE*2);
+	readfaulttest(dva+PAGESIZE);
+	sys_get(SYS_ZERO, 0, NULL, NULL, sva, PAGESIZE*2);
+
 	cprintf("testvm: memopcheck passed\n");
 }
 
@@ -455,6 +512,33 @@ matmult(int a[8][8], int b[8][8], int r[8][8])
 		}
 }
 
+// Per-word accumulators, merged with operators instead of conflicting
+uint32_t mergeacc[2][PAGESIZE/4] gcc_aligned(PAGESIZE);
+
+void
+mergeopcheck()
+{
+	int i;
+	sys_mergeop(mergeacc[0], PAGESIZE, MERGEOP_ADD);
+	sys_mergeop(mergeacc[1], PAGESIZE, MERGEOP_MAX);
+	for (i = 0; i < 4; i++)
+		if (!fork(SYS_START | SYS_SNAP, i)) {
+			mergeacc[0][0] += i + 1;	// count
+			mergeacc[0][i+1]++;		// histogram
+			mergeacc[1][0] = 10 - (i - 2) * (i - 2);
+			sys_ret();
+		}
+	for (i = 0; i < 4; i++)
+		join(SYS_MERGE, i, T_SYSCALL);
+	assert(mergeacc[0][0] == 1+2+3+4);
+	for (i = 0; i < 4; i++)
+		assert(mergeacc[0][i+1] == 1);
+	assert(mergeacc[1][0] == 10);
+
+	// Go back to treating such writes as conflicts
+	sys_mergeop(mergeacc, sizeof(mergeacc), MERGEOP_NONE);
+}
+
 void
 mergecheck()
 {
@@ -485,9 +569,346 @@ mergecheck()
 	assert(sizeof(mc) == sizeof(int)*8*8);
 	assert(memcmp(mr, mc, sizeof(mr)) == 0);
 
+	// Parallel counting and histogramming with merge operators
+	mergeopcheck();
+
 	cprintf("testvm: mergecheck passed\n");
 }
 
+void
+clockcheck()
+{
+	// The clock runs forward, at least for us: we have PFF_NONDET.
+	uint64_t t0 = sys_clock();
+	volatile int i;
+	for (i = 0; i < 1000000; i++)
+		;
+	uint64_t t1 = sys_clock();
+	assert(t1 > t0);
+
+	// But a deterministic child can't read it.
+	if (!fork(SYS_START, 0)) { sys_clock(); sys_ret(); }
+	join(0, 0, T_GPFLT);
+
+	// The kernel data page gives us the same clock without a system call,
+	// and our accounting up to now, including the system calls just made.
+	uint64_t t2 = kdata_clock();
+	assert(t2 >= t1 && sys_clock() >= t2);
+	assert(KDATA->ncpu == sys_ncpu());
+	procacct a0, a1;
+	assert(kdata_acct(&a0) < sys_ncpu());
+	sys_ncpu();
+	kdata_acct(&a1);
+	assert(a1.syscalls == a0.syscalls + 1);
+	assert(a1.tsc > a0.tsc);
+
+	// A deterministic child can't see the page at all.
+	if (!fork(SYS_START, 0)) { (void)KDATA->seq; sys_ret(); }
+	join(0, 0, T_PGFLT);
+
+	cprintf("testvm: clockcheck passed\n");
+}
+
+void
+profcheck()
+{
+	// Profile a busy loop of our own, long enough to take some samples.
+	sys_prof(PROF_START, 0);
+	uint64_t t0 = sys_clock();
+	while (sys_clock() - t0 < 100000000)	// 100ms
+		;
+	sys_prof(PROF_REPORT, 5);
+
+	// Only the root process may use the profiler.
+	if (!fork(SYS_START, 0)) { sys_prof(PROF_STOP, 0); sys_ret(); }
+	join(0, 0, T_GPFLT);
+
+	cprintf("testvm: profcheck passed\n");
+}
+
+void
+tracecheck()
+{
+	// Empty every CPU's trace, then trace a few system calls of ours.
+	static tracerec recs[64];
+	int ncpu = sys_ncpu(), i, j, n, found = 0;
+	for (i = 0; i < ncpu; i++)
+		while (sys_trace(TRACE_READ, (uint32_t)recs, 64, i) == 64)
+			;
+	assert(sys_trace(TRACE_ENABLE, 1 << TRACE_SYSCALL, 0, 0) == 0);
+	for (i = 0; i < 3; i++)
+		sys_ncpu();
+	assert(sys_trace(TRACE_ENABLE, 0, 0, 0) == 1 << TRACE_SYSCALL);
+
+	// We may have moved between CPUs, so look in all their traces.
+	for (i = 0; i < ncpu; i++)
+		while ((n = sys_trace(TRACE_READ, (uint32_t)recs, 64, i)) > 0)
+			for (j = 0; j < n; j++) {
+				assert(recs[j].event == TRACE_SYSCALL);
+				if (recs[j].arg[0] == SYS_NCPU)
+					found++;
+			}
+	assert(found >= 3);
+
+	// A deterministic child can't see the trace.
+	if (!fork(SYS_START, 0)) { sys_trace(TRACE_ENABLE, 0, 0, 0); sys_ret(); }
+	join(0, 0, T_GPFLT);
+
+	cprintf("testvm: tracecheck passed\n");
+}
+
+void
+acctcheck()
+{
+	static uint8_t pages[2][PAGESIZE] gcc_aligned(PAGESIZE);
+	static uint8_t fresh[PAGESIZE] gcc_aligned(PAGESIZE);
+	procacct a;
+	int i;
+
+	// A child that writes shared and fresh pages, and whose own child
+	// makes a hundred system calls, gets charged for all of it,
+	// and for the pages we merge back from it.
+	pages[0][0] = pages[1][0] = 1;
+	if (!fork(SYS_START | SYS_SNAP, 0)) {
+		pages[0][1] = 2;	// copy-on-write fault
+		fresh[0] = 1;		// zero-fill fault
+		pages[1][0] = 3;	// conflicts with our write below
+		if (!fork(SYS_START, 1)) {
+			for (i = 0; i < 100; i++)
+				sys_ncpu();
+			sys_ret();
+		}
+		join(0, 1, T_SYSCALL);
+		sys_ret();
+	}
+	pages[1][0] = 4;
+	join(SYS_MERGE, 0, T_SYSCALL);
+	assert(pages[0][1] == 2 && fresh[0] == 1);	// merged back to us
+	sys_get(SYS_ACCT, 0, (procstate*)&a, NULL, NULL, 0);
+	assert(a.tsc > 0);
+	assert(a.syscalls >= 100);
+	assert(a.cowfaults >= 1 && a.zerofaults >= 1);
+	assert(a.merged >= 2 && a.conflicts == 1);
+	assert(a.pulls == 0 && a.migrations == 0);
+
+	cprintf("testvm: acctcheck passed\n");
+}
+
+void
+freecheck()
+{
+	// Discarding a child lets us reuse its number for a fresh process,
+	// over and over, along with any children it left stopped.
+	int i;
+	for (i = 0; i < 100; i++) {
+		if (!fork(SYS_START, 0)) {
+			if (!fork(SYS_START, 1))
+				sys_ret();
+			join(0, 1, T_SYSCALL);
+			sys_ret();
+		}
+		join(0, 0, T_SYSCALL);
+		sys_put(SYS_FREE, 0, NULL, NULL, NULL, 0);
+	}
+	procstate ps;
+	sys_get(SYS_REGS, 0, &ps, NULL, NULL, 0);
+	assert(ps.tf.eip == 0);		// a brand new child
+
+	cprintf("testvm: freecheck passed\n");
+}
+
+static uint8_t advbuf[64][PAGESIZE] gcc_aligned(PAGESIZE);
+
+// Have a fresh child write the first byte of every stride'th page
+// of advbuf, after advising hint about it if nonzero,
+// and return the copy-on-write and zero-fill faults that took.
+static int
+advfaults(int hint, int stride)
+{
+	int i;
+	if (!fork(SYS_START, 0)) {
+		if (hint)
+			sys_advise(advbuf, sizeof(advbuf), hint);
+		for (i = 0; i < 64; i += stride)
+			advbuf[i][0] = 1;
+		sys_ret();
+	}
+	join(0, 0, T_SYSCALL);
+	procacct a;
+	sys_get(SYS_ACCT, 0, (procstate*)&a, NULL, NULL, 0);
+	sys_put(SYS_FREE, 0, NULL, NULL, NULL, 0);
+	return a.cowfaults + a.zerofaults;
+}
+
+void
+advisecheck()
+{
+	// SYS_DONTNEED leaves fresh zero pages, still readable and writable.
+	advbuf[0][0] = advbuf[5][8] = 0xde;
+	sys_advise(advbuf, sizeof(advbuf), SYS_DONTNEED);
+	assert(advbuf[0][0] == 0 && advbuf[5][8] == 0);
+	advbuf[5][8] = 0xad;
+	assert(advbuf[5][8] == 0xad);
+
+	// SYS_WILLNEED takes the faults up front, and SYS_SEQUENTIAL
+	// resolves pages ahead even for writes that skip some.
+	assert(advfaults(0, 2) >= 32);
+	assert(advfaults(SYS_WILLNEED, 2) < 16);
+	assert(advfaults(SYS_SEQUENTIAL, 2) < 16);
+
+	// A PUT can give back a stopped child's pages too.
+	if (!fork(SYS_START, 0)) {
+		advbuf[0][0] = 7;
+		sys_ret();
+	}
+	join(0, 0, T_SYSCALL);
+	sys_put(SYS_DONTNEED, 0, NULL, NULL, advbuf, PAGESIZE);
+	advbuf[0][0] = 9;
+	sys_get(SYS_COPY, 0, NULL, advbuf, advbuf, PAGESIZE);
+	assert(advbuf[0][0] == 0);
+	advbuf[0][0] = 1;		// still writable here
+	sys_put(SYS_FREE, 0, NULL, NULL, NULL, 0);
+
+	cprintf("testvm: advisecheck passed\n");
+}
+
+static volatile uint32_t shbuf[PAGESIZE/4] gcc_aligned(PAGESIZE);
+
+void
+sharecheck()
+{
+	// Pages shared outright with a nondeterministic child 0
+	// stay shared, so the child sees our writes while it runs,
+	// and we see its.  Only nondeterministic processes may share,
+	// on both ends, so it has to be one before we share with it.
+	if (!forkpff(0, 0, PFF_NONDET)) {
+		while (shbuf[0] != 1)
+			pause();
+		shbuf[1] = 2;
+		sys_ret();
+	}
+	sys_put(SYS_COPY | SYS_SHARE | SYS_START, 0, NULL, (void*)shbuf,
+		(void*)shbuf, PAGESIZE);
+	shbuf[0] = 1;
+	while (shbuf[1] != 2)
+		pause();
+	join(0, 0, T_SYSCALL);
+	assert(shbuf[0] == 1 && shbuf[1] == 2);
+
+	// A copy into another nondeterministic child shares them too,
+	// and merges leave them alone, even where both sides wrote.
+	if (!forkpff(SYS_START | SYS_SNAP, 0, PFF_NONDET)) {
+		shbuf[2] = 3;
+		sys_ret();
+	}
+	while (shbuf[2] != 3)
+		pause();
+	shbuf[2] = 4;
+	join(SYS_MERGE, 0, T_SYSCALL);
+	assert(shbuf[2] == 4);
+
+	// A deterministic child gets a private copy instead,
+	// so its writes stay its own.
+	if (!fork(SYS_START, 0)) {
+		shbuf[3] = 5;
+		sys_ret();
+	}
+	join(0, 0, T_SYSCALL);
+	assert(shbuf[3] != 5);
+
+	// And it may not share, which fork()'s children aren't.
+	if (!fork(SYS_START, 0)) {
+		sys_put(SYS_COPY | SYS_SHARE, 0, NULL, (void*)shbuf,
+			(void*)shbuf, PAGESIZE);
+		sys_ret();
+	}
+	join(0, 0, T_GPFLT);
+	sys_put(SYS_FREE, 0, NULL, NULL, NULL, 0);
+
+	cprintf("testvm: sharecheck passed\n");
+}
+
+double fpuresult[4];
+
+// Add x up n times: long enough to be preempted many times over,
+// and exact, so any FPU state lost on a context switch shows.
+static double
+fpusum(double x, int n)
+{
+	double sum = 0;
+	int i;
+	for (i = 0; i < n; i++)
+		sum += x;
+	return sum;
+}
+
+void
+fpucheck()
+{
+	// Children doing floating point at the same time
+	// must each keep their own FPU registers.
+	int i;
+	for (i = 0; i < 4; i++)
+		if (!fork(SYS_START | SYS_SNAP, i)) {
+			fpuresult[i] = fpusum(i + 1, 1000000);
+			sys_ret();
+		}
+	for (i = 0; i < 4; i++) {
+		join(SYS_MERGE, i, T_SYSCALL);
+		assert(fpuresult[i] == (i + 1) * 1000000.0);
+	}
+
+	// A GET with SYS_FPU returns the FPU state a child left,
+	// and a PUT with just SYS_FPU gives it to another child,
+	// leaving the registers that child got from fork() alone.
+	if (!fork(SYS_START, 0)) {
+		asm volatile("fld1; fldpi");	// leave pi on top of the stack
+		sys_ret();
+	}
+	procstate ps, ps2;
+	sys_get(SYS_REGS | SYS_FPU, 0, &ps, NULL, NULL, 0);
+	assert(ps.pff & PFF_USEFPU);
+	if (!fork(SYS_SNAP, 1)) {
+		double d;
+		asm volatile("fstpl %0" : "=m" (d));	// pop the pi we got
+		fpuresult[0] = d;
+		sys_ret();
+	}
+	sys_put(SYS_FPU | SYS_START, 1, &ps, NULL, NULL, 0);
+
+	// A GET with SYS_STATUS fills in the status view and nothing else.
+	memset(&ps2, 0xaa, sizeof(ps2));
+	sys_get(SYS_STATUS, 1, &ps2, NULL, NULL, 0);
+	assert(ps2.tf.trapno == T_SYSCALL && ps2.tf.err == 0);
+	assert(ps2.tf.eip != 0xaaaaaaaa && ps2.tf.esp != 0xaaaaaaaa);
+	assert(ps2.tf.regs.eax == 0xaaaaaaaa && ps2.tf.ss == 0xaaaa);
+	assert(ps2.pff == 0xaaaaaaaa && ps2.fx.fcw == 0xaaaa);
+
+	// With SYS_FPU too, the status view still comes along.
+	memset(&ps2, 0xaa, sizeof(ps2));
+	sys_get(SYS_STATUS | SYS_FPU, 1, &ps2, NULL, NULL, 0);
+	assert(ps2.tf.trapno == T_SYSCALL && ps2.tf.regs.eax == 0xaaaaaaaa);
+	assert(ps2.fx.fcw != 0xaaaa);
+	join(SYS_MERGE, 1, T_SYSCALL);
+
+	// But there's no status to PUT, nor room for it beside SYS_ACCT.
+	if (!fork(SYS_START, 0)) {
+		sys_put(SYS_STATUS, 1, &ps2, NULL, NULL, 0);
+		sys_ret();
+	}
+	join(0, 0, T_GPFLT);
+	if (!fork(SYS_START, 0)) {
+		sys_get(SYS_ACCT | SYS_REGS, 1, &ps2, NULL, NULL, 0);
+		sys_ret();
+	}
+	join(0, 0, T_GPFLT);
+	double pi;
+	asm volatile("fldpi; fstpl %0" : "=m" (pi));
+	assert(fpuresult[0] == pi);
+
+	cprintf("testvm: fpucheck passed\n");
+}
+
 int
 main()
 {
@@ -498,6 +919,14 @@ main()
 	protcheck();
 	memopcheck();
 	mergecheck();
+	clockcheck();
+	profcheck();
+	tracecheck();
+	acctcheck();
+	freecheck();
+	advisecheck();
+	sharecheck();
+	fpucheck();
 
 	cprintf("testvm: all tests completed successfully!\n");
 	return 0;
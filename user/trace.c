@@ -0,0 +1,121 @@
+/*
+ * Control the kernel's event trace, and dump it (see SYS_TRACE).
+ *
+ * Usage:	trace on [event ...]	- record those events, or all of them
+ *		trace off		- stop recording
+ *		trace dump		- print and empty the trace
+ *
+ * The dump merges all CPUs' events in time order, one per line:
+ *
+ *	<tsc> <cpu> <event> <arg0> <arg1> <arg2>
+ *
+ * with the TSC relative to the first event and the arguments in hex
+ * (see inc/syscall.h for what they mean).
+ *
+ * See section "MIT License" in the file LICENSES for licensing terms.
+ */
+
+#include <inc/stdio.h>
+#include <inc/stdlib.h>
+#include <inc/string.h>
+#include <inc/syscall.h>
+
+#define CHUNK		256		// Records read per system call
+
+static const char *names[TRACE_NEVENTS] = {
+	"syscall", "trap", "switch", "pgflt",
+	"merge", "nettx", "netrx", "retx",
+};
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: trace on [event ...] | off | dump\n");
+	fprintf(stderr, "events: syscall trap switch pgflt merge"
+		" nettx netrx retx\n");
+	exit(1);
+}
+
+// Read all of CPU i's trace into a new array, returning its length.
+static int
+readcpu(int i, tracerec **recs)
+{
+	int n = 0, got;
+	*recs = NULL;
+	do {
+		*recs = realloc(*recs, (n + CHUNK) * sizeof(tracerec));
+		if (*recs == NULL) {
+			fprintf(stderr, "trace: out of memory\n");
+			exit(1);
+		}
+		got = sys_trace(TRACE_READ, (uint32_t)(*recs + n), CHUNK, i);
+		n += got;
+	} while (got == CHUNK);
+	return n;
+}
+
+static void
+dump(void)
+{
+	// Stop tracing while we read, so our reading isn't in it.
+	uint32_t mask = sys_trace(TRACE_ENABLE, 0, 0, 0);
+
+	int ncpu = sys_ncpu(), i;
+	tracerec *recs[ncpu];
+	int n[ncpu], next[ncpu];
+	for (i = 0; i < ncpu; i++) {
+		n[i] = readcpu(i, &recs[i]);
+		next[i] = 0;
+	}
+
+	// Each CPU's events are in order: merge them.
+	uint64_t t0 = 0;
+	while (1) {
+		int min = -1;
+		for (i = 0; i < ncpu; i++)
+			if (next[i] < n[i] && (min < 0 || recs[i][next[i]].tsc
+					< recs[min][next[min]].tsc))
+				min = i;
+		if (min < 0)
+			break;
+		tracerec *r = &recs[min][next[min]++];
+		if (t0 == 0)
+			t0 = r->tsc;
+		printf("%llu %d %s %x %x %x\n", r->tsc - t0, r->cpu,
+			r->event < TRACE_NEVENTS ? names[r->event] : "?",
+			r->arg[0], r->arg[1], r->arg[2]);
+	}
+
+	for (i = 0; i < ncpu; i++)
+		free(recs[i]);
+	sys_trace(TRACE_ENABLE, mask, 0, 0);
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc < 2)
+		usage();
+
+	if (strcmp(argv[1], "on") == 0) {
+		uint32_t mask = 0;
+		int i, e;
+		for (i = 2; i < argc; i++) {
+			for (e = 0; e < TRACE_NEVENTS; e++)
+				if (strcmp(argv[i], names[e]) == 0)
+					break;
+			if (e == TRACE_NEVENTS)
+				usage();
+			mask |= 1 << e;
+		}
+		if (mask == 0)
+			mask = (1 << TRACE_NEVENTS) - 1;
+		sys_trace(TRACE_ENABLE, mask, 0, 0);
+	} else if (strcmp(argv[1], "off") == 0)
+		sys_trace(TRACE_ENABLE, 0, 0, 0);
+	else if (strcmp(argv[1], "dump") == 0)
+		dump();
+	else
+		usage();
+	return 0;
+}